@@ -5,8 +5,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "DiskImage.h"
+#include "offload.h"
 
 #define ERR_OPEN        "Error: can't open source file"
 #define ERR_GETLEN      "Error: can't get file length!"
@@ -77,6 +81,20 @@ class TDiskImage
 
 	TDiskImageType FType;
 
+	// offset + 1 of the first address mark of every sector ID on a track,
+	// built on the first lookup. Sector writes don't move the marks, only
+	// building the tracks anew does.
+	struct TSectorIndex
+	{
+		unsigned char *Track;
+		unsigned int TrackLength;
+		unsigned int ADMOffset[256];
+	};
+	TSectorIndex *FSectorIndex[256][2];
+
+	TSectorIndex *GetSectorIndex(unsigned char CYL, unsigned char SIDE);
+	void DropSectorIndex();
+
 	unsigned short MakeVGCRC(unsigned char *data, unsigned long length);
 public:
 	bool Changed;
@@ -822,6 +840,28 @@ long filelength(int hfile)
 	return ret;
 }
 
+//-----------------------------------------------------------------------------
+static unsigned short vgcrc_tab[256];
+
+static void vgcrc_init()
+{
+	for (unsigned int i = 0; i < 256; i++)
+	{
+		unsigned short CRC = i << 8;
+		for (unsigned int j = 0; j < 8; j++)
+		{
+			if (CRC & 0x8000) CRC = (CRC << 1) ^ 0x1021;
+			else CRC <<= 1;
+		}
+		vgcrc_tab[i] = CRC;
+	}
+}
+
+static unsigned short vgcrc_update(unsigned short CRC, const unsigned char *data, unsigned long length)
+{
+	for (unsigned long i = 0; i < length; i++) CRC = (CRC << 8) ^ vgcrc_tab[(CRC >> 8) ^ data[i]];
+	return CRC;
+}
 //----------------------------------------------------------------------------
 TDiskImage::TDiskImage()
 {
@@ -832,6 +872,8 @@ TDiskImage::TDiskImage()
 			FTracksPtr[t][s][0] = NULL;
 			FTracksPtr[t][s][1] = NULL;
 		}
+	memset(FSectorIndex, 0, sizeof(FSectorIndex));
+	vgcrc_init();
 
 	DiskPresent = false;
 	ReadOnly = true;
@@ -857,21 +899,55 @@ TDiskImage::~TDiskImage()
 			if (FTracksPtr[t][s][1]) delete FTracksPtr[t][s][1];
 			FTracksPtr[t][s][1] = NULL;
 		}
+	DropSectorIndex();
 }
 //-----------------------------------------------------------------------------
-unsigned short TDiskImage::MakeVGCRC(unsigned char *data, unsigned long length)
+void TDiskImage::DropSectorIndex()
 {
-	unsigned short CRC = 0xFFFF;
-	for (unsigned int i = 0; i < length; i++)
-	{
-		CRC ^= data[i] << 8;
-		for (unsigned int j = 0; j < 8; j++)
+	for (int t = 0; t < 256; t++)
+		for (int s = 0; s < 2; s++)
 		{
-			if (CRC & 0x8000) CRC = (CRC << 1) ^ 0x1021;
-			else CRC <<= 1;
+			delete FSectorIndex[t][s];
+			FSectorIndex[t][s] = NULL;
 		}
+}
+//-----------------------------------------------------------------------------
+TDiskImage::TSectorIndex *TDiskImage::GetSectorIndex(unsigned char CYL, unsigned char SIDE)
+{
+	if (SIDE > 1) return NULL;
+
+	TSectorIndex *idx = FSectorIndex[CYL][SIDE];
+	if (idx && idx->Track == FTracksPtr[CYL][SIDE][0] && idx->TrackLength == FTrackLength[CYL][SIDE]) return idx;
+
+	if (!idx) idx = FSectorIndex[CYL][SIDE] = new TSectorIndex;
+	idx->Track = FTracksPtr[CYL][SIDE][0];
+	idx->TrackLength = FTrackLength[CYL][SIDE];
+	memset(idx->ADMOffset, 0, sizeof(idx->ADMOffset));
+
+	// the walk of FindSector, from the start of the track and around once
+	VGFIND_ADM vgfa;
+	unsigned int TrackOffset = 0;
+	unsigned int FirstPos = 0;
+	for (unsigned int n = 0; n < idx->TrackLength; n++)
+	{
+		if (!FindADMark(CYL, SIDE, TrackOffset, &vgfa)) break;
+
+		unsigned char id = vgfa.TrackPointer[(vgfa.OffsetADM + 2) % vgfa.TrackLength];
+		if (!idx->ADMOffset[id]) idx->ADMOffset[id] = vgfa.MarkedOffsetADM + 1;
+
+		if (!n) FirstPos = vgfa.OffsetEndADM;
+		else if (vgfa.OffsetEndADM == FirstPos) break;
+
+		TrackOffset = vgfa.OffsetEndADM;
 	}
-	return CRC;          // H<-->L !!!
+
+	return idx;
+}
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+unsigned short TDiskImage::MakeVGCRC(unsigned char *data, unsigned long length)
+{
+	return vgcrc_update(0xFFFF, data, length);          // H<-->L !!!
 }
 //-----------------------------------------------------------------------------
 void TDiskImage::ApplySectorCRC(VGFIND_SECTOR vgfs)
@@ -889,26 +965,8 @@ void TDiskImage::ApplySectorCRC(VGFIND_SECTOR vgfs)
 	unsigned int len2 = 0;
 	if (len1 < len) len2 = len - len1;
 
-	unsigned int i;
-	unsigned short CRC = 0xFFFF;
-	for (i = 0; i < len1; i++)
-	{
-		CRC ^= TrackPtr[off1 + i] << 8;
-		for (unsigned int j = 0; j < 8; j++)
-		{
-			if (CRC & 0x8000) CRC = (CRC << 1) ^ 0x1021;
-			else CRC <<= 1;
-		}
-	}
-	for (i = 0; i < len2; i++)
-	{
-		CRC ^= TrackPtr[off2 + i] << 8;
-		for (unsigned int j = 0; j < 8; j++)
-		{
-			if (CRC & 0x8000) CRC = (CRC << 1) ^ 0x1021;
-			else CRC <<= 1;
-		}
-	}
+	unsigned short CRC = vgcrc_update(0xFFFF, TrackPtr + off1, len1);
+	CRC = vgcrc_update(CRC, TrackPtr + off2, len2);
 	unsigned int crcoff = (off1 + len1) % TrackLen;
 	if (len2) crcoff = (off2 + len2) % TrackLen;
 
@@ -1015,7 +1073,13 @@ bool TDiskImage::FindSector(unsigned char CYL, unsigned char SIDE,
 
 	// Поиск адресной метки требуемого сектора...
 	bool ADFOUND = false;
-	for (;;)
+	TSectorIndex *idx = FromOffset ? NULL : GetSectorIndex(CYL, SIDE);
+	if (idx)
+	{
+		if (!idx->ADMOffset[SECT]) return false;
+		ADFOUND = FindADMark(CYL, SIDE, idx->ADMOffset[SECT] - 1, &(vgfs->vgfa));
+	}
+	else for (;;)
 	{
 		if (!FindADMark(CYL, SIDE, TrackOffset, &(vgfs->vgfa)))
 			return false;          // ERROR: No ADMARK found on track
@@ -1147,6 +1211,7 @@ void TDiskImage::Open(const char *filename, bool ROnly)
 				if (FTracksPtr[t][s][1]) delete FTracksPtr[t][s][1];
 				FTracksPtr[t][s][1] = NULL;
 			}
+		DropSectorIndex();
 	}
 
 	if (typ == DIT_UNK)
@@ -1180,6 +1245,7 @@ void TDiskImage::formatTRDOS(unsigned int Tcount, unsigned int Scount)
 {
 	MaxTrack = Tcount - 1;
 	MaxSide = Scount - 1;
+	DropSectorIndex();
 
 	unsigned short TotalSecs = Tcount*Scount * 16 - 16;
 
@@ -2713,9 +2779,7 @@ void TDiskImage::ShowError(const char *str)
 // convert packed td0 to unpacked
 unsigned short TD0CRC(unsigned char *buf, unsigned int len);
 unsigned unpack_lzh(unsigned char *src, unsigned size, unsigned char *buf);
-unsigned char *td0_dst, *td0_src;
-
-void td0_move(unsigned size)
+static void td0_move(unsigned char *&td0_dst, unsigned char *&td0_src, unsigned size)
 {
 	memcpy(td0_dst, td0_src, size);
 	td0_dst += size;
@@ -2736,6 +2800,7 @@ bool unpack_td0(unsigned char *data, long &size)
 	unsigned char *snbuf = (unsigned char*)new char[size * 2 + 1500000];  // if compressed then UUUUFF ;-/
 	if (!snbuf) return false;
 
+	unsigned char *td0_dst, *td0_src;
 	memcpy(snbuf, data, size);
 	if (*(short*)snbuf == WORD2('t', 'd')) // packed disk
 	{
@@ -2748,7 +2813,7 @@ bool unpack_td0(unsigned char *data, long &size)
 	}
 
 	td0_src = snbuf, td0_dst = data;
-	td0_move(12);
+	td0_move(td0_dst, td0_src, 12);
 
 	if (snbuf[7] & 0x80)  // additional info...
 	{
@@ -2759,20 +2824,20 @@ bool unpack_td0(unsigned char *data, long &size)
 			delete snbuf;
 			return false;
 		}
-		td0_move(10);
-		td0_move(*((unsigned short*)(snbuf + 12 + 2)));
+		td0_move(td0_dst, td0_src, 10);
+		td0_move(td0_dst, td0_src, *((unsigned short*)(snbuf + 12 + 2)));
 	}
 
 	for (;;)
 	{
 		unsigned char s = *td0_src;
-		td0_move(4);
+		td0_move(td0_dst, td0_src, 4);
 		if (s == 0xFF) break;
 		for (; s; s--)
 		{
 			//         unsigned char *sec = td0_src;
 			unsigned size = 128; if (td0_src[3]) size <<= td0_src[3];
-			td0_move(6);
+			td0_move(td0_dst, td0_src, 6);
 			*(unsigned short*)td0_dst = size + 1; td0_dst += 2;
 			*td0_dst++ = 0;
 			unsigned char *dst = td0_dst;
@@ -2879,17 +2944,10 @@ unsigned short TD0CRC(unsigned char *buf, unsigned int len)
 }
 // ----------------------------------------------------------------------------
 
-unsigned char *packed_ptr, *packed_end;
-
-int readChar(void)
-{
-	if (packed_ptr < packed_end) return *packed_ptr++;
-	else return -1;
-}
-
 // ------------------------------------------------------ LZH unpacker
 
-unsigned char d_code[256] = {
+// upper 6 bits of a match position and its code length, by the first 8 bits
+static const unsigned char d_code[256] = {
 	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -2924,7 +2982,7 @@ unsigned char d_code[256] = {
 	0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
 };
 
-unsigned char d_len[256] = {
+static const unsigned char d_len[256] = {
 	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
 	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
 	0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
@@ -2963,9 +3021,6 @@ unsigned char d_len[256] = {
 const int N = 4096;     // buffer size
 const int F = 60;       // lookahead buffer size
 const int THRESHOLD = 2;
-const int NIL = N;      // leaf of tree
-
-unsigned char text_buf[N + F - 1];
 
 const int N_CHAR = (256 - THRESHOLD + F);       // kinds of characters (character code = 0..N_CHAR-1)
 const int T = (N_CHAR * 2 - 1);       // size of table
@@ -2973,56 +3028,45 @@ const int R = (T - 1);                  // position of root
 const int MAX_FREQ = 0x8000;            // updates tree when the
 										// root frequency comes to this value.
 
-unsigned short freq[T + 1];        // frequency table
-
-short prnt[T + N_CHAR]; // pointers to parent nodes, except for the
-						// elements [T..T + N_CHAR - 1] which are used to get
-						// the positions of leaves corresponding to the codes.
-short son[T];           // pointers to child nodes (son[], son[] + 1)
-
-
-int r;
-
-unsigned getbuf;
-unsigned char getlen;
-
-int GetBit(void)      /* get one bit */
-{
-	int i;
-
-	while (getlen <= 8)
-	{
-		if ((i = readChar()) == -1) i = 0;
-		getbuf |= i << (8 - getlen);
-		getlen += 8;
-	}
-	i = getbuf;
-	getbuf <<= 1;
-	getlen--;
-	return ((i >> 15) & 1);
-}
-
-int GetByte(void)     /* get one byte */
+// All state of one unpacking, so images can be unpacked on any thread. Bits
+// are taken from a 32 bit window refilled a byte at a time, so a code is read
+// by shifts instead of a call per bit. The tree of the characters adapts after
+// every code, the positions are decoded from d_code/d_len by one 16 bit peek.
+struct lzhDecoder
 {
-	unsigned i;
-
-	while (getlen <= 8)
-	{
-		if ((int)(i = readChar()) == -1) i = 0;
-		getbuf |= i << (8 - getlen);
-		getlen += 8;
-	}
-	i = getbuf;
-	getbuf <<= 8;
-	getlen -= 8;
-	return (i >> 8) & 0xFF;
-}
+	unsigned char text_buf[N + F - 1];
+	unsigned short freq[T + 1];     // frequency table
+	short prnt[T + N_CHAR];         // pointers to parent nodes, except for the
+									// elements [T..T + N_CHAR - 1] which are used to get
+									// the positions of leaves corresponding to the codes.
+	short son[T];                   // pointers to child nodes (son[], son[] + 1)
+	int r;
+
+	const unsigned char *src, *end;
+	uint32_t size;
+	uint32_t win;                   // next bits, msb first
+	int cnt;                        // valid bits in win
+	uint32_t used;                  // bits taken so far
+
+	void init(const unsigned char *data, unsigned size);
+	void fill();
+	unsigned bits(int n);
+	void reconst();
+	void update(int c);
+	int decodeChar();
+	int decodePosition();
+	int more();
+};
 
-void StartHuff(void)
+void lzhDecoder::init(const unsigned char *data, unsigned size)
 {
 	int i, j;
 
-	getbuf = 0, getlen = 0;
+	src = data;
+	end = data + size;
+	this->size = size;
+	win = 0, cnt = 0, used = 0;
+
 	for (i = 0; i < N_CHAR; i++) {
 		freq[i] = 1;
 		son[i] = i + T;
@@ -3038,12 +3082,40 @@ void StartHuff(void)
 	freq[T] = 0xffff;
 	prnt[R] = 0;
 
-	for (i = 0; i < N - F; i++) text_buf[i] = ' ';
+	memset(text_buf, ' ', N - F);
 	r = N - F;
 }
 
+// past the end of the data the stream goes on with zeros
+inline void lzhDecoder::fill()
+{
+	while (cnt <= 24)
+	{
+		if (src < end) win |= (uint32_t)*src++ << (24 - cnt);
+		cnt += 8;
+	}
+}
+
+// n <= 16
+inline unsigned lzhDecoder::bits(int n)
+{
+	if (cnt < n) fill();
+	unsigned v = win >> (32 - n);
+	win <<= n;
+	cnt -= n;
+	used += n;
+	return v;
+}
+
+// the original unpacker stops once it has fetched the last byte, which it
+// does 9..16 bits ahead of the ones taken. Every code ends with one bit taken.
+inline int lzhDecoder::more()
+{
+	return used ? (used + 15) / 8 < size : size > 0;
+}
+
 /* reconstruction of tree */
-void reconst(void)
+void lzhDecoder::reconst()
 {
 	int i, j, k;
 	int f, l;
@@ -3079,10 +3151,8 @@ void reconst(void)
 		else prnt[k] = prnt[k + 1] = i;
 }
 
-
 /* increment frequency of given code by one, and update tree */
-
-void update(int c)
+void lzhDecoder::update(int c)
 {
 	int i, j, k, l;
 
@@ -3116,67 +3186,80 @@ void update(int c)
 	} while ((c = prnt[c]) != 0);  /* repeat up to root */
 }
 
-int DecodeChar(void)
+int lzhDecoder::decodeChar()
 {
-	int c;
-
-	c = son[R];
+	int c = son[R];
+	int n = 0;
 
 	/* travel from root to leaf, */
 	/* choosing the smaller child node (son[]) if the read bit is 0, */
 	/* the bigger (son[]+1} if 1 */
-	while (c < T) c = son[c + GetBit()];
+	fill();
+	uint32_t w = win;
+	while (c < T)
+	{
+		if (n == cnt)
+		{
+			used += n;
+			win = 0, cnt = 0;
+			fill();
+			w = win, n = 0;
+		}
+		c = son[c + (w >> 31)];
+		w <<= 1;
+		n++;
+	}
+	win = w;
+	cnt -= n;
+	used += n;
+
 	c -= T;
 	update(c);
 	return c;
 }
 
-int DecodePosition(void)
+int lzhDecoder::decodePosition()
 {
-	int i, j, c;
-
-	/* recover upper 6 bits from table */
-	i = GetByte();
-	c = (int)d_code[i] << 6;
-	j = d_len[i];
-	/* read lower 6 bits verbatim */
-	j -= 2;
-	while (j--) i = (i << 1) + GetBit();
-	return c | (i & 0x3f);
+	if (cnt < 16) fill();
+
+	/* upper 6 bits from table, then the lower 6 bits verbatim */
+	unsigned i = win >> 24;
+	int n = 8 + d_len[i] - 2;
+	return ((int)d_code[i] << 6) | (bits(n) & 0x3f);
 }
 
 unsigned unpack_lzh(unsigned char *src, unsigned size, unsigned char *buf)
 {
-	packed_ptr = src;
-	packed_end = src + size;
+	lzhDecoder *d = new lzhDecoder;
 	int  i, j, k, c;
 	unsigned count = 0;
-	StartHuff();
+	d->init(src, size);
 
 	//  while (count < textsize)  // textsize - sizeof unpacked data
-	while (packed_ptr < packed_end)
+	while (d->more())
 	{
-		c = DecodeChar();
+		c = d->decodeChar();
 		if (c < 256)
 		{
 			*buf++ = c;
-			text_buf[r++] = c;
-			r &= (N - 1);
+			d->text_buf[d->r++] = c;
+			d->r &= (N - 1);
 			count++;
 		}
 		else {
-			i = (r - DecodePosition() - 1) & (N - 1);
+			i = (d->r - d->decodePosition() - 1) & (N - 1);
 			j = c - 255 + THRESHOLD;
 			for (k = 0; k < j; k++)
 			{
-				c = text_buf[(i + k) & (N - 1)];
+				c = d->text_buf[(i + k) & (N - 1)];
 				*buf++ = c;
-				text_buf[r++] = c;
-				r &= (N - 1);
+				d->text_buf[d->r++] = c;
+				d->r &= (N - 1);
 				count++;
 			}
 		}
 	}
+	delete d;
 	return count;
 }
 //--------------------------------------------------------------------------
@@ -3312,6 +3395,122 @@ static void write_data_field(uint8_t *page)
 	write_byte(0xEB);
 }
 
+// Converted images are kept in tmpfs, named by path, size and mtime of the
+// source, so a remount opens the result instead of converting again. They
+// are mounted read-only anyway, so the cached file itself is the vdsk.
+#define VDSK_CACHE_DIR "/tmp/vdsk_cache"
+#define VDSK_CACHE_MAX (32 * 1024 * 1024)
+#define VDSK_CACHE_NUM 64
+
+static int vdsk_cache_name(const char *name, const char *ext, char *out, int size)
+{
+	const char *path = getFullPath(name);
+	struct stat64 st;
+	if (stat64(path, &st) < 0) return 0;
+
+	uint32_t hash = 2166136261u;
+	for (const char *p = path; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	snprintf(out, size, VDSK_CACHE_DIR "/%08X_%llX_%llX.%s", hash, (unsigned long long)st.st_size, (unsigned long long)st.st_mtime, ext);
+	return 1;
+}
+
+static int vdsk_cache_open(const char *cname, fileTYPE *f)
+{
+	if (!FileOpenEx(f, cname, O_RDONLY, 1)) return 0;
+
+	// mtime is the last use for the trimming
+	utimes(cname, NULL);
+	printf("vdsk: %s from cache, size=%llu.\n", cname, f->size);
+	return 1;
+}
+
+// drop the least recently used entries until the cache fits into limit bytes.
+static void vdsk_cache_trim(uint64_t limit)
+{
+	static struct { char name[64]; time_t used; uint64_t size; } list[VDSK_CACHE_NUM];
+	int num = 0;
+	uint64_t total = 0;
+
+	DIR *d = opendir(VDSK_CACHE_DIR);
+	if (!d) return;
+
+	struct dirent *de;
+	while ((de = readdir(d)) && num < VDSK_CACHE_NUM)
+	{
+		int len = strlen(de->d_name);
+		if (de->d_name[0] == '.' || len >= (int)sizeof(list[0].name)) continue;
+
+		char path[128];
+		struct stat64 st;
+		snprintf(path, sizeof(path), VDSK_CACHE_DIR "/%s", de->d_name);
+		if (stat64(path, &st) < 0) continue;
+
+		strcpy(list[num].name, de->d_name);
+		list[num].used = st.st_mtime;
+		list[num].size = st.st_size;
+		total += st.st_size;
+		num++;
+	}
+	closedir(d);
+
+	while ((total > limit || num == VDSK_CACHE_NUM) && num)
+	{
+		int old = 0;
+		for (int i = 1; i < num; i++) if (list[i].used < list[old].used) old = i;
+
+		char path[128];
+		snprintf(path, sizeof(path), VDSK_CACHE_DIR "/%s", list[old].name);
+		unlink(path);
+		total -= list[old].size;
+		list[old] = list[--num];
+	}
+}
+
+// the freshly converted vdsk goes to the cache on the bulk worker
+static void vdsk_cache_store(const char *cname, fileTYPE *f)
+{
+	uint32_t size = f->size;
+	if (!size || size > VDSK_CACHE_MAX) return;
+
+	uint8_t *buf = (uint8_t*)malloc(size);
+	char *path = strdup(cname);
+	if (!buf || !path)
+	{
+		free(buf);
+		free(path);
+		return;
+	}
+
+	FileSeekLBA(f, 0);
+	int ok = FileReadAdv(f, buf, size) == (int)size;
+	FileSeekLBA(f, 0);
+	if (!ok)
+	{
+		free(buf);
+		free(path);
+		return;
+	}
+
+	offload_add_work([path, buf, size]
+	{
+		mkdir(VDSK_CACHE_DIR, 0755);
+		vdsk_cache_trim(VDSK_CACHE_MAX - size);
+
+		// written under a temporary name, so a mount never sees a partial file
+		char tmp[128];
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd >= 0)
+		{
+			int ok = write(fd, buf, size) == (ssize_t)size;
+			close(fd);
+			if (!ok || rename(tmp, path) < 0) unlink(tmp);
+		}
+		free(buf);
+		free(path);
+	}, OFFLOAD_PRIO_BULK);
+}
+
 int dsk2nib(const char *name, fileTYPE *f)
 {
 	int len = strlen(name);
@@ -3329,6 +3528,10 @@ int dsk2nib(const char *name, fileTYPE *f)
 	static uint8_t dos_track[SECTORS * SECTOR_SIZE]; // , pro_track[SECTORS * SECTOR_SIZE];
 	static uint8_t raw_track[RAW_TRACK_uint8_tS];
 
+	char cname[128];
+	int cached = vdsk_cache_name(name, "nib", cname, sizeof(cname));
+	if (cached && vdsk_cache_open(cname, f)) return 1;
+
 	fileTYPE disk_file = {};
 
 	if (!FileOpen(&disk_file, name))
@@ -3384,6 +3587,7 @@ int dsk2nib(const char *name, fileTYPE *f)
 	f->size = FileGetSize(f);
 	FileSeekLBA(f, 0);
 	printf("dsk2nib: vdsk size=%llu.\n", f->size);
+	if (cached) vdsk_cache_store(cname, f);
 
 	return 1;
 }
@@ -3391,6 +3595,10 @@ int dsk2nib(const char *name, fileTYPE *f)
 //--------------------------------------------------------------------------
 int x2trd(const char *name, fileTYPE *f)
 {
+	char cname[128];
+	int cached = vdsk_cache_name(name, "trd", cname, sizeof(cname));
+	if (cached && vdsk_cache_open(cname, f)) return 1;
+
 	TDiskImage *img = new TDiskImage;
 	img->Open(getFullPath(name), true);
 
@@ -3402,11 +3610,13 @@ int x2trd(const char *name, fileTYPE *f)
 	}
 
 	img->writeTRD(f);
+	cached = cached && img->DiskPresent;
 	delete(img);
 
 	f->size = FileGetSize(f);
 	FileSeekLBA(f, 0);
 	printf("x2trd: vdsk size=%llu.\n", f->size);
+	if (cached) vdsk_cache_store(cname, f);
 
 	return 1;
 }
@@ -3415,5 +3625,5 @@ int x2trd_ext_supp(const char *name)
 {
 	const char *ext = "";
 	if (strlen(name) > 4) ext = name + strlen(name) - 4;
-	return (!strcasecmp(ext, ".scl") || !strcasecmp(ext, ".fdi") || !strcasecmp(ext, ".udi"));
+	return (!strcasecmp(ext, ".scl") || !strcasecmp(ext, ".fdi") || !strcasecmp(ext, ".udi") || !strcasecmp(ext, ".td0"));
 }
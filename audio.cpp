@@ -9,6 +9,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <time.h>
+#include <vector>
 
 #include "hardware.h"
 #include "user_io.h"
@@ -17,6 +19,7 @@
 #include "file_io.h"
 #include "menu.h"
 #include "audio.h"
+#include "cd.h"
 
 static uint8_t vol_att = 0;
 static uint8_t corevol_att = 0;
@@ -26,29 +29,36 @@ static int has_filter = 0;
 static char filter_cfg_path[1024] = {};
 static char filter_cfg[1024] = {};
 
-static void setFilter()
+// Parsed coefficient sets in the form they are sent, after the volume word.
+// Kept in memory while the file is unchanged and in the CD info cache (tag
+// "afilter") over core loads, so a filter is read and parsed only once.
+#define AFILTER_CACHE_NUM 8
+
+struct afilterSet
 {
-	fileTYPE f = {};
+	char path[1024];
+	uint64_t size;
+	time_t mtime;
+	std::vector<uint16_t> words;
+};
 
-	has_filter = spi_uio_cmd(UIO_SET_AFILTER);
-	if (!has_filter) return;
+static afilterSet afilter_cache[AFILTER_CACHE_NUM];
+static int afilter_next = 0;
 
-	snprintf(filter_cfg_path, sizeof(filter_cfg_path), AFILTER_DIR"/%s", filter_cfg + 1);
-	if(filter_cfg[0]) printf("\nLoading audio filter: %s\n", filter_cfg_path);
+static int afilter_parse(const char *path, std::vector<uint16_t> &words)
+{
+	fileTYPE f = {};
+	int size = 0;
 
-	if (filter_cfg[0] && FileExists(filter_cfg_path) && FileOpen(&f, filter_cfg_path))
+	if (FileOpen(&f, path))
 	{
 		char *buf = (char*)malloc(f.size + 1);
 		if (buf)
 		{
 			memset(buf, 0, f.size + 1);
-			int size;
 			if ((size = FileReadAdv(&f, buf, f.size)))
 			{
 				int line = 0;
-				spi_uio_cmd_cont(UIO_SET_AFILTER);
-				spi_w((uint8_t)get_core_volume());
-
 				char *end = buf + size;
 				char *pos = buf;
 				while (pos < end && line < 9)
@@ -73,8 +83,8 @@ static void setFilter()
 							printf("got %d values: %d\n", n, val);
 							if (n == 1)
 							{
-								spi_w((uint16_t)val);
-								if (line == 1) spi_w((uint16_t)(val >> 16));
+								words.push_back((uint16_t)val);
+								if (line == 1) words.push_back((uint16_t)(val >> 16));
 								line++;
 							}
 						}
@@ -87,9 +97,9 @@ static void setFilter()
 							{
 								int64_t coeff = 0x8000000000 * val;
 								printf("  -> converted to: %lld\n", coeff);
-								spi_w((uint16_t)coeff);
-								spi_w((uint16_t)(coeff >> 16));
-								spi_w((uint16_t)(coeff >> 32));
+								words.push_back((uint16_t)coeff);
+								words.push_back((uint16_t)(coeff >> 16));
+								words.push_back((uint16_t)(coeff >> 32));
 								line++;
 							}
 						}
@@ -102,17 +112,71 @@ static void setFilter()
 							{
 								int32_t coeff = 0x200000 * val;
 								printf("  -> converted to: %d\n", coeff);
-								spi_w((uint16_t)coeff);
-								spi_w((uint16_t)(coeff >> 16));
+								words.push_back((uint16_t)coeff);
+								words.push_back((uint16_t)(coeff >> 16));
 								line++;
 							}
 						}
 					}
 				}
-				DisableIO();
 			}
 			free(buf);
 		}
+		FileClose(&f);
+	}
+
+	return size;
+}
+
+static const afilterSet *afilter_get(const char *path)
+{
+	struct stat64 st;
+	if (stat64(getFullPath(path), &st) < 0 || !S_ISREG(st.st_mode)) return NULL;
+
+	for (auto &set : afilter_cache)
+	{
+		if (!strcmp(set.path, path) && set.size == (uint64_t)st.st_size && set.mtime == st.st_mtime) return &set;
+	}
+
+	afilterSet *set = &afilter_cache[afilter_next];
+	afilter_next = (afilter_next + 1) % AFILTER_CACHE_NUM;
+	set->path[0] = 0;
+	set->words.clear();
+
+	std::vector<uint8_t> data;
+	if (cd_info_load(path, "afilter", data) && !(data.size() & 1))
+	{
+		set->words.resize(data.size() / 2);
+		memcpy(set->words.data(), data.data(), data.size());
+	}
+	else
+	{
+		if (!afilter_parse(path, set->words)) return NULL;
+		cd_info_store(path, "afilter", set->words.data(), set->words.size() * 2);
+	}
+
+	snprintf(set->path, sizeof(set->path), "%s", path);
+	set->size = st.st_size;
+	set->mtime = st.st_mtime;
+	return set;
+}
+
+static void setFilter()
+{
+	has_filter = spi_uio_cmd(UIO_SET_AFILTER);
+	if (!has_filter) return;
+
+	snprintf(filter_cfg_path, sizeof(filter_cfg_path), AFILTER_DIR"/%s", filter_cfg + 1);
+	if(filter_cfg[0]) printf("\nLoading audio filter: %s\n", filter_cfg_path);
+
+	const afilterSet *set = filter_cfg[0] ? afilter_get(filter_cfg_path) : NULL;
+	if (set)
+	{
+		// the whole set in one frame
+		spi_uio_cmd_cont(UIO_SET_AFILTER);
+		spi_w((uint8_t)get_core_volume());
+		spi_write_t<1, 1>((const uint8_t*)set->words.data(), set->words.size() * 2);
+		DisableIO();
 	}
 	else
 	{
@@ -0,0 +1,407 @@
+// Host benchmark for the pure-CPU parts of MiSTer (make bench).
+// Datasets are generated from a fixed seed on every run, so numbers
+// from different builds of the same machine can be compared directly.
+//
+// usage: MiSTer_bench [work dir] [cd trace]
+// work dir defaults to /tmp/MiSTer_bench. A cd trace (cd_trace in MiSTer_cmd)
+// is replayed instead of the synthetic CD access pattern.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+
+#include "../spi.h"
+#include "../offload.h"
+#include "../counters.h"
+#include "../cfg.h"
+#include "../sxmlc.h"
+#include "../support/chd/mister_chd.h"
+#include "../lib/miniz/miniz.h"
+#include "../lib/md5/md5.h"
+
+static char work_dir[256] = "/tmp/MiSTer_bench";
+static const char *cd_trace_file = nullptr;
+
+// bench/chd_stub.cpp
+chd_file *chd_stub_open(uint32_t sectors);
+static uint32_t rnd_state = 0x12345678;
+
+static uint32_t rnd()
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void report(const char *name, double ms, uint64_t ops, uint64_t bytes)
+{
+	printf("%-14s %9.2f ms %10llu ops %10.0f ops/s", name, ms, (unsigned long long)ops, ops * 1000.0 / ms);
+	if (bytes) printf(" %8.1f MB/s", bytes / 1048576.0 * 1000.0 / ms);
+	printf("\n");
+}
+
+// sector transfer as done by the SD card emulation, bus is stubbed.
+static void bench_spi()
+{
+	static uint8_t buf[512];
+	const int count = 200000;
+	uint64_t spi_start = g_counters[CNT_SPI_BYTES].load();
+
+	double t = now_ms();
+	for (int i = 0; i < count; i++)
+	{
+		spi_uio_cmd_cont(0x18);
+		spi_block_write(buf, 1, 512);
+		DisableIO();
+	}
+	t = now_ms() - t;
+
+	report("spi_sector", t, count, count * 512ULL);
+	printf("%-14s %9llu bus bytes per sector\n", "", (unsigned long long)((g_counters[CNT_SPI_BYTES].load() - spi_start) / count));
+}
+
+// compressible pseudo rom data: runs of repeated bytes
+static void fill_rom(uint8_t *buf, size_t size)
+{
+	size_t pos = 0;
+	while (pos < size)
+	{
+		uint8_t val = rnd();
+		size_t run = 1 + (rnd() & 15);
+		while (run-- && pos < size) buf[pos++] = val;
+	}
+}
+
+// FileOpenZip/FileReadAdv path: iterating extraction in 64KB reads.
+static void bench_zip()
+{
+	const int files = 64;
+	const size_t file_size = 256 * 1024;
+	char path[512];
+	snprintf(path, sizeof(path), "%s/romset.zip", work_dir);
+
+	std::vector<uint8_t> data(file_size);
+	mz_zip_archive zip = {};
+	if (!mz_zip_writer_init_file(&zip, path, 0))
+	{
+		printf("zip: cannot create %s\n", path);
+		return;
+	}
+
+	for (int i = 0; i < files; i++)
+	{
+		char name[32];
+		sprintf(name, "rom_%02d.bin", i);
+		fill_rom(data.data(), file_size);
+		mz_zip_writer_add_mem(&zip, name, data.data(), file_size, MZ_DEFAULT_COMPRESSION);
+	}
+	mz_zip_writer_finalize_archive(&zip);
+	mz_zip_writer_end(&zip);
+
+	static uint8_t buf[64 * 1024];
+	uint64_t total = 0;
+
+	double t = now_ms();
+	memset(&zip, 0, sizeof(zip));
+	if (!mz_zip_reader_init_file(&zip, path, 0))
+	{
+		printf("zip: cannot open %s\n", path);
+		return;
+	}
+
+	for (int i = 0; i < files; i++)
+	{
+		mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(&zip, i, 0);
+		if (!iter) continue;
+
+		size_t ret;
+		while ((ret = mz_zip_reader_extract_iter_read(iter, buf, sizeof(buf)))) total += ret;
+		mz_zip_reader_extract_iter_free(iter);
+	}
+	mz_zip_reader_end(&zip);
+	t = now_ms() - t;
+
+	report("zip_extract", t, files, total);
+}
+
+// crc32 of rom data in the 256KB chunks user_io_file_tx hashes.
+static void bench_crc()
+{
+	const size_t size = 32 * 1024 * 1024;
+	const size_t chunk = 256 * 1024;
+	std::vector<uint8_t> data(size);
+	fill_rom(data.data(), size);
+
+	mz_ulong crc = MZ_CRC32_INIT;
+	double t = now_ms();
+	for (size_t pos = 0; pos < size; pos += chunk) crc = mz_crc32(crc, data.data() + pos, chunk);
+	t = now_ms() - t;
+
+	report("crc32", t, size / chunk, size);
+	printf("%-14s %9lx crc\n", "", (unsigned long)crc);
+}
+
+// md5 of rom data in the chunks the mra loader and the n64 read ahead pass on.
+static void bench_md5()
+{
+	const size_t size = 32 * 1024 * 1024;
+	const size_t chunk = 256 * 1024;
+	std::vector<uint8_t> data(size);
+	fill_rom(data.data(), size);
+
+	MD5Context ctx;
+	uint8_t md5[16];
+	double t = now_ms();
+	MD5Init(&ctx);
+	for (size_t pos = 0; pos < size; pos += chunk) MD5Update(&ctx, data.data() + pos, chunk);
+	MD5Final(md5, &ctx);
+	t = now_ms() - t;
+
+	report("md5", t, size / chunk, size);
+	printf("%-14s  %02x%02x%02x%02x md5\n", "", md5[0], md5[1], md5[2], md5[3]);
+}
+
+static int xml_nodes = 0;
+static int xml_count(XMLEvent evt, const XMLNode *, SXML_CHAR *, const int, SAX_Data *)
+{
+	if (evt == XML_EVENT_START_NODE) xml_nodes++;
+	return true;
+}
+
+// MRA-like document parsed through SAX, as arcade_send_rom does.
+static void bench_xml()
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/big.mra", work_dir);
+
+	FILE *fp = fopen(path, "w");
+	if (!fp)
+	{
+		printf("xml: cannot create %s\n", path);
+		return;
+	}
+
+	fprintf(fp, "<misterromdescription>\n\t<name>Bench</name>\n\t<rbf>bench</rbf>\n");
+	for (int r = 0; r < 16; r++)
+	{
+		fprintf(fp, "\t<rom index=\"%d\" zip=\"romset.zip\" md5=\"none\">\n", r);
+		for (int p = 0; p < 2000; p++)
+		{
+			fprintf(fp, "\t\t<part crc=\"%08x\" name=\"rom_%02d.bin\" offset=\"0x%x\" length=\"0x%x\"/>\n", rnd(), p % 64, p * 0x100, 0x100);
+		}
+		fprintf(fp, "\t\t<part repeat=\"0x100\">FF</part>\n\t</rom>\n");
+	}
+	fprintf(fp, "</misterromdescription>\n");
+	long size = ftell(fp);
+	fclose(fp);
+
+	SAX_Callbacks sax;
+	SAX_Callbacks_init(&sax);
+	sax.all_event = xml_count;
+
+	xml_nodes = 0;
+	double t = now_ms();
+	XMLDoc_parse_file_SAX(path, &sax, nullptr);
+	t = now_ms() - t;
+
+	report("xml_sax", t, xml_nodes, size);
+}
+
+// ScanDirectory-like listing: readdir + stat + case-insensitive sort.
+static void bench_dir()
+{
+	const int files = 5000;
+	char path[512];
+	snprintf(path, sizeof(path), "%s/games", work_dir);
+	mkdir(path, 0755);
+
+	for (int i = 0; i < files; i++)
+	{
+		char name[600];
+		snprintf(name, sizeof(name), "%s/Game %08x (Rev %d).bin", path, rnd(), i % 4);
+		FILE *fp = fopen(name, "w");
+		if (fp) fclose(fp);
+	}
+
+	double t = now_ms();
+	std::vector<std::string> list;
+	DIR *d = opendir(path);
+	if (d)
+	{
+		struct dirent *de;
+		while ((de = readdir(d)))
+		{
+			if (de->d_name[0] == '.') continue;
+
+			std::string full = std::string(path) + "/" + de->d_name;
+			struct stat st;
+			if (!stat(full.c_str(), &st) && S_ISREG(st.st_mode)) list.push_back(de->d_name);
+		}
+		closedir(d);
+	}
+	std::sort(list.begin(), list.end(), [](const std::string &a, const std::string &b) { return strcasecmp(a.c_str(), b.c_str()) < 0; });
+	t = now_ms() - t;
+
+	report("dir_scan", t, list.size(), 0);
+}
+
+// round trip through the offload queue
+static void bench_offload()
+{
+	const int count = 100000;
+	offload_handle_t last = 0;
+
+	double t = now_ms();
+	for (int i = 0; i < count; i++) last = offload_add_work([] {});
+	offload_wait(last);
+	t = now_ms() - t;
+
+	report("offload", t, count, 0);
+}
+
+struct cd_req
+{
+	uint64_t us;
+	int lba;
+	int cnt;
+};
+
+// game loading its data: sequential runs with seeks in between,
+// sectors come several times faster than from a 2x drive.
+static void cd_trace_synth(std::vector<cd_req> &trace)
+{
+	uint64_t us = 0;
+	for (int run = 0; run < 12; run++)
+	{
+		int lba = rnd() % 300000;
+		int len = 16 + (rnd() % 256);
+		for (int i = 0; i < len; i++)
+		{
+			trace.push_back({ us, lba + i, 1 });
+			us += 450;
+		}
+		us += 5000 + (rnd() % 20000);
+	}
+}
+
+// "<us> <core> <lba> <cnt>" lines as written by cd_trace_cmd.
+// Gaps over 20ms are shortened, the cache is idle there anyway.
+static int cd_trace_load(const char *name, std::vector<cd_req> &trace)
+{
+	FILE *fp = fopen(name, "r");
+	if (!fp) return 0;
+
+	char line[256], core[32];
+	unsigned long long us;
+	uint64_t last = 0, t = 0;
+	int lba, cnt;
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (line[0] == '#' || sscanf(line, "%llu %31s %d %d", &us, core, &lba, &cnt) != 4) continue;
+		t += std::min<uint64_t>(us - last, 20000);
+		last = us;
+		trace.push_back({ t, std::max(lba, 0), std::max(cnt, 1) });
+	}
+	fclose(fp);
+	return !trace.empty();
+}
+
+// CD requests through the CHD hunk cache with a few chd_cache / chd_readahead
+// settings. Latency is per request, hit rate is per sector.
+static void bench_cd()
+{
+	std::vector<cd_req> trace;
+	if (cd_trace_file && !cd_trace_load(cd_trace_file, trace))
+	{
+		printf("cd: cannot read %s\n", cd_trace_file);
+		return;
+	}
+	if (trace.empty()) cd_trace_synth(trace);
+
+	static const uint8_t configs[][2] = { { 1, 0 }, { 1, 4 }, { 4, 0 }, { 4, 4 }, { 16, 4 }, { 16, 16 } };
+	static uint8_t buf[64 * CD_FRAME_SIZE];
+
+	printf("%-14s %9s %9s %9s %9s %7s\n", "cd cache/ra", "p50 us", "p90 us", "p99 us", "max us", "hit");
+	for (auto &c : configs)
+	{
+		cfg.chd_cache = c[0];
+		cfg.chd_readahead = c[1];
+		chd_file *chd = chd_stub_open(360000);
+
+		uint64_t hit = g_counters[CNT_CHD_HIT].load(), miss = g_counters[CNT_CHD_MISS].load();
+		std::vector<uint32_t> lat;
+		lat.reserve(trace.size());
+
+		double start = now_ms();
+		for (auto &r : trace)
+		{
+			double due = start + r.us / 1000.0;
+			double wait = due - now_ms();
+			if (wait > 0.2) usleep((useconds_t)((wait - 0.1) * 1000));
+			while (now_ms() < due) {}
+
+			double t = now_ms();
+			for (int i = 0; i < r.cnt && i < 64; i++)
+			{
+				mister_chd_read_sector(chd, (r.lba + i) % 360000, i * CD_FRAME_SIZE, 0, CD_FRAME_SIZE, buf);
+			}
+			lat.push_back((uint32_t)((now_ms() - t) * 1000));
+		}
+		mister_chd_close(chd);
+
+		hit = g_counters[CNT_CHD_HIT].load() - hit;
+		miss = g_counters[CNT_CHD_MISS].load() - miss;
+		std::sort(lat.begin(), lat.end());
+
+		char name[32];
+		sprintf(name, "cd %uMB/%u", c[0], c[1]);
+		printf("%-14s %9u %9u %9u %9u %6.1f%%\n", name, lat[lat.size() / 2], lat[lat.size() * 9 / 10], lat[lat.size() * 99 / 100], lat.back(),
+			100.0 * hit / std::max<uint64_t>(hit + miss, 1));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) snprintf(work_dir, sizeof(work_dir), "%s", argv[1]);
+	if (argc > 2) cd_trace_file = argv[2];
+
+	char cmd[300];
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", work_dir);
+	if (system(cmd)) {}
+	if (mkdir(work_dir, 0755) < 0)
+	{
+		printf("cannot create %s\n", work_dir);
+		return 1;
+	}
+
+	offload_start();
+
+	printf("%-14s %12s %14s %14s\n", "benchmark", "time", "count", "rate");
+	bench_spi();
+	bench_zip();
+	bench_crc();
+	bench_md5();
+	bench_xml();
+	bench_dir();
+	bench_offload();
+	bench_cd();
+
+	offload_stop();
+	return 0;
+}
@@ -0,0 +1,122 @@
+// Host stand-in for libchdr and the main binary parts used by the CHD hunk
+// cache (support/chd/mister_chd.cpp) in the bench target. Images are not
+// read from anywhere: a hunk is filled from its number after CHD_STUB_DECODE_US
+// of busy CPU, which is roughly what decoding a CD hunk costs on the DE10.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <libchdr/chd.h>
+#include <libchdr/cdrom.h>
+#include "../cfg.h"
+#include "../cd.h"
+#include "../file_io.h"
+#include "../membudget.h"
+
+#define CHD_STUB_DECODE_US 800
+
+cfg_t cfg;
+
+struct _chd_file
+{
+	chd_header hdr;
+};
+
+chd_file *chd_stub_open(uint32_t sectors)
+{
+	chd_file *chd = new chd_file;
+	memset(&chd->hdr, 0, sizeof(chd->hdr));
+	chd->hdr.unitbytes = CD_FRAME_SIZE;
+	chd->hdr.hunkbytes = CD_FRAME_SIZE * 8;
+	chd->hdr.hunkcount = (sectors + 7) / 8;
+	chd->hdr.logicalbytes = (uint64_t)chd->hdr.hunkcount * chd->hdr.hunkbytes;
+	return chd;
+}
+
+static uint64_t stub_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+chd_error chd_read(chd_file *chd, UINT32 hunknum, void *buffer)
+{
+	if (hunknum >= chd->hdr.hunkcount) return CHDERR_HUNK_OUT_OF_RANGE;
+
+	uint64_t end = stub_us() + CHD_STUB_DECODE_US;
+	while (stub_us() < end) {}
+
+	memset(buffer, (uint8_t)hunknum, chd->hdr.hunkbytes);
+	return CHDERR_NONE;
+}
+
+const chd_header *chd_get_header(chd_file *chd)
+{
+	return &chd->hdr;
+}
+
+void chd_close(chd_file *chd)
+{
+	delete chd;
+}
+
+chd_error chd_open(const char *, int, chd_file *, chd_file **chd)
+{
+	*chd = nullptr;
+	return CHDERR_FILE_NOT_FOUND;
+}
+
+chd_error chd_open_map(const char *, int, chd_file *, const void *, UINT32, chd_file **chd)
+{
+	*chd = nullptr;
+	return CHDERR_FILE_NOT_FOUND;
+}
+
+chd_error chd_get_metadata(chd_file *, UINT32, UINT32, void *, UINT32, UINT32 *, UINT32 *, UINT8 *)
+{
+	return CHDERR_METADATA_NOT_FOUND;
+}
+
+core_file *chd_core_file(chd_file *)
+{
+	return nullptr;
+}
+
+const char *chd_error_string(chd_error)
+{
+	return "stub error";
+}
+
+const char *getFullPath(const char *name)
+{
+	return name;
+}
+
+void membudget_register(const char *, int, membudget_size_t, membudget_trim_t)
+{
+}
+
+void FileStorageProfile(int, storageProfile *prof)
+{
+	memset(prof, 0, sizeof(*prof));
+	prof->type = STORAGE_SD;
+}
+
+int cd_info_load(const char *, const char *, void *, int)
+{
+	return 0;
+}
+
+int cd_info_load(const char *, const char *, std::vector<uint8_t> &)
+{
+	return 0;
+}
+
+void cd_info_store(const char *, const char *, const void *, int)
+{
+}
+
+void ProgressMessage(const char *, const char *, int, int)
+{
+}
@@ -0,0 +1,59 @@
+// Host stand-in for the HPS-FPGA bus used by the bench target.
+// Transfers are not sent anywhere, they are only counted (CNT_SPI_BYTES)
+// so benchmarks can report the bus traffic a code path would generate.
+
+#include <string.h>
+#include "../fpga_io.h"
+#include "../counters.h"
+
+static uint32_t spi_en = 0;
+
+void fpga_spi_en(uint32_t mask, uint32_t en)
+{
+	spi_en = en ? (spi_en | mask) : (spi_en & ~mask);
+}
+
+uint16_t fpga_spi(uint16_t word)
+{
+	counter_add(CNT_SPI_BYTES, 2);
+	return word;
+}
+
+uint16_t fpga_spi_fast(uint16_t word)
+{
+	counter_add(CNT_SPI_BYTES, 2);
+	return word;
+}
+
+void fpga_spi_fast_block_write(const uint16_t *, uint32_t length)
+{
+	counter_add(CNT_SPI_BYTES, length * 2);
+}
+
+void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
+{
+	counter_add(CNT_SPI_BYTES, length * 2);
+	memset(buf, 0, length * 2);
+}
+
+void fpga_spi_fast_block_write_8(const uint8_t *, uint32_t length)
+{
+	counter_add(CNT_SPI_BYTES, length);
+}
+
+void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
+{
+	counter_add(CNT_SPI_BYTES, length);
+	memset(buf, 0, length);
+}
+
+void fpga_spi_fast_block_write_be(const uint16_t *, uint32_t length)
+{
+	counter_add(CNT_SPI_BYTES, length * 2);
+}
+
+void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length)
+{
+	counter_add(CNT_SPI_BYTES, length * 2);
+	memset(buf, 0, length * 2);
+}
@@ -12,6 +12,7 @@
 
 
 extern int xml_load(const char *xml);
+extern const char *xml_get_rbf(const char *xml);
 int16_t btimeout;
 char bootcoretype[64];
 
@@ -210,6 +211,13 @@ void bootcore_init(const char *path)
 				}
 
 				strcpy(cfg.bootcore, strcmp(bootcore, "menu.rbf") ? bootcore : "");
+
+				// read the core during the countdown, a key press cancels it in the menu
+				if (cfg.bootcore[0])
+				{
+					const char *rbf = isXmlName(cfg.bootcore) ? xml_get_rbf(cfg.bootcore) : cfg.bootcore;
+					if (rbf) fpga_preload_rbf(rbf);
+				}
 				return;
 			}
 		}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <bluetooth.h>
+#include <hci.h>
+#include <hci_lib.h>
+
+#include "btlink.h"
+#include "offload.h"
+
+#define BT_TIMEOUT 2000 // ms for a command to complete
+
+struct btRequest
+{
+	char mac[18];
+	int op;
+};
+
+enum
+{
+	BT_DISCONNECT,
+	BT_LOW_LATENCY,
+};
+
+static int bt_conn_handle(int dd, const char *mac, uint16_t *handle)
+{
+	uint8_t buf[sizeof(struct hci_conn_info_req) + sizeof(struct hci_conn_info)] = {};
+	struct hci_conn_info_req *cr = (struct hci_conn_info_req*)buf;
+
+	if (str2ba(mac, &cr->bdaddr) < 0) return 0;
+	cr->type = ACL_LINK;
+	if (ioctl(dd, HCIGETCONNINFO, (unsigned long)cr) < 0) return 0;
+
+	*handle = htobs(cr->conn_info->handle);
+	return 1;
+}
+
+static void bt_run(const btRequest &req)
+{
+	int dev = hci_get_route(NULL);
+	int dd = (dev < 0) ? -1 : hci_open_dev(dev);
+	if (dd < 0)
+	{
+		printf("btlink: no adapter\n");
+		return;
+	}
+
+	uint16_t handle;
+	if (!bt_conn_handle(dd, req.mac, &handle))
+	{
+		printf("btlink: %s is not connected\n", req.mac);
+	}
+	else if (req.op == BT_DISCONNECT)
+	{
+		if (hci_disconnect(dd, handle, HCI_OE_USER_ENDED_CONNECTION, BT_TIMEOUT) < 0) printf("btlink: cannot disconnect %s\n", req.mac);
+		else printf("btlink: %s disconnected\n", req.mac);
+	}
+	else if (req.op == BT_LOW_LATENCY)
+	{
+		uint16_t policy;
+		if (hci_read_link_policy(dd, handle, &policy, BT_TIMEOUT) < 0 ||
+			hci_write_link_policy(dd, handle, policy & ~htobs(HCI_LP_SNIFF), BT_TIMEOUT) < 0)
+		{
+			printf("btlink: cannot set the link policy of %s\n", req.mac);
+		}
+		else
+		{
+			// a link already in sniff mode stays there until told otherwise
+			exit_sniff_mode_cp cp = {};
+			cp.handle = htobs(handle);
+			hci_send_cmd(dd, OGF_LINK_POLICY, OCF_EXIT_SNIFF_MODE, EXIT_SNIFF_MODE_CP_SIZE, &cp);
+			printf("btlink: %s kept out of sniff mode\n", req.mac);
+		}
+	}
+
+	hci_close_dev(dd);
+}
+
+static void bt_queue(const char *mac, int op)
+{
+	btRequest req = {};
+	snprintf(req.mac, sizeof(req.mac), "%s", mac);
+	req.op = op;
+	offload_add_work([req] { bt_run(req); }, OFFLOAD_PRIO_BULK);
+}
+
+void btlink_disconnect(const char *mac)
+{
+	bt_queue(mac, BT_DISCONNECT);
+}
+
+void btlink_low_latency(const char *mac)
+{
+	bt_queue(mac, BT_LOW_LATENCY);
+}
+
+void btlink_reset()
+{
+	// hci0 even while it's down, hci_get_route() only knows adapters that are up
+	int ctl = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+	if (ctl < 0) return;
+
+	if (ioctl(ctl, HCIDEVDOWN, 0) < 0 || ioctl(ctl, HCIDEVUP, 0) < 0) printf("btlink: cannot reset hci0\n");
+	close(ctl);
+}
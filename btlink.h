@@ -0,0 +1,17 @@
+#ifndef BTLINK_H
+#define BTLINK_H
+
+// Link control of the Bluetooth input devices over the HCI socket of the
+// first adapter, without forking a tool. Commands wait for the controller,
+// so the calls only queue them on the bulk worker. mac is "AA:BB:CC:DD:EE:FF".
+
+void btlink_disconnect(const char *mac);
+
+// keeps the link out of sniff mode, reports then arrive on every slot instead
+// of once per sniff interval. See bt_low_latency in MiSTer.ini.
+void btlink_low_latency(const char *mac);
+
+// resets the adapter before pairing, returns once it's back up
+void btlink_reset();
+
+#endif
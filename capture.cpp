@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <atomic>
+
+#include "capture.h"
+#include "scaler.h"
+
+// Two threads on core 0, away from the main loop:
+// the grabber copies a frame out of the scaler buffer at a fixed rate into
+// a free one of two buffers, the writer sends full buffers to the FIFO in
+// order. If the reader doesn't keep up, both buffers stay full and frames
+// are dropped at the grabber, so a slow reader never stalls the copy.
+// The scaler gets no sync from here, a frame can show a tear.
+#define CAPTURE_BUFS 2
+
+struct captureBuf
+{
+	captureFrame hdr;
+	uint8_t *data;
+	uint32_t alloc;
+	int full;
+};
+
+static captureBuf bufs[CAPTURE_BUFS] = {};
+static pthread_mutex_t cap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cap_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t grab_thread, write_thread;
+static int cap_on = 0;
+static volatile int cap_quit = 0;
+static int cap_fps = 30;
+static int cap_format = CAPTURE_RGB;
+static std::atomic<uint32_t> cap_grabbed, cap_written, cap_dropped;
+
+static uint64_t capture_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void capture_thread_setup()
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+}
+
+static int capture_grab(mister_scaler *ms, captureBuf *buf, uint32_t seq)
+{
+	if (mister_scaler_update(ms) || !ms->width || !ms->height) return 0;
+
+	int w = ms->width, h = ms->height;
+	uint32_t size = (cap_format == CAPTURE_I420) ? w * h + ((w + 1) / 2) * ((h + 1) / 2) * 2 : w * h * 3;
+	if (buf->alloc < size)
+	{
+		uint8_t *data = (uint8_t *)realloc(buf->data, size);
+		if (!data) return 0;
+		buf->data = data;
+		buf->alloc = size;
+	}
+
+	if (cap_format == CAPTURE_I420)
+	{
+		uint8_t *u = buf->data + w * h;
+		if (mister_scaler_read_yuv420(ms, buf->data, u, u + ((w + 1) / 2) * ((h + 1) / 2))) return 0;
+	}
+	else mister_scaler_read(ms, buf->data);
+
+	captureFrame *hdr = &buf->hdr;
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, "MCAP", 4);
+	hdr->format = cap_format;
+	hdr->width = w;
+	hdr->height = h;
+	hdr->seq = seq;
+	hdr->us = capture_us();
+	hdr->size = size;
+	return 1;
+}
+
+static void *grab_proc(void *)
+{
+	capture_thread_setup();
+
+	mister_scaler *ms = mister_scaler_init();
+	if (!ms)
+	{
+		printf("capture: scaler is not compatible\n");
+		return nullptr;
+	}
+
+	uint64_t period = 1000000000ULL / cap_fps;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (uint32_t seq = 0; !cap_quit; seq++)
+	{
+		pthread_mutex_lock(&cap_lock);
+		captureBuf *buf = nullptr;
+		for (int i = 0; i < CAPTURE_BUFS; i++) if (!bufs[i].full) buf = &bufs[i];
+		pthread_mutex_unlock(&cap_lock);
+
+		// only the grabber sets full, so the free buffer is ours
+		if (!buf) cap_dropped++;
+		else if (capture_grab(ms, buf, seq))
+		{
+			cap_grabbed++;
+			pthread_mutex_lock(&cap_lock);
+			buf->full = 1;
+			pthread_cond_signal(&cap_cond);
+			pthread_mutex_unlock(&cap_lock);
+		}
+
+		uint64_t ns = next.tv_nsec + period;
+		next.tv_sec += ns / 1000000000ULL;
+		next.tv_nsec = ns % 1000000000ULL;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr) == EINTR) {}
+	}
+
+	mister_scaler_free(ms);
+	return nullptr;
+}
+
+// 0 once the reader is gone or the capture stops
+static int capture_send(int fd, const uint8_t *data, uint32_t size)
+{
+	while (size && !cap_quit)
+	{
+		struct pollfd pfd = { fd, POLLOUT, 0 };
+		if (poll(&pfd, 1, 100) <= 0) continue;
+		if (pfd.revents & (POLLERR | POLLHUP)) return 0;
+
+		ssize_t len = write(fd, data, size);
+		if (len < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR) continue;
+			return 0;
+		}
+		data += len;
+		size -= len;
+	}
+	return !size;
+}
+
+static void *write_proc(void *)
+{
+	capture_thread_setup();
+
+	// a reader going away must not kill MiSTer
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+	int fd = -1;
+	while (1)
+	{
+		pthread_mutex_lock(&cap_lock);
+		captureBuf *buf = nullptr;
+		while (!cap_quit)
+		{
+			for (int i = 0; i < CAPTURE_BUFS; i++) if (bufs[i].full && (!buf || bufs[i].hdr.seq < buf->hdr.seq)) buf = &bufs[i];
+			if (buf) break;
+			pthread_cond_wait(&cap_cond, &cap_lock);
+		}
+		pthread_mutex_unlock(&cap_lock);
+		if (cap_quit) break;
+
+		// nobody reading: the frame is dropped
+		if (fd < 0) fd = open(CAPTURE_FIFO, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd >= 0)
+		{
+			if (capture_send(fd, (const uint8_t *)&buf->hdr, sizeof(buf->hdr)) && capture_send(fd, buf->data, buf->hdr.size)) cap_written++;
+			else
+			{
+				close(fd);
+				fd = -1;
+			}
+		}
+		else cap_dropped++;
+
+		pthread_mutex_lock(&cap_lock);
+		buf->full = 0;
+		pthread_mutex_unlock(&cap_lock);
+	}
+
+	if (fd >= 0) close(fd);
+	return nullptr;
+}
+
+static void capture_start(int fps, int format)
+{
+	if (cap_on)
+	{
+		printf("capture: already running\n");
+		return;
+	}
+
+	unlink(CAPTURE_FIFO);
+	if (mkfifo(CAPTURE_FIFO, 0666) < 0)
+	{
+		printf("capture: cannot create %s\n", CAPTURE_FIFO);
+		return;
+	}
+
+	cap_fps = fps;
+	cap_format = format;
+	cap_quit = 0;
+	cap_grabbed = cap_written = cap_dropped = 0;
+	for (int i = 0; i < CAPTURE_BUFS; i++) bufs[i].full = 0;
+
+	pthread_create(&write_thread, nullptr, write_proc, nullptr);
+	pthread_create(&grab_thread, nullptr, grab_proc, nullptr);
+	cap_on = 1;
+	printf("capture: %d fps %s to %s\n", fps, (format == CAPTURE_I420) ? "I420" : "RGB24", CAPTURE_FIFO);
+}
+
+static void capture_stop()
+{
+	if (!cap_on)
+	{
+		printf("capture: not running\n");
+		return;
+	}
+
+	cap_quit = 1;
+	pthread_mutex_lock(&cap_lock);
+	pthread_cond_broadcast(&cap_cond);
+	pthread_mutex_unlock(&cap_lock);
+	pthread_join(grab_thread, nullptr);
+	pthread_join(write_thread, nullptr);
+	cap_on = 0;
+
+	for (int i = 0; i < CAPTURE_BUFS; i++)
+	{
+		free(bufs[i].data);
+		bufs[i].data = nullptr;
+		bufs[i].alloc = 0;
+	}
+	unlink(CAPTURE_FIFO);
+
+	printf("capture: stopped, %u frames grabbed, %u written, %u dropped\n", cap_grabbed.load(), cap_written.load(), cap_dropped.load());
+}
+
+void capture_cmd(const char *cmd)
+{
+	if (!strncmp(cmd, "start", 5))
+	{
+		int fps = 30;
+		char fmt[8] = {};
+		sscanf(cmd + 5, "%d %7s", &fps, fmt);
+		if (fps < 1) fps = 1;
+		if (fps > 60) fps = 60;
+		capture_start(fps, !strcmp(fmt, "yuv") ? CAPTURE_I420 : CAPTURE_RGB);
+	}
+	else if (!strcmp(cmd, "stop")) capture_stop();
+	else printf("capture: unknown command '%s'\n", cmd);
+}
@@ -0,0 +1,31 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// Continuous frame capture for recording or streaming without a capture card.
+// "capture start [fps] [rgb|yuv]" / "capture stop" in MiSTer_cmd.
+// Frames are written to CAPTURE_FIFO, each one a captureFrame header followed
+// by the pixels: RGB24, or I420 (Y plane, then U and V at half resolution).
+// e.g. "cat /dev/MiSTer_capture | nc <pc> <port>" on the MiSTer.
+
+#include <inttypes.h>
+
+#define CAPTURE_FIFO "/dev/MiSTer_capture"
+
+#define CAPTURE_RGB  0
+#define CAPTURE_I420 1
+
+struct captureFrame
+{
+	char     magic[4];  // "MCAP"
+	uint32_t format;    // CAPTURE_*
+	uint16_t width;
+	uint16_t height;
+	uint32_t seq;       // gaps are dropped frames
+	uint64_t us;        // CLOCK_MONOTONIC
+	uint32_t size;      // bytes of pixels after the header
+	uint32_t reserved;
+};
+
+void capture_cmd(const char *cmd);
+
+#endif
@@ -0,0 +1,926 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <FLAC/stream_decoder.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "cd.h"
+#include "cfg.h"
+#include "menu.h"
+#include "counters.h"
+#include "shcache.h"
+#include "support/chd/mister_chd.h"
+
+struct cueWord
+{
+	const char *ptr;
+	int len;
+};
+
+static const char *cue_space(const char *p)
+{
+	while (*p == ' ' || *p == '\t') p++;
+	return p;
+}
+
+// next word of a line, a quoted one without the quotes
+static const char *cue_word(const char *p, cueWord *w)
+{
+	p = cue_space(p);
+	if (*p == '"')
+	{
+		w->ptr = ++p;
+		while (*p && *p != '"') p++;
+		w->len = p - w->ptr;
+		if (*p) p++;
+	}
+	else
+	{
+		w->ptr = p;
+		while (*p && *p != ' ' && *p != '\t') p++;
+		w->len = p - w->ptr;
+	}
+	return p;
+}
+
+static int cue_is(const cueWord *w, const char *str)
+{
+	return (int)strlen(str) == w->len && !strncasecmp(w->ptr, str, w->len);
+}
+
+static int cue_find(const cueWord *w, const char **list)
+{
+	for (int i = 0; list[i]; i++) if (cue_is(w, list[i])) return i;
+	return -1;
+}
+
+static int cue_num(const cueWord *w)
+{
+	if (!w->len || w->len > 4) return -1;
+
+	int num = 0;
+	for (int i = 0; i < w->len; i++)
+	{
+		if (w->ptr[i] < '0' || w->ptr[i] > '9') return -1;
+		num = num * 10 + w->ptr[i] - '0';
+	}
+	return num;
+}
+
+// mm:ss:ff in frames
+static int cue_time(const cueWord *w)
+{
+	int part[3] = {}, n = 0, digits = 0;
+	for (int i = 0; i < w->len; i++)
+	{
+		char c = w->ptr[i];
+		if (c == ':')
+		{
+			if (!digits || ++n > 2) return -1;
+			digits = 0;
+		}
+		else if (c >= '0' && c <= '9' && digits < 3)
+		{
+			part[n] = part[n] * 10 + c - '0';
+			digits++;
+		}
+		else return -1;
+	}
+	if (n != 2 || !digits) return -1;
+	return (part[0] * 60 + part[1]) * 75 + part[2];
+}
+
+static const char *cue_cmds[] = { "FILE", "TRACK", "INDEX", "PREGAP", 0 };
+static const char *cue_ignored[] = { "CATALOG", "CDTEXTFILE", "FLAGS", "ISRC", "PERFORMER", "POSTGAP", "REM", "SONGWRITER", "TITLE", 0 };
+static const char *cue_files[] = { "BINARY", "MOTOROLA", "WAVE", 0 };
+static const char *cue_modes[] = { "AUDIO", "MODE1/2048", "MODE1/2352", "MODE2/2336", "MODE2/2352", 0 };
+
+int cd_cue_parse(const char *filename, cue_sheet_t *cue)
+{
+	static char text[100 * 1024];
+
+	cue->cmds = 0;
+	cue->dir[0] = 0;
+
+	memset(text, 0, sizeof(text));
+	if (!FileLoad(filename, text, sizeof(text) - 1)) return 0;
+
+	const char *sep = filename + strlen(filename);
+	while (sep > filename && sep[-1] != '/' && sep[-1] != '\\') sep--;
+	snprintf(cue->dir, sizeof(cue->dir), "%.*s", (int)(sep - filename), filename);
+
+	int names = 0;
+	char *line = text;
+	while (*line && cue->cmds < CUE_MAX_CMDS)
+	{
+		char *end = line;
+		while (*end && *end != '\n') end++;
+		char *next = *end ? end + 1 : end;
+		while (end > line && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) end--;
+		*end = 0;
+
+		cueWord w;
+		const char *p = cue_word(line, &w);
+		line = next;
+		if (!w.len) continue;
+
+		cue_cmd_t *c = &cue->cmd[cue->cmds++];
+		memset(c, 0, sizeof(*c));
+		c->num = -1;
+		c->frames = -1;
+
+		int cmd = cue_find(&w, cue_cmds);
+		if (cmd < 0)
+		{
+			c->cmd = (cue_find(&w, cue_ignored) < 0) ? CUE_UNKNOWN : CUE_OTHER;
+			continue;
+		}
+		c->cmd = CUE_FILE + cmd;
+
+		cueWord arg;
+		p = cue_word(p, &arg);
+		switch (c->cmd)
+		{
+		case CUE_FILE:
+			if (names + arg.len + 1 > (int)sizeof(cue->names))
+			{
+				printf("cue: too many file names in %s\n", filename);
+				cue->cmds--;
+				return 1;
+			}
+			c->name = names;
+			memcpy(cue->names + names, arg.ptr, arg.len);
+			names += arg.len;
+			cue->names[names++] = 0;
+			cue_word(p, &w);
+			c->type = cue_find(&w, cue_files) + 1;
+			break;
+
+		case CUE_TRACK:
+			c->num = cue_num(&arg);
+			cue_word(p, &w);
+			c->type = cue_find(&w, cue_modes) + 1;
+			break;
+
+		case CUE_INDEX:
+			c->num = cue_num(&arg);
+			cue_word(p, &w);
+			c->frames = cue_time(&w);
+			break;
+
+		case CUE_PREGAP:
+			c->frames = cue_time(&arg);
+			break;
+		}
+	}
+
+	return 1;
+}
+
+const char *cd_cue_file(const cue_sheet_t *cue, const cue_cmd_t *cmd, char *path, int size)
+{
+	snprintf(path, size, "%s%s", cue->dir, cue->names + cmd->name);
+	return path;
+}
+
+void cd_swap16(uint8_t *buf, int len)
+{
+	int i = 0;
+
+#ifdef __ARM_NEON
+	for (; i + 16 <= len; i += 16) vst1q_u8(buf + i, vrev16q_u8(vld1q_u8(buf + i)));
+#else
+	// callers pass buffers of any alignment
+	for (; i + 4 <= len; i += 4)
+	{
+		uint32_t v;
+		memcpy(&v, buf + i, 4);
+		v = ((v >> 8) & 0x00FF00FF) | ((v << 8) & 0xFF00FF00);
+		memcpy(buf + i, &v, 4);
+	}
+#endif
+
+	for (; i + 1 < len; i += 2)
+	{
+		uint8_t tmp = buf[i];
+		buf[i] = buf[i + 1];
+		buf[i + 1] = tmp;
+	}
+}
+
+chd_error cd_chd_read_audio(chd_file *chd_f, int lba, int cnt, uint8_t *buf)
+{
+	chd_error err = CHDERR_NONE;
+	for (int i = 0; i < cnt && err == CHDERR_NONE; i++)
+	{
+		err = mister_chd_read_sector(chd_f, lba + i, i * CD_SECTOR_RAW, 0, CD_SECTOR_RAW, buf);
+	}
+
+	if (err == CHDERR_NONE) cd_swap16(buf, cnt * CD_SECTOR_RAW);
+	return err;
+}
+
+// Reads up to cnt audio sectors from lba which belong to a single track.
+// Returns the number of sectors in buf, 0 for silence.
+static int cd_audio_sectors(toc_t *toc, int lba, int cnt, uint8_t *buf)
+{
+	int idx = toc->GetTrackByLBA(lba);
+	cd_track_t *track = &toc->tracks[idx];
+	if (lba < 0 || lba >= track->end || track->type) return 0;
+	if (cnt > track->end - lba) cnt = track->end - lba;
+
+	if (toc->chd_f)
+	{
+		return (cd_chd_read_audio(toc->chd_f, lba + track->offset, cnt, buf) == CHDERR_NONE) ? cnt : 0;
+	}
+
+	if (!track->f.opened()) return 0;
+	int len = FileReadAt(&track->f, (__off64_t)lba * CD_SECTOR_RAW - track->offset, buf, cnt * CD_SECTOR_RAW);
+	return (len > 0) ? len / CD_SECTOR_RAW : 0;
+}
+
+// Zip members are read with seek + read, which can't be done off the main thread
+static int cd_audio_async(toc_t *toc)
+{
+	if (toc->chd_f) return 1;
+	for (int i = 0; i < toc->last; i++)
+	{
+		fileTYPE *f = &toc->tracks[i].f;
+		if (f->opened() && !f->filp && !f->mem && !(f->src && f->src->threadsafe())) return 0;
+	}
+	return 1;
+}
+
+#define CD_AUDIO_CHUNK 16
+
+void cd_audio_drop(cd_audio_t *ring)
+{
+	offload_wait(ring->job);
+	ring->job = 0;
+	ring->toc = 0;
+}
+
+// queues the next chunk, returns 0 if the ring can't be used
+static int cd_audio_fill(cd_audio_t *ring, toc_t *toc, int lba, int end)
+{
+	int size = cfg.cdda_buffer * 75;
+
+	if (ring->toc != toc || ring->lba != lba || ring->end != end || ring->size != size)
+	{
+		cd_audio_drop(ring);
+		if (!size || !cd_audio_async(toc)) return 0;
+
+		if (ring->size != size)
+		{
+			free(ring->buf);
+			ring->buf = (uint8_t *)malloc(size * CD_SECTOR_RAW);
+			ring->size = ring->buf ? size : 0;
+			if (!ring->size) return 0;
+		}
+
+		ring->toc = toc;
+		ring->lba = lba;
+		ring->end = end;
+		ring->fill = lba;
+		ring->ready = lba;
+	}
+
+	if (!offload_is_done(ring->job)) return 1;
+
+	// chunks don't wrap around the end of the ring, so they are read in one go
+	int pos = ring->fill % ring->size;
+	int cnt = ring->size - (ring->fill - ring->lba);
+	if (cnt > CD_AUDIO_CHUNK) cnt = CD_AUDIO_CHUNK;
+	if (cnt > ring->size - pos) cnt = ring->size - pos;
+	if (cnt > ring->end - ring->fill) cnt = ring->end - ring->fill;
+	if (cnt <= 0) return 1;
+
+	int first = ring->fill;
+	ring->job = offload_try_add_work([ring, toc, first, cnt]
+	{
+		uint8_t *dst = ring->buf + (first % ring->size) * CD_SECTOR_RAW;
+		for (int i = 0; i < cnt;)
+		{
+			int n = cd_audio_sectors(toc, first + i, cnt - i, dst + i * CD_SECTOR_RAW);
+			if (!n)
+			{
+				memset(dst + i * CD_SECTOR_RAW, 0, CD_SECTOR_RAW);
+				n = 1;
+			}
+			i += n;
+			ring->ready.store(first + i);
+		}
+	}, OFFLOAD_PRIO_BULK);
+
+	if (ring->job) ring->fill += cnt;
+	return 1;
+}
+
+void cd_audio_read(cd_audio_t *ring, toc_t *toc, int lba, int end, uint8_t *buf)
+{
+	int restart = (ring->toc != toc || ring->lba != lba || ring->end != end);
+
+	if (end > lba && cd_audio_fill(ring, toc, lba, end))
+	{
+		if (ring->ready.load() <= lba)
+		{
+			if (!restart) counter_add(CNT_CDDA_UNDERRUN);
+			offload_wait(ring->job);
+		}
+
+		if (ring->ready.load() > lba)
+		{
+			memcpy(buf, ring->buf + (lba % ring->size) * CD_SECTOR_RAW, CD_SECTOR_RAW);
+			ring->lba++;
+			cd_audio_fill(ring, toc, ring->lba, end);
+			return;
+		}
+	}
+
+	// not played sequentially, or the job didn't get into the queue
+	if (!cd_audio_sectors(toc, lba, 1, buf)) memset(buf, 0, CD_SECTOR_RAW);
+}
+
+// Re-mounting an image or swapping discs doesn't parse it again. Records are
+// tiny, so they are read on the main thread (through shcache, which keeps them
+// over restarts) and written on the bulk worker.
+#define CD_INFO_MAGIC 0x31494443 // "CDI1"
+#define CD_INFO_DIR   CONFIG_DIR "/cdinfo"
+
+struct cdInfoHeader
+{
+	uint32_t magic;
+	uint32_t len;
+	uint32_t path_len;
+	uint32_t reserved;
+	uint64_t size;
+	uint64_t mtime;
+};
+
+static int cd_info_key(const char *filename, const char *tag, std::string &path, cdInfoHeader *h, char *name, int size)
+{
+	path = getFullPath(filename);
+
+	struct stat64 st;
+	if (stat64(path.c_str(), &st) < 0) return 0;
+
+	uint32_t hash = 2166136261u;
+	for (const char *p = path.c_str(); *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+
+	h->magic = CD_INFO_MAGIC;
+	h->path_len = path.size();
+	h->reserved = 0;
+	h->size = st.st_size;
+	h->mtime = st.st_mtime;
+	snprintf(name, size, "%s/" CD_INFO_DIR "/%08X.%s", getRootDir(), hash, tag);
+	return 1;
+}
+
+int cd_info_load(const char *filename, const char *tag, void *data, int len)
+{
+	std::vector<uint8_t> buf;
+	if (!cd_info_load(filename, tag, buf) || buf.size() != (size_t)len) return 0;
+
+	memcpy(data, buf.data(), len);
+	return 1;
+}
+
+int cd_info_load(const char *filename, const char *tag, std::vector<uint8_t> &data)
+{
+	std::string path;
+	cdInfoHeader key, h;
+	char name[1024];
+	if (!cd_info_key(filename, tag, path, &key, name, sizeof(name))) return 0;
+
+	size_t size;
+	uint8_t *rec = (uint8_t*)shcache_load(name, &size);
+	if (!rec) return 0;
+
+	memcpy(&h, rec, std::min(size, sizeof(h)));
+	int ok = size >= sizeof(h) && h.magic == key.magic && h.path_len == key.path_len && h.size == key.size && h.mtime == key.mtime &&
+		size == sizeof(h) + h.path_len + h.len && !memcmp(rec + sizeof(h), path.data(), h.path_len);
+	if (ok) data.assign(rec + sizeof(h) + h.path_len, rec + size);
+	free(rec);
+	return ok;
+}
+
+void cd_info_store(const char *filename, const char *tag, const void *data, int len)
+{
+	std::string path;
+	cdInfoHeader h;
+	char *name = (char*)malloc(1024);
+	if (!name || !cd_info_key(filename, tag, path, &h, name, 1024))
+	{
+		free(name);
+		return;
+	}
+
+	h.len = len;
+	size_t size = sizeof(h) + h.path_len + len;
+	uint8_t *rec = (uint8_t*)malloc(size);
+	if (!rec)
+	{
+		free(name);
+		return;
+	}
+
+	memcpy(rec, &h, sizeof(h));
+	memcpy(rec + sizeof(h), path.data(), h.path_len);
+	memcpy(rec + sizeof(h) + h.path_len, data, len);
+	shcache_store(name, rec, size);
+
+	offload_add_work([rec, size, name]
+	{
+		char *p = strrchr(name, '/');
+		*p = 0;
+		mkdir(name, S_IRWXU | S_IRWXG | S_IRWXO);
+		*p = '/';
+
+		int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (fd >= 0)
+		{
+			if (write(fd, rec, size) != (ssize_t)size) unlink(name);
+			close(fd);
+		}
+		free(rec);
+		free(name);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+// 16 bytes per request, a few minutes of playing fit easily
+#define CD_TRACE_MAX (1024 * 1024)
+
+struct cdTraceRec
+{
+	uint64_t us;
+	int32_t lba;
+	uint16_t cnt;
+	uint16_t core;
+};
+
+static const char *cd_trace_names[] = { "ide", "megacd", "pcecd", "saturn", "psx" };
+
+int cd_trace_on = 0;
+static std::vector<cdTraceRec> *cd_trace_recs = nullptr;
+
+static uint64_t cd_trace_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void cd_trace_add(int core, int lba, int cnt)
+{
+	if (cd_trace_recs->size() >= CD_TRACE_MAX) return;
+	cd_trace_recs->push_back({ cd_trace_us(), lba, (uint16_t)cnt, (uint16_t)core });
+}
+
+static void cd_trace_stop()
+{
+	if (!cd_trace_on)
+	{
+		printf("CD trace: not running\n");
+		return;
+	}
+
+	char name[64] = CONFIG_DIR"/cdtrace.txt";
+	time_t t = time(NULL);
+	struct tm tm = *localtime(&t);
+	if (tm.tm_year >= 119) strftime(name, sizeof(name), CONFIG_DIR"/cdtrace_%Y%m%d_%H%M%S.txt", &tm);
+
+	char *path = strdup(getFullPath(name));
+	std::vector<cdTraceRec> *recs = cd_trace_recs;
+	cd_trace_recs = nullptr;
+	cd_trace_on = 0;
+
+	if (recs->size() >= CD_TRACE_MAX) printf("CD trace: buffer was full, the end is missing\n");
+	printf("CD trace: stopped, %d requests\n", (int)recs->size());
+
+	offload_add_work([recs, path]
+	{
+		FILE *fp = path ? fopen(path, "w") : nullptr;
+		if (fp)
+		{
+			uint64_t start = recs->empty() ? 0 : recs->front().us;
+			fprintf(fp, "# us core lba cnt\n");
+			for (auto &r : *recs) fprintf(fp, "%llu %s %d %u\n", (unsigned long long)(r.us - start), cd_trace_names[r.core], r.lba, r.cnt);
+			fclose(fp);
+			printf("CD trace: written to %s\n", path);
+		}
+		else printf("CD trace: cannot create %s\n", path ? path : "the file");
+		delete recs;
+		free(path);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+void cd_trace_cmd(const char *cmd)
+{
+	if (!strcmp(cmd, "start"))
+	{
+		if (cd_trace_on)
+		{
+			printf("CD trace: already running\n");
+			return;
+		}
+
+		cd_trace_recs = new std::vector<cdTraceRec>;
+		cd_trace_recs->reserve(64 * 1024);
+		cd_trace_on = 1;
+		printf("CD trace: started\n");
+	}
+	else if (!strcmp(cmd, "stop")) cd_trace_stop();
+	else printf("CD trace: unknown command '%s'\n", cmd);
+}
+
+// FLAC tracks keep a few chunks of decoded PCM. Reading one of them decodes
+// the following chunks on the bulk worker, so playback finds them ready and
+// only the compressed data is read from storage. chunk_lock covers the
+// chunks, dec_lock the decoder, which is only used by one thread at a time.
+#define CD_FLAC_CHUNK  32768 // samples (128KB)
+#define CD_FLAC_CHUNKS 4
+#define CD_FLAC_AHEAD  2
+
+struct cdFlacChunk
+{
+	int64_t idx;
+	uint32_t used;
+	uint8_t *data;
+};
+
+struct cdFlacSource : fileSource
+{
+	fileTYPE f;
+	FLAC__StreamDecoder *dec = nullptr;
+	uint64_t pos = 0; // decoder position in f
+	uint64_t samples = 0;
+	uint32_t channels = 0, bits = 0, rate = 0;
+	int async = 0;
+
+	// decoded samples not taken by a chunk yet, the first one is pend_pos
+	std::vector<uint32_t> pend;
+	uint64_t pend_pos = 0;
+
+	cdFlacChunk chunks[CD_FLAC_CHUNKS] = {};
+	uint8_t *tmp = nullptr;
+	uint32_t use_cnt = 0;
+	offload_handle_t job = 0;
+	pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_t dec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	~cdFlacSource()
+	{
+		offload_wait(job);
+		if (dec) FLAC__stream_decoder_delete(dec);
+		for (auto &c : chunks) free(c.data);
+		free(tmp);
+	}
+
+	int open(const char *name);
+	int read(__off64_t offset, void *buf, int len) override;
+	int threadsafe() override { return async; }
+	int get(int64_t idx, int ofs, uint8_t *dst, int len);
+	void decode(int64_t idx, uint8_t *dst);
+	void ahead(int64_t idx);
+};
+
+static FLAC__StreamDecoderReadStatus flac_read(const FLAC__StreamDecoder *, FLAC__byte buffer[], size_t *bytes, void *data)
+{
+	cdFlacSource *src = (cdFlacSource*)data;
+	int len = (*bytes > 0x100000) ? 0x100000 : (int)*bytes;
+	int res = FileReadAt(&src->f, src->pos, buffer, len);
+	if (res <= 0)
+	{
+		*bytes = 0;
+		return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+	}
+
+	src->pos += res;
+	*bytes = res;
+	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+static FLAC__StreamDecoderSeekStatus flac_seek(const FLAC__StreamDecoder *, FLAC__uint64 offset, void *data)
+{
+	((cdFlacSource*)data)->pos = offset;
+	return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
+}
+
+static FLAC__StreamDecoderTellStatus flac_tell(const FLAC__StreamDecoder *, FLAC__uint64 *offset, void *data)
+{
+	*offset = ((cdFlacSource*)data)->pos;
+	return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+}
+
+static FLAC__StreamDecoderLengthStatus flac_length(const FLAC__StreamDecoder *, FLAC__uint64 *length, void *data)
+{
+	*length = ((cdFlacSource*)data)->f.size;
+	return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
+}
+
+static FLAC__bool flac_eof(const FLAC__StreamDecoder *, void *data)
+{
+	cdFlacSource *src = (cdFlacSource*)data;
+	return src->pos >= (uint64_t)src->f.size;
+}
+
+static FLAC__StreamDecoderWriteStatus flac_write(const FLAC__StreamDecoder *, const FLAC__Frame *frame, const FLAC__int32 *const buffer[], void *data)
+{
+	cdFlacSource *src = (cdFlacSource*)data;
+	int shift = (int)src->bits - 16;
+	const FLAC__int32 *l = buffer[0];
+	const FLAC__int32 *r = buffer[(src->channels > 1) ? 1 : 0];
+
+	for (uint32_t i = 0; i < frame->header.blocksize; i++)
+	{
+		int32_t sl = (shift >= 0) ? (l[i] >> shift) : (l[i] << -shift);
+		int32_t sr = (shift >= 0) ? (r[i] >> shift) : (r[i] << -shift);
+		src->pend.push_back((uint16_t)sl | ((uint32_t)(uint16_t)sr << 16));
+	}
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void flac_metadata(const FLAC__StreamDecoder *, const FLAC__StreamMetadata *metadata, void *data)
+{
+	cdFlacSource *src = (cdFlacSource*)data;
+	if (metadata->type != FLAC__METADATA_TYPE_STREAMINFO) return;
+
+	src->samples = metadata->data.stream_info.total_samples;
+	src->channels = metadata->data.stream_info.channels;
+	src->bits = metadata->data.stream_info.bits_per_sample;
+	src->rate = metadata->data.stream_info.sample_rate;
+}
+
+static void flac_error(const FLAC__StreamDecoder *, FLAC__StreamDecoderErrorStatus status, void *)
+{
+	printf("FLAC: %s\n", FLAC__StreamDecoderErrorStatusString[status]);
+}
+
+int cdFlacSource::open(const char *name)
+{
+	if (!FileOpen(&f, name)) return 0;
+
+	dec = FLAC__stream_decoder_new();
+	if (!dec || FLAC__stream_decoder_init_stream(dec, flac_read, flac_seek, flac_tell, flac_length, flac_eof,
+		flac_write, flac_metadata, flac_error, this) != FLAC__STREAM_DECODER_INIT_STATUS_OK) return 0;
+
+	if (!FLAC__stream_decoder_process_until_end_of_metadata(dec)) return 0;
+	if (!samples || channels < 1 || channels > 2 || bits < 8 || bits > 24 || rate != 44100)
+	{
+		printf("FLAC: %s is not CD audio (%u Hz, %u channels, %u bit, %llu samples)\n", name, rate, channels, bits, (unsigned long long)samples);
+		return 0;
+	}
+
+	tmp = (uint8_t*)malloc(CD_FLAC_CHUNK * 4);
+	// zip members can't be read off the main thread
+	async = f.filp != nullptr;
+	return tmp != nullptr;
+}
+
+// dec_lock held
+void cdFlacSource::decode(int64_t idx, uint8_t *dst)
+{
+	uint64_t start = idx * CD_FLAC_CHUNK;
+	uint64_t end = start + CD_FLAC_CHUNK;
+	if (end > samples) end = samples;
+
+	// continue where the last chunk ended, seek otherwise
+	if (start < pend_pos || start > pend_pos + pend.size())
+	{
+		pend.clear();
+		pend_pos = start;
+		if (!FLAC__stream_decoder_seek_absolute(dec, start))
+		{
+			FLAC__stream_decoder_flush(dec);
+			pend.clear();
+		}
+	}
+	else
+	{
+		pend.erase(pend.begin(), pend.begin() + (start - pend_pos));
+		pend_pos = start;
+	}
+
+	while (pend_pos + pend.size() < end)
+	{
+		if (!FLAC__stream_decoder_process_single(dec)) break;
+		FLAC__StreamDecoderState state = FLAC__stream_decoder_get_state(dec);
+		if (state == FLAC__STREAM_DECODER_END_OF_STREAM || state == FLAC__STREAM_DECODER_ABORTED) break;
+	}
+
+	uint64_t cnt = pend.size();
+	if (cnt > end - start) cnt = end - start;
+	memcpy(dst, pend.data(), cnt * 4);
+	memset(dst + cnt * 4, 0, (CD_FLAC_CHUNK - cnt) * 4);
+
+	pend.erase(pend.begin(), pend.begin() + cnt);
+	pend_pos += cnt;
+}
+
+// copies len bytes at ofs of chunk idx to dst (if set), decoding it if needed
+int cdFlacSource::get(int64_t idx, int ofs, uint8_t *dst, int len)
+{
+	for (int pass = 0; pass < 2; pass++)
+	{
+		pthread_mutex_lock(&chunk_lock);
+		for (auto &c : chunks)
+		{
+			if (c.data && c.idx == idx)
+			{
+				c.used = ++use_cnt;
+				if (dst) memcpy(dst, c.data + ofs, len);
+				pthread_mutex_unlock(&chunk_lock);
+				if (pass) pthread_mutex_unlock(&dec_lock);
+				return 1;
+			}
+		}
+		pthread_mutex_unlock(&chunk_lock);
+
+		// somebody else may decode it while we wait for dec_lock
+		if (!pass) pthread_mutex_lock(&dec_lock);
+	}
+
+	decode(idx, tmp);
+
+	pthread_mutex_lock(&chunk_lock);
+	cdFlacChunk *lru = &chunks[0];
+	for (auto &c : chunks)
+	{
+		if (!c.data || c.used < lru->used) lru = &c;
+		if (!c.data) break;
+	}
+
+	if (!lru->data) lru->data = (uint8_t*)malloc(CD_FLAC_CHUNK * 4);
+	int ok = lru->data != nullptr;
+	if (ok)
+	{
+		std::swap(lru->data, tmp);
+		lru->idx = idx;
+		lru->used = ++use_cnt;
+		if (dst) memcpy(dst, lru->data + ofs, len);
+	}
+	pthread_mutex_unlock(&chunk_lock);
+	pthread_mutex_unlock(&dec_lock);
+	return ok;
+}
+
+void cdFlacSource::ahead(int64_t idx)
+{
+	if (!async) return;
+
+	int64_t last = (int64_t)((samples - 1) / CD_FLAC_CHUNK);
+	int missing = 0;
+
+	pthread_mutex_lock(&chunk_lock);
+	for (int64_t i = idx + 1; i <= idx + CD_FLAC_AHEAD && i <= last; i++)
+	{
+		int found = 0;
+		for (auto &c : chunks) found |= (c.data && c.idx == i);
+		missing |= !found;
+	}
+
+	if (missing && offload_is_done(job))
+	{
+		cdFlacSource *src = this;
+		job = offload_try_add_work([src, idx, last]
+		{
+			for (int64_t i = idx + 1; i <= idx + CD_FLAC_AHEAD && i <= last; i++) src->get(i, 0, nullptr, 0);
+		}, OFFLOAD_PRIO_BULK);
+	}
+	pthread_mutex_unlock(&chunk_lock);
+}
+
+int cdFlacSource::read(__off64_t offset, void *buf, int len)
+{
+	const int chunk_bytes = CD_FLAC_CHUNK * 4;
+	int done = 0;
+	int64_t idx = 0;
+
+	while (done < len)
+	{
+		idx = (offset + done) / chunk_bytes;
+		int ofs = (offset + done) % chunk_bytes;
+		int cnt = (len - done < chunk_bytes - ofs) ? len - done : chunk_bytes - ofs;
+		if (!get(idx, ofs, (uint8_t*)buf + done, cnt)) break;
+		done += cnt;
+	}
+
+	if (done) ahead(idx);
+	return done ? done : -1;
+}
+
+int cd_open_track(fileTYPE *f, const char *name)
+{
+	const char *ext = strrchr(name, '.');
+	if (!ext || strcasecmp(ext, ".flac")) return FileOpen(f, name);
+
+	cdFlacSource *src = new cdFlacSource;
+	if (!src->open(name))
+	{
+		delete src;
+		return 0;
+	}
+
+	std::string path = std::string(src->f.path) + "#pcm";
+	printf("FLAC: %s, %llu samples\n", name, (unsigned long long)src->samples);
+	FileOpenSource(f, src, src->samples * 4, path.c_str());
+	return 1;
+}
+
+// RAM left for the core's other needs (save states, rewind, OSD) after a preload
+#define CD_PRELOAD_RESERVE (128ULL * 1024 * 1024)
+
+static uint64_t mem_available()
+{
+	uint64_t kb = 0;
+	char line[128];
+
+	FILE *fp = fopen("/proc/meminfo", "r");
+	if (!fp) return 0;
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "MemAvailable: %llu kB", (unsigned long long*)&kb) == 1) break;
+	}
+	fclose(fp);
+	return kb * 1024;
+}
+
+// track i is in the same file as one of the tracks before it
+static int cd_same_file(toc_t *toc, int i)
+{
+	for (int j = 0; j < i; j++)
+	{
+		if (toc->tracks[j].f.opened() && !strcmp(toc->tracks[j].f.path, toc->tracks[i].f.path)) return 1;
+	}
+	return 0;
+}
+
+int cd_preload(toc_t *toc)
+{
+	if (!cfg.cd_preload) return 0;
+
+	uint64_t total = 0;
+	if (toc->chd_f)
+	{
+		const chd_header *hdr = chd_get_header(toc->chd_f);
+		total = (uint64_t)hdr->hunkcount * hdr->hunkbytes;
+	}
+	else
+	{
+		for (int i = 0; i < toc->last; i++)
+		{
+			if (toc->tracks[i].f.opened() && !cd_same_file(toc, i)) total += toc->tracks[i].f.size;
+		}
+	}
+
+	if (!total) return 0;
+
+	if (total > (uint64_t)cfg.cd_preload * 1024 * 1024)
+	{
+		printf("CD preload: image is %llu MB, over the limit.\n", (unsigned long long)(total >> 20));
+		return 0;
+	}
+
+	if (total + CD_PRELOAD_RESERVE > mem_available())
+	{
+		printf("CD preload: not enough free RAM for %llu MB.\n", (unsigned long long)(total >> 20));
+		return 0;
+	}
+
+	int ok = 1;
+	if (toc->chd_f)
+	{
+		ok = mister_chd_preload(toc->chd_f, 0, total);
+	}
+	else
+	{
+		uint64_t done = 0;
+		for (int i = 0; ok && i < toc->last; i++)
+		{
+			fileTYPE *f = &toc->tracks[i].f;
+			if (!f->opened()) continue;
+
+			// tracks of a single BIN share its copy
+			int shared = cd_same_file(toc, i);
+			ok = FilePreload(f, done, total);
+			if (!shared) done += f->size;
+		}
+	}
+
+	ProgressMessage(0, 0, 0, 0);
+	printf("CD preload: %llu MB %s.\n", (unsigned long long)(total >> 20), ok ? "loaded" : "failed");
+	return ok;
+}
@@ -1,8 +1,11 @@
 #ifndef CD_H
 #define CD_H
 
+#include <atomic>
+#include <vector>
 #include <libchdr/chd.h>
 #include "file_io.h"
+#include "offload.h"
 
 
 typedef enum
@@ -51,4 +54,120 @@ typedef struct
 
 typedef int (*SendDataFunc) (uint8_t* buf, int len, uint8_t index);
 
+// Shared by the CD image loaders and sector readers of all CD cores.
+// Reads of CHD images go through the hunk cache in support/chd.
+
+#define CD_SECTOR_RAW 2352
+
+// Cue sheets are read once and split into a flat list of commands for the
+// loaders of all CD cores. Keywords are case insensitive, the commands the
+// loaders have no use for come as CUE_OTHER (known, safe to skip) or
+// CUE_UNKNOWN (not a cue sheet command).
+enum
+{
+	CUE_UNKNOWN = 0, CUE_OTHER, CUE_FILE, CUE_TRACK, CUE_INDEX, CUE_PREGAP
+};
+
+// type of FILE
+enum
+{
+	CUE_FILE_OTHER = 0, CUE_BINARY, CUE_MOTOROLA, CUE_WAVE
+};
+
+// type of TRACK
+enum
+{
+	CUE_MODE_OTHER = 0, CUE_AUDIO, CUE_MODE1_2048, CUE_MODE1_2352, CUE_MODE2_2336, CUE_MODE2_2352
+};
+
+#define CUE_MAX_CMDS 1024
+
+typedef struct
+{
+	uint8_t cmd;
+	uint8_t type;   // FILE, TRACK
+	int16_t num;    // TRACK, INDEX, -1 if missing
+	int frames;     // INDEX, PREGAP, -1 if the time doesn't parse
+	uint16_t name;  // FILE, offset in names
+} cue_cmd_t;
+
+typedef struct
+{
+	char dir[1024]; // of the cue sheet, with the trailing slash
+	int cmds;
+	cue_cmd_t cmd[CUE_MAX_CMDS];
+	char names[16 * 1024];
+} cue_sheet_t;
+
+// 0 if the cue sheet can't be read. Keep the sheet in static storage.
+int cd_cue_parse(const char *filename, cue_sheet_t *cue);
+
+// full path of the file named by a FILE command
+const char *cd_cue_file(const cue_sheet_t *cue, const cue_cmd_t *cmd, char *path, int size);
+
+// CHD stores audio big endian, cores want it little endian
+void cd_swap16(uint8_t *buf, int len);
+
+// cnt raw audio sectors from lba (CHD numbering), byte swapped
+chd_error cd_chd_read_audio(chd_file *chd_f, int lba, int cnt, uint8_t *buf);
+
+// Read-ahead ring for CD audio playback, cdda_buffer seconds deep. Sectors
+// [lba, ready) are in RAM, [ready, fill) are being read on the bulk offload
+// worker. Keep it in static storage, a zeroed ring is empty.
+typedef struct
+{
+	toc_t *toc;
+	uint8_t *buf;
+	int size;
+	int lba;
+	int end;
+	int fill;
+	std::atomic<int> ready;
+	offload_handle_t job;
+} cd_audio_t;
+
+// Raw audio sector lba (little endian) for a player going sequentially up to
+// end (exclusive). Any other lba restarts the read-ahead from there.
+// Data tracks and sectors beyond the image read as silence.
+void cd_audio_read(cd_audio_t *ring, toc_t *toc, int lba, int end, uint8_t *buf);
+
+// stops the read-ahead, must be called before the image is closed
+void cd_audio_drop(cd_audio_t *ring);
+
+// Small records derived from an image (CHD TOC, game ID, region...), kept in
+// CONFIG_DIR/cdinfo by path, size and mtime of the image and a tag naming
+// the kind of record. A hit fills data with exactly len bytes and returns 1.
+int cd_info_load(const char *filename, const char *tag, void *data, int len);
+// records of variable length
+int cd_info_load(const char *filename, const char *tag, std::vector<uint8_t> &data);
+void cd_info_store(const char *filename, const char *tag, const void *data, int len);
+
+// CD access trace: every sector request of the CD cores is logged with time,
+// core, lba and count while recording. "start" / "stop" writes the trace to
+// config/cdtrace_<date>.txt, which bench/MiSTer_bench can replay against the
+// CHD cache. Used by "cd_trace" in MiSTer_cmd. Main thread only.
+enum
+{
+	CD_TRACE_IDE = 0, CD_TRACE_MEGACD, CD_TRACE_PCECD, CD_TRACE_SATURN, CD_TRACE_PSX
+};
+
+extern int cd_trace_on;
+void cd_trace_add(int core, int lba, int cnt);
+void cd_trace_cmd(const char *cmd);
+
+static inline void cd_trace(int core, int lba, int cnt)
+{
+	if (cd_trace_on) cd_trace_add(core, lba, cnt);
+}
+
+// Opens a track file of a cue sheet. FLAC files are decoded on the fly and
+// read like a BIN audio track (16 bit stereo, little endian).
+int cd_open_track(fileTYPE *f, const char *name);
+
+// Loads the opened track files or the CHD of a mounted image into RAM if
+// cd_preload in MiSTer.ini allows it and it fits into the free memory.
+// Returns 1 if the image is in RAM now. Failure is not fatal, the image
+// is read from storage then.
+int cd_preload(toc_t *toc);
+
 #endif
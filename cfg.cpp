@@ -8,11 +8,18 @@
 #include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
 #include "cfg.h"
 #include "debug.h"
 #include "file_io.h"
 #include "user_io.h"
 #include "video.h"
+#include "offload.h"
 #include "support/arcade/mra_loader.h"
 
 cfg_t cfg;
@@ -51,6 +58,7 @@ static const ini_var_t ini_vars[] =
 	{ "HDMI_LIMITED", (void*)(&(cfg.hdmi_limited)), UINT8, 0, 2 },
 	{ "KBD_NOMOUSE", (void*)(&(cfg.kbd_nomouse)), UINT8, 0, 1 },
 	{ "MOUSE_THROTTLE", (void*)(&(cfg.mouse_throttle)), UINT8, 1, 100 },
+	{ "MOUSE_SYNC", (void*)(&(cfg.mouse_sync)), UINT8, 0, 1 },
 	{ "BOOTSCREEN", (void*)(&(cfg.bootscreen)), UINT8, 0, 1 },
 	{ "VSCALE_MODE", (void*)(&(cfg.vscale_mode)), UINT8, 0, 5 },
 	{ "VSCALE_BORDER", (void*)(&(cfg.vscale_border)), UINT16, 0, 399 },
@@ -97,6 +105,7 @@ static const ini_var_t ini_vars[] =
 	{ "LOG_FILE_ENTRY", (void*)(&(cfg.log_file_entry)), UINT8, 0, 1 },
 	{ "BT_AUTO_DISCONNECT", (void*)(&(cfg.bt_auto_disconnect)), UINT32, 0, 180 },
 	{ "BT_RESET_BEFORE_PAIR", (void*)(&(cfg.bt_reset_before_pair)), UINT8, 0, 1 },
+	{ "BT_LOW_LATENCY", (void*)(&(cfg.bt_low_latency)), UINT8, 0, 1 },
 	{ "WAITMOUNT", (void*)(&(cfg.waitmount)), STRING, 0, sizeof(cfg.waitmount) - 1 },
 	{ "RUMBLE", (void *)(&(cfg.rumble)), UINT8, 0, 1 },
 	{ "WHEEL_FORCE", (void*)(&(cfg.wheel_force)), UINT8, 0, 100 },
@@ -127,6 +136,31 @@ static const ini_var_t ini_vars[] =
 	{ "CONTROLLER_UNIQUE_MAPPING", (void *)(cfg.controller_unique_mapping), UINT32ARR, 0, 0xFFFFFFFF },
 	{ "OSD_LOCK", (void*)(&(cfg.osd_lock)), STRING, 0, sizeof(cfg.osd_lock) - 1 },
 	{ "OSD_LOCK_TIME", (void*)(&(cfg.osd_lock_time)), UINT16, 0, 60 },
+	{ "IDLE_SLEEP", (void*)(&(cfg.idle_sleep)), UINT8, 0, 100 },
+	{ "INPUT_THREAD", (void*)(&(cfg.input_thread)), UINT8, 0, 1 },
+	{ "RBF_CACHE", (void*)(&(cfg.rbf_cache)), UINT16, 0, 256 },
+	{ "UNZIP_CACHE", (void*)(&(cfg.unzip_cache)), UINT16, 0, 512 },
+	{ "GAME_PREFETCH", (void*)(&(cfg.game_prefetch)), UINT16, 0, 512 },
+	{ "READAHEAD_USB", (void*)(&(cfg.readahead_usb)), UINT8, 0, 32 },
+	{ "READAHEAD_NET", (void*)(&(cfg.readahead_net)), UINT8, 0, 32 },
+	{ "NET_READ_SIZE", (void*)(&(cfg.net_read_size)), UINT16, 64, 1024 },
+	{ "NET_META_TTL", (void*)(&(cfg.net_meta_ttl)), UINT16, 0, 3600 },
+	{ "HDD_CACHE", (void*)(&(cfg.hdd_cache)), UINT16, 0, 256 },
+	{ "HDD_WRITE_DELAY", (void*)(&(cfg.hdd_write_delay)), UINT16, 0, 10000 },
+	{ "CDDA_BUFFER", (void*)(&(cfg.cdda_buffer)), UINT8, 0, 10 },
+	{ "CHD_CACHE", (void*)(&(cfg.chd_cache)), UINT8, 0, 64 },
+	{ "CHD_READAHEAD", (void*)(&(cfg.chd_readahead)), UINT8, 0, 16 },
+	{ "CD_PRELOAD", (void*)(&(cfg.cd_preload)), UINT16, 0, 1024 },
+	{ "CORE_SWITCH_INPLACE", (void*)(&(cfg.core_switch_inplace)), UINT8, 0, 1 },
+	{ "MIDI_BRIDGE", (void*)(&(cfg.midi_bridge)), UINT16, 0, 4096 },
+	{ "SAVESTATE_COMPRESS", (void*)(&(cfg.savestate_compress)), UINT8, 0, 1 },
+	{ "REWIND", (void*)(&(cfg.rewind)), UINT16, 0, 512 },
+	{ "SAVE_WRITE_DELAY", (void*)(&(cfg.save_write_delay)), UINT16, 0, 10000 },
+	{ "CMD_TCP_PORT", (void*)(&(cfg.cmd_tcp_port)), UINT16, 0, 65535 },
+	{ "CACHE_BUDGET", (void*)(&(cfg.cache_budget)), UINT16, 0, 1024 },
+	{ "LOG_LEVEL", (void*)(&(cfg.log_level)), UINT8, 0, 3 },
+	{ "LOG_FILE", (void*)(&(cfg.log_file)), STRING, 0, sizeof(cfg.log_file) - 1 },
+	{ "LIBRARY_INDEX", (void*)(&(cfg.library_index)), UINT8, 0, 1 },
 };
 
 static const int nvars = (int)(sizeof(ini_vars) / sizeof(ini_var_t));
@@ -154,18 +188,79 @@ static const int nvars = (int)(sizeof(ini_vars) / sizeof(ini_var_t));
 #define CHAR_IS_QUOTE(c)        (((c) == '"'))
 
 
-fileTYPE ini_file;
-
 static bool has_video_sections = false;
 static bool using_video_section = false;
 
-int ini_pt = 0;
+// Files are read whole and kept while their size and mtime match. cfg_parse()
+// runs again on video mode changes and goes over the file twice when it has
+// video sections, none of these passes touch the storage again.
+#define INI_CACHE_NUM 6
+
+struct iniFile
+{
+	char name[64];
+	uint64_t size;
+	time_t mtime;
+	std::vector<char> data;
+};
+
+static iniFile ini_cache[INI_CACHE_NUM];
+static int ini_cache_next = 0;
+
+static const char *ini_buf = 0;
+static size_t ini_len = 0;
+static size_t ini_pt = 0;
+
+static int ini_open(const char *name)
+{
+	ini_buf = 0;
+	ini_len = 0;
+	ini_pt = 0;
+
+	struct stat64 st;
+	if (!name[0] || stat64(getFullPath(name), &st) < 0 || !S_ISREG(st.st_mode)) return 0;
+
+	iniFile *f = 0;
+	for (auto &c : ini_cache)
+	{
+		if (!strcmp(c.name, name))
+		{
+			f = &c;
+			break;
+		}
+	}
+
+	if (!f || f->size != (uint64_t)st.st_size || f->mtime != st.st_mtime)
+	{
+		if (!f)
+		{
+			f = &ini_cache[ini_cache_next];
+			ini_cache_next = (ini_cache_next + 1) % INI_CACHE_NUM;
+		}
+
+		f->name[0] = 0;
+		f->data.resize(st.st_size);
+
+		fileTYPE file;
+		if (!FileOpen(&file, name)) return 0;
+		int ok = !st.st_size || FileReadAdv(&file, f->data.data(), st.st_size) == (int)st.st_size;
+		FileClose(&file);
+		if (!ok) return 0;
+
+		snprintf(f->name, sizeof(f->name), "%s", name);
+		f->size = st.st_size;
+		f->mtime = st.st_mtime;
+	}
+
+	ini_buf = f->data.data();
+	ini_len = f->data.size();
+	return 1;
+}
+
 static char ini_getch()
 {
-	static uint8_t buf[512];
-	if (!(ini_pt & 0x1ff)) FileReadSec(&ini_file, buf);
-	if (ini_pt >= ini_file.size) return 0;
-	return buf[(ini_pt++) & 0x1ff];
+	if (ini_pt >= ini_len) return 0;
+	return ini_buf[ini_pt++];
 }
 
 static int ini_getline(char* line)
@@ -323,6 +418,43 @@ static void ini_parse_numeric(const ini_var_t *var, const char *text, void *out)
 	}
 }
 
+// open addressing over the names of ini_vars, built on the first lookup
+#define INI_HASH_SIZE 512
+static_assert(INI_HASH_SIZE >= 2 * (sizeof(ini_vars) / sizeof(ini_var_t)), "INI_HASH_SIZE is too small");
+
+static uint32_t ini_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for (; *name; name++) hash = (hash ^ (uint8_t)toupper(*name)) * 16777619u;
+	return hash;
+}
+
+static int ini_find_var(const char *name)
+{
+	static int16_t table[INI_HASH_SIZE];
+	static int built = 0;
+
+	if (!built)
+	{
+		memset(table, -1, sizeof(table));
+		for (int j = 0; j < nvars; j++)
+		{
+			uint32_t h = ini_hash(ini_vars[j].name) & (INI_HASH_SIZE - 1);
+			while (table[h] >= 0 && strcasecmp(ini_vars[table[h]].name, ini_vars[j].name)) h = (h + 1) & (INI_HASH_SIZE - 1);
+
+			// the last one of a name wins, as with the linear search
+			table[h] = j;
+		}
+		built = 1;
+	}
+
+	for (uint32_t h = ini_hash(name) & (INI_HASH_SIZE - 1); table[h] >= 0; h = (h + 1) & (INI_HASH_SIZE - 1))
+	{
+		if (!strcasecmp(ini_vars[table[h]].name, name)) return table[h];
+	}
+	return -1;
+}
+
 static void ini_parse_var(char* buf)
 {
 	// find var
@@ -339,11 +471,7 @@ static void ini_parse_var(char* buf)
 	}
 
 	// parse var
-	int var_id = -1;
-	for (int j = 0; j < (int)(sizeof(ini_vars) / sizeof(ini_var_t)); j++)
-	{
-		if (!strcasecmp(buf, ini_vars[j].name)) var_id = j;
-	}
+	int var_id = ini_find_var(buf);
 
 	if (var_id == -1)
 	{
@@ -404,14 +532,11 @@ static void ini_parse(int alt, const char *vmode)
 	ini_parser_debugf("Start INI parser for core \"%s\"(%s), video mode \"%s\".", user_io_get_core_name(0), user_io_get_core_name(1), vmode);
 
 	memset(line, 0, sizeof(line));
-	memset(&ini_file, 0, sizeof(ini_file));
 
 	const char *name = cfg_get_name(alt);
-	if (!FileOpen(&ini_file, name))	return;
+	if (!ini_open(name)) return;
 
-	ini_parser_debugf("Opened file %s with size %llu bytes.", name, ini_file.size);
-
-	ini_pt = 0;
+	ini_parser_debugf("Opened file %s with size %u bytes.", name, (uint32_t)ini_len);
 
 	// parse ini
 	while (1)
@@ -438,8 +563,6 @@ static void ini_parse(int alt, const char *vmode)
 		// if end of file, stop
 		if (eof) break;
 	}
-
-	FileClose(&ini_file);
 }
 
 static constexpr int CFG_ERRORS_MAX = 4;
@@ -517,7 +640,141 @@ const char* cfg_get_label(uint8_t alt)
 	return label;
 }
 
+// The resolved state of the last parse is kept in CONFIG_DIR/cfg.bin together
+// with everything the result depends on. A later parse with the same inputs
+// (typically the restart after a core switch) takes it instead of the INI.
+#define CFG_SNAP_NAME  "cfg.bin"
+#define CFG_SNAP_MAGIC 0x31474643 // "CFG1"
+
+struct cfgSnapshot
+{
+	uint32_t magic;
+	uint32_t size; // changes with cfg_t
+	uint64_t ini_size;
+	int64_t ini_mtime;
+	char ini[64];
+	char core[2][256];
+	uint8_t arcade;
+	uint8_t vertical;
+
+	// only matter if the INI has video sections
+	char vmode[2][64];
+
+	uint8_t has_video_sections;
+	uint8_t using_video_section;
+	int32_t error_count;
+	char errors[CFG_ERRORS_MAX][CFG_ERRORS_STRLEN];
+	cfg_t cfg;
+};
+
+static cfgSnapshot cfg_snap;
+static int cfg_snap_state = 0; // 0 - not loaded, 1 - valid, -1 - none
+
+static void snap_src_stat(const char *name, uint64_t *size, int64_t *mtime)
+{
+	struct stat64 st;
+	*size = 0;
+	*mtime = 0;
+	if (name[0] && !stat64(getFullPath(name), &st))
+	{
+		*size = st.st_size;
+		*mtime = st.st_mtime;
+	}
+}
+
+static void snap_store(const char *name, const void *data, int size)
+{
+	char *path = (char*)malloc(1024);
+	void *copy = malloc(size);
+	if (!path || !copy)
+	{
+		free(path);
+		free(copy);
+		return;
+	}
+
+	snprintf(path, 1024, "%s/%s", getFullPath(CONFIG_DIR), name);
+	memcpy(copy, data, size);
+
+	offload_add_work([path, copy, size]
+	{
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (fd < 0 || write(fd, copy, size) != (ssize_t)size)
+		{
+			printf("snap_store: failed to write %s\n", path);
+		}
+		if (fd >= 0) close(fd);
+		free(path);
+		free(copy);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+static void cfg_snap_key(cfgSnapshot *s, int alt)
+{
+	memset(s, 0, offsetof(cfgSnapshot, has_video_sections));
+	s->magic = CFG_SNAP_MAGIC;
+	s->size = sizeof(cfgSnapshot);
+	snprintf(s->ini, sizeof(s->ini), "%s", cfg_get_name(alt));
+	snap_src_stat(s->ini, &s->ini_size, &s->ini_mtime);
+	snprintf(s->core[0], sizeof(s->core[0]), "%s", user_io_get_core_name(0));
+	snprintf(s->core[1], sizeof(s->core[1]), "%s", user_io_get_core_name(1));
+	s->arcade = is_arcade() ? 1 : 0;
+	s->vertical = arcade_is_vertical() ? 1 : 0;
+	snprintf(s->vmode[0], sizeof(s->vmode[0]), "%s", video_get_core_mode_name(0));
+	snprintf(s->vmode[1], sizeof(s->vmode[1]), "%s", video_get_core_mode_name(1));
+}
+
+static bool cfg_snap_match(const cfgSnapshot *key)
+{
+	if (cfg_snap_state < 0) return false;
+	if (!cfg_snap_state)
+	{
+		cfg_snap_state = -1;
+		if (FileLoadConfig(CFG_SNAP_NAME, &cfg_snap, sizeof(cfg_snap)) != (int)sizeof(cfg_snap)) return false;
+		if (cfg_snap.magic != CFG_SNAP_MAGIC || cfg_snap.size != sizeof(cfgSnapshot)) return false;
+		cfg_snap_state = 1;
+	}
+
+	if (memcmp(key, &cfg_snap, offsetof(cfgSnapshot, vmode))) return false;
+	if (cfg_snap.has_video_sections)
+	{
+		if (strcmp(key->vmode[1], cfg_snap.vmode[1])) return false;
+		if (!cfg_snap.using_video_section && strcmp(key->vmode[0], cfg_snap.vmode[0])) return false;
+	}
+	return true;
+}
+
+static void cfg_parse_ini(int alt);
+
 void cfg_parse()
+{
+	int alt = altcfg();
+
+	static cfgSnapshot key;
+	cfg_snap_key(&key, alt);
+	if (cfg_snap_match(&key))
+	{
+		memcpy(&cfg, &cfg_snap.cfg, sizeof(cfg));
+		has_video_sections = cfg_snap.has_video_sections;
+		using_video_section = cfg_snap.using_video_section;
+		cfg_error_count = cfg_snap.error_count;
+		memcpy(cfg_errors, cfg_snap.errors, sizeof(cfg_errors));
+		return;
+	}
+
+	cfg_parse_ini(alt);
+
+	memcpy(&cfg_snap, &key, sizeof(cfg_snap));
+	cfg_snap.has_video_sections = has_video_sections;
+	cfg_snap.using_video_section = using_video_section;
+	cfg_snap.error_count = cfg_error_count;
+	memcpy(cfg_snap.errors, cfg_errors, sizeof(cfg_errors));
+	memcpy(&cfg_snap.cfg, &cfg, sizeof(cfg));
+	cfg_snap_state = 1;
+	snap_store(CFG_SNAP_NAME, &cfg_snap, sizeof(cfg_snap));
+}
+
+static void cfg_parse_ini(int alt)
 {
 	memset(&cfg, 0, sizeof(cfg));
 	cfg.bootscreen = 1;
@@ -529,6 +786,15 @@ void cfg_parse()
 	cfg.wheel_force = 50;
 	cfg.dvi_mode = 2;
 	cfg.hdr = 0;
+	cfg.readahead_usb = 2;
+	cfg.readahead_net = 4;
+	cfg.net_read_size = 256;
+	cfg.net_meta_ttl = 300;
+	cfg.log_level = 2;
+	cfg.hdd_cache = 16;
+	cfg.cdda_buffer = 2;
+	cfg.chd_cache = 4;
+	cfg.chd_readahead = 4;
 	cfg.hdr_max_nits = 1000;
 	cfg.hdr_avg_nits = 250;
 	cfg.video_brightness = 50;
@@ -539,11 +805,11 @@ void cfg_parse()
 	has_video_sections = false;
 	using_video_section = false;
 	cfg_error_count = 0;
-	ini_parse(altcfg(), video_get_core_mode_name(1));
+	ini_parse(alt, video_get_core_mode_name(1));
 	if (has_video_sections && !using_video_section)
 	{
 		// second pass to look for section without vrefresh
-		ini_parse(altcfg(), video_get_core_mode_name(0));
+		ini_parse(alt, video_get_core_mode_name(0));
 	}
 
 	if (strlen(cfg.vga_mode))
@@ -700,7 +966,49 @@ static int yc_parse_mode(char* buf, yc_mode *mode)
 	return 1;
 }
 
+// yc.txt result for the current core, kept the same way as cfg.bin
+#define YC_SNAP_NAME  "yc.bin"
+#define YC_SNAP_MAGIC 0x31504E53 // "SNP1"
+
+struct ycSnapshot
+{
+	uint32_t magic;
+	uint32_t size;
+	uint64_t src_size;
+	int64_t src_mtime;
+	char core[256];
+	int32_t max;
+};
+
+static void yc_parse_txt(yc_mode *yc_table, int max);
+
 void yc_parse(yc_mode *yc_table, int max)
+{
+	int size = sizeof(ycSnapshot) + max * sizeof(yc_mode);
+	std::vector<uint8_t> snap(size);
+
+	ycSnapshot key;
+	memset(&key, 0, sizeof(key));
+	key.magic = YC_SNAP_MAGIC;
+	key.size = sizeof(yc_mode);
+	snap_src_stat("yc.txt", &key.src_size, &key.src_mtime);
+	snprintf(key.core, sizeof(key.core), "%s", user_io_get_core_name(1));
+	key.max = max;
+
+	if (FileLoadConfig(YC_SNAP_NAME, snap.data(), size) == size && !memcmp(snap.data(), &key, sizeof(key)))
+	{
+		memcpy(yc_table, snap.data() + sizeof(key), max * sizeof(yc_mode));
+		return;
+	}
+
+	yc_parse_txt(yc_table, max);
+
+	memcpy(snap.data(), &key, sizeof(key));
+	memcpy(snap.data() + sizeof(key), yc_table, max * sizeof(yc_mode));
+	snap_store(YC_SNAP_NAME, snap.data(), size);
+}
+
+static void yc_parse_txt(yc_mode *yc_table, int max)
 {
 	memset(yc_table, 0, max * sizeof(yc_mode));
 
@@ -708,17 +1016,15 @@ void yc_parse(yc_mode *yc_table, int max)
 	int eof;
 
 	memset(line, 0, sizeof(line));
-	memset(&ini_file, 0, sizeof(ini_file));
 
 	const char *corename = user_io_get_core_name(1);
 	int corename_len = strlen(corename);
 
 	const char *name = "yc.txt";
-	if (!FileOpen(&ini_file, name))	return;
+	if (!ini_open(name)) return;
 
-	ini_parser_debugf("Opened file %s with size %llu bytes.", name, ini_file.size);
+	ini_parser_debugf("Opened file %s with size %u bytes.", name, (uint32_t)ini_len);
 
-	ini_pt = 0;
 	int n = 0;
 
 	while (n < max)
@@ -734,6 +1040,4 @@ void yc_parse(yc_mode *yc_table, int max)
 		// if end of file, stop
 		if (eof) break;
 	}
-
-	FileClose(&ini_file);
 }
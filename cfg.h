@@ -27,6 +27,7 @@ typedef struct {
 	uint8_t vsync_adjust;
 	uint8_t kbd_nomouse;
 	uint8_t mouse_throttle;
+	uint8_t mouse_sync;
 	uint8_t bootscreen;
 	uint8_t vscale_mode;
 	uint16_t vscale_border;
@@ -57,6 +58,7 @@ typedef struct {
 	uint8_t shmask_mode_default;
 	int bt_auto_disconnect;
 	int bt_reset_before_pair;
+	int bt_low_latency;
 	char bootcore[256];
 	char video_conf[1024];
 	char video_conf_pal[1024];
@@ -97,6 +99,31 @@ typedef struct {
 	uint32_t controller_unique_mapping[256];
 	char osd_lock[25];
 	uint16_t osd_lock_time;
+	uint8_t idle_sleep;
+	uint8_t input_thread;
+	uint16_t rbf_cache;
+	uint16_t unzip_cache;
+	uint16_t game_prefetch;
+	uint8_t readahead_usb;
+	uint8_t readahead_net;
+	uint16_t net_read_size;
+	uint16_t net_meta_ttl;
+	uint16_t hdd_cache;
+	uint16_t hdd_write_delay;
+	uint8_t cdda_buffer;
+	uint8_t chd_cache;
+	uint8_t chd_readahead;
+	uint16_t cd_preload;
+	uint8_t core_switch_inplace;
+	uint16_t midi_bridge;
+	uint8_t savestate_compress;
+	uint16_t rewind;
+	uint16_t save_write_delay;
+	uint16_t cmd_tcp_port;
+	uint16_t cache_budget;
+	uint8_t log_level;
+	char log_file[256];
+	uint8_t library_index;
 } cfg_t;
 
 extern cfg_t cfg;
@@ -5,9 +5,11 @@
 #include <stdbool.h>
 #include <limits.h>
 #include <ctype.h>
+#include <sys/stat.h>
 
 #include "hardware.h"
 #include "file_io.h"
+#include "shcache.h"
 
 
 // *character font
@@ -174,8 +176,33 @@ unsigned char charfont[256][8] =
 
 static unsigned char tempfont[2048];
 
+// Converted glyphs are kept in the shared cache: the first character and the
+// glyphs from it on, keyed by path, size and date of the font file. Startup
+// and core changes take them from RAM.
+static int font_key(const char *name, char *key, int size)
+{
+	struct stat64 st;
+	const char *path = getFullPath(name);
+	if (stat64(path, &st) < 0 || !S_ISREG(st.st_mode)) return 0;
+
+	snprintf(key, size, "%s@%lld.%lld", path, (long long)st.st_size, (long long)st.st_mtime);
+	return 1;
+}
+
 void LoadFont(char* name)
 {
+	char key[1100];
+	int cached = font_key(name, key, sizeof(key));
+	if (cached)
+	{
+		size_t len = 0;
+		uint8_t *rec = (uint8_t*)shcache_load(key, &len);
+		int ok = rec && len > 1 && !((len - 1) % 8) && rec[0] + (len - 1) / 8 <= 256;
+		if (ok) memcpy(charfont[rec[0]], rec + 1, len - 1);
+		free(rec);
+		if (ok) return;
+	}
+
 	memset(tempfont, 0, sizeof(tempfont));
 
 	int sz = FileLoad(name, tempfont, sizeof(tempfont));
@@ -194,6 +221,7 @@ void LoadFont(char* name)
 		}
 	}
 
+	int first = ch;
 	for (int pos = start; pos < sz; pos += 8)
 	{
 		int n = 0;
@@ -214,4 +242,12 @@ void LoadFont(char* name)
 
 		ch++;
 	}
+
+	if (cached && ch > first)
+	{
+		static uint8_t rec[1 + sizeof(charfont)];
+		rec[0] = first;
+		memcpy(rec + 1, charfont[first], (ch - first) * 8);
+		shcache_store(key, rec, 1 + (ch - first) * 8);
+	}
 }
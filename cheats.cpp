@@ -7,6 +7,8 @@
 #include <ctype.h>
 #include <vector>
 #include <algorithm>
+#include <string>
+#include <sys/stat.h>
 
 #include "hardware.h"
 #include "file_io.h"
@@ -16,6 +18,7 @@
 #include "osd.h"
 #include "cheats.h"
 #include "support.h"
+#include "cd.h"
 
 struct cheat_rec_t
 {
@@ -48,6 +51,12 @@ static int iSelectedEntry = 0;
 static int iFirstEntry = 0;
 static int loaded = 0;
 
+#define CHEAT_SIZE (128*16) // 128 codes max
+
+// Codes of the enabled cheats packed in list order, spliced on each toggle.
+static uint8_t cheat_buff[CHEAT_SIZE];
+static int cheat_pos = 0;
+
 struct CheatComp
 {
 	bool operator()(const cheat_rec_t& ce1, const cheat_rec_t& ce2)
@@ -68,16 +77,43 @@ struct CheatComp
 
 static char cheat_zip[1024] = {};
 
-static int find_by_crc(uint32_t romcrc)
+// The CRC named zips ("Name [1234ABCD].zip") of the cheats dir of a core,
+// sorted by CRC: uint32_t count, count cheat_crc_t, then the names. Kept in
+// cdinfo by the mtime of the dir, which changes whenever files come or go.
+struct cheat_crc_t
 {
-	if (!romcrc) return 0;
+	uint32_t crc;
+	uint32_t name; // offset of the name in the index
+};
 
-	sprintf(cheat_zip, "%s/cheats/%s", getRootDir(), CoreName);
-	DIR *d = opendir(cheat_zip);
+static std::vector<uint8_t> crc_index;
+static char crc_dir[1024] = {};
+static time_t crc_mtime = 0;
+
+static int crc_index_valid()
+{
+	uint32_t size = crc_index.size();
+	if (size < 4) return 0;
+
+	uint32_t count = *(uint32_t*)crc_index.data();
+	if (count > (size - 4) / sizeof(cheat_crc_t)) return 0;
+
+	const cheat_crc_t *e = (const cheat_crc_t*)(crc_index.data() + 4);
+	for (uint32_t i = 0; i < count; i++) if (e[i].name >= size) return 0;
+	return !count || !crc_index.back();
+}
+
+static void crc_index_build(const char *dir)
+{
+	std::vector<cheat_crc_t> entries;
+	std::string names;
+
+	crc_index.clear();
+	DIR *d = opendir(dir);
 	if (!d)
 	{
-		printf("Couldn't open dir: %s\n", cheat_zip);
-		return 0;
+		printf("Couldn't open dir: %s\n", dir);
+		return;
 	}
 
 	struct dirent *de;
@@ -91,20 +127,59 @@ static int find_by_crc(uint32_t romcrc)
 				uint32_t crc = 0;
 				if (sscanf(de->d_name + len - 14, "[%X].zip", &crc) == 1)
 				{
-					if (crc == romcrc)
-					{
-						strcat(cheat_zip, "/");
-						strcat(cheat_zip, de->d_name);
-						closedir(d);
-						return 1;
-					}
+					entries.push_back({ crc, (uint32_t)names.size() });
+					names.append(de->d_name, len + 1);
 				}
 			}
 		}
 	}
-
 	closedir(d);
-	return 0;
+
+	// first one in dir order wins
+	std::stable_sort(entries.begin(), entries.end(), [](const cheat_crc_t &a, const cheat_crc_t &b) { return a.crc < b.crc; });
+
+	uint32_t count = entries.size();
+	uint32_t base = 4 + count * sizeof(cheat_crc_t);
+	for (auto &e : entries) e.name += base;
+
+	crc_index.resize(base + names.size());
+	memcpy(crc_index.data(), &count, 4);
+	if (count) memcpy(crc_index.data() + 4, entries.data(), count * sizeof(cheat_crc_t));
+	if (names.size()) memcpy(crc_index.data() + base, names.data(), names.size());
+
+	cd_info_store(dir, "cheatcrc", crc_index.data(), crc_index.size());
+}
+
+static int find_by_crc(uint32_t romcrc)
+{
+	if (!romcrc) return 0;
+
+	sprintf(cheat_zip, "%s/cheats/%s", getRootDir(), CoreName);
+
+	struct stat64 st;
+	if (stat64(cheat_zip, &st) < 0)
+	{
+		printf("Couldn't open dir: %s\n", cheat_zip);
+		return 0;
+	}
+
+	if (strcmp(crc_dir, cheat_zip) || crc_mtime != st.st_mtime)
+	{
+		if (!cd_info_load(cheat_zip, "cheatcrc", crc_index) || !crc_index_valid()) crc_index_build(cheat_zip);
+		strcpy(crc_dir, cheat_zip);
+		crc_mtime = st.st_mtime;
+	}
+
+	if (!crc_index_valid()) return 0;
+
+	uint32_t count = *(uint32_t*)crc_index.data();
+	const cheat_crc_t *e = (const cheat_crc_t*)(crc_index.data() + 4);
+	const cheat_crc_t *hit = std::lower_bound(e, e + count, romcrc, [](const cheat_crc_t &a, uint32_t crc) { return a.crc < crc; });
+	if (hit == e + count || hit->crc != romcrc) return 0;
+
+	strcat(cheat_zip, "/");
+	strcat(cheat_zip, (const char*)crc_index.data() + hit->name);
+	return 1;
 }
 
 static int find_in_same_dir(const char *name)
@@ -174,6 +249,7 @@ void cheats_init(const char *rom_path, uint32_t romcrc)
 {
 	cheats.clear();
 	loaded = 0;
+	cheat_pos = 0;
 	cheat_zip[0] = 0;
 
 	// reset cheats
@@ -409,37 +485,24 @@ void cheats_print()
 	}
 }
 
-#define CHEAT_SIZE (128*16) // 128 codes max
-
-static void cheats_send()
+// where the codes of an entry go in cheat_buff
+static int cheats_offset(int entry)
 {
-	static uint8_t buff[CHEAT_SIZE];
 	int pos = 0;
+	for (int i = 0; i < entry; i++) if (cheats[i].enabled) pos += cheats[i].cheatSize;
+	return pos;
+}
 
-	for (int i = 0; i < cheats_available(); i++)
-	{
-		if (cheats[i].enabled)
-		{
-			if (cheats[i].cheatData)
-			{
-				memcpy(&buff[pos],cheats[i].cheatData,cheats[i].cheatSize);
-				pos += cheats[i].cheatSize;
-			}
-			else
-			{
-				printf("Consistency error, memory for cheat not allocated, but cheat was enabled -> disable.\n");
-				cheats[i].cheatSize = 0;
-				cheats[i].enabled = false;
-			}
-		}
-	}
-
-	loaded = pos / 16;
+// The core takes the table from address 0 and counts the codes by its
+// length, so the whole table goes out. It's 2KB at most.
+static void cheats_send()
+{
+	loaded = cheat_pos / 16;
 	printf("Cheat codes: %d\n", loaded);
 
 	user_io_set_index(255);
 	user_io_set_download(1);
-	user_io_file_tx_data(buff, pos ? pos : 2);
+	user_io_file_tx_data(cheat_buff, cheat_pos ? cheat_pos : 2);
 	user_io_set_download(0);
 }
 
@@ -450,6 +513,11 @@ void cheats_toggle()
 	if (cheats[iSelectedEntry].enabled == true)
 	{
 		/* disabled loaded cheat, free data */
+		int off = cheats_offset(iSelectedEntry);
+		int size = cheats[iSelectedEntry].cheatSize;
+		memmove(cheat_buff + off, cheat_buff + off + size, cheat_pos - off - size);
+		cheat_pos -= size;
+
 		if (cheats[iSelectedEntry].cheatData)
 		{
 			delete[] cheats[iSelectedEntry].cheatData;
@@ -489,6 +557,11 @@ void cheats_toggle()
 				{
 					if (FileReadAdv(&f, cheats[iSelectedEntry].cheatData, len) == len)
 					{
+						int off = cheats_offset(iSelectedEntry);
+						memmove(cheat_buff + off + len, cheat_buff + off, cheat_pos - off);
+						memcpy(cheat_buff + off, cheats[iSelectedEntry].cheatData, len);
+						cheat_pos += len;
+
 						cheats[iSelectedEntry].cheatSize = len;
 						cheats[iSelectedEntry].enabled = true;
 						changedCheats = true;
@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <string>
+
+#include "cmdsock.h"
+#include "counters.h"
+#include "hardware.h"
+#include "input.h"
+#include "library.h"
+#include "loadlog.h"
+#include "membudget.h"
+#include "scheduler.h"
+
+#define CMDSOCK_CLIENTS 8
+#define CMDSOCK_LINE    1024
+#define CMDSOCK_FOUND   500 // library find lines per reply
+
+struct cmdClient
+{
+	int fd;
+	int http;
+	int len;
+	char buf[CMDSOCK_LINE];
+};
+
+static int unix_fd = -1;
+static int tcp_fd = -1;
+static int wake_fd = -1;
+static int wake_watched = 0;
+static pthread_t sock_tid;
+static cmdClient clients[CMDSOCK_CLIENTS];
+
+// The socket thread hands one request at a time to the main loop and waits
+// for the reply, commands and metrics snapshots run where everything else does.
+static pthread_mutex_t req_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t req_cond = PTHREAD_COND_INITIALIZER;
+static std::atomic<int> req_pending;
+static std::string req_line, req_reply;
+static int req_http = 0;
+
+// histogram id, or HIST_NUM for the input latency
+static const char *hist_load(int id, uint32_t *buckets)
+{
+	if (id == HIST_NUM)
+	{
+		input_latency_buckets(buckets);
+		return "input_latency_us";
+	}
+
+	for (int n = 0; n < HIST_BUCKETS; n++) buckets[n] = g_histograms[id][n].load(std::memory_order_relaxed);
+	return histogram_name(id);
+}
+
+static void metrics_prom(std::string &out)
+{
+	char line[160];
+	snprintf(line, sizeof(line), "# TYPE mister_uptime_ms gauge\nmister_uptime_ms %lu\n", GetTimer(0));
+	out += line;
+
+	for (int i = 0; i < CNT_NUM; i++)
+	{
+		snprintf(line, sizeof(line), "# TYPE mister_%s_total counter\nmister_%s_total %llu\n", counter_name(i), counter_name(i),
+			(unsigned long long)g_counters[i].load(std::memory_order_relaxed));
+		out += line;
+	}
+
+	// bucket n holds [2^(n-1), 2^n), so its le is 2^n - 1. The last one is open ended.
+	for (int i = 0; i <= HIST_NUM; i++)
+	{
+		uint32_t buckets[HIST_BUCKETS];
+		const char *name = hist_load(i, buckets);
+
+		snprintf(line, sizeof(line), "# TYPE mister_%s histogram\n", name);
+		out += line;
+
+		uint64_t sum = 0;
+		for (int n = 0; n < HIST_BUCKETS - 1; n++)
+		{
+			sum += buckets[n];
+			snprintf(line, sizeof(line), "mister_%s_bucket{le=\"%u\"} %llu\n", name, (1u << n) - 1, (unsigned long long)sum);
+			out += line;
+		}
+		sum += buckets[HIST_BUCKETS - 1];
+		snprintf(line, sizeof(line), "mister_%s_bucket{le=\"+Inf\"} %llu\nmister_%s_count %llu\n", name, (unsigned long long)sum, name, (unsigned long long)sum);
+		out += line;
+	}
+
+	snprintf(line, sizeof(line), "# TYPE mister_cache_budget_bytes gauge\nmister_cache_budget_bytes %zu\n# TYPE mister_cache_bytes gauge\n", membudget_limit());
+	out += line;
+	for (int i = 0; i < membudget_num(); i++)
+	{
+		snprintf(line, sizeof(line), "mister_cache_bytes{cache=\"%s\"} %zu\n", membudget_name(i), membudget_size(i));
+		out += line;
+	}
+}
+
+static void metrics_json(std::string &out)
+{
+	char str[128];
+	snprintf(str, sizeof(str), "{\"uptime_ms\":%lu,\"counters\":{", GetTimer(0));
+	out += str;
+
+	for (int i = 0; i < CNT_NUM; i++)
+	{
+		snprintf(str, sizeof(str), "%s\"%s\":%llu", i ? "," : "", counter_name(i), (unsigned long long)g_counters[i].load(std::memory_order_relaxed));
+		out += str;
+	}
+	out += "},\"histograms\":{";
+
+	for (int i = 0; i <= HIST_NUM; i++)
+	{
+		uint32_t buckets[HIST_BUCKETS];
+		const char *name = hist_load(i, buckets);
+
+		uint64_t total = 0;
+		for (int n = 0; n < HIST_BUCKETS; n++) total += buckets[n];
+
+		snprintf(str, sizeof(str), "%s\"%s\":{\"count\":%llu,\"p50\":%u,\"p99\":%u,\"buckets\":[", i ? "," : "", name, (unsigned long long)total,
+			histogram_percentile(buckets, total, 500), histogram_percentile(buckets, total, 990));
+		out += str;
+
+		for (int n = 0; n < HIST_BUCKETS; n++)
+		{
+			snprintf(str, sizeof(str), "%s%u", n ? "," : "", buckets[n]);
+			out += str;
+		}
+		out += "]}";
+	}
+
+	snprintf(str, sizeof(str), "},\"cache_budget\":%zu,\"caches\":{", membudget_limit());
+	out += str;
+	for (int i = 0; i < membudget_num(); i++)
+	{
+		snprintf(str, sizeof(str), "%s\"%s\":%zu", i ? "," : "", membudget_name(i), membudget_size(i));
+		out += str;
+	}
+	out += "}}\n";
+}
+
+// main loop
+static void run_request(const std::string &req, int http, std::string &out)
+{
+	if (http)
+	{
+		// "GET /metrics HTTP/1.1"
+		std::string body;
+		const char *status = "200 OK";
+		const char *type = "text/plain; version=0.0.4";
+		if (!req.compare(0, 18, "GET /metrics.json ")) { metrics_json(body); type = "application/json"; }
+		else if (!req.compare(0, 13, "GET /metrics ")) metrics_prom(body);
+		else
+		{
+			status = "404 Not Found";
+			body = "GET /metrics or /metrics.json\n";
+		}
+
+		char head[200];
+		snprintf(head, sizeof(head), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", status, type, (uint32_t)body.size());
+		out = head;
+		out += body;
+		return;
+	}
+
+	if (req == "metrics") metrics_prom(out);
+	else if (req == "metrics json") metrics_json(out);
+	else if (req == "loads") loadlog_report(out);
+	else if (req == "library")
+	{
+		int files, dirs, busy;
+		library_status(&files, &dirs, &busy);
+		char line[100];
+		snprintf(line, sizeof(line), "files %d\nfolders %d\nbusy %d\n", files, dirs, busy);
+		out = line;
+	}
+	else if (!req.compare(0, 13, "library find "))
+	{
+		// "library find SNES/ mario" looks in games/SNES only
+		std::string text = req.substr(13), core;
+		size_t sp = text.find("/ ");
+		if (sp != std::string::npos && text.find(' ') > sp)
+		{
+			core = text.substr(0, sp);
+			text = text.substr(sp + 2);
+		}
+
+		std::vector<libMatch> found;
+		int cnt = library_find(text.c_str(), core.c_str(), found, CMDSOCK_FOUND);
+		for (auto &m : found)
+		{
+			char size[32];
+			snprintf(size, sizeof(size), "\t%llu\n", (unsigned long long)m.size);
+			out += m.path;
+			out += size;
+		}
+		if (cnt > (int)found.size())
+		{
+			char more[64];
+			snprintf(more, sizeof(more), "%d more\n", cnt - (int)found.size());
+			out += more;
+		}
+	}
+	else
+	{
+		printf("MiSTer_sock: %s\n", req.c_str());
+
+		static char cmd[CMDSOCK_LINE];
+		snprintf(cmd, sizeof(cmd), "%s", req.c_str());
+		if (!input_cmd(cmd))
+		{
+			out = "error: unknown command\n";
+			return;
+		}
+	}
+	out += "ok\n";
+}
+
+void cmdsock_poll()
+{
+	if (wake_fd < 0) return;
+
+	// the scheduler has its epoll set up by now
+	if (!wake_watched)
+	{
+		scheduler_watch_fd(wake_fd, EPOLLIN);
+		wake_watched = 1;
+	}
+
+	if (!req_pending.load(std::memory_order_acquire)) return;
+
+	// the wake up is written before the request is marked as pending
+	uint64_t val;
+	if (read(wake_fd, &val, sizeof(val)) < 0) {}
+
+	pthread_mutex_lock(&req_lock);
+	std::string req = req_line;
+	int http = req_http;
+	pthread_mutex_unlock(&req_lock);
+
+	std::string reply;
+	run_request(req, http, reply);
+
+	pthread_mutex_lock(&req_lock);
+	req_reply.swap(reply);
+	req_pending.store(0, std::memory_order_release);
+	pthread_cond_signal(&req_cond);
+	pthread_mutex_unlock(&req_lock);
+}
+
+// socket thread from here on
+static std::string request(const char *line, int http)
+{
+	pthread_mutex_lock(&req_lock);
+	req_line = line;
+	req_http = http;
+	req_reply.clear();
+
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof(one)) < 0) {}
+	req_pending.store(1, std::memory_order_release);
+
+	while (req_pending.load(std::memory_order_acquire)) pthread_cond_wait(&req_cond, &req_lock);
+
+	std::string reply;
+	reply.swap(req_reply);
+	pthread_mutex_unlock(&req_lock);
+	return reply;
+}
+
+static void client_close(cmdClient *c)
+{
+	close(c->fd);
+	c->fd = -1;
+}
+
+static int client_send(cmdClient *c, const std::string &data)
+{
+	size_t done = 0;
+	while (done < data.size())
+	{
+		ssize_t n = send(c->fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		done += n;
+	}
+	return 1;
+}
+
+static void client_accept(int lfd, int http)
+{
+	int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+	if (fd < 0) return;
+
+	for (int i = 0; i < CMDSOCK_CLIENTS; i++)
+	{
+		cmdClient *c = &clients[i];
+		if (c->fd >= 0) continue;
+
+		// a client which doesn't read its replies mustn't hold up the others for long
+		struct timeval tv = { 2, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		c->fd = fd;
+		c->http = http;
+		c->len = 0;
+		return;
+	}
+
+	close(fd);
+}
+
+static void client_read(cmdClient *c)
+{
+	int n = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+	if (n <= 0)
+	{
+		client_close(c);
+		return;
+	}
+	c->len += n;
+	c->buf[c->len] = 0;
+	int full = c->len >= (int)sizeof(c->buf) - 1;
+
+	if (c->http)
+	{
+		// all of the headers are read, closing with unread data would reset the connection
+		if (!full && !strstr(c->buf, "\r\n\r\n") && !strstr(c->buf, "\n\n")) return;
+
+		c->buf[strcspn(c->buf, "\r\n")] = 0;
+		client_send(c, request(c->buf, 1));
+		client_close(c);
+		return;
+	}
+
+	char *line = c->buf;
+	char *end;
+	while ((end = strchr(line, '\n')))
+	{
+		*end = 0;
+		if (end > line && end[-1] == '\r') end[-1] = 0;
+		if (*line && !client_send(c, request(line, 0)))
+		{
+			client_close(c);
+			return;
+		}
+		line = end + 1;
+	}
+
+	c->len -= line - c->buf;
+	memmove(c->buf, line, c->len + 1);
+
+	if (full && c->len >= (int)sizeof(c->buf) - 1)
+	{
+		client_send(c, "error: line too long\n");
+		client_close(c);
+	}
+}
+
+static void *sock_thread(void *)
+{
+	for (;;)
+	{
+		struct pollfd fds[2 + CMDSOCK_CLIENTS];
+		fds[0] = { unix_fd, POLLIN, 0 };
+		fds[1] = { tcp_fd, POLLIN, 0 };
+		for (int i = 0; i < CMDSOCK_CLIENTS; i++) fds[2 + i] = { clients[i].fd, POLLIN, 0 };
+
+		if (poll(fds, 2 + CMDSOCK_CLIENTS, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		for (int i = 0; i < CMDSOCK_CLIENTS; i++) if (fds[2 + i].revents) client_read(&clients[i]);
+		if (fds[0].revents & POLLIN) client_accept(unix_fd, 0);
+		if (fds[1].revents & POLLIN) client_accept(tcp_fd, 1);
+	}
+
+	printf("cmdsock: poll failed (%d)\n", errno);
+	return 0;
+}
+
+static int listen_unix()
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", CMDSOCK_PATH);
+
+	unlink(CMDSOCK_PATH);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+	{
+		printf("cmdsock: cannot listen on %s (%d)\n", CMDSOCK_PATH, errno);
+		close(fd);
+		return -1;
+	}
+
+	// anyone who may write to MiSTer_cmd
+	chmod(CMDSOCK_PATH, 0666);
+	return fd;
+}
+
+static int listen_tcp(uint16_t port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+	{
+		printf("cmdsock: cannot listen on port %u (%d)\n", port, errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void cmdsock_start(uint16_t tcp_port)
+{
+	if (wake_fd >= 0) return;
+
+	for (int i = 0; i < CMDSOCK_CLIENTS; i++) clients[i].fd = -1;
+
+	unix_fd = listen_unix();
+	if (tcp_port) tcp_fd = listen_tcp(tcp_port);
+	if (unix_fd < 0 && tcp_fd < 0) return;
+
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd < 0 || pthread_create(&sock_tid, nullptr, sock_thread, nullptr))
+	{
+		printf("cmdsock: cannot start the socket thread\n");
+		if (wake_fd >= 0) close(wake_fd);
+		if (unix_fd >= 0) close(unix_fd);
+		if (tcp_fd >= 0) close(tcp_fd);
+		wake_fd = unix_fd = tcp_fd = -1;
+		return;
+	}
+
+	pthread_detach(sock_tid);
+	if (tcp_fd >= 0) printf("cmdsock: metrics on port %u\n", tcp_port);
+}
@@ -0,0 +1,21 @@
+#ifndef CMDSOCK_H
+#define CMDSOCK_H
+
+#include <inttypes.h>
+
+// MiSTer_cmd with replies. CMDSOCK_PATH takes one command per line and ends
+// the answer to each with a line "ok" or "error: ...". "metrics" answers with
+// the counters, histograms and input latency in Prometheus text format first,
+// "metrics json" with the same as one line of JSON. With cmd_tcp_port set in
+// MiSTer.ini the metrics are also served over HTTP (GET /metrics and
+// /metrics.json) for scraping. TCP takes no commands. "library" and
+// "library find [<core>/ ]<text>" query the games index (library.h), "loads"
+// gives the load times per core (loadlog.h).
+#define CMDSOCK_PATH "/dev/MiSTer_sock"
+
+void cmdsock_start(uint16_t tcp_port);
+
+// runs the pending request, if any. co_poll, under input_lock().
+void cmdsock_poll();
+
+#endif
@@ -0,0 +1,253 @@
+#include "counters.h"
+#include "hardware.h"
+
+#include <stdio.h>
+#include <string.h>
+
+std::atomic<uint64_t> g_counters[CNT_NUM];
+std::atomic<uint32_t> g_histograms[HIST_NUM][HIST_BUCKETS];
+
+static const char *counter_names[CNT_NUM] =
+{
+	"loop",
+	"spi_bytes",
+	"spi_in",
+	"file_read",
+	"ra_hit",
+	"ra_miss",
+	"hdd_hit",
+	"hdd_miss",
+	"cdda_underrun",
+	"cd_late",
+	"chd_hit",
+	"chd_miss",
+	"midi_out",
+	"midi_in",
+	"cache_trim_bytes",
+	"log_dropped",
+};
+
+static const char *histogram_names[HIST_NUM] =
+{
+	"co_poll_us",
+	"co_ui_us",
+	"midi_us",
+	"file_read_us",
+	"file_tx_us",
+};
+
+// values of the previous dump, for the rates
+static uint64_t last_values[CNT_NUM];
+static uint32_t last_time = 0;
+
+uint32_t histogram_percentile(const uint32_t *buckets, uint64_t total, uint32_t permille)
+{
+	if (!total) return 0;
+
+	uint64_t limit = (total * permille + 999) / 1000;
+	uint64_t sum = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+	{
+		sum += buckets[i];
+		if (sum >= limit) return 1u << i;
+	}
+	return 1u << (HIST_BUCKETS - 1);
+}
+
+const char *counter_name(int id)
+{
+	return counter_names[id];
+}
+
+const char *histogram_name(int id)
+{
+	return histogram_names[id];
+}
+
+void counters_dump()
+{
+	FILE *fp = fopen(COUNTERS_FILE, "w");
+	if (!fp)
+	{
+		printf("counters: cannot create %s\n", COUNTERS_FILE);
+		return;
+	}
+
+	uint32_t now = counters_time_us();
+	uint32_t elapsed = now - last_time;
+
+	fprintf(fp, "# name total per_sec\n");
+	for (int i = 0; i < CNT_NUM; i++)
+	{
+		uint64_t value = g_counters[i].load(std::memory_order_relaxed);
+		uint64_t rate = (last_time && elapsed) ? (value - last_values[i]) * 1000000ULL / elapsed : 0;
+		fprintf(fp, "%s %llu %llu\n", counter_names[i], (unsigned long long)value, (unsigned long long)rate);
+		last_values[i] = value;
+	}
+	last_time = now;
+
+	fprintf(fp, "# name count p50 p99 max (us, bucket upper bounds) buckets...\n");
+	for (int i = 0; i < HIST_NUM; i++)
+	{
+		uint32_t buckets[HIST_BUCKETS];
+		uint64_t total = 0;
+		int top = 0;
+		for (int n = 0; n < HIST_BUCKETS; n++)
+		{
+			buckets[n] = g_histograms[i][n].load(std::memory_order_relaxed);
+			total += buckets[n];
+			if (buckets[n]) top = n;
+		}
+
+		fprintf(fp, "%s %llu %u %u %u", histogram_names[i], (unsigned long long)total,
+			histogram_percentile(buckets, total, 500), histogram_percentile(buckets, total, 990), 1u << top);
+		for (int n = 0; n <= top; n++) fprintf(fp, " %u", buckets[n]);
+		fprintf(fp, "\n");
+	}
+
+	fclose(fp);
+	printf("counters: written to %s\n", COUNTERS_FILE);
+}
+
+struct SpiStats
+{
+	uint64_t frames;
+	uint64_t bytes_out; // including single words
+	uint64_t bytes_in;  // block reads only
+	uint64_t ns;
+};
+
+static SpiStats spi_stats[SPI_CS_NUM][256];
+static int spi_stats_enabled = 0;
+static int spi_frame_cs = -1;
+static uint64_t spi_frame_ns, spi_frame_bytes, spi_frame_in;
+int spi_stats_cmd = 0;
+
+static uint64_t spi_stats_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void spi_stats_begin(int cs)
+{
+	if (!spi_stats_enabled || spi_frame_cs >= 0) return;
+
+	spi_frame_cs = cs;
+	spi_frame_bytes = g_counters[CNT_SPI_BYTES].load(std::memory_order_relaxed);
+	spi_frame_in = g_counters[CNT_SPI_IN].load(std::memory_order_relaxed);
+	spi_stats_cmd = -1;
+	spi_frame_ns = spi_stats_now();
+}
+
+void spi_stats_end()
+{
+	if (spi_frame_cs < 0) return;
+
+	uint64_t ns = spi_stats_now() - spi_frame_ns;
+	uint64_t bytes = g_counters[CNT_SPI_BYTES].load(std::memory_order_relaxed) - spi_frame_bytes;
+	uint64_t in = g_counters[CNT_SPI_IN].load(std::memory_order_relaxed) - spi_frame_in;
+
+	// frames without any transfer don't carry a command
+	if (bytes)
+	{
+		SpiStats *s = &spi_stats[spi_frame_cs][spi_stats_cmd & 0xFF];
+		s->frames++;
+		s->bytes_out += bytes - in;
+		s->bytes_in += in;
+		s->ns += ns;
+	}
+
+	spi_frame_cs = -1;
+	spi_stats_cmd = 0;
+}
+
+static void spi_stats_dump()
+{
+	static const char *cs_names[SPI_CS_NUM] = { "io", "fpga", "osd" };
+
+	FILE *fp = fopen(SPI_STATS_FILE, "w");
+	if (!fp)
+	{
+		printf("spi_stats: cannot create %s\n", SPI_STATS_FILE);
+		return;
+	}
+
+	fprintf(fp, "# cs cmd frames bytes_out bytes_in total_us\n");
+	for (int cs = 0; cs < SPI_CS_NUM; cs++)
+	{
+		for (int cmd = 0; cmd < 256; cmd++)
+		{
+			SpiStats *s = &spi_stats[cs][cmd];
+			if (!s->frames) continue;
+
+			fprintf(fp, "%s 0x%02X %llu %llu %llu %llu\n", cs_names[cs], cmd, (unsigned long long)s->frames,
+				(unsigned long long)s->bytes_out, (unsigned long long)s->bytes_in, (unsigned long long)(s->ns / 1000));
+		}
+	}
+
+	fclose(fp);
+	printf("spi_stats: written to %s\n", SPI_STATS_FILE);
+}
+
+void spi_stats_command(const char *cmd)
+{
+	if (!strcmp(cmd, "on")) spi_stats_enabled = 1;
+	else if (!strcmp(cmd, "off")) spi_stats_enabled = 0;
+	else if (!strcmp(cmd, "dump")) spi_stats_dump();
+	else if (!strcmp(cmd, "reset")) memset(spi_stats, 0, sizeof(spi_stats));
+	else printf("spi_stats: unknown command '%s'\n", cmd);
+}
+
+struct BootPhase
+{
+	const char *name;
+	uint32_t start, end;
+};
+
+static constexpr int MAX_BOOT_PHASES = 32;
+static BootPhase boot_phases[MAX_BOOT_PHASES];
+static int boot_phase_num = 0;
+static int boot_phase_open = 0;
+
+void boot_phase_add(const char *name, uint32_t start, uint32_t end)
+{
+	if (boot_phase_num >= MAX_BOOT_PHASES) return;
+	boot_phases[boot_phase_num++] = { name, start, end };
+}
+
+static void boot_phase_close()
+{
+	if (boot_phase_open) boot_phases[boot_phase_open - 1].end = GetTimer(0);
+	boot_phase_open = 0;
+}
+
+void boot_phase(const char *name)
+{
+	boot_phase_close();
+	if (boot_phase_num >= MAX_BOOT_PHASES) return;
+
+	uint32_t now = GetTimer(0);
+	boot_phases[boot_phase_num++] = { name, now, now };
+	boot_phase_open = boot_phase_num;
+}
+
+void boot_done()
+{
+	boot_phase_close();
+	if (!boot_phase_num) return;
+
+	FILE *fp = fopen(BOOT_FILE, "w");
+	if (fp) fprintf(fp, "# phase start end duration (ms since kernel boot)\n");
+
+	printf("Boot timeline:\n");
+	for (int i = 0; i < boot_phase_num; i++)
+	{
+		BootPhase *p = &boot_phases[i];
+		printf("  %-20s %6u ms (at %u)\n", p->name, p->end - p->start, p->start);
+		if (fp) fprintf(fp, "%s %u %u %u\n", p->name, p->start, p->end, p->end - p->start);
+	}
+
+	if (fp) fclose(fp);
+}
@@ -0,0 +1,114 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <inttypes.h>
+#include <time.h>
+#include <atomic>
+
+// Always-on performance counters. Updating one is a single relaxed atomic
+// add, so they stay compiled in for regular builds. "counters" in MiSTer_cmd
+// writes the current values to COUNTERS_FILE.
+
+#define COUNTERS_FILE "/tmp/MiSTer_counters"
+
+enum
+{
+	CNT_LOOP,      // main loop rounds
+	CNT_SPI_BYTES, // bytes transferred over the HPS-FPGA SPI
+	CNT_SPI_IN,    // part of it read by block transfers
+	CNT_FILE_READ, // bytes read from files (incl. zip)
+	CNT_RA_HIT,    // sequential reads served by the file read-ahead
+	CNT_RA_MISS,   // sequential reads that had to wait for the storage
+	CNT_HDD_HIT,   // 4KB blocks served by the disk image cache
+	CNT_HDD_MISS,  // 4KB blocks the disk image cache read from storage
+	CNT_CDDA_UNDERRUN, // CD / MSU-1 audio sectors that weren't read ahead in time
+	CNT_CD_LATE,   // CD data sectors of the Saturn / Mega CD read-ahead that had to be waited for
+	CNT_CHD_HIT,   // CHD sector reads served by the hunk cache
+	CNT_CHD_MISS,  // CHD sector reads that had to decode (or wait for) their hunk
+	CNT_MIDI_OUT,  // MIDI bytes the bridge sent from the core to the synth
+	CNT_MIDI_IN,   // MIDI bytes the bridge sent from the synth to the core
+	CNT_CACHE_TRIM, // bytes the memory budget took back from the caches
+	CNT_LOG_DROP,  // log lines dropped on a full ring
+	CNT_NUM
+};
+
+// log2 histograms of durations in us. Bucket n holds samples in [2^(n-1), 2^n).
+enum
+{
+	HIST_CO_POLL,  // co_poll slice
+	HIST_CO_UI,    // co_ui slice
+	HIST_MIDI,     // MIDI bridge, UART ready to bytes written to the synth
+	HIST_FILE_READ, // reads that went to the storage (not served by a cache)
+	HIST_FILE_TX,  // user_io_file_tx, file opened to the transfer done
+	HIST_NUM
+};
+
+#define HIST_BUCKETS 24
+
+extern std::atomic<uint64_t> g_counters[CNT_NUM];
+extern std::atomic<uint32_t> g_histograms[HIST_NUM][HIST_BUCKETS];
+
+static inline void counter_add(int id, uint32_t n = 1)
+{
+	g_counters[id].fetch_add(n, std::memory_order_relaxed);
+}
+
+static inline uint32_t histogram_bucket(uint32_t value)
+{
+	uint32_t bucket = value ? 32 - __builtin_clz(value) : 0;
+	return (bucket >= HIST_BUCKETS) ? HIST_BUCKETS - 1 : bucket;
+}
+
+static inline void histogram_add(int id, uint32_t value)
+{
+	g_histograms[id][histogram_bucket(value)].fetch_add(1, std::memory_order_relaxed);
+}
+
+// upper bound of the bucket reaching the given fraction (1/1000) of samples
+uint32_t histogram_percentile(const uint32_t *buckets, uint64_t total, uint32_t permille);
+
+// monotonic timestamp for histogram samples
+static inline uint32_t counters_time_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+void counters_dump();
+
+// names as in COUNTERS_FILE
+const char *counter_name(int id);
+const char *histogram_name(int id);
+
+// SPI traffic per chip select and command, off until "spi_stats on".
+// spi.cpp opens a frame on every Enable*() and closes it on Disable*(),
+// fpga_spi() tags the open frame with the first word sent, which is the
+// command for hps_io, the OSD and file transfers alike.
+#define SPI_STATS_FILE "/tmp/MiSTer_spi_stats"
+
+enum
+{
+	SPI_CS_IO,
+	SPI_CS_FPGA,
+	SPI_CS_OSD,
+	SPI_CS_NUM
+};
+
+extern int spi_stats_cmd; // < 0 while the open frame waits for its command
+
+void spi_stats_begin(int cs);
+void spi_stats_end();
+void spi_stats_command(const char *cmd);
+
+// Boot timeline. boot_phase() starts a named phase and ends the previous one,
+// boot_phase_add() records a phase which ran elsewhere (offload workers).
+// boot_done() ends the last phase, logs the timeline and writes BOOT_FILE.
+// Main thread only. Times are ms since kernel boot (GetTimer).
+#define BOOT_FILE "/tmp/MiSTer_boot"
+
+void boot_phase(const char *name);
+void boot_phase_add(const char *name, uint32_t start, uint32_t end);
+void boot_done();
+
+#endif
@@ -0,0 +1,76 @@
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "fbdraw.h"
+
+void fbdraw_row(volatile uint32_t *dst, const uint32_t *row, int w)
+{
+	uint32_t *d = (uint32_t *)dst;
+	int x = 0;
+
+#ifdef __ARM_NEON
+	for (; x + 8 <= w; x += 8)
+	{
+		uint32x4_t a = vld1q_u32(row + x);
+		uint32x4_t b = vld1q_u32(row + x + 4);
+		vst1q_u32(d + x, a);
+		vst1q_u32(d + x + 4, b);
+	}
+#endif
+
+	for (; x < w; x++) d[x] = row[x];
+}
+
+void fbdraw_fill(volatile uint32_t *dst, int stride, int w, int h, uint32_t color)
+{
+	for (int y = 0; y < h; y++)
+	{
+		uint32_t *d = (uint32_t *)(dst + y * stride);
+		int x = 0;
+
+#ifdef __ARM_NEON
+		uint32x4_t c = vdupq_n_u32(color);
+		for (; x + 8 <= w; x += 8)
+		{
+			vst1q_u32(d + x, c);
+			vst1q_u32(d + x + 4, c);
+		}
+#endif
+
+		for (; x < w; x++) d[x] = color;
+	}
+}
+
+void fbdraw_ramp(uint32_t *row, const uint32_t *val, uint32_t xr, uint32_t mask, int w)
+{
+	int x = 0;
+
+#ifdef __ARM_NEON
+	uint32x4_t vx = vdupq_n_u32(xr);
+	uint32x4_t vm = vdupq_n_u32(mask);
+	for (; x + 4 <= w; x += 4) vst1q_u32(row + x, vandq_u32(veorq_u32(vld1q_u32(val + x), vx), vm));
+#endif
+
+	for (; x < w; x++) row[x] = (val[x] ^ xr) & mask;
+}
+
+void fbdraw_columns(uint32_t *row, uint32_t val, const uint32_t *xr, const uint32_t *mask, int w)
+{
+	int x = 0;
+
+#ifdef __ARM_NEON
+	uint32x4_t vv = vdupq_n_u32(val);
+	for (; x + 4 <= w; x += 4) vst1q_u32(row + x, vandq_u32(veorq_u32(vv, vld1q_u32(xr + x)), vld1q_u32(mask + x)));
+#endif
+
+	for (; x < w; x++) row[x] = (val ^ xr[x]) & mask[x];
+}
+
+void fbdraw_gray_ramp(uint32_t *val, int w)
+{
+	for (int x = 0; x < w; x++) val[x] = ((256 * x) / w) * 0x010101;
+}
@@ -0,0 +1,29 @@
+#ifndef FBDRAW_H
+#define FBDRAW_H
+
+// Drawing into the video framebuffer. It is mapped uncached, so single pixel
+// stores cost a bus transaction each. Pixels are composed a row at a time in
+// normal memory and go out with wide stores.
+// stride is in pixels, colors are 0x00RRGGBB.
+
+#include <inttypes.h>
+
+// widest row the helpers handle
+#define FBDRAW_MAX_W 2048
+
+// solid rectangle
+void fbdraw_fill(volatile uint32_t *dst, int stride, int w, int h, uint32_t color);
+
+// one row of pixels
+void fbdraw_row(volatile uint32_t *dst, const uint32_t *row, int w);
+
+// row[x] = (val[x] ^ xr) & mask: gradient of val in the channels of mask, xr = 0xFFFFFF inverts it
+void fbdraw_ramp(uint32_t *row, const uint32_t *val, uint32_t xr, uint32_t mask, int w);
+
+// row[x] = (val ^ xr[x]) & mask[x]: one gray level through per column channel masks
+void fbdraw_columns(uint32_t *row, uint32_t val, const uint32_t *xr, const uint32_t *mask, int w);
+
+// gray ramp: val[x] = (256 * x / w) in all three channels
+void fbdraw_gray_ramp(uint32_t *val, int w);
+
+#endif
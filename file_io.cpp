@@ -14,12 +14,18 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 #include <linux/magic.h>
+#include <pthread.h>
 #include <algorithm>
 #include <vector>
 #include <string>
 #include <set>
+#include <unordered_map>
 #include "lib/miniz/miniz.h"
+#include "lib/md5/md5.h"
 #include "osd.h"
 #include "fpga_io.h"
 #include "menu.h"
@@ -32,31 +38,120 @@
 #include "scheduler.h"
 #include "video.h"
 #include "support.h"
+#include "counters.h"
+#include "hardware.h"
+#include "shcache.h"
+#include "membudget.h"
 
 #define MIN(a,b) (((a)<(b)) ? (a) : (b))
 
-typedef std::vector<direntext_t> DirentVector;
 typedef std::set<std::string> DirNameSet;
 
 static const size_t YieldIterations = 128;
 
-DirentVector DirItem;
+// The listing of the browser. Full ROM sets have 100k+ entries, so they are
+// kept as small records with the strings packed into one pool, and
+// direntext_t is only built for the entries being looked at.
+struct dirRec
+{
+	uint32_t name; // d_name in the pool, followed by altname and datecode
+	uint16_t alt;
+	uint16_t date;
+	uint8_t type;
+};
+
+struct DirList
+{
+	std::vector<dirRec> recs;
+	std::vector<char> pool;
+	uint32_t gen = 0; // bumped on every change, drops the built items
+
+	size_t size() const { return recs.size(); }
+	void clear() { recs.clear(); pool.clear(); gen++; }
+	void resize(size_t num) { recs.resize(num); gen++; }
+	void shrink_to_fit() { recs.shrink_to_fit(); pool.shrink_to_fit(); }
+
+	const char *name(const dirRec &r) const { return pool.data() + r.name; }
+	const char *altname(const dirRec &r) const { return pool.data() + r.name + r.alt; }
+	const char *datecode(const dirRec &r) const { return pool.data() + r.name + r.date; }
+
+	const char *name(size_t i) const { return name(recs[i]); }
+	const char *altname(size_t i) const { return altname(recs[i]); }
+	int type(size_t i) const { return recs[i].type; }
+
+	void push_back(const direntext_t &e)
+	{
+		size_t name_len = strnlen(e.de.d_name, sizeof(e.de.d_name) - 1) + 1;
+		size_t alt_len = strnlen(e.altname, sizeof(e.altname) - 1) + 1;
+		size_t date_len = strnlen(e.datecode, sizeof(e.datecode) - 1) + 1;
+
+		dirRec r = { (uint32_t)pool.size(), (uint16_t)name_len, (uint16_t)(name_len + alt_len), e.de.d_type };
+		pool.resize(pool.size() + name_len + alt_len + date_len);
+		char *p = pool.data() + r.name;
+		memcpy(p, e.de.d_name, name_len - 1); p[name_len - 1] = 0; p += name_len;
+		memcpy(p, e.altname, alt_len - 1); p[alt_len - 1] = 0; p += alt_len;
+		memcpy(p, e.datecode, date_len - 1); p[date_len - 1] = 0;
+
+		recs.push_back(r);
+		gen++;
+	}
+
+	// entry i as direntext_t, valid until 64 other entries were looked at
+	direntext_t *item(size_t i)
+	{
+		static direntext_t items[64];
+		static uint32_t items_gen[64];
+		static size_t items_idx[64];
+
+		int slot = i & 63;
+		direntext_t *e = &items[slot];
+		if (items_gen[slot] == gen + 1 && items_idx[slot] == i) return e;
+
+		memset(e, 0, sizeof(*e));
+		if (i < recs.size())
+		{
+			e->de.d_type = recs[i].type;
+			strcpy(e->de.d_name, name(i));
+			strcpy(e->altname, altname(i));
+			strcpy(e->datecode, datecode(recs[i]));
+		}
+		items_gen[slot] = gen + 1;
+		items_idx[slot] = i;
+		return e;
+	}
+};
+
+static DirList DirItem;
 DirNameSet DirNames;
 
 
-// Directory scanning can cause the same zip file to be opened multiple times
+// Directory scanning and rom loading can cause the same zip files to be opened multiple times
 // due to testing file types to adjust the path
 // (and the fact the code path is shared with regular files)
-// cache the opened mz_zip_archive so we only open it once
+// keep the recently opened mz_zip_archives so we only parse their central directory once
 // this has the extra benefit that if a user is navigating through multiple directories
-// in a zip archive, the zip will only be opened once and things will be more responsive
+// in a zip archive, or an MRA pulls parts from parent and clone romsets, each zip will
+// only be opened once and things will be more responsive
 // ** We have to open the file outselves with open() so we can set O_CLOEXEC to prevent
 // leaking the file descriptor when the user changes cores
 
-static mz_zip_archive last_zip_archive = {};
-static int last_zip_fd = -1;
-static FILE *last_zip_cfile = NULL;
-static char last_zip_fname[256] = {};
+struct zipHandle
+{
+	mz_zip_archive archive;
+	FILE          *cfile;
+	char           path[1024];
+	time_t         mtime;
+	__off64_t      size;
+	uint32_t       used;
+	int            pinned;
+};
+
+#define ZIP_POOL_SIZE 4
+
+static zipHandle *zip_pool[ZIP_POOL_SIZE] = {};
+static uint32_t zip_pool_tick = 0;
+static pthread_mutex_t zip_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static char scanned_path[1024] = {};
 static int scanned_opts = 0;
 
@@ -72,8 +167,14 @@ fileTYPE::fileTYPE()
 	mode = 0;
 	type = 0;
 	zip = 0;
+	ra = 0;
+	cache = 0;
+	ovl = 0;
+	mem = 0;
+	src = 0;
 	size = 0;
 	offset = 0;
+	dfd = -1;
 }
 
 fileTYPE::~fileTYPE()
@@ -83,56 +184,493 @@ fileTYPE::~fileTYPE()
 
 int fileTYPE::opened()
 {
-	return filp || zip;
+	return filp || zip || src;
 }
 
+// Inflate state saved at intervals while a deflated member is read, so a
+// seek resumes from the closest one instead of restarting the member
+// (zran style). The unconsumed part of miniz's read buffer isn't saved:
+// on restore the file position is moved back so it's read again.
+#define ZIP_CP_MAX      128
+#define ZIP_CP_MIN_SIZE (4 * 1024 * 1024) // smaller members just restart
+#define ZIP_CP_MIN_STEP (1024 * 1024)
+
+struct zipCheckpoint
+{
+	mz_uint64          out_ofs;
+	mz_uint64          file_ofs;  // next compressed byte to feed
+	mz_uint64          comp_remaining;
+	size_t             out_blk_remain;
+	int                status;
+	mz_uint            crc;
+	tinfl_decompressor inflator;
+	mz_uint8           dict[TINFL_LZ_DICT_SIZE];
+};
+
 struct fileZipArchive
 {
-	mz_zip_archive                    archive;
+	zipHandle                        *handle;
+	mz_zip_archive                   *archive;
 	int                               index;
 	mz_zip_reader_extract_iter_state* iter;
 	__off64_t                         offset;
+	zipCheckpoint                    *cp;
+	int                               cp_num;
+	mz_uint64                         cp_step;
+};
+
+static void zip_checkpoint_add(fileZipArchive *zip)
+{
+	mz_zip_reader_extract_iter_state *it = zip->iter;
+	if (!it->file_stat.m_method || it->file_stat.m_uncomp_size < ZIP_CP_MIN_SIZE) return;
+	if (it->status != TINFL_STATUS_NEEDS_MORE_INPUT && it->status != TINFL_STATUS_HAS_MORE_OUTPUT) return;
+
+	if (!zip->cp)
+	{
+		zip->cp_step = it->file_stat.m_uncomp_size / ZIP_CP_MAX;
+		if (zip->cp_step < ZIP_CP_MIN_STEP) zip->cp_step = ZIP_CP_MIN_STEP;
+		zip->cp = (zipCheckpoint*)malloc(sizeof(zipCheckpoint) * ZIP_CP_MAX);
+		if (!zip->cp) return;
+		zip->cp_num = 0;
+	}
+
+	// checkpoints are only added in order, on the first pass over a region
+	mz_uint64 next = zip->cp_num ? zip->cp[zip->cp_num - 1].out_ofs + zip->cp_step : zip->cp_step;
+	if (it->out_buf_ofs < next || zip->cp_num >= ZIP_CP_MAX) return;
+
+	zipCheckpoint *cp = &zip->cp[zip->cp_num++];
+	cp->out_ofs = it->out_buf_ofs;
+	cp->file_ofs = it->cur_file_ofs - it->read_buf_avail;
+	cp->comp_remaining = it->comp_remaining + it->read_buf_avail;
+	cp->out_blk_remain = it->out_blk_remain;
+	cp->status = it->status;
+#ifndef MINIZ_DISABLE_ZIP_READER_CRC32_CHECKS
+	cp->crc = it->file_crc32;
+#endif
+	cp->inflator = it->inflator;
+	memcpy(cp->dict, it->pWrite_buf, sizeof(cp->dict));
+}
+
+// closest checkpoint at or before offset, 0 if none.
+static zipCheckpoint *zip_checkpoint_find(fileZipArchive *zip, __off64_t offset)
+{
+	zipCheckpoint *res = 0;
+	for (int i = 0; i < zip->cp_num && zip->cp[i].out_ofs <= (mz_uint64)offset; i++) res = &zip->cp[i];
+	return res;
+}
+
+static void zip_checkpoint_restore(fileZipArchive *zip, zipCheckpoint *cp)
+{
+	mz_zip_reader_extract_iter_state *it = zip->iter;
+	it->out_buf_ofs = cp->out_ofs;
+	it->cur_file_ofs = cp->file_ofs;
+	it->comp_remaining = cp->comp_remaining;
+	it->read_buf_avail = 0;
+	it->read_buf_ofs = 0;
+	it->out_blk_remain = cp->out_blk_remain;
+	it->status = cp->status;
+#ifndef MINIZ_DISABLE_ZIP_READER_CRC32_CHECKS
+	it->file_crc32 = cp->crc;
+#endif
+	it->inflator = cp->inflator;
+	memcpy(it->pWrite_buf, cp->dict, sizeof(cp->dict));
+	zip->offset = cp->out_ofs;
+}
+
+static void zip_close_handle(zipHandle *z)
+{
+	if (!z) return;
+	mz_zip_reader_end(&z->archive);
+	if (z->cfile) fclose(z->cfile);
+	delete z;
+}
+
+static zipHandle *zip_open_handle(const char *path, int flags)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	struct stat64 st;
+	if (fstat64(fd, &st) < 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	zipHandle *z = new zipHandle{};
+	z->cfile = fdopen(fd, "r");
+	if (!z->cfile)
+	{
+		close(fd);
+		delete z;
+		return 0;
+	}
+
+	if (!mz_zip_reader_init_cfile(&z->archive, z->cfile, 0, flags))
+	{
+		zip_close_handle(z);
+		return 0;
+	}
+
+	snprintf(z->path, sizeof(z->path), "%s", path);
+	z->mtime = st.st_mtime;
+	z->size = st.st_size;
+	return z;
+}
+
+// an archive replaced on disk must not be served from the pool
+static int zip_handle_valid(zipHandle *z)
+{
+	struct stat64 st;
+	return !stat64(z->path, &st) && st.st_mtime == z->mtime && st.st_size == z->size;
+}
+
+// Find path in the pool. With take set the handle is removed from the pool,
+// so the caller owns it until zip_pool_put (its FILE can't be shared with a
+// read running on another thread).
+static zipHandle *zip_pool_find(const char *path, int take)
+{
+	zipHandle *res = 0;
+
+	pthread_mutex_lock(&zip_pool_lock);
+	for (int i = 0; i < ZIP_POOL_SIZE; i++)
+	{
+		zipHandle *z = zip_pool[i];
+		if (!z || strcasecmp(z->path, path) || (take && z->pinned)) continue;
+
+		if (!zip_handle_valid(z))
+		{
+			if (!z->pinned)
+			{
+				zip_close_handle(z);
+				zip_pool[i] = 0;
+			}
+			continue;
+		}
+
+		z->used = ++zip_pool_tick;
+		if (take) zip_pool[i] = 0;
+		res = z;
+		break;
+	}
+	pthread_mutex_unlock(&zip_pool_lock);
+
+	return res;
+}
+
+// return a handle to the pool, evicting the least recently used one.
+static void zip_pool_put(zipHandle *z)
+{
+	zipHandle *old = z;
+
+	pthread_mutex_lock(&zip_pool_lock);
+	z->used = ++zip_pool_tick;
+	int slot = -1;
+	for (int i = 0; i < ZIP_POOL_SIZE; i++)
+	{
+		if (!zip_pool[i])
+		{
+			slot = i;
+			break;
+		}
+
+		if (!zip_pool[i]->pinned && (slot < 0 || zip_pool[i]->used < zip_pool[slot]->used)) slot = i;
+	}
+
+	if (slot >= 0)
+	{
+		old = zip_pool[slot];
+		zip_pool[slot] = z;
+	}
+	pthread_mutex_unlock(&zip_pool_lock);
+
+	zip_close_handle(old);
+}
+
+// Sorted entry table of big archives, stored in CONFIG_DIR/zipindex and
+// keyed by path, size and mtime of the zip. Browsing an indexed zip doesn't
+// need its central directory parsed at all, name and crc lookups are
+// binary searches. The index is written the first time the archive is parsed.
+#define ZIP_INDEX_MIN   2048 // entries, smaller archives parse fast enough
+#define ZIP_INDEX_MAGIC 0x3158495A // "ZIX1"
+#define ZIP_INDEX_DIR   CONFIG_DIR "/zipindex"
+
+struct zipIndexHeader
+{
+	uint32_t magic;
+	uint32_t num;
+	uint32_t names_len;
+	uint32_t path_len;
+	uint64_t zip_size;
+	uint64_t zip_mtime;
+};
+
+struct zipIndexEntry
+{
+	uint32_t name;  // offset in the name table
+	uint32_t index; // central directory index
+	uint32_t crc;
+	uint32_t is_dir;
+	uint64_t size;
+};
+
+struct zipIndex
+{
+	char           path[1024];
+	uint64_t       zip_size;
+	uint64_t       zip_mtime;
+	uint32_t       num;
+	zipIndexEntry *entries; // sorted by name, case insensitive
+	uint32_t      *by_crc;  // entry numbers sorted by crc
+	const char    *names;
+	uint8_t       *data;    // file image, everything above points into it
+	size_t         data_len;
 };
 
+static zipIndex *zip_index_cur = 0;
+
+static void zip_index_path(const char *zip_path, char *out, int size)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *p = zip_path; *p; p++) hash = (hash ^ (uint8_t)tolower(*p)) * 16777619u;
+	snprintf(out, size, "%s/" ZIP_INDEX_DIR "/%08X.idx", getRootDir(), hash);
+}
+
+static void zip_index_free(zipIndex *zi)
+{
+	if (!zi) return;
+	free(zi->data);
+	delete zi;
+}
+
+// point the tables into the image, 0 if it's malformed.
+static zipIndex *zip_index_from_image(uint8_t *data, size_t len)
+{
+	zipIndexHeader *h = (zipIndexHeader*)data;
+	if (len < sizeof(*h) || h->magic != ZIP_INDEX_MAGIC || h->path_len >= sizeof(zipIndex::path) ||
+		len != sizeof(*h) + h->num * (sizeof(zipIndexEntry) + sizeof(uint32_t)) + h->names_len + h->path_len)
+	{
+		free(data);
+		return 0;
+	}
+
+	zipIndex *zi = new zipIndex{};
+	zi->data = data;
+	zi->data_len = len;
+	zi->num = h->num;
+	zi->zip_size = h->zip_size;
+	zi->zip_mtime = h->zip_mtime;
+	zi->entries = (zipIndexEntry*)(data + sizeof(*h));
+	zi->by_crc = (uint32_t*)(zi->entries + h->num);
+	zi->names = (const char*)(zi->by_crc + h->num);
+	memcpy(zi->path, zi->names + h->names_len, h->path_len);
+	zi->path[h->path_len] = 0;
+	return zi;
+}
+
+static void zip_index_build(mz_zip_archive *z, const char *path, const struct stat64 *st)
+{
+	uint32_t num = mz_zip_reader_get_num_files(z);
+	if (num < ZIP_INDEX_MIN) return;
+
+	std::vector<zipIndexEntry> entries(num);
+	std::string names;
+	for (uint32_t i = 0; i < num; i++)
+	{
+		mz_zip_archive_file_stat s;
+		if (!mz_zip_reader_file_stat(z, i, &s)) return;
+
+		entries[i] = { (uint32_t)names.size(), i, s.m_crc32, (uint32_t)s.m_is_directory, s.m_uncomp_size };
+		names.append(s.m_filename, strlen(s.m_filename) + 1);
+	}
+
+	const char *n = names.c_str();
+	std::sort(entries.begin(), entries.end(), [n](const zipIndexEntry &a, const zipIndexEntry &b)
+		{ return strcasecmp(n + a.name, n + b.name) < 0; });
+
+	std::vector<uint32_t> by_crc(num);
+	for (uint32_t i = 0; i < num; i++) by_crc[i] = i;
+	std::sort(by_crc.begin(), by_crc.end(), [&entries](uint32_t a, uint32_t b) { return entries[a].crc < entries[b].crc; });
+
+	zipIndexHeader h = { ZIP_INDEX_MAGIC, num, (uint32_t)names.size(), (uint32_t)strlen(path),
+		(uint64_t)st->st_size, (uint64_t)st->st_mtime };
 
-static int OpenZipfileCached(char *path, int flags)
+	size_t len = sizeof(h) + num * (sizeof(zipIndexEntry) + sizeof(uint32_t)) + h.names_len + h.path_len;
+	uint8_t *data = (uint8_t*)malloc(len);
+	if (!data) return;
+
+	uint8_t *p = data;
+	memcpy(p, &h, sizeof(h)); p += sizeof(h);
+	memcpy(p, entries.data(), num * sizeof(zipIndexEntry)); p += num * sizeof(zipIndexEntry);
+	memcpy(p, by_crc.data(), num * sizeof(uint32_t)); p += num * sizeof(uint32_t);
+	memcpy(p, names.data(), h.names_len); p += h.names_len;
+	memcpy(p, path, h.path_len);
+
+	zipIndex *zi = zip_index_from_image(data, len);
+	if (!zi) return;
+
+	uint8_t *copy = (uint8_t*)malloc(len);
+	if (copy)
+	{
+		char *name = (char*)malloc(1024);
+		if (!name) free(copy);
+		else
+		{
+			memcpy(copy, data, len);
+			zip_index_path(path, name, 1024);
+			shcache_store(name, data, len);
+
+			// written on the bulk worker, the index is usable right away
+			offload_add_work([copy, len, name]
+			{
+				char *p = strrchr(name, '/');
+				*p = 0;
+				mkdir(name, S_IRWXU | S_IRWXG | S_IRWXO);
+				*p = '/';
+
+				int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+				if (fd >= 0)
+				{
+					if (write(fd, copy, len) != (ssize_t)len) unlink(name);
+					close(fd);
+				}
+				free(copy);
+				free(name);
+			}, OFFLOAD_PRIO_BULK);
+		}
+	}
+
+	printf("Zip index of %s: %u entries\n", path, num);
+	zip_index_free(zip_index_cur);
+	zip_index_cur = zi;
+}
+
+// index of the zip at path if there is a current one, main thread only.
+static zipIndex *zip_index_get(const char *path)
+{
+	struct stat64 st;
+	if (stat64(path, &st) < 0) return 0;
+
+	zipIndex *zi = zip_index_cur;
+	if (zi && !strcasecmp(zi->path, path) && zi->zip_size == (uint64_t)st.st_size && zi->zip_mtime == (uint64_t)st.st_mtime) return zi;
+	if (st.st_size < 64 * 1024) return 0;
+
+	char name[1024];
+	zip_index_path(path, name, sizeof(name));
+
+	size_t len;
+	uint8_t *data = (uint8_t*)shcache_load(name, &len);
+	if (!data) return 0;
+
+	zi = zip_index_from_image(data, len);
+
+	if (zi && (strcasecmp(zi->path, path) || zi->zip_size != (uint64_t)st.st_size || zi->zip_mtime != (uint64_t)st.st_mtime))
+	{
+		// stale or a hash collision
+		shcache_drop(name);
+		zip_index_free(zi);
+		return 0;
+	}
+
+	if (zi)
+	{
+		zip_index_free(zip_index_cur);
+		zip_index_cur = zi;
+	}
+	return zi;
+}
+
+static const char *zip_index_name(zipIndex *zi, uint32_t n)
 {
-  if (last_zip_fname[0] && !strcasecmp(path, last_zip_fname))
-  {
-    return 1;
-  }
+	return zi->names + zi->entries[n].name;
+}
+
+// first entry not sorting before name
+static uint32_t zip_index_lower(zipIndex *zi, const char *name)
+{
+	uint32_t lo = 0, hi = zi->num;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (strcasecmp(zip_index_name(zi, mid), name) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// entries starting with prefix, case insensitive
+static void zip_index_range(zipIndex *zi, const char *prefix, uint32_t *first, uint32_t *count)
+{
+	size_t len = strlen(prefix);
+	uint32_t n = zip_index_lower(zi, prefix);
+	*first = n;
+	while (n < zi->num && !strncasecmp(zip_index_name(zi, n), prefix, len)) n++;
+	*count = n - *first;
+}
+
+static int zip_index_find(zipIndex *zi, const char *name)
+{
+	uint32_t n = zip_index_lower(zi, name);
+	return (n < zi->num && !strcasecmp(zip_index_name(zi, n), name)) ? (int)n : -1;
+}
+
+static int zip_index_find_crc(zipIndex *zi, uint32_t crc)
+{
+	uint32_t lo = 0, hi = zi->num;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (zi->entries[zi->by_crc[mid]].crc < crc) lo = mid + 1;
+		else hi = mid;
+	}
+	return (lo < zi->num && zi->entries[zi->by_crc[lo]].crc == crc) ? (int)zi->entries[zi->by_crc[lo]].index : -1;
+}
+
+// pin keeps the archive in the pool across yields, until zip_unpin
+static mz_zip_archive *OpenZipfileCached(char *path, int flags, int pin = 0)
+{
+	zipHandle *z = zip_pool_find(path, 0);
+	if (!z)
+	{
+		z = zip_open_handle(path, flags);
+		if (!z) return 0;
+		zip_pool_put(z);
 
-  mz_zip_reader_end(&last_zip_archive);
-  mz_zip_zero_struct(&last_zip_archive);
-  if (last_zip_cfile)
-  {
-    fclose(last_zip_cfile);
-    last_zip_cfile = nullptr;
-  }
+		if (!zip_index_get(path))
+		{
+			struct stat64 st = {};
+			st.st_size = z->size;
+			st.st_mtime = z->mtime;
+			zip_index_build(&z->archive, path, &st);
+		}
+	}
 
-  last_zip_fname[0] = '\0';
-  last_zip_fd = open(path, O_RDONLY|O_CLOEXEC);
-  if (last_zip_fd < 0)
-  {
-    return 0;
-  }
+	if (pin)
+	{
+		pthread_mutex_lock(&zip_pool_lock);
+		z->pinned++;
+		pthread_mutex_unlock(&zip_pool_lock);
+	}
 
-  last_zip_cfile = fdopen(last_zip_fd, "r");
-  if (!last_zip_cfile)
-  {
-    close(last_zip_fd);
-    last_zip_fd = -1;
-    return 0;
-  }
+	return &z->archive;
+}
 
-  int mz_ret = mz_zip_reader_init_cfile(&last_zip_archive, last_zip_cfile, 0, flags);
-  if (mz_ret)
-  {
-    strncpy(last_zip_fname, path, sizeof(last_zip_fname));
-  }
-  return mz_ret;
+static void zip_unpin(mz_zip_archive *archive)
+{
+	pthread_mutex_lock(&zip_pool_lock);
+	for (int i = 0; i < ZIP_POOL_SIZE; i++)
+	{
+		if (zip_pool[i] && &zip_pool[i]->archive == archive && zip_pool[i]->pinned) zip_pool[i]->pinned--;
+	}
+	pthread_mutex_unlock(&zip_pool_lock);
 }
 
+// FileOpen* take the archive out of the pool, or parse a fresh one.
+static zipHandle *zip_take(const char *path)
+{
+	zipHandle *z = zip_pool_find(path, 1);
+	return z ? z : zip_open_handle(path, 0);
+}
 
 static int FileIsZipped(char* path, char** zip_path, char** file_path)
 {
@@ -190,15 +728,24 @@ static int isPathDirectory(const char *path, int use_zip = 1)
 			return 1;
 		}
 
-		if (!OpenZipfileCached(full_path, 0))
+		// Folder names always end with a slash in the zip
+		// file central directory.
+		zipIndex *zi = zip_index_get(zip_path);
+		if (zi)
+		{
+			uint32_t first, count;
+			strcat(file_path, "/");
+			zip_index_range(zi, file_path, &first, &count);
+			return count > 0;
+		}
+
+		mz_zip_archive *z = OpenZipfileCached(full_path, 0);
+		if (!z)
 		{
-			printf("isPathDirectory(OpenZipfileCached) Zip:%s, error:%s\n", zip_path,
-				mz_zip_get_error_string(mz_zip_get_last_error(&last_zip_archive)));
+			printf("isPathDirectory(OpenZipfileCached) Zip:%s failed\n", zip_path);
 			return 0;
 		}
 
-		// Folder names always end with a slash in the zip
-		// file central directory.
 		strcat(file_path, "/");
 
 		// Some zip files don't have directory entries
@@ -206,16 +753,16 @@ static int isPathDirectory(const char *path, int use_zip = 1)
 		// this is a binary search (usually) If that fails then scan for the first
 		// entry that starts with file_path
 
-		const int file_index = mz_zip_reader_locate_file(&last_zip_archive, file_path, NULL, 0);
-		if (file_index >= 0 && mz_zip_reader_is_file_a_directory(&last_zip_archive, file_index))
+		const int file_index = mz_zip_reader_locate_file(z, file_path, NULL, 0);
+		if (file_index >= 0 && mz_zip_reader_is_file_a_directory(z, file_index))
 		{
 			return 1;
 		}
 
-		for (size_t i = 0; i < mz_zip_reader_get_num_files(&last_zip_archive); i++)
+		for (size_t i = 0; i < mz_zip_reader_get_num_files(z); i++)
 		{
 			char zip_fname[256];
-			mz_zip_reader_get_filename(&last_zip_archive, i, &zip_fname[0], sizeof(zip_fname));
+			mz_zip_reader_get_filename(z, i, &zip_fname[0], sizeof(zip_fname));
 			if (strcasestr(zip_fname, file_path))
 			{
 				return 1;
@@ -250,13 +797,21 @@ static int isPathRegularFile(const char *path, int use_zip = 1)
 		{
 			return 0;
 		}
-		if (!OpenZipfileCached(full_path, 0))
+		zipIndex *zi = zip_index_get(zip_path);
+		if (zi)
+		{
+			int n = zip_index_find(zi, file_path);
+			return n >= 0 && !zi->entries[n].is_dir;
+		}
+
+		mz_zip_archive *z = OpenZipfileCached(full_path, 0);
+		if (!z)
 		{
 			//printf("isPathRegularFile(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
 			//       mz_zip_get_error_string(mz_zip_get_last_error(&z)));
 			return 0;
 		}
-		const int file_index = mz_zip_reader_locate_file(&last_zip_archive, file_path, NULL, 0);
+		const int file_index = mz_zip_reader_locate_file(z, file_path, NULL, 0);
 		if (file_index < 0)
 		{
 			//printf("isPathRegularFile(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
@@ -265,7 +820,7 @@ static int isPathRegularFile(const char *path, int use_zip = 1)
 			return 0;
 		}
 
-		if (!mz_zip_reader_is_file_a_directory(&last_zip_archive, file_index) && mz_zip_reader_is_file_supported(&last_zip_archive, file_index))
+		if (!mz_zip_reader_is_file_a_directory(z, file_index) && mz_zip_reader_is_file_supported(z, file_index))
 		{
 			return 1;
 		}
@@ -278,64 +833,481 @@ static int isPathRegularFile(const char *path, int use_zip = 1)
 	return 0;
 }
 
-void FileClose(fileTYPE *file)
+// Read-ahead for sequential readers on slow storage (USB drives, network
+// shares). After a few back to back FileReadAdv calls the chunks ahead of
+// the reader are read on the bulk worker into a small ring, so the storage
+// latency overlaps with the time the core takes to consume the data. The
+// depth and chunk size come from the storage profile, the SD card doesn't
+// need it. The stdio position follows every read served from the ring.
+#define RA_CHUNK (64 * 1024)
+#define RA_SEQ   2  // back to back reads before the chunks ahead are read
+#define RA_MAX   32
+#define DIR_CACHE_MIN 256 // entries, smaller folders scan fast enough locally
+
+#ifndef CIFS_MAGIC_NUMBER
+#define CIFS_MAGIC_NUMBER 0xFF534D42
+#endif
+#ifndef SMB2_MAGIC_NUMBER
+#define SMB2_MAGIC_NUMBER 0xFE534D42
+#endif
+#define MMC_BLOCK_MAJOR 179
+
+struct fileReadCache
 {
-	if (file->zip)
-	{
-		if (file->zip->iter)
-		{
-			mz_zip_reader_extract_iter_free(file->zip->iter);
-		}
-		mz_zip_reader_end(&file->zip->archive);
+	int       depth; // chunks, 0 - not used for this file
+	int       chunk;
+	int       seq_min;
+	int       seq;
+	__off64_t next;  // end of the previous read
+	uint8_t  *buf;
+	__off64_t ofs[RA_MAX];
+	int       len[RA_MAX]; // set by the worker, -1 - empty or failed
+	offload_handle_t job[RA_MAX];
+};
 
-		delete file->zip;
-	}
+static void storage_profile(const struct statfs *fs, const struct stat64 *st, storageProfile *prof)
+{
+	memset(prof, 0, sizeof(*prof));
+	prof->ra_chunk = RA_CHUNK;
+	prof->ra_seq = RA_SEQ;
+	prof->dir_min = DIR_CACHE_MIN;
 
-	if (file->filp)
+	if (fs->f_type == CIFS_MAGIC_NUMBER || fs->f_type == SMB2_MAGIC_NUMBER || fs->f_type == NFS_SUPER_MAGIC)
 	{
-		//printf("closing %p\n", file->filp);
-		fclose(file->filp);
-		if (file->type == 1)
-		{
-			if (file->name[0] == '/')
-			{
-				shm_unlink(file->name);
-			}
-			file->type = 0;
-		}
+		prof->type = STORAGE_NET;
+		prof->ra_depth = cfg.readahead_net;
+		prof->ra_chunk = ((cfg.net_read_size < 64) ? 64 : cfg.net_read_size) * 1024;
+		prof->ra_seq = 1;
+		prof->dir_min = DIR_CACHE_MIN / 8;
+		prof->meta_ttl = cfg.net_meta_ttl;
+	}
+	else if (fs->f_type == TMPFS_MAGIC || fs->f_type == RAMFS_MAGIC)
+	{
+		prof->type = STORAGE_RAM;
+	}
+	else if (major(st->st_dev) == MMC_BLOCK_MAJOR)
+	{
+		prof->type = STORAGE_SD;
+	}
+	else
+	{
+		prof->type = STORAGE_USB;
+		prof->ra_depth = cfg.readahead_usb;
 	}
 
-	file->zip = nullptr;
-	file->filp = nullptr;
-	file->size = 0;
+	if (!S_ISREG(st->st_mode)) prof->ra_depth = 0;
 }
 
-static int zip_search_by_crc(mz_zip_archive *zipArchive, uint32_t crc32)
+void FileStorageProfile(int fd, storageProfile *prof)
 {
-	for (unsigned int file_index = 0; file_index < zipArchive->m_total_files; file_index++)
+	struct statfs fs;
+	struct stat64 st;
+	if (fstatfs(fd, &fs) || fstat64(fd, &st))
 	{
-		mz_zip_archive_file_stat s;
-		if (mz_zip_reader_file_stat(zipArchive, file_index, &s))
-		{
-			if (s.m_crc32 == crc32)
-			{
-				return file_index;
-			}
-		}
+		memset(&fs, 0, sizeof(fs));
+		fs.f_type = TMPFS_MAGIC;
+		memset(&st, 0, sizeof(st));
 	}
-
-	return -1;
+	storage_profile(&fs, &st, prof);
 }
 
-int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
+int FileStorageProfilePath(const char *path, storageProfile *prof, struct stat64 *st)
 {
-	make_fullpath(name);
-	FileClose(file);
-	file->mode = 0;
-	file->type = 0;
+	struct statfs fs;
+	struct stat64 tmp;
+	if (!st) st = &tmp;
+	if (statfs(path, &fs) || stat64(path, st)) return 0;
+	storage_profile(&fs, st, prof);
+	return 1;
+}
+
+static void ra_drop(fileReadCache *ra)
+{
+	for (int i = 0; i < ra->depth; i++)
+	{
+		offload_wait(ra->job[i]);
+		ra->job[i] = 0;
+		ra->len[i] = -1;
+	}
+}
+
+// Preloaded files by path. Several fileTYPEs of the same file (tracks of a
+// single BIN cue sheet) share one copy, it's freed with the last of them.
+struct fileMem
+{
+	uint8_t *data;
+	__off64_t size;
+	int refs;
+};
+
+static std::unordered_map<std::string, fileMem> mem_files;
+static std::atomic<size_t> mem_files_bytes(0);
+
+static size_t mem_files_size()
+{
+	return mem_files_bytes.load();
+}
+
+static void mem_release(fileTYPE *file)
+{
+	if (!file->mem) return;
+
+	auto it = mem_files.find(file->path);
+	if (it != mem_files.end() && it->second.data == file->mem && !--it->second.refs)
+	{
+		mem_files_bytes -= it->second.size;
+		free(it->second.data);
+		mem_files.erase(it);
+	}
+	file->mem = nullptr;
+}
+
+static void ra_free(fileTYPE *file)
+{
+	if (!file->ra) return;
+
+	ra_drop(file->ra);
+	free(file->ra->buf);
+	delete file->ra;
+	file->ra = 0;
+}
+
+// queue the missing chunks of [from, from + depth chunks).
+static void ra_fill(fileTYPE *file, __off64_t from)
+{
+	fileReadCache *ra = file->ra;
+	__off64_t start = from - from % ra->chunk;
+	__off64_t end = start + (__off64_t)ra->depth * ra->chunk;
+	int fd = fileno(file->filp);
+	int chunk = ra->chunk;
+
+	for (__off64_t c = start; c < end && c < file->size; c += chunk)
+	{
+		int slot = -1;
+		for (int i = 0; i < ra->depth && slot < 0; i++) if (ra->job[i] && ra->ofs[i] == c) slot = i;
+		if (slot >= 0) continue;
+
+		// reuse a finished chunk outside of the window
+		for (int i = 0; i < ra->depth && slot < 0; i++)
+		{
+			if (!ra->job[i] || ((ra->ofs[i] < start || ra->ofs[i] >= end) && offload_is_done(ra->job[i]))) slot = i;
+		}
+		if (slot < 0) break;
+
+		uint8_t *dst = ra->buf + (size_t)slot * chunk;
+		int *len = &ra->len[slot];
+		ra->ofs[slot] = c;
+		ra->len[slot] = -1;
+		ra->job[slot] = offload_try_add_work([fd, dst, c, len, chunk]
+		{
+			*len = pread64(fd, dst, chunk, c);
+		}, OFFLOAD_PRIO_BULK);
+		if (!ra->job[slot]) break;
+	}
+}
+
+// copy what the ring has from the current offset, 0 if it isn't used.
+static int ra_read(fileTYPE *file, uint8_t *dst, int length)
+{
+	fileReadCache *ra = file->ra;
+	if (!ra || !ra->buf || ra->seq < ra->seq_min || offload_is_worker()) return 0;
+
+	__off64_t pos = file->offset;
+	int done = 0;
+	while (done < length)
+	{
+		__off64_t c = pos - pos % ra->chunk;
+		int slot = -1;
+		for (int i = 0; i < ra->depth && slot < 0; i++) if (ra->job[i] && ra->ofs[i] == c) slot = i;
+		if (slot < 0) break;
+
+		offload_wait(ra->job[slot]);
+		int in = pos - c;
+		if (ra->len[slot] <= in) break;
+
+		int n = MIN(ra->len[slot] - in, length - done);
+		memcpy(dst + done, ra->buf + (size_t)slot * ra->chunk + in, n);
+		done += n;
+		pos += n;
+		if (ra->len[slot] < ra->chunk) break;
+	}
+
+	counter_add(done ? CNT_RA_HIT : CNT_RA_MISS);
+	if (done) fseeko64(file->filp, pos, SEEK_SET);
+	return done;
+}
+
+// track the access pattern after a read of len bytes at offset.
+static void ra_update(fileTYPE *file, __off64_t offset, int len)
+{
+	if (file->type == 1 || offload_is_worker()) return;
+
+	if (!file->ra)
+	{
+		storageProfile prof;
+		FileStorageProfile(fileno(file->filp), &prof);
+		file->ra = new fileReadCache{};
+		file->ra->depth = prof.ra_depth;
+		file->ra->chunk = prof.ra_chunk;
+		file->ra->seq_min = prof.ra_seq;
+		file->ra->next = -1;
+	}
+
+	fileReadCache *ra = file->ra;
+	if (!ra->depth) return;
+
+	ra->seq = (offset == ra->next) ? ra->seq + 1 : 0;
+	ra->next = offset + len;
+	if (ra->seq < ra->seq_min) return;
+
+	if (!ra->buf)
+	{
+		ra->buf = (uint8_t*)malloc((size_t)ra->depth * ra->chunk);
+		if (!ra->buf)
+		{
+			ra->depth = 0;
+			return;
+		}
+		for (int i = 0; i < ra->depth; i++) ra->len[i] = -1;
+	}
+
+	ra_fill(file, ra->next);
+}
+
+static void bc_free(fileTYPE *file);
+static void ovl_free(fileTYPE *file);
+
+void FileClose(fileTYPE *file)
+{
+	ra_free(file);
+	bc_free(file);
+	ovl_free(file);
+
+	mem_release(file);
+
+	delete file->src;
+	file->src = nullptr;
+
+	if (file->zip)
+	{
+		if (file->zip->iter)
+		{
+			mz_zip_reader_extract_iter_free(file->zip->iter);
+		}
+		free(file->zip->cp);
+		zip_pool_put(file->zip->handle);
+
+		delete file->zip;
+	}
+
+	if (file->dfd >= 0)
+	{
+		close(file->dfd);
+		file->dfd = -1;
+	}
+
+	if (file->filp)
+	{
+		//printf("closing %p\n", file->filp);
+		fclose(file->filp);
+		if (file->type == 1)
+		{
+			if (file->name[0] == '/')
+			{
+				shm_unlink(file->name);
+			}
+			file->type = 0;
+		}
+	}
+
+	file->zip = nullptr;
+	file->filp = nullptr;
+	file->size = 0;
+}
+
+static int zip_search_by_crc(mz_zip_archive *zipArchive, uint32_t crc32)
+{
+	for (unsigned int file_index = 0; file_index < zipArchive->m_total_files; file_index++)
+	{
+		mz_zip_archive_file_stat s;
+		if (mz_zip_reader_file_stat(zipArchive, file_index, &s))
+		{
+			if (s.m_crc32 == crc32)
+			{
+				return file_index;
+			}
+		}
+	}
+
+	return -1;
+}
+
+// Unpacked copies of zipped files in tmpfs (unzip_cache in MiSTer.ini), so a
+// second launch reads and maps a plain file instead of inflating it again.
+// Entries are named by zip path, member (or crc) and size and mtime of the
+// zip, an updated zip is never taken from the cache. The mtime of an entry
+// is its last use for the trimming.
+#define UNZIP_CACHE_DIR "/tmp/unzip_cache"
+#define UNZIP_CACHE_NUM 128
+#define UNZIP_CACHE_MIN (64 * 1024) // smaller ones inflate faster than they are looked up
+
+static int unzip_cache_name(const char *zip_path, const char *file_path, uint32_t crc32, char *out, int size)
+{
+	struct stat64 st;
+	if (!cfg.unzip_cache || stat64(zip_path, &st) < 0) return 0;
+
+	uint32_t hash = 2166136261u;
+	for (const char *p = zip_path; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	uint32_t member = crc32;
+	if (!crc32)
+	{
+		member = 2166136261u;
+		for (const char *p = file_path; *p; p++) member = (member ^ (uint8_t)*p) * 16777619u;
+	}
+	snprintf(out, size, UNZIP_CACHE_DIR "/%08X_%c%08X_%llX_%llX.bin", hash, crc32 ? 'c' : 'n', member,
+		(unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+	return 1;
+}
+
+static int unzip_cache_open(fileTYPE *file, const char *cname)
+{
+	int fd = open(cname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	struct stat64 st;
+	if (fstat64(fd, &st) < 0 || !(file->filp = fdopen(fd, "r")))
+	{
+		close(fd);
+		return 0;
+	}
+
+	utimes(cname, NULL);
+	file->size = st.st_size;
+	file->offset = 0;
+	file->mode = O_RDONLY;
+	printf("%s from unzip cache.\n", file->path);
+	return 1;
+}
+
+// drop the least recently used entries until the cache fits into limit bytes,
+// returns the size of what is left. Runs on the main thread and the bulk worker.
+static uint64_t unzip_cache_trim(uint64_t limit)
+{
+	struct { char name[64]; time_t used; uint64_t size; } list[UNZIP_CACHE_NUM];
+	int num = 0;
+	uint64_t total = 0;
+
+	DIR *d = opendir(UNZIP_CACHE_DIR);
+	if (!d) return 0;
+
+	struct dirent *de;
+	while ((de = readdir(d)) && num < UNZIP_CACHE_NUM)
+	{
+		int len = strlen(de->d_name);
+		if (len < 4 || len >= (int)sizeof(list[0].name) || strcmp(de->d_name + len - 4, ".bin")) continue;
+
+		char path[128];
+		struct stat64 st;
+		snprintf(path, sizeof(path), UNZIP_CACHE_DIR "/%s", de->d_name);
+		if (stat64(path, &st) < 0) continue;
+
+		strcpy(list[num].name, de->d_name);
+		list[num].used = st.st_mtime;
+		list[num].size = st.st_size;
+		total += st.st_size;
+		num++;
+	}
+	closedir(d);
+
+	while ((total > limit || num == UNZIP_CACHE_NUM) && num)
+	{
+		int old = 0;
+		for (int i = 1; i < num; i++) if (list[i].used < list[old].used) old = i;
+
+		char path[128];
+		snprintf(path, sizeof(path), UNZIP_CACHE_DIR "/%s", list[old].name);
+		unlink(path);
+		total -= list[old].size;
+		list[old] = list[--num];
+	}
+	return total;
+}
+
+static size_t unzip_cache_size()
+{
+	return unzip_cache_trim(UINT64_MAX);
+}
+
+static size_t unzip_cache_budget_trim(size_t bytes)
+{
+	uint64_t total = unzip_cache_size();
+	return total - unzip_cache_trim((total > bytes) ? total - bytes : 0);
+}
+
+// the member is inflated into the cache on the bulk worker, with a zip
+// handle of its own, while the loader goes on reading it from the zip
+static void unzip_cache_store(const char *cname, const char *zip_path, int index, uint64_t size)
+{
+	uint64_t limit = cfg.unzip_cache * 1024ULL * 1024ULL;
+	if (size < UNZIP_CACHE_MIN || size > limit) return;
+
+	char *path = strdup(cname);
+	char *zpath = strdup(zip_path);
+	if (!path || !zpath)
+	{
+		free(path);
+		free(zpath);
+		return;
+	}
+
+	offload_add_work([path, zpath, index, size, limit]
+	{
+		mkdir(UNZIP_CACHE_DIR, 0755);
+		membudget_register("unzip", MEMBUDGET_PRIO_LOW, unzip_cache_size, unzip_cache_budget_trim);
+
+		// written under a temporary name, so a loader never sees a partial
+		// file. O_EXCL keeps a second launch from inflating the same member.
+		char tmp[128];
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		struct stat64 st;
+		if (fd < 0 && errno == EEXIST && !stat64(tmp, &st) && st.st_mtime < time(NULL) - 60)
+		{
+			// left behind by a restart in the middle of it
+			unlink(tmp);
+			fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		}
+		FILE *fp = (fd >= 0) ? fdopen(fd, "w") : 0;
+		if (fp)
+		{
+			unzip_cache_trim(limit - size);
+
+			zipHandle *z = zip_open_handle(zpath, 0);
+			int ok = z && mz_zip_reader_extract_to_cfile(&z->archive, index, fp, 0);
+			if (z) zip_close_handle(z);
+			if (fclose(fp)) ok = 0;
+			if (!ok || rename(tmp, path) < 0) unlink(tmp);
+		}
+		else if (fd >= 0)
+		{
+			close(fd);
+			unlink(tmp);
+		}
+		free(path);
+		free(zpath);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
+{
+	make_fullpath(name);
+	FileClose(file);
+	file->mode = 0;
+	file->type = 0;
 
 	char *p = strrchr(full_path, '/');
 	strcpy(file->name, (p) ? p + 1 : full_path);
+	snprintf(file->path, sizeof(file->path), "%s", full_path);
 
 	char *zip_path, *file_path;
 	if (!FileIsZipped(full_path, &zip_path, &file_path))
@@ -344,43 +1316,54 @@ int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
 		return 0;
 	}
 
-	file->zip = new fileZipArchive{};
-	if (!mz_zip_reader_init_file(&file->zip->archive, zip_path, 0))
+	char cname[128];
+	int cached = unzip_cache_name(zip_path, file_path, crc32, cname, sizeof(cname));
+	if (cached && unzip_cache_open(file, cname)) return 1;
+
+	zipHandle *z = zip_take(zip_path);
+	if (!z)
 	{
-		printf("FileOpenZip(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+		printf("FileOpenZip(zip_take) Zip:%s, cannot open.\n", zip_path);
 		return 0;
 	}
 
+	file->zip = new fileZipArchive{};
+	file->zip->handle = z;
+	file->zip->archive = &z->archive;
+
 	file->zip->index = -1;
-	if (crc32) file->zip->index = zip_search_by_crc(&file->zip->archive, crc32);
-	if (file->zip->index < 0) file->zip->index = mz_zip_reader_locate_file(&file->zip->archive, file_path, NULL, 0);
+	if (crc32)
+	{
+		zipIndex *zi = zip_index_get(zip_path);
+		file->zip->index = zi ? zip_index_find_crc(zi, crc32) : zip_search_by_crc(file->zip->archive, crc32);
+	}
+	if (file->zip->index < 0) file->zip->index = mz_zip_reader_locate_file(file->zip->archive, file_path, NULL, 0);
 	if (file->zip->index < 0)
 	{
 		printf("FileOpenZip(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
 
 	mz_zip_archive_file_stat s;
-	if (!mz_zip_reader_file_stat(&file->zip->archive, file->zip->index, &s))
+	if (!mz_zip_reader_file_stat(file->zip->archive, file->zip->index, &s))
 	{
 		printf("FileOpenZip(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
 	file->size = s.m_uncomp_size;
 
-	file->zip->iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
+	file->zip->iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
 	if (!file->zip->iter)
 	{
 		printf("FileOpenZip(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
@@ -388,6 +1371,7 @@ int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
 	file->zip->offset = 0;
 	file->offset = 0;
 	file->mode = O_RDONLY;
+	if (cached) unzip_cache_store(cname, zip_path, file->zip->index, file->size);
 	return 1;
 }
 
@@ -400,6 +1384,7 @@ int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zi
 
 	char *p = strrchr(full_path, '/');
 	strcpy(file->name, (mode == -1) ? full_path : p + 1);
+	snprintf(file->path, sizeof(file->path), "%s", full_path);
 
 	char *zip_path, *file_path;
 	if (use_zip && (mode != -1) && FileIsZipped(full_path, &zip_path, &file_path))
@@ -411,47 +1396,55 @@ int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zi
 			return 0;
 		}
 
-		file->zip = new fileZipArchive{};
-		if (!mz_zip_reader_init_file(&file->zip->archive, zip_path, 0))
+		char cname[128];
+		int cached = unzip_cache_name(zip_path, file_path, 0, cname, sizeof(cname));
+		if (cached && unzip_cache_open(file, cname)) return 1;
+
+		zipHandle *z = zip_take(zip_path);
+		if (!z)
 		{
-			if(!mute) printf("FileOpenEx(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+			if(!mute) printf("FileOpenEx(zip_take) Zip:%s, cannot open.\n", zip_path);
 			return 0;
 		}
 
-		file->zip->index = mz_zip_reader_locate_file(&file->zip->archive, file_path, NULL, 0);
+		file->zip = new fileZipArchive{};
+		file->zip->handle = z;
+		file->zip->archive = &z->archive;
+
+		file->zip->index = mz_zip_reader_locate_file(file->zip->archive, file_path, NULL, 0);
 		if (file->zip->index < 0)
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
 
 		mz_zip_archive_file_stat s;
-		if (!mz_zip_reader_file_stat(&file->zip->archive, file->zip->index, &s))
+		if (!mz_zip_reader_file_stat(file->zip->archive, file->zip->index, &s))
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
 		file->size = s.m_uncomp_size;
 
-		file->zip->iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
+		file->zip->iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
 		if (!file->zip->iter)
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
 		file->zip->offset = 0;
 		file->offset = 0;
 		file->mode = mode;
+		if (cached) unzip_cache_store(cname, zip_path, file->zip->index, file->size);
 	}
 	else
 	{
@@ -513,7 +1506,11 @@ int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zi
 
 __off64_t FileGetSize(fileTYPE *file)
 {
-	if (file->filp)
+	if (file->ovl || file->mem || file->src)
+	{
+		return file->size;
+	}
+	else if (file->filp)
 	{
 		struct stat64 st;
 		if (fstat64(fileno(file->filp), &st) < 0) return 0;
@@ -542,7 +1539,17 @@ int FileOpen(fileTYPE *file, const char *name, char mute)
 
 int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 {
-	if (file->filp)
+	if (file->ovl || file->mem || file->src)
+	{
+		if (origin == SEEK_CUR) offset += file->offset;
+		else if (origin == SEEK_END) offset += file->size;
+		if (offset < 0)
+		{
+			printf("Fail to seek the file: offset=%lld, %s.\n", offset, file->name);
+			return 0;
+		}
+	}
+	else if (file->filp)
 	{
 		__off64_t res = fseeko64(file->filp, offset, origin);
 		if (res < 0)
@@ -563,13 +1570,28 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 			offset = file->size - offset;
 		}
 
-		if (offset < file->zip->offset)
+		mz_zip_reader_extract_iter_state *it = file->zip->iter;
+		zipCheckpoint *cp = zip_checkpoint_find(file->zip, offset);
+
+		if (it && !it->file_stat.m_method && it->status != TINFL_STATUS_FAILED && offset <= (__off64_t)it->file_stat.m_uncomp_size)
+		{
+			// stored member, just move the file position
+			it->cur_file_ofs = it->cur_file_ofs - it->out_buf_ofs + offset;
+			it->comp_remaining = it->comp_remaining + it->out_buf_ofs - offset;
+			it->out_buf_ofs = offset;
+			file->zip->offset = offset;
+		}
+		else if (cp && (offset < file->zip->offset || (__off64_t)cp->out_ofs > file->zip->offset))
+		{
+			zip_checkpoint_restore(file->zip, cp);
+		}
+		else if (offset < file->zip->offset)
 		{
-			mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
+			mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
 			if (!iter)
 			{
 				printf("FileSeek(mz_zip_reader_extract_iter_new) Failed to rewind iterator, error:%s\n",
-				       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+				       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 				return 0;
 			}
 
@@ -584,10 +1606,11 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 			const size_t want_len = MIN((__off64_t)sizeof(buf), offset - file->zip->offset);
 			const size_t read_len = mz_zip_reader_extract_iter_read(file->zip->iter, buf, want_len);
 			file->zip->offset += read_len;
+			zip_checkpoint_add(file->zip);
 			if (read_len < want_len)
 			{
 				printf("FileSeek(mz_zip_reader_extract_iter_read) Failed to advance iterator, error:%s\n",
-				       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+				       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 				return 0;
 			}
 		}
@@ -608,70 +1631,750 @@ int FileSeekLBA(fileTYPE *file, uint32_t offset)
 	return FileSeek(file, off64, SEEK_SET);
 }
 
-// Read with offset advancing
-int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres)
+// Copy-on-write overlay disk, see FileOpenDisk. The overlay file holds a
+// header naming the read-only base image, an index with the data slot of
+// every written block (0 - still in the base) and the slots themselves,
+// appended in the order blocks are first written.
+#define OVL_MAGIC   "MiSTrOVL"
+#define OVL_VERSION 1
+#define OVL_BLOCK   (64 * 1024)
+#define OVL_HDR     4096
+
+struct ovlHeader
 {
-	ssize_t ret = 0;
+	char     magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint64_t size;       // virtual disk size, equal to the base size
+	uint64_t index_ofs;
+	uint64_t data_ofs;
+	char     base[1024];
+};
 
-	if (file->filp)
-	{
-		ret = fread(pBuffer, 1, length, file->filp);
-		if (ret < 0)
-		{
-			printf("FileReadAdv error(%d).\n", ret);
-			return failres;
-		}
-	}
-	else if (file->zip)
-	{
-		ret = mz_zip_reader_extract_iter_read(file->zip->iter, pBuffer, length);
-		if (!ret)
-		{
-			printf("FileReadEx(mz_zip_reader_extract_iter_read) Failed to read, error:%s\n",
-			       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-			return failres;
-		}
-		file->zip->offset += ret;
-	}
-	else
-	{
-		printf("FileReadAdv error(unknown file type).\n");
-		return failres;
-	}
+struct fileOverlay
+{
+	pthread_mutex_t lock;
+	fileTYPE base;
+	uint32_t block_size;
+	uint32_t slots;      // data slots in use
+	uint64_t index_ofs;
+	uint64_t data_ofs;
+	std::vector<uint32_t> index;
+	std::vector<uint8_t> buf;
+};
 
-	file->offset += ret;
-	return ret;
+static void ovl_free(fileTYPE *file)
+{
+	fileOverlay *o = file->ovl;
+	if (!o) return;
+
+	pthread_mutex_destroy(&o->lock);
+	delete o;
+	file->ovl = 0;
 }
 
-int FileReadSec(fileTYPE *file, void *pBuffer)
+// whole requests only, the overlay gives no other guarantee on error
+static ssize_t ovl_pread(int fd, void *buf, size_t len, __off64_t offset)
 {
-	return FileReadAdv(file, pBuffer, 512);
+	ssize_t ret = pread64(fd, buf, len, offset);
+	if (ret >= 0 && (size_t)ret != len) errno = EIO;
+	return ((size_t)ret == len) ? ret : -1;
 }
 
-// Write with offset advancing
-int FileWriteAdv(fileTYPE *file, void *pBuffer, int length, int failres)
+static ssize_t ovl_pwrite(int fd, const void *buf, size_t len, __off64_t offset)
 {
-	int ret;
+	ssize_t ret = pwrite64(fd, buf, len, offset);
+	if (ret >= 0 && (size_t)ret != len) errno = ENOSPC;
+	return ((size_t)ret == len) ? ret : -1;
+}
 
-	if (file->filp)
+static ssize_t ovl_read(fileTYPE *file, __off64_t offset, uint8_t *dst, size_t length)
+{
+	fileOverlay *o = file->ovl;
+	__off64_t end = MIN(offset + (__off64_t)length, file->size);
+	__off64_t pos = offset;
+
+	pthread_mutex_lock(&o->lock);
+	while (pos < end)
 	{
-		ret = fwrite(pBuffer, 1, length, file->filp);
-		fflush(file->filp);
+		// extend over the following blocks coming from the same place
+		uint64_t b = pos / o->block_size;
+		uint32_t idx = o->index[b];
+		uint64_t n = b + 1;
+		while ((__off64_t)(n * o->block_size) < end && o->index[n] == (idx ? idx + (n - b) : 0)) n++;
+
+		size_t cnt = MIN((__off64_t)(n * o->block_size), end) - pos;
+		ssize_t ret = idx ?
+			ovl_pread(fileno(file->filp), dst, cnt, o->data_ofs + (uint64_t)(idx - 1) * o->block_size + pos % o->block_size) :
+			ovl_pread(fileno(o->base.filp), dst, cnt, pos);
 
 		if (ret < 0)
 		{
-			printf("FileWriteAdv error(%d).\n", ret);
-			return failres;
+			pthread_mutex_unlock(&o->lock);
+			return -1;
 		}
 
-		file->offset += ret;
-		if (file->offset > file->size) file->size = FileGetSize(file);
-		return ret;
+		dst += cnt;
+		pos += cnt;
 	}
-	else if (file->zip)
+	pthread_mutex_unlock(&o->lock);
+
+	return pos - offset;
+}
+
+static ssize_t ovl_write(fileTYPE *file, __off64_t offset, const uint8_t *src, size_t length)
+{
+	fileOverlay *o = file->ovl;
+	int fd = fileno(file->filp);
+	if (offset + (__off64_t)length > file->size)
 	{
-		printf("FileWriteAdv error(not supported for zip).\n");
-		return failres;
+		errno = ENOSPC;
+		return -1;
+	}
+
+	pthread_mutex_lock(&o->lock);
+	__off64_t pos = offset, end = offset + length;
+	while (pos < end)
+	{
+		uint64_t b = pos / o->block_size;
+		uint32_t in = pos % o->block_size;
+		uint32_t cnt = MIN((__off64_t)(o->block_size - in), end - pos);
+		uint32_t idx = o->index[b];
+
+		if (idx)
+		{
+			if (ovl_pwrite(fd, src, cnt, o->data_ofs + (uint64_t)(idx - 1) * o->block_size + in) < 0) break;
+		}
+		else
+		{
+			// first write to the block: copy it up, data goes out before the index entry
+			uint32_t slot = o->slots + 1;
+			uint32_t blen = MIN((__off64_t)o->block_size, file->size - (__off64_t)b * o->block_size);
+			const uint8_t *data = src;
+			if (cnt < blen)
+			{
+				if (ovl_pread(fileno(o->base.filp), o->buf.data(), blen, b * o->block_size) < 0) break;
+				memcpy(o->buf.data() + in, src, cnt);
+				data = o->buf.data();
+			}
+
+			if (ovl_pwrite(fd, data, blen, o->data_ofs + (uint64_t)(slot - 1) * o->block_size) < 0) break;
+			if (ovl_pwrite(fd, &slot, sizeof(slot), o->index_ofs + b * sizeof(slot)) < 0) break;
+
+			o->index[b] = slot;
+			o->slots = slot;
+		}
+
+		src += cnt;
+		pos += cnt;
+	}
+	pthread_mutex_unlock(&o->lock);
+
+	return (pos < end) ? -1 : (ssize_t)length;
+}
+
+static int ovl_header(fileTYPE *file, ovlHeader *h)
+{
+	if (!file->filp || file->size < OVL_HDR) return 0;
+	if (pread64(fileno(file->filp), h, sizeof(*h), 0) != sizeof(*h)) return 0;
+	if (memcmp(h->magic, OVL_MAGIC, sizeof(h->magic))) return 0;
+
+	h->base[sizeof(h->base) - 1] = 0;
+	return 1;
+}
+
+int FileOpenDisk(fileTYPE *file, const char *name, int mode)
+{
+	if (!FileOpenEx(file, name, mode)) return 0;
+
+	ovlHeader h;
+	if (!ovl_header(file, &h)) return 1;
+
+	uint32_t bs = h.block_size;
+	if (h.version != OVL_VERSION || bs < 4096 || (bs & (bs - 1)) || h.index_ofs < sizeof(h) || h.data_ofs < h.index_ofs + ((h.size + bs - 1) / bs) * 4)
+	{
+		printf("FileOpenDisk(%s): unsupported overlay.\n", file->name);
+		FileClose(file);
+		return 0;
+	}
+
+	fileOverlay *o = new fileOverlay();
+	if (!FileOpenEx(&o->base, h.base, O_RDONLY) || !o->base.filp || (uint64_t)o->base.size != h.size)
+	{
+		printf("FileOpenDisk(%s): base image %s is %s.\n", file->name, h.base, o->base.opened() ? "of different size" : "not available");
+		delete o;
+		FileClose(file);
+		return 0;
+	}
+
+	o->block_size = bs;
+	o->index_ofs = h.index_ofs;
+	o->data_ofs = h.data_ofs;
+	o->index.resize((h.size + bs - 1) / bs);
+	o->buf.resize(bs);
+	o->slots = 0;
+
+	if (ovl_pread(fileno(file->filp), o->index.data(), o->index.size() * 4, o->index_ofs) < 0)
+	{
+		printf("FileOpenDisk(%s): cannot read the index.\n", file->name);
+		delete o;
+		FileClose(file);
+		return 0;
+	}
+
+	// a slot past the largest index entry is a block lost by a crash, reuse it
+	for (uint32_t idx : o->index) if (idx > o->slots) o->slots = idx;
+	pthread_mutex_init(&o->lock, 0);
+
+	file->ovl = o;
+	file->size = h.size;
+	file->offset = 0;
+	printf("Overlay %s on %s, %u of %u blocks written.\n", file->name, h.base, o->slots, (uint32_t)o->index.size());
+	return 1;
+}
+
+int FileOverlayCreate(const char *name, const char *base)
+{
+	ovlHeader h = {};
+	fileTYPE f;
+
+	// reset keeps the base of the existing overlay
+	if (!base)
+	{
+		if (!FileOpenEx(&f, name, O_RDONLY) || !ovl_header(&f, &h))
+		{
+			printf("FileOverlayCreate(%s): not an overlay.\n", name);
+			return 0;
+		}
+		FileClose(&f);
+		base = h.base;
+	}
+
+	// base name has to outlive the header reset below
+	char base_name[sizeof(h.base)];
+	snprintf(base_name, sizeof(base_name), "%s", base);
+
+	if (!FileOpenEx(&f, base_name, O_RDONLY) || !f.filp)
+	{
+		printf("FileOverlayCreate(%s): cannot open base image %s.\n", name, base_name);
+		return 0;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, OVL_MAGIC, sizeof(h.magic));
+	h.version = OVL_VERSION;
+	h.block_size = OVL_BLOCK;
+	h.size = f.size;
+	h.index_ofs = OVL_HDR;
+	h.data_ofs = (OVL_HDR + ((h.size + OVL_BLOCK - 1) / OVL_BLOCK) * 4 + OVL_BLOCK - 1) & ~(uint64_t)(OVL_BLOCK - 1);
+	strcpy(h.base, base_name);
+	FileClose(&f);
+
+	if (!FileOpenEx(&f, name, O_CREAT | O_TRUNC | O_RDWR | O_SYNC))
+	{
+		printf("FileOverlayCreate(%s): cannot create.\n", name);
+		return 0;
+	}
+
+	static uint8_t hdr[OVL_HDR];
+	memcpy(hdr, &h, sizeof(h));
+	int ok = ovl_pwrite(fileno(f.filp), hdr, sizeof(hdr), 0) >= 0 && !ftruncate64(fileno(f.filp), h.data_ofs);
+	if (!ok) printf("FileOverlayCreate(%s) error(%s).\n", name, strerror(errno));
+	else printf("Overlay %s created on %s (%llu MB).\n", name, base_name, (unsigned long long)(h.size >> 20));
+
+	FileClose(&f);
+	return ok;
+}
+
+// raw positional access under the block cache
+static ssize_t file_pread(fileTYPE *file, void *buf, size_t len, __off64_t offset)
+{
+	if (file->ovl) return ovl_read(file, offset, (uint8_t*)buf, len);
+	return pread64(fileno(file->filp), buf, len, offset);
+}
+
+static ssize_t file_pwritev(fileTYPE *file, const struct iovec *iov, int cnt, __off64_t offset)
+{
+	if (!file->ovl) return pwritev64(fileno(file->filp), iov, cnt, offset);
+
+	ssize_t total = 0;
+	for (int i = 0; i < cnt; i++)
+	{
+		if (ovl_write(file, offset + total, (const uint8_t*)iov[i].iov_base, iov[i].iov_len) < 0) return -1;
+		total += iov[i].iov_len;
+	}
+	return total;
+}
+
+// LRU cache of 4KB blocks for disk images, see FileSetCache. Guests keep
+// re-reading their FAT, bitmap and directory sectors, which are then served
+// from memory. Misses read the whole run of missing blocks with one pread.
+// Writes go through to the file and update the cached copies, unless a write
+// delay is set: then they only dirty the blocks, which are written back later
+// in runs of adjacent blocks (FileFlushCache, eviction, close).
+#define BC_BLOCK 4096
+#define BC_RUN   32
+#define BC_NONE  0xFFFFFFFF
+
+struct fileBlockCache
+{
+	pthread_mutex_t lock;
+	uint32_t num;
+	uint8_t *data;
+	std::vector<uint64_t> block; // block number per slot
+	std::vector<uint32_t> len;   // valid bytes per slot, 0 - free
+	std::vector<uint32_t> prev, next;
+	std::vector<uint8_t> dirty;
+	uint32_t head, tail;         // most and least recently used
+	uint32_t ndirty;
+	uint32_t delay;              // write-back mode if not 0
+	unsigned long dirty_at;      // GetTimer() of the oldest dirty block
+	int werr;
+	std::unordered_map<uint64_t, uint32_t> map;
+	uint8_t run[BC_RUN * BC_BLOCK];
+};
+
+// allocated by all the caches, they hold dirty blocks and aren't trimmed
+static std::atomic<size_t> bc_bytes(0);
+
+static size_t bc_size()
+{
+	return bc_bytes.load();
+}
+
+static void bc_unlink(fileBlockCache *c, uint32_t s)
+{
+	if (c->prev[s] != BC_NONE) c->next[c->prev[s]] = c->next[s];
+	else c->head = c->next[s];
+	if (c->next[s] != BC_NONE) c->prev[c->next[s]] = c->prev[s];
+	else c->tail = c->prev[s];
+}
+
+static void bc_touch(fileBlockCache *c, uint32_t s)
+{
+	if (c->head == s) return;
+
+	bc_unlink(c, s);
+	c->prev[s] = BC_NONE;
+	c->next[s] = c->head;
+	c->prev[c->head] = s;
+	c->head = s;
+}
+
+static uint32_t bc_find(fileBlockCache *c, uint64_t block)
+{
+	auto it = c->map.find(block);
+	return (it == c->map.end()) ? BC_NONE : it->second;
+}
+
+// write all dirty blocks back in ascending order, adjacent blocks with one pwritev.
+static void bc_flush(fileTYPE *file)
+{
+	fileBlockCache *c = file->cache;
+	if (!c->ndirty) return;
+
+	std::vector<uint32_t> slots;
+	slots.reserve(c->ndirty);
+	for (uint32_t s = 0; s < c->num; s++) if (c->dirty[s]) slots.push_back(s);
+	std::sort(slots.begin(), slots.end(), [c](uint32_t a, uint32_t b) { return c->block[a] < c->block[b]; });
+
+	struct iovec iov[BC_RUN];
+	for (size_t i = 0; i < slots.size();)
+	{
+		uint64_t first = c->block[slots[i]];
+		int n = 0;
+		ssize_t size = 0;
+		while (i < slots.size() && n < BC_RUN && c->block[slots[i]] == first + n)
+		{
+			uint32_t s = slots[i++];
+			iov[n].iov_base = c->data + (size_t)s * BC_BLOCK;
+			iov[n].iov_len = c->len[s];
+			size += c->len[s];
+			c->dirty[s] = 0;
+			n++;
+			if (c->len[s] < BC_BLOCK) break;
+		}
+
+		ssize_t ret = file_pwritev(file, iov, n, first * BC_BLOCK);
+		if (ret != size)
+		{
+			printf("FileFlushCache(%s) error(%s).\n", file->name, (ret < 0) ? strerror(errno) : "short write");
+			c->werr = 1;
+		}
+	}
+	c->ndirty = 0;
+}
+
+static void bc_insert(fileTYPE *file, uint64_t block, const uint8_t *src, uint32_t len)
+{
+	fileBlockCache *c = file->cache;
+	uint32_t s = c->tail;
+	if (c->dirty[s]) bc_flush(file);
+	if (c->len[s]) c->map.erase(c->block[s]);
+
+	memcpy(c->data + (size_t)s * BC_BLOCK, src, len);
+	c->block[s] = block;
+	c->len[s] = len;
+	c->map[block] = s;
+	bc_touch(c, s);
+}
+
+static void bc_free(fileTYPE *file)
+{
+	fileBlockCache *c = file->cache;
+	if (!c) return;
+
+	if (file->filp) bc_flush(file);
+	pthread_mutex_destroy(&c->lock);
+	bc_bytes -= (size_t)c->num * BC_BLOCK;
+	free(c->data);
+	delete c;
+	file->cache = 0;
+}
+
+static int bc_read(fileTYPE *file, __off64_t offset, uint8_t *dst, int length, int failres)
+{
+	fileBlockCache *c = file->cache;
+	__off64_t end = MIN(offset + length, file->size);
+	__off64_t pos = offset;
+
+	pthread_mutex_lock(&c->lock);
+	while (pos < end)
+	{
+		uint64_t b = pos / BC_BLOCK;
+		uint32_t in = pos % BC_BLOCK;
+		uint32_t s = bc_find(c, b);
+
+		if (s == BC_NONE)
+		{
+			uint32_t n = 1;
+			while (n < BC_RUN && (__off64_t)(b + n) * BC_BLOCK < end && bc_find(c, b + n) == BC_NONE) n++;
+
+			uint32_t t = counters_time_us();
+			ssize_t ret = file_pread(file, c->run, n * BC_BLOCK, b * BC_BLOCK);
+			histogram_add(HIST_FILE_READ, counters_time_us() - t);
+			if (ret < 0)
+			{
+				pthread_mutex_unlock(&c->lock);
+				printf("FileReadAt error(%s).\n", strerror(errno));
+				return failres;
+			}
+
+			counter_add(CNT_FILE_READ, ret);
+			counter_add(CNT_HDD_MISS, n);
+			for (uint32_t i = 0; i < n && (ssize_t)(i * BC_BLOCK) < ret; i++)
+			{
+				bc_insert(file, b + i, c->run + i * BC_BLOCK, MIN((ssize_t)BC_BLOCK, ret - i * BC_BLOCK));
+			}
+
+			s = bc_find(c, b);
+			if (s == BC_NONE) break;
+		}
+		else
+		{
+			counter_add(CNT_HDD_HIT);
+			bc_touch(c, s);
+		}
+
+		if (in >= c->len[s]) break;
+
+		uint32_t cnt = MIN((__off64_t)(c->len[s] - in), end - pos);
+		memcpy(dst, c->data + (size_t)s * BC_BLOCK + in, cnt);
+		dst += cnt;
+		pos += cnt;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return pos - offset;
+}
+
+// keep the cached blocks equal to the file after a write.
+static void bc_write(fileTYPE *file, __off64_t offset, const uint8_t *src, int length)
+{
+	fileBlockCache *c = file->cache;
+	if (!c || length <= 0) return;
+
+	pthread_mutex_lock(&c->lock);
+	__off64_t pos = offset, end = offset + length;
+	while (pos < end)
+	{
+		uint64_t b = pos / BC_BLOCK;
+		uint32_t in = pos % BC_BLOCK;
+		uint32_t cnt = MIN((__off64_t)(BC_BLOCK - in), end - pos);
+
+		uint32_t s = bc_find(c, b);
+		if (s != BC_NONE)
+		{
+			if (in > c->len[s])
+			{
+				// a hole up to the write, read it again next time
+				c->map.erase(b);
+				c->len[s] = 0;
+			}
+			else
+			{
+				memcpy(c->data + (size_t)s * BC_BLOCK + in, src, cnt);
+				if (in + cnt > c->len[s]) c->len[s] = in + cnt;
+			}
+		}
+
+		src += cnt;
+		pos += cnt;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+// write-back variant of the above, the file is not touched unless a block has
+// to be loaded or evicted. Returns 0 for writes it can't take (past the end).
+static int bc_write_back(fileTYPE *file, __off64_t offset, const uint8_t *src, int length)
+{
+	fileBlockCache *c = file->cache;
+	if (offset + length > file->size) return 0;
+
+	pthread_mutex_lock(&c->lock);
+	__off64_t pos = offset, end = offset + length;
+	while (pos < end)
+	{
+		uint64_t b = pos / BC_BLOCK;
+		uint32_t in = pos % BC_BLOCK;
+		uint32_t cnt = MIN((__off64_t)(BC_BLOCK - in), end - pos);
+		uint32_t blen = MIN((__off64_t)BC_BLOCK, file->size - (__off64_t)b * BC_BLOCK);
+
+		uint32_t s = bc_find(c, b);
+		if (s == BC_NONE)
+		{
+			// partially written block needs the rest of it first
+			if (cnt < blen)
+			{
+				ssize_t ret = file_pread(file, c->run, blen, b * BC_BLOCK);
+				if (ret != (ssize_t)blen)
+				{
+					pthread_mutex_unlock(&c->lock);
+					printf("FileWriteAt error(%s).\n", (ret < 0) ? strerror(errno) : "short read");
+					return -1;
+				}
+				counter_add(CNT_FILE_READ, ret);
+			}
+			bc_insert(file, b, c->run, blen);
+			s = bc_find(c, b);
+		}
+		else
+		{
+			bc_touch(c, s);
+		}
+
+		memcpy(c->data + (size_t)s * BC_BLOCK + in, src, cnt);
+		c->len[s] = blen;
+		if (!c->dirty[s])
+		{
+			if (!c->ndirty) c->dirty_at = GetTimer(0);
+			c->dirty[s] = 1;
+			c->ndirty++;
+		}
+
+		src += cnt;
+		pos += cnt;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return length;
+}
+
+int FileFlushCache(fileTYPE *file, uint32_t age_ms)
+{
+	fileBlockCache *c = file->cache;
+	if (!c) return 1;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->ndirty && (!age_ms || CheckTimer(c->dirty_at + age_ms))) bc_flush(file);
+	int ok = !c->werr;
+	c->werr = 0;
+	pthread_mutex_unlock(&c->lock);
+	return ok;
+}
+
+int FileCacheDirty(fileTYPE *file, uint32_t age_ms)
+{
+	fileBlockCache *c = file->cache;
+	if (!c) return 0;
+
+	pthread_mutex_lock(&c->lock);
+	int ret = c->ndirty && (!age_ms || CheckTimer(c->dirty_at + age_ms));
+	pthread_mutex_unlock(&c->lock);
+	return ret;
+}
+
+int FileSetCache(fileTYPE *file, uint32_t size_mb, uint32_t write_delay)
+{
+	bc_free(file);
+	if (!size_mb || !file->filp || file->type == 1) return 0;
+
+	fileBlockCache *c = new fileBlockCache();
+	c->num = size_mb * (1024 * 1024 / BC_BLOCK);
+	c->data = (uint8_t*)malloc((size_t)c->num * BC_BLOCK);
+	if (!c->data)
+	{
+		printf("FileSetCache(%s): no memory for %uMB\n", file->name, size_mb);
+		delete c;
+		return 0;
+	}
+
+	c->block.resize(c->num);
+	c->len.assign(c->num, 0);
+	c->dirty.assign(c->num, 0);
+	c->ndirty = 0;
+	c->delay = write_delay;
+	c->werr = 0;
+	c->prev.resize(c->num);
+	c->next.resize(c->num);
+	for (uint32_t i = 0; i < c->num; i++)
+	{
+		c->prev[i] = i ? i - 1 : BC_NONE;
+		c->next[i] = (i + 1 < c->num) ? i + 1 : BC_NONE;
+	}
+	c->head = 0;
+	c->tail = c->num - 1;
+	c->map.reserve(c->num);
+	pthread_mutex_init(&c->lock, 0);
+
+	bc_bytes += (size_t)c->num * BC_BLOCK;
+	membudget_register("hdd_blocks", MEMBUDGET_PRIO_HIGH, bc_size);
+	file->cache = c;
+	return 1;
+}
+
+// Read with offset advancing
+int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres)
+{
+	ssize_t ret = 0;
+
+	if (file->ovl || file->mem || file->src)
+	{
+		// counted by FileReadAt
+		ret = FileReadAt(file, file->offset, pBuffer, length, -1);
+		if (ret < 0) return failres;
+		file->offset += ret;
+		return ret;
+	}
+	else if (file->filp)
+	{
+		// stdio reads don't go through the block cache
+		if (file->cache) FileFlushCache(file);
+
+		ret = ra_read(file, (uint8_t*)pBuffer, length);
+		if (ret < length)
+		{
+			uint32_t t = counters_time_us();
+			ssize_t rd = fread((uint8_t*)pBuffer + ret, 1, length - ret, file->filp);
+			histogram_add(HIST_FILE_READ, counters_time_us() - t);
+			if (rd < 0)
+			{
+				printf("FileReadAdv error(%d).\n", rd);
+				return failres;
+			}
+			ret += rd;
+		}
+		ra_update(file, file->offset, ret);
+	}
+	else if (file->zip)
+	{
+		ret = mz_zip_reader_extract_iter_read(file->zip->iter, pBuffer, length);
+		if (!ret)
+		{
+			printf("FileReadEx(mz_zip_reader_extract_iter_read) Failed to read, error:%s\n",
+			       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
+			return failres;
+		}
+		file->zip->offset += ret;
+		zip_checkpoint_add(file->zip);
+	}
+	else
+	{
+		printf("FileReadAdv error(unknown file type).\n");
+		return failres;
+	}
+
+	file->offset += ret;
+	counter_add(CNT_FILE_READ, ret);
+	return ret;
+}
+
+#ifndef EXFAT_SUPER_MAGIC
+#define EXFAT_SUPER_MAGIC 0x2011BAB0
+#endif
+#ifndef NTFS_SB_MAGIC
+#define NTFS_SB_MAGIC     0x5346544e
+#endif
+
+const uint8_t *FileMap(fileTYPE *file, uint32_t size, fileMapping *map)
+{
+	map->base = 0;
+	map->len = 0;
+
+	if (!file->filp || !size || file->offset + size > file->size) return 0;
+
+	// a failing read from a mapping is a SIGBUS, keep network shares on read()
+	int fd = fileno(file->filp);
+	struct statfs fs_stat;
+	if (fstatfs(fd, &fs_stat) || (fs_stat.f_type != MSDOS_SUPER_MAGIC && fs_stat.f_type != EXT4_SUPER_MAGIC &&
+		fs_stat.f_type != EXFAT_SUPER_MAGIC && fs_stat.f_type != NTFS_SB_MAGIC && fs_stat.f_type != TMPFS_MAGIC)) return 0;
+
+	__off64_t page = file->offset & ~(__off64_t)(sysconf(_SC_PAGESIZE) - 1);
+	size_t len = size + (file->offset - page);
+	void *p = mmap64(0, len, PROT_READ, MAP_SHARED, fd, page);
+	if (p == MAP_FAILED) return 0;
+
+	madvise(p, len, MADV_SEQUENTIAL);
+	map->base = p;
+	map->len = len;
+	return (const uint8_t*)p + (file->offset - page);
+}
+
+void FileUnmap(fileMapping *map)
+{
+	if (map->base) munmap(map->base, map->len);
+	map->base = 0;
+	map->len = 0;
+}
+
+int FileReadSec(fileTYPE *file, void *pBuffer)
+{
+	return FileReadAdv(file, pBuffer, 512);
+}
+
+// Write with offset advancing
+int FileWriteAdv(fileTYPE *file, void *pBuffer, int length, int failres)
+{
+	int ret;
+
+	if (file->ovl)
+	{
+		ret = FileWriteAt(file, file->offset, pBuffer, length, -1);
+		if (ret < 0) return failres;
+		file->offset += ret;
+		return ret;
+	}
+	else if (file->filp)
+	{
+		if (file->ra) ra_drop(file->ra);
+		ret = fwrite(pBuffer, 1, length, file->filp);
+		fflush(file->filp);
+
+		if (ret < 0)
+		{
+			printf("FileWriteAdv error(%d).\n", ret);
+			return failres;
+		}
+
+		bc_write(file, file->offset, (const uint8_t*)pBuffer, ret);
+		file->offset += ret;
+		if (file->offset > file->size) file->size = FileGetSize(file);
+		return ret;
+	}
+	else if (file->zip)
+	{
+		printf("FileWriteAdv error(not supported for zip).\n");
+		return failres;
 	}
 	else
 	{
@@ -685,9 +2388,254 @@ int FileWriteSec(fileTYPE *file, void *pBuffer)
 	return FileWriteAdv(file, pBuffer, 512);
 }
 
+static int direct_fd(fileTYPE *file, __off64_t offset, const void *pBuffer, int length)
+{
+	if (file->dfd >= 0 && !(((uintptr_t)pBuffer | (uintptr_t)offset | (uintptr_t)length) & (FILE_DIRECT_ALIGN - 1))) return file->dfd;
+	return fileno(file->filp);
+}
+
+int FileReadAt(fileTYPE *file, __off64_t offset, void *pBuffer, int length, int failres)
+{
+	if (file->mem)
+	{
+		if (offset < 0) return failres;
+		if (offset + length > file->size) length = (offset < file->size) ? file->size - offset : 0;
+		memcpy(pBuffer, file->mem + offset, length);
+		counter_add(CNT_FILE_READ, length);
+		return length;
+	}
+
+	if (file->src)
+	{
+		if (offset < 0) return failres;
+		if (offset + length > file->size) length = (offset < file->size) ? file->size - offset : 0;
+		int ret = length ? file->src->read(offset, pBuffer, length) : 0;
+		return (ret < 0) ? failres : ret;
+	}
+
+	if (!file->filp)
+	{
+		if (!FileSeek(file, offset, SEEK_SET)) return failres;
+		return FileReadAdv(file, pBuffer, length, failres);
+	}
+
+	if (file->cache) return bc_read(file, offset, (uint8_t*)pBuffer, length, failres);
+
+	uint32_t t = counters_time_us();
+	ssize_t ret = file->ovl ? ovl_read(file, offset, (uint8_t*)pBuffer, length) :
+		pread64(direct_fd(file, offset, pBuffer, length), pBuffer, length, offset);
+	histogram_add(HIST_FILE_READ, counters_time_us() - t);
+	if (ret < 0)
+	{
+		printf("FileReadAt error(%s).\n", strerror(errno));
+		return failres;
+	}
+
+	counter_add(CNT_FILE_READ, ret);
+	return ret;
+}
+
+void FileOpenSource(fileTYPE *file, fileSource *src, __off64_t size, const char *path)
+{
+	FileClose(file);
+	file->mode = O_RDONLY;
+	file->type = 0;
+	file->src = src;
+	file->size = size;
+	file->offset = 0;
+
+	snprintf(file->path, sizeof(file->path), "%s", path);
+	const char *p = strrchr(path, '/');
+	snprintf(file->name, sizeof(file->name), "%s", p ? p + 1 : path);
+}
+
+int FilePreload(fileTYPE *file, uint64_t done, uint64_t total)
+{
+	if (file->mem) return 1;
+	if (!file->opened() || file->ovl || (file->mode & (O_WRONLY | O_RDWR))) return 0;
+
+	__off64_t size = FileGetSize(file);
+
+	auto it = mem_files.find(file->path);
+	if (it != mem_files.end() && it->second.size == size)
+	{
+		it->second.refs++;
+		ra_free(file);
+		file->mem = it->second.data;
+		file->size = size;
+		return 1;
+	}
+
+	uint8_t *mem = (size > 0 && size < 0x7FFFFFFF) ? (uint8_t*)malloc(size) : nullptr;
+	if (!mem)
+	{
+		printf("FilePreload: cannot allocate %lld bytes for %s\n", size, file->name);
+		return 0;
+	}
+
+	__off64_t offset = file->offset;
+	int ok = FileSeek(file, 0, SEEK_SET);
+	for (__off64_t pos = 0; ok && pos < size;)
+	{
+		int len = (int)MIN((__off64_t)(1024 * 1024), size - pos);
+		ok = (FileReadAdv(file, mem + pos, len) == len);
+		pos += len;
+		if (total) ProgressMessage("Loading", file->name, (done + pos) >> 10, total >> 10);
+	}
+
+	if (!ok)
+	{
+		printf("FilePreload: read error in %s\n", file->name);
+		free(mem);
+		FileSeek(file, offset, SEEK_SET);
+		return 0;
+	}
+
+	// stdio buffer and read-ahead aren't used any more
+	ra_free(file);
+	mem_files[file->path] = { mem, size, 1 };
+	mem_files_bytes += size;
+	membudget_register("cd_preload", MEMBUDGET_PRIO_HIGH, mem_files_size);
+	file->mem = mem;
+	file->size = size;
+	FileSeek(file, offset, SEEK_SET);
+	return 1;
+}
+
+int FileWriteAt(fileTYPE *file, __off64_t offset, const void *pBuffer, int length, int failres)
+{
+	if (!file->filp)
+	{
+		if (file->zip) printf("FileWriteAt error(not supported for zip).\n");
+		return failres;
+	}
+
+	// drop the stdio read buffer and the read-ahead, they could hold the old data
+	fflush(file->filp);
+	if (file->ra) ra_drop(file->ra);
+
+	if (file->cache && file->cache->delay)
+	{
+		int ret = bc_write_back(file, offset, (const uint8_t*)pBuffer, length);
+		if (ret < 0) return failres;
+		if (ret) return ret;
+	}
+
+	ssize_t ret = file->ovl ? ovl_write(file, offset, (const uint8_t*)pBuffer, length) :
+		pwrite64(direct_fd(file, offset, pBuffer, length), pBuffer, length, offset);
+	if (ret < 0)
+	{
+		printf("FileWriteAt error(%s).\n", strerror(errno));
+		return failres;
+	}
+
+	bc_write(file, offset, (const uint8_t*)pBuffer, ret);
+	if (offset + ret > file->size) file->size = FileGetSize(file);
+	return ret;
+}
+
+int FileSetDirect(fileTYPE *file, int on)
+{
+	if (file->dfd >= 0)
+	{
+		close(file->dfd);
+		file->dfd = -1;
+	}
+
+	if (!on || !file->filp || file->type == 1 || file->ovl) return 0;
+
+	// reopen through procfs, the full path of the file isn't kept
+	char name[32];
+	sprintf(name, "/proc/self/fd/%d", fileno(file->filp));
+	file->dfd = open(name, ((file->mode & O_RDWR) ? O_RDWR : O_RDONLY) | O_DIRECT | O_CLOEXEC);
+	if (file->dfd < 0)
+	{
+		printf("FileSetDirect(%s): %s\n", file->name, strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+// Write-behind of the config files. FileSaveConfig only replaces the pending
+// image of its file, they are written on the bulk worker once no config
+// changed for CFGW_QUIET ms, so stepping through an OSD option writes once.
+// An image stays pending (and is what FileLoad returns) until the data
+// written is still the latest one.
+#define CFGW_QUIET 1000
+
+static std::unordered_map<std::string, std::vector<uint8_t>> cfgw_pending; // by full path
+static pthread_mutex_t cfgw_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<int> cfgw_count(0);
+static unsigned long cfgw_time = 0;
+static offload_handle_t cfgw_job = 0;
+
+static void cfgw_write()
+{
+	pthread_mutex_lock(&cfgw_lock);
+	std::unordered_map<std::string, std::vector<uint8_t>> list = cfgw_pending;
+	pthread_mutex_unlock(&cfgw_lock);
+
+	for (auto &it : list)
+	{
+		int fd = open(it.first.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_SYNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+		int ok = fd >= 0 && write(fd, it.second.data(), it.second.size()) == (ssize_t)it.second.size();
+		if (fd >= 0) close(fd);
+		if (!ok) printf("FileSaveConfig(write) File:%s, error: %s.\n", it.first.c_str(), strerror(errno));
+
+		pthread_mutex_lock(&cfgw_lock);
+		auto cur = cfgw_pending.find(it.first);
+		if (cur != cfgw_pending.end() && cur->second == it.second)
+		{
+			cfgw_pending.erase(cur);
+			cfgw_count--;
+		}
+		pthread_mutex_unlock(&cfgw_lock);
+	}
+}
+
+void FileConfigPoll()
+{
+	if (!cfgw_count || (cfgw_job && !offload_is_done(cfgw_job)) || !CheckTimer(cfgw_time)) return;
+	cfgw_job = offload_add_work([] { cfgw_write(); }, OFFLOAD_PRIO_BULK);
+}
+
+void FileConfigFlush()
+{
+	if (cfgw_job) offload_wait(cfgw_job);
+	cfgw_job = 0;
+	if (cfgw_count) cfgw_write();
+}
+
+// pending image of a config file, -1 if there is none
+static int cfgw_load(const char *path, void *pBuffer, int size)
+{
+	int ret = -1;
+	pthread_mutex_lock(&cfgw_lock);
+	auto it = cfgw_pending.find(path);
+	if (it != cfgw_pending.end())
+	{
+		ret = it->second.size();
+		if (pBuffer)
+		{
+			if (size && size < ret) ret = size;
+			memcpy(pBuffer, it->second.data(), ret);
+		}
+	}
+	pthread_mutex_unlock(&cfgw_lock);
+	return ret;
+}
+
+static void cfgw_drop(const char *path)
+{
+	pthread_mutex_lock(&cfgw_lock);
+	if (cfgw_pending.erase(path)) cfgw_count--;
+	pthread_mutex_unlock(&cfgw_lock);
+}
+
 int FileSave(const char *name, void *pBuffer, int size)
 {
 	make_fullpath(name);
+	if (cfgw_count) cfgw_drop(full_path);
 
 	int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, S_IRWXU | S_IRWXG | S_IRWXO);
 	if (fd < 0)
@@ -711,6 +2659,7 @@ int FileSave(const char *name, void *pBuffer, int size)
 int FileDelete(const char *name)
 {
 	make_fullpath(name);
+	if (cfgw_count) cfgw_drop(full_path);
 	printf("delete %s\n", full_path);
 	return !unlink(full_path);
 }
@@ -742,6 +2691,12 @@ const char* GetNameFromPath(char *path)
 
 int FileLoad(const char *name, void *pBuffer, int size)
 {
+	if (cfgw_count)
+	{
+		int ret = cfgw_load(make_fullpath(name), pBuffer, size);
+		if (ret >= 0) return ret;
+	}
+
 	fileTYPE f;
 	if (!FileOpen(&f, name)) return 0;
 
@@ -771,21 +2726,187 @@ int FileSaveConfig(const char *name, void *pBuffer, int size)
 		FileCreatePath(path);
 	}
 
-	strcat(path, "/");
-	strcat(path, name);
-	return FileSave(path, pBuffer, size);
-}
-
-int FileDeleteConfig(const char *name)
-{
-	char path[256] = { CONFIG_DIR"/" };
-	strcat(path, name);
-	return FileDelete(path);
-}
+	strcat(path, "/");
+	strcat(path, name);
+
+	make_fullpath(path);
+	pthread_mutex_lock(&cfgw_lock);
+	auto res = cfgw_pending.emplace(full_path, std::vector<uint8_t>());
+	if (res.second) cfgw_count++;
+	res.first->second.assign((uint8_t*)pBuffer, (uint8_t*)pBuffer + size);
+	pthread_mutex_unlock(&cfgw_lock);
+
+	cfgw_time = GetTimer(CFGW_QUIET);
+	return size;
+}
+
+int FileDeleteConfig(const char *name)
+{
+	char path[256] = { CONFIG_DIR"/" };
+	strcat(path, name);
+	return FileDelete(path);
+}
+
+// Prefetch of the game the user may load next, see FilePrefetch(). The page
+// cache keeps the data, so the load reads it from RAM. The reads go in slices
+// so other bulk jobs get their turn, and a newer prefetch stops older ones.
+#define PREFETCH_SLICE (4 * 1024 * 1024)
+
+struct filePrefetch
+{
+	char path[1024];
+	char next[1024]; // read after path
+	__off64_t pos;
+	uint64_t left;
+	uint32_t gen;
+};
+
+static std::atomic<uint32_t> prefetch_gen(0);
+static uint8_t prefetch_buf[256 * 1024]; // bulk worker only
+
+// the file of the first track named by a cue sheet, which holds the first data track
+static void prefetch_cue(filePrefetch *p)
+{
+	FILE *fp = fopen(p->path, "r");
+	if (!fp) return;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), fp))
+	{
+		char *s = line;
+		while (*s == ' ' || *s == '\t') s++;
+		if (strncasecmp(s, "FILE", 4) || (s[4] != ' ' && s[4] != '\t')) continue;
+
+		s += 5;
+		while (*s == ' ' || *s == '\t') s++;
+		char *end;
+		if (*s == '"') end = strchr(++s, '"');
+		else end = strpbrk(s, " \t\r\n");
+		if (!end || end == s) break;
+		*end = 0;
+
+		if (s[0] == '/') snprintf(p->next, sizeof(p->next), "%s", s);
+		else
+		{
+			const char *dir_end = strrchr(p->path, '/');
+			int dir_len = dir_end ? dir_end - p->path + 1 : 0;
+			snprintf(p->next, sizeof(p->next), "%.*s%s", dir_len, p->path, s);
+		}
+		break;
+	}
+	fclose(fp);
+}
+
+static void prefetch_slice(filePrefetch *p)
+{
+	int done = 1;
+	if (p->gen == prefetch_gen.load() && !offload_stopping())
+	{
+		if (!p->pos && !p->next[0])
+		{
+			const char *ext = strrchr(p->path, '.');
+			if (ext && !strcasecmp(ext, ".cue")) prefetch_cue(p);
+		}
+
+		int fd = open(p->path, O_RDONLY | O_CLOEXEC);
+		int eof = fd < 0;
+		uint32_t slice = 0;
+		while (!eof && p->left && slice < PREFETCH_SLICE && p->gen == prefetch_gen.load())
+		{
+			ssize_t n = pread64(fd, prefetch_buf, (p->left < sizeof(prefetch_buf)) ? p->left : sizeof(prefetch_buf), p->pos);
+			if (n <= 0) eof = 1;
+			else
+			{
+				p->pos += n;
+				p->left -= n;
+				slice += n;
+			}
+		}
+		if (fd >= 0) close(fd);
+
+		if (eof && p->next[0])
+		{
+			strcpy(p->path, p->next);
+			p->next[0] = 0;
+			p->pos = 0;
+			eof = 0;
+		}
+
+		// just a hint, give up if the bulk worker is busy
+		if (!eof && p->left) done = !offload_try_add_work([p] { prefetch_slice(p); }, OFFLOAD_PRIO_BULK);
+	}
+	if (done) delete p;
+}
+
+void FilePrefetch(const char *path, uint32_t budget)
+{
+	uint32_t gen = ++prefetch_gen;
+	if (!budget || !path || !path[0]) return;
+
+	filePrefetch *p = new filePrefetch;
+	snprintf(p->path, sizeof(p->path), "%s", path);
+	p->next[0] = 0;
+	p->pos = 0;
+	p->left = budget;
+	p->gen = gen;
+	if (!offload_try_add_work([p] { prefetch_slice(p); }, OFFLOAD_PRIO_BULK)) delete p;
+}
+
+void FilePrefetchCancel()
+{
+	prefetch_gen++;
+}
+
+int FileExists(const char *name, int use_zip)
+{
+	return isPathRegularFile(name, use_zip);
+}
+
+int FileListNames(const char *dir, void (*cb)(const char *name, void *arg), void *arg)
+{
+	make_fullpath(dir);
+
+	char *zip_path, *file_path;
+	if (FileIsZipped(full_path, &zip_path, &file_path))
+	{
+		char prefix[1024];
+		snprintf(prefix, sizeof(prefix), "%s%s", file_path, *file_path ? "/" : "");
+		size_t len = strlen(prefix);
+
+		zipIndex *zi = zip_index_get(zip_path);
+		if (zi)
+		{
+			uint32_t first, count;
+			zip_index_range(zi, prefix, &first, &count);
+			for (uint32_t n = first; n < first + count; n++)
+			{
+				if (!zi->entries[n].is_dir) cb(zip_index_name(zi, n) + len, arg);
+			}
+			return 1;
+		}
+
+		mz_zip_archive *z = OpenZipfileCached(full_path, 0);
+		if (!z) return 0;
+
+		char name[1024];
+		for (mz_uint n = 0; n < mz_zip_reader_get_num_files(z); n++)
+		{
+			if (mz_zip_reader_is_file_a_directory(z, n) || !mz_zip_reader_get_filename(z, n, name, sizeof(name))) continue;
+			if (!strncasecmp(name, prefix, len)) cb(name + len, arg);
+		}
+		return 1;
+	}
+
+	DIR *d = opendir(full_path);
+	if (!d) return 0;
 
-int FileExists(const char *name, int use_zip)
-{
-	return isPathRegularFile(name, use_zip);
+	struct dirent64 *de;
+	while ((de = readdir64(d)))
+	{
+		if (de->d_type == DT_REG || de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) cb(de->d_name, arg);
+	}
+	closedir(d);
+	return 1;
 }
 
 int PathIsDir(const char *name, int use_zip)
@@ -1208,7 +3329,7 @@ void FindStorage(void)
 
 struct DirentComp
 {
-	bool operator()(const direntext_t& de1, const direntext_t& de2)
+	bool operator()(const dirRec& de1, const dirRec& de2)
 	{
 
 #ifdef USE_SCHEDULER
@@ -1218,26 +3339,29 @@ struct DirentComp
 		}
 #endif
 
-		if ((de1.de.d_type == DT_DIR) && !strcmp(de1.altname, "..")) return true;
-		if ((de2.de.d_type == DT_DIR) && !strcmp(de2.altname, "..")) return false;
+		const char *alt1 = DirItem.altname(de1);
+		const char *alt2 = DirItem.altname(de2);
+
+		if ((de1.type == DT_DIR) && !strcmp(alt1, "..")) return true;
+		if ((de2.type == DT_DIR) && !strcmp(alt2, "..")) return false;
 
-		if ((de1.de.d_type == DT_DIR) && (de2.de.d_type != DT_DIR)) return true;
-		if ((de1.de.d_type != DT_DIR) && (de2.de.d_type == DT_DIR)) return false;
+		if ((de1.type == DT_DIR) && (de2.type != DT_DIR)) return true;
+		if ((de1.type != DT_DIR) && (de2.type == DT_DIR)) return false;
 
-		int len1 = strlen(de1.altname);
-		int len2 = strlen(de2.altname);
-		if ((len1 > 4) && (de1.altname[len1 - 4] == '.')) len1 -= 4;
-		if ((len2 > 4) && (de2.altname[len2 - 4] == '.')) len2 -= 4;
+		int len1 = strlen(alt1);
+		int len2 = strlen(alt2);
+		if ((len1 > 4) && (alt1[len1 - 4] == '.')) len1 -= 4;
+		if ((len2 > 4) && (alt2[len2 - 4] == '.')) len2 -= 4;
 
 		int len = (len1 < len2) ? len1 : len2;
-		int ret = strncasecmp(de1.altname, de2.altname, len);
+		int ret = strncasecmp(alt1, alt2, len);
 		if (!ret)
 		{
 			if(len1 != len2)
 			{
 				return len1 < len2;
 			}
-			ret = strcasecmp(de1.datecode, de2.datecode);
+			ret = strcasecmp(DirItem.datecode(de1), DirItem.datecode(de2));
 		}
 
 		return ret < 0;
@@ -1246,6 +3370,63 @@ struct DirentComp
 	size_t iterations = 0;
 };
 
+// DirentComp order on small precomputed keys. Only the keys are sorted and
+// every record is moved once at the end. The folded name prefix decides
+// almost all compares without going to the pool, DirentComp breaks the ties.
+struct direntKey
+{
+	uint64_t prefix; // first 8 folded chars of the name without extension
+	uint32_t rank;   // 0 - "..", 1 - folder, 2 - file
+	uint32_t index;
+};
+
+static void dirent_key(const dirRec &de, uint32_t index, direntKey &key)
+{
+	const char *altname = DirItem.altname(de);
+	int len = strlen(altname);
+	if ((len > 4) && (altname[len - 4] == '.')) len -= 4;
+
+	key.prefix = 0;
+	for (int i = 0; i < 8; i++) key.prefix = (key.prefix << 8) | (i < len ? (uint8_t)tolower(altname[i]) : 0);
+	key.rank = (de.type != DT_DIR) ? 2 : strcmp(altname, "..") ? 1 : 0;
+	key.index = index;
+}
+
+static void sort_dir_items(std::vector<dirRec>::iterator first, std::vector<dirRec>::iterator last)
+{
+	size_t num = last - first;
+	if (num < 2) return;
+
+	std::vector<direntKey> keys(num);
+	for (size_t i = 0; i < num; i++) dirent_key(first[i], i, keys[i]);
+
+	DirentComp comp;
+	std::sort(keys.begin(), keys.end(), [&first, &comp](const direntKey &a, const direntKey &b)
+	{
+		if (a.rank != b.rank) return a.rank < b.rank;
+		if (a.prefix != b.prefix) return a.prefix < b.prefix;
+		return a.rank && comp(first[a.index], first[b.index]);
+	});
+
+	// apply the permutation in place, cycle by cycle
+	for (size_t i = 0; i < num; i++)
+	{
+		if (keys[i].index == i) continue;
+
+		dirRec tmp = first[i];
+		size_t j = i;
+		while (keys[j].index != i)
+		{
+			size_t k = keys[j].index;
+			first[j] = first[k];
+			keys[j].index = j;
+			j = k;
+		}
+		first[j] = tmp;
+		keys[j].index = j;
+	}
+}
+
 void AdjustDirectory(char *path)
 {
 	if (!FileExists(path)) return;
@@ -1370,6 +3551,387 @@ static void get_display_name(direntext_t *dext, const char *ext, int options)
 	if (fext) *fext = 0;
 }
 
+// Filtered and sorted listings of big folders, stored in CONFIG_DIR/dircache
+// and keyed by folder, extension, options, prefix and filter. A listing is
+// used while the folder mtime matches, so the stat() of every entry is skipped.
+// FAT mtime resolution is coarse, so every hit is checked again on the bulk
+// worker by listing the names only. A changed folder drops its listing and
+// gets a full scan on the next visit. On a network share smaller folders get
+// listings too, and a checked listing isn't checked again for meta_ttl (see
+// storageProfile). DIR_CACHE_MIN is defined with the storage profiles.
+#define DIR_CACHE_MAGIC 0x32434C44 // "DLC2"
+#define DIR_CACHE_DIR   CONFIG_DIR "/dircache"
+
+struct dirCacheHeader
+{
+	uint32_t magic;
+	uint32_t num;
+	uint32_t key_len;
+	uint32_t names_hash;
+	uint32_t pool_len;
+	uint32_t reserved;
+	uint64_t dir_mtime;
+};
+
+static uint32_t dir_name_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *p = name; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	return hash;
+}
+
+// order independent, readdir order isn't stable over renames.
+static uint32_t dir_names_hash(const char *path)
+{
+	DIR *d = opendir(path);
+	if (!d) return 0;
+
+	uint32_t hash = 0;
+	struct dirent64 *de;
+	while ((de = readdir64(d))) hash += dir_name_hash(de->d_name);
+	closedir(d);
+	return hash;
+}
+
+static void dir_cache_path(const std::string &key, char *out, int size)
+{
+	snprintf(out, size, "%s/" DIR_CACHE_DIR "/%08X.dir", getRootDir(), dir_name_hash(key.c_str()));
+}
+
+// folder -> when its listing was last checked, see meta_ttl
+static std::unordered_map<std::string, unsigned long> dir_checked;
+
+// fills DirItem on a hit, main thread only.
+static int dir_cache_load(const char *path, const std::string &key)
+{
+	struct stat64 st;
+	storageProfile prof;
+	if (!FileStorageProfilePath(path, &prof, &st)) return 0;
+
+	char name[1024];
+	dir_cache_path(key, name, sizeof(name));
+
+	size_t size;
+	uint8_t *data = (uint8_t*)shcache_load(name, &size);
+	if (!data) return 0;
+
+	int ok = 0;
+	dirCacheHeader h;
+	memcpy(&h, data, std::min(size, sizeof(h)));
+	if (size >= sizeof(h) && h.magic == DIR_CACHE_MAGIC && h.dir_mtime == (uint64_t)st.st_mtime && h.key_len == key.size() &&
+		size == sizeof(h) + h.key_len + (uint64_t)h.num * sizeof(dirRec) + h.pool_len && !memcmp(data + sizeof(h), key.data(), h.key_len))
+	{
+		const uint8_t *p = data + sizeof(h) + h.key_len;
+		DirItem.clear();
+		DirItem.recs.resize(h.num);
+		memcpy(DirItem.recs.data(), p, h.num * sizeof(dirRec)); // key_len leaves p unaligned
+		p += h.num * sizeof(dirRec);
+		DirItem.pool.assign((const char*)p, (const char*)p + h.pool_len);
+		ok = 1;
+		for (size_t i = 0; ok && i < h.num; i++)
+		{
+			const dirRec &r = DirItem.recs[i];
+			ok = r.name < h.pool_len && r.date < h.pool_len - r.name && !DirItem.pool.back();
+		}
+		if (!ok) DirItem.clear();
+	}
+	free(data);
+	if (!ok) return 0;
+
+	if (prof.meta_ttl)
+	{
+		auto it = dir_checked.find(path);
+		if (it != dir_checked.end() && !CheckTimer(it->second)) return 1;
+		dir_checked[path] = GetTimer(prof.meta_ttl * 1000);
+	}
+
+	char *dir = strdup(path);
+	char *cname = strdup(name);
+	uint32_t names_hash = h.names_hash;
+	if (!dir || !cname || !offload_try_add_work([dir, cname, names_hash]
+		{
+			if (dir_names_hash(dir) != names_hash)
+			{
+				printf("Listing of %s has changed, dropping it.\n", dir);
+				unlink(cname);
+				shcache_drop(cname);
+			}
+			free(dir);
+			free(cname);
+		}, OFFLOAD_PRIO_BULK))
+	{
+		free(dir);
+		free(cname);
+	}
+
+	return 1;
+}
+
+static void dir_cache_store(const char *path, const std::string &key, uint32_t names_hash)
+{
+	struct stat64 st;
+	storageProfile prof;
+	if (!FileStorageProfilePath(path, &prof, &st) || DirItem.size() < (size_t)prof.dir_min) return;
+
+	dirCacheHeader h = { DIR_CACHE_MAGIC, (uint32_t)DirItem.size(), (uint32_t)key.size(), names_hash, (uint32_t)DirItem.pool.size(), 0, (uint64_t)st.st_mtime };
+	size_t len = sizeof(h) + h.key_len + h.num * sizeof(dirRec) + h.pool_len;
+	uint8_t *data = (uint8_t*)malloc(len);
+	char *name = (char*)malloc(1024);
+	if (!data || !name)
+	{
+		free(data);
+		free(name);
+		return;
+	}
+
+	uint8_t *p = data;
+	memcpy(p, &h, sizeof(h)); p += sizeof(h);
+	memcpy(p, key.data(), h.key_len); p += h.key_len;
+	memcpy(p, DirItem.recs.data(), h.num * sizeof(dirRec)); p += h.num * sizeof(dirRec);
+	memcpy(p, DirItem.pool.data(), h.pool_len);
+	dir_cache_path(key, name, 1024);
+	shcache_store(name, data, len);
+
+	offload_add_work([data, len, name]
+	{
+		char *p = strrchr(name, '/');
+		*p = 0;
+		mkdir(name, S_IRWXU | S_IRWXG | S_IRWXO);
+		*p = '/';
+
+		int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (fd >= 0)
+		{
+			if (write(fd, data, len) != (ssize_t)len) unlink(name);
+			close(fd);
+		}
+		free(data);
+		free(name);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+// Folders are read on the bulk worker, which also does the stat() of every
+// entry, and handed over in batches. The UI filters each batch as it comes,
+// keeps DirItem sorted by merging the new entries in and redraws the first
+// page through the progress hook until the folder is complete.
+#define DIR_SCAN_BATCH  256
+#define DIR_SCAN_FIRST  100 // ms before the first partial page is shown
+#define DIR_SCAN_REDRAW 250 // ms between partial pages
+
+struct dirScan
+{
+	char path[1024];
+	DIR *dir;
+	pthread_mutex_t lock;
+	std::vector<dirent64> ready; // published by the worker
+	uint32_t names_hash;
+	int done;
+
+	// main thread only
+	std::vector<dirent64> batch;
+	size_t pos;
+	size_t sorted; // DirItem prefix which is in order
+	unsigned long redraw;
+};
+
+static void (*scan_progress)(void) = 0;
+
+void flist_set_progress(void (*cb)(void))
+{
+	scan_progress = cb;
+}
+
+static void dir_scan_publish(dirScan *s, std::vector<dirent64> &out, int done)
+{
+	pthread_mutex_lock(&s->lock);
+	if (s->ready.empty()) s->ready.swap(out);
+	else s->ready.insert(s->ready.end(), out.begin(), out.end());
+	if (done) s->done = 1;
+	pthread_mutex_unlock(&s->lock);
+	out.clear();
+}
+
+static void dir_scan_run(dirScan *s)
+{
+	char full[1024 + 256];
+	int len = snprintf(full, sizeof(full), "%s", s->path);
+	uint32_t hash = 0;
+
+	std::vector<dirent64> out;
+	out.reserve(DIR_SCAN_BATCH);
+
+	struct dirent64 *de;
+	while ((de = readdir64(s->dir)))
+	{
+		hash += dir_name_hash(de->d_name);
+
+		// the entry may be shorter than the struct, copy the name only
+		out.emplace_back();
+		dirent64 &e = out.back();
+		memset(&e, 0, sizeof(e));
+		e.d_ino = de->d_ino;
+		e.d_type = de->d_type;
+		snprintf(e.d_name, sizeof(e.d_name), "%s", de->d_name);
+
+		// Handle (possible) symbolic link type in the directory entry
+		if (e.d_type == DT_LNK || e.d_type == DT_REG)
+		{
+			snprintf(full + len, sizeof(full) - len, "/%s", e.d_name);
+
+			struct stat entrystat;
+			if (!stat(full, &entrystat))
+			{
+				if (S_ISREG(entrystat.st_mode)) e.d_type = DT_REG;
+				else if (S_ISDIR(entrystat.st_mode)) e.d_type = DT_DIR;
+			}
+		}
+
+		if (out.size() >= DIR_SCAN_BATCH) dir_scan_publish(s, out, 0);
+	}
+	closedir(s->dir);
+
+	s->names_hash = hash;
+	dir_scan_publish(s, out, 1);
+}
+
+// sort the newly added entries into DirItem. Merging only once the tail
+// has grown to the size of the sorted part keeps the total cost n log n.
+static void dir_scan_merge(dirScan *s, int force)
+{
+	int redraw = scan_progress && CheckTimer(s->redraw);
+	size_t num = DirItem.size();
+	if (s->sorted == num || (!force && !redraw && num - s->sorted < s->sorted)) return;
+
+	sort_dir_items(DirItem.recs.begin() + s->sorted, DirItem.recs.end());
+	std::inplace_merge(DirItem.recs.begin(), DirItem.recs.begin() + s->sorted, DirItem.recs.end(), DirentComp());
+	DirItem.gen++;
+	s->sorted = num;
+
+	if (redraw)
+	{
+		scan_progress();
+		s->redraw = GetTimer(DIR_SCAN_REDRAW);
+	}
+}
+
+static struct dirent64 *dir_scan_next(dirScan *s)
+{
+	while (s->pos >= s->batch.size())
+	{
+		dir_scan_merge(s, 0);
+
+		s->batch.clear();
+		s->pos = 0;
+
+		pthread_mutex_lock(&s->lock);
+		s->batch.swap(s->ready);
+		int done = s->done;
+		pthread_mutex_unlock(&s->lock);
+
+		if (s->batch.empty())
+		{
+			if (done) return 0;
+
+			// keep the scheduler from idling while the worker reads
+			scheduler_activity();
+			scheduler_yield();
+		}
+	}
+
+	return &s->batch[s->pos++];
+}
+
+// Type-to-search over the current listing. Typing into the file browser
+// only ever narrows the filter, and a longer filter matches a subset of the
+// entries of a shorter one, so such rescans are answered from DirItem. A
+// bitmap of name bigrams per entry rejects most entries without a compare.
+static std::vector<uint64_t> DirGrams;
+static std::string search_key, search_filter;
+static int search_valid = 0;
+
+static uint64_t name_grams(const char *name)
+{
+	uint64_t grams = 0;
+	for (const char *p = name; p[0] && p[1]; p++) grams |= 1ULL << ((tolower((uint8_t)p[0]) * 31 + tolower((uint8_t)p[1])) & 63);
+	return grams;
+}
+
+static std::string search_make_key(const char *path, const char *extension, int options, const char *prefix)
+{
+	char opts[16];
+	sprintf(opts, "%X", options);
+	return std::string(path) + '\n' + extension + '\n' + opts + '\n' + (prefix ? prefix : "");
+}
+
+static void search_index_build(const char *path, const char *extension, int options, const char *prefix, const char *filter)
+{
+	DirGrams.resize(DirItem.size());
+	for (size_t i = 0; i < DirItem.size(); i++) DirGrams[i] = name_grams(DirItem.name(i));
+
+	search_key = search_make_key(path, extension, options, prefix);
+	search_filter = filter ? filter : "";
+	search_valid = 1;
+}
+
+// keep the entries of DirItem matching filter, 0 if a rescan is needed.
+static int search_narrow(const char *path, const char *extension, int options, const char *prefix, const char *filter)
+{
+	if (!search_valid || !filter || !filter[0] || DirGrams.size() != DirItem.size()) return 0;
+	if (strncasecmp(filter, search_filter.c_str(), search_filter.size()) || search_key != search_make_key(path, extension, options, prefix)) return 0;
+
+	uint64_t grams = name_grams(filter);
+	size_t num = 0;
+	for (size_t i = 0; i < DirItem.size(); i++)
+	{
+		if ((DirGrams[i] & grams) != grams || !strcasestr(DirItem.name(i), filter)) continue;
+		if (num != i)
+		{
+			DirItem.recs[num] = DirItem.recs[i];
+			DirGrams[num] = DirGrams[i];
+		}
+		num++;
+	}
+
+	DirItem.resize(num);
+	DirGrams.resize(num);
+	search_filter = filter;
+	printf("Filtered %s in memory\n", path);
+	return 1;
+}
+
+// position the selection on file_name once DirItem is complete.
+static int scan_select(const char *file_name)
+{
+	printf("Got %d dir entries\n", flist_nDirEntries());
+	if (!flist_nDirEntries()) return 0;
+
+	if (file_name[0])
+	{
+		int pos = -1;
+		for (int i = 0; i < flist_nDirEntries(); i++)
+		{
+			if (!strcmp(file_name, DirItem.name(i)))
+			{
+				pos = i;
+				break;
+			}
+			else if (!strcasecmp(file_name, DirItem.name(i)))
+			{
+				pos = i;
+			}
+		}
+
+		if(pos>=0)
+		{
+			iSelectedEntry = pos;
+			if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
+			else iFirstEntry = iSelectedEntry - (OsdGetSize() / 2) + 1;
+			if (iFirstEntry < 0) iFirstEntry = 0;
+		}
+	}
+	return flist_nDirEntries();
+}
+
 int ScanDirectory(char* path, int mode, const char *extension, int options, const char *prefix, const char *filter)
 {
 	static char file_name[1024];
@@ -1391,6 +3953,14 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 	{
 		iFirstEntry = 0;
 		iSelectedEntry = 0;
+
+		if (search_narrow(path, extension, options, prefix, filter))
+		{
+			file_name[0] = 0;
+			return scan_select(file_name);
+		}
+		search_valid = 0;
+
 		DirItem.clear();
 		DirNames.clear();
 
@@ -1433,30 +4003,67 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		char *zip_path, *file_path_in_zip = (char*)"";
 		FileIsZipped(full_path, &zip_path, &file_path_in_zip);
 
-		DIR *d = nullptr;
+		std::string cache_key;
+		if (!is_zipped && !(options & SCANO_NEOGEO))
+		{
+			char opts[16];
+			sprintf(opts, "%X", options);
+			cache_key = std::string(full_path) + '\n' + extension + '\n' + opts + '\n' + (prefix ? prefix : "") + '\n' + (filter ? filter : "");
+			if (dir_cache_load(full_path, cache_key))
+			{
+				search_index_build(path, extension, options, prefix, filter);
+				return scan_select(file_name);
+			}
+		}
+
+		dirScan *scan = nullptr;
+		offload_handle_t scan_done = 0;
 		mz_zip_archive *z = nullptr;
+		zipIndex *zi = nullptr;
+		uint32_t zip_first = 0, zip_num = 0;
 		if (is_zipped)
 		{
-			if (!OpenZipfileCached(full_path, 0))
+			// indexed zips list only the entries below the current folder
+			zi = zip_index_get(full_path);
+			if (zi)
 			{
-				printf("Couldn't open zip file %s: %s\n", full_path, mz_zip_get_error_string(mz_zip_get_last_error(&last_zip_archive)));
-				return 0;
+				zip_index_range(zi, file_path_in_zip, &zip_first, &zip_num);
+			}
+			else
+			{
+				// the scan yields to the other coroutines, which may open zips too
+				z = OpenZipfileCached(full_path, 0, 1);
+				if (!z)
+				{
+					printf("Couldn't open zip file %s\n", full_path);
+					return 0;
+				}
+				zip_num = mz_zip_reader_get_num_files(z);
 			}
-			z = &last_zip_archive;
 		}
 		else
 		{
-			d = opendir(full_path);
+			DIR *d = opendir(full_path);
 			if (!d)
 			{
 				printf("Couldn't open dir: %s\n", full_path);
 				return 0;
 			}
+
+			scan = new dirScan();
+			snprintf(scan->path, sizeof(scan->path), "%s", full_path);
+			scan->dir = d;
+			pthread_mutex_init(&scan->lock, 0);
+			scan->redraw = GetTimer(DIR_SCAN_FIRST);
+
+			// a busy worker would hold the listing back, read it here then
+			if (offload_pending(OFFLOAD_PRIO_BULK)) dir_scan_run(scan);
+			else scan_done = offload_add_work([scan] { dir_scan_run(scan); }, OFFLOAD_PRIO_BULK);
 		}
 
 		struct dirent64 *de = nullptr;
-		for (size_t i = 0; (d && (de = readdir64(d)))
-				 || (z && i < mz_zip_reader_get_num_files(z)); i++)
+		for (size_t i = 0; (scan && (de = dir_scan_next(scan)))
+				 || (is_zipped && i < zip_num); i++)
 		{
 #ifdef USE_SCHEDULER
 			if (0 < i && i % YieldIterations == 0)
@@ -1465,9 +4072,10 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			}
 #endif
 			struct dirent64 _de = {};
-			if (z)
+			if (is_zipped)
 			{
-				mz_zip_reader_get_filename(z, i, &_de.d_name[0], sizeof(_de.d_name));
+				if (zi) snprintf(_de.d_name, sizeof(_de.d_name), "%s", zip_index_name(zi, zip_first + i));
+				else mz_zip_reader_get_filename(z, i, &_de.d_name[0], sizeof(_de.d_name));
 				const char *rname = GetRelativeFileName(file_path_in_zip, _de.d_name);
 				if (rname)
 				{
@@ -1501,7 +4109,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 
 				de = &_de;
 
-				_de.d_type = mz_zip_reader_is_file_a_directory(z, i) ? DT_DIR : DT_REG;
+				_de.d_type = (zi ? zi->entries[zip_first + i].is_dir : mz_zip_reader_is_file_a_directory(z, i)) ? DT_DIR : DT_REG;
 				if (_de.d_type == DT_DIR) {
 					// Remove trailing slash.
 					if (DirNames.find(_de.d_name) != DirNames.end())
@@ -1515,25 +4123,6 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 					}
 				}
 			}
-			// Handle (possible) symbolic link type in the directory entry
-			else if (de->d_type == DT_LNK || de->d_type == DT_REG)
-			{
-				sprintf(full_path + path_len, "/%s", de->d_name);
-
-				struct stat entrystat;
-
-				if (!stat(full_path, &entrystat))
-				{
-					if (S_ISREG(entrystat.st_mode))
-					{
-						de->d_type = DT_REG;
-					}
-					else if (S_ISDIR(entrystat.st_mode))
-					{
-						de->d_type = DT_DIR;
-					}
-				}
-			}
 
             if (filter)
 			{
@@ -1687,7 +4276,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			}
 		}
 
-		if (z)
+		if (is_zipped)
 		{
 			// Since zip files aren't actually folders the entry to
 			// exit the zip file must be added manually.
@@ -1697,42 +4286,30 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			strcpy(dext.de.d_name, "..");
 			get_display_name(&dext, extension, options);
 			DirItem.push_back(dext);
+			if (z) zip_unpin(z);
 		}
 
-		if (d)
+		if (scan)
+		{
+			dir_scan_merge(scan, 1);
+			scheduler_wait_work(scan_done);
+			if (!cache_key.empty()) dir_cache_store(full_path, cache_key, scan->names_hash);
+
+			pthread_mutex_destroy(&scan->lock);
+			delete scan;
+		}
+		else
 		{
-			closedir(d);
+			sort_dir_items(DirItem.recs.begin(), DirItem.recs.end());
+			DirItem.gen++;
 		}
 
-		printf("Got %d dir entries\n", flist_nDirEntries());
-		if (!flist_nDirEntries()) return 0;
+		// capacity grows by doubling, give the slack back
+		DirItem.shrink_to_fit();
 
-		std::sort(DirItem.begin(), DirItem.end(), DirentComp());
-		if (file_name[0])
-		{
-			int pos = -1;
-			for (int i = 0; i < flist_nDirEntries(); i++)
-			{
-				if (!strcmp(file_name, DirItem[i].de.d_name))
-				{
-					pos = i;
-					break;
-				}
-				else if (!strcasecmp(file_name, DirItem[i].de.d_name))
-				{
-					pos = i;
-				}
-			}
+		if (!is_zipped) search_index_build(path, extension, options, prefix, filter);
 
-			if(pos>=0)
-			{
-				iSelectedEntry = pos;
-				if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
-				else iFirstEntry = iSelectedEntry - (OsdGetSize() / 2) + 1;
-				if (iFirstEntry < 0) iFirstEntry = 0;
-			}
-		}
-		return flist_nDirEntries();
+		return scan_select(file_name);
 	}
 	else
 	{
@@ -1812,12 +4389,12 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			int pos = -1;
 			for (int i = 0; i < flist_nDirEntries(); i++)
 			{
-				if ((DirItem[i].de.d_type == DT_DIR) && !strcmp(DirItem[i].altname, extension))
+				if ((DirItem.type(i) == DT_DIR) && !strcmp(DirItem.altname(i), extension))
 				{
 					pos = i;
 					break;
 				}
-				else if ((DirItem[i].de.d_type == DT_DIR) && !strcasecmp(DirItem[i].altname, extension))
+				else if ((DirItem.type(i) == DT_DIR) && !strcasecmp(DirItem.altname(i), extension))
 				{
 					pos = i;
 				}
@@ -1840,7 +4417,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 				int found = -1;
 				for (int i = iSelectedEntry+1; i < flist_nDirEntries(); i++)
 				{
-					if (toupper(DirItem[i].altname[0]) == mode)
+					if (toupper(DirItem.altname(i)[0]) == mode)
 					{
 						found = i;
 						break;
@@ -1851,7 +4428,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 				{
 					for (int i = 0; i < flist_nDirEntries(); i++)
 					{
-						if (toupper(DirItem[i].altname[0]) == mode)
+						if (toupper(DirItem.altname(i)[0]) == mode)
 						{
 							found = i;
 							break;
@@ -1900,12 +4477,12 @@ int flist_iSelectedEntry()
 
 direntext_t* flist_DirItem(int n)
 {
-	return &DirItem[n];
+	return DirItem.item(n);
 }
 
 direntext_t* flist_SelectedItem()
 {
-	return &DirItem[iSelectedEntry];
+	return DirItem.item(iSelectedEntry);
 }
 
 char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext, int next)
@@ -1924,7 +4501,7 @@ char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext
 
 	if (!DirItem.size()) return NULL;
 	if (p) ScanDirectory(path, next ? SCANF_NEXT : SCANF_PREV, "", 0);
-	snprintf(path, sizeof(path), "%s/%s", scanned_path, DirItem[iSelectedEntry].de.d_name);
+	snprintf(path, sizeof(path), "%s/%s", scanned_path, DirItem.name(iSelectedEntry));
 
 	return path + strlen(base_path) + 1;
 }
@@ -1940,6 +4517,83 @@ int isXmlName(const char *path)
 	return 0;
 }
 
+fileReadAhead::fileReadAhead(fileTYPE *file, uint32_t size, uint32_t chunk, int crc_skip, struct MD5Context *md5,
+	fileReadFilter filter, void *filter_arg)
+	: crc(0), file(file), chunk(chunk), left(size), pos(0), crc_skip(crc_skip), md5(md5), filter(filter), filter_arg(filter_arg), cur(-1)
+{
+	memset(len, 0, sizeof(len));
+	memset(done, 0, sizeof(done));
+
+	buf = (uint8_t*)malloc(chunk * READAHEAD_BUFS);
+	if (!buf)
+	{
+		printf("fileReadAhead: out of memory.\n");
+		left = 0;
+		return;
+	}
+
+	for (int n = 0; n < READAHEAD_BUFS; n++) submit(n);
+}
+
+fileReadAhead::~fileReadAhead()
+{
+	for (int n = 0; n < READAHEAD_BUFS; n++) offload_wait(done[n]);
+	free(buf);
+}
+
+void fileReadAhead::submit(int n)
+{
+	if (!left) return;
+
+	uint32_t want = (left > chunk) ? chunk : left;
+	uint32_t start = pos;
+	left -= want;
+	pos += want;
+
+	// the worker runs the reads in order, so the crc and md5 are chained correctly
+	done[n] = offload_add_work([this, n, want, start]
+	{
+		uint8_t *data = buf + n * chunk;
+		int ret = FileReadAdv(file, data, want);
+		len[n] = (ret > 0) ? ret : 0;
+
+		if (filter && len[n]) filter(data, len[n], filter_arg);
+
+		if (crc_skip >= 0 && start + len[n] > (uint32_t)crc_skip)
+		{
+			uint32_t off = (start >= (uint32_t)crc_skip) ? 0 : crc_skip - start;
+			crc = crc32(crc, data + off, len[n] - off);
+		}
+
+		if (md5) MD5Update(md5, data, len[n]);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+uint8_t *fileReadAhead::next(uint32_t *len_out)
+{
+	*len_out = 0;
+
+	// the previous chunk is done with, reuse its buffer
+	if (cur >= 0) submit(cur);
+
+	cur = (cur + 1) % READAHEAD_BUFS;
+	if (!done[cur]) return 0;
+
+	offload_wait(done[cur]);
+	done[cur] = 0;
+
+	if (!len[cur])
+	{
+		// read error, drain the rest so crc and file are settled
+		left = 0;
+		for (int n = 0; n < READAHEAD_BUFS; n++) offload_wait(done[n]);
+		return 0;
+	}
+
+	*len_out = len[cur];
+	return buf + cur * chunk;
+}
+
 fileTextReader::fileTextReader()
 {
 	buffer = nullptr;
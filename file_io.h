@@ -7,8 +7,22 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include "spi.h"
+#include "offload.h"
 
 struct fileZipArchive;
+struct fileReadCache;
+struct fileBlockCache;
+struct fileOverlay;
+
+// Read-only data made by code outside of file_io (decoded audio tracks, see
+// cd_open_track). Files opened by FileOpenSource serve all reads from it.
+// read() may be called off the main thread when threadsafe() says so.
+struct fileSource
+{
+	virtual ~fileSource() {}
+	virtual int read(__off64_t offset, void *buf, int len) = 0;
+	virtual int threadsafe() { return 1; }
+};
 
 struct fileTYPE
 {
@@ -20,12 +34,61 @@ struct fileTYPE
 	int             mode;
 	int             type;
 	fileZipArchive *zip;
+	fileReadCache  *ra;
+	fileBlockCache *cache;  // see FileSetCache
+	fileOverlay    *ovl;    // see FileOpenDisk
+	uint8_t        *mem;    // see FilePreload
+	fileSource     *src;    // see FileOpenSource
 	__off64_t       size;
 	__off64_t       offset;
+	int             dfd;    // O_DIRECT descriptor, see FileSetDirect
 	char            path[1024];
 	char            name[261];
 };
 
+// Reads a file ahead on the bulk offload worker, so the storage latency of the
+// next chunks overlaps with the transfer of the current one. The file belongs
+// to the reader until it is destroyed. If crc_skip >= 0, crc is the crc32 of
+// everything past the first crc_skip bytes, complete once next() returned 0.
+// An md5 context gets all the data in order the same way and must not be
+// touched by the caller while the reader exists.
+#define READAHEAD_BUFS 3
+
+struct MD5Context;
+
+// runs on the worker right after each read, before the crc and md5.
+// Chunks come in file order.
+typedef void (*fileReadFilter)(uint8_t *data, uint32_t len, void *arg);
+
+struct fileReadAhead
+{
+	fileReadAhead(fileTYPE *file, uint32_t size, uint32_t chunk = 64 * 1024, int crc_skip = -1, struct MD5Context *md5 = nullptr,
+		fileReadFilter filter = nullptr, void *filter_arg = nullptr);
+	~fileReadAhead();
+
+	// next chunk in order, 0 at the end or on a read error.
+	// The data can be modified and stays valid until the next call.
+	uint8_t *next(uint32_t *len);
+
+	uint32_t crc;
+
+private:
+	void submit(int n);
+
+	fileTYPE *file;
+	uint8_t  *buf;
+	uint32_t  chunk;
+	uint32_t  left;
+	uint32_t  pos;
+	int       crc_skip;
+	struct MD5Context *md5;
+	fileReadFilter filter;
+	void     *filter_arg;
+	int       cur;
+	uint32_t  len[READAHEAD_BUFS];
+	offload_handle_t done[READAHEAD_BUFS];
+};
+
 struct direntext_t
 {
 	dirent de;
@@ -53,6 +116,10 @@ direntext_t* flist_SelectedItem();
 char* flist_Path();
 char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext, int next);
 
+// called during long folder scans with the sorted entries found so far,
+// so the first page can be drawn before the folder is complete. 0 disables.
+void flist_set_progress(void (*cb)(void));
+
 // scanning flags
 #define SCANF_INIT       0 // start search from beginning of directory
 #define SCANF_NEXT       1 // find next file in directory
@@ -89,14 +156,99 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin);
 int FileSeekLBA(fileTYPE *file, uint32_t offset);
 
 int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres = 0);
+
+// Read-only mapping of size bytes from the current offset of a plain file on
+// local storage, for transfers without the copy through a read buffer.
+// Returns 0 for zip members, network shares or on errors: use FileReadAdv then.
+struct fileMapping
+{
+	void   *base;
+	size_t  len;
+};
+const uint8_t *FileMap(fileTYPE *file, uint32_t size, fileMapping *map);
+void FileUnmap(fileMapping *map);
 int FileReadSec(fileTYPE *file, void *pBuffer);
 int FileWriteAdv(fileTYPE *file, void *pBuffer, int length, int failres = 0);
 int FileWriteSec(fileTYPE *file, void *pBuffer);
+
+// Positional I/O for block images: a single pread()/pwrite() at offset,
+// without the stdio buffer and without a seek. The position used by
+// FileReadAdv/FileWriteAdv is left alone. Zip members fall back to seek + read.
+int FileReadAt(fileTYPE *file, __off64_t offset, void *pBuffer, int length, int failres = 0);
+int FileWriteAt(fileTYPE *file, __off64_t offset, const void *pBuffer, int length, int failres = 0);
+
+// Opens size bytes of src as a read-only file, it's deleted by FileClose.
+// path must be unique for the data, FilePreload shares copies by path.
+void FileOpenSource(fileTYPE *file, fileSource *src, __off64_t size, const char *path);
+
+// Load a read-only file (or zip member) completely into RAM, all reads and
+// seeks are served from there until it is closed. Shows the progress as
+// done + bytes loaded of total bytes if total is set. Returns 0 on error, the file
+// is unchanged then.
+int FilePreload(fileTYPE *file, uint64_t done = 0, uint64_t total = 0);
+
+// Bypass the page cache for positional I/O. Only requests with offset, length
+// and buffer aligned to FILE_DIRECT_ALIGN use it, others stay cached.
+#define FILE_DIRECT_ALIGN 512
+int FileSetDirect(fileTYPE *file, int on);
+
+// Memory-bounded LRU block cache for the positional reads of a disk image,
+// size_mb = 0 removes it. Writes through any of the calls keep it coherent.
+// With write_delay set FileWriteAt only dirties the cache; the owner calls
+// FileFlushCache to write back data older than age_ms (0 - everything).
+// Returns 0 if a write-back failed since the last call. FileCacheDirty tells
+// if a FileFlushCache with the same age_ms would write anything, so the
+// write-back can be handed to a worker.
+int FileSetCache(fileTYPE *file, uint32_t size_mb, uint32_t write_delay = 0);
+int FileFlushCache(fileTYPE *file, uint32_t age_ms = 0);
+int FileCacheDirty(fileTYPE *file, uint32_t age_ms = 0);
+
+// FileOpenEx for disk images. An overlay file opens as the virtual disk made
+// of its read-only base image and the blocks written so far, which go to the
+// overlay only. FileOverlayCreate makes an empty overlay on top of base, or
+// resets an existing one if base is 0. Don't reset an overlay in use.
+int FileOpenDisk(fileTYPE *file, const char *name, int mode);
+int FileOverlayCreate(const char *name, const char *base = 0);
 int FileCreatePath(const char *dir);
 
+// I/O profile of the storage a file lives on, picked by its file system. On
+// a network share every request is a round trip, so sequential readers get
+// bigger chunks read ahead sooner (a big read goes out as parallel requests)
+// and checked folder listings are trusted for a while. Depths and sizes come
+// from MiSTer.ini (readahead_usb, readahead_net, net_read_size, net_meta_ttl).
+#define STORAGE_SD  0
+#define STORAGE_USB 1
+#define STORAGE_NET 2
+#define STORAGE_RAM 3
+
+struct storageProfile
+{
+	int type;      // STORAGE_*
+	int ra_depth;  // chunks read ahead of sequential readers, 0 - none
+	int ra_chunk;  // bytes
+	int ra_seq;    // back to back reads before reading ahead
+	int dir_min;   // entries, smaller folders don't get a cached listing
+	int meta_ttl;  // seconds a checked listing is used without checking it again
+};
+
+void FileStorageProfile(int fd, storageProfile *prof);
+// 0 if path doesn't exist, st gets its stat64() if given
+int FileStorageProfilePath(const char *path, storageProfile *prof, struct stat64 *st = 0);
+
+// Reads up to budget bytes of a file the user may load next (for a cue sheet
+// also the file of its first track) into the page cache on the bulk worker.
+// Each call stops the previous prefetch, as does FilePrefetchCancel().
+void FilePrefetch(const char *path, uint32_t budget);
+void FilePrefetchCancel();
+
 int FileExists(const char *name, int use_zip = 1);
 int FileCanWrite(const char *name);
 int PathIsDir(const char *name, int use_zip = 1);
+
+// calls cb with the name of each file in dir (a folder, a zip or a folder in
+// a zip, the way FileExists takes them), members of a zip with their path
+// below dir. One listing answers many FileExists. 0 if dir can't be read.
+int FileListNames(const char *dir, void (*cb)(const char *name, void *arg), void *arg);
 struct stat64* getPathStat(const char *path);
 
 #define SAVE_DIR "saves"
@@ -121,6 +273,12 @@ int FileSaveConfig(const char *name, void *pBuffer, int size);
 int FileLoadConfig(const char *name, void *pBuffer, int size); // supply pBuffer = 0 to get the file size without loading
 int FileDeleteConfig(const char *name);
 
+// FileSaveConfig writes behind: the files are written on the bulk worker once
+// the configs stay unchanged for a moment (FileConfigPoll, main loop), or
+// right away by FileConfigFlush before a restart or reboot.
+void FileConfigPoll();
+void FileConfigFlush();
+
 void AdjustDirectory(char *path);
 int ScanDirectory(char* path, int mode, const char *extension, int options, const char *prefix = NULL, const char *filter = NULL);
 
@@ -1,4 +1,5 @@
 #include <memory.h>
+#include <stdint.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_CACHE_H
@@ -89,6 +90,19 @@ FT_ULong utf8_to_utf32(const unsigned char *c)
     return utf32;
 }
 
+// Rendered 8x8 columns by codepoint and half. Menus redraw the same lines
+// (and scroll long names) all the time, so most lookups end here instead of
+// going through the FreeType caches and the bit loop below.
+#define GLYPH_CACHE_SIZE 1024 // pow2
+
+struct glyph_entry
+{
+    uint32_t key; // codepoint << 1 | lower part, 0 = empty
+    unsigned char col[8];
+};
+
+static glyph_entry glyph_cache[GLYPH_CACHE_SIZE];
+
 void freetype_render(const unsigned char *c, bool is_lower_part)
 {
     FT_Error error;
@@ -96,6 +110,15 @@ void freetype_render(const unsigned char *c, bool is_lower_part)
     FT_UInt glyph_index;
 
     c_utf32 = utf8_to_utf32(c);
+
+    uint32_t key = (c_utf32 << 1) | (is_lower_part ? 1 : 0);
+    glyph_entry *entry = &glyph_cache[((key * 2654435761u) >> 22) & (GLYPH_CACHE_SIZE - 1)];
+    if (entry->key == key)
+    {
+        memcpy(rendered_font, entry->col, 8);
+        return;
+    }
+
     glyph_index = FTC_CMapCache_Lookup(ftc_mapcache, 0, 0, c_utf32);
 
     if (!glyph_index)
@@ -140,6 +163,12 @@ void freetype_render(const unsigned char *c, bool is_lower_part)
 
         shift_y--;
     }
+
+    if (!error)
+    {
+        entry->key = key;
+        memcpy(entry->col, rendered_font, 8);
+    }
 }
 
 FT_Error FtcFaceRequester(FTC_FaceID faceID, FT_Library lib, FT_Pointer reqData, FT_Face *face)
@@ -6,22 +6,34 @@
 #include <signal.h>
 #include <ctype.h>
 #include <termios.h>
+#include <time.h>
+#include <dirent.h>
+#include <utime.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <atomic>
 
 #include "fpga_io.h"
+#include "spi.h"
 #include "file_io.h"
 #include "input.h"
 #include "osd.h"
 #include "menu.h"
+#include "user_io.h"
 #include "shmem.h"
 #include "offload.h"
+#include "counters.h"
+#include "membudget.h"
+#include "cfg.h"
+#include "ide.h"
 
 #include "fpga_base_addr_ac5.h"
 #include "fpga_manager.h"
 #include "fpga_system_manager.h"
 #include "fpga_reset_manager.h"
 #include "fpga_nic301.h"
+#include "log.h"
+#include "loadlog.h"
 
 #define FPGA_REG_BASE 0xFF000000
 #define FPGA_REG_SIZE 0x01000000
@@ -421,10 +433,234 @@ static int make_env(const char *name, const char *cfg)
 	return 0;
 }
 
+// Recently loaded bitstreams are kept in tmpfs, which survives app_restart.
+// Entries are named by path, size and mtime of the source, so an updated
+// core is never taken from the cache.
+#define RBF_CACHE_DIR "/tmp/rbf_cache"
+#define RBF_CACHE_MAX 64
+
+static void rbf_path(const char *name, char *path, int size)
+{
+	if (name[0] == '/') snprintf(path, size, "%s", name);
+	else snprintf(path, size, "%s/%s", !strcasecmp(name, "menu.rbf") ? getStorageDir(0) : getRootDir(), name);
+}
+
+static void rbf_cache_name(const char *path, const struct stat64 *st, char *out, int size)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *p = path; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	snprintf(out, size, RBF_CACHE_DIR "/%08X_%llX_%llX.rbf", hash, (unsigned long long)st->st_size, (unsigned long long)st->st_mtime);
+}
+
+// drop the least recently used entries until the cache fits into limit bytes,
+// returns the size of what is left. Runs on the main thread and the bulk worker.
+static uint64_t rbf_cache_trim(uint64_t limit)
+{
+	struct { char name[64]; time_t used; uint64_t size; } list[RBF_CACHE_MAX];
+	int num = 0;
+	uint64_t total = 0;
+
+	DIR *d = opendir(RBF_CACHE_DIR);
+	if (!d) return 0;
+
+	struct dirent *de;
+	while ((de = readdir(d)) && num < RBF_CACHE_MAX)
+	{
+		int len = strlen(de->d_name);
+		if (len < 4 || len >= (int)sizeof(list[0].name) || strcmp(de->d_name + len - 4, ".rbf")) continue;
+
+		char path[128];
+		struct stat64 st;
+		snprintf(path, sizeof(path), RBF_CACHE_DIR "/%s", de->d_name);
+		if (stat64(path, &st) < 0) continue;
+
+		strcpy(list[num].name, de->d_name);
+		list[num].used = st.st_mtime;
+		list[num].size = st.st_size;
+		total += st.st_size;
+		num++;
+	}
+	closedir(d);
+
+	while (total > limit && num)
+	{
+		int old = 0;
+		for (int i = 1; i < num; i++) if (list[i].used < list[old].used) old = i;
+
+		char path[128];
+		snprintf(path, sizeof(path), RBF_CACHE_DIR "/%s", list[old].name);
+		unlink(path);
+		total -= list[old].size;
+		list[old] = list[--num];
+	}
+	return total;
+}
+
+static size_t rbf_cache_size()
+{
+	return rbf_cache_trim(UINT64_MAX);
+}
+
+static size_t rbf_cache_budget_trim(size_t bytes)
+{
+	uint64_t total = rbf_cache_size();
+	return total - rbf_cache_trim((total > bytes) ? total - bytes : 0);
+}
+
+static void rbf_cache_store(const char *cname, const void *buf, uint32_t size)
+{
+	uint64_t limit = cfg.rbf_cache * 1024ULL * 1024ULL;
+	if (size > limit) return;
+
+	mkdir(RBF_CACHE_DIR, 0755);
+	membudget_register("rbf", MEMBUDGET_PRIO_LOW, rbf_cache_size, rbf_cache_budget_trim);
+	rbf_cache_trim(limit - size);
+
+	// written under a temporary name, so a reader never sees a partial file
+	char tmp[128];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cname);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	int ok = write(fd, buf, size) == (ssize_t)size;
+	close(fd);
+	if (!ok || rename(tmp, cname) < 0) unlink(tmp);
+}
+
+static void rbf_prefetch(const char *path)
+{
+	char cname[128];
+	struct stat64 st;
+
+	if (stat64(path, &st) < 0) return;
+	rbf_cache_name(path, &st, cname, sizeof(cname));
+	if (!access(cname, F_OK)) return;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+
+	void *buf = malloc(st.st_size);
+	if (buf)
+	{
+		if (read(fd, buf, st.st_size) == st.st_size) rbf_cache_store(cname, buf, st.st_size);
+		free(buf);
+	}
+	close(fd);
+}
+
+void fpga_prefetch_rbf(const char *name)
+{
+	static char last[1024] = {};
+	static offload_handle_t pending = 0;
+
+	// one at a time, scrolling through the list must not queue up reads
+	if (!cfg.rbf_cache || !strcmp(last, name) || !offload_is_done(pending)) return;
+	snprintf(last, sizeof(last), "%s", name);
+
+	int len = strlen(name);
+	if (len < 4 || strcasecmp(name + len - 4, ".rbf")) return;
+
+	char *path = (char*)malloc(1024);
+	if (!path) return;
+	rbf_path(name, path, 1024);
+
+	// just a hint, skip it if the bulk worker is busy
+	pending = offload_try_add_work([path] { rbf_prefetch(path); free(path); }, OFFLOAD_PRIO_BULK);
+	if (!pending) free(path);
+}
+
+// The boot core is read while its countdown runs, see fpga_preload_rbf().
+struct rbfPreload
+{
+	char path[1024];
+	struct stat64 st;
+	void *buf;
+	std::atomic<int> cancel;
+	offload_handle_t job;
+};
+
+static rbfPreload preload;
+
+static void rbf_preload_run()
+{
+	int fd = open(preload.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+
+	struct stat64 st;
+	uint8_t *buf = 0;
+	if (!fstat64(fd, &st) && st.st_size > 16) buf = (uint8_t*)malloc(st.st_size);
+
+	int ok = buf != 0;
+	for (__off64_t pos = 0; ok && pos < st.st_size;)
+	{
+		// in chunks, so a key press during the countdown stops it soon
+		if (preload.cancel) ok = 0;
+		else
+		{
+			ssize_t len = read(fd, buf + pos, (st.st_size - pos < 0x100000) ? st.st_size - pos : 0x100000);
+			if (len <= 0) ok = 0;
+			pos += len;
+		}
+	}
+	close(fd);
+
+	// a MiSTer header must describe a bitstream within the file
+	if (ok && !memcmp(buf, "MiSTer", 6) && *(uint32_t*)(buf + 12) > st.st_size - 16) ok = 0;
+
+	if (ok)
+	{
+		preload.st = st;
+		preload.buf = buf;
+	}
+	else free(buf);
+}
+
+void fpga_preload_rbf(const char *name)
+{
+	fpga_preload_cancel();
+
+	int len = strlen(name);
+	if (len < 4 || strcasecmp(name + len - 4, ".rbf")) return;
+
+	rbf_path(name, preload.path, sizeof(preload.path));
+	preload.cancel = 0;
+	preload.job = offload_add_work([] { rbf_preload_run(); }, OFFLOAD_PRIO_BULK);
+}
+
+void fpga_preload_cancel()
+{
+	if (!preload.job) return;
+
+	preload.cancel = 1;
+	offload_wait(preload.job);
+	preload.job = 0;
+	free(preload.buf);
+	preload.buf = 0;
+}
+
+// the rest of a running preload is still shorter than reading the file again
+static void *rbf_preload_take(const char *path, const struct stat64 *st)
+{
+	if (!preload.job) return 0;
+
+	offload_wait(preload.job);
+	preload.job = 0;
+
+	void *buf = preload.buf;
+	preload.buf = 0;
+	if (buf && (strcmp(path, preload.path) || preload.st.st_size != st->st_size || preload.st.st_mtime != st->st_mtime))
+	{
+		free(buf);
+		buf = 0;
+	}
+	return buf;
+}
+
 int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 {
 	OsdDisable();
 	static char path[1024];
+	char cname[128] = {};
 	int ret = 0;
 
 	if(cfg)
@@ -435,17 +671,17 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 		reboot(0);
 	}
 
-	printf("Loading RBF: %s\n", name);
+	log_info("Loading RBF: %s\n", name);
+	uint32_t load_start = counters_time_us();
 
-	if(name[0] == '/') strcpy(path, name);
-	else sprintf(path, "%s/%s", !strcasecmp(name, "menu.rbf") ? getStorageDir(0) : getRootDir(), name);
+	rbf_path(name, path, sizeof(path));
 
 	int rbf = open(path, O_RDONLY);
 	if (rbf < 0)
 	{
 		char error[4096];
 		snprintf(error,4096,"%s\nNot Found", name);
-		printf("Couldn't open file %s\n", path);
+		log_err("Couldn't open file %s\n", path);
 		Info(error,5000);
 		return -1;
 	}
@@ -454,25 +690,52 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 		struct stat64 st;
 		if (fstat64(rbf, &st)<0)
 		{
-			printf("Couldn't get info of file %s\n", path);
+			log_err("Couldn't get info of file %s\n", path);
 			ret = -1;
 		}
 		else
 		{
-			printf("Bitstream size: %lld bytes\n", st.st_size);
+			log_info("Bitstream size: %lld bytes\n", st.st_size);
+
+			void *buf = rbf_preload_take(path, &st);
+			int preloaded = (buf != 0);
+			if (preloaded)
+			{
+				log_info("Using preloaded bitstream\n");
+				if (::cfg.rbf_cache)
+				{
+					rbf_cache_name(path, &st, cname, sizeof(cname));
+					if (!access(cname, F_OK)) cname[0] = 0;
+				}
+			}
+			else if (::cfg.rbf_cache)
+			{
+				rbf_cache_name(path, &st, cname, sizeof(cname));
+				int cached = open(cname, O_RDONLY | O_CLOEXEC);
+				if (cached >= 0)
+				{
+					log_info("Using cached bitstream %s\n", cname);
+					close(rbf);
+					rbf = cached;
 
-			void *buf = malloc(st.st_size);
+					// mtime of the cache entry is its LRU stamp
+					utime(cname, 0);
+					cname[0] = 0;
+				}
+			}
+
+			if (!buf) buf = malloc(st.st_size);
 			if (!buf)
 			{
-				printf("Couldn't allocate %llu bytes.\n", st.st_size);
+				log_err("Couldn't allocate %llu bytes.\n", st.st_size);
 				ret = -1;
 			}
 			else
 			{
 				fpga_core_reset(1);
-				if (read(rbf, buf, st.st_size)<st.st_size)
+				if (!preloaded && read(rbf, buf, st.st_size)<st.st_size)
 				{
-					printf("Couldn't read file %s\n", name);
+					log_err("Couldn't read file %s\n", name);
 					ret = -1;
 				}
 				else
@@ -488,11 +751,13 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 					ret = socfpga_load(p, sz);
 					if (ret)
 					{
-						printf("Error %d while loading %s\n", ret, path);
+						log_err("Error %d while loading %s\n", ret, path);
 					}
 					else
 					{
 						do_bridge(1);
+						loadlog_add(LOAD_RBF, counters_time_us() - load_start, name);
+						if (cname[0]) rbf_cache_store(cname, buf, st.st_size);
 					}
 				}
 				free(buf);
@@ -501,7 +766,11 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 	}
 	close(rbf);
 
-	app_restart(!strcasecmp(name, "menu.rbf") ? "menu.rbf" : path, xml);
+	const char *target = !strcasecmp(name, "menu.rbf") ? "menu.rbf" : path;
+	if (!ret && user_io_core_switch(target, xml)) return ret;
+
+	loadlog_handover();
+	app_restart(target, xml);
 	return ret;
 }
 
@@ -558,28 +827,41 @@ int fpga_get_io_version()
 	return (fpga_gpi_read() >> 18) & 3;
 }
 
+// GPO is shared with the SPI lines, so these take the bus
+
 void fpga_set_led(uint32_t on)
 {
+	int bus = spi_acquire();
 	uint32_t gpo = fpga_gpo_read();
 	fpga_gpo_write(on ? gpo | 0x20000000 : gpo & ~0x20000000);
+	spi_release(bus);
 }
 
 int fpga_get_buttons()
 {
+	int bus = spi_acquire();
 	fpga_gpo_write(fpga_gpo_read() | 0x80000000);
 	int gpi = fpga_gpi_read();
+	spi_release(bus);
 	if (gpi < 0) gpi = 0; // FPGA is not in user mode. Ignore the data;
 	return (gpi >> 29) & 3;
 }
 
 int fpga_get_io_type()
 {
+	int bus = spi_acquire();
 	fpga_gpo_write(fpga_gpo_read() | 0x80000000);
-	return (fpga_gpi_read() >> 28) & 1;
+	int gpi = fpga_gpi_read();
+	spi_release(bus);
+	return (gpi >> 28) & 1;
 }
 
 void reboot(int cold)
 {
+	ide_flush();
+	user_io_save_flush();
+	FileConfigFlush();
+	log_flush();
 	sync();
 	fpga_core_reset(1);
 
@@ -612,13 +894,19 @@ char *getappname()
 
 void app_restart(const char *path, const char *xml)
 {
+	ide_flush();
+	user_io_save_flush();
+	FileConfigFlush();
 	sync();
 	fpga_core_reset(1);
 
+	// held until exec, the input thread must not touch the devices anymore
+	input_lock();
 	input_switch(0);
 	input_uinp_destroy();
 
 	offload_stop();
+	log_flush();
 
 	char *appname = getappname();
 	printf("restarting the %s\n", appname);
@@ -630,8 +918,10 @@ void app_restart(const char *path, const char *xml)
 
 void fpga_core_reset(int reset)
 {
+	int bus = spi_acquire();
 	uint32_t gpo = fpga_gpo_read() & ~0xC0000000;
 	fpga_gpo_write(reset ? gpo | 0x40000000 : gpo | 0x80000000);
+	spi_release(bus);
 }
 
 int is_fpga_ready(int quick)
@@ -669,6 +959,8 @@ void fpga_wait_to_reset()
 
 uint16_t fpga_spi(uint16_t word)
 {
+	counter_add(CNT_SPI_BYTES, 2);
+	if (spi_stats_cmd < 0) spi_stats_cmd = word & 0xFF;
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE)) | word;
 
 	fpga_gpo_write(gpo);
@@ -704,6 +996,8 @@ uint16_t fpga_spi(uint16_t word)
 
 uint16_t fpga_spi_fast(uint16_t word)
 {
+	counter_add(CNT_SPI_BYTES, 2);
+	if (spi_stats_cmd < 0) spi_stats_cmd = word & 0xFF;
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE)) | word;
 	fpga_gpo_write(gpo);
 	fpga_gpo_write(gpo | SSPI_STROBE);
@@ -711,23 +1005,102 @@ uint16_t fpga_spi_fast(uint16_t word)
 	return (uint16_t)fpga_gpi_read();
 }
 
+// Block transfers are always bit-banged through GPO. There is no CPU-free
+// path for them: the HPS DMA controller has no user space interface, and a
+// DDR mailbox needs support in the core. Cores having it declare a load
+// address in CONF_STR, and user_io_file_tx() then writes the file straight
+// into the shmem_map() window instead of calling this.
 void fpga_spi_fast_block_write(const uint16_t *buf, uint32_t length)
 {
+	counter_add(CNT_SPI_BYTES, length * 2);
 	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t gpo = gpoH;
+	uint32_t rem = length % 16;
+	length /= 16;
 
-	// should be optimized for speed by compiler automatically
+	// not optimized by compiler automatically
+	// so do manual optimization for speed.
 	while (length--)
+	{
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | *buf++;
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+	}
+
+	while (rem--)
 	{
 		gpo = gpoH | *buf++;
 		fpga_gpo_writeN(gpo);
 		fpga_gpo_writeN(gpo | SSPI_STROBE);
 	}
+
 	fpga_gpo_write(gpo);
 }
 
 void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
 {
+	counter_add(CNT_SPI_BYTES, length * 2);
+	counter_add(CNT_SPI_IN, length * 2);
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t rem = length % 16;
 	length /= 16;
@@ -811,6 +1184,7 @@ void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
 
 void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
 {
+	counter_add(CNT_SPI_BYTES, length);
 	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t gpo = gpoH;
 	uint32_t rem = length % 16;
@@ -897,6 +1271,8 @@ void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
 
 void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
 {
+	counter_add(CNT_SPI_BYTES, length);
+	counter_add(CNT_SPI_IN, length);
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t rem = length % 16;
 	length /= 16;
@@ -980,23 +1356,95 @@ void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
 
 void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length)
 {
+	counter_add(CNT_SPI_BYTES, length * 2);
 	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t gpo = gpoH;
+	uint32_t rem = length % 16;
+	length /= 16;
 
-	// should be optimized for speed by compiler automatically
+	// not optimized by compiler automatically
+	// so do manual optimization for speed.
 	while (length--)
 	{
-		uint16_t tmp = *buf++;
-		tmp = (tmp << 8) | (tmp >> 8);
-		gpo = gpoH | tmp;
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+
+		gpo = gpoH | __builtin_bswap16(*buf++);
+		fpga_gpo_writeN(gpo);
+		fpga_gpo_writeN(gpo | SSPI_STROBE);
+	}
+
+	while (rem--)
+	{
+		gpo = gpoH | __builtin_bswap16(*buf++);
 		fpga_gpo_writeN(gpo);
 		fpga_gpo_writeN(gpo | SSPI_STROBE);
 	}
+
 	fpga_gpo_write(gpo);
 }
 
 void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length)
 {
+	counter_add(CNT_SPI_BYTES, length * 2);
+	counter_add(CNT_SPI_IN, length * 2);
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 
 	// should be optimized for speed by compiler automatically
@@ -1004,7 +1452,155 @@ void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length)
 	{
 		fpga_gpo_writeN(gpo | SSPI_STROBE);
 		fpga_gpo_writeN(gpo);
-		uint16_t tmp = (uint16_t)fpga_gpi_read();
-		*buf++ = (tmp << 8) | (tmp >> 8);
+		*buf++ = __builtin_bswap16((uint16_t)fpga_gpi_read());
+	}
+}
+
+// Baseline numbers of the HPS side of the bus, see "spi_bench" in MiSTer_cmd.
+// The kernels run with every chip select off so the strobes are ignored by
+// the core. With the menu core the cost of a whole command frame is measured
+// too (the menu core answers UIO_GET_STRING, the config string read has no
+// side effects), and the copies into DDR use the savestate area, which the
+// menu core doesn't touch.
+#define SPI_BENCH_BYTES (4 * 1024 * 1024)
+#define SPI_BENCH_DDR   0x3E000000
+
+static uint64_t spi_bench_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void spi_bench_kernel(int v, uint16_t *buf, uint32_t size)
+{
+	switch (v)
+	{
+	case 0: fpga_spi_fast_block_write(buf, size / 2); break;
+	case 1: fpga_spi_fast_block_write_8((uint8_t*)buf, size); break;
+	case 2: fpga_spi_fast_block_write_be(buf, size / 2); break;
+	case 3: fpga_spi_fast_block_read(buf, size / 2); break;
+	case 4: fpga_spi_fast_block_read_8((uint8_t*)buf, size); break;
+	case 5: fpga_spi_fast_block_read_be(buf, size / 2); break;
+	case 6: spi_block_write((uint8_t*)buf, 1, size); break;
+	case 7: spi_block_write((uint8_t*)buf + 1, 1, size); break;
+	case 8: spi_block_read((uint8_t*)buf, 1, size); break;
+	case 9: spi_block_read((uint8_t*)buf + 1, 1, size); break;
+	}
+}
+
+void fpga_spi_bench()
+{
+	if (fpga_gpo_read() & (7 << 18))
+	{
+		printf("spi_bench: SPI is in use.\n");
+		return;
+	}
+
+	static uint16_t buf[32 * 1024 + 1];
+	static const uint32_t sizes[] = { 16, 64, 512, 4096, 32 * 1024, 64 * 1024 };
+	static const char *names[] = { "write", "write_8", "write_be", "read", "read_8", "read_be",
+		"blk_write", "blk_wr_u", "blk_read", "blk_rd_u" };
+
+	// single words, the handshaked and the fast one
+	uint64_t t = spi_bench_ns();
+	for (int i = 0; i < 100000; i++) fpga_spi(0);
+	uint64_t spi_ns = (spi_bench_ns() - t) / 100000;
+
+	t = spi_bench_ns();
+	for (int i = 0; i < 100000; i++) fpga_spi_fast(0);
+	uint64_t fast_ns = (spi_bench_ns() - t) / 100000;
+
+	printf("spi_bench: fpga_spi %llu ns/word, fpga_spi_fast %llu ns/word\n", (unsigned long long)spi_ns, (unsigned long long)fast_ns);
+
+	if (is_menu())
+	{
+		t = spi_bench_ns();
+		for (int i = 0; i < 10000; i++) spi_uio_cmd(UIO_GET_STRING);
+		printf("spi_bench: command frame %llu ns\n", (unsigned long long)((spi_bench_ns() - t) / 10000));
+	}
+
+	// the per call overhead is the time of a zero byte transfer, extrapolated
+	// from the two smallest sizes
+	printf("spi_bench: MB/s per block size, ns per call\n%-10s", "");
+	for (uint32_t size : sizes) printf(" %8u", size);
+	printf(" %8s\n", "call");
+
+	for (int v = 0; v < (int)(sizeof(names) / sizeof(names[0])); v++)
+	{
+		double ns_per[2] = {};
+		printf("%-10s", names[v]);
+		for (uint32_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+		{
+			uint32_t size = sizes[n];
+			uint32_t total = 0, calls = 0;
+			t = spi_bench_ns();
+			while (total < SPI_BENCH_BYTES)
+			{
+				spi_bench_kernel(v, buf, size);
+				total += size;
+				calls++;
+			}
+			uint64_t ns = spi_bench_ns() - t;
+			if (n < 2) ns_per[n] = ns / (double)calls;
+			printf(" %8.2f", ns ? total * 1000.0 / ns : 0.0);
+		}
+		double call = ns_per[0] - (ns_per[1] - ns_per[0]) * sizes[0] / (sizes[1] - sizes[0]);
+		printf(" %8.0f\n", call > 0 ? call : 0.0);
+	}
+
+	if (!is_menu()) return;
+
+	// DDR through shmem_map, mapping cost and copy bandwidth both ways, by
+	// memcpy and the burst copies
+	const uint32_t map_size = 1024 * 1024;
+	t = spi_bench_ns();
+	for (int i = 0; i < 100; i++)
+	{
+		void *p = shmem_map(SPI_BENCH_DDR, map_size);
+		if (!p) return;
+		shmem_unmap(p, map_size);
+	}
+	printf("spi_bench: shmem_map+unmap of 1MB %llu us\n", (unsigned long long)((spi_bench_ns() - t) / 100000));
+
+	uint8_t *ddr = (uint8_t*)shmem_map(SPI_BENCH_DDR, map_size);
+	uint8_t *ram = (uint8_t*)malloc(map_size);
+	if (ram) memset(ram, 0, map_size);
+	if (ddr && ram)
+	{
+		static const uint32_t copy_sizes[] = { 512, 4096, 64 * 1024, 1024 * 1024 };
+		printf("spi_bench: DDR copy MB/s per size\n%-10s", "");
+		for (uint32_t size : copy_sizes) printf(" %8u", size);
+		printf("\n");
+
+		static const char *copy_names[] = { "to_ddr", "from_ddr", "shm_write", "shm_read" };
+		for (int dir = 0; dir < 4; dir++)
+		{
+			printf("%-10s", copy_names[dir]);
+			for (uint32_t size : copy_sizes)
+			{
+				uint32_t total = 0;
+				t = spi_bench_ns();
+				while (total < 4 * SPI_BENCH_BYTES)
+				{
+					for (uint32_t ofs = 0; ofs < map_size; ofs += size)
+					{
+						switch (dir)
+						{
+						case 0: memcpy(ddr + ofs, ram + ofs, size); break;
+						case 1: memcpy(ram + ofs, ddr + ofs, size); break;
+						case 2: shmem_write(ddr + ofs, ram + ofs, size); break;
+						case 3: shmem_read(ram + ofs, ddr + ofs, size); break;
+						}
+					}
+					total += map_size;
+				}
+				uint64_t ns = spi_bench_ns() - t;
+				printf(" %8.2f", ns ? total * 1000.0 / ns : 0.0);
+			}
+			printf("\n");
+		}
 	}
+	free(ram);
+	if (ddr) shmem_unmap(ddr, map_size);
 }
@@ -19,6 +19,7 @@ void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length);
 void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length);
 void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length);
 void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length);
+void fpga_spi_bench();
 
 void fpga_set_led(uint32_t on);
 int  fpga_get_buttons();
@@ -35,6 +36,14 @@ int fpga_get_io_version();
 
 int fpga_load_rbf(const char *name, const char *cfg = 0, const char *xml = 0);
 
+// hint that the core may be loaded soon, see rbf_cache in MiSTer.ini.
+void fpga_prefetch_rbf(const char *name);
+
+// read the core to be loaded next into RAM in the background (bootcore countdown).
+// fpga_load_rbf() takes it if the file is still the same.
+void fpga_preload_rbf(const char *name);
+void fpga_preload_cancel();
+
 void reboot(int cold);
 void app_restart(const char *path, const char *xml = 0);
 char *getappname();
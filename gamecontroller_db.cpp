@@ -3,9 +3,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "input.h"
 #include "file_io.h"
 #include "user_io.h"
+#include "offload.h"
 #include "profiling.h"
 
 
@@ -50,13 +55,12 @@ static const char *sdlname_to_mister_idx[] = {
 typedef struct {
 	uint16_t id[4]; //bustype, vid, pid, version
 	uint32_t map[NUMBUTTONS];
+	uint8_t used;
 } controllerdb_entry;
 
-
-
-
+// hashed by id, an entry lives in one of GCDB_CACHE_PROBE slots from its home slot
+#define GCDB_CACHE_PROBE 4
 static controllerdb_entry db_maps[MAX_GCDB_ENTRIES] = {};
-static int last_db_idx = 0;
 
 //platform should be at the end of mapping strings. this function will null the start of platform: if found
 static bool cdb_entry_matches(char *db_str)
@@ -447,36 +451,316 @@ static bool parse_mapping_string(char *map_str, char *guid, int dev_fd, uint32_t
 
 
 #define GCDB_DIR  "/media/fat/linux/gamecontrollerdb/"
+static const char *gcdb_files[] = { GCDB_DIR "gamecontrollerdb_user.txt", GCDB_DIR "gamecontrollerdb.txt" };
+#define GCDB_FILES (sizeof(gcdb_files) / sizeof(gcdb_files[0]))
+
+// Binary index of a DB file, kept in CONFIG_DIR/gcdb and rebuilt when the DB's
+// size or mtime changes. Lines are hashed by their lowercase GUID, so only the
+// candidate lines are read from the DB. Lines with a GUID field shorter than 32
+// characters prefix-match in the line by line scan, they're kept aside and
+// always checked. The last matching line wins, as with the scan.
+#define GCDB_INDEX_MAGIC 0x31424447 // "GDB1"
+#define GCDB_INDEX_DIR CONFIG_DIR "/gcdb"
 
+typedef struct {
+	uint32_t magic;
+	uint32_t path_len;
+	uint64_t size;
+	uint64_t mtime;
+	uint32_t buckets;    // pow2
+	uint32_t hashed_num; // followed by the short GUID lines
+	uint32_t short_num;
+	uint32_t reserved;
+} gcdb_index_header;
+
+typedef struct {
+	uint32_t hash;
+	uint32_t offset;
+	uint32_t len;
+} gcdb_line;
+
+typedef struct {
+	uint64_t size;
+	uint64_t mtime;
+	uint8_t *data; // header, path, buckets, lines: the file image
+	size_t len;
+	const gcdb_index_header *hdr;
+	const uint32_t *bucket;
+	const gcdb_line *line;
+} gcdb_index;
+
+static gcdb_index gcdb_indexes[GCDB_FILES] = {};
+
+// the prefetch builds the indexes on the offload worker
+static pthread_mutex_t gcdb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t gcdb_guid_hash(const char *guid, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+	{
+		char c = guid[i];
+		if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		hash = (hash ^ (uint8_t)c) * 16777619u;
+	}
+	return hash;
+}
+
+static size_t gcdb_align(size_t len)
+{
+	return (len + 3) & ~3;
+}
+
+static void gcdb_index_free(gcdb_index *db)
+{
+	free(db->data);
+	db->data = NULL;
+	db->len = 0;
+}
+
+static bool gcdb_index_setup(gcdb_index *db, int n)
+{
+	if (db->len < sizeof(gcdb_index_header)) return false;
+
+	const gcdb_index_header *h = (const gcdb_index_header*)db->data;
+	size_t pos = gcdb_align(sizeof(*h) + h->path_len);
+	uint64_t need = pos + ((uint64_t)h->buckets + 1) * sizeof(uint32_t) + ((uint64_t)h->hashed_num + h->short_num) * sizeof(gcdb_line);
+	if (h->magic != GCDB_INDEX_MAGIC || !h->buckets || (h->buckets & (h->buckets - 1)) || need != db->len) return false;
+	if (h->path_len != strlen(gcdb_files[n]) || memcmp(db->data + sizeof(*h), gcdb_files[n], h->path_len)) return false;
+
+	db->hdr = h;
+	db->bucket = (const uint32_t*)(db->data + pos);
+	db->line = (const gcdb_line*)(db->bucket + h->buckets + 1);
+	if (db->bucket[h->buckets] != h->hashed_num) return false;
+	return true;
+}
 
-bool read_controller_map_from_file(char *fname, char *guid, int dev_fd, uint32_t *fill_map)
+static bool gcdb_index_build(gcdb_index *db, int n)
 {
+	// no FileOpen here, it isn't safe off the main thread
+	int fd = open(gcdb_files[n], O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+
 	fileTextReader reader;
+	reader.size = db->size;
+	reader.buffer = (char*)malloc(db->size + 1);
+	reader.pos = reader.buffer;
+	bool ok = reader.buffer && read(fd, reader.buffer, db->size) == (ssize_t)db->size;
+	close(fd);
+	if (!ok) return false;
+	reader.buffer[db->size] = 0;
+
+	uint32_t hashed_num = 0, short_num = 0;
+	gcdb_line *lines = (gcdb_line*)malloc((db->size / 2 + 1) * sizeof(gcdb_line));
+	if (!lines) return false;
+
+	// short GUID lines go to the end of the same array
+	uint32_t cap = db->size / 2 + 1;
+	const char *line;
+	while ((line = FileReadLine(&reader)))
+	{
+		const char *gcom = strchr(line, ',');
+		if (!gcom || gcom - line > GUID_LEN - 1) continue;
+
+		gcdb_line l = { gcdb_guid_hash(line, gcom - line), (uint32_t)(line - reader.buffer), (uint32_t)strlen(line) };
+		if (gcom - line == GUID_LEN - 1) lines[hashed_num++] = l;
+		else lines[cap - ++short_num] = l;
+	}
+
+	uint32_t buckets = 16;
+	while (buckets < hashed_num) buckets <<= 1;
+
+	gcdb_index_header h = {};
+	h.magic = GCDB_INDEX_MAGIC;
+	h.path_len = strlen(gcdb_files[n]);
+	h.size = db->size;
+	h.mtime = db->mtime;
+	h.buckets = buckets;
+	h.hashed_num = hashed_num;
+	h.short_num = short_num;
+
+	size_t pos = gcdb_align(sizeof(h) + h.path_len);
+	db->len = pos + (buckets + 1) * sizeof(uint32_t) + (hashed_num + short_num) * sizeof(gcdb_line);
+	db->data = (uint8_t*)calloc(1, db->len);
+	if (!db->data)
+	{
+		free(lines);
+		db->len = 0;
+		return false;
+	}
+
+	memcpy(db->data, &h, sizeof(h));
+	memcpy(db->data + sizeof(h), gcdb_files[n], h.path_len);
+
+	// counting sort by bucket keeps the file order inside of a bucket
+	uint32_t *bucket = (uint32_t*)(db->data + pos);
+	gcdb_line *out = (gcdb_line*)(bucket + buckets + 1);
+	for (uint32_t i = 0; i < hashed_num; i++) bucket[(lines[i].hash & (buckets - 1)) + 1]++;
+	for (uint32_t i = 0; i < buckets; i++) bucket[i + 1] += bucket[i];
+
+	uint32_t *fill = (uint32_t*)malloc(buckets * sizeof(uint32_t));
+	bool sorted = fill != NULL;
+	if (sorted)
+	{
+		memcpy(fill, bucket, buckets * sizeof(uint32_t));
+		for (uint32_t i = 0; i < hashed_num; i++) out[fill[lines[i].hash & (buckets - 1)]++] = lines[i];
+		for (uint32_t i = 0; i < short_num; i++) out[hashed_num + i] = lines[cap - 1 - i];
+		free(fill);
+	}
+	free(lines);
+
+	if (!sorted || !gcdb_index_setup(db, n))
+	{
+		gcdb_index_free(db);
+		return false;
+	}
+	return true;
+}
+
+static void gcdb_index_name(int n, char *name, size_t size)
+{
+	snprintf(name, size, "%s/" GCDB_INDEX_DIR "/%08X.idx", getRootDir(), gcdb_guid_hash(gcdb_files[n], strlen(gcdb_files[n])));
+}
+
+static bool gcdb_index_load(gcdb_index *db, int n)
+{
+	char name[1024];
+	gcdb_index_name(n, name, sizeof(name));
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+
+	gcdb_index_header h = {};
+	bool ok = read(fd, &h, sizeof(h)) == sizeof(h) && h.magic == GCDB_INDEX_MAGIC && h.size == db->size && h.mtime == db->mtime;
+	if (ok)
+	{
+		struct stat st;
+		ok = !fstat(fd, &st) && st.st_size > (off_t)sizeof(h);
+		if (ok)
+		{
+			db->len = st.st_size;
+			db->data = (uint8_t*)malloc(db->len);
+			ok = db->data && pread(fd, db->data, db->len, 0) == (ssize_t)db->len && gcdb_index_setup(db, n);
+		}
+	}
+
+	close(fd);
+	if (!ok) gcdb_index_free(db);
+	return ok;
+}
+
+static void gcdb_index_store(const gcdb_index *db, int n)
+{
+	char *name = (char*)malloc(1024);
+	uint8_t *rec = (uint8_t*)malloc(db->len);
+	if (!name || !rec)
+	{
+		free(name);
+		free(rec);
+		return;
+	}
+
+	size_t size = db->len;
+	memcpy(rec, db->data, size);
+	gcdb_index_name(n, name, 1024);
+
+	offload_add_work([rec, size, name]
+	{
+		// FileCreatePath isn't safe off the main thread
+		char *dir = strrchr(name, '/');
+		*dir = 0;
+		mkdir(name, 0777);
+		*dir = '/';
+
+		FILE *fp = fopen(name, "wb");
+		if (fp)
+		{
+			bool ok = fwrite(rec, size, 1, fp) == 1;
+			if (fclose(fp) || !ok) remove(name);
+		}
+		free(rec);
+		free(name);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+// call with gcdb_lock held
+static const gcdb_index *gcdb_index_get(int n)
+{
+	gcdb_index *db = &gcdb_indexes[n];
+
+	struct stat st;
+	if (stat(gcdb_files[n], &st))
+	{
+		gcdb_index_free(db);
+		return NULL;
+	}
+
+	if (db->data && db->size == (uint64_t)st.st_size && db->mtime == (uint64_t)st.st_mtime) return db;
+
+	gcdb_index_free(db);
+	db->size = st.st_size;
+	db->mtime = st.st_mtime;
+
+	if (gcdb_index_load(db, n)) return db;
+	if (!gcdb_index_build(db, n)) return NULL;
+
+	printf("Gamecontrollerdb: indexed %u lines of %s\n", db->hdr->hashed_num + db->hdr->short_num, gcdb_files[n]);
+	gcdb_index_store(db, n);
+	return db;
+}
+
+static bool read_controller_map_from_file(int n, char *guid, int dev_fd, uint32_t *fill_map)
+{
 	char matched[1024] = {};
-	char *map_start = NULL;
 
-	if (FileOpenTextReader(&reader, fname))
+	pthread_mutex_lock(&gcdb_lock);
+	const gcdb_index *db = gcdb_index_get(n);
+	int fd = db ? open(gcdb_files[n], O_RDONLY | O_CLOEXEC) : -1;
+	if (fd >= 0)
 	{
-		const char *line;
-		printf("Gamecontrollerdb: searching for GUID %s in file %s\n", guid, fname);
-		while ((line = FileReadLine(&reader)))
+		printf("Gamecontrollerdb: searching for GUID %s in file %s\n", guid, gcdb_files[n]);
+
+		uint32_t hash = gcdb_guid_hash(guid, strlen(guid));
+		uint32_t b = hash & (db->hdr->buckets - 1);
+		int h_pos = db->bucket[b + 1];
+		int s_pos = db->hdr->hashed_num + db->hdr->short_num;
+
+		// both lists are in file order, walk them backwards, the first match is the last one in the file
+		while (h_pos > (int)db->bucket[b] || s_pos > (int)db->hdr->hashed_num)
 		{
-			if (line[0] == '#') continue;
-			const char *gcom = strchr(line, ',');
-			if (!strncasecmp(line, guid, gcom-line))
+			const gcdb_line *l;
+			if (s_pos <= (int)db->hdr->hashed_num || (h_pos > (int)db->bucket[b] && db->line[h_pos - 1].offset > db->line[s_pos - 1].offset))
+			{
+				l = &db->line[--h_pos];
+				if (l->hash != hash) continue;
+			}
+			else l = &db->line[--s_pos];
+
+			char *line = (char*)malloc(l->len + 1);
+			if (!line) break;
+
+			bool found = false;
+			if (pread(fd, line, l->len, l->offset) == (ssize_t)l->len)
 			{
-				if (cdb_entry_matches((char *)gcom))
+				line[l->len] = 0;
+				char *gcom = strchr(line, ',');
+				if (gcom && !strncasecmp(line, guid, gcom - line) && cdb_entry_matches(gcom))
 				{
-					map_start = strchr((char *)gcom+1, ',');
+					char *map_start = strchr(gcom + 1, ',');
 					if (map_start)
 					{
-						strncpy(matched, map_start+1, sizeof(matched));
+						strncpy(matched, map_start + 1, sizeof(matched));
+						found = true;
 					}
 				}
 			}
+			free(line);
+			if (found) break;
 		}
-
+		close(fd);
 	}
+	pthread_mutex_unlock(&gcdb_lock);
+
 	if (matched[0] != 0)
 	{
 		printf("Gamecontrollerdb: found match, using config %s\n", matched);
@@ -486,13 +770,23 @@ bool read_controller_map_from_file(char *fname, char *guid, int dev_fd, uint32_t
 	return false;
 }
 
+static int gcdb_cache_home(uint16_t bustype, uint16_t vid, uint16_t pid, uint16_t version)
+{
+	uint32_t hash = ((uint32_t)bustype * 0x9E3779B1u) ^ ((uint32_t)vid << 16 | pid) ^ ((uint32_t)version * 0x85EBCA6Bu);
+	hash ^= hash >> 15;
+	hash *= 0x2C1B3C6Du;
+	return (hash >> 16) % MAX_GCDB_ENTRIES;
+}
+
 static int gcdb_controller_idx(uint16_t bustype, uint16_t vid, uint16_t pid, uint16_t version)
 {
-	for (int i=0; i < MAX_GCDB_ENTRIES; i++)
+	int home = gcdb_cache_home(bustype, vid, pid, version);
+	for (int i = 0; i < GCDB_CACHE_PROBE; i++)
 	{
-		if (db_maps[i].id[0] == bustype && db_maps[i].id[1] == vid && db_maps[i].id[2] == pid && db_maps[i].id[3] == version)
+		controllerdb_entry *e = &db_maps[(home + i) % MAX_GCDB_ENTRIES];
+		if (e->used && e->id[0] == bustype && e->id[1] == vid && e->id[2] == pid && e->id[3] == version)
 		{
-			return i;
+			return (home + i) % MAX_GCDB_ENTRIES;
 		}
 	}
 	return -1;
@@ -506,12 +800,31 @@ static void gcdb_cache_controller_map(uint16_t bustype, uint16_t vid, uint16_t p
 		return;
 	}
 
-	db_maps[last_db_idx].id[0] = bustype;
-	db_maps[last_db_idx].id[1] = vid;
-	db_maps[last_db_idx].id[2] = pid;
-	db_maps[last_db_idx].id[3] = version;
-	memcpy(db_maps[last_db_idx].map, button_map, sizeof(uint32_t)*NUMBUTTONS);
-	last_db_idx = (last_db_idx +1) % MAX_GCDB_ENTRIES;
+	// first free slot in the probe window, the home slot is replaced if there's none
+	int home = gcdb_cache_home(bustype, vid, pid, version);
+	int idx = home;
+	for (int i = 0; i < GCDB_CACHE_PROBE; i++)
+	{
+		if (!db_maps[(home + i) % MAX_GCDB_ENTRIES].used)
+		{
+			idx = (home + i) % MAX_GCDB_ENTRIES;
+			break;
+		}
+	}
+
+	db_maps[idx].id[0] = bustype;
+	db_maps[idx].id[1] = vid;
+	db_maps[idx].id[2] = pid;
+	db_maps[idx].id[3] = version;
+	db_maps[idx].used = 1;
+	memcpy(db_maps[idx].map, button_map, sizeof(uint32_t)*NUMBUTTONS);
+}
+
+void gcdb_prefetch()
+{
+	pthread_mutex_lock(&gcdb_lock);
+	for (uint32_t n = 0; n < GCDB_FILES; n++) gcdb_index_get(n);
+	pthread_mutex_unlock(&gcdb_lock);
 }
 
 bool gcdb_map_for_controller(uint16_t bustype, uint16_t vid, uint16_t pid, uint16_t version, int dev_fd, uint32_t *fill_map)
@@ -527,14 +840,10 @@ bool gcdb_map_for_controller(uint16_t bustype, uint16_t vid, uint16_t pid, uint1
 		}
 		sprintf(guid_str, "%04x0000%04x0000%04x0000%04x0000", (uint16_t)(bustype << 8 | bustype >> 8), (uint16_t)( vid << 8 |  vid >> 8), (uint16_t)(pid << 8 | pid >> 8), (uint16_t)(version << 8 | version >> 8));
 
-		char path[256] = {GCDB_DIR};
-		strcat(path, "gamecontrollerdb_user.txt");
 		bool found_entry = false;
-		if (!(found_entry = read_controller_map_from_file(path, guid_str, dev_fd, fill_map)))
+		for (uint32_t n = 0; n < GCDB_FILES && !found_entry; n++)
 		{
-			strcpy(path, GCDB_DIR);
-			strcat(path, "gamecontrollerdb.txt");
-			found_entry = read_controller_map_from_file(path, guid_str, dev_fd, fill_map);
+			found_entry = read_controller_map_from_file(n, guid_str, dev_fd, fill_map);
 		}
 
 
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <time.h>
+#include <unistd.h>
 #include <ios>
 #include <fstream>
 #include <iostream>
@@ -20,6 +21,9 @@
 #include "file_io.h"
 #include "hardware.h"
 #include "ide.h"
+#include "scheduler.h"
+#include "cfg.h"
+#include "offload.h"
 
 #if 0
 	#define dbg_printf     printf
@@ -75,7 +79,10 @@ void ide_recvbuf(ide_config *ide, uint16_t reg, uint32_t length, uint16_t *data)
 }
 
 const uint32_t ide_io_max_size = 32;
-uint8_t ide_buf[ide_io_max_size * 512];
+alignas(FILE_DIRECT_ALIGN) uint8_t ide_buf[ide_io_max_size * 512];
+
+// read pipeline of each channel, see process_read
+alignas(FILE_DIRECT_ALIGN) static uint8_t ide_rd_bufs[2][2][ide_io_max_size * 512];
 
 ide_config ide_inst[2] = {};
 
@@ -86,6 +93,7 @@ uint16_t ide_check()
 	res = spi_w(UIO_DMA_SDIO);
 	if (!res) res = (uint8_t)spi_w(0);
 	DisableIO();
+	if (res) scheduler_activity();
 	return res;
 }
 
@@ -104,7 +112,7 @@ int ide_img_mount(fileTYPE *f, const char *name, int rw)
 		}
 		else {
 			writable = rw && FileCanWrite(name);
-			ret = FileOpenEx(f, name, writable ? (O_RDWR | O_SYNC) : O_RDONLY);
+			ret = FileOpenDisk(f, name, writable ? (O_RDWR | O_SYNC) : O_RDONLY);
 			if (!ret) printf("Failed to open file %s\n", name);
 		}
 	}
@@ -281,6 +289,100 @@ static void guess_geometry(fileTYPE *f, chs_t *chs, int allow_vrdb)
 	}
 }
 
+// The geometry found for the last images, kept in CONFIG_DIR/hddgeo.bin. An
+// image mounted again with the same path, size and mtime skips the probe,
+// which reads the first sectors of every image on every mount.
+#define GEO_CACHE_NAME  "hddgeo.bin"
+#define GEO_CACHE_MAGIC 0x314F4547 // "GEO1"
+#define GEO_CACHE_NUM   16
+
+struct geoEntry
+{
+	char path[256];
+	uint64_t size;
+	int64_t mtime;
+	uint32_t stamp; // of the last use, the oldest one is replaced
+	uint8_t allow_vrdb;
+	chs_t chs;
+};
+
+struct geoCache
+{
+	uint32_t magic;
+	uint32_t stamp;
+	geoEntry entry[GEO_CACHE_NUM];
+};
+
+static geoCache geo_cache;
+static int geo_cache_loaded = 0;
+
+static geoEntry *geo_cache_find(const char *path, const struct stat64 *st, int allow_vrdb)
+{
+	if (!geo_cache_loaded)
+	{
+		geo_cache_loaded = 1;
+		if (FileLoadConfig(GEO_CACHE_NAME, &geo_cache, sizeof(geo_cache)) != (int)sizeof(geo_cache) ||
+			geo_cache.magic != GEO_CACHE_MAGIC)
+		{
+			memset(&geo_cache, 0, sizeof(geo_cache));
+			geo_cache.magic = GEO_CACHE_MAGIC;
+		}
+	}
+
+	for (int i = 0; i < GEO_CACHE_NUM; i++)
+	{
+		geoEntry *e = &geo_cache.entry[i];
+		if (e->stamp && e->size == (uint64_t)st->st_size && e->mtime == st->st_mtime &&
+			e->allow_vrdb == allow_vrdb && !strcmp(e->path, path)) return e;
+	}
+	return 0;
+}
+
+static void geo_cache_store()
+{
+	geoCache *copy = (geoCache*)malloc(sizeof(geoCache));
+	if (!copy) return;
+
+	memcpy(copy, &geo_cache, sizeof(geoCache));
+	offload_add_work([copy]
+	{
+		FileSaveConfig(GEO_CACHE_NAME, copy, sizeof(geoCache));
+		free(copy);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+static void get_geometry(fileTYPE *f, chs_t *chs, int allow_vrdb)
+{
+	struct stat64 st;
+	if (strlen(f->path) >= sizeof(geo_cache.entry[0].path) || stat64(f->path, &st))
+	{
+		guess_geometry(f, chs, allow_vrdb);
+		return;
+	}
+
+	geoEntry *e = geo_cache_find(f->path, &st, allow_vrdb);
+	if (e)
+	{
+		printf("Geometry of an unchanged image. ");
+		*chs = e->chs;
+		e->stamp = ++geo_cache.stamp;
+		return;
+	}
+
+	guess_geometry(f, chs, allow_vrdb);
+
+	e = &geo_cache.entry[0];
+	for (int i = 1; i < GEO_CACHE_NUM; i++) if (geo_cache.entry[i].stamp < e->stamp) e = &geo_cache.entry[i];
+
+	strcpy(e->path, f->path);
+	e->size = st.st_size;
+	e->mtime = st.st_mtime;
+	e->allow_vrdb = allow_vrdb;
+	e->chs = *chs;
+	e->stamp = ++geo_cache.stamp;
+	geo_cache_store();
+}
+
 static void ide_set_geometry(drive_t *drive, uint16_t sectors, uint16_t heads)
 {
 	int info = 0;
@@ -320,12 +422,11 @@ static uint32_t checksum_rdb(uint32_t *p, int set)
 	return 0;
 }
 
-static void fill_fake_rdb(drive_t *drive, uint32_t sector, int cnt)
+static void fill_fake_rdb(drive_t *drive, uint32_t sector, int cnt, uint8_t *buff)
 {
 	printf("fill_fake_rdb(%u,%d)\n", sector, cnt);
 
-	uint8_t *buff = ide_buf;
-	memset(ide_buf, 0, sizeof(ide_buf));
+	memset(buff, 0, sizeof(ide_buf));
 
 	while (cnt)
 	{
@@ -457,6 +558,8 @@ void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors, int heads, i
 	if(drive->f)
 	{
 		if (!drive->chd_f) drive->total_sectors = (drive->f->size / 512);
+		if (!drive->cd && !drive->chd_f) FileSetCache(drive->f, cfg.hdd_cache, cfg.hdd_write_delay);
+		drive->flush_err = 0;
 	}
 	else
 	{
@@ -744,31 +847,49 @@ inline uint16_t get_cnt(ide_config *ide)
 	return cnt;
 }
 
-inline int readhdd(drive_t *drive, uint32_t lba, int cnt)
+inline int readhdd(drive_t *drive, uint32_t lba, int cnt, uint8_t *buf)
 {
 	if (lba < drive->offset)
 	{
-		if (!drive->type) fill_fake_rdb(drive, lba, cnt);
-		else memset(ide_buf, 0, sizeof(ide_buf));
+		if (!drive->type) fill_fake_rdb(drive, lba, cnt, buf);
+		else memset(buf, 0, sizeof(ide_buf));
 		return 1;
 	}
 	else
 	{
-		return FileReadAdv(drive->f, ide_buf, cnt * 512, -1);
+		return FileReadAt(drive->f, (__off64_t)(lba - drive->offset) << 9, buf, cnt * 512, -1);
 	}
 }
 
-static void process_read(ide_config *ide, int multi)
+// Wait for the core to take the next block. There is no interrupt from the
+// FPGA side, so it's still polled, but after the first few checks the loop
+// sleeps between polls instead of spinning core 1 on a slow or stuck core.
+// Returns 0 if the other channel has a request meanwhile, the transfer is
+// then resumed by the next ide_io, so HDD and CD-ROM take turns per block.
+static uint16_t ide_wait_req(ide_config *ide)
 {
-	uint32_t lba = get_lba(ide);
-	uint16_t ide_req = 0;
+	ide_config *other = &ide_inst[(ide == ide_inst) ? 1 : 0];
+	int shared = other->drive[0].present || other->drive[1].present;
 
-	dbg2_printf("  sector_count: %d\n", ide->regs.sector_count);
+	for (int i = 0;; i++)
+	{
+		uint16_t res = ide_check();
+		if (shared && ((res >> other->bitoff) & 7)) return 0;
 
-	uint32_t cnt = multi ? get_cnt(ide) : 1;
-	ide->null = !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset));
-	if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
-	if (ide->null) memset(ide_buf, 0, cnt * 512);
+		uint16_t req = (res >> ide->bitoff) & 7;
+		if (req) return req;
+		if (i >= 64) usleep(20);
+	}
+}
+
+// Sends rd_buf, the next block is read on the offload worker while the
+// current one is on the wire, so storage latency and SPI transfer overlap.
+static void read_blocks(ide_config *ide)
+{
+	uint32_t lba = get_lba(ide);
+	uint16_t ide_req = 0;
+	drive_t *drive = &ide->drive[ide->regs.drv];
+	uint32_t cnt = ide->io_cnt;
 
 	while (1)
 	{
@@ -780,14 +901,31 @@ static void process_read(ide_config *ide, int multi)
 		ide->regs.status = ATA_STATUS_RDP | ATA_STATUS_RDY | ATA_STATUS_DRQ | ATA_STATUS_IRQ;
 		if (!ide->regs.sector_count) ide->regs.status |= ATA_STATUS_END;
 
+		uint8_t *next = ide->rd_next;
+		uint32_t next_cnt = 0;
+		int next_res = 0;
+		offload_handle_t job = 0;
+		if (ide->regs.sector_count)
+		{
+			next_cnt = ide->multi ? get_cnt(ide) : 1;
+			if (!ide->null && lba >= drive->offset)
+			{
+				int *res = &next_res;
+				job = offload_try_add_work([drive, lba, next_cnt, next, res]
+				{
+					*res = FileReadAt(drive->f, (__off64_t)(lba - drive->offset) << 9, next, next_cnt * 512, -1);
+				});
+			}
+		}
+
 		if (ide->regs.io_fast)
 		{
 			ide_set_regs(ide);
-			ide_send_data(ide_buf, cnt * 256);
+			ide_send_data(ide->rd_buf, cnt * 256);
 		}
 		else
 		{
-			ide_send_data(ide_buf, cnt * 256);
+			ide_send_data(ide->rd_buf, cnt * 256);
 			ide->regs.status &= ~ATA_STATUS_RDP;
 			ide_set_regs(ide);
 		}
@@ -799,12 +937,25 @@ static void process_read(ide_config *ide, int multi)
 			break;
 		}
 
-		cnt = multi ? get_cnt(ide) : 1;
-		if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
-		if (ide->null) memset(ide_buf, 0, cnt * 512);
+		cnt = next_cnt;
+		if (job)
+		{
+			offload_wait(job);
+			ide->null = (next_res <= 0);
+		}
+		else if (!ide->null) ide->null = (readhdd(drive, lba, cnt, next) <= 0);
+		if (ide->null) memset(next, 0, cnt * 512);
 
-		ide_req = 0;
-		while (!ide_req) ide_req = (ide_check() >> ide->bitoff) & 7;
+		ide->rd_next = ide->rd_buf;
+		ide->rd_buf = next;
+		ide->io_cnt = cnt;
+
+		ide_req = ide_wait_req(ide);
+		if (!ide_req)
+		{
+			ide->state = IDE_STATE_WAIT_RD;
+			break;
+		}
 
 		if (ide_req != 5)
 		{
@@ -816,26 +967,80 @@ static void process_read(ide_config *ide, int multi)
 	dbg2_printf("  finish\n");
 }
 
-static void process_write(ide_config *ide, int multi)
+static void process_read(ide_config *ide, int multi)
 {
 	uint32_t lba = get_lba(ide);
-	uint32_t cnt = 1;
-	uint16_t ide_req;
+	drive_t *drive = &ide->drive[ide->regs.drv];
 
-	ide->null = (ide->regs.cmd != 0xFA) ? !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset)) : 1;
-	uint8_t irq = 0;
+	ide->rd_buf = ide_rd_bufs[ide - ide_inst][0];
+	ide->rd_next = ide_rd_bufs[ide - ide_inst][1];
+	ide->multi = multi;
 
-	while (1)
+	dbg2_printf("  sector_count: %d\n", ide->regs.sector_count);
+
+	uint32_t cnt = multi ? get_cnt(ide) : 1;
+	ide->null = !drive->f->opened();
+	if (!ide->null) ide->null = (readhdd(drive, lba, cnt, ide->rd_buf) <= 0);
+	if (ide->null) memset(ide->rd_buf, 0, cnt * 512);
+
+	ide->io_cnt = cnt;
+	read_blocks(ide);
+}
+
+// delayed writes are written back when the bus is quiet for this long,
+// or once they are hdd_write_delay old even if it's busy.
+#define IDE_IDLE_FLUSH 100
+
+static void ide_flush_port(ide_config *ide, uint32_t age)
+{
+	for (int i = 0; i < 2; i++)
 	{
-		cnt = multi ? get_cnt(ide) : 1;
-		ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_DRQ | irq;
-		irq = ATA_STATUS_IRQ;
+		drive_t *drive = &ide->drive[i];
+		if (drive->present && !drive->cd && drive->f && !FileFlushCache(drive->f, age)) drive->flush_err = 1;
+	}
+}
 
-		ide->regs.io_size = cnt;
-		ide_set_regs(ide);
+static uint32_t ide_idle_age()
+{
+	return (cfg.hdd_write_delay < IDE_IDLE_FLUSH) ? cfg.hdd_write_delay : IDE_IDLE_FLUSH;
+}
+
+void ide_flush()
+{
+	ide_flush_port(&ide_inst[0], 0);
+	ide_flush_port(&ide_inst[1], 0);
+}
+
+void ide_flush_poll()
+{
+	if (!cfg.hdd_write_delay) return;
+
+	ide_flush_port(&ide_inst[0], ide_idle_age());
+	ide_flush_port(&ide_inst[1], ide_idle_age());
+}
+
+// asks the core for the next block
+static void write_req(ide_config *ide, uint8_t irq)
+{
+	ide->io_cnt = ide->multi ? get_cnt(ide) : 1;
+	ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_DRQ | irq;
+	ide->regs.io_size = ide->io_cnt;
+	ide_set_regs(ide);
+}
+
+static void write_blocks(ide_config *ide)
+{
+	uint32_t lba = get_lba(ide);
+	uint16_t ide_req;
 
-		ide_req = 0;
-		while (!ide_req) ide_req = (ide_check() >> ide->bitoff) & 7;
+	while (1)
+	{
+		ide_req = ide_wait_req(ide);
+		if (!ide_req)
+		{
+			ide->state = IDE_STATE_WAIT_WR;
+			return;
+		}
 
 		if (ide_req != 5)
 		{
@@ -843,6 +1048,7 @@ static void process_write(ide_config *ide, int multi)
 			break;
 		}
 
+		uint32_t cnt = ide->io_cnt;
 		ide_recv_data(ide_buf, cnt * 256);
 
 		if (ide->regs.cmd == 0xFA)
@@ -857,7 +1063,7 @@ static void process_write(ide_config *ide, int multi)
 		}
 		else
 		{
-			if (!ide->null) ide->null = (lba < ide->drive[ide->regs.drv].offset) ? 0 : (FileWriteAdv(ide->drive[ide->regs.drv].f, ide_buf, cnt * 512, -1) <= 0);
+			if (!ide->null) ide->null = (lba < ide->drive[ide->regs.drv].offset) ? 0 : (FileWriteAt(ide->drive[ide->regs.drv].f, (__off64_t)(lba - ide->drive[ide->regs.drv].offset) << 9, ide_buf, cnt * 512, -1) <= 0);
 			lba += cnt;
 			ide->regs.sector_count -= cnt;
 			put_lba(ide, lba);
@@ -870,7 +1076,20 @@ static void process_write(ide_config *ide, int multi)
 			ide_set_regs(ide);
 			break;
 		}
+
+		write_req(ide, ATA_STATUS_IRQ);
 	}
+
+	if (cfg.hdd_write_delay) ide_flush_port(ide, cfg.hdd_write_delay);
+}
+
+static void process_write(ide_config *ide, int multi)
+{
+	ide->null = (ide->regs.cmd != 0xFA) ? !ide->drive[ide->regs.drv].f->opened() : 1;
+	ide->multi = multi;
+
+	write_req(ide, 0);
+	write_blocks(ide);
 }
 
 static int handle_hdd(ide_config *ide)
@@ -912,6 +1131,22 @@ static int handle_hdd(ide_config *ide)
 		process_write(ide, 0);
 		break;
 
+	case 0xE7: // flush cache
+	case 0xEA: // flush cache ext
+		{
+			drive_t *drive = &ide->drive[ide->regs.drv];
+			if (!FileFlushCache(drive->f)) drive->flush_err = 1;
+			ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_IRQ;
+			if (drive->flush_err)
+			{
+				ide->regs.status |= ATA_STATUS_ERR;
+				ide->regs.error = ATA_ERR_ABRT;
+				drive->flush_err = 0;
+			}
+			ide_set_regs(ide);
+		}
+		break;
+
 	case 0xC6: // set multople
 		if (ide->regs.sector_count > ide_io_max_size)
 		{
@@ -971,6 +1206,10 @@ void ide_io(int num, int req)
 
 			dbg_printf("IDE %04X reset finish\n", ide->base);
 		}
+		else if (cfg.hdd_write_delay)
+		{
+			ide_flush_port(ide, ide_idle_age());
+		}
 	}
 	else if (req == 4) // command
 	{
@@ -1004,6 +1243,14 @@ void ide_io(int num, int req)
 			if (ide->regs.pkt_cnt) cdrom_read(ide);
 			else cdrom_reply(ide, 0);
 		}
+		else if (ide->state == IDE_STATE_WAIT_RD)
+		{
+			read_blocks(ide);
+		}
+		else if (ide->state == IDE_STATE_WAIT_WR)
+		{
+			write_blocks(ide);
+		}
 		else if (ide->state == IDE_STATE_WAIT_PKT_MODE)
 		{
 			ide_recv_data(ide_buf, 256);
@@ -1026,6 +1273,7 @@ void ide_io(int num, int req)
 		if (ide->state != IDE_STATE_RESET)
 		{
 			printf("IDE %04X reset start\n", ide->base);
+			ide_flush_port(ide, 0);
 		}
 
 		ide->drive[0].playing = 0;
@@ -1089,10 +1337,10 @@ int ide_open(uint8_t unit, const char* filename)
 	if (!is_minimig() || ((minimig_config.ide_cfg & 1) && minimig_config.hardfile[unit].cfg))
 	{
 		printf("\nChecking HDD %d\n", unit);
-		if (filename[0] && FileOpenEx(&hdd_file[unit], filename, FileCanWrite(filename) ? O_RDWR : O_RDONLY))
+		if (filename[0] && FileOpenDisk(&hdd_file[unit], filename, FileCanWrite(filename) ? O_RDWR : O_RDONLY))
 		{
 			printf("file: \"%s\": ", hdd_file[unit].name);
-			guess_geometry(&hdd_file[unit], &chs, is_minimig() && !strcasecmp(".hdf", filename + strlen(filename) - 4));
+			get_geometry(&hdd_file[unit], &chs, is_minimig() && !strcasecmp(".hdf", filename + strlen(filename) - 4));
 			printf("size: %llu (%llu MB)\n", hdd_file[unit].size, hdd_file[unit].size >> 20);
 			printf("CHS: %u/%u/%u", chs.cylinders, chs.heads, chs.sectors);
 			printf(" (%llu MB), ", ((((uint64_t)chs.cylinders) * chs.heads * chs.sectors) >> 11));
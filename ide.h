@@ -31,6 +31,8 @@
 #define IDE_STATE_WAIT_PKT_RD   4
 #define IDE_STATE_WAIT_PKT_END  5
 #define IDE_STATE_WAIT_PKT_MODE 6
+#define IDE_STATE_WAIT_RD       7
+#define IDE_STATE_WAIT_WR       8
 
 struct regs_t
 {
@@ -88,6 +90,7 @@ struct drive_t
 	uint8_t  placeholder;
 	uint8_t  allow_placeholder;
 	uint8_t  cd;
+	uint8_t  flush_err;  // a background write-back failed, reported by FLUSH CACHE
 	uint8_t  load_state;
 	uint8_t  last_load_state;
 	uint8_t  track_cnt;
@@ -106,10 +109,10 @@ struct drive_t
 	uint8_t  atapi_ascq_code;
 
 	chd_file *chd_f;
-	int      chd_hunknum;
-	uint8_t	 *chd_hunkbuf;
 	uint32_t  chd_total_size;
-	uint32_t  chd_last_partial_lba;
+
+	track_t  *rd_track; // current ATAPI read
+	uint32_t  rd_lba;
 
 	uint16_t id[256];
 };
@@ -123,6 +126,12 @@ struct ide_config
 	uint32_t prepcnt;
 	regs_t   regs;
 
+	// HDD transfer in progress, resumed block by block (IDE_STATE_WAIT_RD/WR)
+	uint8_t  multi;
+	uint32_t io_cnt;
+	uint8_t *rd_buf;  // block to send next
+	uint8_t *rd_next; // read ahead while rd_buf is on the wire
+
 	drive_t drive[2];
 };
 
@@ -157,4 +166,9 @@ int ide_open(uint8_t unit, const char* filename);
 
 void ide_io(int num, int req);
 
+// write back delayed HDD writes (see hdd_write_delay): everything, or only
+// what has waited long enough, for cores that don't poll ide_io when idle.
+void ide_flush();
+void ide_flush_poll();
+
 #endif
@@ -5,13 +5,9 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <time.h>
-#include <ios>
-#include <fstream>
-#include <iostream>
-#include <string>
-#include <sstream>
 #include <sys/stat.h>
 #include <cmath>
+#include <atomic>
 #include <libchdr/chd.h>
 #include <byteswap.h>
 #include "spi.h"
@@ -20,6 +16,9 @@
 #include "hardware.h"
 #include "cd.h"
 #include "ide.h"
+#include "offload.h"
+#include "counters.h"
+#include "cfg.h"
 
 #if 0
 #define dbg_printf     printf
@@ -150,23 +149,6 @@ static const char * load_iso_file(drive_t *drv, const char* filename)
 	return drv->track[0].filename;
 }
 
-static int get_word(std::string &keyword, std::istream &in)
-{
-	in >> keyword;
-	for (uint32_t i = 0; i < keyword.size(); i++) keyword[i] = (char)toupper(keyword[i]);
-	return keyword.size();
-}
-
-static int get_timecode(uint32_t &frames, std::istream &in)
-{
-	std::string msf;
-	in >> msf;
-	TMSF tmp = { 0, 0, 0 };
-	int success = sscanf(msf.c_str(), "%hhu:%hhu:%hhu", &tmp.min, &tmp.sec, &tmp.fr) == 3;
-	frames = (int)MSF_TO_FRAMES(tmp.min, tmp.sec, tmp.fr);
-	return success;
-}
-
 static track_t *get_track_from_lba(drive_t *drive, uint32_t lba, bool &index0)
 {
 	track_t *ret = NULL;
@@ -216,7 +198,7 @@ static int add_track(drive_t *drv, track_t *curr, uint32_t &shift, const int32_t
 		totalPregap = currPregap;
 
 		memcpy(&drv->track[drv->track_cnt], curr, sizeof(track_t));
-		FileOpenEx(&drv->track[drv->track_cnt].f, curr->filename, O_RDONLY);
+		cd_open_track(&drv->track[drv->track_cnt].f, curr->filename);
 		drv->track_cnt++;
 		return 1;
 	}
@@ -240,7 +222,8 @@ static int add_track(drive_t *drv, track_t *curr, uint32_t &shift, const int32_t
 	}
 	else
 	{
-		uint32_t size = FileLoad(prev->filename, 0, 0);
+		// decoded size for compressed audio
+		uint32_t size = prev->f.opened() ? prev->f.size : FileLoad(prev->filename, 0, 0);
 		const uint32_t tmp = size - prev->skip;
 		prev->length = tmp / prev->sectorSize;
 
@@ -266,7 +249,7 @@ static int add_track(drive_t *drv, track_t *curr, uint32_t &shift, const int32_t
 	}
 
 	memcpy(&drv->track[drv->track_cnt], curr, sizeof(track_t));
-	FileOpenEx(&drv->track[drv->track_cnt].f, drv->track[drv->track_cnt].filename, O_RDONLY);
+	cd_open_track(&drv->track[drv->track_cnt].f, drv->track[drv->track_cnt].filename);
 	drv->track_cnt++;
 	return 1;
 }
@@ -296,13 +279,6 @@ static const char* load_chd_file(drive_t *drv, const char *chdfile)
 		return 0;
 	}
 
-	if (drv->chd_hunkbuf)
-	{
-		free(drv->chd_hunkbuf);
-	}
-
-	drv->chd_hunkbuf = (uint8_t *)malloc(CD_FRAME_SIZE * CD_FRAMES_PER_HUNK);
-	drv->chd_hunknum = -1;
 	drv->chd_f = tmpTOC.chd_f;
 
 	//don't use add_track, just do it ourselves...
@@ -363,35 +339,19 @@ static const char* load_cue_file(drive_t *drv, const char *cuefile)
 	uint32_t currPregap = 0;
 	uint32_t totalPregap = 0;
 	int32_t prestart = -1;
-	int track_number;
 	int success;
 	int canAddTrack = 0;
 
-	std::string pathname(cuefile);
-	std::size_t found = pathname.find_last_of('/');
-	if (found == std::string::npos) return 0; // no folder name?
-	pathname.resize(found + 1);
+	if (!strrchr(cuefile, '/')) return 0; // no folder name?
 
-	std::ifstream in;
-	in.open(cuefile, std::ios::in);
-	if (in.fail()) return 0;
+	static cue_sheet_t cue;
+	if (!cd_cue_parse(cuefile, &cue)) return 0;
 
-	while (!in.eof())
+	for (int n = 0; n < cue.cmds; n++)
 	{
-		// get next line
-		std::string buf;
-		std::getline(in, buf);
-
-		if (in.fail() && !in.eof()) return 0;  // probably a binary file
-
-		std::istringstream line(buf);
+		const cue_cmd_t *c = &cue.cmd[n];
 
-		std::string command;
-		get_word(command, line);
-
-		//printf("command: %s\n", command.c_str());
-
-		if (command == "TRACK")
+		if (c->cmd == CUE_TRACK)
 		{
 			if (canAddTrack) success = add_track(drv, &track, shift, prestart, totalPregap, currPregap);
 			else success = 1;
@@ -401,87 +361,73 @@ static const char* load_cue_file(drive_t *drv, const char *cuefile)
 			currPregap = 0;
 			prestart = -1;
 
-			line >> track_number; // (cin) read into a true int first
-
-			track.number = static_cast<uint8_t>(track_number);
+			track.number = static_cast<uint8_t>(c->num);
 
-			std::string type;
-			get_word(type, line);
-
-			//printf("  type: %s\n", type.c_str());
-
-			if (type == "AUDIO")
+			switch (c->type)
 			{
+			case CUE_AUDIO:
 				track.sectorSize = BYTES_PER_RAW_REDBOOK_FRAME;
 				track.attr = 0;
 				track.mode2 = false;
-			}
-			else if (type == "MODE1/2048")
-			{
+				break;
+
+			case CUE_MODE1_2048:
 				track.sectorSize = BYTES_PER_COOKED_REDBOOK_FRAME;
 				track.attr = 0x40;
 				track.mode2 = false;
-			}
-			else if (type == "MODE1/2352")
-			{
+				break;
+
+			case CUE_MODE1_2352:
 				track.sectorSize = BYTES_PER_RAW_REDBOOK_FRAME;
 				track.attr = 0x40;
 				track.mode2 = false;
-			}
-			else if (type == "MODE2/2336")
-			{
+				break;
+
+			case CUE_MODE2_2336:
 				track.sectorSize = 2336;
 				track.attr = 0x40;
 				track.mode2 = true;
-			}
-			else if (type == "MODE2/2352")
-			{
+				break;
+
+			case CUE_MODE2_2352:
 				track.sectorSize = BYTES_PER_RAW_REDBOOK_FRAME;
 				track.attr = 0x40;
 				track.mode2 = true;
+				break;
+
+			default:
+				success = 0;
+				break;
 			}
-			else success = 0;
 
 			canAddTrack = 1;
 		}
-		else if (command == "INDEX")
+		else if (c->cmd == CUE_INDEX)
 		{
-			int index;
-			line >> index;
-			uint32_t frame;
-			success = get_timecode(frame, line);
+			success = c->frames >= 0;
 
-			if (index == 1) track.start = frame;
-			else if (index == 0) prestart = static_cast<int32_t>(frame);
+			if (c->num == 1) track.start = c->frames;
+			else if (c->num == 0) prestart = c->frames;
 			// ignore other indices
 		}
-		else if (command == "FILE")
+		else if (c->cmd == CUE_FILE)
 		{
 			if (canAddTrack) success = add_track(drv, &track, shift, prestart, totalPregap, currPregap);
 			else success = 1;
 			canAddTrack = 0;
 
-			std::string filename;
-			std::getline(std::getline(line, filename, '"'), filename, '"');
-
-			strcpy(track.filename, pathname.c_str());
-			strcat(track.filename, filename.c_str());
-
+			cd_cue_file(&cue, c, track.filename, sizeof(track.filename));
 			printf("cue: got new file name: %s\n", track.filename);
 		}
-		else if (command == "PREGAP") success = get_timecode(currPregap, line);
-		// ignored commands
-		else if (command == "CATALOG" || command == "CDTEXTFILE" || command == "FLAGS" || command == "ISRC" ||
-			command == "PERFORMER" || command == "POSTGAP" || command == "REM" ||
-			command == "SONGWRITER" || command == "TITLE" || command.empty())
+		else if (c->cmd == CUE_PREGAP)
 		{
-			success = 1;
+			success = c->frames >= 0;
+			currPregap = c->frames;
 		}
+		// ignored commands
+		else if (c->cmd == CUE_OTHER) success = 1;
 		// failure
-		else
-		{
-			success = 0;
-		}
+		else success = 0;
 
 		if (!success)
 		{
@@ -990,30 +936,218 @@ static void pkt_send(ide_config *ide, void *data, uint16_t size)
 	ide->state = IDE_STATE_WAIT_PKT_RD;
 }
 
-static void read_cd_sectors(ide_config *ide, track_t *track, int cnt)
+#define CD_PF_SECTORS 8 // ide_io_max_size / 4
+
+// Read cnt data sectors starting at lba into buf, 2048 bytes each.
+// Only called from one thread at a time, see cd_pf.
+static int read_cd_sectors(drive_t *drv, track_t *track, uint32_t lba, uint32_t cnt, uint8_t *buf)
 {
-	drive_t *drv = &ide->drive[ide->regs.drv];
-	uint32_t sz = drv->track[drv->data_num].sectorSize;
+	static uint8_t raw[CD_PF_SECTORS * BYTES_PER_RAW_REDBOOK_FRAME];
+	int ok = 1;
 
-	if (sz == 2048)
+	if (drv->chd_f)
 	{
-		if (!ide->null) ide->null = (FileReadAdv(&track->f, ide_buf, cnt * sz, -1) <= 0);
-		if (ide->null) memset(ide_buf, 0, cnt * sz);
-		return;
+		uint32_t hdr = drv->track[drv->data_num].mode2 ? 24 : 16;
+		if (drv->track[drv->data_num].sectorSize == 2048) hdr = 0;
+
+		// consecutive sectors of one hunk are decoded only once
+		for (uint32_t i = 0; i < cnt; i++)
+		{
+			if (mister_chd_read_sector(drv->chd_f, lba + i + drv->track[drv->data_num].chd_offset, i * 2048, hdr, 2048, buf) != CHDERR_NONE)
+			{
+				memset(buf + i * 2048, 0, 2048);
+				ok = 0;
+			}
+		}
+		return ok;
+	}
+
+	if (!track || lba < track->start) ok = 0;
+	else
+	{
+		uint32_t sz = track->sectorSize;
+		__off64_t pos = track->skip + (__off64_t)(lba - track->start) * sz;
+
+		if (sz == 2048)
+		{
+			int ret = FileReadAt(&track->f, pos, buf, cnt * 2048, -1);
+			ok = (ret > 0);
+			if (ok && ret < (int)(cnt * 2048)) memset(buf + ret, 0, cnt * 2048 - ret);
+		}
+		else
+		{
+			// one read for the whole run, then pick the user data out of the raw sectors
+			uint32_t pre = track->mode2 ? 24 : 16;
+			ok = (cnt <= CD_PF_SECTORS && sz <= BYTES_PER_RAW_REDBOOK_FRAME && sz >= pre + 2048);
+			if (ok) ok = (FileReadAt(&track->f, pos, raw, cnt * sz, -1) == (int)(cnt * sz));
+			if (ok) for (uint32_t i = 0; i < cnt; i++) memcpy(buf + i * 2048, raw + i * sz + pre, 2048);
+		}
+	}
+
+	if (!ok) memset(buf, 0, cnt * 2048);
+	return ok;
+}
+
+// Read-ahead of the next run of sectors (of the current command, or of the
+// next sequential one) on the offload worker while the host is busy with the
+// previous one. There is only one run in flight, the track file it reads
+// must not be used until cd_pf_drop().
+static struct
+{
+	drive_t *drv;
+	track_t *track;
+	uint32_t lba;
+	uint32_t cnt;
+	int ok;
+	offload_handle_t job;
+	alignas(FILE_DIRECT_ALIGN) uint8_t buf[CD_PF_SECTORS * 2048];
+} cd_pf;
+
+static void cd_pf_drop(drive_t *drv)
+{
+	if (!cd_pf.drv || (drv && cd_pf.drv != drv)) return;
+
+	offload_wait(cd_pf.job);
+	cd_pf.job = 0;
+	cd_pf.drv = 0;
+}
+
+static void cd_pf_start(drive_t *drv, uint32_t lba, uint32_t cnt)
+{
+	cd_pf_drop(0);
+
+	track_t *track = drv->rd_track;
+	if (!cnt || cnt > CD_PF_SECTORS) return;
+
+	// zipped images seek the shared file handle, only real files and CHD are safe off the main thread
+	if (!drv->chd_f && (!track || !track->f.filp)) return;
+
+	cd_pf.drv = drv;
+	cd_pf.track = track;
+	cd_pf.lba = lba;
+	cd_pf.cnt = cnt;
+	cd_pf.job = offload_try_add_work([drv, track, lba, cnt]
+	{
+		cd_pf.ok = read_cd_sectors(drv, track, lba, cnt, cd_pf.buf);
+	});
+
+	if (!cd_pf.job) cd_pf.drv = 0;
+}
+
+// Read one raw audio sector, byte order as the FPGA expects it.
+static void cdda_read_sector(drive_t *drv, uint32_t lba, uint8_t *buf)
+{
+	bool is_index0 = false;
+	track_t *track = get_track_from_lba(drv, lba, is_index0);
+
+	if (track && !track->attr)
+	{
+		if (drv->chd_f)
+		{
+			if (cd_chd_read_audio(drv->chd_f, lba + drv->track[drv->data_num].chd_offset, 1, buf) != CHDERR_NONE)
+			{
+				memset(buf, 0, BYTES_PER_RAW_REDBOOK_FRAME);
+			}
+		}
+		else
+		{
+			//If we're in the index0 area "audio pregap", that data is actually in the
+			//previous track. Use that file object, seek and return the data from there.
+			//If the seek fails just return zero data.
+			//It may be a 'PREGAP' which indicates no stored data
+
+			track_t *read_track = track;
+			if (is_index0 && track->number > 1)
+			{
+				//track number is 1-based, track array is zero. 
+				read_track = &drv->track[track->number-2];
+
+			}
+			uint32_t pos = read_track->skip + (lba - read_track->start) * read_track->sectorSize;
+			if (FileReadAt(&read_track->f, pos, buf, BYTES_PER_RAW_REDBOOK_FRAME, -1) < 0)
+			{
+				memset(buf, 0, BYTES_PER_RAW_REDBOOK_FRAME);
+			}
+		}
 	}
+	else
+	{
+		memset(buf, 0, BYTES_PER_RAW_REDBOOK_FRAME);
+	}
+}
 
-	uint32_t pre = drv->track[drv->data_num].mode2 ? 24 : 16;
-	uint32_t post = sz - pre - 2048;
-	uint32_t off = 0;
+// CD audio ring, cdda_buffer seconds deep. Sectors [lba, ready) are in RAM,
+// the offload worker fills [ready, fill) and the poll loop only copies out.
+// Slot of a sector is its lba modulo the ring size.
+#define CDDA_CHUNK 16
 
-	while (cnt--)
+static struct
+{
+	drive_t *drv;
+	uint8_t *buf;
+	uint32_t size;
+	uint32_t lba;
+	uint32_t end;
+	uint32_t fill;
+	std::atomic<uint32_t> ready;
+	offload_handle_t job;
+} cdda;
+
+static void cdda_drop(drive_t *drv)
+{
+	if (!cdda.drv || (drv && cdda.drv != drv)) return;
+
+	offload_wait(cdda.job);
+	cdda.job = 0;
+	cdda.drv = 0;
+}
+
+// returns 1 if the ring was restarted
+static int cdda_fill(drive_t *drv)
+{
+	uint32_t size = cfg.cdda_buffer * REDBOOK_FRAMES_PER_SECOND;
+	int restart = 0;
+
+	if (cdda.drv != drv || cdda.lba != drv->play_start_lba || cdda.end != drv->play_end_lba || cdda.size != size)
 	{
-		if (!ide->null) ide->null = !FileSeek(&track->f, pre, SEEK_CUR);
-		if (!ide->null) ide->null = (FileReadAdv(&track->f, ide_buf + off, 2048, -1) <= 0);
-		if (ide->null) memset(ide_buf + off, 0, 2048);
-		if (!ide->null) ide->null = !FileSeek(&track->f, post, SEEK_CUR);
-		off += 2048;
+		// new play command or seek, start over
+		cdda_drop(0);
+		if (cdda.size != size)
+		{
+			free(cdda.buf);
+			cdda.buf = (uint8_t *)malloc(size * BYTES_PER_RAW_REDBOOK_FRAME);
+			cdda.size = cdda.buf ? size : 0;
+		}
+
+		if (!cdda.size) return 0;
+
+		cdda.drv = drv;
+		cdda.lba = drv->play_start_lba;
+		cdda.end = drv->play_end_lba;
+		cdda.fill = cdda.lba;
+		cdda.ready = cdda.lba;
+		restart = 1;
 	}
+
+	if (!offload_is_done(cdda.job)) return restart;
+
+	uint32_t cnt = cdda.size - (cdda.fill - cdda.lba);
+	if (cnt > CDDA_CHUNK) cnt = CDDA_CHUNK;
+	if (cnt > cdda.end - cdda.fill) cnt = cdda.end - cdda.fill;
+	if (!cnt) return restart;
+
+	uint32_t lba = cdda.fill;
+	cdda.job = offload_try_add_work([drv, lba, cnt]
+	{
+		for (uint32_t i = 0; i < cnt; i++)
+		{
+			cdda_read_sector(drv, lba + i, cdda.buf + ((lba + i) % cdda.size) * BYTES_PER_RAW_REDBOOK_FRAME);
+			cdda.ready.store(lba + i + 1);
+		}
+	});
+
+	if (cdda.job) cdda.fill += cnt;
+	return restart;
 }
 
 void cdrom_read(ide_config *ide)
@@ -1036,58 +1170,39 @@ void cdrom_read(ide_config *ide)
 		dbg_printf("** partial CD read\n");
 	}
 
-
-	track_t *track = get_track_from_lba(drive, ide->regs.pkt_lba, is_index0);
-
-	if (ide->state == IDE_STATE_INIT_RW && !drive->chd_f && track)
+	// the track is resolved once per command, the following runs continue from rd_lba
+	if (ide->state == IDE_STATE_INIT_RW)
 	{
-		uint32_t pos = track->skip + (ide->regs.pkt_lba - track->start) * track->sectorSize;
-		ide->null = (FileSeek(&track->f, pos, SEEK_SET) < 0);
+		drive->rd_track = get_track_from_lba(drive, ide->regs.pkt_lba, is_index0);
+		drive->rd_lba = ide->regs.pkt_lba;
 	}
 
+	cd_trace(CD_TRACE_IDE, drive->rd_lba, cnt);
 
-	if (drive->chd_f) {
-
-		uint32_t hdr = drive->track[drive->data_num].mode2 ? 24 : 16;
-		if (drive->track[drive->data_num].sectorSize == 2048)
-		{
-			hdr = 0;
-		}
-		uint32_t d_offset = 0;
-
-		if (ide->state == IDE_STATE_INIT_RW)
-		{
-			drive->chd_last_partial_lba = ide->regs.pkt_lba;
-		}
-
-		for (uint32_t i = 0; i < cnt; i++)
-		{
-
-			if (mister_chd_read_sector(drive->chd_f, drive->chd_last_partial_lba + drive->track[drive->data_num].chd_offset, d_offset, hdr, 2048, ide_buf, drive->chd_hunkbuf, &drive->chd_hunknum) != CHDERR_NONE)
-			{
-				//I don't think anything else uses this, but set it just in case.
-				ide->null = 1;
-				memset(ide_buf + d_offset, 0, 2048);
-			}
-			else
-			{
-				ide->null = 0;
-			}
-			d_offset += 2048;
-			drive->chd_last_partial_lba++;
-		}
-
+	uint8_t *buf = ide_buf;
+	if (cd_pf.drv == drive && cd_pf.track == drive->rd_track && cd_pf.lba == drive->rd_lba && cd_pf.cnt == cnt)
+	{
+		offload_wait(cd_pf.job);
+		ide->null = !cd_pf.ok;
+		buf = cd_pf.buf;
 	}
 	else
 	{
-		read_cd_sectors(ide, track, cnt);
+		cd_pf_drop(0);
+		if (cdda.drv == drive) offload_wait(cdda.job);
+		ide->null = !read_cd_sectors(drive, drive->rd_track, drive->rd_lba, cnt, ide_buf);
 	}
 
 	dbg_printf("\nsector:\n");
-	dbg_hexdump(ide_buf, 512, 0);
+	dbg_hexdump(buf, 512, 0);
 
+	drive->rd_lba += cnt;
 	ide->regs.pkt_cnt -= cnt;
-	pkt_send(ide, ide_buf, cnt * 2048);
+	pkt_send(ide, buf, cnt * 2048);
+
+	// pkt_send has copied the data out, the buffer can take the next run
+	cd_pf.drv = 0;
+	cd_pf_start(drive, drive->rd_lba, ide->regs.pkt_cnt ? ((cnt < ide->regs.pkt_cnt) ? cnt : ide->regs.pkt_cnt) : cnt);
 }
 
 static int cd_inquiry(uint8_t maxlen)
@@ -1508,19 +1623,15 @@ void cdrom_reply(ide_config *ide, uint8_t error, uint8_t asc_code, uint8_t ascq_
 
 void cdrom_close_chd(drive_t *drv)
 {
+	cd_pf_drop(drv);
+	cdda_drop(drv);
+	drv->rd_track = 0;
 
 	if (drv->chd_f)
 	{
-		chd_close(drv->chd_f);
+		mister_chd_close(drv->chd_f);
 		drv->chd_f = NULL;
 	}
-
-	if (drv->chd_hunkbuf)
-	{
-		free(drv->chd_hunkbuf);
-		drv->chd_hunkbuf = NULL;
-	}
-	drv->chd_hunknum = -1;
 }
 
 const char* cdrom_parse(uint32_t num, const char *filename)
@@ -1556,7 +1667,6 @@ const char* cdrom_parse(uint32_t num, const char *filename)
 
 void ide_cdda_send_sector()
 {
-	bool is_index0 = false;
 	static uint8_t cdda_buf[BYTES_PER_RAW_REDBOOK_FRAME];
 	drive_t *drv = NULL;
 	ide_config *ide = NULL;
@@ -1577,57 +1687,45 @@ void ide_cdda_send_sector()
 
 	if (!drv || !ide) return;
 
-	bool needs_swap = false;
-	track_t *track = get_track_from_lba(drv, drv->play_start_lba, is_index0);
+	int restart = cdda_fill(drv);
 
-	if (!track->attr)
+	uint8_t *src = cdda_buf;
+	if (cdda.drv == drv)
 	{
-		if (drv->chd_f)
+		if ((int32_t)(cdda.ready.load() - cdda.lba) <= 0)
 		{
-			mister_chd_read_sector(drv->chd_f, drv->play_start_lba + drv->track[drv->data_num].chd_offset, 0, 0, BYTES_PER_RAW_REDBOOK_FRAME, cdda_buf, drv->chd_hunkbuf, &drv->chd_hunknum);
-			needs_swap = true;
+			if (!restart) counter_add(CNT_CDDA_UNDERRUN);
+			offload_wait(cdda.job);
 		}
-		else
-		{
-			//If we're in the index0 area "audio pregap", that data is actually in the
-			//previous track. Use that file object, seek and return the data from there.
-			//If the seek fails just return zero data.
-			//It may be a 'PREGAP' which indicates no stored data
 
-			track_t *read_track = track;
-			if (is_index0 && track->number > 1)
-			{
-				//track number is 1-based, track array is zero. 
-				read_track = &drv->track[track->number-2];
-
-			}
-			uint32_t pos = read_track->skip + (drv->play_start_lba - read_track->start) * read_track->sectorSize;
-			if (FileSeek(&read_track->f, pos, SEEK_SET))
-			{
-				FileReadAdv(&read_track->f, cdda_buf, sizeof(cdda_buf), -1);
-			} else {
-				memset(cdda_buf, 0, sizeof(cdda_buf));
-			}
-		}
+		if ((int32_t)(cdda.ready.load() - cdda.lba) > 0) src = cdda.buf + (cdda.lba % cdda.size) * BYTES_PER_RAW_REDBOOK_FRAME;
 	}
-	else
+
+	if (src == cdda_buf)
 	{
-		memset(cdda_buf, 0, sizeof(cdda_buf));
+		// not buffered (disabled or offload queue full), the data read-ahead may be using the same file
+		cd_pf_drop(drv);
+		cdda_read_sector(drv, drv->play_start_lba, cdda_buf);
 	}
 
+	int16_t *src16 = (int16_t *)src;
 	int16_t *cdda_buf16 = (int16_t *)cdda_buf;
 	const int buf_wsize = sizeof(cdda_buf) / 2;
 
 	for (int sidx = 0; sidx < buf_wsize; sidx++)
 	{
-		if (needs_swap) cdda_buf16[sidx] = bswap_16(cdda_buf16[sidx]);
-		double tmps = (double)cdda_buf16[sidx];
+		double tmps = (double)src16[sidx];
 		cdda_buf16[sidx] = (int16_t)(tmps*((sidx & 1) ? drv->volume_l : drv->volume_r));
 	}
 
 	ide_sendbuf(ide, 0x200, buf_wsize, (uint16_t *)cdda_buf);
 
 	drv->play_start_lba++;
+	if (cdda.drv == drv && cdda.lba + 1 == drv->play_start_lba)
+	{
+		// after an unbuffered sector nothing is in flight, catch the ring up
+		if (++cdda.lba > cdda.fill) cdda.fill = cdda.ready = cdda.lba;
+	}
 	if (drv->play_start_lba >= drv->play_end_lba)
 	{
 		drv->playing = 0;
@@ -6,6 +6,8 @@
 #include <string.h>
 #include <sys/inotify.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/sysinfo.h>
 #include <dirent.h>
 #include <errno.h>
@@ -17,6 +19,13 @@
 #include <sys/types.h>
 #include <stdarg.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
 
 #include "input.h"
 #include "user_io.h"
@@ -30,10 +39,23 @@
 #include "joymapping.h"
 #include "support.h"
 #include "profiling.h"
+#include "counters.h"
 #include "gamecontroller_db.h"
 #include "str_util.h"
+#include "scheduler.h"
+#include "storage_bench.h"
+#include "cd.h"
+#include "capture.h"
+#include "btlink.h"
+#include "log.h"
+#include "shcache.h"
 
 #define NUMDEV 30
+#define DISP_KEY_FIRST 0x100
+#define DISP_KEYS (KEY_EMU + ABS_CNT * 2 - DISP_KEY_FIRST)
+#define RUMBLE_POLL_MS 16
+#define INPUT_THREAD_PRIO 40
+#define INPUT_THREAD_TICK_MS 1
 #define NUMPLAYERS 6
 #define UINPUT_NAME "MiSTer virtual input"
 
@@ -41,6 +63,9 @@ char joy_bnames[NUMBUTTONS][32] = {};
 int  joy_bcount = 0;
 static struct pollfd pool[NUMDEV + 3];
 
+// pool entries by index in an epoll set, rebuilt with the device list
+static int input_epfd = -1;
+
 static int ev2amiga[] =
 {
 	NONE, //0   KEY_RESERVED
@@ -1158,10 +1183,12 @@ typedef struct
 	uint8_t  kbdmap[256];
 
 	int32_t  guncal[4];
+	struct input_absinfo gunabs[2]; // X and Y ranges of guncal
 
 	int      accx, accy;
 	int      startx, starty;
 	int      lastx, lasty;
+	int      touchx, touchy; // motion of the current report
 	int      quirk;
 
 	int      misc_flags;
@@ -1191,8 +1218,11 @@ typedef struct
 
 	int      timeout;
 	char     mac[64];
+	uint8_t  bt;       // connected over Bluetooth (mac is its address)
 
 	int      bind;
+	uint32_t open_seq; // order of opening, the oldest device of a group is its master
+	uint8_t  fresh;    // opened since the last mergedevs()
 	uint32_t unique_hash;
 	char     devname[32];
 	char     id[80];
@@ -1204,9 +1234,25 @@ typedef struct
 	float    max_range[2];
 
 	uint32_t deadzone;
+
+	// compiled by dispatch_build(), valid while disp_gen matches
+	uint32_t disp_gen;
+	uint8_t  disp_on;
+	uint8_t  disp_slow[DISP_KEYS];
+	uint32_t disp_btn[DISP_KEYS];
+	uint8_t  disp_abs[ABS_CNT];
 } devInput;
 
 static devInput input[NUMDEV] = {};
+static uint32_t open_seq = 0;
+
+// bumped whenever maps or the mapping mode change
+static uint32_t disp_gen = 1;
+
+static void dispatch_reset()
+{
+	disp_gen++;
+}
 static devInput player_pad[NUMPLAYERS] = {};
 static devInput player_pdsp[NUMPLAYERS] = {};
 
@@ -1245,6 +1291,9 @@ static int set_watch()
 #define EVENT_SIZE  ( sizeof (struct inotify_event) )
 #define BUF_LEN     ( 1024 * ( EVENT_SIZE + 16 ) )
 
+static int input_hotplug(const char *name, int add);
+
+// 1 if devices were hotplugged, 2 if the whole set has to be reopened
 static int check_devs()
 {
 	int result = 0;
@@ -1261,11 +1310,16 @@ static int check_devs()
 	while (i<length)
 	{
 		struct inotify_event *event = (struct inotify_event *) &buffer[i];
+		if (event->mask & IN_Q_OVERFLOW)
+		{
+			printf("Input device events are lost.\n");
+			return 2;
+		}
+
 		if (event->len)
 		{
 			if (event->mask & IN_CREATE)
 			{
-				result = 1;
 				if (event->mask & IN_ISDIR)
 				{
 					printf("The directory %s was created.\n", event->name);
@@ -1273,11 +1327,11 @@ static int check_devs()
 				else
 				{
 					printf("The file %s was created.\n", event->name);
+					result |= input_hotplug(event->name, 1);
 				}
 			}
 			else if (event->mask & IN_DELETE)
 			{
-				result = 1;
 				if (event->mask & IN_ISDIR)
 				{
 					printf("The directory %s was deleted.\n", event->name);
@@ -1285,6 +1339,7 @@ static int check_devs()
 				else
 				{
 					printf("The file %s was deleted.\n", event->name);
+					result |= input_hotplug(event->name, 0);
 				}
 			}
 			/*
@@ -1363,12 +1418,101 @@ void sysled_enable(int en)
 }
 
 #define JOYMAP_DIR  "inputs/"
-static int load_map(const char *name, void *pBuffer, int size)
+
+// Map files as loaded, by name, empty for the ones that don't exist (most
+// per core names). A plugged device and every app_restart ask for several
+// of them. The cache is kept in shcache for the next process, valid while
+// the mtimes of the config folders are the ones it was built with.
+#define MAPCACHE_KEY "input_maps"
+
+static std::unordered_map<std::string, std::string> map_cache;
+static uint32_t map_cache_stamp[2];
+static int map_cache_ready = 0;
+
+static uint32_t map_dir_mtime(const char *dir)
 {
-	char path[256] = { JOYMAP_DIR };
-	strcat(path, name);
-	int ret = FileLoadConfig(path, pBuffer, size);
-	if (!ret) return FileLoadConfig(name, pBuffer, size);
+	struct stat64 st;
+	return stat64(getFullPath(dir), &st) ? 0 : (uint32_t)st.st_mtime;
+}
+
+static void map_cache_init()
+{
+	map_cache_ready = 1;
+	map_cache_stamp[0] = map_dir_mtime(CONFIG_DIR);
+	map_cache_stamp[1] = map_dir_mtime(CONFIG_DIR "/" JOYMAP_DIR);
+
+	size_t len = 0;
+	uint8_t *rec = (uint8_t*)shcache_load(MAPCACHE_KEY, &len);
+	if (!rec) return;
+
+	uint32_t hdr[3];
+	const uint8_t *p = rec, *end = rec + len;
+	if (len >= sizeof(hdr))
+	{
+		memcpy(hdr, p, sizeof(hdr));
+		p += sizeof(hdr);
+	}
+
+	if (len >= sizeof(hdr) && hdr[0] == map_cache_stamp[0] && hdr[1] == map_cache_stamp[1])
+	{
+		for (uint32_t i = 0; i < hdr[2]; i++)
+		{
+			uint32_t n[2];
+			if (end - p < (int)sizeof(n)) break;
+			memcpy(n, p, sizeof(n));
+			p += sizeof(n);
+			if ((uint32_t)(end - p) < n[0] + n[1]) break;
+			map_cache[std::string((const char*)p, n[0])].assign((const char*)p + n[0], n[1]);
+			p += n[0] + n[1];
+		}
+	}
+	free(rec);
+}
+
+static void map_cache_save()
+{
+	std::string rec;
+	uint32_t hdr[3] = { map_cache_stamp[0], map_cache_stamp[1], (uint32_t)map_cache.size() };
+	rec.append((const char*)hdr, sizeof(hdr));
+	for (auto &it : map_cache)
+	{
+		uint32_t n[2] = { (uint32_t)it.first.size(), (uint32_t)it.second.size() };
+		rec.append((const char*)n, sizeof(n));
+		rec += it.first;
+		rec += it.second;
+	}
+	shcache_store(MAPCACHE_KEY, rec.data(), rec.size());
+}
+
+static void map_cache_put(const char *name, const void *data, int size)
+{
+	map_cache[name].assign((const char*)data, (size > 0) ? size : 0);
+	map_cache_save();
+}
+
+// joymap: from inputs/ or, like older versions saved it, the config folder
+static int load_map(const char *name, void *pBuffer, int size, int joymap = 1)
+{
+	if (!map_cache_ready) map_cache_init();
+
+	auto it = map_cache.find(name);
+	if (it != map_cache.end())
+	{
+		int len = std::min((int)it->second.size(), size);
+		memcpy(pBuffer, it->second.data(), len);
+		return len;
+	}
+
+	int ret = 0;
+	if (joymap)
+	{
+		char path[256] = { JOYMAP_DIR };
+		strcat(path, name);
+		ret = FileLoadConfig(path, pBuffer, size);
+	}
+	if (!ret) ret = FileLoadConfig(name, pBuffer, size);
+
+	map_cache_put(name, pBuffer, ret);
 	return ret;
 }
 
@@ -1378,6 +1522,7 @@ static void delete_map(const char *name)
 	strcat(path, name);
 	FileDeleteConfig(name);
 	FileDeleteConfig(path);
+	map_cache_put(name, 0, 0);
 }
 
 static int save_map(const char *name, void *pBuffer, int size)
@@ -1385,6 +1530,7 @@ static int save_map(const char *name, void *pBuffer, int size)
 	char path[256] = { JOYMAP_DIR };
 	strcat(path, name);
 	FileDeleteConfig(name);
+	map_cache_put(name, pBuffer, size);
 	return FileSaveConfig(path, pBuffer, size);
 }
 
@@ -1413,6 +1559,7 @@ void start_map_setting(int cnt, int set)
 	mapping_button = 0;
 	mapping = 1;
 	mapping_set = set;
+	dispatch_reset();
 	if (!mapping_set)
 	{
 		mapping_dev = -1;
@@ -1510,13 +1657,22 @@ static char *get_kbdmap_name(int dev)
 void finish_map_setting(int dismiss)
 {
 	mapping = 0;
+	dispatch_reset();
 	if (mapping_dev<0) return;
 
 	if (mapping_type == 2)
 	{
 		input[mapping_dev].has_kbdmap = 0;
-		if (dismiss) FileDeleteConfig(get_kbdmap_name(mapping_dev));
-		else FileSaveConfig(get_kbdmap_name(mapping_dev), &input[mapping_dev].kbdmap, sizeof(input[mapping_dev].kbdmap));
+		if (dismiss)
+		{
+			FileDeleteConfig(get_kbdmap_name(mapping_dev));
+			map_cache_put(get_kbdmap_name(mapping_dev), 0, 0);
+		}
+		else
+		{
+			map_cache_put(get_kbdmap_name(mapping_dev), &input[mapping_dev].kbdmap, sizeof(input[mapping_dev].kbdmap));
+			FileSaveConfig(get_kbdmap_name(mapping_dev), &input[mapping_dev].kbdmap, sizeof(input[mapping_dev].kbdmap));
+		}
 	}
 	else if (mapping_type == 3)
 	{
@@ -1536,12 +1692,22 @@ void finish_map_setting(int dismiss)
 	}
 }
 
+static void input_lightgun_ranges(int idx)
+{
+	memset(input[idx].gunabs, 0, sizeof(input[idx].gunabs));
+	input[idx].gunabs[0].minimum = input[idx].guncal[2];
+	input[idx].gunabs[0].maximum = input[idx].guncal[3];
+	input[idx].gunabs[1].minimum = input[idx].guncal[0];
+	input[idx].gunabs[1].maximum = input[idx].guncal[1];
+}
+
 void input_lightgun_save(int idx, int32_t *cal)
 {
 	static char name[128];
 	sprintf(name, "%s_gun_cal_%04x_%04x_v2.cfg", user_io_get_core_name(), input[idx].vid, input[idx].pid);
 	FileSaveConfig(name, cal, 4 * sizeof(int32_t));
 	memcpy(input[idx].guncal, cal, sizeof(input[idx].guncal));
+	input_lightgun_ranges(idx);
 }
 
 static void input_lightgun_load(int idx)
@@ -1549,6 +1715,7 @@ static void input_lightgun_load(int idx)
 	static char name[128];
 	sprintf(name, "%s_gun_cal_%04x_%04x_v2.cfg", user_io_get_core_name(), input[idx].vid, input[idx].pid);
 	FileLoadConfig(name, input[idx].guncal, 4 * sizeof(int32_t));
+	input_lightgun_ranges(idx);
 }
 
 int input_has_lightgun()
@@ -1650,6 +1817,397 @@ static int af_delay[NUMPLAYERS] = {};
 
 static uint32_t crtgun_timeout[NUMDEV] = {};
 
+// Periodic input work (autofire, mouse emulation, key repeat, mouse reports)
+// runs from deadlines on the monotonic clock. The earliest one is programmed
+// into a timerfd of the device epoll set, so the loop wakes up right on time
+// instead of spinning every ms to check its timers.
+#define INPUT_TIMER_ID (NUMDEV + 3)
+
+static int input_tfd = -1;
+static uint64_t input_timer_due = 0;
+static uint64_t input_timer_armed = 0;
+
+static uint64_t input_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t input_ms_ns(uint32_t ms)
+{
+	return ms * 1000000ULL;
+}
+
+// run the periodic work again at ns at the latest
+static void input_timer_at(uint64_t ns)
+{
+	if (!input_timer_due || ns < input_timer_due) input_timer_due = ns;
+}
+
+// programs the earliest deadline asked for in this round
+static void input_timer_arm()
+{
+	uint64_t due = input_timer_due;
+	input_timer_due = 0;
+	if (input_tfd < 0 || due == input_timer_armed) return;
+
+	struct itimerspec its = {};
+	its.it_value.tv_sec = due / 1000000000ULL;
+	its.it_value.tv_nsec = due % 1000000000ULL;
+	timerfd_settime(input_tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	input_timer_armed = due;
+}
+
+static void input_timer_ack()
+{
+	uint64_t cnt;
+	if (read(input_tfd, &cnt, sizeof(cnt)) < 0) {}
+	input_timer_armed = 0;
+}
+
+// Input latency, per device: kernel timestamp -> input_cb and
+// kernel timestamp -> joystick state sent to the core, plus the interval
+// between the reports of a device (SYN_REPORT to SYN_REPORT), which is the
+// polling rate of USB and the sniff / slot interval of Bluetooth devices.
+// Device timestamps are switched to CLOCK_MONOTONIC when opened.
+#define LATENCY_FILE "/tmp/MiSTer_latency"
+
+struct latency_stats_t
+{
+	uint32_t count;
+	uint32_t max_us;
+	uint32_t buckets[HIST_BUCKETS];
+};
+
+struct latency_pending_t
+{
+	int dev;
+	uint64_t kernel_ns;
+	uint64_t cb_ns;
+};
+
+static latency_stats_t latency_cb[NUMDEV] = {};
+static latency_stats_t latency_spi[NUMDEV] = {};
+static latency_stats_t latency_rep[NUMDEV] = {};
+static uint64_t latency_rep_ns[NUMDEV] = {};            // kernel time of the last report
+static latency_pending_t latency_cur = { -1, 0, 0 };   // event being processed
+static latency_pending_t latency_joy[NUMPLAYERS] = {}; // waiting for the digital send
+
+static void latency_add(latency_stats_t *stats, uint64_t ns)
+{
+	uint32_t us = (uint32_t)(ns / 1000);
+	stats->count++;
+	if (us > stats->max_us) stats->max_us = us;
+	stats->buckets[histogram_bucket(us)]++;
+}
+
+static void latency_event(int dev, const struct input_event *ev)
+{
+	latency_cur.dev = dev;
+	latency_cur.kernel_ns = ev->time.tv_sec * 1000000000ULL + ev->time.tv_usec * 1000ULL;
+	latency_cur.cb_ns = input_now_ns();
+	if (latency_cur.cb_ns < latency_cur.kernel_ns)
+	{
+		latency_cur.dev = -1; // clock not switched
+		return;
+	}
+
+	latency_add(&latency_cb[dev], latency_cur.cb_ns - latency_cur.kernel_ns);
+	if (ev->type == EV_SYN && ev->code == SYN_REPORT)
+	{
+		if (latency_rep_ns[dev] && latency_cur.kernel_ns > latency_rep_ns[dev]) latency_add(&latency_rep[dev], latency_cur.kernel_ns - latency_rep_ns[dev]);
+		latency_rep_ns[dev] = latency_cur.kernel_ns;
+	}
+}
+
+static void latency_sent(const latency_pending_t *lat)
+{
+	if (lat->dev >= 0) latency_add(&latency_spi[lat->dev], input_now_ns() - lat->kernel_ns);
+}
+
+static void latency_dump()
+{
+	FILE *fp = fopen(LATENCY_FILE, "w");
+	if (!fp)
+	{
+		printf("latency: cannot create %s\n", LATENCY_FILE);
+		return;
+	}
+
+	fprintf(fp, "# device: count p50 p99 max (us) for kernel->input_cb | kernel->core | report interval\n");
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (!latency_cb[i].count) continue;
+
+		fprintf(fp, "%s (%s%s):", input[i].devname, input[i].name, input[i].bt ? ", bt" : "");
+		for (latency_stats_t *stats : { &latency_cb[i], &latency_spi[i], &latency_rep[i] })
+		{
+			fprintf(fp, " %u %u %u %u%s", stats->count,
+				histogram_percentile(stats->buckets, stats->count, 500),
+				histogram_percentile(stats->buckets, stats->count, 990),
+				stats->max_us, (stats != &latency_rep[i]) ? " |" : "");
+		}
+		fprintf(fp, "\n");
+	}
+
+	fclose(fp);
+	printf("latency: written to %s\n", LATENCY_FILE);
+}
+
+static void input_latency_cmd(const char *cmd)
+{
+	if (!strcmp(cmd, "dump")) latency_dump();
+	else if (!strcmp(cmd, "reset"))
+	{
+		memset(latency_cb, 0, sizeof(latency_cb));
+		memset(latency_spi, 0, sizeof(latency_spi));
+		memset(latency_rep, 0, sizeof(latency_rep));
+		memset(latency_rep_ns, 0, sizeof(latency_rep_ns));
+	}
+	else printf("latency: unknown command '%s'\n", cmd);
+}
+
+void input_latency_buckets(uint32_t *buckets)
+{
+	memset(buckets, 0, HIST_BUCKETS * sizeof(*buckets));
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		for (int n = 0; n < HIST_BUCKETS; n++) buckets[n] += latency_spi[i].buckets[n];
+	}
+}
+
+// Input recording for repeatable benchmarks ("input_rec" in MiSTer_cmd).
+// Events are taken where they enter input_cb(), after the device quirks,
+// and replayed into input_cb() at their recorded pace (or faster), so the
+// same workload can be run against different builds. Mouse nodes are not
+// recorded, they don't deliver evdev events.
+#define INPUT_REC_MAX (1024 * 1024)
+
+struct inputRec
+{
+	uint64_t us;
+	int32_t value;
+	int32_t min, max;
+	uint16_t type, code;
+	uint8_t dev;
+};
+
+static int input_rec_on = 0;
+static std::vector<inputRec> *input_recs = nullptr;
+static char input_rec_ids[NUMDEV][64] = {};
+
+static std::vector<inputRec> *replay_recs = nullptr;
+static uint32_t replay_pos = 0;
+static uint32_t replay_speed = 1;   // 0 - as fast as possible
+static uint64_t replay_start = 0;
+static int replay_map[NUMDEV] = {};
+static uint64_t replay_cost_total = 0;
+static latency_stats_t replay_cost = {}; // ns
+
+static void input_rec_add(int dev, const struct input_event *ev, const struct input_absinfo *absinfo)
+{
+	if (input_recs->size() >= INPUT_REC_MAX) return;
+	input_recs->push_back({ input_now_ns() / 1000, ev->value, absinfo->minimum, absinfo->maximum, ev->type, ev->code, (uint8_t)dev });
+}
+
+static void input_rec_stop()
+{
+	if (!input_rec_on)
+	{
+		printf("input rec: not running\n");
+		return;
+	}
+
+	char name[64] = CONFIG_DIR"/inputrec.txt";
+	time_t t = time(NULL);
+	struct tm tm = *localtime(&t);
+	if (tm.tm_year >= 119) strftime(name, sizeof(name), CONFIG_DIR"/inputrec_%Y%m%d_%H%M%S.txt", &tm);
+
+	char *path = strdup(getFullPath(name));
+	char (*ids)[64] = (char(*)[64])malloc(sizeof(input_rec_ids));
+	if (ids) memcpy(ids, input_rec_ids, sizeof(input_rec_ids));
+	std::vector<inputRec> *recs = input_recs;
+	input_recs = nullptr;
+	input_rec_on = 0;
+
+	if (recs->size() >= INPUT_REC_MAX) printf("input rec: buffer was full, the end is missing\n");
+	printf("input rec: stopped, %d events\n", (int)recs->size());
+
+	offload_add_work([recs, path, ids]
+	{
+		FILE *fp = (path && ids) ? fopen(path, "w") : nullptr;
+		if (fp)
+		{
+			for (int i = 0; i < NUMDEV; i++) if (ids[i][0]) fprintf(fp, "# dev %d %s\n", i, ids[i]);
+			fprintf(fp, "# us dev type code value min max\n");
+
+			uint64_t start = recs->empty() ? 0 : recs->front().us;
+			for (auto &r : *recs) fprintf(fp, "%llu %u %u %u %d %d %d\n", (unsigned long long)(r.us - start), r.dev, r.type, r.code, r.value, r.min, r.max);
+			fclose(fp);
+			printf("input rec: written to %s\n", path);
+		}
+		else printf("input rec: cannot create %s\n", path ? path : "the file");
+		delete recs;
+		free(ids);
+		free(path);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+static void input_replay_load(const char *arg)
+{
+	char name[256];
+	unsigned speed = 1;
+	if (sscanf(arg, "%255s %u", name, &speed) < 1)
+	{
+		printf("input rec: play <file> [speed]\n");
+		return;
+	}
+
+	FILE *fp = fopen((name[0] == '/') ? name : getFullPath(name), "r");
+	if (!fp)
+	{
+		printf("input rec: cannot open %s\n", name);
+		return;
+	}
+
+	// recorded devices go to the open ones with the same id, else to the same slot
+	int used[NUMDEV] = {};
+	for (int i = 0; i < NUMDEV; i++) replay_map[i] = (pool[i].fd >= 0) ? i : -1;
+
+	std::vector<inputRec> *recs = new std::vector<inputRec>;
+	char line[256], id[64];
+	unsigned long long us;
+	int dev, type, code, value, min, max;
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "# dev %d %63s", &dev, id) == 2 && dev >= 0 && dev < NUMDEV)
+		{
+			for (int i = 0; i < NUMDEV; i++)
+			{
+				if (pool[i].fd >= 0 && !used[i] && !strcmp(input[i].idstr, id))
+				{
+					used[i] = 1;
+					replay_map[dev] = i;
+					break;
+				}
+			}
+		}
+		else if (line[0] != '#' && sscanf(line, "%llu %d %d %d %d %d %d", &us, &dev, &type, &code, &value, &min, &max) == 7 && dev >= 0 && dev < NUMDEV)
+		{
+			recs->push_back({ us, value, min, max, (uint16_t)type, (uint16_t)code, (uint8_t)dev });
+		}
+	}
+	fclose(fp);
+
+	delete replay_recs;
+	replay_recs = recs;
+	replay_pos = 0;
+	replay_speed = speed;
+	replay_start = input_now_ns();
+	replay_cost_total = 0;
+	memset(&replay_cost, 0, sizeof(replay_cost));
+	memset(latency_cb, 0, sizeof(latency_cb));
+	memset(latency_spi, 0, sizeof(latency_spi));
+	memset(latency_rep, 0, sizeof(latency_rep));
+	memset(latency_rep_ns, 0, sizeof(latency_rep_ns));
+	printf("input rec: playing %d events from %s at %ux\n", (int)recs->size(), name, speed);
+}
+
+static void input_replay_done()
+{
+	printf("input rec: replayed %u events\n", replay_pos);
+	if (replay_cost.count)
+	{
+		printf("input rec: input_cb cost avg %llu p50 %u p99 %u max %u (ns)\n", (unsigned long long)(replay_cost_total / replay_cost.count),
+			histogram_percentile(replay_cost.buckets, replay_cost.count, 500),
+			histogram_percentile(replay_cost.buckets, replay_cost.count, 990), replay_cost.max_us);
+	}
+	latency_dump();
+
+	delete replay_recs;
+	replay_recs = nullptr;
+}
+
+// Feeds the due events of a replay. Their timestamps are the due times,
+// so the latency stats show the delay to input_cb and to the core.
+static void input_replay_run()
+{
+	if (!replay_recs) return;
+
+	uint64_t now = input_now_ns();
+	int budget = 256;
+	while (replay_pos < replay_recs->size())
+	{
+		inputRec &r = (*replay_recs)[replay_pos];
+		uint64_t due = replay_start + (replay_speed ? r.us * 1000 / replay_speed : 0);
+		if (due > now)
+		{
+			input_timer_at(due);
+			return;
+		}
+
+		if (!budget--)
+		{
+			input_timer_at(now);
+			return;
+		}
+
+		replay_pos++;
+		int dev = replay_map[r.dev];
+		if (dev < 0 || pool[dev].fd < 0) continue;
+
+		struct input_event ev = {};
+		ev.time.tv_sec = due / 1000000000ULL;
+		ev.time.tv_usec = (due % 1000000000ULL) / 1000;
+		ev.type = r.type;
+		ev.code = r.code;
+		ev.value = r.value;
+
+		struct input_absinfo absinfo = {};
+		absinfo.minimum = r.min;
+		absinfo.maximum = r.max;
+
+		latency_event(dev, &ev);
+		uint64_t start = input_now_ns();
+		input_cb(&ev, &absinfo, dev);
+		uint32_t cost = (uint32_t)(input_now_ns() - start);
+
+		replay_cost_total += cost;
+		replay_cost.count++;
+		if (cost > replay_cost.max_us) replay_cost.max_us = cost;
+		replay_cost.buckets[histogram_bucket(cost)]++;
+	}
+
+	input_replay_done();
+}
+
+static void input_rec_cmd(const char *cmd)
+{
+	if (!strcmp(cmd, "start"))
+	{
+		if (input_rec_on)
+		{
+			printf("input rec: already running\n");
+			return;
+		}
+
+		for (int i = 0; i < NUMDEV; i++)
+		{
+			if (pool[i].fd >= 0 && input[i].idstr[0]) snprintf(input_rec_ids[i], sizeof(input_rec_ids[i]), "%s", input[i].idstr);
+			else input_rec_ids[i][0] = 0;
+		}
+
+		input_recs = new std::vector<inputRec>;
+		input_recs->reserve(64 * 1024);
+		input_rec_on = 1;
+		printf("input rec: started\n");
+	}
+	else if (!strcmp(cmd, "stop")) input_rec_stop();
+	else if (!strncmp(cmd, "play ", 5)) input_replay_load(cmd + 5);
+	else printf("input rec: unknown command '%s'\n", cmd);
+}
+
 static unsigned char mouse_btn = 0; //emulated mouse
 static unsigned char mice_btn = 0;
 static int mouse_req = 0;
@@ -1662,7 +2220,7 @@ static int mouse_sniper = 0;
 static int mouse_emu_x = 0;
 static int mouse_emu_y = 0;
 
-static uint32_t mouse_timer = 0;
+static uint64_t mouse_timer = 0;
 
 #define BTN_TGL 100
 #define BTN_OSD 101
@@ -1715,15 +2273,40 @@ void input_uinp_destroy()
 	}
 }
 
-static unsigned long uinp_repeat = 0;
+static uint64_t uinp_repeat = 0;
 static struct input_event uinp_ev;
+
+// Keys of one poll round are sent in one write with a single SYN,
+// so chords arrive as one report.
+static struct input_event uinp_batch[32];
+static int uinp_batch_cnt = 0;
+static int uinp_batch_frame = 0; // start of the current report
+
+static void uinp_syn()
+{
+	struct input_event *ev = &uinp_batch[uinp_batch_cnt++];
+	memset(ev, 0, sizeof(*ev));
+	ev->time = uinp_ev.time;
+	ev->type = EV_SYN;
+	ev->code = SYN_REPORT;
+	uinp_batch_frame = uinp_batch_cnt;
+}
+
+static void uinp_flush()
+{
+	if (uinp_batch_cnt > uinp_batch_frame) uinp_syn();
+	if (uinp_batch_cnt && uinp_fd > 0) write(uinp_fd, uinp_batch, uinp_batch_cnt * sizeof(uinp_batch[0]));
+	uinp_batch_cnt = 0;
+	uinp_batch_frame = 0;
+}
+
 static void uinp_send_key(uint16_t key, int press)
 {
 	if (uinp_fd > 0)
 	{
 		if (!uinp_ev.value && press)
 		{
-			uinp_repeat = GetTimer(REPEATDELAY);
+			uinp_repeat = input_now_ns() + input_ms_ns(REPEATDELAY);
 		}
 
 		memset(&uinp_ev, 0, sizeof(uinp_ev));
@@ -1731,14 +2314,21 @@ static void uinp_send_key(uint16_t key, int press)
 		uinp_ev.type = EV_KEY;
 		uinp_ev.code = key;
 		uinp_ev.value = press;
-		write(uinp_fd, &uinp_ev, sizeof(uinp_ev));
 
-		static struct input_event ev;
-		ev.time = uinp_ev.time;
-		ev.type = EV_SYN;
-		ev.code = SYN_REPORT;
-		ev.value = 0;
-		write(uinp_fd, &ev, sizeof(ev));
+		// room for the event and two SYNs
+		if (uinp_batch_cnt > (int)(sizeof(uinp_batch) / sizeof(uinp_batch[0])) - 3) uinp_flush();
+
+		// the same key twice in a report would be merged by the readers
+		for (int i = uinp_batch_frame; i < uinp_batch_cnt; i++)
+		{
+			if (uinp_batch[i].code == key)
+			{
+				uinp_syn();
+				break;
+			}
+		}
+
+		uinp_batch[uinp_batch_cnt++] = uinp_ev;
 	}
 }
 
@@ -1748,11 +2338,14 @@ static void uinp_check_key()
 	{
 		if (!grabbed)
 		{
-			if (uinp_ev.value && CheckTimer(uinp_repeat))
+			uint64_t now = input_now_ns();
+			if (uinp_ev.value && now >= uinp_repeat)
 			{
-				uinp_repeat = GetTimer(REPEATRATE);
+				uint64_t rate = input_ms_ns(REPEATRATE);
+				uinp_repeat = (now - uinp_repeat < rate) ? uinp_repeat + rate : now + rate;
 				uinp_send_key(uinp_ev.code, 2);
 			}
+			if (uinp_ev.value) input_timer_at(uinp_repeat);
 		}
 		else
 		{
@@ -1761,6 +2354,8 @@ static void uinp_check_key()
 				uinp_send_key(uinp_ev.code, 0);
 			}
 		}
+
+		uinp_flush();
 	}
 }
 
@@ -1790,11 +2385,6 @@ static inline void joy_clamp(int* value, const int min, const int max)
 	}
 }
 
-static inline float boxradf(const float angle)
-{
-	return 1.0f / fmaxf(fabsf(sinf(angle)), fabsf(cosf(angle)));
-}
-
 static void joy_apply_deadzone(int* x, int* y, const devInput* dev, const int stick) {
 	// Don't be fancy with such a small deadzone.
 	if (dev->deadzone <= 2) 
@@ -1804,15 +2394,19 @@ static void joy_apply_deadzone(int* x, int* y, const devInput* dev, const int st
 		return;
 	}
 
-	const float radius = hypotf(*x, *y);
-	if (radius <= (float)dev->deadzone)
+	const int radius_sq = *x * *x + *y * *y;
+	if (radius_sq <= (int)(dev->deadzone * dev->deadzone))
 	{
 		*x = *y = 0;
 		return;
 	}
 
-	const float angle = atan2f(*y, *x);
-	const float box_radius = boxradf(angle);
+	/* No trig needed: the cosine and sine of the angle are x and y over the
+	   radius, and the radius of the unit box at that angle is the radius
+	   over the bigger of |x| and |y|. */
+	const float radius = sqrtf((float)radius_sq);
+	const int abs_x = abs(*x), abs_y = abs(*y);
+	const float box_radius = radius / (float)(abs_x > abs_y ? abs_x : abs_y);
 
 	/* A measure of how "cardinal" the angle is,
 	   i.e closeness to [0, 90, 180, 270] degrees (0.0 - 1.0). */
@@ -1830,8 +2424,9 @@ static void joy_apply_deadzone(int* x, int* y, const devInput* dev, const int st
 	   The whole point of this function is to subtract some magnitude, not add. */
 	if (adjusted_radius > radius) return;
 
-	*x = nearbyintf(adjusted_radius * cosf(angle));
-	*y = nearbyintf(adjusted_radius * sinf(angle));
+	const float scale = adjusted_radius / radius;
+	*x = nearbyintf(*x * scale);
+	*y = nearbyintf(*y * scale);
 
 	// Just to be sure.
 	const int min_range = is_psx() ? -128 : -127;
@@ -2127,6 +2722,7 @@ static void joy_digital(int jnum, uint32_t mask, uint32_t code, char press, int
 		{
 			if (press) joy[num] |= mask;
 			else joy[num] &= ~mask;
+			if (latency_joy[num].dev < 0) latency_joy[num] = latency_cur;
 			//user_io_digital_joystick(num, joy[num]);
 
 			if (code)
@@ -2149,7 +2745,8 @@ static bool joy_dir_is_diagonal(const int x, const int y)
 		abs((x > y) == (x > -y) ? (float)y / x : (float)x / y) >= JOY_DIAG_THRESHOLD;
 }
 
-static void joy_analog(int dev, int axis, int offset, int stick = 0)
+// send = 0 only keeps the axis for the send of the other one
+static void joy_analog(int dev, int axis, int offset, int stick = 0, int send = 1)
 {
 	int num = input[dev].num;
 	static int pos[2][NUMPLAYERS][2] = {};
@@ -2157,6 +2754,8 @@ static void joy_analog(int dev, int axis, int offset, int stick = 0)
 	if (grabbed && num > 0 && --num < NUMPLAYERS)
 	{
 		pos[stick][num][axis] = offset;
+		if (!send) return;
+
 		int x = pos[stick][num][0], y = pos[stick][num][1];
 
 		if (joy_dir_is_diagonal(x, y))
@@ -2195,6 +2794,7 @@ static void joy_analog(int dev, int axis, int offset, int stick = 0)
 		{
 			user_io_l_analog_joystick(num, (char)x, (char)y);
 		}
+		latency_sent(&latency_cur);
 	}
 }
 
@@ -2418,53 +3018,171 @@ static void assign_player(int dev, int num, int force = 0)
 	printf("Device %s %sassigned to player %d\n", input[dev].id, force ? "forcebly " : "", input[dev].num);
 }
 
-static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int dev)
+// Joystick buttons and sticks of a plain gamepad while a core is running are
+// by far the most frequent events. Their outcome only depends on the maps,
+// so it's resolved per code once and input_cb skips the decision tree for them.
+// Codes which need more (OSD combo, mapped to keys, mouse emulation toggle)
+// and all other devices take the full path.
+static void dispatch_build(int dev)
 {
-	if (ev->type != EV_KEY && ev->type != EV_ABS && ev->type != EV_REL) return;
-	if (ev->type == EV_KEY && (!ev->code || ev->code == KEY_UNKNOWN)) return;
-
-	static uint16_t last_axis = 0;
-
-	int sub_dev = dev;
-
-	//check if device is a part of multifunctional device
-	if (!JOYCON_COMBINED(dev) && input[dev].bind >= 0) dev = input[dev].bind;
+	devInput *inp = &input[dev];
+	inp->disp_gen = disp_gen;
+	inp->disp_on = !JOYCON_COMBINED(dev) && inp->quirk != QUIRK_PDSP && inp->quirk != QUIRK_MSSP &&
+		inp->quirk != QUIRK_TOUCHGUN && inp->quirk != QUIRK_WHEEL;
+	if (!inp->disp_on) return;
 
-	if (ev->type == EV_KEY)
+	for (int n = 0; n < DISP_KEYS; n++)
 	{
-		if (input[dev].timeout > 0) input[dev].timeout = cfg.bt_auto_disconnect * 10;
+		uint32_t code = n + DISP_KEY_FIRST;
+		uint32_t mapped = (code < 1024 && inp->jkmap[code]) ? inp->jkmap[code] : code;
 
-		//mouse
-		if (ev->code >= BTN_MOUSE && ev->code < BTN_JOYSTICK)
+		inp->disp_btn[n] = 0;
+		inp->disp_slow[n] = (code == inp->mmap[SYS_BTN_OSD_KTGL + 1] || code == inp->mmap[SYS_BTN_OSD_KTGL + 2] ||
+			mapped < 256 || mapped == inp->mmap[SYS_BTN_OSD_KTGL + 1] || mapped == inp->mmap[SYS_BTN_OSD_KTGL + 2] ||
+			mapped == inp->mmap[SYS_MS_BTN_EMU]);
+
+		for (uint i = 0; i < BTN_NUM; i++)
 		{
-			if (ev->value <= 1)
-			{
-				int mask = 1 << (ev->code - BTN_MOUSE);
-				if (input[dev].ds_mouse_emu && mask == 1) mask = 2;
-				mice_btn = (ev->value) ? (mice_btn | mask) : (mice_btn & ~mask);
-				mouse_btn_req();
-			}
-			return;
+			if (mapped == (inp->map[i] & 0xFFFF) || mapped == (inp->map[i] >> 16)) inp->disp_btn[n] |= 1 << i;
 		}
 	}
 
-	if (ev->type == EV_KEY && ev->code < 256 && !(mapping && mapping_type == 2))
+	// same priority as the analog stick checks in input_cb
+	const int *stick[4] = { &inp->stick_l[0], &inp->stick_l[1], &inp->stick_r[0], &inp->stick_r[1] };
+	for (int code = 0; code < ABS_CNT; code++)
 	{
-		if (!input[dev].has_kbdmap)
+		inp->disp_abs[code] = 0;
+		for (int s = 0; s < 4; s++)
 		{
-			if (!FileLoadConfig(get_kbdmap_name(dev), &input[dev].kbdmap, sizeof(input[dev].kbdmap)))
+			if (*stick[s] && code == (uint16_t)inp->mmap[*stick[s]])
 			{
-				memset(input[dev].kbdmap, 0, sizeof(input[dev].kbdmap));
+				inp->disp_abs[code] = s + 1;
+				break;
 			}
-			input[dev].has_kbdmap = 1;
 		}
-
-		if (input[dev].kbdmap[ev->code]) ev->code = input[dev].kbdmap[ev->code];
 	}
+}
 
-	static int key_mapped = 0;
+// clamped axis value to -127...127 (-128 for PSX)
+static int abs_scale(int value, const struct input_absinfo *absinfo)
+{
+	int hrange = (absinfo->maximum - absinfo->minimum) / 2;
 
-	int map_skip = (ev->type == EV_KEY && mapping && ((ev->code == KEY_SPACE && mapping_type == 1) || ev->code == KEY_ALTERASE) && (mapping_dev >= 0 || mapping_button<0));
+	// normalize to -range/2...+range/2
+	value -= (absinfo->minimum + absinfo->maximum) / 2;
+
+	int range = is_psx() ? 128 : 127;
+	value = (value * range) / hrange;
+
+	// final check to eliminate additive error
+	if (value < -range) value = -range;
+	else if (value > 127) value = 127;
+
+	return value;
+}
+
+// 1 if the event was handled by the compiled tables
+static int dispatch_fast(struct input_event *ev, struct input_absinfo *absinfo, int dev, int sub_dev)
+{
+	devInput *inp = &input[dev];
+	if (!inp->disp_on || inp->disp_gen != disp_gen || !inp->num || !inp->map_shown) return 0;
+	if (mapping || mouse_emu || user_io_osd_is_visible() || video_fb_state()) return 0;
+
+	if (ev->type == EV_KEY)
+	{
+		int n = ev->code - DISP_KEY_FIRST;
+		if (n < 0 || n >= DISP_KEYS || inp->disp_slow[n] || inp->has_map != 1) return 0;
+
+		uint32_t btn = inp->disp_btn[n];
+		int origcode = ev->code;
+		if (ev->code < 1024 && inp->jkmap[ev->code]) ev->code = inp->jkmap[ev->code];
+
+		for (int i = 0; btn; i++, btn >>= 1)
+		{
+			if (!(btn & 1)) continue;
+			if (i <= 3 && origcode == ev->code) origcode = 0; // prevent autofire for original dpad
+			if (ev->value <= 1) joy_digital(inp->num, 1 << i, origcode, ev->value, i, 0);
+		}
+		return 1;
+	}
+
+	if (ev->type == EV_ABS)
+	{
+		if (ev->code >= ABS_CNT || ev->code == 8 || (ev->code <= 1 && inp->lightgun)) return 0;
+
+		int value = ev->value;
+		if (ev->value < absinfo->minimum) value = absinfo->minimum;
+		else if (ev->value > absinfo->maximum) value = absinfo->maximum;
+		value = abs_scale(value, absinfo);
+
+		if (input[sub_dev].axis_pos[ev->code] == (int8_t)value) return 1;
+		input[sub_dev].axis_pos[ev->code] = (int8_t)value;
+
+		int s = inp->disp_abs[ev->code];
+		if (s--) joy_analog(dev, s & 1, (value < -1 || value > 1) ? value : 0, s >> 1);
+		return 1;
+	}
+
+	return 0;
+}
+
+// light gun whose X hasn't been sent yet
+static int lightgun_dev = -1;
+static int lightgun_x = 0;
+
+static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int dev)
+{
+	if (ev->type != EV_KEY && ev->type != EV_ABS && ev->type != EV_REL) return;
+	if (ev->type == EV_KEY && (!ev->code || ev->code == KEY_UNKNOWN)) return;
+
+	static uint16_t last_axis = 0;
+
+	int sub_dev = dev;
+
+	//check if device is a part of multifunctional device
+	if (!JOYCON_COMBINED(dev) && input[dev].bind >= 0) dev = input[dev].bind;
+
+	if (ev->type == EV_KEY)
+	{
+		if (input[dev].timeout > 0) input[dev].timeout = cfg.bt_auto_disconnect * 10;
+
+		//mouse
+		if (ev->code >= BTN_MOUSE && ev->code < BTN_JOYSTICK)
+		{
+			if (ev->value <= 1)
+			{
+				int mask = 1 << (ev->code - BTN_MOUSE);
+				if (input[dev].ds_mouse_emu && mask == 1) mask = 2;
+				mice_btn = (ev->value) ? (mice_btn | mask) : (mice_btn & ~mask);
+				mouse_btn_req();
+			}
+			return;
+		}
+	}
+
+	if (ev->type == EV_KEY && ev->code < 256 && !(mapping && mapping_type == 2))
+	{
+		if (!input[dev].has_kbdmap)
+		{
+			if (!load_map(get_kbdmap_name(dev), &input[dev].kbdmap, sizeof(input[dev].kbdmap), 0))
+			{
+				memset(input[dev].kbdmap, 0, sizeof(input[dev].kbdmap));
+			}
+			input[dev].has_kbdmap = 1;
+		}
+
+		if (input[dev].kbdmap[ev->code]) ev->code = input[dev].kbdmap[ev->code];
+	}
+
+	static int key_mapped = 0;
+
+	if (dispatch_fast(ev, absinfo, dev, sub_dev))
+	{
+		key_mapped = 0;
+		return;
+	}
+
+	int map_skip = (ev->type == EV_KEY && mapping && ((ev->code == KEY_SPACE && mapping_type == 1) || ev->code == KEY_ALTERASE) && (mapping_dev >= 0 || mapping_button<0));
 	int cancel   = (ev->type == EV_KEY && ev->code == KEY_ESC && !(mapping && mapping_type == 3 && mapping_button));
 	int enter    = (ev->type == EV_KEY && ev->code == KEY_ENTER && !(mapping && mapping_type == 3 && mapping_button));
 	int origcode = ev->code;
@@ -2731,6 +3449,8 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 		}
 	}
 
+	if (input[dev].disp_gen != disp_gen) dispatch_build(dev);
+
 	int old_combo = input[dev].osd_combo;
 
 	if (ev->type == EV_KEY)
@@ -3449,17 +4169,7 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 					break;
 				}
 
-				int hrange = (absinfo->maximum - absinfo->minimum) / 2;
-
-				// normalize to -range/2...+range/2
-				value -= (absinfo->minimum + absinfo->maximum) / 2;
-
-				int range = is_psx() ? 128 : 127;
-				value = (value * range) / hrange;
-
-				// final check to eliminate additive error
-				if (value < -range) value = -range;
-				else if (value > 127) value = 127;
+				value = abs_scale(value, absinfo);
 
 				if (input[sub_dev].axis_pos[ev->code & 0xFF] == (int8_t)value) break;
 				input[sub_dev].axis_pos[ev->code & 0xFF] = (int8_t)value;
@@ -3522,11 +4232,15 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 					}
 					else if (ev->code == 0 && input[dev].lightgun)
 					{
-						joy_analog(dev, 0, value);
+						// sent with Y or at the end of the report
+						joy_analog(dev, 0, value, 0, 0);
+						lightgun_dev = dev;
+						lightgun_x = value;
 					}
 					else if (ev->code == 1 && input[dev].lightgun)
 					{
 						joy_analog(dev, 1, value);
+						lightgun_dev = -1;
 					}
 					else
 					{
@@ -3600,6 +4314,7 @@ void make_unique(uint16_t vid, uint16_t pid, int type)
 		min = INT32_MAX;
 		for (int i = 0; i < NUMDEV; i++)
 		{
+			if (pool[i].fd < 0) continue;
 			if ((!type && (input[i].vid == vid)) ||
 				(type > 0 && (input[i].vid == vid) && (input[i].pid == pid)) ||
 				(type < 0 && (input[i].vid == vid) && (input[i].pid != pid)))
@@ -3687,7 +4402,12 @@ void mergedevs()
 									input[i].unique_hash = str_hash(input[i].id);
 									input[i].unique_hash = str_hash(input[i].mac, input[i].unique_hash);
 
-									input[i].timeout = (strlen(uniq) && strstr(sysfs, "bluetooth")) ? (cfg.bt_auto_disconnect * 10) : 0;
+									input[i].bt = strlen(uniq) && strstr(sysfs, "bluetooth");
+									if (input[i].fresh)
+									{
+										input[i].timeout = input[i].bt ? (cfg.bt_auto_disconnect * 10) : 0;
+										if (input[i].bt && cfg.bt_low_latency) btlink_low_latency(input[i].mac);
+									}
 								}
 							}
 						}
@@ -3715,62 +4435,75 @@ void mergedevs()
 
 	for (int i = 0; i < (int)cfg.no_merge_vidpid[0]; i++) make_unique(cfg.no_merge_vidpid[i + 1] >> 16, (uint16_t)(cfg.no_merge_vidpid[i + 1]), 1);
 
-	// merge multifunctional devices by id
+	// merge multifunctional devices by id.
+	// The oldest device of a group is its master, so a hotplugged one never takes over a group in use.
 	for (int i = 0; i < NUMDEV; i++)
 	{
+		if (JOYCON_COMBINED(i))
+		{
+			int pair = input[i].bind;
+			if (pool[pair].fd >= 0 && JOYCON_COMBINED(pair) && input[pair].bind == i) continue;
+
+			// other half is gone
+			input[i].misc_flags &= ~(1 << 31);
+			snprintf(input[i].idstr, sizeof(input[i].idstr), "%04x_%04x", input[i].vid, input[i].pid);
+		}
+
 		input[i].bind = i;
-		if (input[i].id[0] && !input[i].mouse)
+		if (pool[i].fd >= 0 && input[i].id[0] && !input[i].mouse)
 		{
-			for (int j = 0; j < i; j++)
+			for (int j = 0; j < NUMDEV; j++)
 			{
-				if (!strcmp(input[i].id, input[j].id))
+				if (pool[j].fd >= 0 && input[j].open_seq < input[input[i].bind].open_seq && !strcmp(input[i].id, input[j].id))
 				{
 					input[i].bind = j;
-					break;
 				}
 			}
 		}
 	}
 
 	//copy missing fields to mouseX
-	for (int i = 0; i < NUMDEV; i++) if (input[i].mouse)
+	for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0 && input[i].mouse)
 	{
-		for (int j = 0; j < NUMDEV; j++) if (!input[j].mouse)
+		int src = -1;
+		for (int j = 0; j < NUMDEV; j++) if (pool[j].fd >= 0 && !input[j].mouse)
+		{
+			if (!strcmp(input[i].id, input[j].id) && (src < 0 || input[j].open_seq < input[src].open_seq)) src = j;
+		}
+
+		if (src >= 0)
 		{
-			if (!strcmp(input[i].id, input[j].id))
+			int j = src;
+			input[i].bind = j;
+			input[i].vid = input[j].vid;
+			input[i].pid = input[j].pid;
+			input[i].version = input[j].version;
+			input[i].bustype = input[j].bustype;
+			input[i].quirk = input[j].quirk;
+			memcpy(input[i].name, input[j].name, sizeof(input[i].name));
+			memcpy(input[i].idstr, input[j].idstr, sizeof(input[i].idstr));
+
+			if (!input[i].quirk)
 			{
-				input[i].bind = j;
-				input[i].vid = input[j].vid;
-				input[i].pid = input[j].pid;
-				input[i].version = input[j].version;
-				input[i].bustype = input[j].bustype;
-				input[i].quirk = input[j].quirk;
-				memcpy(input[i].name, input[j].name, sizeof(input[i].name));
-				memcpy(input[i].idstr, input[j].idstr, sizeof(input[i].idstr));
-
-				if (!input[i].quirk)
+				//All mice as spinners
+				if ((cfg.spinner_vid == 0xFFFF && cfg.spinner_pid == 0xFFFF)
+					//Mouse as spinner
+					|| (cfg.spinner_vid && cfg.spinner_pid && input[i].vid == cfg.spinner_vid && input[i].pid == cfg.spinner_pid))
 				{
-					//All mice as spinners
-					if ((cfg.spinner_vid == 0xFFFF && cfg.spinner_pid == 0xFFFF)
-						//Mouse as spinner
-						|| (cfg.spinner_vid && cfg.spinner_pid && input[i].vid == cfg.spinner_vid && input[i].pid == cfg.spinner_pid))
-					{
-						input[i].quirk = QUIRK_MSSP;
-						input[i].bind = i;
-						input[i].spinner_prediv = 1;
-					}
-
-					//Arcade Spinner TS-BSP01 (X axis) and Atari (Y axis)
-					if (input[i].vid == 0x32be && input[i].pid == 0x1420)
-					{
-						input[i].quirk = QUIRK_MSSP;
-						input[i].bind = i;
-						input[i].spinner_prediv = 3;
-					}
+					input[i].quirk = QUIRK_MSSP;
+					input[i].bind = i;
+					input[i].spinner_prediv = 1;
+				}
 
-					if (input[i].quirk == QUIRK_MSSP) strcat(input[i].id, "_sp");
+				//Arcade Spinner TS-BSP01 (X axis) and Atari (Y axis)
+				if (input[i].vid == 0x32be && input[i].pid == 0x1420)
+				{
+					input[i].quirk = QUIRK_MSSP;
+					input[i].bind = i;
+					input[i].spinner_prediv = 3;
 				}
-				break;
+
+				if (input[i].quirk == QUIRK_MSSP) strcat(input[i].id, "_sp");
 			}
 		}
 	}
@@ -3898,7 +4631,7 @@ static void send_mouse_with_throttle(int dev, int xval, int yval, int8_t wval)
 	int i = dev;
 	if (input[dev].bind >= 0) dev = input[dev].bind;
 
-	if (is_menu() && !video_fb_state()) printf("%s: dx=%d, dy=%d, scroll=%d\n", input[i].devname, xval, yval, wval);
+	if (is_menu() && !video_fb_state()) log_rate(100, LOGL_DEBUG, "%s: dx=%d, dy=%d, scroll=%d\n", input[i].devname, xval, yval, wval);
 
 	int throttle = cfg.mouse_throttle ? cfg.mouse_throttle : 1;
 	if (input[dev].ds_mouse_emu) throttle *= 4;
@@ -3980,18 +4713,14 @@ static void touchscreen_proc(int dev, input_event *ev)
 			if (ev->code == ABS_MT_POSITION_X)
 			{
 				ev->code = ABS_X;
-				absinfo.minimum = input[i].guncal[2];
-				absinfo.maximum = input[i].guncal[3];
 				menu_lightgun_cb(i, ev->type, ev->code, ev->value);
-				input_cb(ev, &absinfo, i);
+				input_cb(ev, &input[i].gunabs[0], i);
 			}
 			else if (ev->code == ABS_MT_POSITION_Y)
 			{
 				ev->code = ABS_Y;
-				absinfo.minimum = input[i].guncal[0];
-				absinfo.maximum = input[i].guncal[1];
 				menu_lightgun_cb(i, ev->type, ev->code, ev->value);
-				input_cb(ev, &absinfo, i);
+				input_cb(ev, &input[i].gunabs[1], i);
 			}
 			else if (ev->code == ABS_MT_SLOT && (input[i].misc_flags & 0x80))
 			{
@@ -4033,7 +4762,7 @@ static void touchscreen_proc(int dev, input_event *ev)
 						if (dx > 255) dx = 255;
 						if (dx < -256) dx = -256;
 						input[i].lastx = ev->value;
-						send_mouse_with_throttle(i, dx, 0, 0);
+						input[i].touchx += dx;
 					}
 					else if (ev->code == ABS_MT_POSITION_Y)
 					{
@@ -4041,7 +4770,7 @@ static void touchscreen_proc(int dev, input_event *ev)
 						if (dy > 255) dy = 255;
 						if (dy < -256) dy = -256;
 						input[i].lasty = ev->value;
-						send_mouse_with_throttle(i, 0, -dy, 0);
+						input[i].touchy -= dy;
 					}
 				}
 			}
@@ -4050,6 +4779,24 @@ static void touchscreen_proc(int dev, input_event *ev)
 
 }
 
+// Touch screens and light guns report X and Y as separate events, their
+// position goes to the core in one update at SYN_REPORT.
+static void report_end(int dev)
+{
+	if (input[dev].touchx || input[dev].touchy)
+	{
+		send_mouse_with_throttle(dev, input[dev].touchx, input[dev].touchy, 0);
+		input[dev].touchx = 0;
+		input[dev].touchy = 0;
+	}
+
+	if (lightgun_dev >= 0)
+	{
+		joy_analog(lightgun_dev, 0, lightgun_x);
+		lightgun_dev = -1;
+	}
+}
+
 static int vcs_proc(int dev, input_event *ev)
 {
 	devInput *inp = &input[dev];
@@ -4115,6 +4862,7 @@ static int vcs_proc(int dev, input_event *ev)
 				inp->mod = !inp->mod;
 				inp->has_map = 0;
 				inp->has_mmap = 0;
+				dispatch_reset();
 				Info(inp->mod ? "8-button mode" : "5-button mode");
 			}
 		}
@@ -4582,6 +5330,471 @@ static void setup_wheels()
 	}
 }
 
+static void input_watch(int n)
+{
+	if (pool[n].fd < 0) return;
+
+	struct epoll_event ev = {};
+	ev.events = pool[n].events;
+	ev.data.u32 = n;
+	epoll_ctl(input_epfd, EPOLL_CTL_ADD, pool[n].fd, &ev);
+}
+
+static struct input_event ev_batch[32];
+static int ev_batch_pos = 0, ev_batch_cnt = 0;
+
+// Next event of a ready device. The first call reads all queued events
+// (up to the batch size) in one go, 0 once they are taken.
+static int input_next_event(int fd, struct input_event *ev, int first)
+{
+	if (first)
+	{
+		int len = read(fd, ev_batch, sizeof(ev_batch));
+		ev_batch_cnt = (len > 0) ? len / sizeof(struct input_event) : 0;
+		ev_batch_pos = 0;
+	}
+
+	if (ev_batch_pos >= ev_batch_cnt) return 0;
+	*ev = ev_batch[ev_batch_pos++];
+	return 1;
+}
+
+// Opens /dev/input/<name> into slot n, 0 if there is nothing to use.
+static int input_open_dev(int n, const char *name)
+{
+	memset(&input[n], 0, sizeof(input[n]));
+	sprintf(input[n].devname, "/dev/input/%s", name);
+	int fd = open(input[n].devname, O_RDWR | O_CLOEXEC);
+	//printf("open(%s): %d\n", input[n].devname, fd);
+
+	if (fd > 0)
+	{
+		pool[n].fd = fd;
+		pool[n].events = POLLIN;
+		input[n].mouse = !strncmp(name, "mouse", 5);
+
+		char uniq[32] = {};
+		if (!input[n].mouse)
+		{
+			struct input_id id;
+			memset(&id, 0, sizeof(id));
+			ioctl(pool[n].fd, EVIOCGID, &id);
+			input[n].vid = id.vendor;
+			input[n].pid = id.product;
+			input[n].version = id.version;
+			input[n].bustype = id.bustype;
+
+			ioctl(pool[n].fd, EVIOCGUNIQ(sizeof(uniq)), uniq);
+			ioctl(pool[n].fd, EVIOCGNAME(sizeof(input[n].name)), input[n].name);
+			input[n].led = has_led(pool[n].fd);
+
+			int clk = CLOCK_MONOTONIC;
+			ioctl(pool[n].fd, EVIOCSCLOCKID, &clk);
+		}
+
+		//skip our virtual device
+		if (!strcmp(input[n].name, UINPUT_NAME))
+		{
+			close(pool[n].fd);
+
+			pool[n].fd = -1;
+			return 0;
+		}
+
+		input[n].bind = -1;
+
+		int effects;
+		input[n].has_rumble = false;
+		if (cfg.rumble)
+		{
+			if (ioctl(fd, EVIOCGEFFECTS, &effects) >= 0)
+			{
+				unsigned char ff_features[(FF_MAX + 7) / 8] = {};
+
+				if (ioctl(fd, EVIOCGBIT(EV_FF, sizeof(ff_features)), ff_features) != -1)
+				{
+					if (test_bit(FF_RUMBLE, ff_features)) {
+						input[n].rumble_effect.id = -1;
+						input[n].has_rumble = true;
+					}
+				}
+			}
+		}
+
+		// enable scroll wheel reading
+		if (input[n].mouse)
+		{
+			unsigned char buffer[4];
+			static const unsigned char mousedev_imps_seq[] = { 0xf3, 200, 0xf3, 100, 0xf3, 80 };
+			if (write(pool[n].fd, mousedev_imps_seq, sizeof(mousedev_imps_seq)) != sizeof(mousedev_imps_seq))
+			{
+				printf("Cannot switch %s to ImPS/2 protocol(1)\n", input[n].devname);
+			}
+			else if (read(pool[n].fd, buffer, sizeof buffer) != 1 || buffer[0] != 0xFA)
+			{
+				printf("Failed to switch %s to ImPS/2 protocol(2)\n", input[n].devname);
+			}
+		}
+
+		// RasPad3 touchscreen
+		if (input[n].vid == 0x222a && input[n].pid == 1)
+		{
+			input[n].quirk = QUIRK_TOUCHGUN;
+			input[n].num = 1;
+			input[n].map_shown = 1;
+
+			input[n].lightgun = 0;
+			input[n].guncal[0] = 0;
+			input[n].guncal[1] = 16383;
+			input[n].guncal[2] = 2047;
+			input[n].guncal[3] = 14337;
+			input_lightgun_load(n);
+		}
+
+		if (input[n].vid == 0x054c)
+		{
+			if (strcasestr(input[n].name, "Motion"))
+			{
+				// don't use Accelerometer
+				close(pool[n].fd);
+				pool[n].fd = -1;
+				return 0;
+			}
+
+			if (input[n].pid == 0x0268)  input[n].quirk = QUIRK_DS3;
+			else if (input[n].pid == 0x05c4 || input[n].pid == 0x09cc || input[n].pid == 0x0ba0 || input[n].pid == 0x0ce6)
+			{
+				input[n].quirk = QUIRK_DS4;
+				if (strcasestr(input[n].name, "Touchpad"))
+				{
+					input[n].quirk = QUIRK_DS4TOUCH;
+				}
+			}
+		}
+
+		if (input[n].vid == 0x0079 && input[n].pid == 0x1802)
+		{
+			input[n].lightgun = 1;
+			input[n].num = 2; // force mayflash mode 1/2 as second joystick.
+		}
+
+		if (input[n].vid == 0x057e && (input[n].pid == 0x0306 || input[n].pid == 0x0330))
+		{
+			if (strcasestr(input[n].name, "Accelerometer"))
+			{
+				// don't use Accelerometer
+				close(pool[n].fd);
+				pool[n].fd = -1;
+				return 0;
+			}
+			else if (strcasestr(input[n].name, "Motion Plus"))
+			{
+				// don't use Accelerometer
+				close(pool[n].fd);
+				pool[n].fd = -1;
+				return 0;
+			}
+			else
+			{
+				input[n].quirk = QUIRK_WIIMOTE;
+				input[n].guncal[0] = 0;
+				input[n].guncal[1] = 767;
+				input[n].guncal[2] = 1;
+				input[n].guncal[3] = 1023;
+				input_lightgun_load(n);
+			}
+		}
+
+		if (input[n].vid == 0x057e)
+		{
+			if (strstr(input[n].name, " IMU"))
+			{
+				// don't use Accelerometer
+				close(pool[n].fd);
+				pool[n].fd = -1;
+				return 0;
+			}
+		}
+
+		if (input[n].vid == 0x057e && input[n].pid == 0x2006)
+		{
+			input[n].misc_flags = 1 << 30;
+			input[n].quirk = QUIRK_JOYCON;
+		}
+		if (input[n].vid == 0x057e && input[n].pid == 0x2007)
+		{
+			input[n].misc_flags = 1 << 29;
+			input[n].quirk = QUIRK_JOYCON;
+		}
+
+		//Ultimarc lightgun
+		if (input[n].vid == 0xd209 && input[n].pid == 0x1601)
+		{
+			input[n].lightgun = 1;
+		}
+
+		//Namco Guncon via RetroZord adapter or Reflex Adapt
+		if ((input[n].vid == 0x2341 && input[n].pid == 0x8036 && (strstr(uniq, "RZordPsGun") || strstr(input[n].name, "RZordPsGun"))) ||
+			(input[n].vid == 0x16D0 && input[n].pid == 0x127E && (strstr(uniq, "ReflexPSGun") || strstr(input[n].name, "ReflexPSGun"))))
+		{
+			input[n].quirk = QUIRK_LIGHTGUN;
+			input[n].lightgun = 1;
+			input[n].guncal[0] = 0;
+			input[n].guncal[1] = 32767;
+			input[n].guncal[2] = 0;
+			input[n].guncal[3] = 32767;
+			input_lightgun_load(n);
+		}
+
+		//Namco GunCon 2
+		if (input[n].vid == 0x0b9a && input[n].pid == 0x016a)
+		{
+			input[n].quirk = QUIRK_LIGHTGUN_CRT;
+			input[n].lightgun = 1;
+			input[n].guncal[0] = 25;
+			input[n].guncal[1] = 245;
+			input[n].guncal[2] = 145;
+			input[n].guncal[3] = 700;
+			input_lightgun_load(n);
+		}
+
+		//Namco GunCon 3
+		if (input[n].vid == 0x0b9a && input[n].pid == 0x0800)
+		{
+			input[n].quirk = QUIRK_LIGHTGUN;
+			input[n].lightgun = 1;
+			input[n].guncal[0] = -32768;
+			input[n].guncal[1] = 32767;
+			input[n].guncal[2] = -32768;
+			input[n].guncal[3] = 32767;
+			input_lightgun_load(n);
+		}
+
+		//GUN4IR Lightgun
+		if (input[n].vid == 0x2341 && input[n].pid >= 0x8042 && input[n].pid <= 0x8049)
+		{
+			input[n].quirk = QUIRK_LIGHTGUN;
+			input[n].lightgun = 1;
+			input[n].guncal[0] = 0;
+			input[n].guncal[1] = 32767;
+			input[n].guncal[2] = 0;
+			input[n].guncal[3] = 32767;
+			input_lightgun_load(n);
+		}
+
+		//Madcatz Arcade Stick 360
+		if (input[n].vid == 0x0738 && input[n].pid == 0x4758) input[n].quirk = QUIRK_MADCATZ360;
+
+		// mr.Spinner
+		// 0x120  - Button
+		// Axis 7 - EV_REL is spinner
+		// Axis 8 - EV_ABS is Paddle
+		// Overlays on other existing gamepads
+		if (strstr(uniq, "MiSTer-S1")) input[n].quirk = QUIRK_PDSP;
+		if (strstr(input[n].name, "MiSTer-S1")) input[n].quirk = QUIRK_PDSP;
+
+		// Arcade with spinner and/or paddle:
+		// Axis 7 - EV_REL is spinner
+		// Axis 8 - EV_ABS is Paddle
+		// Includes other buttons and axes, works as a full featured gamepad.
+		if (strstr(uniq, "MiSTer-A1")) input[n].quirk = QUIRK_PDSP_ARCADE;
+		if (strstr(input[n].name, "MiSTer-A1")) input[n].quirk = QUIRK_PDSP_ARCADE;
+
+		//Jamma
+		if (cfg.jamma_vid && cfg.jamma_pid && input[n].vid == cfg.jamma_vid && input[n].pid == cfg.jamma_pid)
+		{
+			input[n].quirk = QUIRK_JAMMA;
+		}
+
+		//Jamma2
+		if (cfg.jamma2_vid && cfg.jamma2_pid && input[n].vid == cfg.jamma2_vid && input[n].pid == cfg.jamma2_pid)
+		{
+			input[n].quirk = QUIRK_JAMMA2;
+		}
+
+		//Atari VCS wireless joystick with spinner
+		if (input[n].vid == 0x3250 && input[n].pid == 0x1001)
+		{
+			input[n].quirk = QUIRK_VCS;
+			input[n].spinner_acc = -1;
+			input[n].misc_flags = 0;
+		}
+
+		//Arduino and Teensy devices may share the same VID:PID, so additional field UNIQ is used to differentiate them
+		//Reflex Adapt also uses the UNIQ field to differentiate between device modes
+		if ((input[n].vid == 0x2341 || (input[n].vid == 0x16C0 && (input[n].pid>>8) == 0x4) || (input[n].vid == 0x16D0 && input[n].pid == 0x127E)) && strlen(uniq))
+		{
+			snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x_%s", input[n].vid, input[n].pid, uniq);
+			char *p;
+			while ((p = strchr(input[n].idstr, '/'))) *p = '_';
+			while ((p = strchr(input[n].idstr, ' '))) *p = '_';
+			while ((p = strchr(input[n].idstr, '*'))) *p = '_';
+			while ((p = strchr(input[n].idstr, ':'))) *p = '_';
+			strcpy(input[n].name, uniq);
+		}
+		else if (input[n].vid == 0x1209 && (input[n].pid == 0xFACE || input[n].pid == 0xFACA))
+		{
+			int sum = 0;
+			for (uint32_t i = 0; i < sizeof(input[n].name); i++)
+			{
+				if (!input[n].name[i]) break;
+				sum += (uint8_t)input[n].name[i];
+			}
+			snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x_%d", input[n].vid, input[n].pid, sum);
+		}
+		else
+		{
+			snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x", input[n].vid, input[n].pid);
+		}
+
+		ioctl(pool[n].fd, EVIOCGRAB, (grabbed | user_io_osd_is_visible()) ? 1 : 0);
+
+		input[n].open_seq = ++open_seq;
+		input[n].fresh = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Opens or closes a single node, 1 if the device set changed.
+// Other devices stay open and keep their state.
+static int input_hotplug(const char *name, int add)
+{
+	if (strncmp(name, "event", 5) && strncmp(name, "mouse", 5)) return 0;
+
+	char devname[32];
+	snprintf(devname, sizeof(devname), "/dev/input/%s", name);
+
+	// on create too: the node was reused before its delete was seen
+	int result = 0;
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (pool[i].fd >= 0 && !strcmp(input[i].devname, devname))
+		{
+			printf("close %d: %s\n", i, devname);
+			close(pool[i].fd);
+			pool[i].fd = -1;
+			pool[i].events = 0;
+
+			memset(&input[i], 0, sizeof(input[i]));
+			memset(&latency_cb[i], 0, sizeof(latency_cb[i]));
+			memset(&latency_spi[i], 0, sizeof(latency_spi[i]));
+			for (int k = 0; k < NUMPLAYERS; k++) if (latency_joy[k].dev == i) latency_joy[k].dev = -1;
+			result = 1;
+		}
+	}
+
+	if (!add) return result;
+
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (pool[i].fd < 0)
+		{
+			if (!input_open_dev(i, name)) return result;
+			input_watch(i);
+			return 1;
+		}
+	}
+
+	printf("No free slot for %s\n", devname);
+	return result;
+}
+
+// Merges the hotplugged devices into the set.
+// Devices in use keep their groups, players and maps.
+static void input_hotplug_done()
+{
+	int bind[NUMDEV];
+	for (int i = 0; i < NUMDEV; i++) bind[i] = input[i].bind;
+
+	mergedevs();
+	check_joycon();
+	setup_wheels();
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (pool[i].fd < 0 || (!input[i].fresh && bind[i] == input[i].bind)) continue;
+
+		printf("%s %d(%2d): %s (%04x:%04x:%08x) %d \"%s\" \"%s\"\n", input[i].fresh ? "opened" : "rebound", i, input[i].bind, input[i].devname, input[i].vid, input[i].pid, input[i].unique_hash, input[i].quirk, input[i].id, input[i].name);
+		input[i].fresh = 0;
+		restore_player(i);
+	}
+	unflag_players();
+	dispatch_reset();
+}
+
+// MiSTer_cmd commands, from the FIFO and from the command socket.
+// 0 if the command is unknown.
+int input_cmd(char *cmd)
+{
+	if (!strncmp(cmd, "fb_cmd", 6)) video_cmd(cmd);
+	else if (!strncmp(cmd, "load_core ", 10))
+	{
+		if(isXmlName(cmd)) xml_load(cmd + 10);
+		else fpga_load_rbf(cmd + 10);
+	}
+	else if (!strncmp(cmd, "screenshot", 10))
+	{
+		user_io_screenshot_cmd(cmd);
+	}
+	else if (!strncmp(cmd, "volume ", 7))
+	{
+		if (!strcmp(cmd + 7, "mute")) set_volume(0x81);
+		else if (!strcmp(cmd + 7, "unmute")) set_volume(0x80);
+		else if (cmd[7] >= '0' && cmd[7] <= '7') set_volume(0x40 - 0x30 + cmd[7]);
+	}
+	else if (!strcmp(cmd, "spi_bench"))
+	{
+		fpga_spi_bench();
+	}
+	else if (!strcmp(cmd, "counters"))
+	{
+		counters_dump();
+	}
+	else if (!strcmp(cmd, "storage_bench"))
+	{
+		storageBenchResult res[STORAGE_BENCH_MAX];
+		storage_bench_report(res, storage_bench_run(res, STORAGE_BENCH_MAX), STORAGE_BENCH_FILE);
+	}
+	else if (!strncmp(cmd, "latency ", 8))
+	{
+		input_latency_cmd(cmd + 8);
+	}
+	else if (!strncmp(cmd, "input_rec ", 10))
+	{
+		input_rec_cmd(cmd + 10);
+	}
+	else if (!strncmp(cmd, "capture ", 8))
+	{
+		capture_cmd(cmd + 8);
+	}
+	else if (!strncmp(cmd, "profile ", 8))
+	{
+		profiling_stats_cmd(cmd + 8);
+	}
+	else if (!strncmp(cmd, "trace ", 6))
+	{
+		profiling_trace_cmd(cmd + 6);
+	}
+	else if (!strncmp(cmd, "cd_trace ", 9))
+	{
+		cd_trace_cmd(cmd + 9);
+	}
+	else if (!strncmp(cmd, "spi_stats ", 10))
+	{
+		spi_stats_command(cmd + 10);
+	}
+	else if (!strncmp(cmd, "hdd_overlay ", 12))
+	{
+		// <overlay>;<base> creates, <overlay> alone resets
+		char *base = strchr(cmd + 12, ';');
+		if (base) *base++ = 0;
+		FileOverlayCreate(cmd + 12, base);
+	}
+	else return 0;
+	return 1;
+}
+
 int input_test(int getchar)
 {
 	static char cur_leds = 0;
@@ -4615,6 +5828,8 @@ int input_test(int getchar)
 		pool[NUMDEV + 2].fd = open(LED_MONITOR, O_RDONLY | O_CLOEXEC);
 		pool[NUMDEV + 2].events = POLLPRI;
 
+		input_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
 		state++;
 	}
 
@@ -4628,7 +5843,15 @@ int input_test(int getchar)
 			pool[i].events = 0;
 		}
 
+		// a new set, so nothing of the old device list is left in it
+		if (input_epfd >= 0) close(input_epfd);
+		input_epfd = epoll_create1(EPOLL_CLOEXEC);
+		ev_batch_cnt = 0;
+
 		memset(input, 0, sizeof(input));
+		memset(latency_cb, 0, sizeof(latency_cb));
+		memset(latency_spi, 0, sizeof(latency_spi));
+		for (int i = 0; i < NUMPLAYERS; i++) latency_joy[i].dev = -1;
 
 		int n = 0;
 		DIR *d = opendir("/dev/input");
@@ -4639,293 +5862,8 @@ int input_test(int getchar)
 			{
 				if (!strncmp(de->d_name, "event", 5) || !strncmp(de->d_name, "mouse", 5))
 				{
-					memset(&input[n], 0, sizeof(input[n]));
-					sprintf(input[n].devname, "/dev/input/%s", de->d_name);
-					int fd = open(input[n].devname, O_RDWR | O_CLOEXEC);
-					//printf("open(%s): %d\n", input[n].devname, fd);
-
-					if (fd > 0)
-					{
-						pool[n].fd = fd;
-						pool[n].events = POLLIN;
-						input[n].mouse = !strncmp(de->d_name, "mouse", 5);
-
-						char uniq[32] = {};
-						if (!input[n].mouse)
-						{
-							struct input_id id;
-							memset(&id, 0, sizeof(id));
-							ioctl(pool[n].fd, EVIOCGID, &id);
-							input[n].vid = id.vendor;
-							input[n].pid = id.product;
-							input[n].version = id.version;
-							input[n].bustype = id.bustype;
-
-							ioctl(pool[n].fd, EVIOCGUNIQ(sizeof(uniq)), uniq);
-							ioctl(pool[n].fd, EVIOCGNAME(sizeof(input[n].name)), input[n].name);
-							input[n].led = has_led(pool[n].fd);
-						}
-
-						//skip our virtual device
-						if (!strcmp(input[n].name, UINPUT_NAME))
-						{
-							close(pool[n].fd);
-
-							pool[n].fd = -1;
-							continue;
-						}
-
-						input[n].bind = -1;
-
-						int effects;
-						input[n].has_rumble = false;
-						if (cfg.rumble)
-						{
-							if (ioctl(fd, EVIOCGEFFECTS, &effects) >= 0)
-							{
-								unsigned char ff_features[(FF_MAX + 7) / 8] = {};
-
-								if (ioctl(fd, EVIOCGBIT(EV_FF, sizeof(ff_features)), ff_features) != -1)
-								{
-									if (test_bit(FF_RUMBLE, ff_features)) {
-										input[n].rumble_effect.id = -1;
-										input[n].has_rumble = true;
-									}
-								}
-							}
-						}
-
-						// enable scroll wheel reading
-						if (input[n].mouse)
-						{
-							unsigned char buffer[4];
-							static const unsigned char mousedev_imps_seq[] = { 0xf3, 200, 0xf3, 100, 0xf3, 80 };
-							if (write(pool[n].fd, mousedev_imps_seq, sizeof(mousedev_imps_seq)) != sizeof(mousedev_imps_seq))
-							{
-								printf("Cannot switch %s to ImPS/2 protocol(1)\n", input[n].devname);
-							}
-							else if (read(pool[n].fd, buffer, sizeof buffer) != 1 || buffer[0] != 0xFA)
-							{
-								printf("Failed to switch %s to ImPS/2 protocol(2)\n", input[n].devname);
-							}
-						}
-
-						// RasPad3 touchscreen
-						if (input[n].vid == 0x222a && input[n].pid == 1)
-						{
-							input[n].quirk = QUIRK_TOUCHGUN;
-							input[n].num = 1;
-							input[n].map_shown = 1;
-
-							input[n].lightgun = 0;
-							input[n].guncal[0] = 0;
-							input[n].guncal[1] = 16383;
-							input[n].guncal[2] = 2047;
-							input[n].guncal[3] = 14337;
-							input_lightgun_load(n);
-						}
-
-						if (input[n].vid == 0x054c)
-						{
-							if (strcasestr(input[n].name, "Motion"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
-
-							if (input[n].pid == 0x0268)  input[n].quirk = QUIRK_DS3;
-							else if (input[n].pid == 0x05c4 || input[n].pid == 0x09cc || input[n].pid == 0x0ba0 || input[n].pid == 0x0ce6)
-							{
-								input[n].quirk = QUIRK_DS4;
-								if (strcasestr(input[n].name, "Touchpad"))
-								{
-									input[n].quirk = QUIRK_DS4TOUCH;
-								}
-							}
-						}
-
-						if (input[n].vid == 0x0079 && input[n].pid == 0x1802)
-						{
-							input[n].lightgun = 1;
-							input[n].num = 2; // force mayflash mode 1/2 as second joystick.
-						}
-
-						if (input[n].vid == 0x057e && (input[n].pid == 0x0306 || input[n].pid == 0x0330))
-						{
-							if (strcasestr(input[n].name, "Accelerometer"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
-							else if (strcasestr(input[n].name, "Motion Plus"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
-							else
-							{
-								input[n].quirk = QUIRK_WIIMOTE;
-								input[n].guncal[0] = 0;
-								input[n].guncal[1] = 767;
-								input[n].guncal[2] = 1;
-								input[n].guncal[3] = 1023;
-								input_lightgun_load(n);
-							}
-						}
-
-						if (input[n].vid == 0x057e)
-						{
-							if (strstr(input[n].name, " IMU"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
-						}
-
-						if (input[n].vid == 0x057e && input[n].pid == 0x2006)
-						{
-							input[n].misc_flags = 1 << 30;
-							input[n].quirk = QUIRK_JOYCON;
-						}
-						if (input[n].vid == 0x057e && input[n].pid == 0x2007)
-						{
-							input[n].misc_flags = 1 << 29;
-							input[n].quirk = QUIRK_JOYCON;
-						}
-
-						//Ultimarc lightgun
-						if (input[n].vid == 0xd209 && input[n].pid == 0x1601)
-						{
-							input[n].lightgun = 1;
-						}
-
-						//Namco Guncon via RetroZord adapter or Reflex Adapt
-						if ((input[n].vid == 0x2341 && input[n].pid == 0x8036 && (strstr(uniq, "RZordPsGun") || strstr(input[n].name, "RZordPsGun"))) ||
-							(input[n].vid == 0x16D0 && input[n].pid == 0x127E && (strstr(uniq, "ReflexPSGun") || strstr(input[n].name, "ReflexPSGun"))))
-						{
-							input[n].quirk = QUIRK_LIGHTGUN;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = 0;
-							input[n].guncal[1] = 32767;
-							input[n].guncal[2] = 0;
-							input[n].guncal[3] = 32767;
-							input_lightgun_load(n);
-						}
-
-						//Namco GunCon 2
-						if (input[n].vid == 0x0b9a && input[n].pid == 0x016a)
-						{
-							input[n].quirk = QUIRK_LIGHTGUN_CRT;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = 25;
-							input[n].guncal[1] = 245;
-							input[n].guncal[2] = 145;
-							input[n].guncal[3] = 700;
-							input_lightgun_load(n);
-						}
-
-						//Namco GunCon 3
-						if (input[n].vid == 0x0b9a && input[n].pid == 0x0800)
-						{
-							input[n].quirk = QUIRK_LIGHTGUN;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = -32768;
-							input[n].guncal[1] = 32767;
-							input[n].guncal[2] = -32768;
-							input[n].guncal[3] = 32767;
-							input_lightgun_load(n);
-						}
-
-						//GUN4IR Lightgun
-						if (input[n].vid == 0x2341 && input[n].pid >= 0x8042 && input[n].pid <= 0x8049)
-						{
-							input[n].quirk = QUIRK_LIGHTGUN;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = 0;
-							input[n].guncal[1] = 32767;
-							input[n].guncal[2] = 0;
-							input[n].guncal[3] = 32767;
-							input_lightgun_load(n);
-						}
-
-						//Madcatz Arcade Stick 360
-						if (input[n].vid == 0x0738 && input[n].pid == 0x4758) input[n].quirk = QUIRK_MADCATZ360;
-
-						// mr.Spinner
-						// 0x120  - Button
-						// Axis 7 - EV_REL is spinner
-						// Axis 8 - EV_ABS is Paddle
-						// Overlays on other existing gamepads
-						if (strstr(uniq, "MiSTer-S1")) input[n].quirk = QUIRK_PDSP;
-						if (strstr(input[n].name, "MiSTer-S1")) input[n].quirk = QUIRK_PDSP;
-
-						// Arcade with spinner and/or paddle:
-						// Axis 7 - EV_REL is spinner
-						// Axis 8 - EV_ABS is Paddle
-						// Includes other buttons and axes, works as a full featured gamepad.
-						if (strstr(uniq, "MiSTer-A1")) input[n].quirk = QUIRK_PDSP_ARCADE;
-						if (strstr(input[n].name, "MiSTer-A1")) input[n].quirk = QUIRK_PDSP_ARCADE;
-
-						//Jamma
-						if (cfg.jamma_vid && cfg.jamma_pid && input[n].vid == cfg.jamma_vid && input[n].pid == cfg.jamma_pid)
-						{
-							input[n].quirk = QUIRK_JAMMA;
-						}
-
-						//Jamma2
-						if (cfg.jamma2_vid && cfg.jamma2_pid && input[n].vid == cfg.jamma2_vid && input[n].pid == cfg.jamma2_pid)
-						{
-							input[n].quirk = QUIRK_JAMMA2;
-						}
-
-						//Atari VCS wireless joystick with spinner
-						if (input[n].vid == 0x3250 && input[n].pid == 0x1001)
-						{
-							input[n].quirk = QUIRK_VCS;
-							input[n].spinner_acc = -1;
-							input[n].misc_flags = 0;
-						}
-
-						//Arduino and Teensy devices may share the same VID:PID, so additional field UNIQ is used to differentiate them
-						//Reflex Adapt also uses the UNIQ field to differentiate between device modes
-						if ((input[n].vid == 0x2341 || (input[n].vid == 0x16C0 && (input[n].pid>>8) == 0x4) || (input[n].vid == 0x16D0 && input[n].pid == 0x127E)) && strlen(uniq))
-						{
-							snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x_%s", input[n].vid, input[n].pid, uniq);
-							char *p;
-							while ((p = strchr(input[n].idstr, '/'))) *p = '_';
-							while ((p = strchr(input[n].idstr, ' '))) *p = '_';
-							while ((p = strchr(input[n].idstr, '*'))) *p = '_';
-							while ((p = strchr(input[n].idstr, ':'))) *p = '_';
-							strcpy(input[n].name, uniq);
-						}
-						else if (input[n].vid == 0x1209 && (input[n].pid == 0xFACE || input[n].pid == 0xFACA))
-						{
-							int sum = 0;
-							for (uint32_t i = 0; i < sizeof(input[n].name); i++)
-							{
-								if (!input[n].name[i]) break;
-								sum += (uint8_t)input[n].name[i];
-							}
-							snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x_%d", input[n].vid, input[n].pid, sum);
-						}
-						else
-						{
-							snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x", input[n].vid, input[n].pid);
-						}
-
-						ioctl(pool[n].fd, EVIOCGRAB, (grabbed | user_io_osd_is_visible()) ? 1 : 0);
-
-						n++;
-						if (n >= NUMDEV) break;
-					}
+					if (input_open_dev(n, de->d_name)) n++;
+					if (n >= NUMDEV) break;
 				}
 			}
 			closedir(d);
@@ -4936,10 +5874,24 @@ int input_test(int getchar)
 			for (int i = 0; i < n; i++)
 			{
 				printf("opened %d(%2d): %s (%04x:%04x:%08x) %d \"%s\" \"%s\"\n", i, input[i].bind, input[i].devname, input[i].vid, input[i].pid, input[i].unique_hash, input[i].quirk, input[i].id, input[i].name);
+				input[i].fresh = 0;
 				restore_player(i);
 			}
 			unflag_players();
 		}
+
+		// the set wakes up the main loop from idle sleep
+		for (int i = 0; i < NUMDEV + 3; i++) input_watch(i);
+		if (input_tfd >= 0)
+		{
+			struct epoll_event tev = {};
+			tev.events = EPOLLIN;
+			tev.data.u32 = INPUT_TIMER_ID;
+			epoll_ctl(input_epfd, EPOLL_CTL_ADD, input_tfd, &tev);
+			input_timer_armed = 0;
+		}
+		scheduler_watch_fd(input_epfd, EPOLLIN);
+
 		cur_leds |= 0x80;
 		state++;
 	}
@@ -4958,14 +5910,8 @@ int input_test(int getchar)
 					input[i].timeout--;
 					if (!input[i].timeout)
 					{
-						static char cmd[128];
-						sprintf(cmd, "btctl disconnect %s", input[i].mac);
-						system(cmd);
-						if (JOYCON_COMBINED(i))
-						{
-							sprintf(cmd, "btctl disconnect %s", input[input[i].bind].mac);
-							system(cmd);
-						}
+						btlink_disconnect(input[i].mac);
+						if (JOYCON_COMBINED(i)) btlink_disconnect(input[input[i].bind].mac);
 					}
 				}
 			}
@@ -4979,22 +5925,36 @@ int input_test(int getchar)
 
 		while (1)
 		{
-			if (cfg.rumble && !is_menu())
+			// rumble is asked once per player and frame, devices of a player share it
+			static uint32_t rumble_timer = 0;
+			if (cfg.rumble && !is_menu() && CheckTimer(rumble_timer))
 			{
+				rumble_timer = GetTimer(RUMBLE_POLL_MS);
+
+				uint16_t rumble[NUMDEV];
+				uint64_t asked = 0;
 				for (int i = 0; i < NUMDEV; i++)
 				{
 					if (!input[i].has_rumble) continue;
 
 					int dev = i;
 					if (input[i].bind >= 0) dev = input[i].bind;
-					if (!input[dev].num) continue;
+					if (!input[dev].num || input[dev].num > NUMDEV) continue;
 
-					set_rumble(i, spi_uio_cmd(UIO_GET_RUMBLE | ((input[dev].num - 1) << 8)));
+					int num = input[dev].num - 1;
+					if (!(asked & (1ULL << num)))
+					{
+						rumble[num] = spi_uio_cmd(UIO_GET_RUMBLE | (num << 8));
+						asked |= 1ULL << num;
+					}
+					set_rumble(i, rumble[num]);
 				}
 			}
 
-			int return_value = poll(pool, NUMDEV + 3, timeout);
+			struct epoll_event ready[NUMDEV + 4];
+			int return_value = epoll_wait(input_epfd, ready, NUMDEV + 4, timeout);
 			if (!return_value) break;
+			if (return_value > 0) scheduler_activity();
 
 			if (return_value < 0)
 			{
@@ -5002,7 +5962,21 @@ int input_test(int getchar)
 				break;
 			}
 
-			if ((pool[NUMDEV].revents & POLLIN) && check_devs())
+			// inotify watch, MiSTer_cmd, LED monitor, timer
+			uint32_t revents[4] = {};
+			for (int r = 0; r < return_value; r++) if (ready[r].data.u32 >= NUMDEV) revents[ready[r].data.u32 - NUMDEV] = ready[r].events;
+			if (revents[3] & EPOLLIN) input_timer_ack();
+
+			int hotplug = (revents[0] & EPOLLIN) ? check_devs() : 0;
+			if (hotplug == 1)
+			{
+				// slots may have changed under the ready list
+				input_hotplug_done();
+				cur_leds |= 0x80;
+				return 0;
+			}
+
+			if (hotplug)
 			{
 				printf("Close all devices.\n");
 				for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0)
@@ -5014,19 +5988,25 @@ int input_test(int getchar)
 				return 0;
 			}
 
-			for (int pos = 0; pos < NUMDEV; pos++)
+			for (int r = 0; r < return_value; r++)
 			{
+				int pos = ready[r].data.u32;
+				if (pos >= NUMDEV) continue;
+
 				int i = pos;
+				latency_cur.dev = -1;
 
 
-				if ((pool[i].fd >= 0) && (pool[i].revents & POLLIN))
+				if ((pool[i].fd >= 0) && (ready[r].events & EPOLLIN))
 				{
 					if (!input[i].mouse)
 					{
 
-						memset(&ev, 0, sizeof(ev));
-						if (read(pool[i].fd, &ev, sizeof(ev)) == sizeof(ev))
+						for (int first = 1; input_next_event(pool[pos].fd, &ev, first); first = 0)
 						{
+							i = pos;
+							latency_event(i, &ev);
+							if (!getchar && ev.type == EV_SYN && ev.code == SYN_REPORT) report_end(i);
 							if (getchar)
 							{
 								if (ev.type == EV_KEY && ev.value >= 1)
@@ -5439,7 +6419,11 @@ int input_test(int getchar)
 									dev = i;
 								}
 
-								if (!noabs) input_cb(&ev, &absinfo, i);
+								if (!noabs)
+								{
+									if (input_rec_on) input_rec_add(i, &ev, &absinfo);
+									input_cb(&ev, &absinfo, i);
+								}
 
 								// simulate digital directions from analog
 								if (ev.type == EV_ABS && !(mapping && mapping_type <= 1 && mapping_button < -4) && !(ev.code <= 1 && input[dev].lightgun) && input[dev].quirk != QUIRK_PDSP && input[dev].quirk != QUIRK_MSSP)
@@ -5585,7 +6569,7 @@ int input_test(int getchar)
 				}
 			}
 
-			if ((pool[NUMDEV + 1].fd >= 0) && (pool[NUMDEV + 1].revents & POLLIN))
+			if ((pool[NUMDEV + 1].fd >= 0) && (revents[1] & EPOLLIN))
 			{
 				static char cmd[1024];
 				int len = read(pool[NUMDEV + 1].fd, cmd, sizeof(cmd) - 1);
@@ -5594,26 +6578,11 @@ int input_test(int getchar)
 					if (cmd[len - 1] == '\n') cmd[len - 1] = 0;
 					cmd[len] = 0;
 					printf("MiSTer_cmd: %s\n", cmd);
-					if (!strncmp(cmd, "fb_cmd", 6)) video_cmd(cmd);
-					else if (!strncmp(cmd, "load_core ", 10))
-					{
-						if(isXmlName(cmd)) xml_load(cmd + 10);
-						else fpga_load_rbf(cmd + 10);
-					}
-					else if (!strncmp(cmd, "screenshot", 10))
-					{
-						user_io_screenshot_cmd(cmd);
-					}
-					else if (!strncmp(cmd, "volume ", 7))
-					{
-						if (!strcmp(cmd + 7, "mute")) set_volume(0x81);
-						else if (!strcmp(cmd + 7, "unmute")) set_volume(0x80);
-						else if (cmd[7] >= '0' && cmd[7] <= '7') set_volume(0x40 - 0x30 + cmd[7]);
-					}
+					input_cmd(cmd);
 				}
 			}
 
-			if ((pool[NUMDEV + 2].fd >= 0) && (pool[NUMDEV + 2].revents & POLLPRI))
+			if ((pool[NUMDEV + 2].fd >= 0) && (revents[2] & EPOLLPRI))
 			{
 				static char status[16];
 				if (read(pool[NUMDEV + 2].fd, status, sizeof(status) - 1) && status[0] != '0')
@@ -5652,27 +6621,30 @@ int input_test(int getchar)
 	return 0;
 }
 
-int input_poll(int getchar)
+static int input_poll_run(int getchar)
 {
 	PROFILE_FUNCTION();
 
 	static int af[NUMPLAYERS] = {};
-	static uint32_t time[NUMPLAYERS] = {};
+	static uint64_t time[NUMPLAYERS] = {};
 	static uint32_t joy_prev[NUMPLAYERS] = {};
 
 	int ret = input_test(getchar);
+	latency_cur.dev = -1;
 	if (getchar) return ret;
 
 	uinp_check_key();
+	input_replay_run();
 
 	static int prev_dx = 0;
 	static int prev_dy = 0;
 
 	if (mouse_emu || ((user_io_get_kbdemu() == EMU_MOUSE) && kbd_mouse_emu))
 	{
-		if((prev_dx || mouse_emu_x || prev_dy || mouse_emu_y) && (!mouse_timer || CheckTimer(mouse_timer)))
+		uint64_t now = input_now_ns();
+		if((prev_dx || mouse_emu_x || prev_dy || mouse_emu_y) && (!mouse_timer || now >= mouse_timer))
 		{
-			mouse_timer = GetTimer(20);
+			mouse_timer = now + input_ms_ns(20);
 
 			int dx = mouse_emu_x;
 			int dy = mouse_emu_y;
@@ -5691,14 +6663,17 @@ int input_poll(int getchar)
 	}
 
 	if (!mouse_emu_x && !mouse_emu_y) mouse_timer = 0;
+	else if (mouse_timer) input_timer_at(mouse_timer);
 
 	if (grabbed)
 	{
+		uint64_t now = input_now_ns();
 		for (int i = 0; i < NUMPLAYERS; i++)
 		{
 			if (af_delay[i] < AF_MIN) af_delay[i] = AF_MIN;
 
-			if (!time[i]) time[i] = GetTimer(af_delay[i]);
+			uint64_t period = input_ms_ns(af_delay[i]);
+			if (!time[i]) time[i] = now + period;
 			int send = 0;
 
 			int newdir = ((joy[i] & 0xF) != (joy_prev[i] & 0xF));
@@ -5706,7 +6681,7 @@ int input_poll(int getchar)
 			{
 				if ((joy[i] ^ joy_prev[i]) & autofire[i])
 				{
-					time[i] = GetTimer(af_delay[i]);
+					time[i] = now + period;
 					af[i] = 0;
 				}
 
@@ -5714,9 +6689,10 @@ int input_poll(int getchar)
 				joy_prev[i] = joy[i];
 			}
 
-			if (CheckTimer(time[i]))
+			if (now >= time[i])
 			{
-				time[i] = GetTimer(af_delay[i]);
+				// fixed steps, the rate doesn't depend on when the loop gets here
+				time[i] = (now - time[i] < period) ? time[i] + period : now + period;
 				af[i] = !af[i];
 				if (joy[i] & autofire[i]) send = 1;
 			}
@@ -5724,7 +6700,14 @@ int input_poll(int getchar)
 			if (send)
 			{
 				user_io_digital_joystick(i, af[i] ? joy[i] & ~autofire[i] : joy[i], newdir);
+				latency_sent(&latency_joy[i]);
 			}
+
+			// events which didn't change the state are never sent
+			latency_joy[i].dev = -1;
+
+			// autofire keeps toggling without new device events
+			if (joy[i] & autofire[i]) input_timer_at(time[i]);
 		}
 	}
 
@@ -5735,29 +6718,156 @@ int input_poll(int getchar)
 			if(joy[i]) user_io_digital_joystick(i, 0, 1);
 
 			joy[i] = 0;
+			latency_joy[i].dev = -1;
 			af[i] = 0;
 			autofire[i] = 0;
 		}
 	}
 
+	if (touch_rel) scheduler_wake_in(1);
+
+	// motion of all mice is accumulated and sent once per period, buttons right away
 	if (mouse_req)
 	{
-		static uint32_t old_time = 0;
-		uint32_t time = GetTimer(0);
-		if ((time - old_time > 15) || (mouse_req & 2))
+		static uint64_t old_time = 0;
+		uint64_t time = input_now_ns();
+		uint64_t period = 16000000;
+		if (cfg.mouse_sync)
+		{
+			uint32_t frame = video_frame_us();
+			if (frame >= 4000 && frame <= 50000) period = frame * 1000ULL;
+		}
+
+		int due = (time - old_time >= period);
+		if (due || (mouse_req & 2))
 		{
-			old_time = time;
+			// keep the cadence while the mouse is moving
+			old_time = (due && time - old_time < period * 2) ? old_time + period : time;
 			user_io_mouse(mouse_btn | mice_btn, mouse_x, mouse_y, mouse_w);
 			mouse_req = 0;
 			mouse_x = 0;
 			mouse_y = 0;
 			mouse_w = 0;
 		}
+		else input_timer_at(old_time + period);
 	}
 
+	input_timer_arm();
 	return 0;
 }
 
+static pthread_mutex_t input_mutex;
+static int input_thread_on = 0;
+static thread_local int input_in_thread = 0;
+
+void input_lock()
+{
+	if (input_thread_on) pthread_mutex_lock(&input_mutex);
+}
+
+void input_unlock()
+{
+	if (input_thread_on) pthread_mutex_unlock(&input_mutex);
+}
+
+static void *input_thread(void *)
+{
+	input_in_thread = 1;
+
+	for (;;)
+	{
+		// sleep until a device has something, autofire and mouse emulation still need the tick.
+		// input_epfd is replaced on rescan, a stale one just fails once.
+		struct epoll_event ev;
+		int fd = input_epfd;
+		if (fd < 0 || epoll_wait(fd, &ev, 1, INPUT_THREAD_TICK_MS) < 0) usleep(INPUT_THREAD_TICK_MS * 1000);
+
+		// main loop handles the reload
+		if (!is_fpga_ready(1)) continue;
+
+		pthread_mutex_lock(&input_mutex);
+		input_poll_run(0);
+		pthread_mutex_unlock(&input_mutex);
+	}
+
+	return nullptr;
+}
+
+static void input_thread_start()
+{
+	pthread_mutexattr_t mattr;
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&input_mutex, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	spi_share();
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	// core #0 with the offload workers, which it preempts. Main keeps core #1.
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	struct sched_param param = {};
+	param.sched_priority = INPUT_THREAD_PRIO;
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &param);
+
+	pthread_t tid;
+	int err = pthread_create(&tid, &attr, input_thread, nullptr);
+	if (err == EPERM)
+	{
+		printf("input: no realtime priority for the input thread.\n");
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		err = pthread_create(&tid, &attr, input_thread, nullptr);
+	}
+	pthread_attr_destroy(&attr);
+
+	if (err)
+	{
+		printf("input: failed to start the input thread (%d), polling in the main loop.\n", err);
+		return;
+	}
+
+	pthread_detach(tid);
+	input_thread_on = 1;
+	printf("input: devices are served by the input thread.\n");
+}
+
+int input_poll(int getchar)
+{
+	static int thread_tried = 0;
+
+	if (input_thread_on && !input_in_thread)
+	{
+		// the thread gets the events first, waiting for a key here may miss some
+		if (!getchar) return 0;
+
+		input_lock();
+		int ret = input_poll_run(1);
+		input_unlock();
+		return ret;
+	}
+
+	int ret = input_poll_run(getchar);
+
+	// the first poll opens the devices here, so early boot checks (is_key_pressed) still work.
+	// The menu core stays in the main loop, it sleeps in input_test() there.
+	if (!getchar && !thread_tried && cfg.input_thread && !is_menu())
+	{
+		thread_tried = 1;
+		input_thread_start();
+	}
+
+	return ret;
+}
+
 int is_key_pressed(int key)
 {
 	unsigned char bits[(KEY_MAX + 7) / 8];
@@ -5815,6 +6925,21 @@ int input_state()
 	return grabbed;
 }
 
+// Devices stay open over an in-place core switch, only what belongs to the old core is dropped.
+void input_core_switch()
+{
+	reset_players();
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		input[i].has_map = 0;
+		input[i].has_jkmap = 0;
+		if (pool[i].fd >= 0 && (input[i].quirk == QUIRK_WIIMOTE || input[i].quirk == QUIRK_TOUCHGUN ||
+			input[i].quirk == QUIRK_LIGHTGUN || input[i].quirk == QUIRK_LIGHTGUN_CRT)) input_lightgun_load(i);
+	}
+	dispatch_reset();
+	input_switch(1);
+}
+
 static char ovr_buttons[1024] = {};
 static char ovr_nmap[1024] = {};
 static char ovr_pmap[1024] = {};
@@ -78,6 +78,19 @@ void sysled_enable(int en);
 
 void input_notify_mode();
 int input_poll(int getchar);
+
+// With input_thread=1 the devices are served by a thread of their own.
+// The main loop holds this while it reads or changes input state (UI, user_io_poll).
+// No-op otherwise.
+void input_lock();
+void input_unlock();
+
+// kernel -> core latency of all devices, HIST_BUCKETS log2 buckets in us
+// (see counters.h). Cleared by "latency reset". Under input_lock().
+void input_latency_buckets(uint32_t *buckets);
+
+// runs a MiSTer_cmd command, 0 if it's unknown
+int input_cmd(char *cmd);
 int is_key_pressed(int key);
 
 void start_map_setting(int cnt, int set = 0);
@@ -103,6 +116,7 @@ int input_has_lightgun();
 void input_lightgun_save(int idx, int32_t *cal);
 
 void input_switch(int grab);
+void input_core_switch();
 int input_state();
 void input_uinp_destroy();
 
@@ -373,6 +373,11 @@ struct _chd_verify_result
 CHD_EXPORT chd_error chd_open_file(core_file *file, int mode, chd_file *parent, chd_file **chd);
 CHD_EXPORT chd_error chd_open(const char *filename, int mode, chd_file *parent, chd_file **chd);
 
+/* same as chd_open(), but a v5 map is copied from rawmap (header.rawmap of an
+   earlier open of the same file) instead of read and decoded. It is decoded
+   as usual if rawmaplen doesn't match. */
+CHD_EXPORT chd_error chd_open_map(const char *filename, int mode, chd_file *parent, const void *rawmap, UINT32 rawmaplen, chd_file **chd);
+
 /* precache underlying file */
 CHD_EXPORT chd_error chd_precache(chd_file *chd);
 
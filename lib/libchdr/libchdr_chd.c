@@ -1338,10 +1338,11 @@ static inline void map_extract_old(const UINT8 *base, map_entry *entry, UINT32 h
 ***************************************************************************/
 
 /*-------------------------------------------------
-    chd_open_file - open a CHD file for access
+    chd_open_file_map - open a CHD file for access,
+    taking the v5 map from rawmap if it is given
 -------------------------------------------------*/
 
-CHD_EXPORT chd_error chd_open_file(core_file *file, int mode, chd_file *parent, chd_file **chd)
+static chd_error chd_open_file_map(core_file *file, int mode, chd_file *parent, const void *rawmap, UINT32 rawmaplen, chd_file **chd)
 {
 	chd_file *newchd = NULL;
 	chd_error err;
@@ -1409,6 +1410,13 @@ CHD_EXPORT chd_error chd_open_file(core_file *file, int mode, chd_file *parent,
 		if (err != CHDERR_NONE)
 			EARLY_EXIT(err);
 	}
+	else if (rawmap != NULL && rawmaplen == (UINT32)map_size_v5(&newchd->header))
+	{
+		newchd->header.rawmap = (uint8_t*)malloc(rawmaplen);
+		if (newchd->header.rawmap == NULL)
+			EARLY_EXIT(err = CHDERR_OUT_OF_MEMORY);
+		memcpy(newchd->header.rawmap, rawmap, rawmaplen);
+	}
 	else
 	{
 		err = decompress_v5_map(newchd, &(newchd->header));
@@ -1516,6 +1524,15 @@ cleanup:
 	return err;
 }
 
+/*-------------------------------------------------
+    chd_open_file - open a CHD file for access
+-------------------------------------------------*/
+
+CHD_EXPORT chd_error chd_open_file(core_file *file, int mode, chd_file *parent, chd_file **chd)
+{
+	return chd_open_file_map(file, mode, parent, NULL, 0, chd);
+}
+
 /*-------------------------------------------------
     chd_precache - precache underlying file in
     memory
@@ -1552,11 +1569,11 @@ CHD_EXPORT chd_error chd_precache(chd_file *chd)
 }
 
 /*-------------------------------------------------
-    chd_open - open a CHD file by
-    filename
+    chd_open_map - open a CHD file by filename
+    with a map decoded by an earlier open
 -------------------------------------------------*/
 
-CHD_EXPORT chd_error chd_open(const char *filename, int mode, chd_file *parent, chd_file **chd)
+CHD_EXPORT chd_error chd_open_map(const char *filename, int mode, chd_file *parent, const void *rawmap, UINT32 rawmaplen, chd_file **chd)
 {
 	chd_error err;
 	core_file *file = NULL;
@@ -1581,7 +1598,7 @@ CHD_EXPORT chd_error chd_open(const char *filename, int mode, chd_file *parent,
 	}
 
 	/* now open the CHD */
-	err = chd_open_file(file, mode, parent, chd);
+	err = chd_open_file_map(file, mode, parent, rawmap, rawmaplen, chd);
 	if (err != CHDERR_NONE)
 		goto cleanup;
 
@@ -1594,6 +1611,16 @@ cleanup:
 	return err;
 }
 
+/*-------------------------------------------------
+    chd_open - open a CHD file by
+    filename
+-------------------------------------------------*/
+
+CHD_EXPORT chd_error chd_open(const char *filename, int mode, chd_file *parent, chd_file **chd)
+{
+	return chd_open_map(filename, mode, parent, NULL, 0, chd);
+}
+
 /*-------------------------------------------------
     chd_close - close a CHD file for access
 -------------------------------------------------*/
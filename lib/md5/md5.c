@@ -122,11 +122,10 @@ MD5Update(ctx, buf, len)
 		len -= t;
 	}
 
-	/* Process data in 64-byte chunks */
+	/* Process data in 64-byte chunks, straight from the caller's buffer */
 
 	while (len >= 64) {
-		memcpy(ctx->in, buf, 64);
-		MD5Transform(ctx->buf, ctx->in);
+		MD5Transform(ctx->buf, buf);
 		buf += 64;
 		len -= 64;
 	}
@@ -190,7 +189,10 @@ MD5Final(digest, ctx)
 
 /* #define F1(x, y, z) (x & y | ~x & z) */
 #define F1(x, y, z) (z ^ (x & (y ^ z)))
-#define F2(x, y, z) F1(z, x, y)
+/* #define F2(x, y, z) F1(z, x, y) */
+/* The terms are disjoint, so + works like | and leaves (y & ~z) + data off the
+   chain through x, the result of the previous step */
+#define F2(x, y, z) ((x & z) + (y & ~z))
 #define F3(x, y, z) (x ^ y ^ z)
 #define F4(x, y, z) (y ^ (x | ~z))
 
@@ -212,6 +214,13 @@ MD5Transform(buf, inraw)
 	uint32 in[16];
 	int i;
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/* The words are in MD5 byte order already. Where uint32 is exactly 32
+	   bits (ARM), a block copy loads them without assembling each byte. */
+	if (sizeof(uint32) == 4) {
+		memcpy(in, inraw, 64);
+	} else
+#endif
 	for (i = 0; i < 16; ++i)
 		in[i] = getu32 (inraw + 4 * i);
 
@@ -85,9 +85,7 @@ mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
 #else
 /* Faster, but larger CPU cache footprint.
  */
-mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
-{
-    static const mz_uint32 s_crc_table[256] =
+static const mz_uint32 s_crc_table[256] =
         {
           0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535,
           0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD,
@@ -128,9 +126,55 @@ mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
           0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
         };
 
+#if MINIZ_LITTLE_ENDIAN && defined(__GNUC__)
+/* Slicing-by-8: s_crc_slice[n][b] is the crc of byte b followed by n + 1 zero bytes, which
+   takes eight bytes per step with independent lookups. The tables are 7KB and stay in L1.
+   They are filled before main(), so the workers calling mz_crc32() never see them half done. */
+static mz_uint32 s_crc_slice[7][256];
+
+__attribute__((constructor)) static void mz_crc32_init_slices(void)
+{
+    int i, n;
+    for (i = 0; i < 256; i++)
+    {
+        mz_uint32 c = s_crc_table[i];
+        for (n = 0; n < 7; n++)
+        {
+            c = (c >> 8) ^ s_crc_table[c & 0xFF];
+            s_crc_slice[n][i] = c;
+        }
+    }
+}
+#endif
+
+mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
+{
     mz_uint32 crc32 = (mz_uint32)crc ^ 0xFFFFFFFF;
     const mz_uint8 *pByte_buf = (const mz_uint8 *)ptr;
 
+#if MINIZ_LITTLE_ENDIAN && defined(__GNUC__)
+    while (buf_len && ((size_t)pByte_buf & 3))
+    {
+        crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ pByte_buf[0]) & 0xFF];
+        ++pByte_buf;
+        --buf_len;
+    }
+
+    while (buf_len >= 8)
+    {
+        mz_uint32 lo, hi;
+        memcpy(&lo, pByte_buf, 4);
+        memcpy(&hi, pByte_buf + 4, 4);
+        lo ^= crc32;
+        crc32 = s_crc_slice[6][lo & 0xFF] ^ s_crc_slice[5][(lo >> 8) & 0xFF] ^
+                s_crc_slice[4][(lo >> 16) & 0xFF] ^ s_crc_slice[3][lo >> 24] ^
+                s_crc_slice[2][hi & 0xFF] ^ s_crc_slice[1][(hi >> 8) & 0xFF] ^
+                s_crc_slice[0][(hi >> 16) & 0xFF] ^ s_crc_table[hi >> 24];
+        pByte_buf += 8;
+        buf_len -= 8;
+    }
+#endif
+
     while (buf_len >= 4)
     {
         crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ pByte_buf[0]) & 0xFF];
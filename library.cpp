@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <map>
+#include <algorithm>
+
+#include "library.h"
+#include "file_io.h"
+
+#define LIB_MAGIC  0x3142494C // "LIB1"
+#define LIB_DEPTH  16
+#define LIB_QUIET  1000 // ms without changes before the dirty folders are read
+#define LIB_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct libFile
+{
+	std::string name;
+	uint64_t size;
+	uint32_t mtime;
+};
+
+struct libDir
+{
+	uint32_t mtime = 0;
+	int wd = -1;
+	int dirty = 0;
+	std::vector<std::string> subdirs;
+	std::vector<libFile> files;
+};
+
+// Keyed by full path, a folder and everything below it are one range of
+// the map. Only the thread changes it, always under lib_lock.
+static std::map<std::string, libDir> lib_dirs;
+static std::map<int, std::string> lib_wds;
+static pthread_mutex_t lib_lock = PTHREAD_MUTEX_INITIALIZER;
+static int lib_ino = -1;
+static int lib_changed = 0;
+static int lib_busy = 0;
+static int lib_files = 0;
+static char lib_file[1024];
+static std::vector<std::string> lib_roots;
+
+static void lib_put(std::vector<uint8_t> &buf, const void *data, size_t len)
+{
+	buf.insert(buf.end(), (const uint8_t*)data, (const uint8_t*)data + len);
+}
+
+static void lib_put_str(std::vector<uint8_t> &buf, const std::string &str)
+{
+	uint16_t len = str.size();
+	lib_put(buf, &len, sizeof(len));
+	lib_put(buf, str.data(), len);
+}
+
+static int lib_get(const uint8_t *&p, const uint8_t *end, void *data, size_t len)
+{
+	if ((size_t)(end - p) < len) return 0;
+	memcpy(data, p, len);
+	p += len;
+	return 1;
+}
+
+static int lib_get_str(const uint8_t *&p, const uint8_t *end, std::string &str)
+{
+	uint16_t len;
+	if (!lib_get(p, end, &len, sizeof(len)) || (size_t)(end - p) < len) return 0;
+	str.assign((const char*)p, len);
+	p += len;
+	return 1;
+}
+
+static void lib_save()
+{
+	std::vector<uint8_t> buf;
+	uint32_t val = LIB_MAGIC;
+	lib_put(buf, &val, sizeof(val));
+
+	pthread_mutex_lock(&lib_lock);
+	val = lib_dirs.size();
+	lib_put(buf, &val, sizeof(val));
+	for (auto &it : lib_dirs)
+	{
+		const libDir &d = it.second;
+		lib_put_str(buf, it.first);
+		lib_put(buf, &d.mtime, sizeof(d.mtime));
+
+		val = d.subdirs.size();
+		lib_put(buf, &val, sizeof(val));
+		for (auto &s : d.subdirs) lib_put_str(buf, s);
+
+		val = d.files.size();
+		lib_put(buf, &val, sizeof(val));
+		for (auto &f : d.files)
+		{
+			lib_put_str(buf, f.name);
+			lib_put(buf, &f.size, sizeof(f.size));
+			lib_put(buf, &f.mtime, sizeof(f.mtime));
+		}
+	}
+	lib_changed = 0;
+	pthread_mutex_unlock(&lib_lock);
+
+	// written next to it and renamed, a power loss leaves the old index
+	std::string tmp = std::string(lib_file) + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if (!fp) return;
+	int ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+	if (fclose(fp)) ok = 0;
+	if (!ok || rename(tmp.c_str(), lib_file)) unlink(tmp.c_str());
+}
+
+static void lib_load()
+{
+	FILE *fp = fopen(lib_file, "rb");
+	if (!fp) return;
+
+	std::vector<uint8_t> buf;
+	uint8_t chunk[16384];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) buf.insert(buf.end(), chunk, chunk + n);
+	fclose(fp);
+
+	const uint8_t *p = buf.data(), *end = p + buf.size();
+	uint32_t magic, ndirs;
+	if (!lib_get(p, end, &magic, sizeof(magic)) || magic != LIB_MAGIC || !lib_get(p, end, &ndirs, sizeof(ndirs))) return;
+
+	std::map<std::string, libDir> dirs;
+	int files = 0;
+	for (uint32_t i = 0; i < ndirs; i++)
+	{
+		std::string path;
+		libDir d;
+		uint32_t cnt;
+		if (!lib_get_str(p, end, path) || !lib_get(p, end, &d.mtime, sizeof(d.mtime)) || !lib_get(p, end, &cnt, sizeof(cnt))) return;
+
+		d.subdirs.resize(cnt);
+		for (auto &s : d.subdirs) if (!lib_get_str(p, end, s)) return;
+
+		if (!lib_get(p, end, &cnt, sizeof(cnt))) return;
+		d.files.resize(cnt);
+		for (auto &f : d.files)
+		{
+			if (!lib_get_str(p, end, f.name) || !lib_get(p, end, &f.size, sizeof(f.size)) || !lib_get(p, end, &f.mtime, sizeof(f.mtime))) return;
+		}
+		files += cnt;
+		dirs[path].files.swap(d.files);
+		dirs[path].subdirs.swap(d.subdirs);
+		dirs[path].mtime = d.mtime;
+	}
+
+	pthread_mutex_lock(&lib_lock);
+	lib_dirs.swap(dirs);
+	lib_files = files;
+	pthread_mutex_unlock(&lib_lock);
+	printf("library: %d files in %u folders from the index\n", files, ndirs);
+}
+
+// path and everything below it, under lib_lock
+static void lib_drop_tree(const std::string &path)
+{
+	std::string prefix = path + "/";
+	auto it = lib_dirs.lower_bound(path);
+	while (it != lib_dirs.end() && (it->first == path || !it->first.compare(0, prefix.size(), prefix)))
+	{
+		if (it->second.wd >= 0)
+		{
+			inotify_rm_watch(lib_ino, it->second.wd);
+			lib_wds.erase(it->second.wd);
+		}
+		lib_files -= it->second.files.size();
+		it = lib_dirs.erase(it);
+		lib_changed = 1;
+	}
+}
+
+// Reads the folder if it's new, dirty or its mtime changed, then goes on
+// with its subfolders. Unchanged ones cost a stat().
+static void lib_scan(const std::string &path, int depth)
+{
+	struct stat64 st;
+	if (stat64(path.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+	{
+		pthread_mutex_lock(&lib_lock);
+		lib_drop_tree(path);
+		pthread_mutex_unlock(&lib_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&lib_lock);
+	libDir *d = &lib_dirs[path];
+	int fresh = d->dirty || !d->mtime || d->mtime != (uint32_t)st.st_mtime;
+	d->dirty = 0;
+	if (d->wd < 0 && lib_ino >= 0)
+	{
+		d->wd = inotify_add_watch(lib_ino, path.c_str(), LIB_EVENTS | IN_ONLYDIR);
+		if (d->wd >= 0) lib_wds[d->wd] = path;
+	}
+	std::vector<std::string> subs = d->subdirs;
+	pthread_mutex_unlock(&lib_lock);
+
+	if (fresh)
+	{
+		DIR *dir = opendir(path.c_str());
+		if (!dir) return;
+
+		std::vector<libFile> files;
+		std::vector<std::string> found;
+		struct dirent64 *de;
+		while ((de = readdir64(dir)))
+		{
+			if (de->d_name[0] == '.') continue;
+
+			struct stat64 fst;
+			if (fstatat64(dirfd(dir), de->d_name, &fst, 0) < 0) continue;
+
+			if (S_ISDIR(fst.st_mode)) found.push_back(de->d_name);
+			else if (S_ISREG(fst.st_mode)) files.push_back({ de->d_name, (uint64_t)fst.st_size, (uint32_t)fst.st_mtime });
+		}
+		closedir(dir);
+
+		pthread_mutex_lock(&lib_lock);
+		for (auto &s : subs)
+		{
+			if (std::find(found.begin(), found.end(), s) == found.end()) lib_drop_tree(path + "/" + s);
+		}
+
+		d = &lib_dirs[path];
+		lib_files += (int)files.size() - (int)d->files.size();
+		d->files.swap(files);
+		d->subdirs = found;
+		d->mtime = st.st_mtime;
+		lib_changed = 1;
+		pthread_mutex_unlock(&lib_lock);
+
+		subs.swap(found);
+	}
+
+	if (depth < LIB_DEPTH)
+	{
+		for (auto &s : subs) lib_scan(path + "/" + s, depth + 1);
+	}
+}
+
+static void lib_scan_all()
+{
+	for (auto &root : lib_roots) lib_scan(root, 0);
+}
+
+// inotify events: marks the touched folders, 1 if a full walk is needed
+static int lib_events()
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int all = 0;
+
+	while (1)
+	{
+		ssize_t len = read(lib_ino, buf, sizeof(buf));
+		if (len <= 0) break;
+
+		pthread_mutex_lock(&lib_lock);
+		for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len)
+		{
+			const struct inotify_event *ev = (const struct inotify_event*)ptr;
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				all = 1;
+				continue;
+			}
+
+			auto wd = lib_wds.find(ev->wd);
+			if (wd == lib_wds.end()) continue;
+
+			auto it = lib_dirs.find(wd->second);
+			if (ev->mask & IN_IGNORED)
+			{
+				// folder gone or unmounted, its parent is dirty as well
+				if (it != lib_dirs.end()) it->second.wd = -1;
+				lib_wds.erase(wd);
+			}
+			else if (it != lib_dirs.end()) it->second.dirty = 1;
+		}
+		pthread_mutex_unlock(&lib_lock);
+	}
+
+	return all;
+}
+
+static void lib_rescan_dirty()
+{
+	std::vector<std::string> dirty;
+	pthread_mutex_lock(&lib_lock);
+	for (auto &it : lib_dirs) if (it.second.dirty) dirty.push_back(it.first);
+	pthread_mutex_unlock(&lib_lock);
+
+	// the walk of a folder also covers the dirty ones below it
+	std::string last;
+	for (auto &path : dirty)
+	{
+		if (!last.empty() && !path.compare(0, last.size() + 1, last + "/")) continue;
+		lib_scan(path, 0);
+		last = path;
+	}
+}
+
+static void *lib_thread(void *)
+{
+	// storage is shared with the core loading, stay out of its way
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	lib_load();
+
+	lib_ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (lib_ino < 0) printf("library: no inotify, changes are picked up on the next start\n");
+
+	lib_scan_all();
+	if (lib_changed) lib_save();
+
+	int files, dirs, busy;
+	library_status(&files, &dirs, &busy);
+	printf("library: %d files in %d folders\n", files, dirs);
+	lib_busy = 0;
+
+	if (lib_ino < 0) return (void *)0;
+
+	while (1)
+	{
+		struct pollfd pfd = { lib_ino, POLLIN, 0 };
+		if (poll(&pfd, 1, -1) <= 0) continue;
+
+		// collect the changes until things are quiet, a copy adds many files
+		int all = lib_events();
+		while (poll(&pfd, 1, LIB_QUIET) > 0) all |= lib_events();
+
+		lib_busy = 1;
+		if (all) lib_scan_all();
+		else lib_rescan_dirty();
+		if (lib_changed) lib_save();
+		lib_busy = 0;
+	}
+
+	return (void *)0;
+}
+
+void library_start()
+{
+	lib_busy = 1;
+	snprintf(lib_file, sizeof(lib_file), "%s/%s/library.bin", getRootDir(), CONFIG_DIR);
+
+	lib_roots.push_back(std::string(getRootDir()) + "/" + GAMES_DIR);
+	for (int i = 0; i < 6; i++)
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/media/usb%d/%s", i, GAMES_DIR);
+		lib_roots.push_back(path);
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	pthread_t thread;
+	if (!pthread_create(&thread, &attr, lib_thread, 0)) pthread_detach(thread);
+	pthread_attr_destroy(&attr);
+}
+
+// core folder of path (games/<core>/...), 0 if it's not below a games folder
+static const char *lib_core(const std::string &path, size_t *len)
+{
+	const char *p = strstr(path.c_str(), "/" GAMES_DIR "/");
+	if (!p) return 0;
+
+	p += strlen(GAMES_DIR) + 2;
+	const char *e = strchr(p, '/');
+	*len = e ? (size_t)(e - p) : strlen(p);
+	return p;
+}
+
+int library_find(const char *text, const char *core, std::vector<libMatch> &out, int max)
+{
+	int cnt = 0;
+	size_t core_len = (core && *core) ? strlen(core) : 0;
+
+	pthread_mutex_lock(&lib_lock);
+	for (auto &it : lib_dirs)
+	{
+		if (core_len)
+		{
+			size_t len;
+			const char *c = lib_core(it.first, &len);
+			if (!c || len != core_len || strncasecmp(c, core, len)) continue;
+		}
+
+		for (auto &f : it.second.files)
+		{
+			if (!strcasestr(f.name.c_str(), text)) continue;
+			if (cnt++ < max) out.push_back({ it.first + "/" + f.name, f.size, f.mtime });
+		}
+	}
+	pthread_mutex_unlock(&lib_lock);
+
+	return cnt;
+}
+
+void library_status(int *files, int *dirs, int *busy)
+{
+	pthread_mutex_lock(&lib_lock);
+	*files = lib_files;
+	*dirs = lib_dirs.size();
+	*busy = lib_busy;
+	pthread_mutex_unlock(&lib_lock);
+}
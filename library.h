@@ -0,0 +1,31 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+// Index of the games folders (games/ of the SD card and of the USB drives).
+// A background thread on core #0 walks them once, keeps the result in
+// CONFIG_DIR/library.bin and follows changes with inotify. On the next
+// start only folders whose mtime changed are read again. Enabled by
+// library_index in MiSTer.ini.
+
+struct libMatch
+{
+	std::string path; // full path
+	uint64_t size;
+	uint32_t mtime;
+};
+
+void library_start();
+
+// files with text in their name (case insensitive), at most max. core, if
+// given, limits the search to games/<core>. Returns the number of matches,
+// which can be more than were put into out.
+int library_find(const char *text, const char *core, std::vector<libMatch> &out, int max);
+
+// files and folders indexed, busy while walking or catching up with changes
+void library_status(int *files, int *dirs, int *busy);
+
+#endif
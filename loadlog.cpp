@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "loadlog.h"
+#include "file_io.h"
+#include "hardware.h"
+#include "offload.h"
+#include "user_io.h"
+
+#define LOADLOG_GAP      3000 // ms without a phase before the launch is done
+#define LOADLOG_MAX      500  // launches kept in the history
+#define LOADLOG_FILE     "loads.log"
+#define LOADLOG_HANDOVER "/tmp/MiSTer_load_rbf"
+
+extern const char *version;
+
+static const char *phase_names[LOAD_NUM] = { "rbf", "mra", "rom", "crc", "ss", "save" };
+
+static uint32_t cur_us[LOAD_NUM];
+static char cur_file[256];
+static int cur_open = 0;
+static unsigned long cur_timer = 0;
+static int handover_read = 0;
+
+static void history_path(char *path, int size)
+{
+	snprintf(path, size, "%s/%s/%s", getRootDir(), CONFIG_DIR, LOADLOG_FILE);
+}
+
+static void read_lines(const char *path, std::vector<std::string> &lines)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp) return;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), fp)) if (line[0] != '#' && strchr(line, '\n')) lines.push_back(line);
+	fclose(fp);
+}
+
+// bulk worker: the history with the new line, the oldest ones dropped
+static void history_append(char *line)
+{
+	char path[1024];
+	history_path(path, sizeof(path));
+
+	std::vector<std::string> lines;
+	read_lines(path, lines);
+	lines.push_back(line);
+	free(line);
+
+	size_t first = (lines.size() > LOADLOG_MAX) ? lines.size() - LOADLOG_MAX : 0;
+
+	// written next to it and renamed, a power loss leaves the old history
+	std::string tmp = std::string(path) + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if (!fp) return;
+
+	fprintf(fp, "# time firmware core rbf mra rom crc ss save (us) file\n");
+	for (size_t i = first; i < lines.size(); i++) fputs(lines[i].c_str(), fp);
+	if (fclose(fp) || rename(tmp.c_str(), path)) unlink(tmp.c_str());
+}
+
+void loadlog_add(int phase, uint32_t us, const char *file)
+{
+	if (phase < 0 || phase >= LOAD_NUM) return;
+
+	if (!cur_open)
+	{
+		memset(cur_us, 0, sizeof(cur_us));
+		cur_file[0] = 0;
+		cur_open = 1;
+	}
+	cur_us[phase] += us;
+
+	// the launch is named after its game, the core only if there is none
+	if (file && *file && (phase != LOAD_RBF || !cur_file[0]))
+	{
+		const char *p = strrchr(file, '/');
+		snprintf(cur_file, sizeof(cur_file), "%s", p ? p + 1 : file);
+	}
+	cur_timer = GetTimer(LOADLOG_GAP);
+}
+
+void loadlog_handover()
+{
+	if (!cur_open || !cur_us[LOAD_RBF]) return;
+
+	FILE *fp = fopen(LOADLOG_HANDOVER, "w");
+	if (!fp) return;
+	fprintf(fp, "%u %s\n", cur_us[LOAD_RBF], cur_file);
+	fclose(fp);
+}
+
+void loadlog_poll()
+{
+	if (!handover_read)
+	{
+		handover_read = 1;
+		FILE *fp = fopen(LOADLOG_HANDOVER, "r");
+		if (fp)
+		{
+			uint32_t us;
+			char name[256] = {};
+			if (fscanf(fp, "%u %255[^\n]", &us, name) >= 1) loadlog_add(LOAD_RBF, us, name);
+			fclose(fp);
+			unlink(LOADLOG_HANDOVER);
+		}
+	}
+
+	if (!cur_open || !CheckTimer(cur_timer)) return;
+	cur_open = 0;
+
+	// loading the menu core isn't a launch
+	if (is_menu()) return;
+
+	char *line = (char*)malloc(512);
+	if (!line) return;
+
+	const char *core = user_io_get_core_name();
+	int len = snprintf(line, 512, "%lu %s %s", (unsigned long)time(NULL), version + 5, *core ? core : "-");
+	for (int i = 0; i < LOAD_NUM; i++) len += snprintf(line + len, 512 - len, " %u", cur_us[i]);
+	snprintf(line + len, 512 - len, " %s\n", cur_file);
+
+	offload_add_work([line] { history_append(line); }, OFFLOAD_PRIO_BULK);
+}
+
+struct loadStats
+{
+	std::vector<uint32_t> total;
+	std::vector<uint32_t> phase[LOAD_NUM];
+};
+
+static uint32_t percentile(std::vector<uint32_t> &v, int pct)
+{
+	if (v.empty()) return 0;
+	std::sort(v.begin(), v.end());
+	size_t n = (v.size() * pct + 99) / 100;
+	return v[n ? n - 1 : 0];
+}
+
+void loadlog_report(std::string &out)
+{
+	char path[1024];
+	history_path(path, sizeof(path));
+
+	std::vector<std::string> lines;
+	read_lines(path, lines);
+
+	struct loadRec
+	{
+		char ver[32], core[64];
+		uint32_t us[LOAD_NUM];
+	};
+
+	std::vector<loadRec> recs;
+	for (auto &l : lines)
+	{
+		loadRec r;
+		unsigned long t;
+		if (sscanf(l.c_str(), "%lu %31s %63s %u %u %u %u %u %u", &t, r.ver, r.core,
+			&r.us[0], &r.us[1], &r.us[2], &r.us[3], &r.us[4], &r.us[5]) == 3 + LOAD_NUM) recs.push_back(r);
+	}
+
+	// the firmware before this one is the latest other one in the history
+	const char *fw = version + 5;
+	std::string prev;
+	for (auto &r : recs) if (strcmp(r.ver, fw)) prev = r.ver;
+
+	std::map<std::string, loadStats> now, before;
+	for (auto &r : recs)
+	{
+		int cur = !strcmp(r.ver, fw);
+		if (!cur && prev != r.ver) continue;
+
+		uint32_t total = 0;
+		for (int i = 0; i < LOAD_NUM; i++) if (i != LOAD_CRC) total += r.us[i]; // crc is part of rom
+
+		loadStats &s = cur ? now[r.core] : before[r.core];
+		s.total.push_back(total);
+		for (int i = 0; i < LOAD_NUM; i++) s.phase[i].push_back(r.us[i]);
+	}
+
+	char line[256];
+	snprintf(line, sizeof(line), "# firmware %s, previous %s, times in ms\n# core loads median p95 prev_median change", fw, prev.empty() ? "none" : prev.c_str());
+	out += line;
+	for (int i = 0; i < LOAD_NUM; i++)
+	{
+		out += " ";
+		out += phase_names[i];
+	}
+	out += "\n";
+
+	for (auto &it : now)
+	{
+		loadStats &s = it.second;
+		uint32_t med = percentile(s.total, 50);
+		int len = snprintf(line, sizeof(line), "%s %u %u %u", it.first.c_str(), (uint32_t)s.total.size(), med / 1000, percentile(s.total, 95) / 1000);
+
+		auto b = before.find(it.first);
+		if (b != before.end())
+		{
+			uint32_t old = percentile(b->second.total, 50);
+			int change = old ? (int)(((int64_t)med - old) * 100 / old) : 0;
+			len += snprintf(line + len, sizeof(line) - len, " %u %+d%%", old / 1000, change);
+		}
+		else len += snprintf(line + len, sizeof(line) - len, " - -");
+
+		for (int i = 0; i < LOAD_NUM; i++) len += snprintf(line + len, sizeof(line) - len, " %u", percentile(s.phase[i], 50) / 1000);
+		snprintf(line + len, sizeof(line) - len, "\n");
+		out += line;
+	}
+}
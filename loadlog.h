@@ -0,0 +1,37 @@
+#ifndef LOADLOG_H
+#define LOADLOG_H
+
+#include <inttypes.h>
+#include <string>
+
+// Timing of each launch: core (RBF) load, MRA, ROM read and transfer, its
+// crc, the savestate preload and the save mount. Phases of one launch come
+// within LOADLOG_GAP of each other. The record is written to the history
+// in the config folder once the launch has been quiet that long. The RBF
+// time is handed over to the process started after it.
+
+enum
+{
+	LOAD_RBF,
+	LOAD_MRA,
+	LOAD_ROM,
+	LOAD_CRC,
+	LOAD_SS,
+	LOAD_SAVE,
+	LOAD_NUM
+};
+
+// us spent in the phase, file (if given) is what the launch is named after
+void loadlog_add(int phase, uint32_t us, const char *file = 0);
+
+// before app_restart, the RBF time goes to the next process
+void loadlog_handover();
+
+// closes the record of a finished launch, main loop
+void loadlog_poll();
+
+// per core median and p95 of the launches with this firmware, and the
+// change against the one before it. "loads" on MiSTer_sock.
+void loadlog_report(std::string &out);
+
+#endif
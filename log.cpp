@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <atomic>
+
+#include "log.h"
+#include "counters.h"
+#include "hardware.h"
+
+#define LOG_SLOTS 256 // must be pow2
+#define LOG_LINE  252 // longer lines are cut
+
+// Same ring as the offload queues: any number of producers, the writer
+// thread as the only consumer, semaphores counting the free and filled
+// slots. A producer only ever tries for a slot, it never waits.
+struct logCell
+{
+	std::atomic<uint32_t> seq; // pos + 1 once the line at pos is published
+	char text[LOG_LINE];
+};
+
+int log_level = LOGL_INFO;
+
+static logCell s_ring[LOG_SLOTS];
+static std::atomic<uint32_t> s_head; // next position claimed by a producer
+static std::atomic<uint32_t> s_done; // lines written out
+static std::atomic<uint32_t> s_dropped;
+static sem_t s_items, s_slots;
+static FILE *s_file = 0;
+static int s_running = 0;
+
+static void sem_wait_intr(sem_t *sem)
+{
+	while (sem_wait(sem) < 0 && errno == EINTR) {}
+}
+
+static void log_write(const char *text)
+{
+	fputs(text, stdout);
+	if (s_file) fputs(text, s_file);
+}
+
+static void *log_thread(void *)
+{
+	uint32_t tail = 0;
+	while (true)
+	{
+		sem_wait_intr(&s_items);
+
+		// producer may have claimed the cell but not published it yet
+		logCell *cell = &s_ring[tail % LOG_SLOTS];
+		while (cell->seq.load(std::memory_order_acquire) != tail + 1) sched_yield();
+
+		log_write(cell->text);
+		tail++;
+		sem_post(&s_slots);
+
+		uint32_t dropped = s_dropped.exchange(0);
+		if (dropped)
+		{
+			char msg[64];
+			snprintf(msg, sizeof(msg), "log: %u lines dropped\n", dropped);
+			log_write(msg);
+		}
+
+		// flushed once the ring runs empty, not after every line
+		int left = 0;
+		sem_getvalue(&s_items, &left);
+		if (!left)
+		{
+			fflush(stdout);
+			if (s_file) fflush(s_file);
+		}
+		s_done.store(tail);
+	}
+	return (void *)0;
+}
+
+void log_start(int level, const char *file)
+{
+	log_level = level;
+	if (s_running) return;
+
+	if (file && *file)
+	{
+		s_file = fopen(file, "a");
+		if (!s_file) printf("log: cannot open %s\n", file);
+	}
+
+	for (uint32_t n = 0; n < LOG_SLOTS; n++) s_ring[n].seq = 0;
+	sem_init(&s_items, 0, 0);
+	sem_init(&s_slots, 0, LOG_SLOTS);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	// next to the offload workers, away from the main loop on core #1
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	pthread_t thread;
+	if (!pthread_create(&thread, &attr, log_thread, 0))
+	{
+		pthread_detach(thread);
+		s_running = 1;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+void log_flush()
+{
+	if (!s_running) return;
+
+	unsigned long timeout = GetTimer(1000);
+	while (s_done.load() != s_head.load() && !CheckTimer(timeout)) usleep(1000);
+}
+
+static void log_vprint(int level, const char *fmt, va_list args)
+{
+	if (level > log_level) return;
+
+	if (!s_running)
+	{
+		vprintf(fmt, args);
+		return;
+	}
+
+	if (sem_trywait(&s_slots) < 0)
+	{
+		s_dropped++;
+		g_counters[CNT_LOG_DROP]++;
+		return;
+	}
+
+	uint32_t pos = s_head.fetch_add(1);
+	logCell *cell = &s_ring[pos % LOG_SLOTS];
+	int len = vsnprintf(cell->text, sizeof(cell->text), fmt, args);
+	if (len >= (int)sizeof(cell->text)) cell->text[sizeof(cell->text) - 2] = '\n';
+	cell->seq.store(pos + 1, std::memory_order_release);
+
+	sem_post(&s_items);
+}
+
+void log_print(int level, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	log_vprint(level, fmt, args);
+	va_end(args);
+}
+
+int log_site_allow(logSite *site, uint32_t ms)
+{
+	uint32_t now = GetTimer(0);
+	uint32_t next = site->next.load(std::memory_order_relaxed);
+	if ((next && (int32_t)(now - next) < 0) || !site->next.compare_exchange_strong(next, now + ms))
+	{
+		site->skipped++;
+		return 0;
+	}
+	return 1;
+}
+
+void log_site_print(logSite *site, int level, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	log_vprint(level, fmt, args);
+	va_end(args);
+
+	uint32_t skipped = site->skipped.exchange(0);
+	if (skipped) log_print(level, "  (%u more like it suppressed)\n", skipped);
+}
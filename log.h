@@ -0,0 +1,51 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <inttypes.h>
+#include <atomic>
+
+// Logging off the hot paths. A line goes into a lock free ring and a thread on
+// the offload core writes it to the console (and log_file of MiSTer.ini), so
+// a slow serial console never stalls the caller. Lines are written in order
+// among themselves but may come out after a later plain printf. A full ring
+// drops the line and counts it in CNT_LOG_DROP.
+
+#define LOGL_ERR   0
+#define LOGL_WARN  1
+#define LOGL_INFO  2
+#define LOGL_DEBUG 3
+
+extern int log_level;
+
+// starts the writer, before it lines are printed right away. level is the
+// most verbose one kept, file (if given) gets a copy of every line.
+void log_start(int level, const char *file);
+
+// waits (up to 1s) for the ring to be written out, before exec or reboot
+void log_flush();
+
+void log_print(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_err(...)   log_print(LOGL_ERR, __VA_ARGS__)
+#define log_warn(...)  log_print(LOGL_WARN, __VA_ARGS__)
+#define log_info(...)  do { if (log_level >= LOGL_INFO) log_print(LOGL_INFO, __VA_ARGS__); } while (0)
+#define log_debug(...) do { if (log_level >= LOGL_DEBUG) log_print(LOGL_DEBUG, __VA_ARGS__); } while (0)
+
+// one call site of log_rate
+struct logSite
+{
+	std::atomic<uint32_t> next;
+	std::atomic<uint32_t> skipped;
+};
+
+// 1 if the site may log again, at most once per ms. The lines skipped
+// meanwhile are counted and reported with the next one.
+int log_site_allow(logSite *site, uint32_t ms);
+void log_site_print(logSite *site, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#define log_rate(ms, level, ...) do { \
+	static logSite log_site_; \
+	if (log_level >= (level) && log_site_allow(&log_site_, ms)) log_site_print(&log_site_, level, __VA_ARGS__); \
+} while (0)
+
+#endif
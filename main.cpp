@@ -30,10 +30,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "user_io.h"
 #include "input.h"
 #include "fpga_io.h"
+#include "hardware.h"
 #include "scheduler.h"
 #include "osd.h"
 #include "font.h"
 #include "offload.h"
+#include "counters.h"
+#include "gamecontroller_db.h"
+#include "perfhud.h"
+#include "cmdsock.h"
+#include "membudget.h"
+#include "log.h"
+#include "library.h"
+#include "loadlog.h"
+#include "cfg.h"
 
 const char *version = "$VER:" VDATE;
 
@@ -47,9 +57,12 @@ int main(int argc, char *argv[])
 	CPU_SET(1, &set);
 	sched_setaffinity(0, sizeof(set), &set);
 
+	boot_phase("offload_start");
 	offload_start();
 
+	boot_phase("fpga_io_init");
 	fpga_io_init();
+	boot_phase("startup");
 
 	DISKLED_OFF;
 
@@ -69,9 +82,36 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
+	boot_phase("FindStorage");
 	FindStorage();
-	freetype_init();
+
+	// independent of the core, run them on the offload core while user_io_init talks to the FPGA
+	static uint32_t font_time[2], gcdb_time[2];
+	offload_handle_t font_done = offload_add_work([]
+	{
+		font_time[0] = GetTimer(0);
+		freetype_init();
+		font_time[1] = GetTimer(0);
+	});
+
+	offload_handle_t gcdb_done = offload_add_work([]
+	{
+		gcdb_time[0] = GetTimer(0);
+		gcdb_prefetch();
+		gcdb_time[1] = GetTimer(0);
+	}, OFFLOAD_PRIO_BULK);
+
+	boot_phase("user_io_init");
 	user_io_init((argc > 1) ? argv[1] : "",(argc > 2) ? argv[2] : NULL);
+	cmdsock_start(cfg.cmd_tcp_port);
+	log_start(cfg.log_level, cfg.log_file);
+	if (cfg.library_index) library_start();
+
+	boot_phase("wait freetype_init");
+	offload_wait(font_done);
+	boot_phase_add("freetype_init (bg)", font_time[0], font_time[1]);
+	if (offload_is_done(gcdb_done)) boot_phase_add("gcdb_prefetch (bg)", gcdb_time[0], gcdb_time[1]);
+	boot_done();
 
 #ifdef USE_SCHEDULER
 	scheduler_init();
@@ -84,8 +124,16 @@ int main(int argc, char *argv[])
 			fpga_wait_to_reset();
 		}
 
+		counter_add(CNT_LOOP);
+		user_io_poll_storage();
 		user_io_poll();
+		cmdsock_poll();
 		input_poll(0);
+		perfhud_poll();
+		membudget_poll();
+		FileConfigPoll();
+		video_menu_bg_poll();
+		loadlog_poll();
 		HandleUI();
 		OsdUpdate();
 	}
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "membudget.h"
+#include "counters.h"
+#include "hardware.h"
+#include "cfg.h"
+
+#define MEMBUDGET_MAX    16
+#define MEMBUDGET_PERIOD 1000 // ms
+#define MEMBUDGET_PSI    20.0 // % of the last 10s some task stalled on memory
+#define MEMBUDGET_AVAIL  (24 * 1024 * 1024)
+
+struct mbCache
+{
+	const char *name;
+	int prio;
+	membudget_size_t size;
+	membudget_trim_t trim;
+};
+
+// append only, readers look at the first mb_num entries without the lock
+static mbCache mb_caches[MEMBUDGET_MAX];
+static std::atomic<int> mb_num(0);
+static pthread_mutex_t mb_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long mb_next = 0;
+static int mb_psi = 1; // 0 once /proc/pressure/memory is known to be missing
+
+void membudget_register(const char *name, int prio, membudget_size_t size, membudget_trim_t trim)
+{
+	pthread_mutex_lock(&mb_lock);
+	int num = mb_num.load();
+	int found = 0;
+	for (int i = 0; i < num && !found; i++) found = !strcmp(mb_caches[i].name, name);
+	if (!found && num < MEMBUDGET_MAX)
+	{
+		mb_caches[num] = { name, prio, size, trim };
+		mb_num.store(num + 1);
+	}
+	pthread_mutex_unlock(&mb_lock);
+}
+
+static int mem_pressure()
+{
+	char line[128];
+	if (mb_psi)
+	{
+		FILE *fp = fopen("/proc/pressure/memory", "r");
+		if (fp)
+		{
+			float avg10 = 0;
+			int ok = fgets(line, sizeof(line), fp) && sscanf(line, "some avg10=%f", &avg10) == 1;
+			fclose(fp);
+			if (ok) return avg10 > MEMBUDGET_PSI;
+		}
+		mb_psi = 0;
+	}
+
+	FILE *fp = fopen("/proc/meminfo", "r");
+	if (!fp) return 0;
+
+	unsigned long kb = 0;
+	int found = 0;
+	while (!found && fgets(line, sizeof(line), fp)) found = sscanf(line, "MemAvailable: %lu kB", &kb) == 1;
+	fclose(fp);
+	return found && kb * 1024ULL < MEMBUDGET_AVAIL;
+}
+
+void membudget_poll()
+{
+	if (!CheckTimer(mb_next)) return;
+	mb_next = GetTimer(MEMBUDGET_PERIOD);
+
+	int num = mb_num.load();
+	if (!num) return;
+
+	size_t size[MEMBUDGET_MAX];
+	size_t total = 0;
+	for (int i = 0; i < num; i++) total += (size[i] = mb_caches[i].size());
+
+	size_t excess = 0;
+	size_t limit = membudget_limit();
+	if (limit && total > limit) excess = total - limit;
+
+	// under pressure give a quarter back, even within the budget
+	if (mem_pressure() && excess < total / 4) excess = total / 4;
+	if (!excess) return;
+
+	size_t freed = 0;
+	for (int prio = MEMBUDGET_PRIO_LOW; prio <= MEMBUDGET_PRIO_HIGH && freed < excess; prio++)
+	{
+		for (int i = 0; i < num && freed < excess; i++)
+		{
+			if (mb_caches[i].prio != prio || !mb_caches[i].trim || !size[i]) continue;
+			freed += mb_caches[i].trim(excess - freed);
+		}
+	}
+
+	counter_add(CNT_CACHE_TRIM, freed);
+	if (freed) printf("membudget: %zu KB in caches, trimmed %zu KB\n", total / 1024, freed / 1024);
+}
+
+int membudget_num()
+{
+	return mb_num.load();
+}
+
+const char *membudget_name(int i)
+{
+	return mb_caches[i].name;
+}
+
+size_t membudget_size(int i)
+{
+	return mb_caches[i].size();
+}
+
+size_t membudget_limit()
+{
+	return (size_t)cfg.cache_budget * 1024 * 1024;
+}
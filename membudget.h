@@ -0,0 +1,34 @@
+#ifndef MEMBUDGET_H
+#define MEMBUDGET_H
+
+#include <stddef.h>
+
+// One RAM budget for all the caches, Linux and the framebuffer share the
+// DE10's memory with them. Every cache registers a size callback and, if it
+// can give memory back, a trim callback. When the caches together go over
+// cache_budget in MiSTer.ini, or Linux runs short of memory (the PSI memory
+// pressure, MemAvailable where there is no PSI), caches are trimmed lowest
+// priority first. A trimmed cache may grow back to its own limit, the next
+// check trims it again. Caches without trim only count towards the total.
+
+#define MEMBUDGET_PRIO_LOW  0 // copies of files that are cheap to read again
+#define MEMBUDGET_PRIO_MID  1 // data the running game reads repeatedly
+#define MEMBUDGET_PRIO_HIGH 2
+
+typedef size_t (*membudget_size_t)();
+typedef size_t (*membudget_trim_t)(size_t bytes); // frees about bytes, returns what was freed
+
+// thread-safe, registering a name again does nothing. The callbacks are
+// called on the main thread, without any lock of the budget held.
+void membudget_register(const char *name, int prio, membudget_size_t size, membudget_trim_t trim = 0);
+
+// checks the budget once a second. UI coroutine.
+void membudget_poll();
+
+// for the metrics
+int membudget_num();
+const char *membudget_name(int i);
+size_t membudget_size(int i);
+size_t membudget_limit(); // 0 - no cap
+
+#endif
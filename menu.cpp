@@ -41,6 +41,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <libgen.h>
+#include <atomic>
 #include <bluetooth.h>
 #include <hci.h>
 #include <hci_lib.h>
@@ -65,6 +66,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "font.h"
 #include "ide.h"
 #include "profiling.h"
+#include "scheduler.h"
+#include "storage_bench.h"
+#include "thumbs.h"
+#include "offload.h"
+#include "btlink.h"
 
 /*menu states*/
 enum MENU
@@ -75,6 +81,8 @@ enum MENU
 
 	MENU_SYSTEM1,
 	MENU_SYSTEM2,
+	MENU_STORAGE_BENCH1,
+	MENU_STORAGE_BENCH2,
 	MENU_COMMON1,
 	MENU_COMMON2,
 	MENU_MISC1,
@@ -375,6 +383,22 @@ static const char *home_dir = NULL;
 static char filter[256] = {};
 static unsigned long filter_typing_timer = 0;
 
+// how long a file stays highlighted before it's read ahead, see game_prefetch
+#define PREFETCH_DWELL 400
+static unsigned long prefetch_timer = 0;
+
+// partial listing while a big folder is still being read
+static void file_select_progress()
+{
+	if (menustate != MENU_FILE_SELECT1 && menustate != MENU_FILE_SELECT2) return;
+
+	OsdSetTitle((fs_Options & SCANO_CORES) ? "Cores" : "Select", 0);
+	PrintDirectory();
+	OsdSetSize(16);
+	OsdUpdate();
+	OsdSetSize(8);
+}
+
 // this function displays file selection menu
 void SelectFile(const char* path, const char* pFileExt, int Options, unsigned char MenuSelect, unsigned char MenuCancel)
 {
@@ -425,9 +449,6 @@ void SelectFile(const char* path, const char* pFileExt, int Options, unsigned ch
 		}
 	}
 
-	ScanDirectory(selPath, SCANF_INIT, pFileExt, Options);
-	AdjustDirectory(selPath);
-
 	strcpy(fs_pFileExt, pFileExt);
 	fs_ExtLen = strlen(fs_pFileExt);
 	fs_Options = Options & ~SCANO_NOENTER;
@@ -435,6 +456,10 @@ void SelectFile(const char* path, const char* pFileExt, int Options, unsigned ch
 	fs_MenuCancel = MenuCancel;
 
 	menustate = MENU_FILE_SELECT1;
+	flist_set_progress(file_select_progress);
+
+	ScanDirectory(selPath, SCANF_INIT, pFileExt, Options);
+	AdjustDirectory(selPath);
 }
 
 #define STD_EXIT       "            exit"
@@ -471,11 +496,38 @@ void SelectINI()
 
 /* the Atari core handles OSD keys competely inside the core */
 static uint32_t menu_key = 0;
+static uint32_t menu_key_last = 0;    // last key menu_key_get() has seen after debounce
+static unsigned char menu_btn_last = 0;
+
+// HandleUI() service contract: with the OSD hidden and nothing going on it
+// only runs when a key arrives, something calls menu_wake() or the idle tick
+// is due. Timers of the hidden state (OSD lock, bt reset) are coarse enough
+// for the tick.
+#define UI_IDLE_TICK_MS 100
+
+static int ui_wake = 1;
+static uint32_t ui_idle_tick = 0;
 
 void menu_key_set(unsigned int c)
 {
 	//printf("OSD enqueue: %x\n", c);
 	menu_key = c;
+	ui_wake = 1;
+}
+
+// back to the initial state for the core started by user_io_core_switch()
+void menu_core_switch()
+{
+	menustate = MENU_NONE1;
+	menusub = 0;
+	menu_timer = 0;
+	osd_lock_timer = 0;
+	osd_unlocked = 1;
+}
+
+void menu_wake()
+{
+	ui_wake = 1;
 }
 
 // get key status
@@ -505,6 +557,7 @@ static uint32_t menu_key_get(void)
 			hold_cnt = 1;
 		}
 		c2 = c1;
+		menu_key_last = c1;
 
 		// generate repeat "key-pressed" events
 		if ((c1 & UPSTROKE) || (!c1))
@@ -515,7 +568,7 @@ static uint32_t menu_key_get(void)
 		else if (CheckTimer(repeat))
 		{
 			repeat = GetTimer(REPEATRATE);
-			if (GetASCIIKey(c1) || ((menustate == MENU_COMMON2) && (menusub == 17)) || ((menustate == MENU_SYSTEM2) && (menusub == 5)))
+			if (GetASCIIKey(c1) || ((menustate == MENU_COMMON2) && (menusub == 17)) || ((menustate == MENU_SYSTEM2) && (menusub == 6)))
 			{
 				c = c1;
 				hold_cnt++;
@@ -527,7 +580,7 @@ static uint32_t menu_key_get(void)
 	if (!c && !select_ini)
 	{
 		static unsigned long longpress = 0, longpress_consumed = 0;
-		static unsigned char last_but = 0;
+		unsigned char &last_but = menu_btn_last;
 		unsigned char but = user_io_menu_button();
 
 		if (but && !last_but) longpress = GetTimer(3000);
@@ -586,11 +639,10 @@ static uint32_t menu_key_get(void)
 	return(c);
 }
 
-static char* getNet(int spec)
+static char* getNet(int spec, char *host)
 {
 	int netType = 0;
 	struct ifaddrs *ifaddr, *ifa, *ifae = 0, *ifaw = 0;
-	static char host[NI_MAXHOST];
 
 	if (getifaddrs(&ifaddr) == -1)
 	{
@@ -631,6 +683,58 @@ static char* getNet(int spec)
 	return spec ? (ifa ? host : 0) : (char*)netType;
 }
 
+// Network, bluetooth and battery state. Interface enumeration and the SMBus
+// reads of the battery take milliseconds, so they are sampled on the bulk
+// worker and the UI only reads the last snapshot, asking for a new one at
+// most once a second.
+#define SYSINFO_PERIOD 1000
+
+struct sysInfo
+{
+	char net[3][NI_MAXHOST]; // 1 - eth0, 2 - wlan, empty if down
+	int bt;
+	int hasbat;
+	battery_data_t bat;
+};
+
+static sysInfo sysinfo_snap = {};
+static pthread_mutex_t sysinfo_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long sysinfo_next = 0;
+static std::atomic<int> sysinfo_busy;
+
+static void sysinfo_sample()
+{
+	static sysInfo s;
+	memset(&s, 0, sizeof(s));
+	for (int i = 1; i <= 2; i++) if (!getNet(i, s.net[i])) s.net[i][0] = 0;
+	s.bt = hci_get_route(0) >= 0;
+	s.hasbat = getBattery(0, &s.bat);
+
+	pthread_mutex_lock(&sysinfo_lock);
+	sysinfo_snap = s;
+	pthread_mutex_unlock(&sysinfo_lock);
+}
+
+static void sysinfo_get(sysInfo *info)
+{
+	if (!sysinfo_next)
+	{
+		// the very first one is needed right away
+		sysinfo_sample();
+		sysinfo_next = GetTimer(SYSINFO_PERIOD);
+	}
+	else if (CheckTimer(sysinfo_next) && !sysinfo_busy)
+	{
+		sysinfo_next = GetTimer(SYSINFO_PERIOD);
+		sysinfo_busy = 1;
+		if (!offload_try_add_work([] { sysinfo_sample(); sysinfo_busy = 0; }, OFFLOAD_PRIO_BULK)) sysinfo_busy = 0;
+	}
+
+	pthread_mutex_lock(&sysinfo_lock);
+	*info = sysinfo_snap;
+	pthread_mutex_unlock(&sysinfo_lock);
+}
+
 static long sysinfo_timer;
 static void infowrite(int pos, const char* txt)
 {
@@ -650,8 +754,10 @@ static void printSysInfo()
 	if (!sysinfo_timer || CheckTimer(sysinfo_timer))
 	{
 		sysinfo_timer = GetTimer(2000);
-		struct battery_data_t bat;
-		int hasbat = getBattery(0, &bat);
+		static sysInfo info;
+		sysinfo_get(&info);
+		struct battery_data_t &bat = info.bat;
+		int hasbat = info.hasbat;
 		int n = 2;
 		static int flip = 0;
 
@@ -660,15 +766,15 @@ static void printSysInfo()
 
 		int j = 0;
 		char *net;
-		net = getNet(1);
-		if (net)
+		net = info.net[1];
+		if (net[0])
 		{
 			sprintf(str, "\x1c %s", net);
 			infowrite(n++, str);
 			j++;
 		}
-		net = getNet(2);
-		if (net)
+		net = info.net[2];
+		if (net[0])
 		{
 			sprintf(str, "\x1d %s", net);
 			infowrite(n++, str);
@@ -925,10 +1031,25 @@ static int gun_idx = 0;
 static int32_t gun_pos[4] = {};
 static int page = 0;
 
+int menu_needs_service(void)
+{
+	if (ui_wake || is_menu() || user_io_osd_is_visible()) return 1;
+	if (menustate != MENU_NONE2 || bt_timer >= 0 || !mgl_get()->done) return 1;
+
+	// debounce and key repeat in progress, or the OSD button is in use
+	if (menu_key != menu_key_last || (menu_key && !(menu_key & UPSTROKE))) return 1;
+	if (user_io_menu_button() || menu_btn_last) return 1;
+
+	return CheckTimer(ui_idle_tick);
+}
+
 void HandleUI(void)
 {
 	PROFILE_FUNCTION();
 
+	ui_wake = 0;
+	ui_idle_tick = GetTimer(UI_IDLE_TICK_MS);
+
 	if (bt_timer >= 0)
 	{
 		if (!bt_timer) bt_timer = (int32_t)GetTimer(6000);
@@ -1067,7 +1188,11 @@ void HandleUI(void)
 	minus = false;
 	recent = false;
 
-	if (c && cfg.bootcore[0] != '\0') cfg.bootcore[0] = '\0';
+	if (c && cfg.bootcore[0] != '\0')
+	{
+		cfg.bootcore[0] = '\0';
+		fpga_preload_cancel();
+	}
 
 	if (!select_ini && is_menu() && cfg.osd_timeout >= 5)
 	{
@@ -1370,6 +1495,8 @@ void HandleUI(void)
 		break;
 	}
 
+	if (is_menu()) thumbs_poll(menustate == MENU_FILE_SELECT1 || menustate == MENU_FILE_SELECT2);
+
 	// Switch to current menu screen
 	switch (menustate)
 	{
@@ -1416,7 +1543,7 @@ void HandleUI(void)
 				}
 				else if (is_menu())
 				{
-					menusub = 6;
+					menusub = 7;
 					SelectFile("", 0, SCANO_CORES, MENU_CORE_FILE_SELECTED1, MENU_SYSTEM1);
 				}
 				else if (is_minimig())
@@ -4980,6 +5107,21 @@ void HandleUI(void)
 		OsdUpdate();
 		OsdSetSize(8);
 		menustate = MENU_FILE_SELECT2;
+		if (is_menu()) thumbs_select(selPath);
+		if ((fs_Options & SCANO_CORES) && flist_nDirEntries() && flist_SelectedItem()->de.d_type != DT_DIR)
+		{
+			// read the highlighted core ahead while the user decides
+			static char core_name[1024];
+			snprintf(core_name, sizeof(core_name), "%s%s%s", selPath, selPath[0] ? "/" : "", flist_SelectedItem()->de.d_name);
+			fpga_prefetch_rbf(core_name);
+		}
+		if (fs_Options & SCANO_CORES) arcade_precompile(getFullPath(selPath));
+		FilePrefetchCancel();
+		prefetch_timer = 0;
+		if (cfg.game_prefetch && !(fs_Options & (SCANO_CORES | SCANO_SAVES)) && flist_nDirEntries() && flist_SelectedItem()->de.d_type != DT_DIR)
+		{
+			prefetch_timer = GetTimer(PREFETCH_DWELL);
+		}
 		if (cfg.log_file_entry && flist_nDirEntries())
 		{
 			//Write out paths infos for external integration
@@ -4992,6 +5134,15 @@ void HandleUI(void)
 	case MENU_FILE_SELECT2:
 		menumask = 0;
 
+		if (prefetch_timer && CheckTimer(prefetch_timer))
+		{
+			// the selection stayed, read the game ahead while the user decides
+			static char game_name[1024];
+			prefetch_timer = 0;
+			snprintf(game_name, sizeof(game_name), "%s%s%s", selPath, selPath[0] ? "/" : "", flist_SelectedItem()->de.d_name);
+			FilePrefetch(getFullPath(game_name), cfg.game_prefetch * 1024 * 1024);
+		}
+
 		if (c == KEY_BACKSPACE && (fs_Options & (SCANO_UMOUNT | SCANO_CLEAR)) && !strlen(filter))
 		{
 			for (int i = 0; i < OsdGetSize(); i++) OsdWrite(i, "", 0, 0);
@@ -6346,7 +6497,7 @@ void HandleUI(void)
 
 		m = 0;
 		OsdSetTitle("System Settings", OSD_ARROW_LEFT);
-		menumask = 0x7F;
+		menumask = 0xFF;
 
 		OsdWrite(m++);
 		sprintf(s, "       MiSTer v%s", version + 5);
@@ -6399,15 +6550,16 @@ void HandleUI(void)
 		OsdWrite(m++, " Define joystick buttons   \x16", menusub == 2);
 		OsdWrite(m++, " Scripts                   \x16", menusub == 3);
 		OsdWrite(m++, " Help                      \x16", menusub == 4);
+		OsdWrite(m++, " Storage benchmark         \x16", menusub == 5);
 		OsdWrite(m++, "");
 		cr = m;
-		OsdWrite(m++, " Reboot (hold \x16 cold reboot)", menusub == 5);
+		OsdWrite(m++, " Reboot (hold \x16 cold reboot)", menusub == 6);
 		sysinfo_timer = 0;
 
 		reboot_req = 0;
 
 		while(m < OsdGetSize()-1) OsdWrite(m++, "");
-		OsdWrite(15, STD_EXIT, menusub == 6);
+		OsdWrite(15, STD_EXIT, menusub == 7);
 		menustate = MENU_SYSTEM2;
 		break;
 
@@ -6469,6 +6621,10 @@ void HandleUI(void)
 				break;
 
 			case 5:
+				menustate = MENU_STORAGE_BENCH1;
+				break;
+
+			case 6:
 				{
 					reboot_req = 1;
 
@@ -6481,7 +6637,7 @@ void HandleUI(void)
 				}
 				break;
 
-			case 6:
+			case 7:
 				menustate = MENU_NONE1;
 				break;
 			}
@@ -6494,6 +6650,60 @@ void HandleUI(void)
 		if (!hold_cnt && reboot_req) fpga_load_rbf("menu.rbf");
 		break;
 
+	case MENU_STORAGE_BENCH1:
+		{
+			OsdSetTitle("Storage Benchmark", 0);
+			menumask = 1;
+			menusub = 0;
+			for (int i = 0; i < OsdGetSize(); i++) OsdWrite(i);
+			OsdWrite(7, "     Testing the storage,");
+			OsdWrite(8, "    it can take a minute...");
+			OsdUpdate();
+
+			storageBenchResult res[STORAGE_BENCH_MAX];
+			int num = storage_bench_run(res, STORAGE_BENCH_MAX);
+			storage_bench_report(res, num, STORAGE_BENCH_FILE);
+
+			m = 0;
+			OsdWrite(m++);
+			for (int i = 0; i < num && m < OsdGetSize() - 4; i++)
+			{
+				storageBenchResult *r = &res[i];
+				if (!r->ok)
+				{
+					sprintf(s, " %s: failed", r->name);
+					OsdWrite(m++, s);
+					continue;
+				}
+
+				sprintf(s, " %-9s %5u.%u MB/s", r->name, r->seq_kbps / 1024, (r->seq_kbps % 1024) * 10 / 1024);
+				OsdWrite(m++, s);
+				sprintf(s, "  2K %u.%u/%u.%ums 512 %u.%u/%u.%ums",
+					r->r2k_us[0] / 1000, r->r2k_us[0] / 100 % 10, r->r2k_us[2] / 1000, r->r2k_us[2] / 100 % 10,
+					r->r512_us[0] / 1000, r->r512_us[0] / 100 % 10, r->r512_us[2] / 1000, r->r512_us[2] / 100 % 10);
+				OsdWrite(m++, s);
+				if (r->type != STORAGE_SD)
+				{
+					sprintf(s, "  Use %s=%d", (r->type == STORAGE_NET) ? "readahead_net" : "readahead_usb", r->readahead);
+					OsdWrite(m++, s);
+				}
+			}
+			OsdWrite(m++);
+			OsdWrite(m++, "  read latency p50/p99");
+			while (m < OsdGetSize() - 1) OsdWrite(m++);
+			OsdWrite(OsdGetSize() - 1, STD_EXIT, 1);
+			menustate = MENU_STORAGE_BENCH2;
+		}
+		break;
+
+	case MENU_STORAGE_BENCH2:
+		if (menu || select)
+		{
+			menustate = MENU_SYSTEM1;
+			menusub = 5;
+		}
+		break;
+
 	case MENU_JOYSYSMAP:
 		strcpy(joy_bnames[SYS_BTN_A - DPAD_NAMES], "A");
 		strcpy(joy_bnames[SYS_BTN_B - DPAD_NAMES], "B");
@@ -6718,7 +6928,7 @@ void HandleUI(void)
 		if (parentstate == MENU_BTPAIR)
 		{
 			OsdUpdate();
-			if(cfg.bt_reset_before_pair) system("hciconfig hci0 reset");
+			if(cfg.bt_reset_before_pair) btlink_reset();
 			script_pipe = popen("/usr/sbin/btpair", "r");
 		}
 		else
@@ -6982,10 +7192,13 @@ void HandleUI(void)
 					strftime(str + strlen(str), sizeof(str) - 1 - strlen(str), "%b %d %a%H:%M:%S", &tm);
 				}
 
+				static sysInfo info;
+				sysinfo_get(&info);
+
 				int n = 8;
-				if (getNet(2)) str[n++] = 0x1d;
-				if (getNet(1)) str[n++] = 0x1c;
-				if (hci_get_route(0) >= 0) str[n++] = 4;
+				if (info.net[2][0]) str[n++] = 0x1d;
+				if (info.net[1][0]) str[n++] = 0x1c;
+				if (info.bt) str[n++] = 4;
 				if (user_io_get_sdram_cfg() & 0x8000)
 				{
 					switch (user_io_get_sdram_cfg() & 7)
@@ -7198,6 +7411,9 @@ void PrintDirectory(int expand)
 		}
 
 		k++;
+
+		// rendering long utf8 names is slow, don't let the guest wait for it
+		scheduler_service_storage();
 	}
 	OsdSetSize(8);
 }
@@ -7341,6 +7557,7 @@ int menu_allow_cfg_switch()
 void menu_process_save()
 {
 	menu_save_timer = GetTimer(1000);
+	menu_wake();
 }
 
 static char pchar[] = { 0x8C, 0x8E, 0x8F, 0x90, 0x91, 0x7F };
@@ -7349,49 +7566,101 @@ static char pchar[] = { 0x8C, 0x8E, 0x8F, 0x90, 0x91, 0x7F };
 #define PROGRESS_CHARS  (int)(sizeof(pchar)/sizeof(pchar[0]))
 #define PROGRESS_MAX    ((PROGRESS_CHARS*PROGRESS_CNT)-1)
 
+// Loaders report progress on every chunk. That only stores the counters,
+// the bar is rendered at most PROGRESS_HZ times a second, from the caller
+// when it's due or from the UI coroutine.
+#define PROGRESS_HZ     15
+
+static std::atomic<uint64_t> progress_cur;
+static std::atomic<uint64_t> progress_max;
+static int progress_active = 0;
+static int progress_shown = -1;
+static unsigned long progress_timer = 0;
+static const char *progress_title_ptr, *progress_text_ptr;
+static char progress_title[32];
+static char progress_text[256];
+
+void ProgressSet(uint64_t current, uint64_t max)
+{
+	progress_cur.store(current, std::memory_order_relaxed);
+	progress_max.store(max, std::memory_order_relaxed);
+}
+
+void ProgressPoll()
+{
+	if (!progress_active || !CheckTimer(progress_timer)) return;
+
+	uint64_t max = progress_max.load(std::memory_order_relaxed);
+	uint64_t current = progress_cur.load(std::memory_order_relaxed);
+	if (!max) return;
+
+	int new_progress = (current * PROGRESS_MAX) / max;
+	if (new_progress > PROGRESS_MAX) new_progress = PROGRESS_MAX;
+	if (progress_shown == new_progress) return;
+
+	progress_shown = new_progress;
+	progress_timer = GetTimer(1000 / PROGRESS_HZ);
+
+	static char progress_buf[256];
+	memset(progress_buf, 0, sizeof(progress_buf));
+
+	const char *text = progress_text;
+	char c = pchar[new_progress % PROGRESS_CHARS];
+	new_progress /= PROGRESS_CHARS;
+
+	char *buf = progress_buf;
+
+	sprintf(buf, "\n\n ");
+	buf += 3;
+
+	int len_utf8 = utf8_strlen(text);
+	int len_byte;
+
+	if (len_utf8 > 27) {
+		len_byte = index_from_utf8(text, 28) - 1;
+	} else {
+		len_byte = strlen(text);
+	}
+	memcpy(buf, text, len_byte);
+	buf += len_byte;
+
+	sprintf(buf, "\n ");
+	buf += 2;
+
+	for (int i = 0; i <= new_progress; i++) buf[i] = (i < new_progress) ? 0x7F : c;
+	buf[PROGRESS_CNT] = 0;
+
+	InfoMessage(progress_buf, 2000, progress_title);
+}
+
 void ProgressMessage(const char* title, const char* text, int current, int max)
 {
-	static int progress;
 	if (!current && !max)
 	{
-		progress = -1;
+		progress_active = 0;
+		progress_shown = -1;
+		progress_title_ptr = progress_text_ptr = 0;
+		ProgressSet(0, 0);
 		MenuHide();
 		return;
 	}
 
-	int new_progress = (((uint64_t)current)*PROGRESS_MAX) / max;
-	if (progress != new_progress)
-	{
-		progress = new_progress;
-		static char progress_buf[256];
-		memset(progress_buf, 0, sizeof(progress_buf));
-
-		if (new_progress > PROGRESS_MAX) new_progress = PROGRESS_MAX;
-		char c = pchar[new_progress % PROGRESS_CHARS];
-		new_progress /= PROGRESS_CHARS;
-
-		char *buf = progress_buf;
+	ProgressSet((uint32_t)current, (uint32_t)max);
 
-		sprintf(buf, "\n\n ");
-		buf += 3;
-		
-		int len_utf8 = utf8_strlen(text);
-		int len_byte;
-
-		if (len_utf8 > 27) {
-			len_byte = index_from_utf8(text, 28) - 1;
-		} else {
-			len_byte = strlen(text);
-		}
-		memcpy(buf, text, len_byte);
-		buf += len_byte;
+	if (!title) title = "";
+	if (!text) text = "";
 
-		sprintf(buf, "\n ");
-		buf += 2;
-	
-		for (int i = 0; i <= new_progress; i++) buf[i] = (i < new_progress) ? 0x7F : c;
-		buf[PROGRESS_CNT] = 0;
-
-		InfoMessage(progress_buf, 2000, title);
+	// the name changes once per file, not per chunk
+	if (title != progress_title_ptr || text != progress_text_ptr || strncmp(text, progress_text, sizeof(progress_text) - 1))
+	{
+		progress_title_ptr = title;
+		progress_text_ptr = text;
+		snprintf(progress_title, sizeof(progress_title), "%s", title);
+		snprintf(progress_text, sizeof(progress_text), "%s", text);
+		progress_shown = -1;
+		progress_timer = 0;
 	}
+
+	progress_active = 1;
+	ProgressPoll();
 }
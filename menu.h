@@ -7,11 +7,21 @@ void SelectFile(const char* path, const char* pFileExt, int Options, unsigned ch
 
 void HandleUI(void);
 void menu_key_set(unsigned int c);
+
+// HandleUI() has something to do. With the OSD hidden it's skipped otherwise,
+// other modules changing what the UI shows call menu_wake().
+int menu_needs_service(void);
+void menu_wake();
+void menu_core_switch();
 void menu_process_save();
 void PrintDirectory(int expand = 0);
 void ScrollLongName(void);
 
 void ProgressMessage(const char* title = 0, const char* text = 0, int current = 0, int max = 0);
+// ProgressSet() only updates the counters of the active progress message and
+// is safe from any thread, ProgressPoll() renders it when due.
+void ProgressSet(uint64_t current, uint64_t max);
+void ProgressPoll();
 void InfoMessage(const char *message, int timeout = 2000, const char *title = "Message");
 void Info(const char *message, int timeout = 2000, int width = 0, int height = 0, int frame = 0);
 void MenuHide();
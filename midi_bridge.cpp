@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <asm/termbits.h>
+#include <asm/ioctls.h>
+
+#include "midi_bridge.h"
+#include "counters.h"
+
+// <sys/ioctl.h> clashes with the termios2 definitions of <asm/termbits.h>
+extern "C" int ioctl(int fd, unsigned long request, ...);
+
+#define MIDI_UART "/dev/ttyS1"
+#define MIDI_BRIDGE_PRIO 45 // above the input thread, MIDI has no slack at all
+
+static int uart_fd = -1;
+static int midi_fd = -1;
+static int stop_fd[2] = { -1, -1 };
+static int buf_size = 0;
+static pthread_t bridge_tid;
+static int bridge_on = 0;
+
+static int open_midi()
+{
+	DIR *d = opendir("/dev/snd");
+	if (!d) return -1;
+
+	char name[64] = {};
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		// the first raw MIDI port of the first USB MIDI device
+		if (!strncmp(de->d_name, "midiC", 5) && (!name[0] || strcmp(de->d_name, name) < 0))
+		{
+			snprintf(name, sizeof(name), "%s", de->d_name);
+		}
+	}
+	closedir(d);
+	if (!name[0]) return -1;
+
+	char path[80];
+	snprintf(path, sizeof(path), "/dev/snd/%s", name);
+	int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("midi_bridge: cannot open %s (%d)\n", path, errno);
+		return -1;
+	}
+
+	printf("midi_bridge: using %s\n", path);
+	return fd;
+}
+
+static int open_uart(uint32_t baud)
+{
+	int fd = open(MIDI_UART, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) return -1;
+
+	// raw, 8N1 and any baud rate (31250 isn't one of the B* constants)
+	struct termios2 tio;
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	tio.c_iflag = 0;
+	tio.c_oflag = 0;
+	tio.c_lflag = 0;
+	tio.c_cflag = BOTHER | CS8 | CLOCAL | CREAD;
+	tio.c_ispeed = baud;
+	tio.c_ospeed = baud;
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+
+	if (ioctl(fd, TCSETS2, &tio) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int write_all(int fd, const uint8_t *buf, int len)
+{
+	while (len > 0)
+	{
+		int n = write(fd, buf, len);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN) return -1;
+
+			struct pollfd p = { fd, POLLOUT, 0 };
+			poll(&p, 1, 100);
+			continue;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void *bridge_thread(void *)
+{
+	uint8_t *buf = (uint8_t*)malloc(buf_size);
+	if (!buf) return 0;
+
+	struct pollfd fds[3] =
+	{
+		{ uart_fd, POLLIN, 0 },
+		{ midi_fd, POLLIN, 0 },
+		{ stop_fd[0], POLLIN, 0 },
+	};
+
+	for (;;)
+	{
+		if (poll(fds, 3, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (fds[2].revents) break;
+
+		// core -> synth: the bytes go out straight from the read, no queue in between
+		if (fds[0].revents & POLLIN)
+		{
+			uint32_t t = counters_time_us();
+			int n = read(uart_fd, buf, buf_size);
+			if (n > 0)
+			{
+				if (write_all(midi_fd, buf, n) < 0) break;
+				counter_add(CNT_MIDI_OUT, n);
+				histogram_add(HIST_MIDI, counters_time_us() - t);
+			}
+		}
+
+		// synth -> core (SysEx replies, MIDI in)
+		if (fds[1].revents & POLLIN)
+		{
+			int n = read(midi_fd, buf, buf_size);
+			if (n > 0)
+			{
+				if (write_all(uart_fd, buf, n) < 0) break;
+				counter_add(CNT_MIDI_IN, n);
+			}
+		}
+
+		if ((fds[0].revents | fds[1].revents) & (POLLERR | POLLHUP))
+		{
+			printf("midi_bridge: device is gone\n");
+			break;
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+
+int midi_bridge_start(uint32_t baud, int buffer)
+{
+	midi_bridge_stop();
+
+	midi_fd = open_midi();
+	if (midi_fd < 0) return 0;
+
+	uart_fd = open_uart(baud);
+	if (uart_fd < 0 || pipe2(stop_fd, O_CLOEXEC) < 0)
+	{
+		printf("midi_bridge: cannot set up %s\n", MIDI_UART);
+		midi_bridge_stop();
+		return 0;
+	}
+
+	buf_size = buffer;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	// core #0 with the offload workers, which it preempts
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	struct sched_param param = {};
+	param.sched_priority = MIDI_BRIDGE_PRIO;
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &param);
+
+	int err = pthread_create(&bridge_tid, &attr, bridge_thread, nullptr);
+	if (err == EPERM)
+	{
+		printf("midi_bridge: no realtime priority for the bridge thread.\n");
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		err = pthread_create(&bridge_tid, &attr, bridge_thread, nullptr);
+	}
+	pthread_attr_destroy(&attr);
+
+	if (err)
+	{
+		printf("midi_bridge: failed to start the bridge thread (%d).\n", err);
+		midi_bridge_stop();
+		return 0;
+	}
+
+	bridge_on = 1;
+	printf("midi_bridge: %s at %u baud, %d bytes per transfer.\n", MIDI_UART, baud, buffer);
+	return 1;
+}
+
+void midi_bridge_stop()
+{
+	if (bridge_on)
+	{
+		if (write(stop_fd[1], "", 1) < 0) printf("midi_bridge: cannot stop the thread\n");
+		pthread_join(bridge_tid, nullptr);
+		bridge_on = 0;
+	}
+
+	if (uart_fd >= 0) close(uart_fd);
+	if (midi_fd >= 0) close(midi_fd);
+	if (stop_fd[0] >= 0) close(stop_fd[0]);
+	if (stop_fd[1] >= 0) close(stop_fd[1]);
+	uart_fd = midi_fd = stop_fd[0] = stop_fd[1] = -1;
+}
+
+int midi_bridge_active()
+{
+	return bridge_on;
+}
@@ -0,0 +1,15 @@
+#ifndef MIDI_BRIDGE_H
+#define MIDI_BRIDGE_H
+
+#include <inttypes.h>
+
+// MIDI of the core (UART in MIDI mode) to a USB MIDI device, forwarded by a
+// realtime thread of MiSTer itself instead of the midilink helper.
+// See midi_bridge in MiSTer.ini. Bytes and latency are in the counters.
+
+// takes the UART at the given baud rate, 0 if there is no USB MIDI device
+int midi_bridge_start(uint32_t baud, int buffer);
+void midi_bridge_stop();
+int midi_bridge_active();
+
+#endif
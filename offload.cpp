@@ -1,76 +1,107 @@
 #include "offload.h"
 #include "profiling.h"
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+static constexpr uint32_t QUEUE_SIZE = 64; // must be pow2
+
+// Bounded ring between any number of producers and the single worker of a class.
+// Free slots and queued items are counted by semaphores, which only enter the
+// kernel when somebody actually has to sleep, so submission costs neither a
+// mutex nor an allocation in the common case.
+struct Cell
+{
+	std::atomic<uint32_t> seq; // pos + 1 once the task at pos is published
+	offload_task task;
+};
 
-static constexpr uint32_t QUEUE_SIZE = 8;
+// One queue and one worker per priority class.
+// Work inside a class completes in submission order,
+// so completion can be tracked with a single counter.
+struct Queue
+{
+	Cell cells[QUEUE_SIZE];
+	std::atomic<uint32_t> head; // next position claimed by a producer
+	uint32_t tail;              // next position taken by the worker
+	std::atomic<uint32_t> completed;
+	sem_t items, slots;
+	pthread_t thread;
+	int prio;
+};
 
-static pthread_t s_thread_handle;
-static pthread_cond_t s_cond_work, s_cond_available;
-static pthread_mutex_t s_queue_lock;
+static Queue s_queues[OFFLOAD_PRIO_NUM];
+static std::atomic<bool> s_quit;
+static thread_local int s_is_worker = 0;
 
-struct Work
+// slow path for offload_wait() only
+static pthread_cond_t s_cond_done;
+static pthread_mutex_t s_done_lock;
+static std::atomic<int> s_waiters;
+
+static offload_handle_t make_handle(uint32_t seq, int prio)
 {
-	std::function<void()> handler;
-};
+	return (seq << 2) | (prio + 1);
+}
 
-static Work s_queue[QUEUE_SIZE];
-static uint32_t s_queue_head, s_queue_tail;
-static bool s_quit;
+static void sem_wait_intr(sem_t *sem)
+{
+	while (sem_wait(sem) < 0 && errno == EINTR) {}
+}
 
-static void *worker_thread(void *)
+static void *worker_thread(void *arg)
 {
+	Queue *q = (Queue*)arg;
+	s_is_worker = 1;
+
+	// bulk work must not compete with the latency-critical worker
+	if (q->prio == OFFLOAD_PRIO_BULK) setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+
 	while (true)
 	{
-		Work *current_work = nullptr;
 		// Wait for work
-		pthread_mutex_lock(&s_queue_lock);
-		if (s_queue_head == s_queue_tail)
-		{
-			// queue empty and quit flag set, exit
-			if (s_quit)
-			{
-				pthread_mutex_unlock(&s_queue_lock);
-				break;
-			}
-
-			// wait for work signal
-			pthread_cond_wait(&s_cond_work, &s_queue_lock);
-			
-			// quit flag was set and queue still empty, quit
-			if (s_quit && (s_queue_head == s_queue_tail))
-			{
-				pthread_mutex_unlock(&s_queue_lock);
-				break;
-			}
-		}
+		sem_wait_intr(&q->items);
 
-		// get work
-		current_work = &s_queue[s_queue_tail % QUEUE_SIZE];
-		pthread_mutex_unlock(&s_queue_lock);
+		// queue empty and quit flag set, exit
+		if (s_quit && q->tail == q->head) break;
+
+		// producer may have claimed the cell but not published it yet
+		Cell *cell = &q->cells[q->tail % QUEUE_SIZE];
+		while (cell->seq.load(std::memory_order_acquire) != q->tail + 1) sched_yield();
+
+		// get work and release the slot before running it
+		offload_task current_work = std::move(cell->task);
+		sem_post(&q->slots);
 
 		// execute
-		current_work->handler();
-		current_work->handler = nullptr;
-
-		// lock and move tail forward
-		pthread_mutex_lock(&s_queue_lock);
-		s_queue_tail++;
-		pthread_cond_signal(&s_cond_available);
-		pthread_mutex_unlock(&s_queue_lock);
+		current_work();
+		current_work.reset();
+
+		q->tail++;
+		q->completed.store(q->tail);
+		if (s_waiters.load())
+		{
+			pthread_mutex_lock(&s_done_lock);
+			pthread_cond_broadcast(&s_cond_done);
+			pthread_mutex_unlock(&s_done_lock);
+		}
 	}
 	return (void *)0;
 }
 
 void offload_start()
 {
-	pthread_cond_init(&s_cond_available, nullptr);
-	pthread_cond_init(&s_cond_work, nullptr);
-	pthread_mutex_init(&s_queue_lock, nullptr);
-
-	s_queue_head = s_queue_tail = 0;
+	pthread_cond_init(&s_cond_done, nullptr);
+	pthread_mutex_init(&s_done_lock, nullptr);
+	s_waiters = 0;
 	s_quit = false;
 
 	pthread_attr_t attr;
@@ -83,40 +114,100 @@ void offload_start()
 	CPU_SET(0, &set);
 	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
 
-	pthread_create(&s_thread_handle, &attr, worker_thread, nullptr);
+	for (int i = 0; i < OFFLOAD_PRIO_NUM; i++)
+	{
+		Queue *q = &s_queues[i];
+		for (uint32_t n = 0; n < QUEUE_SIZE; n++) q->cells[n].seq = 0;
+		q->head = 0;
+		q->tail = 0;
+		q->completed = 0;
+		q->prio = i;
+		sem_init(&q->items, 0, 0);
+		sem_init(&q->slots, 0, QUEUE_SIZE);
+
+		pthread_create(&q->thread, &attr, worker_thread, q);
+	}
+
+	pthread_attr_destroy(&attr);
 }
 
 void offload_stop()
 {
-	pthread_mutex_lock(&s_queue_lock);
-
 	s_quit = true;
-	pthread_cond_signal(&s_cond_work);
-
-	pthread_mutex_unlock(&s_queue_lock);
+	for (int i = 0; i < OFFLOAD_PRIO_NUM; i++) sem_post(&s_queues[i].items);
 
 	printf("Waiting for offloaded work to finish...");
-	pthread_join(s_thread_handle, nullptr);
+	for (int i = 0; i < OFFLOAD_PRIO_NUM; i++) pthread_join(s_queues[i].thread, nullptr);
 	printf("Done\n");
 }
 
-void offload_add_work(std::function<void()> handler)
+static offload_handle_t add_work(offload_task &task, int prio, bool wait)
+{
+	if (prio < 0 || prio >= OFFLOAD_PRIO_NUM) prio = OFFLOAD_PRIO_BULK;
+	Queue *q = &s_queues[prio];
+
+	if (wait) sem_wait_intr(&q->slots);
+	else if (sem_trywait(&q->slots) < 0) return 0;
+
+	uint32_t pos = q->head.fetch_add(1);
+	Cell *cell = &q->cells[pos % QUEUE_SIZE];
+	cell->task = std::move(task);
+	cell->seq.store(pos + 1, std::memory_order_release);
+
+	sem_post(&q->items);
+	return make_handle(pos + 1, prio);
+}
+
+offload_handle_t offload_add_work(offload_task task, int prio)
 {
 	PROFILE_FUNCTION();
+	return add_work(task, prio, true);
+}
 
-	pthread_mutex_lock(&s_queue_lock);
+offload_handle_t offload_try_add_work(offload_task task, int prio)
+{
+	PROFILE_FUNCTION();
+	return add_work(task, prio, false);
+}
 
-	if ((s_queue_head - s_queue_tail) == QUEUE_SIZE)
-	{
-		pthread_cond_wait(&s_cond_available, &s_queue_lock);
-	}
+int offload_is_done(offload_handle_t handle)
+{
+	if (!handle) return 1;
 
-	Work *work = &s_queue[s_queue_head % QUEUE_SIZE];
-	work->handler = handler;
+	int prio = (handle & 3) - 1;
+	if (prio < 0 || prio >= OFFLOAD_PRIO_NUM) return 1;
 
-	s_queue_head++;
+	// 30-bit sequence compare, tolerant to wrap around
+	uint32_t seq = handle >> 2;
+	uint32_t done = s_queues[prio].completed.load() & 0x3FFFFFFF;
+	return ((done - seq) & 0x3FFFFFFF) < 0x20000000;
+}
 
-	pthread_cond_signal(&s_cond_work);
+void offload_wait(offload_handle_t handle)
+{
+	PROFILE_FUNCTION();
+
+	if (offload_is_done(handle)) return;
+
+	pthread_mutex_lock(&s_done_lock);
+	s_waiters++;
+	while (!offload_is_done(handle)) pthread_cond_wait(&s_cond_done, &s_done_lock);
+	s_waiters--;
+	pthread_mutex_unlock(&s_done_lock);
+}
+
+uint32_t offload_pending(int prio)
+{
+	if (prio < 0 || prio >= OFFLOAD_PRIO_NUM) return 0;
+	return s_queues[prio].head.load() - s_queues[prio].completed.load();
+}
+
+int offload_is_worker()
+{
+	return s_is_worker;
+}
 
-	pthread_mutex_unlock(&s_queue_lock);
-}
\ No newline at end of file
+int offload_stopping()
+{
+	return s_quit;
+}
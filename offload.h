@@ -2,11 +2,162 @@
 #define OFFLOAD_H
 
 #include <stddef.h>
-#include <functional>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+// Priority classes. Each class has its own queue and worker,
+// so a long bulk job never delays latency-critical work.
+#define OFFLOAD_PRIO_HIGH 0 // short, latency-critical jobs (sysfs writes, notifications)
+#define OFFLOAD_PRIO_BULK 1 // long running jobs (file writes, encoding, decompression)
+#define OFFLOAD_PRIO_NUM  2
+
+// Completion handle. 0 is never returned for queued work.
+typedef uint32_t offload_handle_t;
+
+// Move-only callable with inline storage. Constructing it never allocates,
+// captures larger than OFFLOAD_TASK_SIZE fail at compile time.
+#define OFFLOAD_TASK_SIZE 64
+
+class offload_task
+{
+public:
+	offload_task() : invoke(nullptr), manage(nullptr) {}
+
+	template<typename F, typename T = typename std::decay<F>::type,
+		typename = typename std::enable_if<!std::is_same<T, offload_task>::value>::type>
+	offload_task(F &&f)
+	{
+		static_assert(sizeof(T) <= OFFLOAD_TASK_SIZE, "offload_task: captured state is too big");
+		static_assert(alignof(T) <= alignof(max_align_t), "offload_task: captured state is over-aligned");
+
+		new (storage) T(std::forward<F>(f));
+		invoke = [](void *p) { (*(T*)p)(); };
+		manage = [](void *dst, void *src)
+		{
+			if (dst) new (dst) T(std::move(*(T*)src));
+			((T*)src)->~T();
+		};
+	}
+
+	offload_task(offload_task &&other) : invoke(nullptr), manage(nullptr)
+	{
+		*this = std::move(other);
+	}
+
+	offload_task &operator=(offload_task &&other)
+	{
+		if (this != &other)
+		{
+			reset();
+			if (other.manage)
+			{
+				other.manage(storage, other.storage);
+				invoke = other.invoke;
+				manage = other.manage;
+				other.invoke = nullptr;
+				other.manage = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	offload_task(const offload_task&) = delete;
+	offload_task &operator=(const offload_task&) = delete;
+
+	~offload_task() { reset(); }
+
+	void reset()
+	{
+		if (manage) manage(nullptr, storage);
+		invoke = nullptr;
+		manage = nullptr;
+	}
+
+	explicit operator bool() const { return invoke != nullptr; }
+	void operator()() { invoke(storage); }
+
+private:
+	alignas(max_align_t) unsigned char storage[OFFLOAD_TASK_SIZE];
+	void (*invoke)(void *p);
+	void (*manage)(void *dst, void *src);
+};
 
 void offload_start();
 void offload_stop();
 
-void offload_add_work(std::function<void()> work);
+// blocks while the queue of the given class is full.
+offload_handle_t offload_add_work(offload_task work, int prio = OFFLOAD_PRIO_HIGH);
+
+// returns 0 if the queue of the given class is full.
+offload_handle_t offload_try_add_work(offload_task work, int prio = OFFLOAD_PRIO_HIGH);
+
+// non-blocking completion check. Handle 0 is always complete.
+int offload_is_done(offload_handle_t handle);
+
+// blocks the calling thread until the work is complete.
+// Use scheduler_wait_work() from the coroutines instead.
+void offload_wait(offload_handle_t handle);
+
+// number of queued + running jobs of the given class.
+uint32_t offload_pending(int prio);
+
+// non-zero when called from one of the workers. Work running there must not
+// wait for jobs queued behind it.
+int offload_is_worker();
+
+// Idempotent background update where only the latest value matters
+// (sysfs parameters and the like). set() stores the value and queues the
+// apply function only if no apply is pending yet, so a burst of changes runs
+// it once with the final value and never holds more than one queue slot.
+// Values equal to the last applied one are dropped. T must be trivially copyable.
+template<typename T>
+class offload_latest
+{
+public:
+	explicit offload_latest(void (*apply)(const T &val), int prio = OFFLOAD_PRIO_HIGH) : apply(apply), prio(prio)
+	{
+		pthread_mutex_init(&lock, nullptr);
+	}
+
+	void set(const T &val)
+	{
+		pthread_mutex_lock(&lock);
+		value = val;
+		bool queue = !pending;
+		pending = true;
+		pthread_mutex_unlock(&lock);
+
+		if (queue) offload_add_work([this] { run(); }, prio);
+	}
+
+private:
+	void run()
+	{
+		pthread_mutex_lock(&lock);
+		T val = value;
+		pending = false;
+		bool same = has_applied && !memcmp(&val, &applied, sizeof(T));
+		applied = val;
+		has_applied = true;
+		pthread_mutex_unlock(&lock);
+
+		if (!same) apply(val);
+	}
+
+	void (*apply)(const T &val);
+	int prio;
+	pthread_mutex_t lock;
+	T value = {}, applied = {};
+	bool pending = false;
+	bool has_applied = false;
+};
+
+// non-zero once offload_stop() was called. Long jobs should wrap up early,
+// the exit waits for everything that's queued.
+int offload_stopping();
 
-#endif
\ No newline at end of file
+#endif
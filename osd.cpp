@@ -47,6 +47,7 @@ as rotated copies of the first 128 entries.  -- AMR
 #include "hardware.h"
 #include "font.h"
 #include "profiling.h"
+#include "str_util.h"
 
 #include "support.h"
 
@@ -78,6 +79,12 @@ static uint8_t osdbuf[256 * 32];
 static int  osdbufpos = 0;
 static int  osdset = 0;
 
+// What the OSD buffer in the FPGA holds. A line write starts at the first byte
+// of the line and the rest of the line keeps its contents, so only the part
+// up to the last changed byte is sent.
+static uint8_t osdshadow[256 * 32];
+static uint32_t osdshadow_valid = 0;
+
 char framebuffer[16][256];
 static void framebuffer_clear()
 {
@@ -133,6 +140,16 @@ static unsigned long scroll_timer[2] = {};  // file/dir name scrolling timer
 static int arrow;
 static unsigned char titlebuffer[256];
 
+// Every change of a line in osdbuf bumps its generation. OsdWriteOffset()
+// remembers what it drew into a line, and a redraw with the same arguments
+// over an untouched line is skipped. Menus redraw all their lines on every
+// key press (PrintDirectory on each cursor move), usually only the lines
+// around the selection actually change.
+static uint32_t line_gen[32];
+static uint32_t line_sig[32];
+static uint32_t line_sig_gen[32];
+static uint32_t title_gen = 0;
+
 static void rotatechar(unsigned char *in, unsigned char *out)
 {
 	int a;
@@ -156,6 +173,7 @@ void OsdSetTitle(const char *s, int a)
 {
 	// Compose the title, condensing character gaps
 	arrow = a;
+	title_gen++;
 	int zeros = 0;
 	uint fixedHeight = 128;
 	uint i = 0, j = 0;
@@ -220,6 +238,7 @@ void OsdWrite(unsigned char n, const char *s, unsigned char invert, unsigned cha
 static void osd_start(int line)
 {
 	line = line & 0x1F;
+	line_gen[line]++;
 	osdset |= 1 << line;
 	osdbufpos = line * 256;
 }
@@ -261,6 +280,19 @@ void OsdWriteOffset(unsigned char n, const char *s, unsigned char invert, unsign
 
 	if (n && n < OsdGetSize() - 1) leftchar = 0;
 
+	// arguments and the state the line depends on, multi-line and background
+	// writes aren't tracked
+	uint32_t sig = 0;
+	if (!usebg && n < 32 && !strpbrk(s, "\r\n"))
+	{
+		const int args[] = { n, invert, stipple, offset, leftchar, maxinv, mininv, is_lower_part, arrow, osd_size, (int)title_gen };
+		sig = str_hash(s, ~0u);
+		for (int a : args) sig = (sig * 31) ^ (uint32_t)a;
+		if (!sig) sig = 1;
+
+		if (line_sig[n] == sig && line_sig_gen[n] == line_gen[n]) return;
+	}
+
 	if (stipple) {
 		stipplemask = 0x55;
 		stipple = 0xff;
@@ -400,6 +432,12 @@ void OsdWriteOffset(unsigned char n, const char *s, unsigned char invert, unsign
 		osdbuf[osdbufpos++] = xormask;
 		i += 22;
 	}
+
+	if (sig)
+	{
+		line_sig[n] = sig;
+		line_sig_gen[n] = line_gen[n];
+	}
 }
 
 void OsdShiftDown(unsigned char n)
@@ -516,6 +554,7 @@ void OSD_PrintInfo(const char *message, int *width, int *height, int frame)
 // clear OSD frame buffer
 void OsdClear(void)
 {
+	for (auto &gen : line_gen) gen++;
 	osdset = -1;
 	memset(osdbuf, 0, 16 * 256);
 }
@@ -561,6 +600,7 @@ void OsdMenuCtl(int en)
 {
 	if (en)
 	{
+		osdshadow_valid = 0;
 		spi_osd_cmd(OSD_CMD_WRITE | 8);
 		spi_osd_cmd(OSD_CMD_ENABLE);
 	}
@@ -693,13 +733,24 @@ void OsdUpdate()
 	{
 		if (osdset & (1 << i))
 		{
+			uint8_t *line = osdbuf + i * 256;
+			uint8_t *shadow = osdshadow + i * 256;
+
+			int len = 256;
+			if (osdshadow_valid & (1 << i))
+			{
+				while (len && line[len - 1] == shadow[len - 1]) len--;
+				if (!len) continue;
+			}
+
 			spi_osd_cmd_cont(OSD_CMD_WRITE | i);
-			spi_write(osdbuf + i * 256, 256, 0);
+			spi_write_t<0, 1>(line, len);
 			DisableOsd();
-			if (is_megacd()) mcd_poll();
-			if (is_pce()) pcecd_poll();
-			if (is_saturn()) saturn_poll();
-			if (is_neogeo_cd()) neocd_poll();
+
+			memcpy(shadow, line, len);
+			osdshadow_valid |= 1 << i;
+
+			user_io_cd_poll();
 		}
 	}
 
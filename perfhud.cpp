@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "perfhud.h"
+#include "counters.h"
+#include "hardware.h"
+#include "offload.h"
+#include "scheduler.h"
+#include "input.h"
+#include "menu.h"
+
+#define PERFHUD_PERIOD 500 // ms between refreshes
+#define PERFHUD_CPUS   2
+
+struct hudSnap
+{
+	uint32_t time_us;
+	uint64_t cnt[CNT_NUM];
+	uint32_t hist[HIST_NUM][HIST_BUCKETS];
+	uint32_t input[HIST_BUCKETS];
+	uint64_t cpu_busy[PERFHUD_CPUS];
+	uint64_t cpu_total[PERFHUD_CPUS];
+};
+
+static int hud_on = 0;
+static unsigned long hud_next = 0;
+static hudSnap hud_last, hud_cur;
+
+static void cpu_read(hudSnap *s)
+{
+	memset(s->cpu_busy, 0, sizeof(s->cpu_busy));
+	memset(s->cpu_total, 0, sizeof(s->cpu_total));
+
+	FILE *fp = fopen("/proc/stat", "r");
+	if (!fp) return;
+
+	char line[256];
+	while (fgets(line, sizeof(line), fp))
+	{
+		// per core lines only: user nice system idle iowait irq softirq steal
+		unsigned int n;
+		unsigned long long v[8] = {};
+		if (strncmp(line, "cpu", 3) || line[3] < '0' || line[3] > '9') continue;
+		if (sscanf(line + 3, "%u %llu %llu %llu %llu %llu %llu %llu %llu", &n, v, v + 1, v + 2, v + 3, v + 4, v + 5, v + 6, v + 7) < 5) continue;
+		if (n >= PERFHUD_CPUS) continue;
+
+		uint64_t total = 0;
+		for (int i = 0; i < 8; i++) total += v[i];
+		s->cpu_total[n] = total;
+		s->cpu_busy[n] = total - v[3] - v[4];
+	}
+	fclose(fp);
+}
+
+static void snap_take(hudSnap *s)
+{
+	s->time_us = counters_time_us();
+	for (int i = 0; i < CNT_NUM; i++) s->cnt[i] = g_counters[i].load(std::memory_order_relaxed);
+	for (int i = 0; i < HIST_NUM; i++)
+	{
+		for (int n = 0; n < HIST_BUCKETS; n++) s->hist[i][n] = g_histograms[i][n].load(std::memory_order_relaxed);
+	}
+	input_latency_buckets(s->input);
+	cpu_read(s);
+}
+
+// p99 of the samples in between, 0 if there are none
+static uint32_t hud_p99(const uint32_t *cur, const uint32_t *old)
+{
+	// a reset in between starts the histogram over
+	int reset = 0;
+	for (int n = 0; n < HIST_BUCKETS; n++) if (cur[n] < old[n]) reset = 1;
+
+	uint32_t delta[HIST_BUCKETS];
+	uint64_t total = 0;
+	for (int n = 0; n < HIST_BUCKETS; n++)
+	{
+		delta[n] = reset ? cur[n] : cur[n] - old[n];
+		total += delta[n];
+	}
+	return histogram_percentile(delta, total, 990);
+}
+
+static const char *hud_us(char *str, uint32_t us)
+{
+	if (!us) strcpy(str, "-");
+	else if (us < 1000) sprintf(str, "%uus", us);
+	else sprintf(str, "%ums", us / 1000);
+	return str;
+}
+
+static uint64_t hud_delta(int id)
+{
+	return hud_cur.cnt[id] - hud_last.cnt[id];
+}
+
+// MB/s in tenths
+static uint32_t hud_mbs(uint64_t bytes, uint32_t elapsed_us)
+{
+	return (uint32_t)(bytes * 10 * 1000000ULL / elapsed_us / (1024 * 1024));
+}
+
+static int cpu_load(int n)
+{
+	uint64_t total = hud_cur.cpu_total[n] - hud_last.cpu_total[n];
+	return total ? (int)((hud_cur.cpu_busy[n] - hud_last.cpu_busy[n]) * 100 / total) : 0;
+}
+
+static void hud_show()
+{
+	uint32_t elapsed = hud_cur.time_us - hud_last.time_us;
+	if (!elapsed) return;
+
+	char msg[512], a[16], b[16];
+	int len = 0;
+
+	len += sprintf(msg + len, "Loop %7llu/s  CPU %3d%% %3d%%\n",
+		(unsigned long long)(hud_delta(CNT_LOOP) * 1000000ULL / elapsed), cpu_load(0), cpu_load(1));
+
+	len += sprintf(msg + len, "p99  co_poll %-5s co_ui %s\n",
+		hud_us(a, hud_p99(hud_cur.hist[HIST_CO_POLL], hud_last.hist[HIST_CO_POLL])),
+		hud_us(b, hud_p99(hud_cur.hist[HIST_CO_UI], hud_last.hist[HIST_CO_UI])));
+
+	uint32_t spi = hud_mbs(hud_delta(CNT_SPI_BYTES), elapsed);
+	len += sprintf(msg + len, "SPI  %4u.%u MB/s\n", spi / 10, spi % 10);
+
+	uint32_t rd = hud_mbs(hud_delta(CNT_FILE_READ), elapsed);
+	len += sprintf(msg + len, "Read %4u.%u MB/s  p99 %s\n", rd / 10, rd % 10,
+		hud_us(a, hud_p99(hud_cur.hist[HIST_FILE_READ], hud_last.hist[HIST_FILE_READ])));
+
+	uint64_t hit = hud_delta(CNT_CHD_HIT), miss = hud_delta(CNT_CHD_MISS);
+	if (hit + miss) sprintf(a, "%3u%%", (uint32_t)(hit * 100 / (hit + miss)));
+	else strcpy(a, "   -");
+	len += sprintf(msg + len, "CHD  %s hit  CD late %llu\n", a, (unsigned long long)hud_delta(CNT_CD_LATE));
+
+	len += sprintf(msg + len, "Jobs high %u  bulk %u\n", offload_pending(OFFLOAD_PRIO_HIGH), offload_pending(OFFLOAD_PRIO_BULK));
+
+	sprintf(msg + len, "Input p99 %s", hud_us(a, hud_p99(hud_cur.input, hud_last.input)));
+
+	Info(msg, PERFHUD_PERIOD * 3);
+}
+
+void perfhud_toggle()
+{
+	hud_on = !hud_on;
+	if (hud_on)
+	{
+		snap_take(&hud_last);
+		hud_next = GetTimer(PERFHUD_PERIOD);
+	}
+	Info(hud_on ? "Performance HUD on" : "Performance HUD off");
+}
+
+int perfhud_active()
+{
+	return hud_on;
+}
+
+void perfhud_poll()
+{
+	if (!hud_on) return;
+
+	if (CheckTimer(hud_next))
+	{
+		hud_next = GetTimer(PERFHUD_PERIOD);
+		snap_take(&hud_cur);
+		hud_show();
+		hud_last = hud_cur;
+	}
+
+	// nothing else may wake the UI while a core runs
+	int32_t left = (int32_t)(hud_next - GetTimer(0));
+	scheduler_wake_in(left > 0 ? left : 0);
+}
@@ -0,0 +1,14 @@
+#ifndef PERFHUD_H
+#define PERFHUD_H
+
+// Live performance counters in an OSD info box over the running core, to
+// tell whether a stutter comes from the storage, the SPI or the UI. Win+Pause
+// turns it on and off. Rates and percentiles cover the last refresh only.
+
+void perfhud_toggle();
+int perfhud_active();
+
+// refreshes the box when it's due. UI coroutine, under input_lock().
+void perfhud_poll();
+
+#endif
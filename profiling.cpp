@@ -3,10 +3,17 @@
 #include "profiling.h"
 
 #include "str_util.h"
+#include "file_io.h"
+#include "offload.h"
+#include "libco.h"
+#include "counters.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <time.h>
+#include <vector>
+#include <algorithm>
 
 struct Event
 {
@@ -24,24 +31,262 @@ static constexpr Event *get_event(uint32_t idx)
 	return &s_events[idx % MAX_EVENTS];
 }
 
-uint32_t profiling_event_begin(const char *name)
+static inline uint64_t timespec_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// Trace capture. Events are appended to a chunk which is handed over to the
+// bulk offload worker once full, so the hot path is a push_back and the file
+// is written to while the capture is running.
+struct TraceEvent
+{
+	const char *name;
+	uint64_t ts_ns;
+	uint16_t tid;
+	char ph;
+};
+
+struct TraceFile
+{
+	char path[1024];
+	uint64_t start_ns;
+	FILE *fp;
+	int count;
+};
+
+typedef std::vector<TraceEvent> TraceChunk;
+
+static constexpr size_t TRACE_CHUNK_EVENTS = 16384;
+static constexpr int TRACE_MAX_COROUTINES = 15;
+static TraceChunk *s_trace = nullptr;
+static TraceFile *s_trace_file = nullptr;
+static cothread_t s_trace_co[TRACE_MAX_COROUTINES];
+
+// every coroutine gets its own track, otherwise scopes interrupted by
+// a switch would not nest.
+static uint16_t trace_tid()
+{
+	cothread_t co = co_active();
+	for (int i = 0; i < TRACE_MAX_COROUTINES; i++)
+	{
+		if (s_trace_co[i] == co) return i + 1;
+		if (!s_trace_co[i])
+		{
+			s_trace_co[i] = co;
+			return i + 1;
+		}
+	}
+	return TRACE_MAX_COROUTINES + 1;
+}
+
+static void trace_write(TraceFile *file, TraceChunk *chunk)
+{
+	if (file->fp)
+	{
+		for (const TraceEvent &ev : *chunk)
+		{
+			fprintf(file->fp, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":1,\"tid\":%u}",
+				file->count ? "," : "", ev.name, ev.ph, (ev.ts_ns - file->start_ns) / 1000ULL,
+				(uint32_t)((ev.ts_ns - file->start_ns) % 1000ULL), ev.tid);
+			file->count++;
+		}
+	}
+	delete chunk;
+}
+
+static void trace_flush(bool last)
+{
+	TraceFile *file = s_trace_file;
+	TraceChunk *chunk = s_trace;
+
+	s_trace = nullptr;
+	if (last)
+	{
+		s_trace_file = nullptr;
+		offload_add_work([file, chunk]
+		{
+			trace_write(file, chunk);
+			if (file->fp)
+			{
+				fprintf(file->fp, "\n]}\n");
+				fclose(file->fp);
+				printf("Trace: %d events written to %s\n", file->count, file->path);
+			}
+			delete file;
+		}, OFFLOAD_PRIO_BULK);
+		return;
+	}
+
+	// offload_*_work are profiled too, don't record them while handing over
+	s_trace = nullptr;
+	if (offload_try_add_work([file, chunk] { trace_write(file, chunk); }, OFFLOAD_PRIO_BULK))
+	{
+		s_trace = new TraceChunk;
+		s_trace->reserve(TRACE_CHUNK_EVENTS);
+	}
+	else
+	{
+		// writer is behind, keep growing the current chunk
+		s_trace = chunk;
+	}
+}
+
+static inline void trace_event(const char *name, char ph, const struct timespec *ts)
+{
+	s_trace->push_back({ name, timespec_ns(ts), trace_tid(), ph });
+	if (s_trace->size() >= TRACE_CHUNK_EVENTS) trace_flush(false);
+}
+
+static void trace_start()
+{
+	if (s_trace)
+	{
+		printf("Trace: already running\n");
+		return;
+	}
+
+	TraceFile *file = new TraceFile;
+	file->fp = nullptr;
+	file->count = 0;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	file->start_ns = timespec_ns(&ts);
+
+	char name[64] = CONFIG_DIR"/trace.json";
+	time_t t = time(NULL);
+	struct tm tm = *localtime(&t);
+	if (tm.tm_year >= 119) strftime(name, sizeof(name), CONFIG_DIR"/trace_%Y%m%d_%H%M%S.json", &tm);
+	strcpyz(file->path, sizeof(file->path), getFullPath(name));
+
+	offload_add_work([file]
+	{
+		file->fp = fopen(file->path, "w");
+		if (!file->fp)
+		{
+			printf("Trace: cannot create %s\n", file->path);
+			return;
+		}
+		fprintf(file->fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	}, OFFLOAD_PRIO_BULK);
+
+	memset(s_trace_co, 0, sizeof(s_trace_co));
+	s_trace_file = file;
+	s_trace = new TraceChunk;
+	s_trace->reserve(TRACE_CHUNK_EVENTS);
+	printf("Trace: started\n");
+}
+
+static void trace_stop()
+{
+	if (!s_trace)
+	{
+		printf("Trace: not running\n");
+		return;
+	}
+
+	trace_flush(true);
+	printf("Trace: stopped\n");
+}
+
+void profiling_trace_cmd(const char *cmd)
+{
+	if (!strcmp(cmd, "start")) trace_start();
+	else if (!strcmp(cmd, "stop")) trace_stop();
+	else printf("Trace: unknown command '%s'\n", cmd);
+}
+
+// Per-scope aggregates, keyed by the name pointer.
+struct ScopeStats
+{
+	const char *name;
+	uint32_t count;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint32_t buckets[HIST_BUCKETS]; // log2 of us
+};
+
+static constexpr uint32_t MAX_SCOPES = 256; // must be pow2
+static ScopeStats s_scopes[MAX_SCOPES];
+
+static ScopeStats *get_scope(const char *name)
+{
+	uint32_t idx = ((uint32_t)(uintptr_t)name * 2654435761u) >> 24;
+	for (uint32_t i = 0; i < MAX_SCOPES; i++)
+	{
+		ScopeStats *stats = &s_scopes[(idx + i) % MAX_SCOPES];
+		if (stats->name == name) return stats;
+		if (!stats->name)
+		{
+			stats->name = name;
+			return stats;
+		}
+	}
+	return nullptr;
+}
+
+static void scope_add(const char *name, uint64_t ns)
+{
+	ScopeStats *stats = get_scope(name);
+	if (!stats) return;
+
+	if (!stats->count || ns < stats->min_ns) stats->min_ns = ns;
+	if (ns > stats->max_ns) stats->max_ns = ns;
+	stats->count++;
+	stats->total_ns += ns;
+	stats->buckets[histogram_bucket(ns / 1000)]++;
+}
+
+static void stats_dump()
+{
+	std::vector<ScopeStats *> list;
+	for (uint32_t i = 0; i < MAX_SCOPES; i++) if (s_scopes[i].count) list.push_back(&s_scopes[i]);
+	std::sort(list.begin(), list.end(), [](const ScopeStats *a, const ScopeStats *b) { return a->total_ns > b->total_ns; });
+
+	printf("\n+----- Name -------------------------------+ Count  + Total(ms) + Avg(us) + Min(us) + p50(us) + p99(us) + Max(us) +\n");
+	for (const ScopeStats *stats : list)
+	{
+		printf("| %-40.40s | %6u | %9llu | %7llu | %7llu | %7u | %7u | %7llu |\n", stats->name, stats->count,
+			stats->total_ns / 1000000ULL, stats->total_ns / stats->count / 1000ULL, stats->min_ns / 1000ULL,
+			histogram_percentile(stats->buckets, stats->count, 500), histogram_percentile(stats->buckets, stats->count, 990),
+			stats->max_ns / 1000ULL);
+	}
+	printf("+------------------------------------------+--------+-----------+---------+---------+---------+---------+---------+\n");
+	printf("p50/p99 are upper bounds of log2 buckets.\n\n");
+	fflush(stdout);
+}
+
+void profiling_stats_cmd(const char *cmd)
+{
+	if (!strcmp(cmd, "dump")) stats_dump();
+	else if (!strcmp(cmd, "reset")) memset(s_scopes, 0, sizeof(s_scopes));
+	else printf("Profile: unknown command '%s'\n", cmd);
+}
+
+uint32_t profiling_event_begin(const char *name, uint64_t *begin_ns)
 {
 	Event *newEvent = get_event(s_event_tail);
 	newEvent->begin_idx = s_event_tail;
 	newEvent->name = name;
 	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
+	*begin_ns = timespec_ns(&newEvent->ts);
+	if (s_trace) trace_event(name, 'B', &newEvent->ts);
 
 	uint32_t r = s_event_tail;
 	s_event_tail++;
 	return r;
 }
 
-void profiling_event_end(uint32_t begin_idx, const char *name)
+void profiling_event_end(uint32_t begin_idx, const char *name, uint64_t begin_ns)
 {
 	Event *newEvent = get_event(s_event_tail);
 	newEvent->begin_idx = begin_idx;
 	newEvent->name = name;
 	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
+	scope_add(name, timespec_ns(&newEvent->ts) - begin_ns);
+	if (s_trace) trace_event(name, 'E', &newEvent->ts);
 	s_event_tail++;
 }
 
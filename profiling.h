@@ -5,33 +5,42 @@
 
 #ifdef PROFILING
 
-uint32_t profiling_event_begin(const char *name);
-void profiling_event_end(uint32_t begin_idx, const char *name);
+uint32_t profiling_event_begin(const char *name, uint64_t *begin_ns);
+void profiling_event_end(uint32_t begin_idx, const char *name, uint64_t begin_ns);
 void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us);
 
+// "dump" / "reset" per-scope statistics (count, avg, min, p50, p99, max).
+// Used by "profile" in MiSTer_cmd.
+void profiling_stats_cmd(const char *cmd);
+
+// "start" / "stop" a Chrome trace (chrome://tracing, ui.perfetto.dev)
+// capture into config/trace_<date>.json. Used by "trace" in MiSTer_cmd.
+void profiling_trace_cmd(const char *cmd);
+
 struct ProfilingScopedEvent
 {
 	const char *name;
 	uint32_t spike_us;
 	uint32_t begin_idx;
+	uint64_t begin_ns;
 
 	ProfilingScopedEvent(const char *name)
 		: name(name)
 		, spike_us(0)
 	{
-		begin_idx = profiling_event_begin(name);
+		begin_idx = profiling_event_begin(name, &begin_ns);
 	}
 
 	ProfilingScopedEvent(const char *name, uint32_t spike_us)
 		: name(name)
 		, spike_us(spike_us)
 	{
-		begin_idx = profiling_event_begin(name);
+		begin_idx = profiling_event_begin(name, &begin_ns);
 	}
 
 	~ProfilingScopedEvent()
 	{
-		profiling_event_end(begin_idx, name);
+		profiling_event_end(begin_idx, name, begin_ns);
 		if (spike_us > 0) profiling_spike_report(begin_idx, spike_us);
 	}
 };
@@ -48,6 +57,10 @@ struct ProfilingScopedEvent
 #define SPIKE_SCOPE(name, us)
 #define SPIKE_FUNCTION(us)
 
+#include <stdio.h>
+inline void profiling_stats_cmd(const char *) { printf("Profile: not available, build with PROFILING=1\n"); }
+inline void profiling_trace_cmd(const char *) { printf("Trace: not available, build with PROFILING=1\n"); }
+
 #endif // PROFILING
 
 #endif // PROFILING_H
@@ -5,15 +5,25 @@
 #include <stdbool.h>
 #include <limits.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
 
 #include "file_io.h"
 #include "user_io.h"
 #include "osd.h"
 #include "cfg.h"
 #include "recent.h"
+#include "offload.h"
 
 #define RECENT_MAX 16
 
+// lists kept in memory, the least recently used one is dropped
+#define RECENT_LISTS 4
+
+#define RECENT_UNKNOWN -1
+
 struct recent_rec_t
 {
 	char dir[1024];
@@ -21,17 +31,35 @@ struct recent_rec_t
 	char label[256];
 };
 
-static recent_rec_t recents[RECENT_MAX];
-static char ena[RECENT_MAX];
+// The lists stay resident once loaded, changes are written in the
+// background. Entries are checked on a worker each time a list is shown,
+// until the answer arrives they are shown as available. The list that needs
+// the check may sit on a slow network share, the menu doesn't wait for it.
+struct recent_list_t
+{
+	char cfg[256];
+	uint32_t used;
+	int num;
+	int allow_dir;
+	recent_rec_t recs[RECENT_MAX];
+	std::atomic<int> ena[RECENT_MAX];
+	std::atomic<uint32_t> gen; // bumped on every change, outdated check results are dropped
+};
 
-static int numlast = 0;
+static recent_list_t lists[RECENT_LISTS];
+static recent_list_t *cur = lists;
+static uint32_t lists_used = 0;
+
+// bumped by the worker after each check, the shown list is redrawn
+static std::atomic<uint32_t> checked;
+static uint32_t checked_shown = 0;
 
 static int iSelectedEntry = 0;
 static int iFirstEntry = 0;
 
 static int recent_available()
 {
-	return numlast;
+	return cur->num;
 }
 
 static char* recent_create_config_name(int idx)
@@ -50,22 +78,109 @@ static const char* recent_path(char* dir, char* name)
 	return path;
 }
 
-static void recent_load(int idx)
+static int recent_exists(int i)
 {
-	// initialize recent to empty strings
-	memset(recents, 0, sizeof(recents));
+	const char *path = recent_path(cur->recs[i].dir, cur->recs[i].name);
+	return FileExists(path) || (cur->allow_dir && PathIsDir(path));
+}
 
-	// load the config file into memory
-	FileLoadConfig(recent_create_config_name(idx), recents, sizeof(recents));
+static void recent_check()
+{
+	int num = cur->num;
+	if (!num) return;
+
+	char (*paths)[1024] = (char(*)[1024])malloc(num * 1024);
+	if (!paths) return;
+
+	for (int i = 0; i < num; i++)
+	{
+		snprintf(paths[i], sizeof(paths[i]), "%s", getFullPath(recent_path(cur->recs[i].dir, cur->recs[i].name)));
+
+		// files inside an archive are checked by the archive, the full check is done at selection
+		char *z = strcasestr(paths[i], ".zip/");
+		if (z) z[4] = 0;
+	}
+
+	recent_list_t *list = cur;
+	uint32_t gen = list->gen;
+	int allow_dir = list->allow_dir;
+
+	offload_add_work([list, gen, num, paths, allow_dir]
+	{
+		for (int i = 0; i < num && list->gen == gen; i++)
+		{
+			struct stat64 st;
+			int ok = !stat64(paths[i], &st) && (S_ISREG(st.st_mode) || (allow_dir && S_ISDIR(st.st_mode)));
+			if (list->gen == gen) list->ena[i] = ok;
+		}
+
+		free(paths);
+		checked++;
+	}, OFFLOAD_PRIO_BULK);
+}
+
+static void recent_store()
+{
+	char *path = strdup(getFullPath(CONFIG_DIR));
+	char *name = (char*)malloc(strlen(path) + strlen(cur->cfg) + 2);
+	void *data = malloc(sizeof(cur->recs));
+	if (!path || !name || !data)
+	{
+		free(path);
+		free(name);
+		free(data);
+		return;
+	}
 
-	for (numlast = 0; numlast < (int)(sizeof(recents)/sizeof(recents[0])) && strlen(recents[numlast].name); numlast++) {}
+	sprintf(name, "%s/%s", path, cur->cfg);
+	free(path);
+	memcpy(data, cur->recs, sizeof(cur->recs));
 
-	// check the items
-	for (int i = 0; i < recent_available(); i++)
+	offload_add_work([name, data]
 	{
-		ena[i] = FileExists(recent_path(recents[i].dir, recents[i].name));
-		if (idx >= 0 && is_neogeo() && !ena[i]) ena[i] = PathIsDir(recent_path(recents[i].dir, recents[i].name));
+		int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (fd < 0 || write(fd, data, sizeof(recent_list_t::recs)) != (ssize_t)sizeof(recent_list_t::recs))
+		{
+			printf("recent_store: failed to write %s\n", name);
+		}
+		if (fd >= 0) close(fd);
+		free(name);
+		free(data);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+static void recent_load(int idx)
+{
+	const char *cfg = recent_create_config_name(idx);
+	recent_list_t *lru = lists;
+
+	for (auto &list : lists)
+	{
+		if (!strcmp(list.cfg, cfg))
+		{
+			cur = &list;
+			cur->allow_dir = idx >= 0 && is_neogeo();
+			cur->used = ++lists_used;
+			return;
+		}
+
+		if (list.used < lru->used) lru = &list;
 	}
+
+	cur = lru;
+	cur->gen++;
+	snprintf(cur->cfg, sizeof(cur->cfg), "%s", cfg);
+	cur->used = ++lists_used;
+	cur->allow_dir = idx >= 0 && is_neogeo();
+
+	// initialize recent to empty strings
+	memset(cur->recs, 0, sizeof(cur->recs));
+
+	// load the config file into memory
+	FileLoadConfig(cfg, cur->recs, sizeof(cur->recs));
+
+	for (cur->num = 0; cur->num < RECENT_MAX && strlen(cur->recs[cur->num].name); cur->num++) {}
+	for (auto &ena : cur->ena) ena = RECENT_UNKNOWN;
 }
 
 int recent_init(int idx)
@@ -73,6 +188,8 @@ int recent_init(int idx)
 	if (!cfg.recents) return 0;
 
 	recent_load(idx);
+	recent_check();
+	checked_shown = checked;
 	recent_scan(SCANF_INIT);
 	return recent_available();
 }
@@ -163,11 +280,18 @@ void recent_scroll_name()
 	int max_len;
 	static char name[256 + 4];
 
+	// redraw with the results of the background check
+	if (checked_shown != checked)
+	{
+		checked_shown = checked;
+		recent_print();
+	}
+
 	// don't scroll if the file doesn't exist
-	if (!ena[iSelectedEntry]) return;
+	if (!cur->ena[iSelectedEntry]) return;
 
 	name[0] = 32;
-	strcpy(name + 1, recents[iSelectedEntry].label);
+	strcpy(name + 1, cur->recs[iSelectedEntry].label);
 
 	len = strlen(name); // get name length
 
@@ -193,7 +317,7 @@ void recent_print()
 			k = iFirstEntry + i;
 
 			s[0] = 32;
-			char* name = recents[k].label;
+			char* name = cur->recs[k].label;
 			strcpy(s + 1, name);
 
 			len = strlen(s); // get name length
@@ -211,7 +335,7 @@ void recent_print()
 			if (!i && k) leftchar = 17;
 			if ((i == OsdGetSize() - 1) && (k < recent_available() - 1)) leftchar = 16;
 
-			d = ena[k] ? 0 : 1;
+			d = !cur->ena[k];
 		}
 		else
 		{
@@ -230,14 +354,17 @@ int recent_select(char *dir, char *path, char *label)
 
 	if (!recent_available()) return 0;
 
-	if (strlen(recents[iSelectedEntry].name))
+	recent_rec_t *rec = &cur->recs[iSelectedEntry];
+	if (strlen(rec->name))
 	{
-		strcpy(dir, recents[iSelectedEntry].dir);
-		strcpy(path, recent_path(recents[iSelectedEntry].dir, recents[iSelectedEntry].name));
-		strcpy(label, recents[iSelectedEntry].label);
+		strcpy(dir, rec->dir);
+		strcpy(path, recent_path(rec->dir, rec->name));
+		strcpy(label, rec->label);
 	}
 
-	return ena[iSelectedEntry];
+	// the background check might be out of date or still running
+	cur->ena[iSelectedEntry] = recent_exists(iSelectedEntry);
+	return cur->ena[iSelectedEntry];
 }
 
 void recent_update(char* dir, char* path, char* label, int idx)
@@ -248,7 +375,6 @@ void recent_update(char* dir, char* path, char* label, int idx)
 	char* name = strrchr(path, '/');
 	if (name) name++; else name = path;
 
-	// load the current state.  this is necessary because we may have started a ROM from multiple sources
 	recent_load(idx);
 
 	// update the selection
@@ -258,26 +384,37 @@ void recent_update(char* dir, char* path, char* label, int idx)
 	strncpy(rec.name, name, sizeof(rec.name)-1);
 	strncpy(rec.label, label ? label : name, sizeof(rec.label)-1);
 
-	for (unsigned i = 0; i < sizeof(recents)/sizeof(recents[0]); i++)
+	for (int i = 0; i < RECENT_MAX; i++)
 	{
-		if (!strcmp(recents[i].dir, dir) && !strcmp(recents[i].name, name))
+		if (!strcmp(cur->recs[i].dir, dir) && !strcmp(cur->recs[i].name, name))
 		{
 			indexToErase = i;
 			break;
 		}
 	}
 
-	if(indexToErase) memmove(recents + 1, recents, sizeof(recents[0])*indexToErase);
-	memcpy(recents, &rec, sizeof(recents[0]));
+	cur->gen++;
+	if (indexToErase)
+	{
+		memmove(cur->recs + 1, cur->recs, sizeof(cur->recs[0])*indexToErase);
+		for (int i = indexToErase; i > 0; i--) cur->ena[i] = (int)cur->ena[i - 1];
+	}
+	memcpy(cur->recs, &rec, sizeof(cur->recs[0]));
+	cur->ena[0] = 1;
+	for (cur->num = 0; cur->num < RECENT_MAX && strlen(cur->recs[cur->num].name); cur->num++) {}
 
 	// store the config file to storage
-	FileSaveConfig(recent_create_config_name(idx), recents, sizeof(recents));
+	recent_store();
 }
 
 void recent_clear(int idx)
 {
-	memset(recents, 0, sizeof(recents));
+	recent_load(idx);
+
+	cur->gen++;
+	cur->num = 0;
+	memset(cur->recs, 0, sizeof(cur->recs));
 
 	// store the config file to storage
-	FileSaveConfig(recent_create_config_name(idx), recents, sizeof(recents));
+	recent_store();
 }
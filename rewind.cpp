@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+
+#include "rewind.h"
+#include "offload.h"
+#include "membudget.h"
+
+// Deltas are coded as words: a run of unchanged words, a count of changed
+// ones and the changed words (XOR). Going back one state XORs the delta into
+// the state after it, so the oldest ones can be dropped at any time.
+struct rwDelta
+{
+	uint32_t *data;
+	uint32_t len;  // words of data
+	uint32_t size; // bytes of the older state
+};
+
+// main thread
+static int rw_on = 0;
+static int rw_want = 0;
+static offload_handle_t rw_handle = 0;
+
+// bulk worker
+static size_t rw_max = 0;
+static size_t rw_bytes = 0;
+static uint32_t rw_budget = 0; // main thread copy of rw_max
+static std::deque<rwDelta> rw_ring;
+static std::vector<uint32_t> rw_head; // newest state
+static std::vector<uint32_t> rw_cur;  // state stepped back to
+static size_t rw_pos = 0;             // deltas before rw_cur
+static int rw_steps = 0;
+static std::vector<uint32_t> rw_enc;
+
+// result of the last step, handed over through rw_handle
+static uint8_t *rw_out = 0;
+static uint32_t rw_out_size = 0;
+static int rw_out_steps = 0;
+
+static void rw_clear()
+{
+	for (auto &d : rw_ring) free(d.data);
+	rw_ring.clear();
+	rw_head.clear();
+	rw_cur.clear();
+	rw_bytes = 0;
+	rw_pos = 0;
+	rw_steps = 0;
+}
+
+static void rw_encode(const uint32_t *old_st, uint32_t old_len, const uint32_t *new_st, uint32_t new_len)
+{
+	uint32_t n = (old_len > new_len) ? old_len : new_len;
+	rw_enc.clear();
+
+	uint32_t i = 0;
+	while (i < n)
+	{
+		uint32_t z = i;
+		while (i < n && (i < old_len ? old_st[i] : 0) == (i < new_len ? new_st[i] : 0)) i++;
+		if (i == n) break;
+
+		rw_enc.push_back(i - z);
+		size_t cnt = rw_enc.size();
+		rw_enc.push_back(0);
+
+		uint32_t l = i;
+		for (; i < n; i++)
+		{
+			uint32_t x = (i < old_len ? old_st[i] : 0) ^ (i < new_len ? new_st[i] : 0);
+			if (!x) break;
+			rw_enc.push_back(x);
+		}
+		rw_enc[cnt] = i - l;
+	}
+}
+
+static void rw_decode(std::vector<uint32_t> &st, const rwDelta &d)
+{
+	uint32_t words = d.size / 4;
+	if (st.size() < words) st.resize(words, 0);
+
+	const uint32_t *p = d.data, *end = d.data + d.len;
+	size_t i = 0;
+	while (p + 2 <= end)
+	{
+		i += *p++;
+		uint32_t cnt = *p++;
+		if (cnt > end - p || i + cnt > st.size()) break;
+		while (cnt--) st[i++] ^= *p++;
+	}
+	st.resize(words);
+}
+
+static void rw_add(uint32_t *state, uint32_t size)
+{
+	uint32_t words = size / 4;
+	if (!rw_head.empty())
+	{
+		rw_encode(rw_head.data(), rw_head.size(), state, words);
+
+		rwDelta d = { (uint32_t*)malloc(rw_enc.size() * 4), (uint32_t)rw_enc.size(), (uint32_t)rw_head.size() * 4 };
+		if (d.data)
+		{
+			memcpy(d.data, rw_enc.data(), d.len * 4);
+			rw_ring.push_back(d);
+			rw_bytes += d.len * 4;
+		}
+		else
+		{
+			rw_clear();
+		}
+	}
+
+	rw_head.assign(state, state + words);
+	free(state);
+
+	// a new state starts stepping back from the newest one again
+	rw_cur.clear();
+	rw_pos = rw_ring.size();
+	rw_steps = 0;
+
+	while (!rw_ring.empty() && rw_bytes + rw_head.size() * 8 > rw_max)
+	{
+		rw_bytes -= rw_ring.front().len * 4;
+		free(rw_ring.front().data);
+		rw_ring.pop_front();
+		rw_pos--;
+	}
+}
+
+static void rw_step(int n)
+{
+	rw_out = 0;
+	if (rw_head.empty()) return;
+
+	if (rw_cur.empty())
+	{
+		rw_cur = rw_head;
+		rw_pos = rw_ring.size();
+		rw_steps = 0;
+	}
+
+	for (; n > 0 && rw_pos > 0; n--)
+	{
+		rw_decode(rw_cur, rw_ring[--rw_pos]);
+		rw_steps++;
+	}
+
+	if (!rw_steps) return;
+
+	rw_out_size = rw_cur.size() * 4;
+	rw_out = (uint8_t*)malloc(rw_out_size);
+	if (rw_out) memcpy(rw_out, rw_cur.data(), rw_out_size);
+	rw_out_steps = rw_steps;
+}
+
+// the ring is the bulk worker's, the budget sees the size it may grow to
+static size_t rw_budget_size()
+{
+	return rw_budget;
+}
+
+void rewind_init(uint32_t max_bytes)
+{
+	if (rw_handle)
+	{
+		offload_wait(rw_handle);
+		free(rw_out);
+		rw_out = 0;
+		rw_handle = 0;
+	}
+
+	if (!rw_on && !max_bytes) return;
+
+	rw_on = max_bytes > 0;
+	rw_want = 0;
+	rw_budget = max_bytes;
+	membudget_register("rewind", MEMBUDGET_PRIO_HIGH, rw_budget_size);
+	offload_add_work([max_bytes]
+	{
+		rw_clear();
+		rw_max = max_bytes;
+	}, OFFLOAD_PRIO_BULK);
+}
+
+int rewind_enabled()
+{
+	return rw_on;
+}
+
+void rewind_push(const void *state, uint32_t size)
+{
+	if (!rw_on || (size & 3)) return;
+
+	uint32_t *copy = (uint32_t*)malloc(size);
+	if (!copy) return;
+
+	memcpy(copy, state, size);
+	offload_add_work([copy, size] { rw_add(copy, size); }, OFFLOAD_PRIO_BULK);
+}
+
+static void rw_queue()
+{
+	int n = rw_want;
+	rw_want = 0;
+	rw_handle = offload_add_work([n] { rw_step(n); }, OFFLOAD_PRIO_BULK);
+}
+
+void rewind_back()
+{
+	if (!rw_on) return;
+
+	// presses during a running step are done in one go by the next one
+	rw_want++;
+	if (!rw_handle) rw_queue();
+}
+
+int rewind_take(uint8_t **state, uint32_t *size, int *steps)
+{
+	if (!rw_handle || !offload_is_done(rw_handle)) return 0;
+	rw_handle = 0;
+
+	*state = rw_out;
+	*size = rw_out_size;
+	*steps = rw_out_steps;
+	rw_out = 0;
+
+	if (rw_want) rw_queue();
+	return 1;
+}
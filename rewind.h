@@ -0,0 +1,25 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <inttypes.h>
+
+// Rewind through the states a core saves into its savestate slots. Every new
+// state is kept in a RAM ring as the XOR against the next one, run length
+// coded, so the ring holds minutes of states for cores saving them often.
+// The ring is kept and decoded on the bulk worker. See rewind in MiSTer.ini.
+
+// empties the ring and sets its size, 0 - disabled
+void rewind_init(uint32_t max_bytes);
+int rewind_enabled();
+
+// a new state of the core, copied before returning
+void rewind_push(const void *state, uint32_t size);
+
+// one state further back (from the newest one after another push)
+void rewind_back();
+
+// 1 once a step is done. state is the one stepped back to (malloc'd), 0 if
+// there is nothing older. steps is how far back it is.
+int rewind_take(uint8_t **state, uint32_t *size, int *steps);
+
+#endif
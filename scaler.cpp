@@ -16,6 +16,10 @@ with help from the MiSTer contributors including Grabulosaure
 #include <sys/types.h>
 #include <err.h>
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #include "scaler.h"
 #include "shmem.h"
 
@@ -42,19 +46,12 @@ mister_scaler * mister_scaler_init()
     printf (" 1: %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X\n",
             buffer[0],buffer[1],buffer[2],buffer[3],buffer[4],buffer[5],buffer[6],buffer[7],
             buffer[8],buffer[9],buffer[10],buffer[11],buffer[12],buffer[13],buffer[14],buffer[15]);
-    if (buffer[0]!=1 || buffer[1]!=1) {
+    if (mister_scaler_update(ms)) {
         printf("problem\n");
         mister_scaler_free(ms);
         return NULL;
     }
 
-    ms->header=buffer[2]<<8 | buffer[3];
-    ms->width =buffer[6]<<8 | buffer[7];
-    ms->height=buffer[8]<<8 | buffer[9];
-    ms->line  =buffer[10]<<8 | buffer[11];
-    ms->output_width =buffer[12]<<8 | buffer[13];
-    ms->output_height=buffer[14]<<8 | buffer[15];
-
     printf ("Image: Width=%i Height=%i  Line=%i  Header=%i output_width=%i output_height=%i \n",ms->width,ms->height,ms->line,ms->header,ms->output_width,ms->output_height);
    /*
     printf (" 1: %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X\n",
@@ -66,44 +63,161 @@ mister_scaler * mister_scaler_init()
 
 }
 
+int mister_scaler_update(mister_scaler *ms)
+{
+    unsigned char *buffer = (unsigned char *)(ms->map+ms->map_off);
+    if (buffer[0]!=1 || buffer[1]!=1) return -1;
+
+    ms->header=buffer[2]<<8 | buffer[3];
+    ms->width =buffer[6]<<8 | buffer[7];
+    ms->height=buffer[8]<<8 | buffer[9];
+    ms->line  =buffer[10]<<8 | buffer[11];
+    ms->output_width =buffer[12]<<8 | buffer[13];
+    ms->output_height=buffer[14]<<8 | buffer[15];
+
+    if (ms->width*3 > ms->line || ms->header + ms->height*ms->line > ms->num_bytes) return -1;
+    return 0;
+}
+
 void mister_scaler_free(mister_scaler *ms)
 {
    shmem_unmap(ms->map,ms->num_bytes+ms->map_off);
    free(ms);
 }
 
+// The scaler buffer is mapped uncached, so byte reads are very slow there.
+// Every line is copied with memcpy (wide bursts) into a cached staging
+// line first and converted from there.
+static unsigned char *scaler_line(mister_scaler *ms, int y, unsigned char *stage)
+{
+    unsigned char *buffer = (unsigned char *)(ms->map+ms->map_off);
+    memcpy(stage, &buffer[ms->header + y*ms->line], ms->width*3);
+    return stage;
+}
+
+// BT.601 studio range, 8-bit fixed point
+static inline void rgb_to_yuv(int R, int G, int B, unsigned char *Y, unsigned char *U, unsigned char *V)
+{
+    *Y = (( 66*R + 129*G +  25*B + 128) >> 8) + 16;
+    *U = ((-38*R -  74*G + 112*B + 128) >> 8) + 128;
+    *V = ((112*R -  94*G -  18*B + 128) >> 8) + 128;
+}
+
+#ifdef __ARM_NEON
+static inline uint8x8_t neon_y(uint8x8_t R, uint8x8_t G, uint8x8_t B)
+{
+    // Y fits unsigned 16 bit only
+    uint16x8_t Y = vmull_u8(R, vdup_n_u8(66));
+    Y = vmlal_u8(Y, G, vdup_n_u8(129));
+    Y = vmlal_u8(Y, B, vdup_n_u8(25));
+    return vadd_u8(vrshrn_n_u16(Y, 8), vdup_n_u8(16));
+}
+
+static inline void neon_uv(uint16x8_t r, uint16x8_t g, uint16x8_t b, unsigned char *outU, unsigned char *outV)
+{
+    const int16x8_t c128 = vdupq_n_s16(128);
+    int16x8_t R = vreinterpretq_s16_u16(r);
+    int16x8_t G = vreinterpretq_s16_u16(g);
+    int16x8_t B = vreinterpretq_s16_u16(b);
+
+    int16x8_t U = vmulq_n_s16(B, 112);
+    U = vmlsq_n_s16(U, R, 38);
+    U = vmlsq_n_s16(U, G, 74);
+    vst1_u8(outU, vqmovun_s16(vaddq_s16(vrshrq_n_s16(U, 8), c128)));
+
+    int16x8_t V = vmulq_n_s16(R, 112);
+    V = vmlsq_n_s16(V, G, 94);
+    V = vmlsq_n_s16(V, B, 18);
+    vst1_u8(outV, vqmovun_s16(vaddq_s16(vrshrq_n_s16(V, 8), c128)));
+}
+#endif
+
 int mister_scaler_read_yuv(mister_scaler *ms,int lineY,unsigned char *bufY, int lineU, unsigned char *bufU, int lineV, unsigned char *bufV)
 {
-    unsigned char *buffer;
-    buffer = (unsigned char *)(ms->map+ms->map_off);
+    unsigned char *stage = (unsigned char *)malloc(ms->width*3 + 16);
+    if (!stage) return -1;
 
-    // do this slow way for now..
-    unsigned char *pixbuf;
-    unsigned char *outbufy;
-    unsigned char *outbufU;
-    unsigned char *outbufV;
     for (int  y=0; y< ms->height ; y++)
-	{
-        pixbuf=&buffer[ms->header + y*ms->line];
-        outbufy=&bufY[y*(lineY)];
-        outbufU=&bufU[y*(lineU)];
-        outbufV=&bufV[y*(lineV)];
-        for (int x = 0; x < ms->width ; x++)
-		{
-			int R,G,B;
-			R = *pixbuf++;
-			G = *pixbuf++;
-			B = *pixbuf++;
-			int Y =  (0.257 * R) + (0.504 * G) + (0.098 * B) + 16;
-			int U = -(0.148 * R) - (0.291 * G) + (0.439 * B) + 128;
-			int V =  (0.439 * R) - (0.368 * G) - (0.071 * B) + 128;
-
-			*outbufy++ = Y;
-			*outbufU++ = U;
-			*outbufV++ = V;
+    {
+        unsigned char *pixbuf = scaler_line(ms, y, stage);
+        unsigned char *outbufy = &bufY[y*(lineY)];
+        unsigned char *outbufU = &bufU[y*(lineU)];
+        unsigned char *outbufV = &bufV[y*(lineV)];
+        int x = 0;
+
+#ifdef __ARM_NEON
+        for (; x + 8 <= ms->width; x += 8)
+        {
+            uint8x8x3_t rgb = vld3_u8(pixbuf + x*3);
+            vst1_u8(outbufy + x, neon_y(rgb.val[0], rgb.val[1], rgb.val[2]));
+            neon_uv(vmovl_u8(rgb.val[0]), vmovl_u8(rgb.val[1]), vmovl_u8(rgb.val[2]), outbufU + x, outbufV + x);
+        }
+#endif
+
+        for (; x < ms->width ; x++)
+        {
+            rgb_to_yuv(pixbuf[x*3], pixbuf[x*3+1], pixbuf[x*3+2], outbufy + x, outbufU + x, outbufV + x);
+        }
+    }
+
+    free(stage);
+    return 0;
+}
+
+int mister_scaler_read_yuv420(mister_scaler *ms, unsigned char *bufY, unsigned char *bufU, unsigned char *bufV)
+{
+    int w = ms->width;
+    int cw = (w + 1) / 2;
+    unsigned char *stage = (unsigned char *)malloc(w*6 + 32);
+    if (!stage) return -1;
+
+    for (int  y=0; y< ms->height ; y+=2)
+    {
+        // odd heights repeat the last line
+        unsigned char *l0 = scaler_line(ms, y, stage);
+        unsigned char *l1 = (y + 1 < ms->height) ? scaler_line(ms, y + 1, stage + w*3 + 16) : l0;
+        unsigned char *y0 = &bufY[y*w];
+        unsigned char *y1 = (y + 1 < ms->height) ? y0 + w : y0;
+        unsigned char *outU = &bufU[(y/2)*cw];
+        unsigned char *outV = &bufV[(y/2)*cw];
+        int x = 0;
+
+#ifdef __ARM_NEON
+        for (; x + 16 <= w; x += 16)
+        {
+            uint8x16x3_t a = vld3q_u8(l0 + x*3);
+            uint8x16x3_t b = vld3q_u8(l1 + x*3);
+            vst1_u8(y0 + x, neon_y(vget_low_u8(a.val[0]), vget_low_u8(a.val[1]), vget_low_u8(a.val[2])));
+            vst1_u8(y0 + x + 8, neon_y(vget_high_u8(a.val[0]), vget_high_u8(a.val[1]), vget_high_u8(a.val[2])));
+            vst1_u8(y1 + x, neon_y(vget_low_u8(b.val[0]), vget_low_u8(b.val[1]), vget_low_u8(b.val[2])));
+            vst1_u8(y1 + x + 8, neon_y(vget_high_u8(b.val[0]), vget_high_u8(b.val[1]), vget_high_u8(b.val[2])));
+
+            // 2x2 averages
+            uint16x8_t R = vrshrq_n_u16(vaddq_u16(vpaddlq_u8(a.val[0]), vpaddlq_u8(b.val[0])), 2);
+            uint16x8_t G = vrshrq_n_u16(vaddq_u16(vpaddlq_u8(a.val[1]), vpaddlq_u8(b.val[1])), 2);
+            uint16x8_t B = vrshrq_n_u16(vaddq_u16(vpaddlq_u8(a.val[2]), vpaddlq_u8(b.val[2])), 2);
+            neon_uv(R, G, B, outU + x/2, outV + x/2);
+        }
+#endif
+
+        for (; x < w; x += 2)
+        {
+            int x1 = (x + 1 < w) ? x + 1 : x;
+            unsigned char u, v;
+            rgb_to_yuv(l0[x*3], l0[x*3+1], l0[x*3+2], y0 + x, &u, &v);
+            rgb_to_yuv(l0[x1*3], l0[x1*3+1], l0[x1*3+2], y0 + x1, &u, &v);
+            rgb_to_yuv(l1[x*3], l1[x*3+1], l1[x*3+2], y1 + x, &u, &v);
+            rgb_to_yuv(l1[x1*3], l1[x1*3+1], l1[x1*3+2], y1 + x1, &u, &v);
+
+            int R = (l0[x*3]   + l0[x1*3]   + l1[x*3]   + l1[x1*3]   + 2) >> 2;
+            int G = (l0[x*3+1] + l0[x1*3+1] + l1[x*3+1] + l1[x1*3+1] + 2) >> 2;
+            int B = (l0[x*3+2] + l0[x1*3+2] + l1[x*3+2] + l1[x1*3+2] + 2) >> 2;
+            unsigned char Y;
+            rgb_to_yuv(R, G, B, &Y, outU + x/2, outV + x/2);
         }
     }
 
+    free(stage);
     return 0;
 }
 
@@ -112,40 +226,43 @@ int mister_scaler_read(mister_scaler *ms,unsigned char *gbuf)
     unsigned char *buffer;
     buffer = (unsigned char *)(ms->map+ms->map_off);
 
-    // do this slow way for now..  - could use a memcpy?
-    unsigned char *pixbuf;
-    unsigned char *outbuf;
+    // same pixel format, lines are copied as they are
     for (int  y=0; y< ms->height ; y++) {
-          pixbuf=&buffer[ms->header + y*ms->line];
-          outbuf=&gbuf[y*(ms->width*3)];
-          for (int x = 0; x < ms->width ; x++) {
-            *outbuf++ = *pixbuf++;
-            *outbuf++ = *pixbuf++;
-            *outbuf++ = *pixbuf++;
-          }
+          memcpy(&gbuf[y*(ms->width*3)], &buffer[ms->header + y*ms->line], ms->width*3);
     }
 
     return 0;
 }
 
 int mister_scaler_read_32(mister_scaler *ms, unsigned char *gbuf) {
-    unsigned char *buffer;
-    buffer = (unsigned char *)(ms->map+ms->map_off);
+    unsigned char *stage = (unsigned char *)malloc(ms->width*3 + 16);
+    if (!stage) return -1;
 
-    // do this slow way for now..  - could use a memcpy?
-    unsigned char *pixbuf;
-    unsigned char *outbuf;
     for (int  y=0; y< ms->height ; y++) {
-          pixbuf=&buffer[ms->header + y*ms->line];
-          outbuf=&gbuf[y*(ms->width*4)];
-          for (int x = 0; x < ms->width ; x++) {
-            outbuf[2] = *pixbuf++;
-            outbuf[1] = *pixbuf++;
-            outbuf[0] = *pixbuf++;
-            outbuf[3] = 0xFF;
-	    outbuf+=4;
+          unsigned char *pixbuf = scaler_line(ms, y, stage);
+          unsigned char *outbuf = &gbuf[y*(ms->width*4)];
+          int x = 0;
+
+#ifdef __ARM_NEON
+          for (; x + 16 <= ms->width; x += 16) {
+            uint8x16x3_t rgb = vld3q_u8(pixbuf + x*3);
+            uint8x16x4_t bgra;
+            bgra.val[0] = rgb.val[2];
+            bgra.val[1] = rgb.val[1];
+            bgra.val[2] = rgb.val[0];
+            bgra.val[3] = vdupq_n_u8(0xFF);
+            vst4q_u8(outbuf + x*4, bgra);
+          }
+#endif
+
+          for (; x < ms->width ; x++) {
+            outbuf[x*4+2] = pixbuf[x*3];
+            outbuf[x*4+1] = pixbuf[x*3+1];
+            outbuf[x*4+0] = pixbuf[x*3+2];
+            outbuf[x*4+3] = 0xFF;
           }
     }
 
+    free(stage);
     return 0;
 }
@@ -26,6 +26,10 @@ mister_scaler *mister_scaler_init();
 int mister_scaler_read(mister_scaler *,unsigned char *buffer);
 int mister_scaler_read_32(mister_scaler *ms, unsigned char *buffer);
 int mister_scaler_read_yuv(mister_scaler *ms,int,unsigned char *y,int, unsigned char *U,int, unsigned char *V);
+// I420: Y is width x height, U and V are (width+1)/2 x (height+1)/2
+int mister_scaler_read_yuv420(mister_scaler *ms, unsigned char *y, unsigned char *U, unsigned char *V);
+// re-reads the frame geometry, which changes with the core's video mode. -1 if the header is invalid.
+int mister_scaler_update(mister_scaler *ms);
 void mister_scaler_free(mister_scaler *);
 
 #endif
@@ -1,17 +1,38 @@
 #include "scheduler.h"
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include "libco.h"
+#include "hardware.h"
+#include "cfg.h"
 #include "menu.h"
 #include "user_io.h"
 #include "input.h"
 #include "fpga_io.h"
 #include "osd.h"
 #include "profiling.h"
+#include "counters.h"
+#include "perfhud.h"
+#include "membudget.h"
+#include "cmdsock.h"
+#include "video.h"
+#include "loadlog.h"
 
 static cothread_t co_scheduler = nullptr;
 static cothread_t co_poll = nullptr;
 static cothread_t co_ui = nullptr;
+static cothread_t co_storage = nullptr;
+static cothread_t co_storage_return = nullptr;
 static cothread_t co_last = nullptr;
+static uint32_t storage_last = 0;
+
+// keep spinning this long after the last activity before going to sleep
+static constexpr uint32_t IDLE_GRACE_MS = 100;
+
+static int epoll_fd = -1;
+static uint32_t last_activity = 0;
+static uint32_t wake_deadline = 0;
+static int wake_requested = 0;
 
 static void scheduler_wait_fpga_ready(void)
 {
@@ -29,40 +50,135 @@ static void scheduler_co_poll(void)
 
 		{
 			SPIKE_SCOPE("co_poll", 1000);
+			uint32_t start = counters_time_us();
+			input_lock();
 			user_io_poll();
+			cmdsock_poll();
+			input_unlock();
 			input_poll(0);
+			histogram_add(HIST_CO_POLL, counters_time_us() - start);
 		}
 
+		// running cores can't wake us up, check their requests every ms
+		if (!is_menu()) scheduler_wake_in(1);
+
 		scheduler_yield();
 	}
 }
 
+static void scheduler_co_storage(void)
+{
+	for (;;)
+	{
+		scheduler_wait_fpga_ready();
+
+		{
+			SPIKE_SCOPE("co_storage", 1000);
+			user_io_poll_storage();
+		}
+		storage_last = GetTimer(0);
+
+		// return to the UI if it called us in, otherwise to the scheduler
+		cothread_t ret = co_storage_return ? co_storage_return : co_scheduler;
+		co_storage_return = nullptr;
+		co_switch(ret);
+	}
+}
+
+void scheduler_service_storage(void)
+{
+	if (!co_storage || co_active() != co_ui) return;
+	if (storage_last == GetTimer(0)) return;
+
+	co_storage_return = co_ui;
+	co_switch(co_storage);
+}
+
 static void scheduler_co_ui(void)
 {
 	for (;;)
 	{
 		{
 			SPIKE_SCOPE("co_ui", 1000);
-			HandleUI();
+			uint32_t start = counters_time_us();
+			input_lock();
+			ProgressPoll();
+			perfhud_poll();
+			membudget_poll();
+			FileConfigPoll();
+			video_menu_bg_poll();
+			loadlog_poll();
+			if (menu_needs_service()) HandleUI();
 			OsdUpdate();
+			input_unlock();
+			histogram_add(HIST_CO_UI, counters_time_us() - start);
 		}
 
+		// menu timers (scrolling, info timeouts) need a steady tick while OSD is shown
+		if (user_io_osd_is_visible()) scheduler_wake_in(10);
+
 		scheduler_yield();
 	}
 }
 
-static void scheduler_schedule(void)
+void scheduler_watch_fd(int fd, uint32_t events)
 {
-	if (co_last == co_poll)
-	{
-		co_last = co_ui;
-		co_switch(co_ui);
-	}
-	else
+	if (epoll_fd < 0 || fd < 0) return;
+
+	struct epoll_event ev = {};
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void scheduler_unwatch_fd(int fd)
+{
+	if (epoll_fd < 0 || fd < 0) return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void scheduler_wake_in(uint32_t ms)
+{
+	uint32_t deadline = GetTimer(ms);
+	if (!wake_requested || (int32_t)(deadline - wake_deadline) < 0) wake_deadline = deadline;
+	wake_requested = 1;
+}
+
+void scheduler_activity(void)
+{
+	last_activity = GetTimer(0);
+}
+
+// called after every full round of co_poll and co_ui
+static void scheduler_idle(void)
+{
+	if (!cfg.idle_sleep || epoll_fd < 0) return;
+
+	uint32_t now = GetTimer(0);
+	int timeout = cfg.idle_sleep;
+	if (wake_requested)
 	{
-		co_last = co_poll;
-		co_switch(co_poll);
+		int32_t left = (int32_t)(wake_deadline - now);
+		if (left < timeout) timeout = (left > 0) ? left : 0;
 	}
+	wake_requested = 0;
+
+	if ((now - last_activity) < IDLE_GRACE_MS || !timeout) return;
+
+	PROFILE_SCOPE("idle");
+	struct epoll_event ev[8];
+	if (epoll_wait(epoll_fd, ev, sizeof(ev) / sizeof(ev[0]), timeout) > 0) scheduler_activity();
+}
+
+// storage gets every other slice: poll, storage, ui, storage, poll...
+static void scheduler_schedule(void)
+{
+	static int slot = 0;
+	static const cothread_t *const order[] = { &co_poll, &co_storage, &co_ui, &co_storage };
+
+	co_last = *order[slot];
+	slot = (slot + 1) & 3;
+	co_switch(co_last);
 }
 
 void scheduler_init(void)
@@ -71,6 +187,11 @@ void scheduler_init(void)
 
 	co_poll = co_create(co_stack_size, scheduler_co_poll);
 	co_ui = co_create(co_stack_size, scheduler_co_ui);
+	co_storage = co_create(co_stack_size, scheduler_co_storage);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) printf("scheduler: epoll_create1 failed, idle sleep is disabled.\n");
+	last_activity = GetTimer(0);
 }
 
 void scheduler_run(void)
@@ -80,8 +201,14 @@ void scheduler_run(void)
 	for (;;)
 	{
 		scheduler_schedule();
+		if (co_last == co_ui)
+		{
+			counter_add(CNT_LOOP);
+			scheduler_idle();
+		}
 	}
 
+	co_delete(co_storage);
 	co_delete(co_ui);
 	co_delete(co_poll);
 	co_delete(co_scheduler);
@@ -89,5 +216,20 @@ void scheduler_run(void)
 
 void scheduler_yield(void)
 {
+	// storage yielding on its own goes back through the scheduler,
+	// the UI that called it in will be resumed in its regular slot.
+	if (co_active() == co_storage) co_storage_return = nullptr;
 	co_switch(co_scheduler);
 }
+
+void scheduler_wait_work(offload_handle_t handle)
+{
+	// not running inside a coroutine yet
+	if (!co_scheduler || co_active() == co_scheduler)
+	{
+		offload_wait(handle);
+		return;
+	}
+
+	while (!offload_is_done(handle)) scheduler_yield();
+}
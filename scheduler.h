@@ -1,10 +1,33 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
+#include <inttypes.h>
+#include "offload.h"
+
 #define USE_SCHEDULER
 
 void scheduler_init(void);
 void scheduler_run(void);
 void scheduler_yield(void);
 
+// Give the storage coroutine a slice from inside a long running UI operation
+// (directory scan, rendering). Does nothing outside of co_ui and is rate
+// limited, so it's cheap to call from tight loops.
+void scheduler_service_storage(void);
+
+// yield to the other coroutines until offloaded work completes.
+void scheduler_wait_work(offload_handle_t handle);
+
+// Wake sources for idle sleep (see idle_sleep in MiSTer.ini).
+// Registered fds wake the main loop as soon as they become ready.
+// Closed fds are dropped from the set automatically.
+void scheduler_watch_fd(int fd, uint32_t events);
+void scheduler_unwatch_fd(int fd);
+
+// the calling coroutine needs to run again within ms milliseconds.
+void scheduler_wake_in(uint32_t ms);
+
+// the calling coroutine did some work, keep spinning for a while.
+void scheduler_activity(void);
+
 #endif
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shcache.h"
+#include "lib/miniz/miniz.h"
+#include "membudget.h"
+
+// One file in tmpfs mapped shared: a header with a slot table and a heap that
+// is only ever appended to. A full heap starts over empty. Records carry a crc
+// of their key and data, and the busy flag tells a region left behind in the
+// middle of an update, which is then started over as well.
+#define SHC_FILE    "/tmp/MiSTer_cache"
+#define SHC_MAGIC   0x31484353 // "SCH1"
+#define SHC_VERSION 1
+#define SHC_SIZE    (16 * 1024 * 1024)
+#define SHC_SLOTS   1024
+#define SHC_PROBE   16
+#define SHC_MAX_REC (SHC_SIZE / 4)
+
+struct shcSlot
+{
+	uint32_t hash;
+	uint32_t off;
+	uint32_t len;
+};
+
+struct shcHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t used;
+	uint32_t gen;
+	uint32_t busy;
+	shcSlot  slot[SHC_SLOTS];
+};
+
+struct shcRec
+{
+	uint32_t magic;
+	uint32_t key_len;
+	uint32_t data_len;
+	uint32_t crc;
+};
+
+static pthread_mutex_t shc_lock = PTHREAD_MUTEX_INITIALIZER;
+static shcHeader *shc = 0;
+static int shc_state = 0; // 0 - not open yet, 1 - open, -1 - unavailable
+
+static void shc_reset()
+{
+	uint32_t gen = (shc->magic == SHC_MAGIC) ? shc->gen + 1 : 0;
+	memset(shc, 0, sizeof(*shc));
+	shc->magic = SHC_MAGIC;
+	shc->version = SHC_VERSION;
+	shc->size = SHC_SIZE;
+	shc->used = (sizeof(*shc) + 7) & ~7;
+	shc->gen = gen;
+}
+
+static size_t shc_size()
+{
+	return SHC_SIZE;
+}
+
+static int shc_open()
+{
+	if (shc_state) return shc_state > 0;
+	shc_state = -1;
+
+	int fd = open(SHC_FILE, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0) return 0;
+
+	// all pages are allocated up front, a full tmpfs would be a SIGBUS on a store
+	struct stat64 st;
+	if (fstat64(fd, &st) < 0 || (st.st_size != SHC_SIZE && (ftruncate(fd, 0) < 0 || posix_fallocate(fd, 0, SHC_SIZE))))
+	{
+		printf("shcache: cannot set up %s\n", SHC_FILE);
+		close(fd);
+		unlink(SHC_FILE);
+		return 0;
+	}
+
+	void *p = mmap(NULL, SHC_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return 0;
+
+	shc = (shcHeader*)p;
+	if (shc->magic != SHC_MAGIC || shc->version != SHC_VERSION || shc->size != SHC_SIZE || shc->busy ||
+		shc->used < sizeof(*shc) || shc->used > SHC_SIZE)
+	{
+		printf("shcache: starting empty\n");
+		shc_reset();
+	}
+	else
+	{
+		printf("shcache: %u KB kept from the last run\n", shc->used / 1024);
+	}
+
+	shc_state = 1;
+	membudget_register("shcache", MEMBUDGET_PRIO_HIGH, shc_size);
+	return 1;
+}
+
+static uint32_t shc_hash(const char *key)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *p = key; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	return hash | 1; // 0 is a free slot
+}
+
+static uint32_t shc_crc(const char *key, uint32_t key_len, const void *data, uint32_t len)
+{
+	uint32_t crc = mz_crc32(MZ_CRC32_INIT, (const uint8_t*)key, key_len);
+	return mz_crc32(crc, (const uint8_t*)data, len);
+}
+
+// valid record of the key in slot s, 0 if it's another key or damaged
+static shcRec *shc_rec(const shcSlot *s, const char *key, uint32_t hash, uint32_t key_len)
+{
+	if (s->hash != hash || s->off < sizeof(*shc) || s->len < sizeof(shcRec) || s->off > shc->used || s->len > shc->used - s->off) return 0;
+
+	shcRec *r = (shcRec*)((uint8_t*)shc + s->off);
+	if (r->magic != SHC_MAGIC || r->key_len != key_len || r->data_len != s->len - sizeof(*r) - key_len) return 0;
+
+	const char *k = (const char*)(r + 1);
+	if (memcmp(k, key, key_len) || r->crc != shc_crc(k, key_len, k + key_len, r->data_len)) return 0;
+	return r;
+}
+
+static shcSlot *shc_find(const char *key, uint32_t hash, uint32_t key_len)
+{
+	for (int i = 0; i < SHC_PROBE; i++)
+	{
+		shcSlot *s = &shc->slot[(hash + i) % SHC_SLOTS];
+		if (shc_rec(s, key, hash, key_len)) return s;
+	}
+	return 0;
+}
+
+static void shc_put(const char *key, const void *data, size_t len)
+{
+	uint32_t key_len = strlen(key);
+	uint32_t hash = shc_hash(key);
+	uint32_t size = sizeof(shcRec) + key_len + len;
+	if (len > SHC_MAX_REC) return;
+
+	shcSlot *s = shc_find(key, hash, key_len);
+	for (int i = 0; !s && i < SHC_PROBE; i++)
+	{
+		shcSlot *f = &shc->slot[(hash + i) % SHC_SLOTS];
+		if (!f->hash) s = f;
+	}
+
+	shc->busy = 1;
+	__sync_synchronize();
+
+	if (!s || size > SHC_SIZE - shc->used)
+	{
+		shc_reset();
+		shc->busy = 1;
+		s = &shc->slot[hash % SHC_SLOTS];
+	}
+
+	shcRec *r = (shcRec*)((uint8_t*)shc + shc->used);
+	r->magic = SHC_MAGIC;
+	r->key_len = key_len;
+	r->data_len = len;
+	memcpy(r + 1, key, key_len);
+	memcpy((uint8_t*)(r + 1) + key_len, data, len);
+	r->crc = shc_crc(key, key_len, data, len);
+
+	s->hash = hash;
+	s->off = shc->used;
+	s->len = size;
+	shc->used = (shc->used + size + 7) & ~7;
+
+	__sync_synchronize();
+	shc->busy = 0;
+}
+
+static void *shc_read_file(const char *name, size_t *len)
+{
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	void *data = 0;
+	struct stat64 st;
+	if (!fstat64(fd, &st) && st.st_size > 0 && st.st_size <= 0x7FFFFFFF)
+	{
+		data = malloc(st.st_size);
+		if (data && read(fd, data, st.st_size) != st.st_size)
+		{
+			free(data);
+			data = 0;
+		}
+		*len = st.st_size;
+	}
+	close(fd);
+	return data;
+}
+
+void *shcache_load(const char *name, size_t *len)
+{
+	pthread_mutex_lock(&shc_lock);
+	if (shc_open())
+	{
+		uint32_t key_len = strlen(name);
+		shcSlot *s = shc_find(name, shc_hash(name), key_len);
+		if (s)
+		{
+			shcRec *r = (shcRec*)((uint8_t*)shc + s->off);
+			void *data = malloc(r->data_len ? r->data_len : 1);
+			if (data)
+			{
+				memcpy(data, (uint8_t*)(r + 1) + key_len, r->data_len);
+				*len = r->data_len;
+			}
+			pthread_mutex_unlock(&shc_lock);
+			return data;
+		}
+	}
+	pthread_mutex_unlock(&shc_lock);
+
+	// the file is read outside of the lock, the next run finds it in the region
+	void *data = shc_read_file(name, len);
+	if (data) shcache_store(name, data, *len);
+	return data;
+}
+
+void shcache_store(const char *name, const void *data, size_t len)
+{
+	pthread_mutex_lock(&shc_lock);
+	if (shc_open()) shc_put(name, data, len);
+	pthread_mutex_unlock(&shc_lock);
+}
+
+void shcache_drop(const char *name)
+{
+	pthread_mutex_lock(&shc_lock);
+	if (shc_open())
+	{
+		shcSlot *s = shc_find(name, shc_hash(name), strlen(name));
+		if (s) memset(s, 0, sizeof(*s));
+	}
+	pthread_mutex_unlock(&shc_lock);
+}
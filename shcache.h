@@ -0,0 +1,22 @@
+#ifndef SHCACHE_H
+#define SHCACHE_H
+
+#include <stddef.h>
+
+// Copies of small cache files (zip indexes, folder listings, compiled MRAs, CD
+// info) in a tmpfs region that outlives the process, so the first browse after
+// a core load doesn't go back to the SD card. Entries are keyed by the name of
+// the cache file and hold its exact image, callers validate them the same way.
+// All functions are thread-safe.
+
+// image of the cache file, from the region or read from name and added to it.
+// malloc'd, 0 if there is neither.
+void *shcache_load(const char *name, size_t *len);
+
+// image of a cache file that has just been written (or is about to be)
+void shcache_store(const char *name, const void *data, size_t len);
+
+// the cache file has gone stale
+void shcache_drop(const char *name);
+
+#endif
@@ -10,11 +10,33 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include "shmem.h"
 
 static int memfd = -1;
 
+// Window cache for shmem_window/put/get. Windows are aligned to 1MB, so
+// neighbouring accesses (sector buffers, rom parts) share one mapping.
+#define WINDOW_ALIGN (1024 * 1024)
+#define WINDOW_MAX   (32 * 1024 * 1024)
+
+struct shmemWindow
+{
+	uint32_t start;
+	uint32_t size;
+	uint8_t *map;
+	uint32_t used;
+};
+
+static shmemWindow windows[SHMEM_WINDOWS] = {};
+static uint32_t window_tick = 0;
+static pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void *shmem_map(uint32_t address, uint32_t size)
 {
 	if (memfd < 0)
@@ -48,26 +70,133 @@ int shmem_unmap(void* map, uint32_t size)
 	return 1;
 }
 
-int shmem_put(uint32_t address, uint32_t size, void *buf)
+// io is the address on the mapping side
+static inline void copy_io(uint8_t *dst, const uint8_t *src, uint32_t len, uintptr_t io)
 {
-	void *shmem = shmem_map(address, size);
-	if (shmem)
+#ifdef __ARM_NEON
+	// bytes up to 8-byte alignment of the mapping
+	while (len && (io & 7))
 	{
-		memcpy(shmem, buf, size);
-		shmem_unmap(shmem, size);
+		*dst++ = *src++;
+		len--;
+		io++;
 	}
 
-	return shmem != 0;
+	while (len >= 64)
+	{
+		uint64x2_t a = vld1q_u64((const uint64_t*)src);
+		uint64x2_t b = vld1q_u64((const uint64_t*)(src + 16));
+		uint64x2_t c = vld1q_u64((const uint64_t*)(src + 32));
+		uint64x2_t d = vld1q_u64((const uint64_t*)(src + 48));
+		vst1q_u64((uint64_t*)dst, a);
+		vst1q_u64((uint64_t*)(dst + 16), b);
+		vst1q_u64((uint64_t*)(dst + 32), c);
+		vst1q_u64((uint64_t*)(dst + 48), d);
+		src += 64;
+		dst += 64;
+		len -= 64;
+	}
+
+	while (len >= 8)
+	{
+		vst1_u64((uint64_t*)dst, vld1_u64((const uint64_t*)src));
+		src += 8;
+		dst += 8;
+		len -= 8;
+	}
+
+	while (len--) *dst++ = *src++;
+#else
+	(void)io;
+	memcpy(dst, src, len);
+#endif
 }
 
-int shmem_get(uint32_t address, uint32_t size, void *buf)
+void shmem_write(void *dst, const void *src, uint32_t len)
+{
+	copy_io((uint8_t*)dst, (const uint8_t*)src, len, (uintptr_t)dst);
+}
+
+void shmem_read(void *dst, const void *src, uint32_t len)
+{
+	copy_io((uint8_t*)dst, (const uint8_t*)src, len, (uintptr_t)src);
+}
+
+static uint8_t *window_get(uint32_t address, uint32_t size)
+{
+	uint64_t end = (uint64_t)address + size;
+	shmemWindow *lru = &windows[0];
+
+	for (int i = 0; i < SHMEM_WINDOWS; i++)
+	{
+		shmemWindow *w = &windows[i];
+		if (w->map && address >= w->start && end <= (uint64_t)w->start + w->size)
+		{
+			w->used = ++window_tick;
+			return w->map + (address - w->start);
+		}
+
+		if (!w->map || (lru->map && w->used < lru->used)) lru = w;
+	}
+
+	uint32_t start = address & ~(WINDOW_ALIGN - 1);
+	uint32_t len = (uint32_t)(((end - start) + WINDOW_ALIGN - 1) & ~(uint64_t)(WINDOW_ALIGN - 1));
+
+	if (lru->map) shmem_unmap(lru->map, lru->size);
+	lru->map = (uint8_t*)shmem_map(start, len);
+	if (!lru->map) return 0;
+
+	lru->start = start;
+	lru->size = len;
+	lru->used = ++window_tick;
+	return lru->map + (address - start);
+}
+
+void *shmem_window(uint32_t address, uint32_t size)
 {
-	void *shmem = shmem_map(address, size);
+	if (size > WINDOW_MAX) return 0;
+
+	pthread_mutex_lock(&window_lock);
+	void *res = window_get(address, size);
+	pthread_mutex_unlock(&window_lock);
+	return res;
+}
+
+// large one-off copies are mapped directly and don't evict the cached windows
+static int shmem_copy(uint32_t address, uint32_t size, void *buf, int put)
+{
+	if (size > WINDOW_MAX)
+	{
+		void *shmem = shmem_map(address, size);
+		if (shmem)
+		{
+			if (put) shmem_write(shmem, buf, size);
+			else shmem_read(buf, shmem, size);
+			shmem_unmap(shmem, size);
+		}
+
+		return shmem != 0;
+	}
+
+	// the lock is held through the copy so another thread can't evict the window
+	pthread_mutex_lock(&window_lock);
+	void *shmem = window_get(address, size);
 	if (shmem)
 	{
-		memcpy(buf, shmem, size);
-		shmem_unmap(shmem, size);
+		if (put) shmem_write(shmem, buf, size);
+		else shmem_read(buf, shmem, size);
 	}
+	pthread_mutex_unlock(&window_lock);
 
 	return shmem != 0;
 }
+
+int shmem_put(uint32_t address, uint32_t size, void *buf)
+{
+	return shmem_copy(address, size, buf, 1);
+}
+
+int shmem_get(uint32_t address, uint32_t size, void *buf)
+{
+	return shmem_copy(address, size, buf, 0);
+}
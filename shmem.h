@@ -9,5 +9,22 @@ int shmem_unmap(void* map, uint32_t size);
 int shmem_put(uint32_t address, uint32_t size, void *buf);
 int shmem_get(uint32_t address, uint32_t size, void *buf);
 
+// Copies into and out of a mapping. The FPGA DDR isn't Linux RAM, so on ARM
+// /dev/mem maps it strongly ordered whatever the open flags (there is no
+// cached or write-combined mode for it and a user mapping of it gets no large
+// pages), every access is a bus transaction of its own. These move 64 bytes
+// per NEON load/store run with the mapping side aligned, so the accesses go
+// out as bursts, and never touch the mapping unaligned. The RAM side may have
+// any alignment.
+void shmem_write(void *dst, const void *src, uint32_t len);
+void shmem_read(void *dst, const void *src, uint32_t len);
+
+// Pointer into a mapping that is kept resident between calls. Repeated
+// accesses to the same area cost no syscall. The pointer stays valid until
+// SHMEM_WINDOWS other areas have been touched through the cache, so don't
+// keep it across calls. Don't unmap it. For the main thread only.
+#define SHMEM_WINDOWS 8
+void *shmem_window(uint32_t address, uint32_t size);
+
 #define fpga_mem(x) (0x20000000 | ((x) & 0x1FFFFFFF))
 #endif
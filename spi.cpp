@@ -1,6 +1,9 @@
+#include <string.h>
+#include <pthread.h>
 #include "spi.h"
 #include "hardware.h"
 #include "fpga_io.h"
+#include "counters.h"
 
 #define SSPI_FPGA_EN (1<<18)
 #define SSPI_OSD_EN  (1<<19)
@@ -8,14 +11,52 @@
 
 #define SWAPW(a) ((((a)<<8)&0xff00)|(((a)>>8)&0x00ff))
 
+static pthread_mutex_t spi_mutex;
+static int spi_shared = 0;
+static thread_local int spi_owner = 0;
+
+void spi_share()
+{
+	if (spi_shared) return;
+
+	// the input thread runs at realtime priority, don't let it wait behind a preempted frame
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&spi_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	spi_shared = 1;
+}
+
+int spi_acquire()
+{
+	if (!spi_shared || spi_owner) return 0;
+
+	pthread_mutex_lock(&spi_mutex);
+	spi_owner = 1;
+	return 1;
+}
+
+void spi_release(int taken)
+{
+	if (!taken || !spi_owner) return;
+
+	spi_owner = 0;
+	pthread_mutex_unlock(&spi_mutex);
+}
+
 void EnableFpga()
 {
+	spi_acquire();
+	spi_stats_begin(SPI_CS_FPGA);
 	fpga_spi_en(SSPI_FPGA_EN, 1);
 }
 
 void DisableFpga()
 {
 	fpga_spi_en(SSPI_FPGA_EN, 0);
+	spi_stats_end();
+	spi_release(1);
 }
 
 static int osd_target = OSD_ALL;
@@ -34,22 +75,30 @@ void EnableOsd()
 	if (osd_target & OSD_HDMI) mask &= ~SSPI_FPGA_EN;
 	if (osd_target & OSD_VGA) mask &= ~SSPI_IO_EN;
 
+	spi_acquire();
+	spi_stats_begin(SPI_CS_OSD);
 	fpga_spi_en(mask, 1);
 }
 
 void DisableOsd()
 {
 	fpga_spi_en(SSPI_OSD_EN | SSPI_IO_EN | SSPI_FPGA_EN, 0);
+	spi_stats_end();
+	spi_release(1);
 }
 
 void EnableIO()
 {
+	spi_acquire();
+	spi_stats_begin(SPI_CS_IO);
 	fpga_spi_en(SSPI_IO_EN, 1);
 }
 
 void DisableIO()
 {
 	fpga_spi_en(SSPI_IO_EN, 0);
+	spi_stats_end();
+	spi_release(1);
 }
 
 uint32_t spi32_w(uint32_t parm)
@@ -162,44 +211,60 @@ void spi_n(uint8_t value, uint16_t cnt)
 	while (cnt--) spi_b(value);
 }
 
+#define IS_ALIGNED16(p) (!((uintptr_t)(p) & 1))
+
 void spi_read(uint8_t *addr, uint32_t len, int wide)
 {
-	if (wide)
-	{
-		uint32_t len16 = len >> 1;
-		uint16_t *a16 = (uint16_t*)addr;
-		while (len16--) *a16++ = spi_w(0);
-		if (len & 1) *((uint8_t*)a16) = spi_w(0);
-	}
-	else
-	{
-		while (len--) *addr++ = spi_b(0);
-	}
+	if (!wide) spi_read_t<0, 1>(addr, len);
+	else if (IS_ALIGNED16(addr)) spi_read_t<1, 1>(addr, len);
+	else spi_read_t<1, 0>(addr, len);
 }
 
 void spi_write(const uint8_t *addr, uint32_t len, int wide)
 {
-	if (wide)
+	if (!wide) spi_write_t<0, 1>(addr, len);
+	else if (IS_ALIGNED16(addr)) spi_write_t<1, 1>(addr, len);
+	else spi_write_t<1, 0>(addr, len);
+}
+
+void spi_block_read_unaligned(uint8_t *addr, int sz)
+{
+	uint16_t buf[256];
+	sz &= ~1;
+	while (sz)
 	{
-		uint32_t len16 = len >> 1;
-		uint16_t *a16 = (uint16_t*)addr;
-		while (len16--) spi_w(*a16++);
-		if(len & 1) spi_w(*((uint8_t*)a16));
+		int chunk = (sz > (int)sizeof(buf)) ? (int)sizeof(buf) : sz;
+		fpga_spi_fast_block_read(buf, chunk / 2);
+		memcpy(addr, buf, chunk);
+		addr += chunk;
+		sz -= chunk;
 	}
-	else
+}
+
+void spi_block_write_unaligned(const uint8_t *addr, int sz)
+{
+	uint16_t buf[256];
+	sz &= ~1;
+	while (sz)
 	{
-		while (len--) spi_b(*addr++);
+		int chunk = (sz > (int)sizeof(buf)) ? (int)sizeof(buf) : sz;
+		memcpy(buf, addr, chunk);
+		fpga_spi_fast_block_write(buf, chunk / 2);
+		addr += chunk;
+		sz -= chunk;
 	}
 }
 
 void spi_block_read(uint8_t *addr, int wide, int sz)
 {
-	if (wide) fpga_spi_fast_block_read((uint16_t*)addr, sz/2);
-	else fpga_spi_fast_block_read_8(addr, sz);
+	if (!wide) spi_block_read_t<0, 1>(addr, sz);
+	else if (IS_ALIGNED16(addr)) spi_block_read_t<1, 1>(addr, sz);
+	else spi_block_read_t<1, 0>(addr, sz);
 }
 
 void spi_block_write(const uint8_t *addr, int wide, int sz)
 {
-	if (wide) fpga_spi_fast_block_write((const uint16_t*)addr, sz/2);
-	else fpga_spi_fast_block_write_8(addr, sz);
+	if (!wide) spi_block_write_t<0, 1>(addr, sz);
+	else if (IS_ALIGNED16(addr)) spi_block_write_t<1, 1>(addr, sz);
+	else spi_block_write_t<1, 0>(addr, sz);
 }
@@ -8,6 +8,15 @@
 #define OSD_VGA  2
 #define OSD_ALL  (OSD_VGA|OSD_HDMI)
 
+/* bus ownership */
+// Only needed with input_thread=1 in MiSTer.ini, where the input thread talks
+// to the core too. spi_share() is called before that thread starts. From then
+// on a frame owns the bus from Enable* to Disable*, other GPO users take it
+// with spi_acquire(), which returns 1 if it was taken here.
+void spi_share();
+int  spi_acquire();
+void spi_release(int taken);
+
 /* chip select functions */
 void EnableFpga();
 void DisableFpga();
@@ -39,6 +48,86 @@ void spi32_b(uint32_t parm);
 uint32_t spi32_w(uint32_t parm);
 
 /* block transfer functions */
+// Width and alignment specialised transfers. The functions taking a runtime
+// width pick one of them once per call. Callers with a fixed width and a
+// buffer known to be 16-bit aligned use them directly.
+// spi_read_t/spi_write_t are handshaked per word, spi_block_*_t are not.
+template<int WIDE, int ALIGNED>
+inline void spi_read_t(uint8_t *addr, uint32_t len)
+{
+	if (!WIDE)
+	{
+		while (len--) *addr++ = (uint8_t)fpga_spi(0);
+		return;
+	}
+
+	uint32_t len16 = len >> 1;
+	if (ALIGNED)
+	{
+		uint16_t *a16 = (uint16_t*)addr;
+		while (len16--) *a16++ = fpga_spi(0);
+		addr = (uint8_t*)a16;
+	}
+	else
+	{
+		while (len16--)
+		{
+			uint16_t w = fpga_spi(0);
+			*addr++ = (uint8_t)w;
+			*addr++ = (uint8_t)(w >> 8);
+		}
+	}
+	if (len & 1) *addr = (uint8_t)fpga_spi(0);
+}
+
+template<int WIDE, int ALIGNED>
+inline void spi_write_t(const uint8_t *addr, uint32_t len)
+{
+	if (!WIDE)
+	{
+		while (len--) fpga_spi(*addr++);
+		return;
+	}
+
+	uint32_t len16 = len >> 1;
+	if (ALIGNED)
+	{
+		const uint16_t *a16 = (const uint16_t*)addr;
+		while (len16--) fpga_spi(*a16++);
+		addr = (const uint8_t*)a16;
+	}
+	else
+	{
+		while (len16--)
+		{
+			fpga_spi(addr[0] | (addr[1] << 8));
+			addr += 2;
+		}
+	}
+	if (len & 1) fpga_spi(*addr);
+}
+
+// unaligned 16-bit blocks go through an aligned bounce buffer, the block
+// kernels load whole words (and may combine them into ldrd/ldm).
+void spi_block_read_unaligned(uint8_t *addr, int sz);
+void spi_block_write_unaligned(const uint8_t *addr, int sz);
+
+template<int WIDE, int ALIGNED>
+inline void spi_block_read_t(uint8_t *addr, int sz)
+{
+	if (!WIDE) fpga_spi_fast_block_read_8(addr, sz);
+	else if (ALIGNED) fpga_spi_fast_block_read((uint16_t*)addr, sz / 2);
+	else spi_block_read_unaligned(addr, sz);
+}
+
+template<int WIDE, int ALIGNED>
+inline void spi_block_write_t(const uint8_t *addr, int sz)
+{
+	if (!WIDE) fpga_spi_fast_block_write_8(addr, sz);
+	else if (ALIGNED) fpga_spi_fast_block_write((const uint16_t*)addr, sz / 2);
+	else spi_block_write_unaligned(addr, sz);
+}
+
 void spi_read(uint8_t *addr, uint32_t len, int wide);
 void spi_write(const uint8_t *addr, uint32_t len, int wide);
 void spi_block_read(uint8_t *addr, int wide, int sz = 512);
@@ -52,6 +141,9 @@ void spi_osd_cmd8_cont(uint8_t cmd, uint8_t parm);
 void spi_osd_cmd8(uint8_t cmd, uint8_t parm);
 
 /* User_io related SPI functions */
+// hps_io latches the command from the first word after EnableIO(), so every
+// command needs its own EnableIO()/DisableIO() frame and they can't be merged.
+// Bulk payloads inside a frame should go through fpga_spi_fast_block_*.
 uint16_t spi_uio_cmd_cont(uint16_t cmd);
 uint16_t spi_uio_cmd(uint16_t cmd);
 uint8_t spi_uio_cmd8_cont(uint8_t cmd, uint8_t parm);
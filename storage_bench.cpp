@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "storage_bench.h"
+#include "file_io.h"
+#include "counters.h"
+
+#define BENCH_SIZE    (16 * 1024 * 1024)
+#define BENCH_BLOCK   (64 * 1024)
+#define BENCH_SAMPLES 256
+#define BENCH_NAME    ".MiSTer_bench"
+
+// consumer rate the read-ahead has to keep up with, 8x CD speed
+#define BENCH_RATE    (1200 * 1024)
+
+static uint32_t rnd_state = 0x12345678;
+
+static uint32_t rnd()
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static int is_mount(const char *path, const char *parent)
+{
+	struct stat st, pst;
+	if (stat(path, &st) || !S_ISDIR(st.st_mode) || stat(parent, &pst)) return 0;
+	return st.st_dev != pst.st_dev;
+}
+
+// the page cache would answer everything after the write
+static void drop_cache(fileTYPE *f)
+{
+	int fd = fileno(f->filp);
+	fsync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static void percentiles(uint32_t *samples, int num, uint32_t *out)
+{
+	std::sort(samples, samples + num);
+	out[0] = samples[num / 2];
+	out[1] = samples[num * 9 / 10];
+	out[2] = samples[num * 99 / 100];
+}
+
+static int random_reads(fileTYPE *f, int size, uint32_t *out)
+{
+	static uint8_t buf[2048];
+	uint32_t samples[BENCH_SAMPLES];
+
+	drop_cache(f);
+	for (int i = 0; i < BENCH_SAMPLES; i++)
+	{
+		__off64_t ofs = (__off64_t)(rnd() % (BENCH_SIZE / size)) * size;
+
+		uint32_t t = counters_time_us();
+		if (!FileSeek(f, ofs, SEEK_SET) || FileReadAdv(f, buf, size) != size) return 0;
+		samples[i] = counters_time_us() - t;
+	}
+
+	percentiles(samples, BENCH_SAMPLES, out);
+	return 1;
+}
+
+static void bench_one(storageBenchResult *res)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%s/" BENCH_NAME, res->path);
+	printf("Storage benchmark: %s (%s)\n", res->name, res->path);
+
+	uint8_t *buf = (uint8_t*)malloc(BENCH_BLOCK);
+	if (!buf) return;
+	for (int i = 0; i < BENCH_BLOCK; i++) buf[i] = rnd();
+
+	fileTYPE f;
+	if (FileOpenEx(&f, name, O_CREAT | O_RDWR | O_TRUNC))
+	{
+		int ok = 1;
+		for (int i = 0; ok && i < BENCH_SIZE / BENCH_BLOCK; i++) ok = (FileWriteAdv(&f, buf, BENCH_BLOCK) == BENCH_BLOCK);
+		if (ok) drop_cache(&f);
+		FileClose(&f);
+
+		if (ok && FileOpen(&f, name))
+		{
+			uint32_t t = counters_time_us();
+			int total = 0, ret;
+			while ((ret = FileReadAdv(&f, buf, BENCH_BLOCK)) > 0) total += ret;
+			t = counters_time_us() - t;
+
+			if (total == BENCH_SIZE)
+			{
+				res->seq_kbps = (uint32_t)((uint64_t)total * 1000000 / 1024 / (t ? t : 1));
+				res->ok = random_reads(&f, 2048, res->r2k_us) && random_reads(&f, 512, res->r512_us);
+			}
+			FileClose(&f);
+		}
+	}
+	unlink(name);
+	free(buf);
+
+	if (!res->ok)
+	{
+		printf("Storage benchmark: %s failed\n", res->path);
+		return;
+	}
+
+	// blocks in flight to cover the slow reads at the given rate
+	if (res->r2k_us[2] < 2000 && res->type != STORAGE_NET) res->readahead = 0;
+	else
+	{
+		uint64_t need = (uint64_t)res->r2k_us[2] * BENCH_RATE / 1000000;
+		res->readahead = std::min<int>(32, need / BENCH_BLOCK + 2);
+	}
+}
+
+int storage_bench_run(storageBenchResult *res, int max)
+{
+	int num = 0;
+	memset(res, 0, sizeof(*res) * max);
+
+	if (num < max)
+	{
+		strcpy(res[num].name, "SD card");
+		strcpy(res[num].path, "/media/fat");
+		num++;
+	}
+
+	for (int i = 0; i < 4 && num < max; i++)
+	{
+		snprintf(res[num].path, sizeof(res[num].path), "/media/usb%d", i);
+		if (!is_mount(res[num].path, "/media")) continue;
+		snprintf(res[num].name, sizeof(res[num].name), "USB %d", i);
+		res[num].type = STORAGE_USB;
+		num++;
+	}
+
+	storageProfile prof;
+	if (num < max && is_mount("/media/fat/" CIFS_DIR, "/media/fat") && FileStorageProfilePath("/media/fat/" CIFS_DIR, &prof) &&
+		prof.type == STORAGE_NET)
+	{
+		strcpy(res[num].name, "Network");
+		strcpy(res[num].path, "/media/fat/" CIFS_DIR);
+		res[num].type = STORAGE_NET;
+		num++;
+	}
+
+	for (int i = 0; i < num; i++) bench_one(&res[i]);
+	return num;
+}
+
+void storage_bench_report(const storageBenchResult *res, int num, const char *file)
+{
+	FILE *fp = fopen(file, "w");
+	if (!fp)
+	{
+		printf("storage_bench: cannot create %s\n", file);
+		return;
+	}
+
+	fprintf(fp, "# name path seq_kb/s 2k_p50 2k_p90 2k_p99 512_p50 512_p90 512_p99 (us) readahead\n");
+	for (int i = 0; i < num; i++)
+	{
+		const storageBenchResult *r = &res[i];
+		if (!r->ok)
+		{
+			fprintf(fp, "\"%s\" %s failed\n", r->name, r->path);
+			continue;
+		}
+
+		fprintf(fp, "\"%s\" %s %u %u %u %u %u %u %u ", r->name, r->path, r->seq_kbps,
+			r->r2k_us[0], r->r2k_us[1], r->r2k_us[2], r->r512_us[0], r->r512_us[1], r->r512_us[2]);
+		if (r->type == STORAGE_SD) fprintf(fp, "-\n");
+		else fprintf(fp, "%s=%d\n", (r->type == STORAGE_NET) ? "readahead_net" : "readahead_usb", r->readahead);
+	}
+	fclose(fp);
+}
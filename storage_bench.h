@@ -0,0 +1,33 @@
+#ifndef STORAGE_BENCH_H
+#define STORAGE_BENCH_H
+
+#include <inttypes.h>
+#include "file_io.h"
+
+// Storage benchmark for the "game stutters" reports. Every mounted storage
+// (SD card, USB drives, network share) gets a scratch file, which is read
+// back through FileReadAdv the same way the cores read their images:
+// sequentially in 64KB blocks, then at random offsets in 2KB and 512B reads.
+// "storage_bench" in MiSTer_cmd writes the report to STORAGE_BENCH_FILE.
+
+#define STORAGE_BENCH_FILE "/tmp/MiSTer_storage_bench"
+#define STORAGE_BENCH_MAX  6
+
+struct storageBenchResult
+{
+	char     name[16];
+	char     path[32];
+	int      ok;
+	int      type;       // STORAGE_*, see file_io.h
+	uint32_t seq_kbps;
+	uint32_t r2k_us[3];  // p50, p90, p99
+	uint32_t r512_us[3];
+	int      readahead;  // recommended readahead_usb/readahead_net, SD doesn't use it
+};
+
+// runs the benchmark on all mounted storage, returns the number of results.
+int storage_bench_run(storageBenchResult *res, int max);
+
+void storage_bench_report(const storageBenchResult *res, int num, const char *file);
+
+#endif
@@ -4,6 +4,15 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include "../../sxmlc.h"
 #include "../../user_io.h"
@@ -13,6 +22,10 @@
 #include "../../fpga_io.h"
 #include "../../lib/md5/md5.h"
 #include "../../shmem.h"
+#include "../../offload.h"
+#include "../../shcache.h"
+#include "../../counters.h"
+#include "../../loadlog.h"
 
 #include "buffer.h"
 #include "mra_loader.h"
@@ -61,8 +74,7 @@ void arcade_nvm_save()
 {
 	if(nvram_idx && nvram_size)
 	{
-		char path[256] = CONFIG_DIR"/nvram/";
-		FileCreatePath(path);
+		char path[256] = "nvram/";
 		strcat(path, nvram_name);
 
 		uint8_t *buf = new uint8_t[nvram_size];
@@ -75,7 +87,7 @@ void arcade_nvm_save()
 			user_io_file_rx_data(buf, nvram_size);
 			user_io_set_upload(0);
 
-			FileSave(path, buf, nvram_size);
+			FileSaveConfig(path, buf, nvram_size);
 			delete(buf);
 		}
 	}
@@ -223,6 +235,123 @@ static int rom_checksz(int idx, int chunk)
 	return 1;
 }
 
+// De-interleave kernels. A part fills n byte lanes of every unitlen bytes
+// of the rom; the patterns sets actually use get a fixed stride so the
+// compiler (and NEON, where present) can do whole vectors at once.
+template<int unit>
+static void rom_lane8(uint8_t *dst, const uint8_t *src, int units, int lane)
+{
+	int i = 0;
+#ifdef __ARM_NEON
+	if (unit == 2)
+	{
+		for (; i + 16 <= units; i += 16)
+		{
+			uint8x16x2_t v = vld2q_u8(dst + i * 2);
+			v.val[lane] = vld1q_u8(src + i);
+			vst2q_u8(dst + i * 2, v);
+		}
+	}
+	else if (unit == 4)
+	{
+		for (; i + 16 <= units; i += 16)
+		{
+			uint8x16x4_t v = vld4q_u8(dst + i * 4);
+			v.val[lane] = vld1q_u8(src + i);
+			vst4q_u8(dst + i * 4, v);
+		}
+	}
+#endif
+	dst += lane;
+	for (; i < units; i++) dst[i * unit] = src[i];
+}
+
+// 16-bit lane, optionally byte swapped
+template<int unit>
+static void rom_lane16(uint8_t *dst, const uint8_t *src, int units, int lane, int swap)
+{
+	int i = 0;
+#ifdef __ARM_NEON
+	if (unit == 2)
+	{
+		for (; i + 8 <= units; i += 8)
+		{
+			uint8x16_t v = vld1q_u8(src + i * 2);
+			vst1q_u8(dst + i * 2, swap ? vrev16q_u8(v) : v);
+		}
+	}
+	else if (unit == 4)
+	{
+		for (; i + 8 <= units; i += 8)
+		{
+			uint8x16_t s = vld1q_u8(src + i * 2);
+			uint16x8x2_t v = vld2q_u16((uint16_t*)(dst + i * 4));
+			v.val[lane] = vreinterpretq_u16_u8(swap ? vrev16q_u8(s) : s);
+			vst2q_u16((uint16_t*)(dst + i * 4), v);
+		}
+	}
+#endif
+	dst += lane * 2;
+	for (; i < units; i++)
+	{
+		dst[i * unit + swap] = src[i * 2];
+		dst[i * unit + (swap ^ 1)] = src[i * 2 + 1];
+	}
+}
+
+static void rom_lanes(uint8_t *dst, const uint8_t *src, int units, int n, const uint8_t *offsets)
+{
+	for (int i = 0; i < units; i++)
+	{
+		for (int j = 0; j < n; j++) dst[offsets[j]] = *src++;
+		dst += unitlen;
+	}
+}
+
+static void rom_scatter(uint8_t *dst, const uint8_t *src, int units, int n, const uint8_t *offsets)
+{
+	if (n == 1)
+	{
+		if (unitlen == 1) memcpy(dst, src, units);
+		else if (unitlen == 2) rom_lane8<2>(dst, src, units, offsets[0]);
+		else if (unitlen == 4) rom_lane8<4>(dst, src, units, offsets[0]);
+		else rom_lanes(dst, src, units, n, offsets);
+		return;
+	}
+
+	// aligned pair of bytes, in either order
+	if (n == 2 && (offsets[0] >> 1) == (offsets[1] >> 1) && offsets[0] != offsets[1])
+	{
+		int lane = offsets[0] >> 1;
+		int swap = offsets[0] & 1;
+		if (unitlen == 2)
+		{
+			if (swap) rom_lane16<2>(dst, src, units, 0, 1);
+			else memcpy(dst, src, units * 2);
+			return;
+		}
+		if (unitlen == 4)
+		{
+			rom_lane16<4>(dst, src, units, lane, swap);
+			return;
+		}
+	}
+
+	// whole units in order
+	if (n == unitlen)
+	{
+		int i = 0;
+		while (i < n && offsets[i] == i) i++;
+		if (i == n)
+		{
+			memcpy(dst, src, units * n);
+			return;
+		}
+	}
+
+	rom_lanes(dst, src, units, n, offsets);
+}
+
 static int rom_data(const uint8_t *buf, int chunk, int map, struct MD5Context *md5context)
 {
 	uint8_t offsets[8]; // assert (unitlen <= 8)
@@ -258,44 +387,53 @@ static int rom_data(const uint8_t *buf, int chunk, int map, struct MD5Context *m
 		map_reg >>= 4;
 	}
 
-	while (chunk)
+	int units = chunk / bytes_in_iter;
+	uint8_t *dst = romdata + romlen[idx];
+	rom_scatter(dst, buf, units, bytes_in_iter, offsets);
+	romlen[idx] += units * unitlen;
+
+	// part size not a multiple of the map, fill the lanes it has
+	int tail = chunk - units * bytes_in_iter;
+	if (tail)
 	{
-		for (int i = 0; i < bytes_in_iter; i++)
-		{
-			*(romdata + romlen[idx] + offsets[i]) = *buf++;
-			chunk--;
-		}
+		buf += units * bytes_in_iter;
+		dst += units * unitlen;
+		for (int i = 0; i < tail; i++) dst[offsets[i]] = buf[i];
 		romlen[idx] += unitlen;
 	}
 
 	return 1;
 }
 
+// big enough that the inflate and read calls don't show up next to the interleave
+#define ROM_FILE_CHUNK (128 * 1024)
+
 static int rom_file(const char *name, uint32_t crc32, int start, int len, int map, struct MD5Context *md5context)
 {
 	fileTYPE f = {};
-	static uint8_t buf[8192];
 	if (!FileOpenZip(&f, name, crc32)) return 0;
 	if (start) FileSeek(&f, start, SEEK_SET);
 	unsigned long bytes2send = f.size - f.offset;
 	if (len > 0 && len < (int)bytes2send) bytes2send = len;
 
-	while (bytes2send)
+	// inflate and hash the next chunks on the worker while the current one is interleaved
+	int ret = 1;
 	{
-		uint16_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
-
-		FileReadAdv(&f, buf, chunk);
-		if (!rom_data(buf, chunk, map, md5context))
+		fileReadAhead ra(&f, bytes2send, ROM_FILE_CHUNK, -1, md5context);
+		uint8_t *buf;
+		uint32_t chunk;
+		while ((buf = ra.next(&chunk)))
 		{
-			FileClose(&f);
-			return 0;
-		};
-
-		bytes2send -= chunk;
+			if (!rom_data(buf, chunk, map, NULL))
+			{
+				ret = 0;
+				break;
+			}
+		}
 	}
 
 	FileClose(&f);
-	return 1;
+	return ret;
 }
 
 static int rom_patch(const uint8_t *buf, int offset, uint16_t len, int dataop)
@@ -420,6 +558,15 @@ unsigned char* hexstr_to_char(const char* hexstr, size_t *out_len)
 	return chrs;
 }
 
+// position of the current node while a compiled MRA is replayed
+static uint32_t mra_replay_pos = 0;
+
+// file position for the progress bar, also while replaying
+static long mra_file_pos(SAX_Data *sd)
+{
+	return sd->file ? ftell(sd->file) : mra_replay_pos;
+}
+
 /*
  *  xml_send_rom
  *
@@ -737,7 +884,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 			for (int i = 1; i < 8; i++) romlen[i] = romlen[0];
 		}
 
-		ProgressMessage("Loading", message, ftell(sd->file), arc_info->file_size);
+		ProgressMessage("Loading", message, mra_file_pos(sd), arc_info->file_size);
 		break;
 
 	case XML_EVENT_TEXT:
@@ -1045,8 +1192,397 @@ static int xml_read_pre_parse(XMLEvent evt, const XMLNode* node, SXML_CHAR* text
 	return true;
 }
 
+// Compiled MRA: the SAX event stream of a file, recorded once and kept in
+// CONFIG_DIR/mracache keyed by path, size and mtime. get_rbf, arcade_pre_parse
+// and arcade_send_rom replay it into their handlers, so a launch reads one small
+// binary file instead of parsing the XML three times. The folder shown in the
+// core list is compiled on the bulk worker in the background.
+#define MRA_CACHE_MAGIC 0x3143524D // "MRC1"
+#define MRA_CACHE_DIR   CONFIG_DIR "/mracache"
+#define MRA_PRECOMPILE_BATCH 8 // files per bulk job, other bulk work runs in between
+
+typedef int (*mraHandler)(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd);
+typedef std::vector<uint8_t> mraBlob;
+
+struct mraCacheHeader
+{
+	uint32_t magic;
+	uint32_t len;
+	uint32_t path_len;
+	uint32_t reserved;
+	uint64_t size;
+	uint64_t mtime;
+};
+
+// Records are an event byte followed by:
+//   START_NODE,
+//   END_NODE:   u32 file position, str tag, u32 count, str name/value pairs
+//   TEXT:       str text
+//   ERROR:      str text, u32 code
+// str is a u32 length, the chars and a NUL, so replay can point into the blob.
+static void mra_put(mraBlob *b, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t*)data;
+	b->insert(b->end(), p, p + len);
+}
+
+static void mra_put_u32(mraBlob *b, uint32_t val)
+{
+	mra_put(b, &val, sizeof(val));
+}
+
+static void mra_put_str(mraBlob *b, const char *str)
+{
+	if (!str) str = "";
+	uint32_t len = strlen(str);
+	mra_put_u32(b, len);
+	mra_put(b, str, len + 1);
+}
+
+static int mra_record(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
+{
+	mraBlob *b = (mraBlob*)sd->user;
+
+	switch (evt)
+	{
+	case XML_EVENT_START_NODE:
+	case XML_EVENT_END_NODE:
+		b->push_back(evt);
+		mra_put_u32(b, ftell(sd->file));
+		mra_put_str(b, node->tag);
+		mra_put_u32(b, node->n_attributes);
+		for (int i = 0; i < node->n_attributes; i++)
+		{
+			mra_put_str(b, node->attributes[i].name);
+			mra_put_str(b, node->attributes[i].value);
+		}
+		break;
+
+	case XML_EVENT_TEXT:
+		b->push_back(evt);
+		mra_put_str(b, text);
+		break;
+
+	case XML_EVENT_ERROR:
+		b->push_back(evt);
+		mra_put_str(b, text);
+		mra_put_u32(b, n);
+		break;
+
+	default:
+		break;
+	}
+
+	return true;
+}
+
+// thread-safe
+static int mra_compile(const char *xml, mraBlob *b)
+{
+	b->clear();
+
+	SAX_Callbacks sax;
+	SAX_Callbacks_init(&sax);
+	sax.all_event = mra_record;
+	return XMLDoc_parse_file_SAX(xml, &sax, b);
+}
+
+static int mra_get_u32(const mraBlob &b, size_t &pos, uint32_t *val)
+{
+	if (pos + sizeof(*val) > b.size()) return 0;
+	memcpy(val, b.data() + pos, sizeof(*val));
+	pos += sizeof(*val);
+	return 1;
+}
+
+static char *mra_get_str(mraBlob &b, size_t &pos)
+{
+	uint32_t len;
+	if (!mra_get_u32(b, pos, &len) || len >= b.size() - pos || b[pos + len]) return NULL;
+	char *str = (char*)b.data() + pos;
+	pos += len + 1;
+	return str;
+}
+
+// Feeds the recorded events to the handler until it returns false.
+// Without a handler the blob is only checked, damaged ones return 0.
+static int mra_walk(mraBlob &b, mraHandler handler, SAX_Data *sd)
+{
+	std::vector<XMLAttribute> attr;
+	XMLNode node;
+	memset(&node, 0, sizeof(node));
+	node.init_value = XML_INIT_DONE;
+
+	size_t pos = 0;
+	while (pos < b.size())
+	{
+		XMLEvent evt = (XMLEvent)b[pos++];
+		char *text = NULL;
+		uint32_t val = 0;
+
+		if (evt == XML_EVENT_START_NODE || evt == XML_EVENT_END_NODE)
+		{
+			uint32_t num;
+			if (!mra_get_u32(b, pos, &val) || !(node.tag = mra_get_str(b, pos)) || !mra_get_u32(b, pos, &num) || num > b.size()) return 0;
+
+			attr.resize(num);
+			for (uint32_t i = 0; i < num; i++)
+			{
+				attr[i].active = true;
+				if (!(attr[i].name = mra_get_str(b, pos)) || !(attr[i].value = mra_get_str(b, pos))) return 0;
+			}
+			node.attributes = attr.data();
+			node.n_attributes = num;
+			if (evt == XML_EVENT_START_NODE) mra_replay_pos = val;
+		}
+		else if (evt == XML_EVENT_TEXT)
+		{
+			if (!(text = mra_get_str(b, pos))) return 0;
+		}
+		else if (evt == XML_EVENT_ERROR)
+		{
+			if (!(text = mra_get_str(b, pos)) || !mra_get_u32(b, pos, &val)) return 0;
+		}
+		else return 0;
+
+		if (handler && !handler(evt, (evt == XML_EVENT_START_NODE || evt == XML_EVENT_END_NODE) ? &node : NULL, text, val, sd)) break;
+	}
+
+	return 1;
+}
+
+// thread-safe
+static int mra_cache_key(const char *xml, mraCacheHeader *h, char *name, int size)
+{
+	struct stat64 st;
+	if (stat64(xml, &st) < 0 || !S_ISREG(st.st_mode)) return 0;
+
+	uint32_t hash = 2166136261u;
+	for (const char *p = xml; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+
+	h->magic = MRA_CACHE_MAGIC;
+	h->len = 0;
+	h->path_len = strlen(xml);
+	h->reserved = 0;
+	h->size = st.st_size;
+	h->mtime = st.st_mtime;
+	snprintf(name, size, "%s/" MRA_CACHE_DIR "/%08X.mra", getRootDir(), hash);
+	return 1;
+}
+
+// thread-safe. Without a blob it only checks that a current record exists,
+// and doesn't add it to shcache, the precompile goes over whole folders.
+static int mra_cache_read(const char *xml, const mraCacheHeader *key, const char *name, mraBlob *b)
+{
+	if (b)
+	{
+		size_t size;
+		uint8_t *rec = (uint8_t*)shcache_load(name, &size);
+		if (!rec) return 0;
+
+		mraCacheHeader h;
+		memcpy(&h, rec, std::min(size, sizeof(h)));
+		int ok = size >= sizeof(h) && h.magic == key->magic && h.path_len == key->path_len && h.size == key->size && h.mtime == key->mtime &&
+			size == sizeof(h) + h.path_len + h.len && !memcmp(rec + sizeof(h), xml, h.path_len);
+		if (ok)
+		{
+			b->assign(rec + sizeof(h) + h.path_len, rec + size);
+			ok = mra_walk(*b, NULL, NULL);
+		}
+		free(rec);
+		return ok;
+	}
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	int ok = 0;
+	mraCacheHeader h;
+	if (read(fd, &h, sizeof(h)) == sizeof(h) && h.magic == key->magic && h.path_len == key->path_len &&
+		h.size == key->size && h.mtime == key->mtime)
+	{
+		std::string p(h.path_len, 0);
+		ok = read(fd, &p[0], h.path_len) == (ssize_t)h.path_len && p == xml;
+	}
+	close(fd);
+	return ok;
+}
+
+static uint8_t *mra_cache_rec(const char *xml, const mraCacheHeader *key, const mraBlob &b, size_t *size)
+{
+	mraCacheHeader h = *key;
+	h.len = b.size();
+	*size = sizeof(h) + h.path_len + h.len;
+
+	uint8_t *rec = (uint8_t*)malloc(*size);
+	if (rec)
+	{
+		memcpy(rec, &h, sizeof(h));
+		memcpy(rec + sizeof(h), xml, h.path_len);
+		memcpy(rec + sizeof(h) + h.path_len, b.data(), h.len);
+	}
+	return rec;
+}
+
+// thread-safe
+static void mra_cache_write(char *name, const uint8_t *rec, size_t size)
+{
+	char *p = strrchr(name, '/');
+	*p = 0;
+	mkdir(name, S_IRWXU | S_IRWXG | S_IRWXO);
+	*p = '/';
+
+	int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd >= 0)
+	{
+		if (write(fd, rec, size) != (ssize_t)size) unlink(name);
+		close(fd);
+	}
+}
+
+// last used MRA, shared by the passes of one launch
+static mraBlob mra_blob;
+static char mra_blob_path[kBigTextSize] = {};
+static mraCacheHeader mra_blob_key;
+
+static mraBlob *mra_get(const char *xml)
+{
+	mraCacheHeader key;
+	char name[kBigTextSize];
+	if (!mra_cache_key(xml, &key, name, sizeof(name))) return NULL;
+
+	if (!strcmp(mra_blob_path, xml) && key.size == mra_blob_key.size && key.mtime == mra_blob_key.mtime) return &mra_blob;
+	mra_blob_path[0] = 0;
+
+	if (!mra_cache_read(xml, &key, name, &mra_blob))
+	{
+		if (!mra_compile(xml, &mra_blob)) return NULL;
+
+		size_t size;
+		uint8_t *rec = mra_cache_rec(xml, &key, mra_blob, &size);
+		char *cname = strdup(name);
+		if (rec && cname)
+		{
+			shcache_store(name, rec, size);
+			offload_add_work([rec, size, cname]
+			{
+				mra_cache_write(cname, rec, size);
+				free(rec);
+				free(cname);
+			}, OFFLOAD_PRIO_BULK);
+		}
+		else
+		{
+			free(rec);
+			free(cname);
+		}
+	}
+
+	snprintf(mra_blob_path, sizeof(mra_blob_path), "%s", xml);
+	mra_blob_key = key;
+	return &mra_blob;
+}
+
+// Same as XMLDoc_parse_file_SAX with the handler as all_event.
+// MGL files are written by frontends all the time and are parsed directly.
+static int mra_parse(const char *xml, mraHandler handler, void *user)
+{
+	mraBlob *b = (isXmlName(xml) == 1) ? mra_get(xml) : NULL;
+	if (!b)
+	{
+		SAX_Callbacks sax;
+		SAX_Callbacks_init(&sax);
+		sax.all_event = handler;
+		return XMLDoc_parse_file_SAX(xml, &sax, user);
+	}
+
+	SAX_Data sd = {};
+	sd.name = xml;
+	sd.user = user;
+
+	mra_replay_pos = 0;
+	if (!handler(XML_EVENT_START_DOC, NULL, (SXML_CHAR*)xml, 0, &sd)) return false;
+	mra_walk(*b, handler, &sd);
+	handler(XML_EVENT_END_DOC, NULL, (SXML_CHAR*)xml, 0, &sd);
+	return true;
+}
+
+struct mraPrecompile
+{
+	char dir[kBigTextSize];
+	std::vector<std::string> names;
+	size_t pos;
+	int listed;
+};
+
+static std::atomic<int> mra_precompile_busy(0);
+
+static void mra_precompile_run(mraPrecompile *job)
+{
+	if (!job->listed)
+	{
+		DIR *d = opendir(job->dir);
+		if (d)
+		{
+			struct dirent *de;
+			while ((de = readdir(d)))
+			{
+				if (de->d_type != DT_DIR && isXmlName(de->d_name) == 1) job->names.push_back(de->d_name);
+			}
+			closedir(d);
+		}
+		job->listed = 1;
+	}
+
+	mraBlob b;
+	int compiled = 0;
+	while (job->pos < job->names.size() && compiled < MRA_PRECOMPILE_BATCH && !offload_stopping())
+	{
+		std::string xml = std::string(job->dir) + "/" + job->names[job->pos++];
+
+		mraCacheHeader key;
+		char name[kBigTextSize];
+		if (!mra_cache_key(xml.c_str(), &key, name, sizeof(name)) || mra_cache_read(xml.c_str(), &key, name, NULL)) continue;
+		if (!mra_compile(xml.c_str(), &b)) continue;
+
+		size_t size;
+		uint8_t *rec = mra_cache_rec(xml.c_str(), &key, b, &size);
+		if (rec) mra_cache_write(name, rec, size);
+		free(rec);
+		compiled++;
+	}
+
+	// a full queue just leaves the rest for the next visit
+	if (job->pos < job->names.size() && !offload_stopping() &&
+		offload_try_add_work([job] { mra_precompile_run(job); }, OFFLOAD_PRIO_BULK)) return;
+
+	delete job;
+	mra_precompile_busy = 0;
+}
+
+void arcade_precompile(const char *dir)
+{
+	static char last[kBigTextSize] = {};
+	if (mra_precompile_busy || !strcmp(last, dir)) return;
+	snprintf(last, sizeof(last), "%s", dir);
+
+	mraPrecompile *job = new mraPrecompile;
+	snprintf(job->dir, sizeof(job->dir), "%s", dir);
+	job->pos = 0;
+	job->listed = 0;
+
+	mra_precompile_busy = 1;
+	if (!offload_try_add_work([job] { mra_precompile_run(job); }, OFFLOAD_PRIO_BULK))
+	{
+		delete job;
+		mra_precompile_busy = 0;
+		last[0] = 0;
+	}
+}
+
 int arcade_send_rom(const char *xml)
 {
+	uint32_t load_start = counters_time_us();
 	const char *p = strrchr(xml, '/');
 	p = p ? p + 1 : xml;
 	snprintf(switches[0].name, sizeof(switches[0].name), "%s", p);
@@ -1058,11 +1594,6 @@ int arcade_send_rom(const char *xml)
 	ext = strcasestr(nvram_name, ".mra");
 	if (ext) strcpy(ext, ".nvm");
 
-	SAX_Callbacks sax;
-	SAX_Callbacks_init(&sax);
-
-	sax.all_event = xml_send_rom;
-
 	set_arcade_root(xml);
 
 	// create the structure we use for the XML parser
@@ -1075,7 +1606,7 @@ int arcade_send_rom(const char *xml)
 	ProgressMessage(0, 0, 0, 0);
 
 	// parse
-	XMLDoc_parse_file_SAX(xml, &sax, &arc_info);
+	mra_parse(xml, xml_send_rom, &arc_info);
 	if (arc_info.validrom0 == 0 && strlen(arc_info.error_msg))
 	{
 		strcpy(arcade_error_msg, arc_info.error_msg);
@@ -1090,16 +1621,14 @@ int arcade_send_rom(const char *xml)
 		switches[n].dip_saved = switches[n].dip_cur;
 		arcade_sw_send(n);
 	}
+
+	loadlog_add(LOAD_MRA, counters_time_us() - load_start, xml);
 	return 0;
 }
 
 void arcade_pre_parse(const char *xml)
 {
-	SAX_Callbacks sax;
-	SAX_Callbacks_init(&sax);
-
-	sax.all_event = xml_read_pre_parse;
-	XMLDoc_parse_file_SAX(xml, &sax, NULL);
+	mra_parse(xml, xml_read_pre_parse, NULL);
 }
 
 bool arcade_is_vertical()
@@ -1126,35 +1655,98 @@ static const char *get_rbf_path(const char *rbfname)
 	return path;
 }
 
+// Resolved <rbf> of the last launched MGL/MRA files. An entry is used
+// until the directory it was found in changes, so a frontend firing MGLs
+// doesn't scan the core folder on every launch.
+#define RBF_NAMES 8
+
+struct rbfName
+{
+	char name[kBigTextSize];
+	int arcade;
+	uint64_t mtime;
+	char rbf[kBigTextSize];
+};
+
+static rbfName rbf_names[RBF_NAMES] = {};
+static int rbf_names_next = 0;
+
+static const char *rbf_search_dir(const char *rbfname, int arcade, const char **filename)
+{
+	if (arcade)
+	{
+		*filename = rbfname;
+		return get_arcade_root(1);
+	}
+
+	*filename = strrchr(rbfname, '/');
+	if (*filename) (*filename)++;
+	else *filename = rbfname;
+	return get_rbf_path(rbfname);
+}
+
+static int get_dir_mtime(const char *dirname, uint64_t *mtime)
+{
+	struct stat64 st;
+	if (stat64(dirname, &st) < 0) return 0;
+	*mtime = st.st_mtime;
+	return 1;
+}
+
+static rbfName *rbf_name_find(const char *rbfname, int arcade, const char *dirname)
+{
+	uint64_t mtime;
+	if (!get_dir_mtime(dirname, &mtime)) return NULL;
+
+	int len = strlen(dirname);
+	for (auto &e : rbf_names)
+	{
+		if (e.name[0] && e.arcade == arcade && e.mtime == mtime && !strcmp(e.name, rbfname) &&
+			!strncmp(e.rbf, dirname, len) && e.rbf[len] == '/') return &e;
+	}
+	return NULL;
+}
+
+static void rbf_name_add(const char *rbfname, int arcade, const char *dirname, const char *rbf)
+{
+	rbfName *e = rbf_name_find(rbfname, arcade, dirname);
+	if (!e)
+	{
+		e = &rbf_names[rbf_names_next];
+		rbf_names_next = (rbf_names_next + 1) % RBF_NAMES;
+	}
+
+	if (!get_dir_mtime(dirname, &e->mtime) || strlen(rbfname) >= sizeof(e->name) || strlen(rbf) >= sizeof(e->rbf))
+	{
+		e->name[0] = 0;
+		return;
+	}
+
+	strcpy(e->name, rbfname);
+	strcpy(e->rbf, rbf);
+	e->arcade = arcade;
+}
+
 static const char *get_rbf(const char *xml, int arcade)
 {
 	static char rbfname[kBigTextSize];
 
 	rbfname[0] = 0;
-	SAX_Callbacks sax;
-	SAX_Callbacks_init(&sax);
-
-	sax.all_event = xml_scan_rbf;
-	XMLDoc_parse_file_SAX(xml, &sax, rbfname);
+	mra_parse(xml, xml_scan_rbf, rbfname);
 
 	/* once we have the rbfname fragment from the MRA xml file
 	 * search the arcade folder for the match */
 	struct dirent *entry;
 	DIR *dir = 0;
 
-	const char *dirname;
 	const char *filename;
-	if (arcade)
-	{
-		dirname = get_arcade_root(1);
-		filename = rbfname;
-	}
-	else
+	const char *dirname = rbf_search_dir(rbfname, arcade, &filename);
+
+	rbfName *known = rbf_name_find(rbfname, arcade, dirname);
+	if (known)
 	{
-		dirname = get_rbf_path(rbfname);
-		filename = strrchr(rbfname, '/');
-		if (filename) filename++;
-		else filename = rbfname;
+		printf("%s: using known %s\n", rbfname, known->rbf);
+		return known->rbf;
 	}
 
 	if (!(dir = opendir(dirname)))
@@ -1164,7 +1756,7 @@ static const char *get_rbf(const char *xml, int arcade)
 	}
 
 	int len;
-	static char lastfound[256] = {};
+	char lastfound[256] = {};
 	while ((entry = readdir(dir)) != NULL)
 	{
 		len = strlen(entry->d_name);
@@ -1198,10 +1790,27 @@ static const char *get_rbf(const char *xml, int arcade)
 		}
 	}
 
-	if (lastfound[0]) snprintf(rbfname, sizeof(rbfname), "%s/%s", dirname, lastfound);
 	closedir(dir);
+	if (!lastfound[0]) return NULL;
+
+	static char found[kBigTextSize];
+	snprintf(found, sizeof(found), "%s/%s", dirname, lastfound);
+	rbf_name_add(rbfname, arcade, dirname, found);
+	return found;
+}
+
+const char *xml_get_rbf(const char *xml)
+{
+	static char path[kBigTextSize];
+
+	if (xml[0] == '/') snprintf(path, sizeof(path), "%s", xml);
+	else snprintf(path, sizeof(path), "%s/%s", getRootDir(), xml);
+
+	int len = strlen(xml);
+	int is_arcade = (len > 4) && !strcasecmp(xml + len - 4, ".mra");
 
-	return lastfound[0] ? rbfname : NULL;
+	if (is_arcade) set_arcade_root(path);
+	return get_rbf(path, is_arcade);
 }
 
 int xml_load(const char *xml)
@@ -1222,6 +1831,9 @@ int xml_load(const char *xml)
 	if (rbf)
 	{
 		printf("XML: %s, RBF: %s\n", path, rbf);
+
+		// same core: only its file actions are run
+		if (!is_arcade && isXmlName(path) == 2 && user_io_mgl_load(rbf, path)) return 0;
 		fpga_load_rbf(rbf, NULL, path);
 	}
 	else
@@ -1236,17 +1848,22 @@ static mgl_struct mgl = {};
 
 static int scan_mgl(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
 {
-	(void)sd;
+	char *rbf = (char *)sd->user;
 
 	static int inside_mgl = 0;
+	static int inside_rbf = 0;
 	switch (evt)
 	{
 	case XML_EVENT_START_DOC:
 		inside_mgl = 0;
+		inside_rbf = 0;
 		break;
 
 	case XML_EVENT_START_NODE:
+		inside_rbf = 0;
 		if (!strcasecmp(node->tag, "mistergamedescription")) inside_mgl = 1;
+		else if (inside_mgl && !strcasecmp(node->tag, "rbf")) inside_rbf = 1;
+		else if (inside_mgl && !strcasecmp(node->tag, "setname")) mgl.setname = 1;
 		else if (inside_mgl && mgl.count < (int)(sizeof(mgl.item) / sizeof(mgl.item[0])))
 		{
 			if (!strcasecmp(node->tag, "file"))
@@ -1321,9 +1938,12 @@ static int scan_mgl(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const in
 		break;
 
 	case XML_EVENT_TEXT:
+		if (inside_rbf) snprintf(rbf, kBigTextSize, "%s", text);
+		inside_rbf = 0;
 		break;
 
 	case XML_EVENT_END_NODE:
+		inside_rbf = 0;
 		if (!strcasecmp(node->tag, "mistergamedescription")) inside_mgl = 0;
 		break;
 
@@ -1337,16 +1957,26 @@ static int scan_mgl(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const in
 	return true;
 }
 
-mgl_struct* mgl_parse(const char *xml)
+mgl_struct* mgl_parse(const char *xml, const char *rbf)
 {
 	memset(&mgl, 0, sizeof(mgl));
 
 	printf("MGL %s\n", xml);
 
+	char rbfname[kBigTextSize] = {};
+
 	SAX_Callbacks sax;
 	SAX_Callbacks_init(&sax);
 	sax.all_event = scan_mgl;
-	XMLDoc_parse_file_SAX(xml, &sax, 0);
+	XMLDoc_parse_file_SAX(xml, &sax, rbfname);
+
+	if (rbf && rbfname[0])
+	{
+		const char *filename;
+		const char *dirname = rbf_search_dir(rbfname, 0, &filename);
+		int len = strlen(dirname);
+		if (!strncmp(rbf, dirname, len) && rbf[len] == '/') rbf_name_add(rbfname, 0, dirname, rbf);
+	}
 
 	return &mgl;
 }
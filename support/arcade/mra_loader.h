@@ -3,6 +3,10 @@
 
 int arcade_send_rom(const char *xml);
 int xml_load(const char *xml);
+
+// the RBF an MRA/MGL would start, NULL if there is none
+const char *xml_get_rbf(const char *xml);
+
 void arcade_check_error();
 
 struct dip_struct
@@ -53,6 +57,7 @@ struct mgl_struct
 	uint32_t timer;
 	int  state;
 	int  done;
+	int  setname; // renames the core, needs a reload
 };
 
 sw_struct *arcade_sw(int n);
@@ -63,11 +68,16 @@ void arcade_sw_load(int n);
 // Read any mra info necessary for ini processing
 void arcade_pre_parse(const char *xml);
 
+// compile the MRAs of a folder in the background, see MRA_CACHE_DIR
+void arcade_precompile(const char *dir);
+
 bool arcade_is_vertical();
 
 void arcade_nvm_save();
 
-mgl_struct* mgl_parse(const char *xml);
+// rbf is the core started for the MGL. The next MGL naming the same <rbf>
+// gets it without a directory scan.
+mgl_struct* mgl_parse(const char *xml, const char *rbf = NULL);
 mgl_struct* mgl_get();
 
 #endif
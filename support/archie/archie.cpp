@@ -402,16 +402,8 @@ void archie_mouse(unsigned char b, int16_t x, int16_t y)
 		return;
 	}
 
-	// ignore any mouse movement if mouse is disabled or if nothing to report
-	if ((flags & FLAG_MOUSE_ENABLED) && (mouse_x || mouse_y))
-	{
-		// send asap if no pending byte
-		if (kbd_state == STATE_IDLE) {
-			archie_kbd_send(STATE_WAIT4ACK1, mouse_x & 0x7f);
-			archie_kbd_send(STATE_WAIT4ACK2, mouse_y & 0x7f);
-			mouse_x = mouse_y = 0;
-		}
-	}
+	// the movement is sent from archie_poll(), all events between two
+	// sends go out as one delta
 
 	// ignore mouse buttons if key scanning is disabled
 	if (flags & FLAG_SCAN_ENABLED)
@@ -444,6 +436,20 @@ static void archie_check_queue(void)
 	tx_queue_rptr = QUEUE_NEXT(tx_queue_rptr);
 }
 
+// accumulated mouse movement, once the keys and buttons have gone out
+static void archie_mouse_flush(void)
+{
+	if (kbd_state != STATE_IDLE || tx_queue_rptr != tx_queue_wptr) return;
+
+	// ignore any mouse movement if mouse is disabled or if nothing to report
+	if ((flags & FLAG_MOUSE_ENABLED) && (mouse_x || mouse_y))
+	{
+		archie_kbd_send(STATE_WAIT4ACK1, mouse_x & 0x7f);
+		archie_kbd_send(STATE_WAIT4ACK2, mouse_y & 0x7f);
+		mouse_x = mouse_y = 0;
+	}
+}
+
 static void check_reset()
 {
 	static uint32_t timer = 0;
@@ -618,6 +624,8 @@ void archie_poll(void)
 	}
 	else
 		DisableIO();
+
+	archie_mouse_flush();
 }
 
 const char *archie_get_hdd_name(int i)
@@ -326,6 +326,29 @@ struct img_info
 
 static img_info gcr_info[16] = {};
 
+// Tracks as they were sent to the core, read and encoded once per image.
+// Any write drops all of them, the G64 track map or the D64 disk id may change.
+#define GCR_CACHE_TRACKS 168
+
+struct gcrTrack
+{
+	std::vector<uint8_t> data; // gcr_buf image
+	uint32_t size;             // track_size
+	uint32_t blks;             // of the request it was read for (G64)
+	bool valid;
+};
+
+static gcrTrack gcr_cache[16][GCR_CACHE_TRACKS];
+
+static void gcr_cache_clear(int idx)
+{
+	for (auto &t : gcr_cache[idx])
+	{
+		t.valid = false;
+		std::vector<uint8_t>().swap(t.data);
+	}
+}
+
 static uint8_t trk_buf[8192];
 static uint8_t gcr_buf[G64_MAX_TRACK_LEN*2];
 static uint8_t track_count[4] = {35, 40, 42, 70};
@@ -387,6 +410,7 @@ int c64_openGCR(const char *path, fileTYPE *f, int idx)
 	//       2=raw MFM supported  (G64_SUPPORT_MFM)
 
 	gcr_info[idx].f = f;
+	gcr_cache_clear(idx);
 	if (!strcasecmp(path + strlen(path) - 4, ".g64") || !strcasecmp(path + strlen(path) - 4, ".g71"))
 	{
 		char str[16];
@@ -435,6 +459,7 @@ int c64_openGCR(const char *path, fileTYPE *f, int idx)
 void c64_closeGCR(int idx)
 {
 	gcr_info[idx].type = 0;
+	gcr_cache_clear(idx);
 }
 
 static const uint8_t gcr_lut[16] = {
@@ -451,28 +476,25 @@ static const uint8_t bin_lut[32] = {
 	0, 9, 10, 11, 0, 13, 14, 0
 };
 
-static uint8_t *gcrptr;
-static int gcrcnt = 0;
-
-void bin2gcr(uint8_t bin)
+// 4 bytes to 5 GCR bytes at a time, through the 10 bit code of every byte.
+static uint8_t *gcr_encode(uint8_t *out, const uint8_t *in, int len)
 {
-	static uint64_t gcr = 0;
-
-	gcr <<= 5;
-	gcr |= gcr_lut[(bin >> 4) & 0xF];
-	gcr <<= 5;
-	gcr |= gcr_lut[bin & 0xF];
+	static uint16_t lut[256] = {};
+	if (!lut[0])
+	{
+		for (int i = 0; i < 256; i++) lut[i] = (gcr_lut[i >> 4] << 5) | gcr_lut[i & 0xF];
+	}
 
-	gcrcnt++;
-	if (gcrcnt == 4)
+	for (; len >= 4; len -= 4, in += 4)
 	{
-		gcrcnt = 0;
-		*gcrptr++ = (uint8_t)(gcr >> 32);
-		*gcrptr++ = (uint8_t)(gcr >> 24);
-		*gcrptr++ = (uint8_t)(gcr >> 16);
-		*gcrptr++ = (uint8_t)(gcr >> 8);
-		*gcrptr++ = (uint8_t)(gcr);
+		uint64_t gcr = ((uint64_t)lut[in[0]] << 30) | ((uint64_t)lut[in[1]] << 20) | ((uint32_t)lut[in[2]] << 10) | lut[in[3]];
+		*out++ = (uint8_t)(gcr >> 32);
+		*out++ = (uint8_t)(gcr >> 24);
+		*out++ = (uint8_t)(gcr >> 16);
+		*out++ = (uint8_t)(gcr >> 8);
+		*out++ = (uint8_t)(gcr);
 	}
+	return out;
 }
 
 void gcr2bin(uint8_t *gcr, uint8_t *bin)
@@ -504,7 +526,13 @@ void c64_readGCR(int idx, uint64_t lba, uint32_t blks)
 	
 	if (!gcr_info[idx].type) return;
 
-	if (gcr_info[idx].type == 2)
+	gcrTrack *cached = (track < GCR_CACHE_TRACKS) ? &gcr_cache[idx][track] : 0;
+	if (cached && cached->valid && (gcr_info[idx].type != 2 || cached->blks == blks))
+	{
+		memcpy(gcr_buf, cached->data.data(), cached->data.size());
+		track_size = cached->size;
+	}
+	else if (gcr_info[idx].type == 2)
 	{
 		if (track >= gcr_info[idx].tracks || !gcr_info[idx].trk_map[track])
 		{
@@ -535,39 +563,31 @@ void c64_readGCR(int idx, uint64_t lba, uint32_t blks)
 			FileReadAdv(gcr_info[idx].f, trk_buf, size);
 
 			uint8_t sec = 0;
-			gcrptr = gcr_buf + 2;
+			uint8_t *gcrptr = gcr_buf + 2;
 			for (int ptr = 0; ptr < size; ptr += 256)
 			{
-				gcrcnt = 0;
-				*gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF;
-				bin2gcr(0x08);
-				bin2gcr(sec ^ track_h ^ gcr_info[idx].id[0] ^ gcr_info[idx].id[1]);
-				bin2gcr(sec);
-				bin2gcr(track_h);
-				bin2gcr(gcr_info[idx].id[1]);
-				bin2gcr(gcr_info[idx].id[0]);
-				bin2gcr(0x0F);
-				bin2gcr(0x0F);
-				*gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55;
-				*gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55;
+				uint8_t hdr[8] = { 0x08, (uint8_t)(sec ^ track_h ^ gcr_info[idx].id[0] ^ gcr_info[idx].id[1]), sec, track_h,
+					gcr_info[idx].id[1], gcr_info[idx].id[0], 0x0F, 0x0F };
+
+				memset(gcrptr, 0xFF, 5); gcrptr += 5;
+				gcrptr = gcr_encode(gcrptr, hdr, sizeof(hdr));
+				memset(gcrptr, 0x55, 9); gcrptr += 9;
 
+				// data block: mark, 256 bytes, checksum, two zero bytes
+				uint8_t blk[260];
 				uint8_t cs = 0;
-				uint8_t bt;
+				blk[0] = 0x07;
+				memcpy(blk + 1, trk_buf + ptr, 256);
+				for (int i = 0; i < 256; i++) cs ^= trk_buf[ptr + i];
+				blk[257] = cs;
+				blk[258] = 0;
+				blk[259] = 0;
 
-				*gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF;
-				bin2gcr(0x07);
-				for (int i = 0; i < 256; i++)
-				{
-					bt = trk_buf[ptr + i];
-					cs ^= bt;
-					bin2gcr(bt);
-				}
-				bin2gcr(cs);
-				bin2gcr(0);
-				bin2gcr(0);
+				memset(gcrptr, 0xFF, 5); gcrptr += 5;
+				gcrptr = gcr_encode(gcrptr, blk, sizeof(blk));
 
 				int gap = (track_h < 18) ? 8 : (track_h < 25) ? 17 : (track_h < 31) ? 12 : 9;
-				while (gap--) *gcrptr++ = 0x55;
+				memset(gcrptr, 0x55, gap); gcrptr += gap;
 				sec++;
 			}
 
@@ -580,6 +600,15 @@ void c64_readGCR(int idx, uint64_t lba, uint32_t blks)
 		}
 	}
 
+	if (cached && !cached->valid)
+	{
+		uint32_t len = (gcr_info[idx].type == 2) ? blks * 256 : track_size ? track_size + 2 : 0;
+		cached->data.assign(gcr_buf, gcr_buf + len);
+		cached->size = track_size;
+		cached->blks = blks;
+		cached->valid = true;
+	}
+
 	if (track_size > (blks * 256) - 2)
 		track_size = (blks * 256) - 2;
 
@@ -667,6 +696,7 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 #endif
 
 	if (!gcr_info[idx].type) return;
+	gcr_cache_clear(idx);
 
 	static uint8_t sec_buf[260];
 
@@ -5,8 +5,18 @@
 #include <string.h>
 #include <inttypes.h>
 #include <time.h>
+#include <pthread.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "../../file_io.h"
+#include "../../cfg.h"
+#include "../../offload.h"
 #include "../../cd.h"
+#include "../../menu.h"
+#include "../../counters.h"
+#include "../../membudget.h"
 #include "mister_chd.h"
 
 void lba_to_hunkinfo(chd_file *chd_f, int lba, int *hunknumber, int *hunkoffset)
@@ -28,9 +38,116 @@ int mister_chd_log(const char *format, ...)
 	return printf("\x1b[32m%s\x1b[0m", logline);
 }
 
+// TOC as built from the track metadata, see cd_info_load
+struct chd_toc_rec
+{
+	int end;
+	int last;
+	struct
+	{
+		int offset;
+		int start;
+		int end;
+		int type;
+		int sector_size;
+		int index1;
+		int sbc_type;
+	} tracks[100];
+};
+
+static int chd_toc_load(const char *filename, toc_t *cd_toc)
+{
+	static chd_toc_rec rec;
+	if (!cd_info_load(filename, "toc", &rec, sizeof(rec))) return 0;
+
+	cd_toc->end = rec.end;
+	cd_toc->last = rec.last;
+	for (int i = 0; i < 100; i++)
+	{
+		cd_track_t *t = &cd_toc->tracks[i];
+		t->offset = rec.tracks[i].offset;
+		t->start = rec.tracks[i].start;
+		t->end = rec.tracks[i].end;
+		t->type = rec.tracks[i].type;
+		t->sector_size = rec.tracks[i].sector_size;
+		t->index1 = rec.tracks[i].index1;
+		t->sbc_type = (cd_subcode_types_t)rec.tracks[i].sbc_type;
+	}
+
+	mister_chd_log("%d tracks from the TOC cache\n", cd_toc->last);
+	return 1;
+}
+
+static void chd_toc_store(const char *filename, toc_t *cd_toc)
+{
+	static chd_toc_rec rec;
+	memset(&rec, 0, sizeof(rec));
+
+	rec.end = cd_toc->end;
+	rec.last = cd_toc->last;
+	for (int i = 0; i < 100; i++)
+	{
+		cd_track_t *t = &cd_toc->tracks[i];
+		rec.tracks[i].offset = t->offset;
+		rec.tracks[i].start = t->start;
+		rec.tracks[i].end = t->end;
+		rec.tracks[i].type = t->type;
+		rec.tracks[i].sector_size = t->sector_size;
+		rec.tracks[i].index1 = t->index1;
+		rec.tracks[i].sbc_type = t->sbc_type;
+	}
+
+	cd_info_store(filename, "toc", &rec, sizeof(rec));
+}
+
+// decoded v5 hunk map, so mounting or swapping to an image again doesn't
+// read and decode the whole compressed map. The header sha1 catches a
+// rewritten file with the same size and mtime.
+struct chd_map_rec
+{
+	uint8_t sha1[CHD_SHA1_BYTES];
+	uint32_t hunkbytes;
+	uint32_t hunkcount;
+	uint32_t maplen;
+};
+
+static int chd_map_match(const chd_map_rec *rec, const chd_header *hdr)
+{
+	return !memcmp(rec->sha1, hdr->sha1, sizeof(rec->sha1)) && rec->hunkbytes == hdr->hunkbytes && rec->hunkcount == hdr->hunkcount;
+}
+
+static void chd_map_store(const char *filename, const chd_header *hdr)
+{
+	if (hdr->version < 5 || !hdr->rawmap) return;
+
+	chd_map_rec rec;
+	memcpy(rec.sha1, hdr->sha1, sizeof(rec.sha1));
+	rec.hunkbytes = hdr->hunkbytes;
+	rec.hunkcount = hdr->hunkcount;
+	rec.maplen = hdr->hunkcount * hdr->mapentrybytes;
+
+	std::vector<uint8_t> buf(sizeof(rec) + rec.maplen);
+	memcpy(buf.data(), &rec, sizeof(rec));
+	memcpy(buf.data() + sizeof(rec), hdr->rawmap, rec.maplen);
+	cd_info_store(filename, "chdmap", buf.data(), buf.size());
+}
+
+static void chd_ra_init(chd_file *chd_f, int fd);
+
 chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 {
-	chd_error err = chd_open(getFullPath(filename), CHD_OPEN_READ, NULL, &cd_toc->chd_f);
+	std::vector<uint8_t> map;
+	chd_map_rec rec = {};
+	if (!cd_info_load(filename, "chdmap", map) || map.size() < sizeof(rec)) map.clear();
+	else
+	{
+		memcpy(&rec, map.data(), sizeof(rec));
+		if (map.size() != sizeof(rec) + rec.maplen) map.clear();
+	}
+
+	std::string path = getFullPath(filename);
+	chd_error err = map.empty() ? chd_open(path.c_str(), CHD_OPEN_READ, NULL, &cd_toc->chd_f) :
+		chd_open_map(path.c_str(), CHD_OPEN_READ, NULL, map.data() + sizeof(rec), rec.maplen, &cd_toc->chd_f);
 	if (err != CHDERR_NONE)
 	{
 		cd_toc->chd_f = NULL;
@@ -45,11 +162,31 @@ chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 		return CHDERR_NO_INTERFACE; //I'm not sure this error condition is possible, so just use whatever
 	}
 
+	if (!map.empty() && !chd_map_match(&rec, chd_header))
+	{
+		// not the image the map was decoded from, open it the slow way
+		chd_close(cd_toc->chd_f);
+		map.clear();
+		err = chd_open(path.c_str(), CHD_OPEN_READ, NULL, &cd_toc->chd_f);
+		if (err != CHDERR_NONE)
+		{
+			cd_toc->chd_f = NULL;
+			return err;
+		}
+		chd_header = chd_get_header(cd_toc->chd_f);
+	}
+
+	if (!map.empty()) mister_chd_log("hunk map from the cache\n");
+	else chd_map_store(filename, chd_header);
+
 	mister_chd_log("hunkbytes %d unitbytes %d logical length %llu\n", chd_header->hunkbytes, chd_header->unitbytes, chd_header->logicalbytes);
 
 	//Set CLOEXEC on underlying FD
 	int chd_fd = fileno(chd_core_file(cd_toc->chd_f));
 	if (chd_fd) fcntl(chd_fd, F_SETFD, FD_CLOEXEC);
+	chd_ra_init(cd_toc->chd_f, chd_fd);
+
+	if (chd_toc_load(filename, cd_toc)) return CHDERR_NONE;
 
 	//Load track info
 	int sector_cnt = 0;
@@ -152,10 +289,202 @@ chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 		mister_chd_log("Track %d: Type: %s PreGap: %d PreGapType: %s Frames: %d start: %d end %d\n", cd_toc->last, track_type, pregap, pgtype, frames, cd_toc->tracks[cd_toc->last].start, cd_toc->tracks[cd_toc->last].end);
 
 	}
+
+	chd_toc_store(filename, cd_toc);
 	return CHDERR_NONE;
 }
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum)
+// Decompressed hunks are kept in one LRU shared by all CHD users, so reading
+// back and forth across hunk boundaries (data + audio, XA interleave) doesn't
+// decode the same hunk again. Keyed by chd_file + hunk number, the entries of
+// an image are dropped by mister_chd_close.
+//
+// chd_lock covers the cache and is only held for lookups and copies.
+// chd_decode_lock serializes chd_read, which isn't reentrant, between the
+// readers (main loop, IDE CD-ROM worker) and the read-ahead.
+struct chd_hunk_t
+{
+	chd_file *chd_f;
+	uint32_t hunknum;
+	std::vector<uint8_t> data;
+};
+
+struct chd_key_hash
+{
+	size_t operator()(const std::pair<chd_file*, uint32_t> &key) const
+	{
+		return std::hash<void*>()(key.first) ^ (key.second * 2654435761u);
+	}
+};
+
+// Once an image is read hunk after hunk, the following chd_readahead hunks
+// (MiSTer.ini) are decoded on the bulk offload worker, so the reader finds
+// them ready. Images on a network share read twice as far ahead, as far as
+// the cache allows, each hunk read there is a round trip.
+
+struct chd_ra_t
+{
+	uint32_t last;
+	offload_handle_t job;
+	int net;
+};
+
+static std::list<chd_hunk_t> chd_lru;
+static std::unordered_map<std::pair<chd_file*, uint32_t>, std::list<chd_hunk_t>::iterator, chd_key_hash> chd_hunks;
+static std::unordered_map<chd_file*, chd_ra_t> chd_ra;
+static std::unordered_map<chd_file*, std::vector<uint8_t>> chd_mem; // see mister_chd_preload
+static size_t chd_cache_bytes = 0;
+static pthread_mutex_t chd_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t chd_decode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// chd_lock held
+static const uint8_t *chd_find_hunk(chd_file *chd_f, uint32_t hunknum)
+{
+	auto it = chd_hunks.find({ chd_f, hunknum });
+	if (it == chd_hunks.end()) return NULL;
+
+	chd_lru.splice(chd_lru.begin(), chd_lru, it->second);
+	return it->second->data.data();
+}
+
+// chd_lock held
+static const uint8_t *chd_insert_hunk(chd_file *chd_f, uint32_t hunknum, std::vector<uint8_t> &data)
+{
+	size_t limit = (size_t)cfg.chd_cache * 1024 * 1024;
+
+	// always keep at least the new one
+	while (!chd_lru.empty() && chd_cache_bytes + data.size() > limit)
+	{
+		chd_hunk_t &old = chd_lru.back();
+		chd_cache_bytes -= old.data.size();
+		chd_hunks.erase({ old.chd_f, old.hunknum });
+		chd_lru.pop_back();
+	}
+
+	chd_cache_bytes += data.size();
+	chd_lru.push_front({ chd_f, hunknum, std::move(data) });
+	chd_hunks[{ chd_f, hunknum }] = chd_lru.begin();
+	return chd_lru.front().data.data();
+}
+
+// chd_decode_lock held. Returns the cached hunk with chd_lock held, or NULL with chd_lock released.
+static const uint8_t *chd_decode_hunk(chd_file *chd_f, uint32_t hunknum, chd_error *err)
+{
+	// somebody else may have decoded it while we waited for chd_decode_lock
+	pthread_mutex_lock(&chd_lock);
+	const uint8_t *hunk = chd_find_hunk(chd_f, hunknum);
+	if (hunk) return hunk;
+	pthread_mutex_unlock(&chd_lock);
+
+	std::vector<uint8_t> data(chd_get_header(chd_f)->hunkbytes);
+	*err = chd_read(chd_f, hunknum, data.data());
+	if (*err != CHDERR_NONE) return NULL;
+
+	pthread_mutex_lock(&chd_lock);
+	return chd_insert_hunk(chd_f, hunknum, data);
+}
+
+// chd_lock held
+static void chd_drop_hunks(chd_file *chd_f)
+{
+	for (auto it = chd_lru.begin(); it != chd_lru.end();)
+	{
+		if (it->chd_f == chd_f)
+		{
+			chd_cache_bytes -= it->data.size();
+			chd_hunks.erase({ it->chd_f, it->hunknum });
+			it = chd_lru.erase(it);
+		}
+		else it++;
+	}
+}
+
+static void chd_readahead(chd_file *chd_f, uint32_t hunknum, uint32_t cnt)
+{
+	for (uint32_t i = 0; i < cnt; i++)
+	{
+		pthread_mutex_lock(&chd_lock);
+		int cached = chd_find_hunk(chd_f, hunknum + i) != NULL;
+		pthread_mutex_unlock(&chd_lock);
+		if (cached) continue;
+
+		chd_error err = CHDERR_NONE;
+		pthread_mutex_lock(&chd_decode_lock);
+		int ok = chd_decode_hunk(chd_f, hunknum + i, &err) != NULL;
+		if (ok) pthread_mutex_unlock(&chd_lock);
+		pthread_mutex_unlock(&chd_decode_lock);
+		if (!ok) break;
+	}
+}
+
+static size_t chd_cache_size()
+{
+	pthread_mutex_lock(&chd_lock);
+	size_t size = chd_cache_bytes;
+	pthread_mutex_unlock(&chd_lock);
+	return size;
+}
+
+// least recently used hunks first
+static size_t chd_cache_trim(size_t bytes)
+{
+	size_t freed = 0;
+	pthread_mutex_lock(&chd_lock);
+	while (!chd_lru.empty() && freed < bytes)
+	{
+		chd_hunk_t &old = chd_lru.back();
+		freed += old.data.size();
+		chd_cache_bytes -= old.data.size();
+		chd_hunks.erase({ old.chd_f, old.hunknum });
+		chd_lru.pop_back();
+	}
+	pthread_mutex_unlock(&chd_lock);
+	return freed;
+}
+
+static size_t chd_mem_size()
+{
+	size_t size = 0;
+	pthread_mutex_lock(&chd_lock);
+	for (auto &m : chd_mem) size += m.second.size();
+	pthread_mutex_unlock(&chd_lock);
+	return size;
+}
+
+static void chd_ra_init(chd_file *chd_f, int fd)
+{
+	membudget_register("chd_hunks", MEMBUDGET_PRIO_MID, chd_cache_size, chd_cache_trim);
+	membudget_register("chd_preload", MEMBUDGET_PRIO_HIGH, chd_mem_size);
+
+	storageProfile prof;
+	FileStorageProfile(fd, &prof);
+
+	pthread_mutex_lock(&chd_lock);
+	chd_ra[chd_f].net = (prof.type == STORAGE_NET);
+	pthread_mutex_unlock(&chd_lock);
+}
+
+// chd_lock held
+static void chd_predict(chd_file *chd_f, uint32_t hunknum)
+{
+	chd_ra_t &ra = chd_ra[chd_f];
+	if (ra.last == hunknum) return;
+
+	int sequential = (hunknum == ra.last + 1);
+	ra.last = hunknum;
+
+	// cache must hold the read-ahead plus the hunk being read
+	uint32_t hunkbytes = chd_get_header(chd_f)->hunkbytes;
+	uint32_t cnt = cfg.chd_readahead;
+	if (ra.net && (size_t)cfg.chd_cache * 1024 * 1024 >= (cnt * 2 + 1) * (size_t)hunkbytes) cnt *= 2;
+	if (!cnt || !sequential || (size_t)cfg.chd_cache * 1024 * 1024 < (cnt + 1) * (size_t)hunkbytes) return;
+	if (hunknum + 1 >= chd_get_header(chd_f)->hunkcount || !offload_is_done(ra.job)) return;
+
+	uint32_t first = hunknum + 1;
+	ra.job = offload_try_add_work([chd_f, first, cnt]() { chd_readahead(chd_f, first, cnt); }, OFFLOAD_PRIO_BULK);
+}
+
+chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf)
 {
 
 	int tmphnum = 0;
@@ -165,17 +494,97 @@ chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, ui
 
 
 	//mister_chd_log("READ LBA: %d, dest_offset: %d sector offset: %d length %d chd_f %p\n", lba, d_offset, s_offset, length, chd_f);
-	if (tmphnum != *hunknum)
+	chd_error err = CHDERR_NONE;
+	int locked = 0;
+
+	pthread_mutex_lock(&chd_lock);
+	auto mem = chd_mem.find(chd_f);
+	if (mem != chd_mem.end())
+	{
+		size_t pos = (size_t)tmphnum * chd_get_header(chd_f)->hunkbytes + hunkofs * CD_FRAME_SIZE + s_offset;
+		if (pos + length <= mem->second.size()) memcpy(destbuf + d_offset, mem->second.data() + pos, length);
+		else err = CHDERR_HUNK_OUT_OF_RANGE;
+		pthread_mutex_unlock(&chd_lock);
+		return err;
+	}
+
+	const uint8_t *hunkbuf = chd_find_hunk(chd_f, tmphnum);
+	counter_add(hunkbuf ? CNT_CHD_HIT : CNT_CHD_MISS);
+	if (!hunkbuf)
+	{
+		pthread_mutex_unlock(&chd_lock);
+		pthread_mutex_lock(&chd_decode_lock);
+		locked = 1;
+		hunkbuf = chd_decode_hunk(chd_f, tmphnum, &err);
+	}
+
+	if (hunkbuf)
+	{
+		int sector_offset = hunkofs * CD_FRAME_SIZE;
+		memcpy(destbuf + d_offset, hunkbuf + sector_offset + s_offset, length);
+		chd_predict(chd_f, tmphnum);
+		pthread_mutex_unlock(&chd_lock);
+	}
+
+	if (locked) pthread_mutex_unlock(&chd_decode_lock);
+
+	if (err != CHDERR_NONE) mister_chd_log("ERROR %s\n", chd_error_string(err));
+	return err;
+}
+
+int mister_chd_preload(chd_file *chd_f, uint64_t done, uint64_t total)
+{
+	const chd_header *hdr = chd_get_header(chd_f);
+	uint64_t size = (uint64_t)hdr->hunkcount * hdr->hunkbytes;
+
+	std::vector<uint8_t> data;
+	try { data.resize(size); }
+	catch (...)
 	{
-		chd_error err = chd_read(chd_f, tmphnum, hunkbuf);
+		mister_chd_log("preload: cannot allocate %llu bytes\n", size);
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < hdr->hunkcount; i++)
+	{
+		pthread_mutex_lock(&chd_decode_lock);
+		chd_error err = chd_read(chd_f, i, data.data() + (size_t)i * hdr->hunkbytes);
+		pthread_mutex_unlock(&chd_decode_lock);
+
 		if (err != CHDERR_NONE)
 		{
-			mister_chd_log("ERROR %s\n", chd_error_string(err));
-			return err;
+			mister_chd_log("preload: ERROR %s\n", chd_error_string(err));
+			return 0;
 		}
-		*hunknum = tmphnum;
+
+		if (total && !(i & 15)) ProgressMessage("Loading", "CHD image", (done + (uint64_t)i * hdr->hunkbytes) >> 10, total >> 10);
 	}
-	int sector_offset = hunkofs * CD_FRAME_SIZE;
-	memcpy(destbuf + d_offset, hunkbuf + sector_offset + s_offset, length);
-	return CHDERR_NONE;
+
+	pthread_mutex_lock(&chd_lock);
+	chd_mem[chd_f].swap(data);
+
+	// the cached hunks of this image are not needed any more
+	chd_drop_hunks(chd_f);
+	pthread_mutex_unlock(&chd_lock);
+	return 1;
+}
+
+void mister_chd_close(chd_file *chd_f)
+{
+	if (!chd_f) return;
+
+	pthread_mutex_lock(&chd_lock);
+	offload_handle_t job = chd_ra[chd_f].job;
+	chd_ra.erase(chd_f);
+	chd_mem.erase(chd_f);
+	pthread_mutex_unlock(&chd_lock);
+
+	// the read-ahead must be done with the image before it goes away
+	offload_wait(job);
+
+	pthread_mutex_lock(&chd_lock);
+	chd_drop_hunks(chd_f);
+	pthread_mutex_unlock(&chd_lock);
+
+	chd_close(chd_f);
 }
@@ -5,7 +5,14 @@
 #include <libchdr/cdrom.h>
 #include "../../cd.h"
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum);
+chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf);
 chd_error mister_load_chd(const char *filename, toc_t *cd_toc);
 
+// decodes the whole image into RAM, later reads of it bypass the hunk cache.
+// Progress is shown as done + bytes decoded of total bytes if total is set.
+int mister_chd_preload(chd_file *chd_f, uint64_t done = 0, uint64_t total = 0);
+
+// closes the image and drops its hunks from the shared cache
+void mister_chd_close(chd_file *chd_f);
+
 #endif
@@ -39,9 +39,14 @@
 #define MCD_SUB_IO_INDEX 3
 #define MCD_CDDA_IO_INDEX 4
 
+#include <atomic>
 #include "../../cd.h"
+#include "../../offload.h"
 #include <libchdr/chd.h>
 
+// data sectors read ahead of the head position
+#define CDD_PF_SECTORS 16
+
 class cdd_t
 {
 public:
@@ -69,17 +74,27 @@ private:
 	int scanOffset;
 	int audioLength;
 	int audioOffset;
-	int chd_hunknum;
-	uint8_t *chd_hunkbuf;
 	int chd_audio_read_lba;
 	uint8_t stat[10];
 	uint8_t comm[10];
 
+	// data sector read-ahead ring, slot of a sector is its lba modulo the size.
+	// Sectors [pf_start, pf_ready) are read, the offload worker fills up to pf_fill.
+	uint8_t pf[CDD_PF_SECTORS][2048];
+	int pf_start;
+	int pf_fill;
+	std::atomic<int> pf_ready;
+	offload_handle_t pf_job;
+
 	int LoadCUE(const char* filename);
 	int LoadCHD(const char* filename);
 	int SectorSend(uint8_t* header);
 	int SubcodeSend();
 	void ReadData(uint8_t *buf);
+	void ReadDataAt(int lba, uint8_t *buf);
+	void PrefetchDrop();
+	int PrefetchGet(uint8_t *buf);
+	void PrefetchFill();
 	int ReadCDDA(uint8_t *buf);
 	int ReadSubcode(uint16_t* buf);
 	void LBAToMSF(int lba, msf_t* msf);
@@ -7,6 +7,7 @@
 
 #include "megacd.h"
 #include "../chd/mister_chd.h"
+#include "../../counters.h"
 
 cdd_t cdd;
 
@@ -20,10 +21,10 @@ cdd_t::cdd_t() {
 	status = CD_STAT_NO_DISC;
 	audioLength = 0;
 	audioOffset = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
 	SendData = NULL;
 	CanSendData = NULL;
+	pf_start = pf_fill = pf_ready = 0;
+	pf_job = 0;
 
 	stat[0] = 0xB;
 	stat[1] = 0x0;
@@ -37,86 +38,29 @@ cdd_t::cdd_t() {
 	stat[9] = 0x4;
 }
 
-static int sgets(char *out, int sz, char **in)
-{
-	*out = 0;
-	do
-	{
-		char *instr = *in;
-		int cnt = 0;
-
-		while (*instr && *instr != 10)
-		{
-			if (*instr == 13)
-			{
-				instr++;
-				continue;
-			}
-
-			if (cnt < sz - 1)
-			{
-				out[cnt++] = *instr;
-				out[cnt] = 0;
-			}
-
-			instr++;
-		}
-
-		if(*instr == 10) instr++;
-		*in = instr;
-	}
-	while (!*out && **in);
-
-	return *out;
-}
-
-
 int cdd_t::LoadCUE(const char* filename) {
 	static char fname[1024 + 10];
-	static char line[128];
-	char *ptr, *lptr;
+	static cue_sheet_t cue;
 	static char header[1024];
-	static char toc[100 * 1024];
 
 	strcpy(fname, filename);
 
-	memset(toc, 0, sizeof(toc));
-	if (!FileLoad(fname, toc, sizeof(toc) - 1)) return 1;
+	if (!cd_cue_parse(fname, &cue)) return 1;
 
 	printf("\x1b[32mMCD: Open CUE: %s\n\x1b[0m", fname);
 
-	int mm, ss, bb, pregap = 0;
+	int pregap = 0;
 
-	char *buf = toc;
-	while (sgets(line, sizeof(line), &buf))
+	for (int n = 0; n < cue.cmds; n++)
 	{
-		lptr = line;
-		while (*lptr == 0x20) lptr++;
+		const cue_cmd_t *c = &cue.cmd[n];
 
 		/* decode FILE commands */
-		if (!(memcmp(lptr, "FILE", 4)))
+		if (c->cmd == CUE_FILE)
 		{
-			ptr = fname + strlen(fname) - 1;
-			while ((ptr - fname) && (*ptr != '/') && (*ptr != '\\')) ptr--;
-			if (ptr - fname) ptr++;
+			cd_cue_file(&cue, c, fname, 1024);
 
-			lptr += 4;
-			while (*lptr == 0x20) lptr++;
-
-			if (*lptr == '\"')
-			{
-				lptr++;
-				while ((*lptr != '\"') && (lptr <= (line + 128)) && (ptr < (fname + 1023)))
-					*ptr++ = *lptr++;
-			}
-			else
-			{
-				while ((*lptr != 0x20) && (lptr <= (line + 128)) && (ptr < (fname + 1023)))
-					*ptr++ = *lptr++;
-			}
-			*ptr = 0;
-
-			if(!FileOpen(&this->toc.tracks[this->toc.last].f, fname)) return -1;
+			if(!cd_open_track(&this->toc.tracks[this->toc.last].f, fname)) return -1;
 
 			printf("\x1b[32mMCD: Open track file: %s\n\x1b[0m", fname);
 
@@ -124,7 +68,7 @@ int cdd_t::LoadCUE(const char* filename) {
 
 			this->toc.tracks[this->toc.last].offset = 0;
 
-			if (!strstr(lptr, "BINARY") && !strstr(lptr, "MOTOROLA") && !strstr(lptr, "WAVE"))
+			if (c->type == CUE_FILE_OTHER)
 			{
 				FileClose(&this->toc.tracks[this->toc.last].f);
 				printf("\x1b[32mMCD: unsupported file: %s\n\x1b[0m", fname);
@@ -134,9 +78,9 @@ int cdd_t::LoadCUE(const char* filename) {
 		}
 
 		/* decode TRACK commands */
-		else if ((sscanf(lptr, "TRACK %02d %*s", &bb)) || (sscanf(lptr, "TRACK %d %*s", &bb)))
+		else if (c->cmd == CUE_TRACK)
 		{
-			if (bb != (this->toc.last + 1))
+			if (c->num != (this->toc.last + 1))
 			{
 				FileClose(&this->toc.tracks[this->toc.last].f);
 				printf("\x1b[32mMCD: missing tracks: %s\n\x1b[0m", fname);
@@ -145,11 +89,11 @@ int cdd_t::LoadCUE(const char* filename) {
 
 			if (!this->toc.last)
 			{
-				if (strstr(lptr, "MODE1/2048"))
+				if (c->type == CUE_MODE1_2048)
 				{
 					this->toc.tracks[0].sector_size = 2048;
 				}
-				else if (strstr(lptr, "MODE1/2352"))
+				else if (c->type == CUE_MODE1_2352)
 				{
 					this->toc.tracks[0].sector_size = 2352;
 
@@ -174,29 +118,27 @@ int cdd_t::LoadCUE(const char* filename) {
 		}
 
 		/* decode PREGAP commands */
-		else if (sscanf(lptr, "PREGAP %02d:%02d:%02d", &mm, &ss, &bb) == 3)
+		else if (c->cmd == CUE_PREGAP && c->frames >= 0)
 		{
-			pregap += bb + ss * 75 + mm * 60 * 75;
+			pregap += c->frames;
 		}
 
 		/* decode INDEX commands */
-		else if ((sscanf(lptr, "INDEX 00 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
-			(sscanf(lptr, "INDEX 0 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
+		else if (c->cmd == CUE_INDEX && c->num == 0 && c->frames >= 0)
 		{
 			if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
 			{
-				this->toc.tracks[this->toc.last - 1].end = bb + ss * 75 + mm * 60 * 75 + pregap;
+				this->toc.tracks[this->toc.last - 1].end = c->frames + pregap;
 			}
 		}
-		else if ((sscanf(lptr, "INDEX 01 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
-			(sscanf(lptr, "INDEX 1 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
+		else if (c->cmd == CUE_INDEX && c->num == 1 && c->frames >= 0)
 		{
 			this->toc.tracks[this->toc.last].offset += pregap * 2352;
 
 			if (!this->toc.tracks[this->toc.last].f.opened())
 			{
-				FileOpen(&this->toc.tracks[this->toc.last].f, fname);
-				this->toc.tracks[this->toc.last].start = bb + ss * 75 + mm * 60 * 75 + pregap;
+				cd_open_track(&this->toc.tracks[this->toc.last].f, fname);
+				this->toc.tracks[this->toc.last].start = c->frames + pregap;
 				if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
 				{
 					this->toc.tracks[this->toc.last - 1].end = this->toc.tracks[this->toc.last].start;
@@ -213,7 +155,7 @@ int cdd_t::LoadCUE(const char* filename) {
 				if (this->toc.tracks[this->toc.last].type) sectorSize = this->toc.tracks[0].sector_size;
 				this->toc.tracks[this->toc.last].end = this->toc.tracks[this->toc.last].start + ((this->toc.tracks[this->toc.last].f.size + sectorSize - 1) / sectorSize);
 
-				this->toc.tracks[this->toc.last].start += (bb + ss * 75 + mm * 60 * 75);
+				this->toc.tracks[this->toc.last].start += c->frames;
 				this->toc.end = this->toc.tracks[this->toc.last].end;
 			}
 
@@ -258,14 +200,6 @@ int cdd_t::Load(const char *filename)
 			printf("ERROR %s\n", chd_error_string(err));
 			return -1;
 		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(CD_FRAME_SIZE * CD_FRAMES_PER_HUNK);
-		this->chd_hunknum = -1;
  	} else {
 		return (-1);
 
@@ -273,7 +207,7 @@ int cdd_t::Load(const char *filename)
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header);
 	} else {
 		fd_img = &this->toc.tracks[0].f;
 
@@ -299,6 +233,7 @@ int cdd_t::Load(const char *filename)
 	if (this->toc.last)
 	{
 		this->toc.tracks[this->toc.last].start = this->toc.end;
+		cd_preload(&this->toc);
 		this->loaded = 1;
 
 		printf("\x1b[32mMCD: CD mounted , last track = %u\n\x1b[0m", this->toc.last);
@@ -313,15 +248,11 @@ void cdd_t::Unload()
 {
 	if (this->loaded)
 	{
-		if (this->toc.chd_f)
-		{
-			chd_close(this->toc.chd_f);
-		}
+		PrefetchDrop();
 
-		if (this->chd_hunkbuf)
+		if (this->toc.chd_f)
 		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
+			mister_chd_close(this->toc.chd_f);
 		}
 
 		for (int i = 0; i < this->toc.last; i++)
@@ -917,28 +848,87 @@ void cdd_t::SeekToLBA(int lba, int play) {
 
 void cdd_t::ReadData(uint8_t *buf)
 {
+	cd_trace(CD_TRACE_MEGACD, this->lba, 1);
+
 	if (this->toc.tracks[this->index].type && (this->lba >= 0))
 	{
+		if (!PrefetchGet(buf)) ReadDataAt(this->lba, buf);
+		PrefetchFill();
+	}
+}
 
-		if (this->toc.chd_f)
+// 2048 bytes of user data of the data track
+void cdd_t::ReadDataAt(int lba, uint8_t *buf)
+{
+	if (this->toc.chd_f)
+	{
+		int read_offset = 0;
+		if (this->sectorSize != 2048)
 		{
-			int read_offset = 0;
-			if (this->sectorSize != 2048)
-			{
-				read_offset += 16;
-			}
-
-			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[0].offset, 0, read_offset, 2048, buf, this->chd_hunkbuf, &this->chd_hunknum);
-		} else {
-			if (this->sectorSize == 2048)
-			{
-				FileSeek(&this->toc.tracks[0].f, this->lba * 2048, SEEK_SET);
-			} else {
-			FileSeek(&this->toc.tracks[0].f, this->lba * 2352 + 16, SEEK_SET);
-			}
-			FileReadAdv(&this->toc.tracks[0].f, buf, 2048);
+			read_offset += 16;
 		}
+
+		mister_chd_read_sector(this->toc.chd_f, lba + this->toc.tracks[0].offset, 0, read_offset, 2048, buf);
+	} else {
+		__off64_t offs = (this->sectorSize == 2048) ? (__off64_t)lba * 2048 : (__off64_t)lba * 2352 + 16;
+		FileReadAt(&this->toc.tracks[0].f, offs, buf, 2048);
+	}
+}
+
+void cdd_t::PrefetchDrop()
+{
+	offload_wait(this->pf_job);
+	this->pf_job = 0;
+	this->pf_start = this->pf_fill = this->pf_ready = 0;
+}
+
+// copies the sector at the head position if it was read ahead
+int cdd_t::PrefetchGet(uint8_t *buf)
+{
+	int lba = this->lba;
+	if (lba < this->pf_start || lba >= this->pf_fill)
+	{
+		// seek, or nothing read ahead yet
+		PrefetchDrop();
+		this->pf_start = this->pf_fill = this->pf_ready = lba + 1;
+		return 0;
+	}
+
+	if (this->pf_ready.load() <= lba)
+	{
+		counter_add(CNT_CD_LATE);
+		offload_wait(this->pf_job);
+		if (this->pf_ready.load() <= lba) return 0;
 	}
+
+	memcpy(buf, this->pf[lba % CDD_PF_SECTORS], 2048);
+	this->pf_start = lba + 1;
+	return 1;
+}
+
+// keep the ring CDD_PF_SECTORS ahead of the head
+void cdd_t::PrefetchFill()
+{
+	if (!offload_is_done(this->pf_job)) return;
+
+	int first = this->pf_fill;
+	int cnt = this->pf_start + CDD_PF_SECTORS - first;
+	if (cnt > CDD_PF_SECTORS / 2) cnt = CDD_PF_SECTORS / 2;
+	if (cnt > this->toc.tracks[0].end - first) cnt = this->toc.tracks[0].end - first;
+	if (cnt <= 0) return;
+
+	// zipped images seek the shared file handle, only real files and CHD are read off the main thread
+	if (!this->toc.chd_f && !this->toc.tracks[0].f.filp) return;
+
+	this->pf_job = offload_try_add_work([this, first, cnt]()
+	{
+		for (int i = first; i < first + cnt; i++)
+		{
+			ReadDataAt(i, this->pf[i % CDD_PF_SECTORS]);
+			this->pf_ready.store(i + 1);
+		}
+	});
+	if (this->pf_job) this->pf_fill += cnt;
 }
 
 int cdd_t::ReadCDDA(uint8_t *buf)
@@ -958,17 +948,10 @@ int cdd_t::ReadCDDA(uint8_t *buf)
 	{
 		for(int i = 0; i < this->audioLength / 2352; i++)
 		{
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 2352*i, 0, 2352, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 2352*i, 0, 2352, buf);
 		}
 
-		//CHD audio requires byteswap. There's probably a better way to do this...
-
-		for (int swapidx = 0; swapidx < this->audioLength; swapidx += 2)
-		{
-			uint8_t temp = buf[swapidx];
-			buf[swapidx] = buf[swapidx+1];
-			buf[swapidx+1] = temp;
-		}
+		cd_swap16(buf, this->audioLength);
 
 		if ((this->audioLength / 2352) > 1)
 		{
@@ -982,18 +965,38 @@ int cdd_t::ReadCDDA(uint8_t *buf)
 	return this->audioLength;
 }
 
-void InterleaveSubcode(uint8_t *subc_data, uint16_t *buf)
+// Each subcode byte of channel j holds 2-bit fields of four output words.
+// subc_spread maps a byte to the contributions of channel 0 to those four
+// words, packed as 16-bit lanes. Channel j is the same shifted right by j,
+// which never crosses a lane, so a sector takes 96 table lookups instead
+// of 384 bit-field extractions.
+static uint64_t subc_spread[256];
+
+static void InitSubcodeSpread()
 {
-	for(int i = 0, n=0; i < 96; i+=2,n++)
+	for (int byte = 0; byte < 256; byte++)
 	{
-		int code = 0;
-		for (int j = 0; j < 8; j++)
+		uint64_t v = 0;
+		for (int k = 0; k < 4; k++)
 		{
-			int bits = (subc_data[(j * 12) + (i / 8)] >> (6 - (i&6))) & 3;
-			code |= ((bits & 1) << (15 - j));
-			code |= ((bits >> 1) << (7 - j));
+			int bits = (byte >> (6 - 2 * k)) & 3;
+			v |= (uint64_t)(((bits & 1) << 15) | ((bits >> 1) << 7)) << (16 * k);
 		}
-		buf[n] = code;
+		subc_spread[byte] = v;
+	}
+}
+
+void InterleaveSubcode(uint8_t *subc_data, uint16_t *buf)
+{
+	if (!subc_spread[0xFF]) InitSubcodeSpread();
+
+	for (int b = 0; b < 12; b++)
+	{
+		uint64_t code = 0;
+		for (int j = 0; j < 8; j++) code |= subc_spread[subc_data[(j * 12) + b]] >> j;
+
+		uint16_t words[4] = { (uint16_t)code, (uint16_t)(code >> 16), (uint16_t)(code >> 32), (uint16_t)(code >> 48) };
+		memcpy(buf + b * 4, words, sizeof(words));
 	}
 }
 
@@ -1005,9 +1008,9 @@ int cdd_t::ReadSubcode(uint16_t* buf)
 	{
 		//Just use the read sector call with an offset, since we previously read that sector, it is already in the hunk cache
 		if (this->toc.tracks[this->index].sbc_type == SUBCODE_RW_RAW) {
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, (uint8_t *)buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, (uint8_t *)buf);
 		} else if (this->toc.tracks[this->index].sbc_type == SUBCODE_RW) {
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, subc, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, subc);
 			InterleaveSubcode(subc, buf);
 		} else {
 			err = -1;
@@ -14,7 +14,7 @@
 #include "minimig_fdd.h"
 #include "../../cfg.h"
 
-static uint8_t buffer[1024];
+static uint8_t buffer[BALL_SIZE]; // the biggest art file
 
 static void mem_upload_init(unsigned long addr)
 {
@@ -160,122 +160,47 @@ static void BootClearScreen(int adr, int size)
 	mem_upload_fini();
 }
 
-static void BootUploadLogo()
+// the whole art file, zero padded to size. The files are small, one read
+// replaces a FileReadSec per 512 bytes.
+static int boot_read_art(const char *name, int size)
 {
 	fileTYPE file = {};
-	int x, y;
-	int i = 0;
-	int adr;
-
-	if (FileOpen(&file, user_io_make_filepath(HomeDir(), LOGO_FILE)) || FileOpen(&file, LOGO_FILE)) {
-		FileReadSec(&file, buffer);
-		mem_upload_init(SCREEN_BPL1 + LOGO_OFFSET);
-		adr = SCREEN_BPL1 + LOGO_OFFSET;
-		for (y = 0; y<LOGO_HEIGHT; y++)
-		{
-			for (x = 0; x<LOGO_WIDTH / 16; x++)
-			{
-				if (i == 512)
-				{
-					mem_upload_fini();
-					FileReadSec(&file, buffer);
-					mem_upload_init(adr);
-					i = 0;
-				}
-				spi8(buffer[i++]);
-				spi8(buffer[i++]);
-				//for (tmp=0; tmp<0x80000; tmp++);
-				//printf("i=%03d  x=%03d  y=%03d  dat[0]=0x%08x  dat[1]=0x%08x\n", i, x, y, buffer[i], buffer[i+1]);
-				adr += 2;
-			}
-			mem_upload_fini();
-			mem_upload_init(SCREEN_BPL1 + LOGO_OFFSET + (y + 1)*(SCREEN_WIDTH / 8));
-			adr = SCREEN_BPL1 + LOGO_OFFSET + (y + 1)*(SCREEN_WIDTH / 8);
-		}
-		mem_upload_fini();
-		mem_upload_init(SCREEN_BPL2 + LOGO_OFFSET);
-		adr = SCREEN_BPL2 + LOGO_OFFSET;
-		for (y = 0; y<LOGO_HEIGHT; y++)
-		{
-			for (x = 0; x<LOGO_WIDTH / 16; x++)
-			{
-				if (i == 512)
-				{
-					mem_upload_fini();
-					FileReadSec(&file, buffer);
-					mem_upload_init(adr);
-					i = 0;
-				}
-				spi8(buffer[i++]);
-				spi8(buffer[i++]);
-				adr += 2;
-			}
-			mem_upload_fini();
-			mem_upload_init(SCREEN_BPL2 + LOGO_OFFSET + (y + 1)*(SCREEN_WIDTH / 8));
-			adr = SCREEN_BPL2 + LOGO_OFFSET + (y + 1)*(SCREEN_WIDTH / 8);
-		}
-		mem_upload_fini();
-		FileClose(&file);
-	}
+	if (!FileOpen(&file, user_io_make_filepath(HomeDir(), name)) && !FileOpen(&file, name)) return 0;
+
+	memset(buffer, 0, size);
+	FileReadAdv(&file, buffer, size);
+	FileClose(&file);
+	return 1;
 }
 
-static void BootUploadBall()
+static void mem_upload(unsigned long addr, const uint8_t *data, int size)
 {
-	fileTYPE file = {};
-	int x;
-	int i = 0;
-	int adr;
+	mem_upload_init(addr);
+	spi_write(data, size, 0);
+	mem_upload_fini();
+}
 
-	if (FileOpen(&file, user_io_make_filepath(HomeDir(), BALL_FILE)) || FileOpen(&file, BALL_FILE))
+static void BootUploadLogo()
+{
+	if (boot_read_art(LOGO_FILE, LOGO_SIZE))
 	{
-		FileReadSec(&file, buffer);
-		mem_upload_init(BALL_ADDRESS);
-		adr = BALL_ADDRESS;
-		for (x = 0; x<BALL_SIZE / 2; x++)
-		{
-			if (i == 512)
-			{
-				mem_upload_fini();
-				FileReadSec(&file, buffer);
-				mem_upload_init(adr);
-				i = 0;
-			}
-			spi8(buffer[i++]);
-			spi8(buffer[i++]);
-			adr += 2;
-		}
-		mem_upload_fini();
-		FileClose(&file);
+		// two bitplanes, rows of LOGO_WIDTH pixels
+		const uint8_t *src = buffer;
+		for (int y = 0; y < LOGO_HEIGHT; y++, src += LOGO_WIDTH / 8) mem_upload(SCREEN_BPL1 + LOGO_OFFSET + y * (SCREEN_WIDTH / 8), src, LOGO_WIDTH / 8);
+		for (int y = 0; y < LOGO_HEIGHT; y++, src += LOGO_WIDTH / 8) mem_upload(SCREEN_BPL2 + LOGO_OFFSET + y * (SCREEN_WIDTH / 8), src, LOGO_WIDTH / 8);
 	}
 }
 
-static void BootUploadCopper()
+static void BootUploadBall()
 {
-	fileTYPE file = {};
-	int x;
-	int i = 0;
-	int adr;
+	if (boot_read_art(BALL_FILE, BALL_SIZE)) mem_upload(BALL_ADDRESS, buffer, BALL_SIZE);
+}
 
-	if (FileOpen(&file, user_io_make_filepath(HomeDir(), COPPER_FILE)) || FileOpen(&file, COPPER_FILE))
+static void BootUploadCopper()
+{
+	if (boot_read_art(COPPER_FILE, COPPER_SIZE))
 	{
-		FileReadSec(&file, buffer);
-		mem_upload_init(COPPER_ADDRESS);
-		adr = COPPER_ADDRESS;
-		for (x = 0; x<COPPER_SIZE / 2; x++)
-		{
-			if (i == 512)
-			{
-				mem_upload_fini();
-				FileReadSec(&file, buffer);
-				mem_upload_init(adr);
-				i = 0;
-			}
-			spi8(buffer[i++]);
-			spi8(buffer[i++]);
-			adr += 2;
-		}
-		mem_upload_fini();
-		FileClose(&file);
+		mem_upload(COPPER_ADDRESS, buffer, COPPER_SIZE);
 	}
 	else {
 		mem_upload_init(COPPER_ADDRESS);
@@ -1,6 +1,7 @@
 // config.c
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <sys/stat.h>
@@ -46,52 +47,114 @@ typedef struct
 mm_configTYPE minimig_config = { };
 static unsigned char romkey[3072];
 
-static void SendFileV2(fileTYPE* file, unsigned char* key, int keysize, int address, int size)
+// the decoded ROM of the last upload. A reload of the same file (every reset
+// of the core) sends it from here, as do the mirrors of the smaller ROMs.
+struct romImage
 {
-	static uint8_t buf[512];
-	unsigned int keyidx = 0;
-	printf("File size: %dkB\n", size >> 1);
-	printf("[");
-	if (keysize)
+	char     path[1024];
+	__off64_t size;
+	time_t   mtime;
+	int      keysize;
+	uint8_t *data;
+	uint32_t len;
+};
+
+static romImage kick_image = {}, hrtmon_image = {};
+
+static time_t file_mtime(fileTYPE *file)
+{
+	struct stat64 st;
+	return (file->filp && !fstat64(fileno(file->filp), &st)) ? st.st_mtime : 0;
+}
+
+// the contents of file past skip, XOR'ed with the key, zero padded to the
+// next 512 bytes. Stays valid until the next call.
+static const uint8_t *LoadRom(romImage *img, fileTYPE *file, int skip, unsigned char *key, int keysize, uint32_t *len)
+{
+	uint32_t size = (uint32_t)file->size - skip;
+	time_t mtime = file_mtime(file);
+
+	*len = (size + 511) & ~511;
+	if (img->data && mtime && img->mtime == mtime && img->size == file->size &&
+		img->keysize == keysize && !strcmp(img->path, file->path))
 	{
-		// read header
-		FileReadAdv(file, buf, 0xb);
+		printf("ROM image %s is cached.\n", file->path);
+		return img->data;
 	}
 
-	for (int i = 0; i<size; i++)
+	if (*len > img->len)
 	{
-		if (!(i & 31)) printf("*");
-		FileReadAdv(file, buf, 512);
+		free(img->data);
+		img->data = (uint8_t*)malloc(*len);
+		img->len = img->data ? *len : 0;
+		if (!img->data) return 0;
+	}
+	img->path[0] = 0;
 
-		if (keysize)
-		{
-			// decrypt ROM
-			for (int j = 0; j<512; j++)
-			{
-				buf[j] ^= key[keyidx++];
-				if ((int)keyidx >= keysize) keyidx -= keysize;
-			}
-		}
-		EnableIO();
-		unsigned int adr = address + i * 512;
-		spi8(UIO_MM2_WR);
-		spi8(adr & 0xff); adr = adr >> 8;
-		spi8(adr & 0xff); adr = adr >> 8;
-		spi8(adr & 0xff); adr = adr >> 8;
-		spi8(adr & 0xff); adr = adr >> 8;
-		for (int j = 0; j<512; j = j + 4)
+	memset(img->data + size, 0, *len - size);
+	if (skip) FileSeek(file, skip, SEEK_SET);
+	if ((uint32_t)FileReadAdv(file, img->data, size) != size) return 0;
+
+	if (keysize)
+	{
+		// decrypt ROM
+		for (uint32_t i = 0, keyidx = 0; i < size; i++)
 		{
-			spi8(buf[j + 0]);
-			spi8(buf[j + 1]);
-			spi8(buf[j + 2]);
-			spi8(buf[j + 3]);
+			img->data[i] ^= key[keyidx++];
+			if ((int)keyidx >= keysize) keyidx = 0;
 		}
-		DisableIO();
 	}
 
-	printf("]\n");
+	strcpy(img->path, file->path);
+	img->size = file->size;
+	img->mtime = mtime;
+	img->keysize = keysize;
+	return img->data;
+}
+
+// the address counts up with the data, so one frame takes any length. 64KB
+// frames still let the core see a new address now and then.
+#define SEND_FRAME 0x10000
+
+static void SendMem(const uint8_t *data, uint32_t size, uint32_t address)
+{
+	printf("Upload %ukB to $%06X\n", size >> 10, address);
+	while (size)
+	{
+		uint32_t n = (size < SEND_FRAME) ? size : SEND_FRAME;
+		spi_uio_cmd32_cont(UIO_MM2_WR, address);
+		spi_write(data, n, 0);
+		DisableIO();
+
+		data += n;
+		address += n;
+		size -= n;
+	}
 }
 
+// skip bytes of header, then the ROM to all addresses given
+static int SendRom(romImage *img, fileTYPE *file, int skip, unsigned char *key, int keysize, uint32_t addr1, uint32_t addr2 = 0)
+{
+	uint32_t len;
+	const uint8_t *rom = LoadRom(img, file, skip, key, keysize, &len);
+	if (!rom)
+	{
+		BootPrint("Failed to read the ROM!");
+		return 0;
+	}
+
+	// a 1MB ROM goes in halves to both addresses
+	if (len == 0x100000)
+	{
+		len >>= 1;
+		SendMem(rom + len, len, addr2);
+		addr2 = 0;
+	}
+
+	SendMem(rom, len, addr1);
+	if (addr2) SendMem(rom, len, addr2);
+	return 1;
+}
 
 static char UploadKickstart(char *name)
 {
@@ -127,15 +190,14 @@ static char UploadKickstart(char *name)
 		if (file.size == 0x100000) {
 			// 1MB Kickstart ROM
 			BootPrint("Uploading 1MB Kickstart ...");
-			SendFileV2(&file, NULL, 0, 0xe00000, file.size >> 10);
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 10);
+			int res = SendRom(&kick_image, &file, 0, NULL, 0, 0xe00000, 0xf80000);
 			FileClose(&file);
-			return(1);
+			return(res);
 		}
 		else if ((file.size == 8203) && keysize) {
 			// Cloanto encrypted A1000 boot ROM
 			BootPrint("Uploading encrypted A1000 boot ROM");
-			SendFileV2(&file, romkey, keysize, 0xf80000, file.size >> 9);
+			SendRom(&kick_image, &file, 0xb, romkey, keysize, 0xf80000);
 			FileClose(&file);
 			//clear tag (write 0 to $fc0000) to force bootrom to load Kickstart from disk
 			//and not use one which was already there.
@@ -147,7 +209,7 @@ static char UploadKickstart(char *name)
 		else if (file.size == 0x2000) {
 			// 8KB A1000 boot ROM
 			BootPrint("Uploading A1000 boot ROM");
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 9);
+			SendRom(&kick_image, &file, 0, NULL, 0, 0xf80000);
 			FileClose(&file);
 			spi_uio_cmd32_cont(UIO_MM2_WR, 0xfc0000);
 			spi8(0x00);spi8(0x00);
@@ -157,42 +219,30 @@ static char UploadKickstart(char *name)
 		else if (file.size == 0x80000) {
 			// 512KB Kickstart ROM
 			BootPrint("Uploading 512KB Kickstart ...");
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 9);
+			int res = SendRom(&kick_image, &file, 0, NULL, 0, 0xf80000, 0xe00000);
 			FileClose(&file);
-			FileOpen(&file, name);
-			SendFileV2(&file, NULL, 0, 0xe00000, file.size >> 9);
-			FileClose(&file);
-			return(1);
+			return(res);
 		}
 		else if ((file.size == 0x8000b) && keysize) {
 			// 512KB Kickstart ROM
 			BootPrint("Uploading 512 KB Kickstart (Probably Amiga Forever encrypted...)");
-			SendFileV2(&file, romkey, keysize, 0xf80000, file.size >> 9);
-			FileClose(&file);
-			FileOpen(&file, name);
-			SendFileV2(&file, romkey, keysize, 0xe00000, file.size >> 9);
+			int res = SendRom(&kick_image, &file, 0xb, romkey, keysize, 0xf80000, 0xe00000);
 			FileClose(&file);
-			return(1);
+			return(res);
 		}
 		else if (file.size == 0x40000) {
 			// 256KB Kickstart ROM
 			BootPrint("Uploading 256 KB Kickstart...");
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 9);
-			FileClose(&file);
-			FileOpen(&file, name); // TODO will this work
-			SendFileV2(&file, NULL, 0, 0xfc0000, file.size >> 9);
+			int res = SendRom(&kick_image, &file, 0, NULL, 0, 0xf80000, 0xfc0000);
 			FileClose(&file);
-			return(1);
+			return(res);
 		}
 		else if ((file.size == 0x4000b) && keysize) {
 			// 256KB Kickstart ROM
 			BootPrint("Uploading 256 KB Kickstart (Probably Amiga Forever encrypted...");
-			SendFileV2(&file, romkey, keysize, 0xf80000, file.size >> 9);
+			int res = SendRom(&kick_image, &file, 0xb, romkey, keysize, 0xf80000, 0xfc0000);
 			FileClose(&file);
-			FileOpen(&file, name); // TODO will this work
-			SendFileV2(&file, romkey, keysize, 0xfc0000, file.size >> 9);
-			FileClose(&file);
-			return(1);
+			return(res);
 		}
 		else {
 			BootPrint("Unsupported ROM file size!");
@@ -212,7 +262,7 @@ static char UploadActionReplay()
 	{
 		int adr, data;
 		puts("Uploading HRTmon ROM... ");
-		SendFileV2(&file, NULL, 0, 0xa10000, (file.size + 511) >> 9);
+		SendRom(&hrtmon_image, &file, 0, NULL, 0, 0xa10000);
 		// HRTmon config
 		adr = 0xa10000 + 20;
 		spi_uio_cmd32_cont(UIO_MM2_WR, adr);
@@ -39,6 +39,11 @@ adfTYPE df[4] = {};    // drive information structure
 
 static uint8_t sector_buffer[512];
 
+// The whole image is read into the block cache on insert, so track reads
+// never wait for the storage (network shares included). Written sectors are
+// kept there and go out together once they are FDD_WRITE_DELAY old.
+#define FDD_WRITE_DELAY 1000
+
 unsigned char Error;
 
 #define TRACK_SIZE 12668
@@ -189,7 +194,7 @@ void ReadTrack(adfTYPE *drive)
 		lba = (drive->track * SECTOR_COUNT) + sector;
 	}
 
-	if (!FileSeekLBA(&drive->file, lba))
+	if (lba * 512 >= (unsigned long)drive->file.size)
 	{
 		return;
 	}
@@ -207,7 +212,8 @@ void ReadTrack(adfTYPE *drive)
 
 	while (1)
 	{
-		FileReadSec(&drive->file, sector_buffer);
+		FileReadAt(&drive->file, (__off64_t)lba * 512, sector_buffer, 512);
+		lba++;
 
 		EnableFpga();
 
@@ -265,10 +271,6 @@ void ReadTrack(adfTYPE *drive)
 			// go to the start of current track
 			sector = 0;
 			lba = drive->track * SECTOR_COUNT;
-			if (!FileSeekLBA(&drive->file, lba))
-			{
-				return;
-			}
 		}
 
 		// remember current sector
@@ -571,7 +573,7 @@ void WriteTrack(adfTYPE *drive)
 		{
 			if (Track == drive->track)
 			{
-				if (!FileSeekLBA(&drive->file, lba+Sector))
+				if (Sector >= SECTOR_COUNT)
 				{
 					return;
 				}
@@ -580,7 +582,7 @@ void WriteTrack(adfTYPE *drive)
 				{
 					if (drive->status & DSK_WRITABLE)
 					{
-						FileWriteSec(&drive->file, sector_buffer);
+						FileWriteAt(&drive->file, (__off64_t)(lba + Sector) * 512, sector_buffer, 512);
 					}
 					else
 					{
@@ -607,11 +609,21 @@ void UpdateDriveStatus(void)
 	DisableFpga();
 }
 
+void FlushFDD(uint32_t age_ms)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		if (df[i].file.cache && !FileFlushCache(&df[i].file, age_ms)) Info("Write error");
+	}
+}
+
 void HandleFDD(unsigned char c1, unsigned char c2)
 {
 	unsigned char sel;
 	drives = (c1 >> 4) & 0x03; // number of active floppy drives
 
+	FlushFDD(FDD_WRITE_DELAY);
+
 	if (c1 & CMD_RDTRK)
 	{
 		sel = (c1 >> 6) & 0x03;
@@ -647,6 +659,16 @@ void InsertFloppy(adfTYPE *drive, char* path)
 	}
 	drive->tracks = (unsigned char)tracks;
 
+	uint32_t mb = (drive->file.size + 0xFFFFF) >> 20;
+	if (FileSetCache(&drive->file, mb, writable ? FDD_WRITE_DELAY : 0))
+	{
+		static uint8_t buf[64 * 1024];
+		for (__off64_t pos = 0; pos < drive->file.size; pos += sizeof(buf))
+		{
+			if (FileReadAt(&drive->file, pos, buf, sizeof(buf)) <= 0) break;
+		}
+	}
+
 	strcpy(drive->name, path);
 
 	// initialize the rest of drive struct
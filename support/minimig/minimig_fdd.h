@@ -29,6 +29,8 @@ extern adfTYPE df[4];
 
 void UpdateDriveStatus(void);
 void HandleFDD(unsigned char c1, unsigned char c2);
+// writes back cached sectors older than age_ms (0 - all of them)
+void FlushFDD(uint32_t age_ms = 0);
 void InsertFloppy(adfTYPE *drive, char* path);
 
 #endif
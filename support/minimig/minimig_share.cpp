@@ -7,7 +7,10 @@
 #include <dirent.h>
 #include <time.h>
 
+#include <fcntl.h>
+
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <vector>
 
@@ -26,6 +29,7 @@ static uint8_t *shmem = 0;
 #define REQUEST_FLG     0      // 4B
 #define REQUEST_BUFFER  4      // ~512B
 #define DATA_BUFFER     0x1000 // 4KB
+#define REQUEST_MAX     (DATA_BUFFER - REQUEST_BUFFER)
 
 // Must match device name in MountList and volume name from MiSTerFileSystem
 #define DEVICE_NAME     "SHARE"
@@ -46,14 +50,25 @@ static uint8_t *shmem = 0;
 static char basepath[1024] = {};
 static int baselen = 0;
 
+// directory entry as seen by ACTION_EXAMINE_OBJECT, so the following
+// ACTION_EXAMINE_NEXT packets are answered without touching the disk.
+struct dir_item_t
+{
+	std::string name;
+	int type;
+	uint32_t size;
+	time_t time;
+};
+
 struct lock
 {
 	uint16_t mode;
 	std::string path;
-	std::vector<dirent64> dir_items;
+	std::vector<dir_item_t> dir_items;
 };
 
-static std::map<uint32_t, lock> locks;
+static std::unordered_map<uint32_t, lock> locks;
+static std::unordered_map<std::string, uint32_t> path_locks; // number of locks per path
 static uint32_t next_key = 1;
 
 static uint32_t get_key()
@@ -74,33 +89,36 @@ static uint32_t add_lock(uint16_t mode, const char* path)
 {
 	uint32_t key = get_key();
 	locks[key] = { mode, path, {} };
+	path_locks[path]++;
 
 	dbg_print("+ add lock: %d, %s\n", key, path);
 	return key;
 }
 
+static void del_lock(uint32_t key)
+{
+	auto it = locks.find(key);
+	if (it == locks.end()) return;
+
+	auto pl = path_locks.find(it->second.path);
+	if (pl != path_locks.end() && !--pl->second) path_locks.erase(pl);
+	locks.erase(it);
+}
+
 static int has_locks(const char* path)
 {
-	int has = 0;
-	for (const auto &pair : locks)
-	{
-		if (pair.second.path == path)
-		{
-			if (!has)
-			{
-				dbg_print("! path %s has locks:", path);
-			}
+	auto pl = path_locks.find(path);
+	if (pl == path_locks.end()) return 0;
 
-			has = 1;
-			dbg_print(" %d", pair.first);
-		}
-	}
+	dbg_print("! path %s has %d locks\n", path, pl->second);
+	return 1;
+}
 
-	if (has)
-	{
-		dbg_print("\n");
-	}
-	return has;
+static int stat_type(const struct stat64 *st)
+{
+	if (S_ISREG(st->st_mode)) return ST_FILE;
+	if (S_ISDIR(st->st_mode)) return ST_USERDIR;
+	return 0;
 }
 
 static std::map<uint32_t, fileTYPE> open_file_handles;
@@ -251,6 +269,7 @@ static int process_request(void *reqres_buffer)
 	int ret = ERROR_ACTION_NOT_KNOWN;
 
 	int sz = SWAP_INT(reqres->sz);
+	if (sz < 0 || sz > REQUEST_MAX) sz = REQUEST_MAX;
 	((uint8_t*)reqres_buffer)[sz] = 0;
 
 	int sz_res = sizeof(GenericRequestResponse);
@@ -323,7 +342,7 @@ static int process_request(void *reqres_buffer)
 			FreeLockRequest *req = (FreeLockRequest*)reqres_buffer;
 
 			uint32_t key = SWAP_INT(req->key);
-			locks.erase(key);
+			del_lock(key);
 			dbg_print("  lock: %d\n", key);
 
 			ret = 0;
@@ -402,13 +421,19 @@ static int process_request(void *reqres_buffer)
 			uint32_t key = SWAP_INT(req->key);
 			dbg_print("  key: %d\n", key);
 
+			// key 0 (root) gets its lock here, examine next relies on it
+			lock &l = locks[key];
+
 			char *name = buf;
-			name[0] = 0;
-			if (locks.find(key) != locks.end()) strcpy(name, locks[key].path.c_str());
+			strcpy(name, l.path.c_str());
 			if (!strlen(name)) strcpy(name, basepath);
 
 			int disk_key = 666;
 			static char fn[256];
+			int type = 0;
+			time_t time = 0;
+			uint32_t size = 0;
+
 			if (rtype == ACTION_EXAMINE_OBJECT)
 			{
 				dbg_print("  examine first\n");
@@ -420,8 +445,19 @@ static int process_request(void *reqres_buffer)
 					strcpy(fn, p ? p + 1 : name);
 				}
 
-				locks[key].dir_items.clear();
-				if (PathIsDir(name, 0))
+				struct stat64 *st = getPathStat(name);
+				type = st ? stat_type(st) : 0;
+				if (!type)
+				{
+					ret = ERROR_OBJECT_NOT_FOUND;
+					break;
+				}
+
+				time = st->st_mtime;
+				if (type == ST_FILE) size = (st->st_size > UINT32_MAX) ? UINT32_MAX : (uint32_t)st->st_size;
+
+				l.dir_items.clear();
+				if (type == ST_USERDIR)
 				{
 					const char* full_path = getFullPath(name);
 					DIR *d = opendir(full_path);
@@ -432,11 +468,20 @@ static int process_request(void *reqres_buffer)
 						break;
 					}
 
+					// one stat relative to the open directory per entry
 					struct dirent64 *de;
 					while ((de = readdir64(d)))
 					{
 						if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) continue;
-						locks[key].dir_items.push_back(*de);
+
+						struct stat64 est;
+						if (fstatat64(dirfd(d), de->d_name, &est, 0) < 0) continue;
+
+						int etype = stat_type(&est);
+						if (!etype) continue;
+
+						uint32_t esize = (etype != ST_FILE) ? 0 : (est.st_size > UINT32_MAX) ? UINT32_MAX : (uint32_t)est.st_size;
+						l.dir_items.push_back({ de->d_name, etype, esize, est.st_mtime });
 					}
 					closedir(d);
 				}
@@ -450,45 +495,23 @@ static int process_request(void *reqres_buffer)
 				uint32_t listed = disk_key - 666;
 				disk_key++;
 
-				if (listed >= locks[key].dir_items.size())
+				if (listed >= l.dir_items.size())
 				{
-					locks[key].dir_items.clear();
+					l.dir_items.clear();
 					ret = ERROR_NO_MORE_ENTRIES;
 					break;
 				}
 
-				strcat(name, "/");
-				strcat(name, locks[key].dir_items[listed].d_name);
-				memcpy(fn, locks[key].dir_items[listed].d_name, sizeof(fn));
-				ret = 0;
+				const dir_item_t &item = l.dir_items[listed];
+				snprintf(fn, sizeof(fn), "%s", item.name.c_str());
+				type = item.type;
+				size = item.size;
+				time = item.time;
 			}
 
 			dbg_print("    name: %s\n", name);
 			dbg_print("    fn: %s\n", fn);
 
-			int type = 0;
-			if (FileExists(name, 0)) type = ST_FILE;
-			else if (PathIsDir(name, 0)) type = ST_USERDIR;
-			else
-			{
-				ret = ERROR_OBJECT_NOT_FOUND;
-				break;
-			}
-
-			time_t time = 0;
-			uint32_t size = 0;
-
-			struct stat64 *st = getPathStat(name);
-			if (st)
-			{
-				time = st->st_mtime;
-				if (type == ST_FILE)
-				{
-					if (st->st_size > UINT32_MAX) size = UINT32_MAX;
-					else size = (uint32_t)st->st_size;
-				}
-			}
-
 			res->disk_key = SWAP_INT(disk_key);
 			res->entry_type = SWAP_INT(type);
 			res->size = SWAP_INT(size);
@@ -890,12 +913,22 @@ static int process_request(void *reqres_buffer)
 	reqres->error_code = SWAP_INT(ret);
 
 	dbg_print("error: %d\n", ret);
-	dbg_hexdump(shmem + REQUEST_BUFFER, sz_res, 0);
+	dbg_hexdump(reqres_buffer, sz_res, 0);
 	dbg_print("\n");
 
 	return sz_res;
 }
 
+// shmem is an uncached mapping, every access is a bus transaction.
+// Requests are pulled in and responses pushed out as whole 32-bit words
+// and processed in normal memory.
+static void shmem_copy(void *dst, const void *src, int size)
+{
+	volatile const uint32_t *s = (volatile const uint32_t*)src;
+	volatile uint32_t *d = (volatile uint32_t*)dst;
+	for (int i = 0; i < (size + 3) / 4; i++) d[i] = s[i];
+}
+
 void minimig_share_poll()
 {
 	if (!shmem)
@@ -914,7 +947,16 @@ void minimig_share_poll()
 			old_req_id = req_id;
 			if (((req_id>>16) & 0xFFFF) == 0x5AA5 && ((req_id - 77) & 0xFF) == ((req_id >> 8) & 0xFF))
 			{
-				process_request(shmem + REQUEST_BUFFER);
+				static uint32_t reqres[REQUEST_MAX / 4 + 1];
+
+				int sz = SWAP_INT(*(uint32_t*)(shmem + REQUEST_BUFFER));
+				if (sz < 0 || sz > REQUEST_MAX) sz = REQUEST_MAX;
+				shmem_copy(reqres, shmem + REQUEST_BUFFER, sz);
+
+				int sz_res = process_request(reqres);
+				if (sz_res > REQUEST_MAX) sz_res = REQUEST_MAX;
+				shmem_copy(shmem + REQUEST_BUFFER, reqres, sz_res);
+
 				*(uint16_t*)(shmem + REQUEST_FLG + 2) = (uint16_t)req_id;
 			}
 		}
@@ -925,6 +967,7 @@ void minimig_share_reset()
 {
 	open_file_handles.clear();
 	locks.clear();
+	path_locks.clear();
 	next_fp = 1;
 	next_key = 1;
 }
@@ -2,14 +2,26 @@
 #include "n64_cpak_header.h"
 #include "../../menu.h"
 #include "../../user_io.h"
+#include "../../file_io.h"
+#include "../../offload.h"
+#include "../../log.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <stdlib.h>
+#include <vector>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include "lib/md5/md5.h"
 
+// from <endian.h>, DataFormat uses the names
+#undef BIG_ENDIAN
+#undef LITTLE_ENDIAN
+
 static constexpr auto CARTID_LENGTH = 6U; // Ex: NSME00
 static constexpr auto MD5_LENGTH = 16U;
 static constexpr auto CARTID_PREFIX = "ID:";
@@ -207,6 +219,18 @@ static void normalizeData(uint8_t* data, size_t size, DataFormat format) {
 	switch (format) {
 		case DataFormat::BYTE_SWAPPED:
 			size &= ~1U;
+#ifdef __ARM_NEON
+			for (; size >= 64; size -= 64, data += 64) {
+				uint8x16_t a = vrev16q_u8(vld1q_u8(data));
+				uint8x16_t b = vrev16q_u8(vld1q_u8(data + 16));
+				uint8x16_t c = vrev16q_u8(vld1q_u8(data + 32));
+				uint8x16_t d = vrev16q_u8(vld1q_u8(data + 48));
+				vst1q_u8(data, a);
+				vst1q_u8(data + 16, b);
+				vst1q_u8(data + 32, c);
+				vst1q_u8(data + 48, d);
+			}
+#endif
 			for (size_t i = 0; i < size; i += 2) {
 				auto c0 = data[0];
 				auto c1 = data[1];
@@ -217,6 +241,18 @@ static void normalizeData(uint8_t* data, size_t size, DataFormat format) {
 			break;
 		case DataFormat::LITTLE_ENDIAN:
 			size &= ~3U;
+#ifdef __ARM_NEON
+			for (; size >= 64; size -= 64, data += 64) {
+				uint8x16_t a = vrev32q_u8(vld1q_u8(data));
+				uint8x16_t b = vrev32q_u8(vld1q_u8(data + 16));
+				uint8x16_t c = vrev32q_u8(vld1q_u8(data + 32));
+				uint8x16_t d = vrev32q_u8(vld1q_u8(data + 48));
+				vst1q_u8(data, a);
+				vst1q_u8(data + 16, b);
+				vst1q_u8(data + 32, c);
+				vst1q_u8(data + 48, d);
+			}
+#endif
 			for (size_t i = 0; i < size; i += 4) {
 				auto c0 = data[0];
 				auto c1 = data[1];
@@ -529,116 +565,336 @@ static bool parse_and_apply_db_tags(char *tags) {
 	return (system_type != SystemType::UNKNOWN && cic_type != CIC::UNKNOWN);
 }
 
-static bool md5_matches(const char* line, const char* md5) {
-	for (size_t i = MD5_LENGTH * 2; i > 0; --i, line++, md5++) {
-		int c = *line;
-		if (!c || *md5 != tolower(c)) {
-			return false;
-		}
-	}
+static const char* DB_FILE_NAMES[] = {
+	"N64-database_user.txt",
+	"N64-database.txt"
+};
+
+// Binary index of a DB file, kept in CONFIG_DIR/n64db and rebuilt when the
+// DB's size or mtime changes. MD5 entries and plain cart IDs are sorted for a
+// binary search. IDs with '_' or fewer than 6 characters are few, they're
+// kept in file order and checked after the search. The first line that
+// matches wins, as with the line by line scan.
+static constexpr uint32_t DB_INDEX_MAGIC = 0x31444E36; // "6ND1"
+static constexpr uint32_t DB_NO_TAGS = 0xFFFFFFFF; // entry found but the tags are malformed
+#define DB_INDEX_DIR CONFIG_DIR "/n64db"
+
+struct db_index_header {
+	uint32_t magic;
+	uint32_t path_len;
+	uint64_t size;
+	uint64_t mtime;
+	uint32_t md5_num;
+	uint32_t id_sorted; // the rest of the IDs are patterns
+	uint32_t id_num;
+	uint32_t tags_len;
+};
+
+struct db_md5_entry {
+	uint8_t md5[MD5_LENGTH];
+	uint32_t line;
+	uint32_t tags;
+};
+
+struct db_id_entry {
+	char id[CARTID_LENGTH];
+	uint8_t len;
+	uint8_t pattern;
+	uint32_t line;
+	uint32_t tags;
+};
+
+struct db_index {
+	char path[1024];
+	uint64_t size;
+	uint64_t mtime;
+	std::vector<uint8_t> data; // header, path, entries, tags: the file image
+	const db_index_header* hdr;
+	const db_md5_entry* md5;
+	const db_id_entry* id;
+	const char* tags;
+};
+
+static db_index db_indexes[sizeof(DB_FILE_NAMES) / sizeof(*DB_FILE_NAMES)];
+
+static size_t db_align(size_t len) {
+	return (len + 3) & ~3;
+}
+
+static bool db_index_setup(db_index* db) {
+	const size_t len = db->data.size();
+	if (len < sizeof(db_index_header)) return false;
 
+	const db_index_header* h = (const db_index_header*)db->data.data();
+	size_t pos = db_align(sizeof(*h) + h->path_len);
+	uint64_t need = pos + (uint64_t)h->md5_num * sizeof(db_md5_entry) + (uint64_t)h->id_num * sizeof(db_id_entry) + h->tags_len;
+	if (h->magic != DB_INDEX_MAGIC || h->id_sorted > h->id_num || need != len || (h->tags_len && db->data.back())) return false;
+
+	db->hdr = h;
+	db->md5 = (const db_md5_entry*)(db->data.data() + pos);
+	db->id = (const db_id_entry*)(db->md5 + h->md5_num);
+	db->tags = (const char*)(db->id + h->id_num);
 	return true;
 }
 
-// Returns numbers of matching characters if match, otherwize 0
-static size_t cart_id_is_match(const char* line, const char* cart_id) {
-	const auto prefix_len = strlen(CARTID_PREFIX);
+// the part of a line sscanf "%*[ \t]%[^#;]" would take
+static uint32_t db_add_tags(std::vector<char>& tags, const char* s) {
+	if (*s != ' ' && *s != '\t') return DB_NO_TAGS;
+	while (*s == ' ' || *s == '\t') s++;
 
-	// A valid ID line should start with "ID:"
-	if (strncmp(line, CARTID_PREFIX, prefix_len) != 0) {
-		return 0;
-	}
+	size_t len = strcspn(s, "#;");
+	if (!len) return DB_NO_TAGS;
 
-	// Skip the line if it doesn't match our cart_id, '_' = don't care
-	const char* lp = line + prefix_len;
-	for (size_t i = 0; i < CARTID_LENGTH && *lp; i++, lp++) {
-		if (i && isspace(*lp)) {
-			return i; // Early termination
-		}
+	uint32_t off = tags.size();
+	tags.insert(tags.end(), s, s + len);
+	tags.push_back(0);
+	return off;
+}
 
-		if (*lp != '_' && *lp != cart_id[i]) {
-			return 0; // Character didn't match pattern
-		}
-	}
+// the line number keeps the first of duplicate entries in front
+static int db_md5_cmp(const void* a, const void* b) {
+	const db_md5_entry* x = (const db_md5_entry*)a;
+	const db_md5_entry* y = (const db_md5_entry*)b;
+	int res = memcmp(x->md5, y->md5, MD5_LENGTH);
+	return res ? res : (x->line > y->line) - (x->line < y->line);
+}
 
-	return CARTID_LENGTH;
+static int db_id_cmp(const void* a, const void* b) {
+	const db_id_entry* x = (const db_id_entry*)a;
+	const db_id_entry* y = (const db_id_entry*)b;
+	int res = memcmp(x->id, y->id, CARTID_LENGTH);
+	return res ? res : (x->line > y->line) - (x->line < y->line);
 }
 
-static uint8_t detect_rom_settings_in_db(const char* lookup_hash, const char* db_file_name) {
-	fileTextReader reader = {};
+static void db_append(std::vector<uint8_t>& data, const void* p, size_t len) {
+	data.insert(data.end(), (const uint8_t*)p, (const uint8_t*)p + len);
+}
 
-	char file_path[1024];
-	sprintf(file_path, "%s/%s", HomeDir(), db_file_name);
+static bool db_index_build(db_index* db, const char* file_path) {
+	fileTextReader reader = {};
+	if (!FileOpenTextReader(&reader, file_path)) return false;
 
-	if (!FileOpenTextReader(&reader, file_path)) {
-		printf("Failed to open N64 data file %s\n", file_path);
-		return 0;
-	}
+	std::vector<db_md5_entry> md5s;
+	std::vector<db_id_entry> ids, patterns;
+	std::vector<char> tags;
+	const auto prefix_len = strlen(CARTID_PREFIX);
 
+	uint32_t line_num = 0;
 	while (const char* line = FileReadLine(&reader)) {
-		// Skip the line if it doesn't start with our hash
-		if (!md5_matches(line, lookup_hash)) {
+		line_num++;
+
+		db_md5_entry m = {};
+		size_t i = 0;
+		for (; i < MD5_LENGTH * 2 && isxdigit(line[i]); i++) {
+			m.md5[i / 2] = (m.md5[i / 2] << 4) | hex_to_dec(line[i]);
+		}
+
+		if (i == MD5_LENGTH * 2) {
+			m.line = line_num;
+			m.tags = db_add_tags(tags, line + i);
+			md5s.push_back(m);
 			continue;
 		}
 
-		const char* s = line + (MD5_LENGTH * 2);
-		char* tags = new char[strlen(s) + 1];
-		if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
-			printf("Found ROM entry for MD5 [%s], but the tag was malformed! (%s)\n", lookup_hash, s);
-			return 2;
+		// A valid ID line should start with "ID:", '_' = don't care
+		if (strncmp(line, CARTID_PREFIX, prefix_len) != 0) continue;
+
+		db_id_entry e = {};
+		const char* lp = line + prefix_len;
+		for (i = 0; i < CARTID_LENGTH && *lp; i++, lp++) {
+			if (i && isspace(*lp)) break; // Early termination
+			e.id[i] = *lp;
+			if (*lp == '_') e.pattern = 1;
 		}
 
-		printf("Found ROM entry for MD5 [%s]: %s\n", lookup_hash, tags);
+		e.len = i;
+		e.line = line_num;
+		e.tags = (i < CARTID_LENGTH && !*lp) ? DB_NO_TAGS : db_add_tags(tags, lp);
+		if (e.len < CARTID_LENGTH) e.pattern = 1;
+		(e.pattern ? patterns : ids).push_back(e);
+	}
+
+	if (!md5s.empty()) qsort(md5s.data(), md5s.size(), sizeof(db_md5_entry), db_md5_cmp);
+	if (!ids.empty()) qsort(ids.data(), ids.size(), sizeof(db_id_entry), db_id_cmp);
+
+	db_index_header h = {};
+	h.magic = DB_INDEX_MAGIC;
+	h.path_len = strlen(db->path);
+	h.size = db->size;
+	h.mtime = db->mtime;
+	h.md5_num = md5s.size();
+	h.id_sorted = ids.size();
+	h.id_num = ids.size() + patterns.size();
+	h.tags_len = tags.size();
+
+	db->data.assign(db_align(sizeof(h) + h.path_len), 0);
+	memcpy(db->data.data(), &h, sizeof(h));
+	memcpy(db->data.data() + sizeof(h), db->path, h.path_len);
+
+	db_append(db->data, md5s.data(), md5s.size() * sizeof(db_md5_entry));
+	db_append(db->data, ids.data(), ids.size() * sizeof(db_id_entry));
+	db_append(db->data, patterns.data(), patterns.size() * sizeof(db_id_entry));
+	db_append(db->data, tags.data(), tags.size());
+	return db_index_setup(db);
+}
+
+static void db_index_file(const db_index* db, char* name, size_t size) {
+	uint32_t hash = 2166136261u;
+	for (const char* p = db->path; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	snprintf(name, size, "%s/" DB_INDEX_DIR "/%08X.idx", getRootDir(), hash);
+}
+
+static bool db_index_load(db_index* db) {
+	char name[1024];
+	db_index_file(db, name, sizeof(name));
+
+	FILE* fp = fopen(name, "rb");
+	if (!fp) return false;
 
-		// 2 = System region and/or CIC wasn't in DB, will need further detection
-		return parse_and_apply_db_tags(tags) ? 3 : 2;
+	db_index_header h = {};
+	size_t path_len = strlen(db->path);
+	bool ok = fread(&h, sizeof(h), 1, fp) == 1 && h.magic == DB_INDEX_MAGIC && h.size == db->size && h.mtime == db->mtime && h.path_len == path_len;
+
+	if (ok) {
+		size_t len = db_align(sizeof(h) + h.path_len) + (uint64_t)h.md5_num * sizeof(db_md5_entry) + (uint64_t)h.id_num * sizeof(db_id_entry) + h.tags_len;
+		db->data.resize(len);
+		memcpy(db->data.data(), &h, sizeof(h));
+		ok = fread(db->data.data() + sizeof(h), len - sizeof(h), 1, fp) == 1 && !memcmp(db->data.data() + sizeof(h), db->path, path_len) && db_index_setup(db);
 	}
 
-	return 0;
+	fclose(fp);
+	if (!ok) db->data.clear();
+	return ok;
 }
 
-static uint8_t detect_rom_settings_in_db_with_cartid(const char* cart_id, const char* db_file_name) {
-	fileTextReader reader = {};
+static void db_index_store(const db_index* db) {
+	FileCreatePath(DB_INDEX_DIR);
+
+	char* name = (char*)malloc(1024);
+	uint8_t* rec = (uint8_t*)malloc(db->data.size());
+	if (!name || !rec) {
+		free(name);
+		free(rec);
+		return;
+	}
+
+	size_t size = db->data.size();
+	memcpy(rec, db->data.data(), size);
+	db_index_file(db, name, 1024);
+
+	offload_add_work([rec, size, name] {
+		FILE* fp = fopen(name, "wb");
+		if (fp) {
+			bool ok = fwrite(rec, size, 1, fp) == 1;
+			if (fclose(fp) || !ok) remove(name);
+		}
+		free(rec);
+		free(name);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+static const db_index* db_index_get(size_t n) {
+	db_index* db = &db_indexes[n];
 
 	char file_path[1024];
-	sprintf(file_path, "%s/%s", HomeDir(), db_file_name);
+	sprintf(file_path, "%s/%s", HomeDir(), DB_FILE_NAMES[n]);
 
-	if (!FileOpenTextReader(&reader, file_path)) {
+	struct stat64* st = getPathStat(file_path);
+	if (!st) {
 		printf("Failed to open N64 data file %s\n", file_path);
-		return 0;
+		return nullptr;
 	}
 
-	size_t i;
+	uint64_t size = st->st_size, mtime = st->st_mtime;
+	const char* path = getFullPath(file_path);
+	if (db->hdr && !strcmp(db->path, path) && db->size == size && db->mtime == mtime) return db;
 
-	while (const char* line = FileReadLine(&reader)) {
-		// Skip lines that doesn't start with our ID
-		if (!(i = cart_id_is_match(line, cart_id))) continue;
-
-		auto s = line + strlen(CARTID_PREFIX) + i;
-		auto tags = new char[strlen(s) + 1];
-		if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
-			printf("Found ROM entry for ID [%s], but the tag was malformed! (%s)\n", cart_id, s);
-			return 2;
-		}
+	db->hdr = nullptr;
+	snprintf(db->path, sizeof(db->path), "%s", path);
+	db->size = size;
+	db->mtime = mtime;
+	if (db_index_load(db)) return db;
 
-		printf("Found ROM entry for ID [%s]: %s\n", cart_id, tags);
+	if (!db_index_build(db, file_path)) {
+		printf("Failed to open N64 data file %s\n", file_path);
+		db->hdr = nullptr;
+		db->data.clear();
+		return nullptr;
+	}
+
+	printf("Indexed %s: %u MD5s, %u IDs\n", file_path, db->hdr->md5_num, db->hdr->id_num);
+	db_index_store(db);
+	return db;
+}
 
-		// 2 = System region and/or CIC wasn't in DB, will need further detection
-		return parse_and_apply_db_tags(tags) ? 3 : 2;
+// 2 = System region and/or CIC wasn't in DB, will need further detection
+static uint8_t db_apply_tags(const db_index* db, uint32_t tags, const char* what, const char* key) {
+	if (tags == DB_NO_TAGS) {
+		printf("Found ROM entry for %s [%s], but the tag was malformed!\n", what, key);
+		return 2;
 	}
 
-	return 0;
+	std::vector<char> copy(db->tags + tags, db->tags + tags + strlen(db->tags + tags) + 1);
+	printf("Found ROM entry for %s [%s]: %s\n", what, key, copy.data());
+	return parse_and_apply_db_tags(copy.data()) ? 3 : 2;
 }
 
-static const char* DB_FILE_NAMES[] = {
-	"N64-database_user.txt",
-	"N64-database.txt"
-};
+static uint8_t detect_rom_settings_in_db(const char* lookup_hash, size_t n) {
+	const db_index* db = db_index_get(n);
+	if (!db) return 0;
+
+	db_md5_entry key = {};
+	for (size_t i = 0; i < MD5_LENGTH * 2; i++) {
+		if (!isxdigit(lookup_hash[i])) return 0;
+		key.md5[i / 2] = (key.md5[i / 2] << 4) | hex_to_dec(lookup_hash[i]);
+	}
+
+	// first entry not below the key
+	size_t lo = 0, hi = db->hdr->md5_num;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (memcmp(db->md5[mid].md5, key.md5, MD5_LENGTH) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+
+	if (lo == db->hdr->md5_num || memcmp(db->md5[lo].md5, key.md5, MD5_LENGTH)) return 0;
+	return db_apply_tags(db, db->md5[lo].tags, "MD5", lookup_hash);
+}
+
+static uint8_t detect_rom_settings_in_db_with_cartid(const char* cart_id, size_t n) {
+	const db_index* db = db_index_get(n);
+	if (!db) return 0;
+
+	const db_id_entry* found = nullptr;
+
+	size_t lo = 0, hi = db->hdr->id_sorted;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (memcmp(db->id[mid].id, cart_id, CARTID_LENGTH) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < db->hdr->id_sorted && !memcmp(db->id[lo].id, cart_id, CARTID_LENGTH)) found = &db->id[lo];
+
+	// a pattern on an earlier line takes precedence
+	for (size_t i = db->hdr->id_sorted; i < db->hdr->id_num; i++) {
+		const db_id_entry* e = &db->id[i];
+		if (found && e->line > found->line) break;
+
+		size_t c = 0;
+		while (c < e->len && (e->id[c] == '_' || e->id[c] == cart_id[c])) c++;
+		if (c == e->len) {
+			found = e;
+			break;
+		}
+	}
+
+	return found ? db_apply_tags(db, found->tags, "ID", cart_id) : 0;
+}
 
 static uint8_t detect_rom_settings_in_dbs_with_md5(const char* lookup_hash) {
 	uint8_t detected = 0;
 	for (auto i = 0U; i < (sizeof(DB_FILE_NAMES) / sizeof(*DB_FILE_NAMES)); i++) {
-		if ((detected = detect_rom_settings_in_db(lookup_hash, DB_FILE_NAMES[i]))) {
+		if ((detected = detect_rom_settings_in_db(lookup_hash, i))) {
 			break;
 		}
 	}
@@ -660,7 +916,7 @@ static uint8_t detect_rom_settings_in_dbs_with_cartid(const char* lookup_id) {
 
 	uint8_t detected = 0;
 	for (auto i = 0U; i < (sizeof(DB_FILE_NAMES) / sizeof(*DB_FILE_NAMES)); i++) {
-		if ((detected = detect_rom_settings_in_db_with_cartid(lookup_id, DB_FILE_NAMES[i]))) {
+		if ((detected = detect_rom_settings_in_db_with_cartid(lookup_id, i))) {
 			break;
 		}
 	}
@@ -963,7 +1219,8 @@ void n64_load_savedata(uint64_t lba, int ack, uint64_t &buffer_lba, uint8_t* buf
 		if (file->size)
 		{
 			diskled_on();
-			if (FileSeek(file, pos, SEEK_SET) && FileReadAdv(file, buffer, buffer_size)) {
+			// positional, so blocks held by save_write_delay are read from the cache
+			if (FileReadAt(file, pos, buffer, buffer_size, 0) > 0) {
 				// printf("Loaded save data, %u bytes from %s (%lld)\n", sz, file->name, pos);
 				done = 1;
 				buffer_lba = lba;
@@ -1018,15 +1275,15 @@ void n64_save_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buf
 	auto file = get_image(file_idx);
 	pos -= get_save_file_offset(file_idx);
 
+	// With save_write_delay this only updates the cached blocks of the file,
+	// EEPROM and FlashRAM bursts go out in one write once the game is done.
 	if (sz) {
 		diskled_on();
-		if (FileSeek(file, pos, SEEK_SET)) {
-			if ((save_files[file_idx].type == MemoryType::CPAK) || (save_files[file_idx].type == MemoryType::TPAK)) {
-				normalizeData(buffer, sz, DataFormat::LITTLE_ENDIAN);
-			}
-			if (!FileWriteAdv(file, buffer, sz)) {
-				printf("Failed to write save data! (%u bytes to %s at %lld)\n", sz, file->name, pos);
-			}
+		if ((save_files[file_idx].type == MemoryType::CPAK) || (save_files[file_idx].type == MemoryType::TPAK)) {
+			normalizeData(buffer, sz, DataFormat::LITTLE_ENDIAN);
+		}
+		if (FileWriteAt(file, pos, buffer, sz, 0) <= 0) {
+			log_rate(1000, LOGL_ERR, "Failed to write save data! (%u bytes to %s at %lld)\n", sz, file->name, pos);
 		}
 	}
 }
@@ -1043,8 +1300,25 @@ static void unmount_all_save_files()
 	mounted_save_files = 0;
 }
 
+// Runs on the read-ahead worker, so the byte order is fixed and the file
+// hashed next to the transfer. The format comes from the start of the file.
+struct RomFilter {
+	bool detected;
+	DataFormat format;
+};
+
+static void rom_filter(uint8_t* data, uint32_t len, void* arg) {
+	auto rf = (RomFilter*)arg;
+	if (!rf->detected) {
+		rf->format = (len >= 4) ? detectRomFormat(data) : DataFormat::UNKNOWN;
+		rf->detected = true;
+	}
+
+	normalizeData(data, len, rf->format);
+}
+
 int n64_rom_tx(const char *name, unsigned char idx) {
-	static uint8_t buf[4096];
+	uint8_t *buf;
 	fileTYPE f;
 
 	if (!FileOpen(&f, name, 1)) return 0;
@@ -1065,14 +1339,15 @@ int n64_rom_tx(const char *name, unsigned char idx) {
 
 	if ((idx & 0x3f) == 2) {
 		// Handle non-N64 files (GameBoy)
-		while (data_left) {
-			uint32_t chunk = (data_left > sizeof(buf)) ? sizeof(buf) : data_left;
-			FileReadAdv(&f, buf, chunk);
-
-			user_io_file_tx_data(buf, chunk);
+		{
+			fileReadAhead ra(&f, data_size, 4096);
+			uint32_t chunk;
+			while ((buf = ra.next(&chunk))) {
+				user_io_file_tx_data(buf, chunk);
 
-			if (use_progress) ProgressMessage("Loading", f.name, data_size - data_left, data_size);
-			data_left -= chunk;
+				if (use_progress) ProgressMessage("Loading", f.name, data_size - data_left, data_size);
+				data_left -= chunk;
+			}
 		}
 
 		printf("Done.\n");
@@ -1095,7 +1370,6 @@ int n64_rom_tx(const char *name, unsigned char idx) {
 	   2 = Found some ROM info in DB (Save type etc.), but System region and/or CIC has not been determined
 	   3 = Has detected everything, System type, CIC, Save type etc. */
 	uint8_t rom_settings_detected = 0;
-	DataFormat rom_format;
 	uint8_t md5[MD5_LENGTH];
 	char md5_hex[MD5_LENGTH * 2 + 1];
 	uint64_t bootcode_sums[2] = { };
@@ -1106,12 +1380,12 @@ int n64_rom_tx(const char *name, unsigned char idx) {
 
 	MD5Context ctx;
 	MD5Init(&ctx);
+	RomFilter rf = {};
 
-	while (data_left) {
-		size_t chunk = (data_left > sizeof(buf)) ? sizeof(buf) : data_left;
-
-		FileReadAdv(&f, buf, chunk);
-
+	// the next chunks are read, normalized and hashed while this one is sent
+	fileReadAhead ra(&f, data_size, 256 * 1024, -1, &ctx, rom_filter, &rf);
+	uint32_t chunk;
+	while ((buf = ra.next(&chunk))) {
 		// perform sanity checks and detect ROM format
 		if (is_first_chunk) {
 			if (chunk < 4096) {
@@ -1124,21 +1398,13 @@ int n64_rom_tx(const char *name, unsigned char idx) {
 				return 0;
 			}
 
-			rom_format = detectRomFormat(buf);
-		}
-
-		// normalize data to big-endian format
-		normalizeData(buf, chunk, rom_format);
-		MD5Update(&ctx, buf, chunk);
-
-		if (is_first_chunk) {
 			/* Try to detect ROM settings based on header MD5 hash.
-			   For calculating the MD5 hash of the header, we need to make a
-			   copy of the context before calling MD5Final, otherwise the file
-			   hash will be incorrect later on. */
+			   The worker hashes the whole file, the header (first 4096 bytes)
+			   gets a context of its own. */
 
 			MD5Context ctx_header;
-			memcpy(&ctx_header, &ctx, sizeof(struct MD5Context));
+			MD5Init(&ctx_header);
+			MD5Update(&ctx_header, buf, 4096);
 			MD5Final(md5, &ctx_header);
 			md5_to_hex(md5, md5_hex);
 			printf("Header MD5: %s\n", md5_hex);
@@ -1188,6 +1454,7 @@ int n64_rom_tx(const char *name, unsigned char idx) {
 		is_first_chunk = false;
 	}
 
+	// the reader is drained at the end, so the worker is done with ctx
 	MD5Final(md5, &ctx);
 	md5_to_hex(md5, md5_hex);
 	printf("File MD5: %s\n", md5_hex); 
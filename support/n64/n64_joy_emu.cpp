@@ -64,9 +64,17 @@ void n64_joy_emu(const int x, const int y, int* x2, int* y2, int max_cardinal, f
 	if (max_cardinal < MAX_CARDINAL) max_cardinal = MAX_CARDINAL;
 	if (max_range < MAX_DIST) max_range = MAX_DIST;
 
-	const float scale_cardinal = MAX_CARDINAL / (max_cardinal - OUTER_DEADZONE);
-	const float scale_range = MAX_DIST / (max_range - OUTER_DEADZONE);
-	const float scale = scale_cardinal > scale_range ? scale_cardinal : scale_range;
+	// the calibration only changes while it's still growing, keep the divisions out of every event
+	static int last_cardinal = 0;
+	static float last_range = 0, scale = 1.0f;
+	if (max_cardinal != last_cardinal || max_range != last_range)
+	{
+		last_cardinal = max_cardinal;
+		last_range = max_range;
+		const float scale_cardinal = MAX_CARDINAL / (max_cardinal - OUTER_DEADZONE);
+		const float scale_range = MAX_DIST / (max_range - OUTER_DEADZONE);
+		scale = scale_cardinal > scale_range ? scale_cardinal : scale_range;
+	}
 	const float scaled_x = abs_x * scale;
 	const float scaled_y = abs_y * scale;
 
@@ -5,6 +5,15 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <time.h>   // clock_gettime, CLOCK_REALTIME
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 #include "neogeo_loader.h"
 #include "neogeocd.h"
 #include "../../sxmlc.h"
@@ -13,6 +22,7 @@
 #include "../../osd.h"
 #include "../../menu.h"
 #include "../../shmem.h"
+#include "../../offload.h"
 
 struct NeoFile
 {
@@ -52,7 +62,28 @@ static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t siz
 	Out: FEDCBA9876 15432 0
 	*/
 
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+	// whole 32 word blocks: words 16-31 go to the even slots, 0-15 to the odd ones
+	uint32_t i = 0;
+#ifdef __ARM_NEON
+	for (; i + 32 <= size; i += 32)
+	{
+		uint16x8x2_t lo = { { vld1q_u16(buf_in + i + 16), vld1q_u16(buf_in + i) } };
+		uint16x8x2_t hi = { { vld1q_u16(buf_in + i + 24), vld1q_u16(buf_in + i + 8) } };
+		vst2q_u16(buf_out + i, lo);
+		vst2q_u16(buf_out + i + 16, hi);
+	}
+#else
+	for (; i + 32 <= size; i += 32)
+	{
+		for (uint32_t k = 0; k < 16; k++)
+		{
+			buf_out[i + k * 2] = buf_in[i + 16 + k];
+			buf_out[i + k * 2 + 1] = buf_in[i + k];
+		}
+	}
+#endif
+
+	for (; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
 
 	/*
 	0 <- 20
@@ -73,14 +104,56 @@ static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t siz
 	*/
 }
 
+// same as spr_convert, into every other word of buf_out. The output is uncached
+// memory shared with the other ROM of the pair, so it's never read back.
 static inline void spr_convert_skp(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
 {
-	for (uint32_t i = 0; i < size; i++) buf_out[i << 1] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+	uint32_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		uint16_t *out = buf_out + (i << 1);
+		for (uint32_t k = 0; k < 16; k++)
+		{
+			out[k * 4] = buf_in[i + 16 + k];
+			out[k * 4 + 2] = buf_in[i + k];
+		}
+	}
+
+	for (; i < size; i++) buf_out[i << 1] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
 }
 
+// both ROMs of the pair already interleaved: in 64 word blocks, the dwords
+// 16-31 go to the even slots and 0-15 to the odd ones, each with its words swapped.
 static inline void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
 {
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
+	uint32_t i = 0;
+#ifdef __ARM_NEON
+	for (; i + 64 <= size; i += 64)
+	{
+		const uint32_t *in = (const uint32_t*)(buf_in + i);
+		uint32_t *out = (uint32_t*)(buf_out + i);
+		for (int m = 0; m < 16; m += 4)
+		{
+			uint32x4x2_t v;
+			v.val[0] = vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(vld1q_u32(in + 16 + m))));
+			v.val[1] = vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(vld1q_u32(in + m))));
+			vst2q_u32(out + m * 2, v);
+		}
+	}
+#else
+	for (; i + 64 <= size; i += 64)
+	{
+		for (uint32_t m = 0; m < 16; m++)
+		{
+			buf_out[i + m * 4] = buf_in[i + 32 + m * 2 + 1];
+			buf_out[i + m * 4 + 1] = buf_in[i + 32 + m * 2];
+			buf_out[i + m * 4 + 2] = buf_in[i + m * 2 + 1];
+			buf_out[i + m * 4 + 3] = buf_in[i + m * 2];
+		}
+	}
+#endif
+
+	for (; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
 }
 
 static void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
@@ -133,8 +206,7 @@ static const char *get_name(const char *path, const char *name)
 static uint32_t neogeo_file_tx(const char* path, const char* name, uint8_t neo_file_type, uint8_t index, uint32_t offset, uint32_t size)
 {
 	fileTYPE f = {};
-	uint8_t buf[4096];	// Same in user_io_file_tx
-	uint8_t buf_out[4096];
+	alignas(4) uint8_t buf_out[4096];
 	static char name_buf[1024];
 
 	sprintf(name_buf, "%s/%s", path, name);
@@ -157,39 +229,42 @@ static uint32_t neogeo_file_tx(const char* path, const char* name, uint8_t neo_f
 	user_io_set_download(1);
 
 	ProgressMessage();
-	while (bytes2send)
-	{
-		uint16_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
-
-		FileReadAdv(&f, buf, chunk);
 
-		EnableFpga();
-		spi8(FIO_FILE_TX_DAT);
-
-		if (neo_file_type == NEO_FILE_RAW)
-		{
-			spi_write(buf, chunk, 1);
-		}
-		else if (neo_file_type == NEO_FILE_8BIT)
-		{
-			spi_write(buf, chunk, 0);
-		}
-		else
+	// converters work on whole buf_out sized blocks
+	{
+		fileReadAhead ra(&f, bytes2send, sizeof(buf_out));
+		uint8_t *buf;
+		uint32_t chunk;
+		while ((buf = ra.next(&chunk)))
 		{
-			if (neo_file_type == NEO_FILE_FIX) fix_convert(buf, buf_out, sizeof(buf_out));
-			else if (neo_file_type == NEO_FILE_SPR)
+			EnableFpga();
+			spi8(FIO_FILE_TX_DAT);
+
+			if (neo_file_type == NEO_FILE_RAW)
 			{
-				if (index == 15) spr_convert_dbl((uint16_t*)buf, (uint16_t*)buf_out, sizeof(buf_out)/2);
-				else spr_convert((uint16_t*)buf, (uint16_t*)buf_out, sizeof(buf_out)/2);
+				spi_write_t<1, 1>(buf, chunk);
 			}
+			else if (neo_file_type == NEO_FILE_8BIT)
+			{
+				spi_write_t<0, 1>(buf, chunk);
+			}
+			else
+			{
+				if (neo_file_type == NEO_FILE_FIX) fix_convert(buf, buf_out, sizeof(buf_out));
+				else if (neo_file_type == NEO_FILE_SPR)
+				{
+					if (index == 15) spr_convert_dbl((uint16_t*)buf, (uint16_t*)buf_out, sizeof(buf_out)/2);
+					else spr_convert((uint16_t*)buf, (uint16_t*)buf_out, sizeof(buf_out)/2);
+				}
 
-			spi_write(buf_out, chunk, 1);
-		}
+				spi_write_t<1, 1>(buf_out, chunk);
+			}
 
-		DisableFpga();
+			DisableFpga();
 
-		ProgressMessage("Loading", dispname, size - bytes2send, size);
-		bytes2send -= chunk;
+			ProgressMessage("Loading", dispname, size - bytes2send, size);
+			bytes2send -= chunk;
+		}
 	}
 
 	FileClose(&f);
@@ -213,6 +288,39 @@ static void make_path(const char *root, const char *name, char *path)
 	strcat(path, name);
 }
 
+// The DDR area of all the ROMs, mapped on first use and kept until the romset
+// is loaded, so parts cost no mmap/munmap. Areas outside of it, or a failed
+// map of the whole area, fall back to a mapping per part.
+#define NEO_DDR_BASE 0x30000000
+#define NEO_DDR_SIZE 0x10000000
+
+static uint8_t *neo_ddr = 0;
+static int neo_ddr_failed = 0;
+
+static void *neo_mem_map(uint32_t address, uint32_t size)
+{
+	if (address >= NEO_DDR_BASE && (uint64_t)address + size <= (uint64_t)NEO_DDR_BASE + NEO_DDR_SIZE && !neo_ddr_failed)
+	{
+		if (!neo_ddr) neo_ddr = (uint8_t*)shmem_map(NEO_DDR_BASE, NEO_DDR_SIZE);
+		if (neo_ddr) return neo_ddr + (address - NEO_DDR_BASE);
+		neo_ddr_failed = 1;
+	}
+
+	return shmem_map(address, size);
+}
+
+static void neo_mem_unmap(void *map, uint32_t size)
+{
+	if (!neo_ddr || (uint8_t*)map < neo_ddr || (uint8_t*)map >= neo_ddr + NEO_DDR_SIZE) shmem_unmap(map, size);
+}
+
+static void neo_mem_release()
+{
+	if (neo_ddr) shmem_unmap(neo_ddr, NEO_DDR_SIZE);
+	neo_ddr = 0;
+	neo_ddr_failed = 0;
+}
+
 extern uint8_t loadbuf[];
 static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t index, uint32_t offset, uint32_t size)
 {
@@ -239,39 +347,58 @@ static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t ind
 	uint32_t remain = size;
 	uint32_t map_addr = 0x38000000 + (((index - 64) >> 1) * 1024 * 1024);
 
+	int ok = 1;
 	ProgressMessage();
-	while (remain)
 	{
-		uint32_t partsz = remain;
-		if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
-
-		//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
-		void *base = shmem_map(map_addr, partsz);
-		if (!base)
+		// the worker reads the next part while this one is converted
+		fileReadAhead ra(&f, size / 2, LOADBUF_SZ / 2);
+		while (remain)
 		{
-			FileClose(&f);
-			return 0;
-		}
+			uint32_t partsz = remain;
+			if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
 
-		FileReadAdv(&f, loadbuf, partsz/2);
-		spr_convert_skp((uint16_t*)loadbuf, ((uint16_t*)base) + ((index ^ 1) & 1), partsz / 4);
+			//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
+			void *base = neo_mem_map(map_addr, partsz);
+			if (!base)
+			{
+				ok = 0;
+				break;
+			}
+
+			uint32_t len;
+			uint8_t *buf = ra.next(&len);
+			if (!buf) buf = loadbuf;
+			if (len < partsz / 2) memset(buf + len, 0, partsz / 2 - len);
+			spr_convert_skp((uint16_t*)buf, ((uint16_t*)base) + ((index ^ 1) & 1), partsz / 4);
 
-		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
+			ProgressMessage("Loading", dispname, size - (remain - partsz), size);
 
-		shmem_unmap(base, partsz);
-		remain -= partsz;
-		map_addr += partsz;
+			neo_mem_unmap(base, partsz);
+			remain -= partsz;
+			map_addr += partsz;
+		}
 	}
 
 	FileClose(&f);
 	ProgressMessage();
 
-	return map_addr - 0x38000000;
+	return ok ? map_addr - 0x38000000 : 0;
 }
 
+// swaps the middle bytes of every dword
 static inline void spr_bswap(uint32_t* buf, uint32_t size)
 {
-	for (uint32_t i = 0; i < size; i++) buf[i] = (buf[i] & 0xFF0000FF) | ((buf[i] & 0xFF00) << 8) | ((buf[i] & 0xFF0000) >> 8);
+	uint32_t i = 0;
+#ifdef __ARM_NEON
+	static const uint8_t order[8] = { 0, 2, 1, 3, 4, 6, 5, 7 };
+	uint8x8_t idx = vld1_u8(order);
+	for (; i + 2 <= size; i += 2)
+	{
+		uint8_t *p = (uint8_t*)(buf + i);
+		vst1_u8(p, vtbl1_u8(vld1_u8(p), idx));
+	}
+#endif
+	for (; i < size; i++) buf[i] = (buf[i] & 0xFF0000FF) | ((buf[i] & 0xFF00) << 8) | ((buf[i] & 0xFF0000) >> 8);
 }
 
 static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_file_type, uint8_t index, uint32_t offset, uint32_t size, uint32_t expand, int swap, uint32_t addr)
@@ -299,53 +426,72 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 
 	uint32_t map_addr = 0x30000000 + (addr ? (addr + 0x8000000) : ((index >= 16) && (index < 64)) ? (index - 16) * 0x80000 : (index == 9) ? 0x2000000 : 0x8000000);
 
+	// every part reads the same amount until the file ends, the rest of an expanded rom is filled
+	uint32_t partszf = remainf;
+	if (partszf > LOADBUF_SZ) partszf = LOADBUF_SZ;
+	uint32_t parts = (size + LOADBUF_SZ - 1) / LOADBUF_SZ;
+
+	int ok = 1;
 	ProgressMessage();
-	while (remain)
 	{
-		uint32_t partsz = remain;
-		if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
+		// the worker reads the next part while this one is converted
+		fileReadAhead ra(&f, partszf * parts, partszf ? partszf : 1);
+		while (remain)
+		{
+			uint32_t partsz = remain;
+			if (partsz > LOADBUF_SZ) partsz = LOADBUF_SZ;
 
-		uint32_t partszf = remainf;
-		if (partszf > LOADBUF_SZ) partszf = LOADBUF_SZ;
+			//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
+			void *base = neo_mem_map(map_addr, partsz);
+			if (!base)
+			{
+				ok = 0;
+				break;
+			}
 
-		//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
-		void *base = shmem_map(map_addr, partsz);
-		if (!base)
-		{
-			FileClose(&f);
-			return 0;
-		}
+			uint32_t len = 0;
+			uint8_t *buf = partszf ? ra.next(&len) : NULL;
 
-		if (neo_file_type == NEO_FILE_FIX)
-		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			fix_convert(loadbuf, (uint8_t*)base, partsz);
-		}
-		else if (neo_file_type == NEO_FILE_SPR)
-		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			if (swap) spr_bswap((uint32_t*)loadbuf, partsz / 4);
-			spr_convert_dbl((uint16_t*)loadbuf, (uint16_t*)base, partsz / 2);
-		}
-		else
-		{
-			memset(base, ((index>=16) && (index<64)) ? 8 : 0, partsz);
-			if (partszf) FileReadAdv(&f, base, partszf);
-		}
+			if (neo_file_type == NEO_FILE_FIX || neo_file_type == NEO_FILE_SPR)
+			{
+				// converters work on whole parts, a short one is padded in loadbuf
+				if (!buf || len < partsz)
+				{
+					memset(loadbuf, 0, partsz);
+					if (buf) memcpy(loadbuf, buf, len);
+					buf = loadbuf;
+				}
+
+				if (neo_file_type == NEO_FILE_FIX)
+				{
+					fix_convert(buf, (uint8_t*)base, partsz);
+				}
+				else
+				{
+					if (swap) spr_bswap((uint32_t*)buf, partsz / 4);
+					spr_convert_dbl((uint16_t*)buf, (uint16_t*)base, partsz / 2);
+				}
+			}
+			else
+			{
+				// each DDR byte written once, the padding after the data only
+				uint32_t n = buf ? ((len < partsz) ? len : partsz) : 0;
+				if (n) shmem_write(base, buf, n);
+				if (n < partsz) memset((uint8_t*)base + n, ((index>=16) && (index<64)) ? 8 : 0, partsz - n);
+			}
 
-		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
+			ProgressMessage("Loading", dispname, size - (remain - partsz), size);
 
-		shmem_unmap(base, partsz);
-		remain -= partsz;
-		map_addr += partsz;
+			neo_mem_unmap(base, partsz);
+			remain -= partsz;
+			map_addr += partsz;
+		}
 	}
 
 	FileClose(&f);
 	ProgressMessage();
 
-	return size;
+	return ok ? size : 0;
 }
 
 static uint32_t crom_sz_max = 0;
@@ -380,10 +526,10 @@ static void notify_core(uint8_t index, uint32_t size, uint32_t memcp_force = 0)
 
 static uint32_t fill_ram(uint32_t size, uint8_t pattern)
 {
-	void *base = shmem_map(0x38000000, size);
+	void *base = neo_mem_map(0x38000000, size);
 	if (!base) return 0;
 	memset(base, pattern, size);
-	shmem_unmap(base, size);
+	neo_mem_unmap(base, size);
 
 	notify_core(18, size, 1);
 	return 1;
@@ -543,19 +689,205 @@ static void parse_xml(const char* filename, const SAX_Callbacks* sax, void* user
 	}
 }
 
+// romsets.xml is read once per size/mtime. The table is kept in
+// CONFIG_DIR/neoindex so a restart doesn't parse it again, and every name
+// of every set is hashed for the per-entry lookups of neogeo_get_altname.
+#define ROMS_INDEX_MAGIC 0x3149474E // "NGI1"
+#define ROMS_INDEX_DIR   CONFIG_DIR "/neoindex"
+
+struct romsIndexHeader
+{
+	uint32_t magic;
+	uint32_t count;
+	uint32_t path_len;
+	uint32_t len;
+	uint64_t size;
+	uint64_t mtime;
+};
+
+static char roms_xml[1024] = {};
+static romsIndexHeader roms_key = {};
+
+// lower case name -> roms index, ROMS_NOT_FIRST if it's not the first name of its set
+#define ROMS_NOT_FIRST 0x80000000
+static std::unordered_map<std::string, uint32_t> roms_names;
+
+static std::string roms_lower(const char *str, size_t len)
+{
+	std::string res(str, len);
+	for (auto &c : res) c = tolower((uint8_t)c);
+	return res;
+}
+
+static void roms_hash()
+{
+	roms_names.clear();
+	roms_names.reserve(rom_cnt * 2);
+
+	for (uint32_t i = 0; i < rom_cnt; i++)
+	{
+		const char *name = roms[i].name;
+		if (name[0] != ',')
+		{
+			roms_names.emplace(roms_lower(name, strlen(name)), i);
+			continue;
+		}
+
+		// ",a,b,c," as matched by strcasestr, a cut off last name never matches
+		const char *p = name + 1;
+		const char *e;
+		while ((e = strchr(p, ',')))
+		{
+			roms_names.emplace(roms_lower(p, e - p), i | ((p == name + 1) ? 0 : ROMS_NOT_FIRST));
+			p = e + 1;
+		}
+	}
+}
+
+static void roms_index_name(const char *xml, char *name, int size)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *p = xml; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	snprintf(name, size, "%s/" ROMS_INDEX_DIR "/%08X.idx", getRootDir(), hash);
+}
+
+// records are the hide flag, name and altname, both NUL terminated
+static int roms_index_load(const char *xml, const romsIndexHeader *key)
+{
+	char name[1024];
+	roms_index_name(xml, name, sizeof(name));
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	int ok = 0;
+	romsIndexHeader h;
+	if (read(fd, &h, sizeof(h)) == sizeof(h) && h.magic == key->magic && h.path_len == key->path_len &&
+		h.size == key->size && h.mtime == key->mtime && h.count <= sizeof(roms) / sizeof(roms[0]))
+	{
+		std::string p(h.path_len, 0);
+		std::string data(h.len, 0);
+		if (read(fd, &p[0], h.path_len) == (ssize_t)h.path_len && p == xml && read(fd, &data[0], h.len) == (ssize_t)h.len)
+		{
+			const char *s = data.data();
+			const char *end = s + h.len;
+			uint32_t i = 0;
+			for (; i < h.count; i++)
+			{
+				rom_info *ri = &roms[i];
+				if (s >= end) break;
+				ri->hide = *s++;
+
+				size_t len = strnlen(s, end - s);
+				if (s + len >= end || len >= sizeof(ri->name)) break;
+				memcpy(ri->name, s, len + 1);
+				s += len + 1;
+
+				len = strnlen(s, end - s);
+				if (s + len >= end || len >= sizeof(ri->altname)) break;
+				memcpy(ri->altname, s, len + 1);
+				s += len + 1;
+			}
+
+			ok = (i == h.count);
+			rom_cnt = ok ? h.count : 0;
+		}
+	}
+	close(fd);
+	return ok;
+}
+
+static void roms_index_store(const char *xml, const romsIndexHeader *key)
+{
+	std::string data;
+	for (uint32_t i = 0; i < rom_cnt; i++)
+	{
+		data += roms[i].hide;
+		data.append(roms[i].name, strlen(roms[i].name) + 1);
+		data.append(roms[i].altname, strlen(roms[i].altname) + 1);
+	}
+
+	romsIndexHeader h = *key;
+	h.count = rom_cnt;
+	h.len = data.size();
+
+	size_t size = sizeof(h) + h.path_len + h.len;
+	uint8_t *rec = (uint8_t*)malloc(size);
+	char *name = (char*)malloc(1024);
+	if (!rec || !name)
+	{
+		free(rec);
+		free(name);
+		return;
+	}
+
+	memcpy(rec, &h, sizeof(h));
+	memcpy(rec + sizeof(h), xml, h.path_len);
+	memcpy(rec + sizeof(h) + h.path_len, data.data(), h.len);
+	roms_index_name(xml, name, 1024);
+
+	offload_add_work([rec, size, name]
+	{
+		char *p = strrchr(name, '/');
+		*p = 0;
+		mkdir(name, S_IRWXU | S_IRWXG | S_IRWXO);
+		*p = '/';
+
+		int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (fd >= 0)
+		{
+			if (write(fd, rec, size) != (ssize_t)size) unlink(name);
+			close(fd);
+		}
+		free(rec);
+		free(name);
+	}, OFFLOAD_PRIO_BULK);
+}
+
 int neogeo_scan_xml(char *path)
 {
 	static char full_path[1024];
 	sprintf(full_path, "%s/romsets.xml", path);
 	if(!FileExists(full_path)) sprintf(full_path, "%s/%s/romsets.xml", getRootDir(), HomeDir());
 
-	SAX_Callbacks sax;
-	SAX_Callbacks_init(&sax);
+	romsIndexHeader key = {};
+	struct stat64 *st = getPathStat(full_path);
+	if (st)
+	{
+		key.magic = ROMS_INDEX_MAGIC;
+		key.size = st->st_size;
+		key.mtime = st->st_mtime;
+	}
+
+	// parse_xml reuses the getFullPath buffer
+	std::string xml_path = getFullPath(full_path);
+	const char *xml = xml_path.c_str();
+	key.path_len = xml_path.size();
+
+	// same file as for the last folder
+	if (st && !strcmp(roms_xml, xml) && key.size == roms_key.size && key.mtime == roms_key.mtime) return rom_cnt;
 
-	memset(roms, 0, sizeof(roms));
+	roms_xml[0] = 0;
 	rom_cnt = 0;
-	sax.all_event = xml_scan;
-	parse_xml(full_path, &sax, 0);
+	if (!st || !roms_index_load(xml, &key))
+	{
+		SAX_Callbacks sax;
+		SAX_Callbacks_init(&sax);
+
+		memset(roms, 0, sizeof(roms));
+		rom_cnt = 0;
+		sax.all_event = xml_scan;
+		parse_xml(full_path, &sax, 0);
+
+		if (st && rom_cnt) roms_index_store(xml, &key);
+	}
+
+	roms_hash();
+	if (st)
+	{
+		snprintf(roms_xml, sizeof(roms_xml), "%s", xml);
+		roms_key = key;
+	}
 	return rom_cnt;
 }
 
@@ -598,28 +930,15 @@ char *neogeo_get_altname(char *path, char *name, char *altname)
 		if (*altname) return altname;
 	}
 
-	sprintf(full_path, ",%s,", altname);
-	for (uint32_t i = 0; i < rom_cnt; i++)
-	{
-		if (roms[i].name[0] == ',')
-		{
-			char *p = strcasestr(roms[i].name, full_path);
-			if (p)
-			{
-				if (roms[i].hide) return (char*)-1;
-				if(p == roms[i].name) return roms[i].altname;
+	auto it = roms_names.find(roms_lower(altname, strlen(altname)));
+	if (it == roms_names.end()) return NULL;
 
-				sprintf(full_path, "%s (%s)", roms[i].altname, altname);
-				return full_path;
-			}
-		}
-		else if (!strcasecmp(altname, roms[i].name))
-		{
-			if (roms[i].hide) return (char*)-1;
-			return roms[i].altname;
-		}
-	}
-	return NULL;
+	rom_info *ri = &roms[it->second & ~ROMS_NOT_FIRST];
+	if (ri->hide) return (char*)-1;
+	if (!(it->second & ROMS_NOT_FIRST)) return ri->altname;
+
+	sprintf(full_path, "%s (%s)", ri->altname, altname);
+	return full_path;
 }
 
 static int has_name(const char *nameset, const char *name)
@@ -654,6 +973,33 @@ static const char* get_romset(const char *path)
 	return romset;
 }
 
+// Listings of the folders (or zips) the files of a romset are in, one read per
+// folder answers all of its files. A name not in the listing is still asked
+// for, the listing is exact while FileExists may not care for the case.
+static std::unordered_map<std::string, std::unordered_set<std::string>> check_dirs;
+
+static void check_dir_add(const char *name, void *arg)
+{
+	((std::unordered_set<std::string>*)arg)->insert(name);
+}
+
+static int check_file(const char *full_path)
+{
+	const char *p = strrchr(full_path, '/');
+	if (p)
+	{
+		std::string dir(full_path, p - full_path);
+		auto it = check_dirs.find(dir);
+		if (it == check_dirs.end())
+		{
+			it = check_dirs.emplace(dir, std::unordered_set<std::string>()).first;
+			FileListNames(dir.c_str(), check_dir_add, &it->second);
+		}
+		if (it->second.count(p + 1)) return 1;
+	}
+	return FileExists(full_path);
+}
+
 static int checked_ok;
 static int romsets = 0;
 static int xml_check_files(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
@@ -695,7 +1041,7 @@ static int xml_check_files(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, c
 					if (!strcasecmp(node->attributes[i].name, "name"))
 					{
 						make_path(path, node->attributes[i].value, full_path);
-						if (FileExists(full_path))
+						if (check_file(full_path))
 						{
 							printf("Found %s\n", full_path);
 							break;
@@ -1208,7 +1554,12 @@ int neogeo_romset_tx(char* name, int cd_en)
 			{
 				sax.all_event = xml_check_files;
 				parse_xml(full_path, &sax, name);
-				if (!checked_ok) return 0;
+				check_dirs.clear();
+				if (!checked_ok)
+				{
+					neo_mem_release();
+					return 0;
+				}
 			}
 
 			romsets = 0;
@@ -1268,6 +1619,8 @@ int neogeo_romset_tx(char* name, int cd_en)
 
 	notify_conf();
 
+	neo_mem_release();
+
 	FileGenerateSavePath(name, (char*)full_path);
 	user_io_file_mount((char*)full_path, 0, 1);
 
@@ -9,6 +9,7 @@
 #include "../../spi.h"
 #include "../../hardware.h"
 #include "../../menu.h"
+#include "../../log.h"
 #include "pcecd.h"
 
 
@@ -75,7 +76,7 @@ void pcecd_poll()
 		case 1:
 			//TODO: process data
 			pcecdd.SendStatus(0);
-			printf("\x1b[32mPCECD: Command MODESELECT6, received data\n\x1b[0m");
+			log_info("\x1b[32mPCECD: Command MODESELECT6, received data\n\x1b[0m");
 			break;
 
 		case 2:
@@ -97,7 +98,7 @@ void pcecd_poll()
 		need_reset = 0;
 		pcecdd.Reset();
 		poll_timer = 0;
-		printf("\x1b[32mPCECD: Reset\n\x1b[0m");
+		log_info("\x1b[32mPCECD: Reset\n\x1b[0m");
 	}
 
 }
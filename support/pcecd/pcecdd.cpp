@@ -6,6 +6,7 @@
 
 #include "../../file_io.h"
 #include "../../user_io.h"
+#include "../../log.h"
 
 #include "../chd/mister_chd.h"
 #include "pcecd.h"
@@ -16,6 +17,9 @@ float get_cd_seek_ms(int start_sector, int target_sector);
 
 pcecdd_t pcecdd;
 
+// PCE CD games play CD audio nearly all the time, it's read ahead in the background
+static cd_audio_t pcecd_audio;
+
 pcecdd_t::pcecdd_t() {
 	latency = 0;
 	audiodelay = 0;
@@ -40,85 +44,29 @@ pcecdd_t::pcecdd_t() {
 
 }
 
-static int sgets(char *out, int sz, char **in)
-{
-	*out = 0;
-	do
-	{
-		char *instr = *in;
-		int cnt = 0;
-
-		while (*instr && *instr != 10)
-		{
-			if (*instr == 13)
-			{
-				instr++;
-				continue;
-			}
-
-			if (cnt < sz - 1)
-			{
-				out[cnt++] = *instr;
-				out[cnt] = 0;
-			}
-
-			instr++;
-		}
-
-		if(*instr == 10) instr++;
-		*in = instr;
-	}
-	while (!*out && **in);
-
-	return *out;
-}
-
 int pcecdd_t::LoadCUE(const char* filename) {
 	static char fname[1024 + 10];
-	static char line[128];
-	char *ptr, *lptr;
-	static char toc[100 * 1024];
+	static cue_sheet_t cue;
 	int hdr = 0;
 
 	strcpy(fname, filename);
 
-	memset(toc, 0, sizeof(toc));
-	if (!FileLoad(fname, toc, sizeof(toc) - 1)) return 1;
+	if (!cd_cue_parse(fname, &cue)) return 1;
 
 	printf("\x1b[32mPCECD: Open CUE: %s\n\x1b[0m", fname);
 
-	int mm, ss, bb, pregap = 0;
+	int pregap = 0;
 
-	char *buf = toc;
-	while (sgets(line, sizeof(line), &buf))
+	for (int n = 0; n < cue.cmds; n++)
 	{
-		lptr = line;
-		while (*lptr == 0x20) lptr++;
+		const cue_cmd_t *c = &cue.cmd[n];
 
 		/* decode FILE commands */
-		if (!(memcmp(lptr, "FILE", 4)))
+		if (c->cmd == CUE_FILE)
 		{
-			ptr = fname + strlen(fname) - 1;
-			while ((ptr - fname) && (*ptr != '/') && (*ptr != '\\')) ptr--;
-			if (ptr - fname) ptr++;
+			cd_cue_file(&cue, c, fname, 1024);
 
-			lptr += 4;
-			while (*lptr == 0x20) lptr++;
-
-			if (*lptr == '\"')
-			{
-				lptr++;
-				while ((*lptr != '\"') && (lptr <= (line + 128)) && (ptr < (fname + 1023)))
-					*ptr++ = *lptr++;
-			}
-			else
-			{
-				while ((*lptr != 0x20) && (lptr <= (line + 128)) && (ptr < (fname + 1023)))
-					*ptr++ = *lptr++;
-			}
-			*ptr = 0;
-
-			if(!FileOpen(&this->toc.tracks[this->toc.last].f, fname)) return -1;
+			if(!cd_open_track(&this->toc.tracks[this->toc.last].f, fname)) return -1;
 
 			printf("\x1b[32mPCECD: Open track file: %s\n\x1b[0m", fname);
 
@@ -129,7 +77,7 @@ int pcecdd_t::LoadCUE(const char* filename) {
 
 			this->toc.tracks[this->toc.last].offset = 0;
 
-			if (!strstr(lptr, "BINARY") && !strstr(lptr, "MOTOROLA") && !strstr(lptr, "WAVE"))
+			if (c->type == CUE_FILE_OTHER)
 			{
 				FileClose(&this->toc.tracks[this->toc.last].f);
 				printf("\x1b[32mPCECD: unsupported file: %s\n\x1b[0m", fname);
@@ -139,9 +87,9 @@ int pcecdd_t::LoadCUE(const char* filename) {
 		}
 
 		/* decode TRACK commands */
-		else if ((sscanf(lptr, "TRACK %02d %*s", &bb)) || (sscanf(lptr, "TRACK %d %*s", &bb)))
+		else if (c->cmd == CUE_TRACK)
 		{
-			if (bb != (this->toc.last + 1))
+			if (c->num != (this->toc.last + 1))
 			{
 				FileClose(&this->toc.tracks[this->toc.last].f);
 				printf("\x1b[32mPCECD: missing tracks: %s\n\x1b[0m", fname);
@@ -150,19 +98,19 @@ int pcecdd_t::LoadCUE(const char* filename) {
 
 			//if (!this->toc.last)
 			{
-				if (strstr(lptr, "MODE1/2048"))
+				if (c->type == CUE_MODE1_2048)
 				{
 					this->toc.tracks[this->toc.last].sector_size = 2048;
 					this->toc.tracks[this->toc.last].type = 1;
 				}
-				else if (strstr(lptr, "MODE1/2352"))
+				else if (c->type == CUE_MODE1_2352)
 				{
 					this->toc.tracks[this->toc.last].sector_size = 2352;
 					this->toc.tracks[this->toc.last].type = 1;
 
 					FileSeek(&this->toc.tracks[this->toc.last].f, 0x10, SEEK_SET);
 				}
-				else if (strstr(lptr, "AUDIO"))
+				else if (c->type == CUE_AUDIO)
 				{
 					this->toc.tracks[this->toc.last].sector_size = 2352;
 					this->toc.tracks[this->toc.last].type = 0;
@@ -189,27 +137,25 @@ int pcecdd_t::LoadCUE(const char* filename) {
 		}
 
 		/* decode PREGAP commands */
-		else if (sscanf(lptr, "PREGAP %02d:%02d:%02d", &mm, &ss, &bb) == 3)
+		else if (c->cmd == CUE_PREGAP && c->frames >= 0)
 		{
-			pregap += bb + ss * 75 + mm * 60 * 75;
+			pregap += c->frames;
 		}
 
 		/* decode INDEX commands */
-		else if ((sscanf(lptr, "INDEX 00 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
-			(sscanf(lptr, "INDEX 0 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
+		else if (c->cmd == CUE_INDEX && c->num == 0 && c->frames >= 0)
 		{
 			if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
 			{
-				this->toc.tracks[this->toc.last - 1].end = bb + ss * 75 + mm * 60 * 75 + pregap;
+				this->toc.tracks[this->toc.last - 1].end = c->frames + pregap;
 			}
 		}
-		else if ((sscanf(lptr, "INDEX 01 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
-			(sscanf(lptr, "INDEX 1 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
+		else if (c->cmd == CUE_INDEX && c->num == 1 && c->frames >= 0)
 		{
 			if (!this->toc.tracks[this->toc.last].f.opened())
 			{
-				FileOpen(&this->toc.tracks[this->toc.last].f, fname);
-				this->toc.tracks[this->toc.last].start = bb + ss * 75 + mm * 60 * 75 + pregap;
+				cd_open_track(&this->toc.tracks[this->toc.last].f, fname);
+				this->toc.tracks[this->toc.last].start = c->frames + pregap;
 				this->toc.tracks[this->toc.last].offset = (pregap * this->toc.tracks[this->toc.last].sector_size) - hdr;
 				if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
 				{
@@ -224,7 +170,7 @@ int pcecdd_t::LoadCUE(const char* filename) {
 				this->toc.tracks[this->toc.last].offset = (this->toc.tracks[this->toc.last].start * this->toc.tracks[this->toc.last].sector_size) - hdr;
 				this->toc.tracks[this->toc.last].end = this->toc.tracks[this->toc.last].start + ((this->toc.tracks[this->toc.last].f.size - hdr + this->toc.tracks[this->toc.last].sector_size - 1) / this->toc.tracks[this->toc.last].sector_size);
 
-				this->toc.tracks[this->toc.last].start += (bb + ss * 75 + mm * 60 * 75);
+				this->toc.tracks[this->toc.last].start += c->frames;
 				this->toc.end = this->toc.tracks[this->toc.last].end;
 			}
 
@@ -258,14 +204,6 @@ int pcecdd_t::Load(const char *filename)
 		if (LoadCUE(filename)) return -1;
 	} else if (!strncasecmp(".chd", ext, 4)) {
 		mister_load_chd(filename, &this->toc);
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(CD_FRAME_SIZE * CD_FRAMES_PER_HUNK);	
-		this->chd_hunknum = -1;
 	} else {
 		return -1;
 	}
@@ -273,6 +211,7 @@ int pcecdd_t::Load(const char *filename)
 	if (this->toc.last)
 	{
 		this->toc.tracks[this->toc.last].start = this->toc.end;
+		cd_preload(&this->toc);
 		this->loaded = 1;
 
 		//memcpy(&fname[strlen(fname) - 4], ".sub", 4);
@@ -289,16 +228,12 @@ void pcecdd_t::Unload()
 {
 	if (this->loaded)
 	{
+		cd_audio_drop(&pcecd_audio);
+
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
+			mister_chd_close(this->toc.chd_f);
 			this->toc.chd_f = NULL;
-			if (this->chd_hunkbuf)
-			{
-				free(this->chd_hunkbuf);
-				this->chd_hunkbuf = NULL;
-				this->chd_hunknum = -1;
-			}
 		} else {
 			for (int i = 0; i < this->toc.last; i++)
 			{
@@ -424,10 +359,6 @@ void pcecdd_t::Update() {
 		{
 			if (!this->toc.tracks[this->index].type)
 			{
-				if (this->toc.tracks[this->index].f.opened()) 
-				{
-					FileSeek(&this->toc.tracks[index].f, (this->lba * 2352) - this->toc.tracks[index].offset, SEEK_SET);
-				}
 				sec_buf[0] = 0x30;
 				sec_buf[1] = 0x09;
 				ReadCDDA(sec_buf + 2);
@@ -455,7 +386,7 @@ void pcecdd_t::Update() {
 				SendStatus(MAKE_STATUS(PCECD_STATUS_GOOD, 0));
 			}
 
-			printf("\x1b[32mPCECD: playback reached the end %d\n\x1b[0m", this->lba);
+			log_info("\x1b[32mPCECD: playback reached the end %d\n\x1b[0m", this->lba);
 		}
 	}
 	else if (this->state == PCECD_STATE_PAUSE)
@@ -505,7 +436,7 @@ void pcecdd_t::CommandExec() {
 		if (SendData)
 			SendData(buf, 18 + 2, PCECD_DATA_IO_INDEX);
 
-		printf("\x1b[32mPCECD: Command REQUESTSENSE, key = %02X, asc = %02X, ascq = %02X, fru = %02X\n\x1b[0m", sense.key, sense.asc, sense.ascq, sense.fru);
+		log_info("\x1b[32mPCECD: Command REQUESTSENSE, key = %02X, asc = %02X, ascq = %02X, fru = %02X\n\x1b[0m", sense.key, sense.asc, sense.ascq, sense.fru);
 
 		SendStatus(MAKE_STATUS(PCECD_STATUS_GOOD, 0));
 
@@ -556,9 +487,9 @@ void pcecdd_t::CommandExec() {
 		if (SendData && len)
 			SendData(buf, len, PCECD_DATA_IO_INDEX);
 
-		printf("\x1b[32mPCECD: Command GETDIRINFO, [1] = %02X, [2] = %02X(%d)\n\x1b[0m", comm[1], comm[2], comm[2]);
+		log_info("\x1b[32mPCECD: Command GETDIRINFO, [1] = %02X, [2] = %02X(%d)\n\x1b[0m", comm[1], comm[2], comm[2]);
 
-		printf("\x1b[32mPCECD: Send data, len = %u, [2] = %02X, [3] = %02X, [4] = %02X, [5] = %02X\n\x1b[0m", len, buf[2], buf[3], buf[4], buf[5]);
+		log_info("\x1b[32mPCECD: Send data, len = %u, [2] = %02X, [3] = %02X, [4] = %02X, [5] = %02X\n\x1b[0m", len, buf[2], buf[3], buf[4], buf[5]);
 
 		SendStatus(MAKE_STATUS(PCECD_STATUS_GOOD, 0));
 	}
@@ -593,7 +524,7 @@ void pcecdd_t::CommandExec() {
 			this->latency = (int)(get_cd_seek_ms(this->lba, new_lba)/13.33);
 			this->audiodelay = 0;
 		}
-		printf("seek time ticks: %d\n", this->latency);
+		log_info("seek time ticks: %d\n", this->latency);
 
 		this->lba = new_lba;
 		this->cnt = cnt_;
@@ -609,12 +540,12 @@ void pcecdd_t::CommandExec() {
 		this->can_read_next = true;
 		this->state = PCECD_STATE_READ;
 
-		printf("\x1b[32mPCECD: Command READ6, lba = %u, cnt = %u\n\x1b[0m", this->lba, this->cnt);
+		log_info("\x1b[32mPCECD: Command READ6, lba = %u, cnt = %u\n\x1b[0m", this->lba, this->cnt);
 	}
 		break;
 
 	case PCECD_COMM_MODESELECT6:
-		printf("\x1b[32mPCECD: Command MODESELECT6, cnt = %u\n\x1b[0m", comm[4]);
+		log_info("\x1b[32mPCECD: Command MODESELECT6, cnt = %u\n\x1b[0m", comm[4]);
 
 		if (comm[4]) {
 			data_req = true;
@@ -668,7 +599,7 @@ void pcecdd_t::CommandExec() {
 			}
 		}
 
-		printf("seek time ticks: %d\n", this->latency);
+		log_info("seek time ticks: %d\n", this->latency);
 
 		this->lba = new_lba;
 		int index = GetTrackByLBA(new_lba, &this->toc);
@@ -689,7 +620,7 @@ void pcecdd_t::CommandExec() {
 
 		PendStatus(MAKE_STATUS(PCECD_STATUS_GOOD, 0));
 	}
-		printf("\x1b[32mPCECD: Command SAPSP, start = %d, end = %d, [1] = %02X, [2] = %02X, [9] = %02X\n\x1b[0m", this->CDDAStart, this->CDDAEnd, comm[1], comm[2], comm[9]);
+		log_info("\x1b[32mPCECD: Command SAPSP, start = %d, end = %d, [1] = %02X, [2] = %02X, [9] = %02X\n\x1b[0m", this->CDDAStart, this->CDDAEnd, comm[1], comm[2], comm[9]);
 		break;
 
 	case PCECD_COMM_SAPEP: {
@@ -731,7 +662,7 @@ void pcecdd_t::CommandExec() {
 			SendStatus(MAKE_STATUS(PCECD_STATUS_GOOD, 0));
 		}
 
-		printf("\x1b[32mPCECD: Command SAPEP, end = %i, [1] = %02X, [2] = %02X, [9] = %02X\n\x1b[0m", this->CDDAEnd, comm[1], comm[2], comm[9]);
+		log_info("\x1b[32mPCECD: Command SAPEP, end = %i, [1] = %02X, [2] = %02X, [9] = %02X\n\x1b[0m", this->CDDAEnd, comm[1], comm[2], comm[9]);
 	}
 		break;
 
@@ -740,7 +671,7 @@ void pcecdd_t::CommandExec() {
 
 		SendStatus(MAKE_STATUS(PCECD_STATUS_GOOD, 0));
 	}
-		printf("\x1b[32mPCECD: Command PAUSE, current lba = %i\n\x1b[0m", this->lba);
+		log_info("\x1b[32mPCECD: Command PAUSE, current lba = %i\n\x1b[0m", this->lba);
 		break;
 
 	case PCECD_COMM_READSUBQ: {
@@ -775,7 +706,7 @@ void pcecdd_t::CommandExec() {
 	default:
 		CommandError(SENSEKEY_ILLEGAL_REQUEST, NSE_INVALID_COMMAND, 0, 0);
 
-		printf("\x1b[32mPCECD: Command undefined, [0] = %02X, [1] = %02X, [2] = %02X, [3] = %02X, [4] = %02X, [5] = %02X\n\x1b[0m", comm[0], comm[1], comm[2], comm[3], comm[4], comm[5]);
+		log_info("\x1b[32mPCECD: Command undefined, [0] = %02X, [1] = %02X, [2] = %02X, [3] = %02X, [4] = %02X, [5] = %02X\n\x1b[0m", comm[0], comm[1], comm[2], comm[3], comm[4], comm[5]);
 		
 		has_status = 0;
 		SendStatus(MAKE_STATUS(PCECD_STATUS_CHECK_COND, 0));
@@ -815,7 +746,7 @@ void pcecdd_t::SendDataRequest() {
 	spi_w((region ? 2 : 0) | 1);
 	DisableIO();
 
-	printf("\x1b[32mPCECD: Data request for MODESELECT6\n\x1b[0m");
+	log_info("\x1b[32mPCECD: Data request for MODESELECT6\n\x1b[0m");
 }
 
 void pcecdd_t::SetRegion(uint8_t rgn) {
@@ -844,6 +775,8 @@ int pcecdd_t::GetTrackByLBA(int lba, toc_t* toc) {
 
 void pcecdd_t::ReadData(uint8_t *buf)
 {
+	cd_trace(CD_TRACE_PCECD, this->lba, 1);
+
 	if (this->toc.tracks[this->index].type && (this->lba >= 0))
 	{
 		if (this->toc.chd_f)
@@ -854,7 +787,7 @@ void pcecdd_t::ReadData(uint8_t *buf)
 				s_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, s_offset, 2048, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, s_offset, 2048, buf);
 		} else {
 			if (this->toc.tracks[this->index].sector_size == 2048)
 			{
@@ -873,18 +806,7 @@ int pcecdd_t::ReadCDDA(uint8_t *buf)
 	this->audioOffset = 0;// 2352;
 
 
-	if (this->toc.chd_f)
-	{
-		mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, 0, this->audioLength, buf, this->chd_hunkbuf, &this->chd_hunknum);
-		for (int swapidx = 0; swapidx < this->audioLength; swapidx += 2)
-		{
-			uint8_t temp = buf[swapidx];
-			buf[swapidx] = buf[swapidx+1];
-			buf[swapidx+1] = temp;
-		}
-	} else if (this->toc.tracks[this->index].f.opened()) {
-		FileReadAdv(&this->toc.tracks[this->index].f, buf, this->audioLength);
-	}
+	cd_audio_read(&pcecd_audio, &this->toc, this->lba, this->CDDAEnd + 1, buf);
 
 	return this->audioLength;
 }
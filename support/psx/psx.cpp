@@ -9,6 +9,7 @@
 #include "../../spi.h"
 #include "../../hardware.h"
 #include "../../menu.h"
+#include "../../log.h"
 #include "psx.h"
 #include "mcdheader.h"
 #include "../../cd.h"
@@ -16,40 +17,6 @@
 #include <libchdr/chd.h>
 
 static char buf[1024];
-static uint8_t chd_hunkbuf[CD_FRAME_SIZE * CD_FRAMES_PER_HUNK];
-static int chd_hunknum;
-
-static int sgets(char *out, int sz, char **in)
-{
-	*out = 0;
-	do
-	{
-		char *instr = *in;
-		int cnt = 0;
-
-		while (*instr && *instr != 10)
-		{
-			if (*instr == 13)
-			{
-				instr++;
-				continue;
-			}
-
-			if (cnt < sz - 1)
-			{
-				out[cnt++] = *instr;
-				out[cnt] = 0;
-			}
-
-			instr++;
-		}
-
-		if (*instr == 10) instr++;
-		*in = instr;
-	} while (!*out && **in);
-
-	return *out;
-}
 
 static uint32_t libCryptSectors[16] =
 {
@@ -106,11 +73,9 @@ static void unload_chd(toc_t *table)
 {
 	if (table->chd_f)
 	{
-		chd_close(table->chd_f);
+		mister_chd_close(table->chd_f);
 	}
-	memset(chd_hunkbuf, 0, sizeof(chd_hunkbuf));
 	memset(table, 0, sizeof(toc_t));
-	chd_hunknum = -1;
 
 }
 
@@ -154,70 +119,44 @@ static int load_chd(const char *filename, toc_t *table)
 
 	table->end = table->tracks[table->last - 1].end + 1;
 
-	memset(chd_hunkbuf, 0, sizeof(chd_hunkbuf));
-	chd_hunknum = -1;
-
 	return 1;
 }
 
 static int load_cue(const char* filename, toc_t *table)
 {
 	static char fname[1024 + 10];
-	static char line[128];
-	char *ptr, *lptr;
-	static char toc[100 * 1024];
+	static cue_sheet_t cue;
 
 	unload_cue(table);
 	printf("\x1b[32mPSX: Open CUE: %s\n\x1b[0m", fname);
 
 	strcpy(fname, filename);
 
-	memset(toc, 0, sizeof(toc));
-	if (!FileLoad(fname, toc, sizeof(toc) - 1))
+	if (!cd_cue_parse(fname, &cue))
 	{
 		printf("\x1b[32mPSX: cannot load file: %s\n\x1b[0m", fname);
 		return 0;
 	}
 
-	int mm, ss, bb;
 	int pregap = 0;
 
-	char *buf = toc;
-	while (sgets(line, sizeof(line), &buf))
+	for (int n = 0; n < cue.cmds; n++)
 	{
-		lptr = line;
-		while (*lptr == 0x20) lptr++;
+		const cue_cmd_t *c = &cue.cmd[n];
 
 		/* decode FILE commands */
-		if (!(memcmp(lptr, "FILE", 4)))
+		if (c->cmd == CUE_FILE)
 		{
-			ptr = fname + strlen(fname) - 1;
-			while ((ptr - fname) && (*ptr != '/') && (*ptr != '\\')) ptr--;
-			if (ptr - fname) ptr++;
-
-			lptr += 4;
-			while (*lptr == 0x20) lptr++;
+			cd_cue_file(&cue, c, fname, 1024);
 
-			if (*lptr == '\"')
-			{
-				lptr++;
-				while ((*lptr != '\"') && (lptr <= (line + 128)) && (ptr < (fname + 1023)))
-					*ptr++ = *lptr++;
-			}
-			else
-			{
-				while ((*lptr != 0x20) && (lptr <= (line + 128)) && (ptr < (fname + 1023)))
-					*ptr++ = *lptr++;
-			}
-			*ptr = 0;
-
-			if (!FileOpen(&table->tracks[table->last].f, fname)) return 0;
+			if (!cd_open_track(&table->tracks[table->last].f, fname)) return 0;
 
 			printf("\x1b[32mPSX: Open track file: %s\n\x1b[0m", fname);
 
 			table->tracks[table->last].offset = 0;
 
-			if (!strstr(lptr, "BINARY"))
+			// decoded audio tracks are listed as WAVE
+			if (c->type != CUE_BINARY && !(c->type == CUE_WAVE && table->tracks[table->last].f.src))
 			{
 				FileClose(&table->tracks[table->last].f);
 				printf("\x1b[32mPSX: unsupported file: %s\n\x1b[0m", fname);
@@ -226,31 +165,31 @@ static int load_cue(const char* filename, toc_t *table)
 		}
 
 		/* decode PREGAP commands */
-		else if (sscanf(lptr, "PREGAP %02d:%02d:%02d", &mm, &ss, &bb) == 3)
+		else if (c->cmd == CUE_PREGAP && c->frames >= 0)
 		{
 			// Single bin specific, add pregab but subtract inherent pregap
-			pregap += bb + ss * 75 + mm * 60 * 75;
+			pregap += c->frames;
       table->tracks[table->last].pregap = 1;
 
 		}
 		/* decode TRACK commands */
-		else if ((sscanf(lptr, "TRACK %02d %*s", &bb)) || (sscanf(lptr, "TRACK %d %*s", &bb)))
+		else if (c->cmd == CUE_TRACK)
 		{
       pregap = 0;
-			if (bb != (table->last + 1))
+			if (c->num != (table->last + 1))
 			{
 				FileClose(&table->tracks[table->last].f);
 				printf("\x1b[32mPSX: missing tracks: %s\n\x1b[0m", fname);
 				return 0;
 			}
 
-			if (strstr(lptr, "MODE1/2352") || strstr(lptr, "MODE2/2352"))
+			if (c->type == CUE_MODE1_2352 || c->type == CUE_MODE2_2352)
 			{
 				table->tracks[table->last].sector_size = 2352;
 				table->tracks[table->last].type = 1;
 				if (!table->last) table->end = 150; // implicit 2 seconds pregap for track 1
 			}
-			else if (strstr(lptr, "AUDIO"))
+			else if (c->type == CUE_AUDIO)
 			{
 				table->tracks[table->last].sector_size = 2352;
 				table->tracks[table->last].type = 0;
@@ -258,29 +197,27 @@ static int load_cue(const char* filename, toc_t *table)
 			else
 			{
 				FileClose(&table->tracks[table->last].f);
-				printf("\x1b[32mPSX: unsupported track type: %s\n\x1b[0m", lptr);
+				printf("\x1b[32mPSX: unsupported track type: %s\n\x1b[0m", fname);
 				return 0;
 			}
 		}
 
 		/* decode INDEX commands */
-		else if ((sscanf(lptr, "INDEX 00 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
-			(sscanf(lptr, "INDEX 0 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
+		else if (c->cmd == CUE_INDEX && c->num == 0 && c->frames >= 0)
 		{
 			// Single bin specific
 			if (!table->tracks[table->last].f.opened())
 			{
 
 
-        pregap = bb+ss*75+mm*60*75;
+        pregap = c->frames;
 			}
 		}
-		else if ((sscanf(lptr, "INDEX 01 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
-			(sscanf(lptr, "INDEX 1 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
+		else if (c->cmd == CUE_INDEX && c->num == 1 && c->frames >= 0)
 		{
 			if (!table->tracks[table->last].f.opened())
 			{
-        table->tracks[table->last].start = bb+ss*75+mm*60*75; 
+        table->tracks[table->last].start = c->frames; 
         if (table->tracks[table->last].pregap)
           table->tracks[table->last].start += pregap;
         //Subtract the fake 150 sector pregap used for the first data track
@@ -305,7 +242,7 @@ static int load_cue(const char* filename, toc_t *table)
 			}
 			else
 			{
-				table->tracks[table->last].index1 = bb + ss * 75 + mm * 60 * 75;
+				table->tracks[table->last].index1 = c->frames;
 				if (table->tracks[table->last].type && !table->last) table->tracks[table->last].index1 = 150;
 				table->tracks[table->last].start = table->end;
 				table->end += (table->tracks[table->last].f.size / table->tracks[table->last].sector_size);
@@ -341,16 +278,18 @@ static int load_cd_image(const char *filename, toc_t *table)
 	const char *ext = strrchr(filename, '.');
 	if (!ext) return 0;
 
+	int res = 0;
 	if (!strncasecmp(".chd", ext, 4))
 	{
-		return load_chd(filename, table);
+		res = load_chd(filename, table);
 	}
 	else if (!strncasecmp(".cue", ext, 4))
 	{
-		return load_cue(filename, table);
+		res = load_cue(filename, table);
 	}
 
-	return 0;
+	if (res) cd_preload(table);
+	return res;
 }
 
 
@@ -431,15 +370,13 @@ static void send_cue_and_metadata(toc_t *table, uint16_t libcrypt_mask, enum reg
 	}
 }
 
-#define MCD_SIZE (128*1024)
-
 static void psx_mount_save(const char *filename)
 {
 	user_io_set_index(2);
 	if (strlen(filename))
 	{
 		FileGenerateSavePath(filename, buf, 0);
-		user_io_file_mount(buf, 2, 1, MCD_SIZE);
+		user_io_file_mount(buf, 2, 1, PSX_MCD_SIZE);
 		StoreIdx_S(2, buf);
 	}
 	else
@@ -467,86 +404,92 @@ void psx_fill_blanksave(uint8_t *buffer, uint32_t lba, int cnt)
 static toc_t toc = {};
 #define CD_SECTOR_LEN 2352
 
+// track of the previous request, streaming stays inside one track for a long time
+static int cur_track = 0;
+
+static int find_track(int lba)
+{
+	if (cur_track < toc.last && lba >= toc.tracks[cur_track].start && lba <= toc.tracks[cur_track].end) return cur_track;
+	if (cur_track + 1 < toc.last && lba >= toc.tracks[cur_track + 1].start && lba <= toc.tracks[cur_track + 1].end) return ++cur_track;
+
+	// tracks are sorted by start
+	int lo = 0, hi = toc.last - 1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (lba < toc.tracks[mid].start) hi = mid - 1;
+		else if (lba > toc.tracks[mid].end) lo = mid + 1;
+		else return cur_track = mid;
+	}
+	return -1;
+}
+
 void psx_read_cd(uint8_t *buffer, int lba, int cnt)
 {
 	//printf("req lba=%d, cnt=%d\n", lba, cnt);
+	cd_trace(CD_TRACE_PSX, lba, cnt);
 
 	while (cnt > 0)
 	{
-		if (lba < toc.tracks[0].start || !toc.last)
+		int i = (lba < toc.tracks[0].start || !toc.last) ? -1 : find_track(lba);
+		if (i < 0)
 		{
-			memset(buffer, 0, CD_SECTOR_LEN);
+			memset(buffer, (!toc.last || lba < toc.tracks[0].start) ? 0 : 0xAA, CD_SECTOR_LEN);
+			buffer += CD_SECTOR_LEN;
+			cnt--;
+			lba++;
+			continue;
+		}
+
+		// run of sectors inside this track
+		int n = toc.tracks[i].end - lba + 1;
+		if (n > cnt) n = cnt;
+
+		//The TOC is setup so that pregap sectors are actually part of the
+		//PREVIOUS track. If the pregap field is set the file doesn't contain
+		//this data, so we have to fake it.
+		//Check the next track's pregap and index1 values to determine
+		//if we're reading pregap sectors
+		int pregap = toc.tracks[i + 1].pregap ? (toc.tracks[i + 1].start - toc.tracks[i + 1].index1 + 1) : INT32_MAX;
+		if (lba >= pregap)
+		{
+			memset(buffer, 0, n * CD_SECTOR_LEN);
 		}
 		else
 		{
-			memset(buffer, 0xAA, CD_SECTOR_LEN);
-			for (int i = 0; i < toc.last; i++)
+			if (n > pregap - lba) n = pregap - lba;
+
+			if (toc.chd_f)
 			{
-				if (lba >= toc.tracks[i].start && lba <= toc.tracks[i].end)
+				// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
+				int read_lba = lba - toc.tracks[0].index1 + toc.tracks[i].offset;
+				for (int s = 0; s < n; s++)
 				{
-					if (!toc.chd_f)
+					uint8_t *sector = buffer + s * CD_SECTOR_LEN;
+					if (mister_chd_read_sector(toc.chd_f, read_lba + s, 0, 0, CD_SECTOR_LEN, sector) == CHDERR_NONE)
 					{
-						if (toc.tracks[i].offset)
-            {
-							FileSeek(&toc.tracks[0].f, toc.tracks[i].offset+((lba-toc.tracks[i].start)*CD_SECTOR_LEN), SEEK_SET);
-
-            }else {
-							FileSeek(&toc.tracks[i].f, (lba - toc.tracks[i].start) * CD_SECTOR_LEN, SEEK_SET);
-            }
+						if (!toc.tracks[i].type) cd_swap16(sector, CD_SECTOR_LEN); //CHD requires byteswap of audio data
 					}
-					while (cnt)
+					else
 					{
-            if (toc.tracks[i+1].pregap && lba > (toc.tracks[i+1].start-toc.tracks[i+1].index1)) 
-            {
-              //The TOC is setup so that pregap sectors are actually part of the
-              //PREVIOUS track. If the pregap field is set the file doesn't contain
-              //this data, so we have to fake it. 
-              //Check the next track's pregap and index1 values to determine
-              //if we're reading pregap sectors
-              
-
-              memset(buffer, 0x0, CD_SECTOR_LEN);
-            }
-            else if (toc.chd_f)
-						{
-
-							// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
-							int read_lba = lba - toc.tracks[0].index1;
-							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer, chd_hunkbuf, &chd_hunknum) == CHDERR_NONE)
-							{
-								if (!toc.tracks[i].type) //CHD requires byteswap of audio data
-								{
-									for (int swapidx = 0; swapidx < CD_SECTOR_LEN; swapidx += 2)
-									{
-										uint8_t temp = buffer[swapidx];
-										buffer[swapidx] = buffer[swapidx + 1];
-										buffer[swapidx + 1] = temp;
-									}
-								}
-							}
-							else {
-								printf("\x1b[32mPSX: CHD read error: %d\n\x1b[0m", lba);
-							}
-						}
-						else {
-							if (toc.tracks[i].offset)
-								FileReadAdv(&toc.tracks[0].f, buffer, CD_SECTOR_LEN);
-							else
-								FileReadAdv(&toc.tracks[i].f, buffer, CD_SECTOR_LEN);
-						}
-						if ((lba + 1) > toc.tracks[i].end) break;
-						buffer += CD_SECTOR_LEN;
-						cnt--;
-						lba++;
+						memset(sector, 0xAA, CD_SECTOR_LEN);
+						log_rate(1000, LOGL_ERR, "\x1b[32mPSX: CHD read error: %d\n\x1b[0m", lba + s);
 					}
-					break;
 				}
 			}
+			else
+			{
+				// whole run in one read
+				fileTYPE *f = toc.tracks[i].offset ? &toc.tracks[0].f : &toc.tracks[i].f;
+				__off64_t pos = toc.tracks[i].offset + (__off64_t)(lba - toc.tracks[i].start) * CD_SECTOR_LEN;
+				int ret = FileReadAt(f, pos, buffer, n * CD_SECTOR_LEN, 0);
+				if (ret < n * CD_SECTOR_LEN) memset(buffer + ret, 0xAA, n * CD_SECTOR_LEN - ret);
+			}
 		}
 
-		buffer += CD_SECTOR_LEN;
-		cnt--;
-		lba++;
+		buffer += n * CD_SECTOR_LEN;
+		cnt -= n;
+		lba += n;
 	}
 }
 
@@ -655,9 +598,59 @@ static game_info_t psx_get_game_info()
 	return { game_id, region_t::UNKNOWN };
 }
 
+// Detection results of the mounted disc, kept by cd_info_store. The libcrypt
+// mask depends on the sbi files, so their mtimes are part of the record.
+struct psx_disc_t
+{
+	char game_id[12];
+	uint32_t region;
+	uint32_t libcrypt_mask;
+	int64_t sbi_mtime[2]; // PSX/sbi.zip, sbi next to the image; 0 - not there
+};
+
+static psx_disc_t disc = {};
+
+static int64_t file_mtime(const char *name)
+{
+	struct stat64 *st = getPathStat(name);
+	return st ? st->st_mtime : 0;
+}
+
+static void psx_detect(const char *sbi_name, psx_disc_t *info)
+{
+	game_info_t game_info = psx_get_game_info();
+	snprintf(info->game_id, sizeof(info->game_id), "%s", game_info.game_id);
+
+	region_t region = psx_get_region();
+	if (region == region_t::UNKNOWN)
+		region = game_info.region;
+	info->region = region;
+
+	fileTYPE sbi_file = {};
+	bool has_sbi_file = false;
+
+	// search for .sbi file in PSX/sbi.zip
+	sprintf(buf, "%s/sbi.zip/%s.sbi", HomeDir(), info->game_id);
+	has_sbi_file = (FileOpen(&sbi_file, buf, 1));
+
+	if (!has_sbi_file)
+	{
+		// search for .sbi file base on image name
+		strcpy(buf, sbi_name);
+		has_sbi_file = (FileOpen(&sbi_file, buf, 1));
+	}
+
+	info->libcrypt_mask = 0;
+	if (has_sbi_file)
+	{
+		printf("Found SBI file: %s\n", buf);
+		info->libcrypt_mask = libCryptMask(&sbi_file);
+	}
+}
+
 const char* psx_get_game_id()
 {
-	return psx_get_game_info().game_id;
+	return disc.game_id;
 }
 
 static void mount_cd(int size, int index)
@@ -688,15 +681,27 @@ void psx_mount_cd(int f_index, int s_index, const char *filename)
 		if (load_cd_image(filename, &toc) && toc.last)
 		{
 			int reset = 0;
-			game_info_t game_info = psx_get_game_info();
-			const char* game_id = game_info.game_id;
-			region_t region = psx_get_region();
-			if (region == region_t::UNKNOWN)
-				region = game_info.region;
-			printf("Game ID: %s, region: %s\n", game_id, region_string(region));
-
 			int name_len = strlen(filename);
 
+			static char sbi_name[1024];
+			strcpy(sbi_name, filename);
+			strcpy((name_len > 4) ? sbi_name + name_len - 4 : sbi_name + name_len, ".sbi");
+
+			sprintf(buf, "%s/sbi.zip", HomeDir());
+			int64_t sbi_mtime[2] = { file_mtime(buf), file_mtime(sbi_name) };
+
+			// re-mounts and disc swaps don't read the disc for this again
+			if (!cd_info_load(filename, "psx", &disc, sizeof(disc)) || memcmp(disc.sbi_mtime, sbi_mtime, sizeof(sbi_mtime)))
+			{
+				memset(&disc, 0, sizeof(disc));
+				psx_detect(sbi_name, &disc);
+				memcpy(disc.sbi_mtime, sbi_mtime, sizeof(sbi_mtime));
+				cd_info_store(filename, "psx", &disc, sizeof(disc));
+			}
+
+			region_t region = (region_t)disc.region;
+			printf("Game ID: %s, region: %s\n", disc.game_id, region_string(region));
+
 			if (toc.tracks[0].type) // is first track a data?
 			{
 				const char *p = strrchr(filename, '/');
@@ -749,30 +754,7 @@ void psx_mount_cd(int f_index, int s_index, const char *filename)
 				}
 			}
 
-			uint16_t mask = 0;
-
-			fileTYPE sbi_file = {};
-			bool has_sbi_file = false;
-
-			// search for .sbi file in PSX/sbi.zip
-			sprintf(buf, "%s/sbi.zip/%s.sbi", HomeDir(), game_id);
-			has_sbi_file = (FileOpen(&sbi_file, buf, 1));
-
-			if (!has_sbi_file)
-			{
-				// search for .sbi file base on image name
-				strcpy(buf, filename);
-				strcpy((name_len > 4) ? buf + name_len - 4 : buf + name_len, ".sbi");
-				has_sbi_file = (FileOpen(&sbi_file, buf, 1));
-			}
-
-			if (has_sbi_file)
-			{
-				printf("Found SBI file: %s\n", buf);
-				mask = libCryptMask(&sbi_file);
-			}
-
-			send_cue_and_metadata(&toc, mask, region, reset);
+			send_cue_and_metadata(&toc, disc.libcrypt_mask, region, reset);
 
 			user_io_set_index(f_index);
 			process_ss(filename, name_len != 0);
@@ -785,6 +767,7 @@ void psx_mount_cd(int f_index, int s_index, const char *filename)
 	if (!loaded)
 	{
 		printf("Unmount CD\n");
+		memset(&disc, 0, sizeof(disc));
 		unload_cue(&toc);
 		unload_chd(&toc);
 		mount_cd(0, s_index);
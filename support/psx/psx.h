@@ -2,6 +2,8 @@
 #define PSX_H
 
 void psx_mount_cd(int f_index, int s_index, const char *filename);
+#define PSX_MCD_SIZE (128*1024)
+
 void psx_fill_blanksave(uint8_t *buffer, uint32_t lba, int cnt);
 void psx_read_cd(uint8_t *buffer, int lba, int cnt);
 const char* psx_get_game_id();
@@ -2,6 +2,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "../../file_io.h"
 #include "../../user_io.h"
@@ -9,6 +12,8 @@
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../cheats.h"
+#include "../../offload.h"
+#include "../../shcache.h"
 #include "saturn.h"
 
 static int need_reset = 0;
@@ -103,19 +108,114 @@ static void saturn_mount_save(const char *filename)
 	user_io_set_download(0);
 }
 
-static int saturn_load_rom(const char *basename, const char *name, int sub_index)
+// The BIOS is read on the bulk worker while the disc is opened. Its image is
+// kept in the shared cache under the path, size and date of the file, so a
+// restarted core finds it in RAM.
+#define BIOS_PATHS 3
+#define BIOS_MAX_SIZE (4 * 1024 * 1024)
+
+static char *bios_path[BIOS_PATHS] = {};
+static uint8_t *bios_data = 0;
+static uint32_t bios_size = 0;
+static int bios_found = -1;
+static offload_handle_t bios_job = 0;
+
+static uint8_t *bios_read(const char *path, uint32_t *size)
+{
+	struct stat64 st;
+	if (stat64(path, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size || st.st_size > BIOS_MAX_SIZE) return 0;
+
+	// no file has this name, a miss doesn't read anything
+	char key[1100];
+	snprintf(key, sizeof(key), "%s@%lld.%lld", path, (long long)st.st_size, (long long)st.st_mtime);
+
+	size_t len = 0;
+	uint8_t *data = (uint8_t*)shcache_load(key, &len);
+	if (data && len == (size_t)st.st_size)
+	{
+		*size = len;
+		return data;
+	}
+	free(data);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	data = (uint8_t*)malloc(st.st_size);
+	if (data && read(fd, data, st.st_size) != st.st_size)
+	{
+		free(data);
+		data = 0;
+	}
+	close(fd);
+
+	if (data)
+	{
+		shcache_store(key, data, st.st_size);
+		*size = st.st_size;
+	}
+	return data;
+}
+
+static void bios_add_path(int n, const char *basename, const char *name)
 {
 	strcpy(buf, basename);
 	char *p = strrchr(buf, '/');
 	if (p)
 	{
-		p++;
-		strcpy(p, name);
-		if (user_io_file_tx(buf, sub_index << 6)) return 1;
+		strcpy(p + 1, name);
+		// file_io paths aren't thread safe, the worker gets the full path.
+		bios_path[n] = strdup(getFullPath(buf));
 	}
+}
+
+static void bios_start(const char *filename, const char *dir)
+{
+	bios_add_path(0, filename, "cd_bios.rom"); // from disk folder.
+	bios_add_path(1, dir, "cd_bios.rom");      // from parent folder.
 
-	return 0;
+	sprintf(buf, "%s/boot.rom", HomeDir());    // from home folder.
+	bios_path[2] = strdup(getFullPath(buf));
+
+	bios_job = offload_add_work([]
+	{
+		for (int i = 0; i < BIOS_PATHS && !bios_data; i++)
+		{
+			if (bios_path[i] && (bios_data = bios_read(bios_path[i], &bios_size))) bios_found = i;
+		}
+	}, OFFLOAD_PRIO_BULK);
+}
+
+static void bios_send()
+{
+	offload_wait(bios_job);
+	bios_job = 0;
+
+	if (bios_data)
+	{
+		printf("Selected file %s with %u bytes to send for index 0.0\n", bios_path[bios_found], bios_size);
+		user_io_set_index(0);
+		user_io_file_info(".rom");
+		user_io_set_download(1);
+		user_io_file_tx_data(bios_data, bios_size);
+		user_io_set_download(0);
+	}
+	else
+	{
+		Info("CD BIOS not found!", 4000);
+	}
+
+	free(bios_data);
+	bios_data = 0;
+	bios_size = 0;
+	bios_found = -1;
+	for (int i = 0; i < BIOS_PATHS; i++)
+	{
+		free(bios_path[i]);
+		bios_path[i] = 0;
+	}
 }
+
 void saturn_set_image(int num, const char *filename)
 {
 	static char last_dir[1024] = {};
@@ -137,32 +237,22 @@ void saturn_set_image(int num, const char *filename)
 		user_io_status_set("[0]", 1);
 		saturn_reset();
 
-		// load CD BIOS
-		if (!saturn_load_rom(filename, "cd_bios.rom", 0)) // from disk folder.
-		{
-			if (!saturn_load_rom(last_dir, "cd_bios.rom", 0)) // from parent folder.
-			{
-				sprintf(buf, "%s/boot.rom", HomeDir()); // from home folder.
-				if (!user_io_file_tx(buf))
-				{
-					Info("CD BIOS not found!", 4000);
-				}
-			}
-		}
+		// load CD BIOS, the core is held in reset until the disc is in
+		bios_start(filename, last_dir);
 	}
 
-	if (strlen(filename))
+	int loaded = strlen(filename) && satcdd.Load(filename) > 0;
+	if (!same_game) bios_send();
+
+	if (loaded)
 	{
-		if (satcdd.Load(filename) > 0)
+		satcdd.SendData = saturn_send_data;
+
+		if (!same_game)
 		{
-			satcdd.SendData = saturn_send_data;
-
-			if (!same_game)
-			{
-				//saturn_load_rom(filename, "cart.rom", 1);
-				saturn_mount_save(filename);
-				//cheats_init(filename, 0);
-			}
+			//saturn_load_rom(filename, "cart.rom", 1);
+			saturn_mount_save(filename);
+			//cheats_init(filename, 0);
 		}
 	}
 
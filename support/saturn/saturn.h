@@ -1,10 +1,15 @@
 #ifndef SATURN_H
 #define SATURN_H
 
+#include <atomic>
 #include "../../cd.h"
+#include "../../offload.h"
 
 //#define SATURN_DEBUG				1
 
+// data sectors read ahead of the head position (~100ms at 2x)
+#define SAT_PF_SECTORS				16
+
 // CDD command
 #define SATURN_COMM_NOP				0x00
 #define SATURN_COMM_SEEK_RING		0x02
@@ -79,10 +84,20 @@ private:
 	uint8_t cd_buf[4096 + 2];
 	int audioLength;
 	int audioFirst;
-	int chd_hunknum;
-	uint8_t *chd_hunkbuf;
 	int chd_audio_read_lba;
 
+	// data sector read-ahead ring, slot of a sector is its lba modulo the size.
+	// Sectors [pf_start, pf_ready) are read, the offload worker fills up to pf_fill.
+	struct pf_sector_t
+	{
+		uint16_t ofs, len;
+		uint8_t data[2352];
+	};
+	pf_sector_t pf[SAT_PF_SECTORS];
+	int pf_start;
+	int pf_fill;
+	std::atomic<int> pf_ready;
+	offload_handle_t pf_job;
 
 	int LoadCUE(const char* filename);
 	void LBAToMSF(int lba, msf_t* msf);
@@ -90,6 +105,10 @@ private:
 	void SetChecksum(uint8_t* stat);
 	int CheckCommand(uint8_t* cmd);
 	void ReadData(uint8_t *buf);
+	void ReadDataAt(int lba, int track, uint8_t *buf, uint16_t *ofs, uint16_t *len);
+	void PrefetchDrop();
+	int PrefetchGet(uint8_t *buf);
+	void PrefetchFill();
 	int ReadCDDA(uint8_t *buf, int first);
 	void MakeSecureRingData(uint8_t *buf);
 	int DataSectorSend(uint8_t* header, int speed);
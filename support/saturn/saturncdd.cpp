@@ -7,6 +7,9 @@
 #include "saturn.h"
 #include "../../shmem.h"
 #include "../chd/mister_chd.h"
+#include "../../file_io.h"
+#include "../../counters.h"
+#include "../../log.h"
 
 #define SHMEM_ADDR  0x31000000
 
@@ -28,8 +31,8 @@ satcdd_t::satcdd_t() {
 	speed = 0;
 	audioLength = 0;
 	audioFirst = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
+	pf_start = pf_fill = pf_ready = 0;
+	pf_job = 0;
 	SendData = NULL;
 
 	stat[0] = SATURN_STAT_OPEN;
@@ -46,85 +49,30 @@ satcdd_t::satcdd_t() {
 	SetChecksum(stat);
 }
 
-static int sgets(char *out, int sz, char **in)
-{
-	*out = 0;
-	do
-	{
-		char *instr = *in;
-		int cnt = 0;
-
-		while (*instr && *instr != 10)
-		{
-			if (*instr == 13)
-			{
-				instr++;
-				continue;
-			}
-
-			if (cnt < sz - 1)
-			{
-				out[cnt++] = *instr;
-				out[cnt] = 0;
-			}
-
-			instr++;
-		}
-
-		if (*instr == 10) instr++;
-		*in = instr;
-	} while (!*out && **in);
-
-	return *out;
-}
-
 int satcdd_t::LoadCUE(const char* filename) {
 	static char fname[1024 + 10];
-	static char line[128];
-	char *ptr, *lptr;
-	static char toc[100 * 1024];
+	static cue_sheet_t cue;
 
 	strcpy(fname, filename);
 
-	memset(toc, 0, sizeof(toc));
-	if (!FileLoad(fname, toc, sizeof(toc) - 1)) return 1;
+	if (!cd_cue_parse(fname, &cue)) return 1;
 
 #ifdef SATURN_DEBUG
 	printf("\x1b[32mSaturn: Open CUE: %s\n\x1b[0m", fname);
 #endif // SATURN_DEBUG
 
-	int mm, ss, bb, pregap = 0;
+	int pregap = 0;
 
-	char *buf = toc;
-	while (sgets(line, sizeof(line), &buf))
+	for (int n = 0; n < cue.cmds; n++)
 	{
-		lptr = line;
-		while (*lptr == 0x20) lptr++;
+		const cue_cmd_t *c = &cue.cmd[n];
 
 		/* decode FILE commands */
-		if (!(memcmp(lptr, "FILE", 4)))
+		if (c->cmd == CUE_FILE)
 		{
-			ptr = fname + strlen(fname) - 1;
-			while ((ptr - fname) && (*ptr != '/') && (*ptr != '\\')) ptr--;
-			if (ptr - fname) ptr++;
+			cd_cue_file(&cue, c, fname, 1024);
 
-			lptr += 4;
-			while (*lptr == 0x20) lptr++;
-
-			if (*lptr == '\"')
-			{
-				lptr++;
-				while ((*lptr != '\"') && (lptr <= (line + 128)) && (ptr < (fname + 1023)))
-					*ptr++ = *lptr++;
-			}
-			else
-			{
-				while ((*lptr != 0x20) && (lptr <= (line + 128)) && (ptr < (fname + 1023)))
-					*ptr++ = *lptr++;
-			}
-			*ptr = 0;
-
-			if (!FileOpen(&this->toc.tracks[this->toc.last].f, fname)) return -1;
+			if (!cd_open_track(&this->toc.tracks[this->toc.last].f, fname)) return -1;
 
 #ifdef SATURN_DEBUG
 			printf("\x1b[32mSaturn: Open track file: %s\n\x1b[0m", fname);
@@ -134,7 +82,7 @@ int satcdd_t::LoadCUE(const char* filename) {
 
 			this->toc.tracks[this->toc.last].offset = 0;
 
-			if (!strstr(lptr, "BINARY") && !strstr(lptr, "MOTOROLA") && !strstr(lptr, "WAVE"))
+			if (c->type == CUE_FILE_OTHER)
 			{
 				FileClose(&this->toc.tracks[this->toc.last].f); 
 #ifdef SATURN_DEBUG
@@ -146,9 +94,9 @@ int satcdd_t::LoadCUE(const char* filename) {
 		}
 
 		/* decode TRACK commands */
-		else if ((sscanf(lptr, "TRACK %02d %*s", &bb)) || (sscanf(lptr, "TRACK %d %*s", &bb)))
+		else if (c->cmd == CUE_TRACK)
 		{
-			if (bb != (this->toc.last + 1))
+			if (c->num != (this->toc.last + 1))
 			{
 				FileClose(&this->toc.tracks[this->toc.last].f);
 #ifdef SATURN_DEBUG
@@ -157,19 +105,19 @@ int satcdd_t::LoadCUE(const char* filename) {
 				break;
 			}
 
-			if (strstr(lptr, "MODE1/2048"))
+			if (c->type == CUE_MODE1_2048)
 			{
 				this->sectorSize = 2048;
 				this->toc.tracks[this->toc.last].type = 1;
 			}
-			else if (strstr(lptr, "MODE1/2352"))
+			else if (c->type == CUE_MODE1_2352)
 			{
 				this->sectorSize = 2352;
 				this->toc.tracks[this->toc.last].type = 1;
 
 				//FileSeek(&this->toc.tracks[0].f, 0x10, SEEK_SET);
 			}
-			else if (strstr(lptr, "MODE2/2352"))
+			else if (c->type == CUE_MODE2_2352)
 			{
 				this->sectorSize = 2352;
 				this->toc.tracks[this->toc.last].type = 2;
@@ -177,30 +125,7 @@ int satcdd_t::LoadCUE(const char* filename) {
 				//FileSeek(&this->toc.tracks[0].f, 0x10, SEEK_SET);
 			}
 
-			if (!this->toc.last)
-			{
-				/*if (strstr(lptr, "MODE1/2048"))
-				{
-					this->sectorSize = 2048;
-					this->toc.tracks[0].type = 1;
-				}
-				else if (strstr(lptr, "MODE1/2352") || strstr(lptr, "MODE2/2352"))
-				{
-					this->sectorSize = 2352;
-					this->toc.tracks[0].type = 1;
-
-					FileSeek(&this->toc.tracks[0].f, 0x10, SEEK_SET);
-				}
-
-				if (this->sectorSize)
-				{
-					this->toc.tracks[0].type = 1;
-
-					FileReadAdv(&this->toc.tracks[0].f, header, 0x210);
-					FileSeek(&this->toc.tracks[0].f, 0, SEEK_SET);
-				}*/
-			}
-			else
+			if (this->toc.last)
 			{
 				if (!this->toc.tracks[this->toc.last].f.opened())
 				{
@@ -210,30 +135,28 @@ int satcdd_t::LoadCUE(const char* filename) {
 		}
 
 		/* decode PREGAP commands */
-		else if (sscanf(lptr, "PREGAP %02d:%02d:%02d", &mm, &ss, &bb) == 3)
+		else if (c->cmd == CUE_PREGAP && c->frames >= 0)
 		{
-			this->toc.tracks[this->toc.last].pregap = bb + ss * 75 + mm * 60 * 75;
+			this->toc.tracks[this->toc.last].pregap = c->frames;
 			pregap += this->toc.tracks[this->toc.last].pregap;
 		}
 
 		/* decode INDEX commands */
-		else if ((sscanf(lptr, "INDEX 00 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
-			(sscanf(lptr, "INDEX 0 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
+		else if (c->cmd == CUE_INDEX && c->num == 0 && c->frames >= 0)
 		{
 			if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
 			{
-				this->toc.tracks[this->toc.last - 1].end = bb + ss * 75 + mm * 60 * 75 + pregap;
+				this->toc.tracks[this->toc.last - 1].end = c->frames + pregap;
 			}
 		}
-		else if ((sscanf(lptr, "INDEX 01 %02d:%02d:%02d", &mm, &ss, &bb) == 3) ||
-			(sscanf(lptr, "INDEX 1 %02d:%02d:%02d", &mm, &ss, &bb) == 3))
+		else if (c->cmd == CUE_INDEX && c->num == 1 && c->frames >= 0)
 		{
 			this->toc.tracks[this->toc.last].offset += pregap * 2352;
 
 			if (!this->toc.tracks[this->toc.last].f.opened())
 			{
-				FileOpen(&this->toc.tracks[this->toc.last].f, fname);
-				this->toc.tracks[this->toc.last].start = bb + ss * 75 + mm * 60 * 75 + pregap;
+				cd_open_track(&this->toc.tracks[this->toc.last].f, fname);
+				this->toc.tracks[this->toc.last].start = c->frames + pregap;
 				if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
 				{
 					this->toc.tracks[this->toc.last - 1].end = this->toc.tracks[this->toc.last].start - this->toc.tracks[this->toc.last].pregap;
@@ -250,7 +173,7 @@ int satcdd_t::LoadCUE(const char* filename) {
 				if (this->toc.tracks[this->toc.last].type) sectorSize = this->sectorSize;
 				this->toc.tracks[this->toc.last].end = this->toc.tracks[this->toc.last].start + ((this->toc.tracks[this->toc.last].f.size + sectorSize - 1) / sectorSize);
 
-				this->toc.tracks[this->toc.last].start += (bb + ss * 75 + mm * 60 * 75);
+				this->toc.tracks[this->toc.last].start += c->frames;
 				this->toc.end = this->toc.tracks[this->toc.last].end;
 			}
 
@@ -294,14 +217,6 @@ int satcdd_t::Load(const char *filename)
 			printf("ERROR %s\n", chd_error_string(err));
 			return -1;
 		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(CD_FRAME_SIZE * CD_FRAMES_PER_HUNK);
-		this->chd_hunknum = -1;
 		if (this->toc.tracks[0].sector_size)
 		{
 			this->sectorSize = this->toc.tracks[0].sector_size;
@@ -314,7 +229,7 @@ int satcdd_t::Load(const char *filename)
 
 	/*if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header);
 	}
 	else {
 		fd_img = &this->toc.tracks[0].f;
@@ -339,6 +254,7 @@ int satcdd_t::Load(const char *filename)
 	if (this->toc.last)
 	{
 		this->toc.tracks[this->toc.last].start = this->toc.end;
+		cd_preload(&this->toc);
 		this->loaded = 1;
 		this->lid_open = false;
 		this->stop_pend = true;
@@ -357,15 +273,11 @@ void satcdd_t::Unload()
 {
 	if (this->loaded)
 	{
-		if (this->toc.chd_f)
-		{
-			chd_close(this->toc.chd_f);
-		}
+		PrefetchDrop();
 
-		if (this->chd_hunkbuf)
+		if (this->toc.chd_f)
 		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
+			mister_chd_close(this->toc.chd_f);
 		}
 
 		for (int i = 0; i < this->toc.last; i++)
@@ -383,9 +295,7 @@ void satcdd_t::Unload()
 	this->sectorSize = 0;
 
 #ifdef SATURN_DEBUG
-	printf("\x1b[32mSaturn: ");
-	printf("Unload");
-	printf("\n\x1b[0m");
+	log_info("\x1b[32mSaturn: Unload\n\x1b[0m");
 #endif // SATURN_DEBUG
 }
 
@@ -423,9 +333,7 @@ void satcdd_t::Reset() {
 	SetChecksum(stat);
 
 #ifdef SATURN_DEBUG
-	printf("\x1b[32mSaturn: ");
-	printf("Reset");
-	printf("\n\x1b[0m");
+	log_info("\x1b[32mSaturn: Reset\n\x1b[0m");
 #endif // SATURN_DEBUG
 }
 
@@ -451,9 +359,7 @@ void satcdd_t::CommandExec() {
 		this->speed = comm[10] == 1 ? 1 : 2;
 
 #ifdef SATURN_DEBUG
-		printf("\x1b[32mSaturn: ");
-		printf("Command Seek Security Ring: FAD = %u, track = %u", fad, this->toc.GetTrackByLBA(this->seek_lba) + 1);
-		printf(" (%u)\n\x1b[0m", frame_cnt);
+		log_info("\x1b[32mSaturn: Command Seek Security Ring: FAD = %u, track = %u (%u)\n\x1b[0m", fad, this->toc.GetTrackByLBA(this->seek_lba) + 1, frame_cnt);
 #endif // SATURN_DEBUG
 		break;
 
@@ -463,9 +369,7 @@ void satcdd_t::CommandExec() {
 		this->speed = comm[10] == 1 ? 1 : 2;
 
 #ifdef SATURN_DEBUG
-		printf("\x1b[32mSaturn: ");
-		printf("Command TOC Read");
-		printf(" (%u)\n\x1b[0m", frame_cnt);
+		log_info("\x1b[32mSaturn: Command TOC Read (%u)\n\x1b[0m", frame_cnt);
 #endif // SATURN_DEBUG
 		break;
 
@@ -474,10 +378,8 @@ void satcdd_t::CommandExec() {
 		this->read_pend = false;
 
 #ifdef SATURN_DEBUG
-		printf("\x1b[32mSaturn: ");
-		printf("Command Stop");
 		//printf(", last FAD = %u", last_lba + 150);
-		printf(" (%u)\n\x1b[0m", frame_cnt);
+		log_info("\x1b[32mSaturn: Command Stop (%u)\n\x1b[0m", frame_cnt);
 #endif // SATURN_DEBUG
 		break;
 
@@ -499,9 +401,7 @@ void satcdd_t::CommandExec() {
 		//printf("\x1b[32mSaturn: ");
 		//printf("Command = %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X", comm[0], comm[1], comm[2], comm[3], comm[4], comm[5], comm[6], comm[7], comm[8], comm[9], comm[10], comm[11]);
 		//printf("\n\x1b[0m");
-		printf("\x1b[32mSaturn: ");
-		printf("Command Read Data: FAD = %u, track = %u, speed = %u", fad, this->toc.GetTrackByLBA(this->seek_lba) + 1, this->speed);
-		printf(" (%u)\n\x1b[0m", frame_cnt);
+		log_info("\x1b[32mSaturn: Command Read Data: FAD = %u, track = %u, speed = %u (%u)\n\x1b[0m", fad, this->toc.GetTrackByLBA(this->seek_lba) + 1, this->speed, frame_cnt);
 #endif // SATURN_DEBUG 
 		break;
 
@@ -510,10 +410,8 @@ void satcdd_t::CommandExec() {
 		this->read_pend = false;
 
 #ifdef SATURN_DEBUG
-		printf("\x1b[32mSaturn: ");
-		printf("Command Pause");
 		//printf(", last FAD = %u", last_lba + 150);
-		printf(" (%u)\n\x1b[0m", frame_cnt);
+		log_info("\x1b[32mSaturn: Command Pause (%u)\n\x1b[0m", frame_cnt);
 #endif // SATURN_DEBUG
 		break;
 
@@ -531,10 +429,8 @@ void satcdd_t::CommandExec() {
 		//printf("\x1b[32mSaturn: ");
 		//printf("Command = %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X", comm[0], comm[1], comm[2], comm[3], comm[4], comm[5], comm[6], comm[7], comm[8], comm[9], comm[10], comm[11]);
 		//printf("\n\x1b[0m");
-		printf("\x1b[32mSaturn: ");
-		printf("Command Seek: FAD = %u, track = %u, speed = %u, num = %u", fad, this->toc.GetTrackByLBA(this->seek_lba) + 1, this->speed, comm[8]);
 		//printf(", command = %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X", comm[0], comm[1], comm[2], comm[3], comm[4], comm[5], comm[6], comm[7], comm[8], comm[9], comm[10], comm[11]);
-		printf(" (%u)\n\x1b[0m", frame_cnt);
+		log_info("\x1b[32mSaturn: Command Seek: FAD = %u, track = %u, speed = %u, num = %u (%u)\n\x1b[0m", fad, this->toc.GetTrackByLBA(this->seek_lba) + 1, this->speed, comm[8], frame_cnt);
 #endif // SATURN_DEBUG
 		break;
 
@@ -544,9 +440,7 @@ void satcdd_t::CommandExec() {
 		this->pause_pend = false;
 
 #ifdef SATURN_DEBUG
-		printf("\x1b[32mSaturn: ");
-		printf("Command undefined, command = %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X", comm[0], comm[1], comm[2], comm[3], comm[4], comm[5], comm[6], comm[7], comm[8], comm[9], comm[10], comm[11]);
-		printf(" (%u)\n\x1b[0m", frame_cnt);
+		log_info("\x1b[32mSaturn: Command undefined, command = %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X (%u)\n\x1b[0m", comm[0], comm[1], comm[2], comm[3], comm[4], comm[5], comm[6], comm[7], comm[8], comm[9], comm[10], comm[11], frame_cnt);
 #endif // SATURN_DEBUG
 		break;
 	}
@@ -639,9 +533,7 @@ void satcdd_t::Process(uint8_t* time_mode) {
 		*time_mode = 1;
 
 #ifdef SATURN_DEBUG
-		printf("\x1b[32mSaturn: ");
-		printf("Process read TOC: index = %02X, msf = %02X:%02X:%02X, q = %02X", idx, BCD(msf.m), BCD(msf.s), BCD(msf.f), q);
-		printf(" (%u)\n\x1b[0m", frame_cnt);
+		log_info("\x1b[32mSaturn: Process read TOC: index = %02X, msf = %02X:%02X:%02X, q = %02X (%u)\n\x1b[0m", idx, BCD(msf.m), BCD(msf.s), BCD(msf.f), q, frame_cnt);
 #endif // SATURN_DEBUG
 	}
 	else if (this->seek_pend) {
@@ -1017,12 +909,20 @@ void satcdd_t::MakeSecureRingData(uint8_t *buf) {
 }
 
 void satcdd_t::ReadData(uint8_t *buf)
+{
+	uint16_t ofs, len;
+	ReadDataAt(this->lba, this->track, buf, &ofs, &len);
+}
+
+// ofs/len: the part of the 2352 byte sector buffer that was written
+void satcdd_t::ReadDataAt(int lba, int track, uint8_t *buf, uint16_t *ofs, uint16_t *len)
 {
 	int offs = 0; 
+	*ofs = *len = 0;
 	
-	if (this->toc.tracks[this->track].type)
+	if (this->toc.tracks[track].type)
 	{
-		int lba_ = this->lba >= 0 ? this->lba : 0;
+		int lba_ = lba >= 0 ? lba : 0;
 		if (this->toc.chd_f)
 		{
 			int read_offset = 0;
@@ -1031,29 +931,91 @@ void satcdd_t::ReadData(uint8_t *buf)
 				read_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->sectorSize, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[track].offset, read_offset, 0, this->sectorSize, buf);
+			*ofs = read_offset;
+			*len = this->sectorSize;
 		}
 		else {
 			if (this->sectorSize == 2048)
 			{
-				offs = (lba_ * 2048) - this->toc.tracks[this->track].offset;
-				FileSeek(&this->toc.tracks[this->track].f, offs, SEEK_SET);
-				FileReadAdv(&this->toc.tracks[this->track].f, buf + 16, 2048);
+				offs = (lba_ * 2048) - this->toc.tracks[track].offset;
+				FileReadAt(&this->toc.tracks[track].f, offs, buf + 16, 2048);
+				*ofs = 16;
+				*len = 2048;
 			}
 			else {
-				offs = (lba_ * 2352) - this->toc.tracks[this->track].offset;
-				FileSeek(&this->toc.tracks[this->track].f, offs, SEEK_SET);
-				FileReadAdv(&this->toc.tracks[this->track].f, buf, 2352);
+				offs = (lba_ * 2352) - this->toc.tracks[track].offset;
+				FileReadAt(&this->toc.tracks[track].f, offs, buf, 2352);
+				*len = 2352;
 			}
 #ifdef SATURN_DEBUG
 			//printf("\x1b[32mSaturn: ");
-			//printf("Read data, lba = %i, track = %i, offset = %i", lba_, this->track, offs);
+			//printf("Read data, lba = %i, track = %i, offset = %i", lba_, track, offs);
 			//printf(" (%u)\n\x1b[0m", frame_cnt);
 #endif // SATURN_DEBUG
 		}
 	}
 }
 
+void satcdd_t::PrefetchDrop()
+{
+	offload_wait(this->pf_job);
+	this->pf_job = 0;
+	this->pf_start = this->pf_fill = this->pf_ready = 0;
+}
+
+// copies the sector at the head position if it was read ahead
+int satcdd_t::PrefetchGet(uint8_t *buf)
+{
+	int lba = this->lba;
+	if (lba < this->pf_start || lba >= this->pf_fill)
+	{
+		// seek, or nothing read ahead yet
+		PrefetchDrop();
+		this->pf_start = this->pf_fill = this->pf_ready = (lba < 0) ? 0 : lba + 1;
+		return 0;
+	}
+
+	if (this->pf_ready.load() <= lba)
+	{
+		counter_add(CNT_CD_LATE);
+		offload_wait(this->pf_job);
+		if (this->pf_ready.load() <= lba) return 0;
+	}
+
+	pf_sector_t *sector = &this->pf[lba % SAT_PF_SECTORS];
+	memcpy(buf + sector->ofs, sector->data + sector->ofs, sector->len);
+	this->pf_start = lba + 1;
+	return 1;
+}
+
+// keep the ring SAT_PF_SECTORS ahead of the head
+void satcdd_t::PrefetchFill()
+{
+	if (!offload_is_done(this->pf_job)) return;
+
+	int first = this->pf_fill;
+	int cnt = this->pf_start + SAT_PF_SECTORS - first;
+	if (cnt > SAT_PF_SECTORS / 2) cnt = SAT_PF_SECTORS / 2;
+	if (cnt > this->toc.end - first) cnt = this->toc.end - first;
+	if (cnt <= 0) return;
+
+	// zipped images seek the shared file handle, only real files and CHD are read off the main thread
+	if (!this->toc.chd_f && !this->toc.tracks[this->toc.GetTrackByLBA(first)].f.filp) return;
+
+	this->pf_job = offload_try_add_work([this, first, cnt]()
+	{
+		for (int i = first; i < first + cnt; i++)
+		{
+			pf_sector_t *sector = &this->pf[i % SAT_PF_SECTORS];
+			ReadDataAt(i, this->toc.GetTrackByLBA(i), sector->data, &sector->ofs, &sector->len);
+			this->pf_ready.store(i + 1);
+		}
+	});
+
+	if (this->pf_job) this->pf_fill += cnt;
+}
+
 int satcdd_t::ReadCDDA(uint8_t *buf, int first)
 {
 	int len = 2352;
@@ -1073,18 +1035,10 @@ int satcdd_t::ReadCDDA(uint8_t *buf, int first)
 	{
 		for (int i = 0; i < len / 2352; i++)
 		{
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset ,2352 * i, 0, 2352, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset ,2352 * i, 0, 2352, buf);
 		}
 
-		//CHD audio requires byteswap. There's probably a better way to do this...
-
-		
-		for (int swapidx = 0; swapidx < len; swapidx += 2)
-		{
-			uint8_t temp = buf[swapidx];
-			buf[swapidx] = buf[swapidx + 1];
-			buf[swapidx + 1] = temp;
-		}
+		cd_swap16(buf, len);
 
 		if ((len / 2352) > 1)
 		{
@@ -1112,17 +1066,13 @@ int satcdd_t::DataSectorSend(uint8_t* header, int speed)
 {
 	static int buf_num_read = 0, buf_num_write = 0;
 
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	uint8_t *shmem_ptr = (uint8_t*)shmem_window(SHMEM_ADDR, 4096 * 4);
 	uint8_t *data_ptr = shmem_ptr + (buf_num_write * 4096);
-	if (header) {
-		ReadData(data_ptr);
-		memcpy(data_ptr + 12 , header, 4);
-	}
-	else {
-		ReadData(data_ptr);
-	}
+	cd_trace(CD_TRACE_SATURN, this->lba, 1);
+	if (!PrefetchGet(data_ptr)) ReadData(data_ptr);
+	if (header) memcpy(data_ptr + 12 , header, 4);
+	PrefetchFill();
 	int boot = (data_ptr[12] == 0x00 && data_ptr[13] == 0x02 && data_ptr[14] == 0x00 && data_ptr[15] == 0x01);
-	shmem_unmap(shmem_ptr, 4096 * 4);
 
 
 	buf_num_write++;
@@ -1141,14 +1091,13 @@ int satcdd_t::DataSectorSend(uint8_t* header, int speed)
 
 int satcdd_t::RingDataSend(uint8_t* header, int speed)
 {
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	uint8_t *shmem_ptr = (uint8_t*)shmem_window(SHMEM_ADDR, 4096 * 4);
 	uint8_t *data_ptr = shmem_ptr;
 	if (header) {
 		MakeSecureRingData(data_ptr);
 		memcpy(data_ptr + 12, header, 12);
 		memset(data_ptr + 2348, 0, 4);
 	}
-	shmem_unmap(shmem_ptr, 4096 * 4);
 
 	uint16_t mode = (speed == 2 ? 0x0101 : 0x0000) | 0x0404;
 
@@ -1164,11 +1113,10 @@ int satcdd_t::AudioSectorSend(int first)
 
 	if (first) buf_num_read = buf_num_write = 0;
 
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	uint8_t *shmem_ptr = (uint8_t*)shmem_window(SHMEM_ADDR, 4096 * 4);
 	uint8_t *data_ptr = shmem_ptr + (buf_num_write * 4096);
 
 	ReadCDDA(data_ptr, first);
-	shmem_unmap(shmem_ptr, 4096 * 4);
 
 	if (first) buf_num_write++;
 	buf_num_write++;
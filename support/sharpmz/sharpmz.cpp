@@ -41,6 +41,8 @@
 #include "../../menu.h"
 #include "../../debug.h"
 #include "../../user_io.h"
+#include "../../file_io.h"
+#include "../../offload.h"
 
 // Names of the supported machines.
 //
@@ -60,6 +62,22 @@ static sharpmz_tape_header_t tapeHeader;
 static tape_queue_t          tapeQueue;
 static unsigned char         debugEnabled = 0;
 
+// Queued tapes are read into RAM on the bulk worker as soon as they are queued,
+// so loading one from the poll loop is a copy out of memory and a single block
+// transfer. An image stays until its name has left the queue.
+//
+typedef struct
+{
+    char             *name;
+    char             *path;                            // Full path, read by the worker.
+    uint8_t          *data;                            // Whole MZF, set by the worker.
+    uint32_t          size;
+    offload_handle_t  job;
+} tape_image_t;
+
+static tape_image_t          tapeImages[MAX_TAPE_QUEUE];
+static uint8_t               tapeBuffer[MZ_TAPE_HEADER_SIZE + 65536];
+
 static uint32_t set_status(uint32_t new_status, uint32_t mask, int ex = 0)
 {
 	static uint32_t status[2] = { 0, 0 };
@@ -355,6 +373,114 @@ void sharpmz_init(void)
     sharpmz_debugf("Initialisation complete.");
 }
 
+// Find the preloaded image of a tape, 0 if there is none.
+//
+static tape_image_t *tape_find(const char *fileName)
+{
+    for(int i=0; i < MAX_TAPE_QUEUE; i++)
+    {
+        if(tapeImages[i].name != NULL && !strcmp(tapeImages[i].name, fileName)) return(&tapeImages[i]);
+    }
+    return(0);
+}
+
+// Release the images of tapes which are no longer queued.
+//
+static void tape_trim(void)
+{
+    for(int i=0; i < MAX_TAPE_QUEUE; i++)
+    {
+        tape_image_t *img = &tapeImages[i];
+        if(img->name == NULL) continue;
+
+        int queued = 0;
+        for(int j=0; j < tapeQueue.elements && !queued; j++)
+        {
+            queued = !strcmp(tapeQueue.queue[j], img->name);
+        }
+        if(queued) continue;
+
+        offload_wait(img->job);
+        free(img->name);
+        free(img->path);
+        free(img->data);
+        memset(img, 0, sizeof(tape_image_t));
+    }
+}
+
+// Start reading a queued tape into RAM.
+//
+static void tape_preload(const char *fileName)
+{
+    tape_trim();
+    if(tape_find(fileName)) return;
+
+    tape_image_t *img = 0;
+    for(int i=0; i < MAX_TAPE_QUEUE && !img; i++)
+    {
+        if(tapeImages[i].name == NULL) img = &tapeImages[i];
+    }
+    if(!img) return;
+
+    // file_io paths aren't thread safe, the worker gets the full path.
+    img->name = strdup(fileName);
+    img->path = strdup(getFullPath(fileName));
+    if(!img->name || !img->path)
+    {
+        free(img->name);
+        free(img->path);
+        img->name = img->path = NULL;
+        return;
+    }
+
+    img->job = offload_add_work([img]
+    {
+        int fd = open(img->path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0) return;
+
+        uint8_t *data = (uint8_t *)malloc(sizeof(tapeBuffer));
+        int len = data ? read(fd, data, sizeof(tapeBuffer)) : -1;
+        close(fd);
+
+        if(len >= MZ_TAPE_HEADER_SIZE)
+        {
+            img->data = data;
+            img->size = len;
+        } else
+        {
+            free(data);
+        }
+    }, OFFLOAD_PRIO_BULK);
+}
+
+// Whole image of a tape (header and data), preloaded or read from the file if
+// it isn't queued (or couldn't be preloaded). 0 if the file can't be opened.
+//
+static uint8_t *tape_fetch(const char *tapeFile, uint32_t *size)
+{
+    tape_image_t *img = tape_find(tapeFile);
+    if(img)
+    {
+        offload_wait(img->job);
+        if(img->data)
+        {
+            *size = img->size;
+            return(img->data);
+        }
+    }
+
+    fileTYPE file = {};
+    if (!FileOpen(&file, tapeFile)) return(0);
+
+    DISKLED_ON;
+    int len = FileReadAdv(&file, tapeBuffer, sizeof(tapeBuffer));
+    DISKLED_OFF;
+    FileClose(&file);
+
+    *size = (len > 0) ? len : 0;
+    return(tapeBuffer);
+}
+
 // Poll handler, perform any periodic tasks via this hook.
 //
 void sharpmz_poll(void)
@@ -452,6 +578,7 @@ void sharpmz_poll(void)
                     {
                         sharpmz_debugf("Loading tape: %s\n", fileName);
                         sharpmz_load_tape_to_ram(fileName, 1);
+                        tape_trim();
                     }
                 }
             }
@@ -475,7 +602,7 @@ void sharpmz_push_filename(char *fileName)
     // Locals.
     char *ptr = (char *)malloc(strlen(fileName)+1);
 
-    if(tapeQueue.elements > MAX_TAPE_QUEUE)
+    if(tapeQueue.elements >= MAX_TAPE_QUEUE)
     {
         free(ptr);
     } else
@@ -484,6 +611,7 @@ void sharpmz_push_filename(char *fileName)
         strcpy(ptr, fileName);
         tapeQueue.queue[tapeQueue.elements] = ptr;
         tapeQueue.elements++;
+        tape_preload(fileName);
     }
 
     return;
@@ -606,6 +734,7 @@ void sharpmz_clear_filelist(void)
     tapeQueue.elements    = 0;
     tapeQueue.tapePos     = 0;
     tapeQueue.fileName[0] = 0;
+    tape_trim();
 
     sharpmz_debugf("Cleared Tape Queue.");
 }
@@ -1898,7 +2027,7 @@ void sharpmz_send_file(romData_t &image, char *dirPrefix)
         //
         if(actualReadSize != 0)
         {
-            spi_write(sector_buffer, actualReadSize, 0);
+            spi_write_t<0, 1>(sector_buffer, actualReadSize);
         } else
         {
             // End of file, short file, so just move onto end.
@@ -1951,7 +2080,7 @@ short sharpmz_read_ram(const char *memDumpFile, short bank)
         //
         for (unsigned long j = 0; j < MZBANKSIZE[mb] or actualWriteSize == 0; j += actualWriteSize)
         {
-            spi_read(sector_buffer, 512, 0);
+            spi_read_t<0, 1>(sector_buffer, 512);
 
             DISKLED_ON;
             actualWriteSize=FileWriteAdv(&file, sector_buffer, MZBANKSIZE[mb] >= 512 ? 512 : MZBANKSIZE[mb]);
@@ -2011,7 +2140,7 @@ short sharpmz_read_tape_header(const char *tapeFile)
 //
 short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
 {
-    unsigned int  actualReadSize;
+    uint32_t      imageSize;
     unsigned long time = GetTimer(0);
   #if defined __SHARPMZ_DEBUG__
     char          fileName[17];
@@ -2019,22 +2148,19 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
 
     //sharpmz_debugf("Sending tape file:%s to emulator ram", tapeFile);
 
-    // Handle for the MZF file to be processed.
-    //
-    fileTYPE file = {};
-
-    // Try and open the tape file, exit if it cannot be opened.
+    // Whole MZF image, exit if the file cannot be opened.
     //
-    if (!FileOpen(&file, tapeFile)) return(1);
+    uint8_t *image = tape_fetch(tapeFile, &imageSize);
+    if (!image) return(1);
 
-    // Read in the tape header, this indicates crucial data such as data type, size, exec address, load address etc.
+    // The tape header indicates crucial data such as data type, size, exec address, load address etc.
     //
-    actualReadSize = sharpmz_file_read(&file, &tapeHeader, 128);
-    if(actualReadSize != 128)
+    if(imageSize < MZ_TAPE_HEADER_SIZE)
     {
-        sharpmz_debugf("Only read:%d bytes of header, aborting.\n", actualReadSize);
+        sharpmz_debugf("Only read:%d bytes of header, aborting.\n", imageSize);
         return(2);
     }
+    memcpy(&tapeHeader, image, MZ_TAPE_HEADER_SIZE);
 
     // Some sanity checks.
     //
@@ -2080,6 +2206,12 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
     if(dstCMT == 0 && tapeHeader.dataType != SHARPMZ_CMT_MC)
         return(3);
 
+    if(imageSize - MZ_TAPE_HEADER_SIZE < tapeHeader.fileSize)
+    {
+        sharpmz_debugf("Bad tape or corruption, data:%d, sizeHeader:%d", imageSize - MZ_TAPE_HEADER_SIZE, tapeHeader.fileSize);
+        return(4);
+    }
+
     // Reset Emulator if loading direct to RAM. This clears out memory, resets monitor and places it in a known state.
     //
     if(dstCMT == 0)
@@ -2102,24 +2234,8 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
         spi8(0x00);
     }
 
-    for (unsigned short i = 0; i < tapeHeader.fileSize && actualReadSize > 0; i += actualReadSize)
-    {
-        DISKLED_ON;
-        actualReadSize = sharpmz_file_read(&file, sector_buffer, 512);
-        DISKLED_OFF;
-
-        sharpmz_debugf("Bytes to read, actual:%d, index:%d, sizeHeader:%d", actualReadSize, i, tapeHeader.fileSize);
-
-        if(actualReadSize > 0)
-        {
-            // Write the sector (or part) to the fpga memory.
-            spi_write(sector_buffer, actualReadSize, 0);
-        } else
-        {
-            sharpmz_debugf("Bad tape or corruption, should never be 0, actual:%d, index:%d, sizeHeader:%d", actualReadSize, i, tapeHeader.fileSize);
-            return(4);
-        }
-    }
+    // Write the whole data partition to the fpga memory in one go.
+    spi_write_t<0, 1>(image + MZ_TAPE_HEADER_SIZE, tapeHeader.fileSize);
     DisableFpga();
 
     // signal end of transmission
@@ -2145,7 +2261,7 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
         spi8(0x00);                                       // Bits 7:0
     }
     //
-    spi_write((unsigned char *)&tapeHeader, MZ_TAPE_HEADER_SIZE, 0);
+    spi_write_t<0, 1>((unsigned char *)&tapeHeader, MZ_TAPE_HEADER_SIZE);
     //
     DisableFpga();
     EnableFpga();                                         // Finally indicate end of transmission.
@@ -2164,9 +2280,6 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
     }
 #endif
 
-    // Tidy up.
-    FileClose(&file);
-
 #ifdef __SHARPMZ_DEBUG_EXTRA__
     // Dump out the memory if needed (generally for debug purposes).
     if(dstCMT == 0)                                       // Load to emulators RAM
@@ -2245,7 +2358,7 @@ short sharpmz_save_tape_from_cmt(const char *tapeFile)
             {
                 writeSize = dataSize > 512 ? 512 : dataSize;
             }
-            spi_read(sector_buffer, writeSize, 0);
+            spi_read_t<0, 1>(sector_buffer, writeSize);
             if(mb == SHARPMZ_MEMBANK_CMT_HDR)
             {
                 memcpy(&tapeHeader, &sector_buffer, MZ_TAPE_HEADER_SIZE);
@@ -5,10 +5,14 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <glob.h>
+#include <atomic>
 
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../spi.h"
+#include "../../cfg.h"
+#include "../../offload.h"
+#include "../../counters.h"
 
 static uint8_t hdr[512];
 
@@ -26,17 +30,30 @@ enum HeaderField {
 	ResetVector = 0x3c,
 };
 
+// Header detection only looks at the banks the candidate headers are in: the
+// first 64KB and the 32KB below 0x410000 (ExHiROM). They are read into one
+// window, the rest of the ROM is read once by the transfer.
+#define WIN_LO_SIZE 0x10000
+#define WIN_EX_BASE 0x408000
+#define WIN_EX_SIZE 0x8000
+
+static uint32_t win_pos(uint32_t addr)
+{
+	return (addr >= WIN_EX_BASE) ? addr - WIN_EX_BASE + WIN_LO_SIZE : addr;
+}
+
 static uint32_t score_header(const uint8_t *data, uint32_t size, uint32_t addr)
 {
 	if (size < addr + 64) return 0;  //image too small to contain header at this location?
 	int score = 0;
 
-	uint16_t resetvector = data[addr + ResetVector] | (data[addr + ResetVector + 1] << 8);
-	uint16_t checksum = data[addr + Checksum] | (data[addr + Checksum + 1] << 8);
-	uint16_t complement = data[addr + Complement] | (data[addr + Complement + 1] << 8);
+	const uint8_t *h = data + win_pos(addr);
+	uint16_t resetvector = h[ResetVector] | (h[ResetVector + 1] << 8);
+	uint16_t checksum = h[Checksum] | (h[Checksum + 1] << 8);
+	uint16_t complement = h[Complement] | (h[Complement + 1] << 8);
 
-	uint8_t resetop = data[(addr & ~0x7fff) | (resetvector & 0x7fff)];  //first opcode executed upon reset
-	uint8_t mapper = data[addr + Mapper] & ~0x10;                      //mask off irrelevent FastROM-capable bit
+	uint8_t resetop = data[win_pos((addr & ~0x7fff) | (resetvector & 0x7fff))];  //first opcode executed upon reset
+	uint8_t mapper = h[Mapper] & ~0x10;                      //mask off irrelevent FastROM-capable bit
 
 																	   //$00:[0000-7fff] contains uninitialized RAM and MMIO.
 																	   //reset vector must point to ROM at $00:[8000-ffff] to be considered valid.
@@ -98,11 +115,11 @@ static uint32_t score_header(const uint8_t *data, uint32_t size, uint32_t addr)
 	if (addr == 0x007fc0 && mapper == 0x22) score += 2;  //0x22 is usually SDD1
 	if (addr == 0x40ffc0 && mapper == 0x25) score += 2;  //0x25 is usually ExHiROM
 
-	if (data[addr + Company] == 0x33) score += 2;        //0x33 indicates extended header
-	if (data[addr + RomType] < 0x08) score++;
-	if (data[addr + RomSize] < 0x10) score++;
-	if (data[addr + RamSize] < 0x08) score++;
-	if (data[addr + CartRegion] < 14) score++;
+	if (h[Company] == 0x33) score += 2;        //0x33 indicates extended header
+	if (h[RomType] < 0x08) score++;
+	if (h[RomSize] < 0x10) score++;
+	if (h[RamSize] < 0x08) score++;
+	if (h[CartRegion] < 14) score++;
 
 	if (score < 0) score = 0;
 	return score;
@@ -129,164 +146,168 @@ static uint32_t find_header(const uint8_t *data, uint32_t size)
 
 uint8_t* snes_get_header(fileTYPE *f)
 {
+	static uint8_t buf[WIN_LO_SIZE + WIN_EX_SIZE];
+
 	memset(hdr, 0, sizeof(hdr));
+	memset(buf, 0, sizeof(buf));
 	uint32_t size = f->size;
-	uint8_t *prebuf = (uint8_t*)malloc(size);
-	if (prebuf)
+	uint32_t skip = 0;
+	if (size & 512)
+	{
+		skip = 512;
+		size -= 512;
+	}
+
+	uint32_t len = (size < WIN_LO_SIZE) ? size : WIN_LO_SIZE;
+	if (FileReadAt(f, skip, buf, len))
 	{
-		FileSeekLBA(f, 0);
-		if (FileReadAdv(f, prebuf, size))
+		if (size > WIN_EX_BASE)
 		{
-			uint8_t *buf = prebuf;
+			len = (size - WIN_EX_BASE < WIN_EX_SIZE) ? size - WIN_EX_BASE : WIN_EX_SIZE;
+			FileReadAt(f, skip + WIN_EX_BASE, buf + WIN_LO_SIZE, len);
+		}
+
+		*(uint32_t*)(&hdr[8]) = size;
+
+		bool is_bsx_bios = false;
+		if (!memcmp(buf+0x7FC0, "Satellaview BS-X     ", 21)) {
+			is_bsx_bios = true;
+		}
 
-			if (size & 512)
+		uint32_t addr = find_header(buf, size);
+		if (addr)
+		{
+			const uint8_t *h = buf + win_pos(addr);
+			uint8_t ramsz = h[RamSize];
+			if (ramsz >= 0x08) ramsz = 0;
+
+			//re-calc rom size
+			uint8_t romsz = 15;
+			size--;
+			if (!(size & 0xFF000000))
 			{
-				buf += 512;
-				size -= 512;
+				while (!(size & 0x1000000))
+				{
+					romsz--;
+					size <<= 1;
+				}
 			}
 
-			*(uint32_t*)(&hdr[8]) = size;
-
-			bool is_bsx_bios = false;
-			if (!memcmp(buf+0x7FC0, "Satellaview BS-X     ", 21)) {
-				is_bsx_bios = true;
+			bool has_bsx_slot = false;
+			if (h[-14] == 'Z' && h[-11] == 'J' &&
+				((h[-13] >= 'A' && h[-13] <= 'Z') || (h[-13] >= '0' && h[-13] <= '9')) &&
+				(h[Company] == 0x33 || (h[-10] == 0x00 && h[-4] == 0x00)) ) {
+				has_bsx_slot = true;
 			}
 
-			uint32_t addr = find_header(buf, size);
-			if (addr)
-			{
-				uint8_t ramsz = buf[addr + RamSize];
-				if (ramsz >= 0x08) ramsz = 0;
+			//Rom type: 0-Low, 1-High, 2-ExHigh, 3-SpecialLoRom
+			hdr[1] = (addr == 0x00ffc0) ? 1 :
+					 (addr == 0x40ffc0) ? 2 :
+					 has_bsx_slot ? 3 :
+					 0;
 
-				//re-calc rom size
-				uint8_t romsz = 15;
-				size--;
-				if (!(size & 0xFF000000))
-				{
-					while (!(size & 0x1000000))
-					{
-						romsz--;
-						size <<= 1;
-					}
+			//BSX 3
+			if (is_bsx_bios) {
+				hdr[1] = 0x30;
+			}
+			else {
+
+				//DSPn types 8..B
+				if (h[Mapper] == 0x20 && h[RomType] == 0x03)
+				{	//DSP1
+					hdr[1] |= 0x84;
+				}
+				else if (h[Mapper] == 0x21 && h[RomType] == 0x03)
+				{	//DSP1B
+					hdr[1] |= 0x80;
+				}
+				else if (h[Mapper] == 0x30 && h[RomType] == 0x05 && h[Company] != 0xb2)
+				{	//DSP1B
+					hdr[1] |= 0x80;
+				}
+				else if (h[Mapper] == 0x31 && (h[RomType] == 0x03 || h[RomType] == 0x05))
+				{	//DSP1B
+					hdr[1] |= 0x80;
+				}
+				else if (h[Mapper] == 0x20 && h[RomType] == 0x05)
+				{	//DSP2
+					hdr[1] |= 0x90;
+				}
+				else if (h[Mapper] == 0x30 && h[RomType] == 0x05 && h[Company] == 0xb2)
+				{	//DSP3
+					hdr[1] |= 0xA0;
+				}
+				else if (h[Mapper] == 0x30 && h[RomType] == 0x03)
+				{	//DSP4
+					hdr[1] |= 0xB0;
+				}
+				else if (h[Mapper] == 0x30 && h[RomType] == 0xf6)
+				{	//ST010
+					hdr[1] |= 0x88;
+					ramsz = 1;
+					if (h[RomSize] < 10) hdr[1] |= 0x20; // ST011
+				}
+				else if (h[Mapper] == 0x30 && h[RomType] == 0x25)
+				{	//OBC1
+					hdr[1] |= 0xC0;
 				}
 
-				bool has_bsx_slot = false;
-				if (buf[addr - 14] == 'Z' && buf[addr - 11] == 'J' &&
-					((buf[addr - 13] >= 'A' && buf[addr - 13] <= 'Z') || (buf[addr - 13] >= '0' && buf[addr - 13] <= '9')) &&
-					(buf[addr + Company] == 0x33 || (buf[addr - 10] == 0x00 && buf[addr - 4] == 0x00)) ) {
-					has_bsx_slot = true;
+				if (h[Mapper] == 0x3a && (h[RomType] == 0xf5 || h[RomType] == 0xf9)) {
+					//SPC7110
+					hdr[1] |= 0xD0;
+					if (h[RomType] == 0xf9) hdr[1] |= 0x08; // with RTC
 				}
 
-				//Rom type: 0-Low, 1-High, 2-ExHigh, 3-SpecialLoRom
-				hdr[1] = (addr == 0x00ffc0) ? 1 :
-						 (addr == 0x40ffc0) ? 2 :
-						 has_bsx_slot ? 3 :
-						 0;
+				if (h[Mapper] == 0x35 && h[RomType] == 0x55)
+				{
+					//S-RTC (+ExHigh)
+					hdr[1] |= 0x08;
+				}
 
-				//BSX 3
-				if (is_bsx_bios) {
-					hdr[1] = 0x30;
+				//CX4 4
+				if (h[Mapper] == 0x20 && h[RomType] == 0xf3)
+				{
+					hdr[1] |= 0x40;
 				}
-				else {
-
-					//DSPn types 8..B
-					if (buf[addr + Mapper] == 0x20 && buf[addr + RomType] == 0x03)
-					{	//DSP1
-						hdr[1] |= 0x84;
-					}
-					else if (buf[addr + Mapper] == 0x21 && buf[addr + RomType] == 0x03)
-					{	//DSP1B
-						hdr[1] |= 0x80;
-					}
-					else if (buf[addr + Mapper] == 0x30 && buf[addr + RomType] == 0x05 && buf[addr + Company] != 0xb2)
-					{	//DSP1B
-						hdr[1] |= 0x80;
-					}
-					else if (buf[addr + Mapper] == 0x31 && (buf[addr + RomType] == 0x03 || buf[addr + RomType] == 0x05))
-					{	//DSP1B
-						hdr[1] |= 0x80;
-					}
-					else if (buf[addr + Mapper] == 0x20 && buf[addr + RomType] == 0x05)
-					{	//DSP2
-						hdr[1] |= 0x90;
-					}
-					else if (buf[addr + Mapper] == 0x30 && buf[addr + RomType] == 0x05 && buf[addr + Company] == 0xb2)
-					{	//DSP3
-						hdr[1] |= 0xA0;
-					}
-					else if (buf[addr + Mapper] == 0x30 && buf[addr + RomType] == 0x03)
-					{	//DSP4
-						hdr[1] |= 0xB0;
-					}
-					else if (buf[addr + Mapper] == 0x30 && buf[addr + RomType] == 0xf6)
-					{	//ST010
-						hdr[1] |= 0x88;
-						ramsz = 1;
-						if (buf[addr + RomSize] < 10) hdr[1] |= 0x20; // ST011
-					}
-					else if (buf[addr + Mapper] == 0x30 && buf[addr + RomType] == 0x25)
-					{	//OBC1
-						hdr[1] |= 0xC0;
-					}
-
-					if (buf[addr + Mapper] == 0x3a && (buf[addr + RomType] == 0xf5 || buf[addr + RomType] == 0xf9)) {
-						//SPC7110
-						hdr[1] |= 0xD0;
-						if (buf[addr + RomType] == 0xf9) hdr[1] |= 0x08; // with RTC
-					}
-
-					if (buf[addr + Mapper] == 0x35 && buf[addr + RomType] == 0x55)
-					{
-						//S-RTC (+ExHigh)
-						hdr[1] |= 0x08;
-					}
-
-					//CX4 4
-					if (buf[addr + Mapper] == 0x20 && buf[addr + RomType] == 0xf3)
-					{
-						hdr[1] |= 0x40;
-					}
-
-					//SDD1 5
-					if (buf[addr + Mapper] == 0x32 && (buf[addr + RomType] == 0x43 || buf[addr + RomType] == 0x45))
-					{
-						if (romsz < 14) hdr[1] |= 0x50; // except Star Ocean un-SDD1
-					}
-
-					//SA1 6
-					if (buf[addr + Mapper] == 0x23 && (buf[addr + RomType] == 0x32 || buf[addr + RomType] == 0x34 || buf[addr + RomType] == 0x35))
-					{
-						hdr[1] |= 0x60;
-					}
-
-					//GSU 7
-					if (buf[addr + Mapper] == 0x20 && (buf[addr + RomType] == 0x13 || buf[addr + RomType] == 0x14 || buf[addr + RomType] == 0x15 || buf[addr + RomType] == 0x1a))
-					{
-						ramsz = buf[addr - 3];
-						if (ramsz == 0xFF) ramsz = 5; //StarFox
-						if (ramsz > 6) ramsz = 6;
-						hdr[1] |= 0x70;
-					}
-
-					//1..2,E..F - reserved for other mappers.
+
+				//SDD1 5
+				if (h[Mapper] == 0x32 && (h[RomType] == 0x43 || h[RomType] == 0x45))
+				{
+					if (romsz < 14) hdr[1] |= 0x50; // except Star Ocean un-SDD1
 				}
 
-				hdr[2] = 0;
+				//SA1 6
+				if (h[Mapper] == 0x23 && (h[RomType] == 0x32 || h[RomType] == 0x34 || h[RomType] == 0x35))
+				{
+					hdr[1] |= 0x60;
+				}
 
-				//PAL Regions
-				if ((buf[addr + CartRegion] >= 0x02 && buf[addr + CartRegion] <= 0x0C) || buf[addr + CartRegion] == 0x11)
+				//GSU 7
+				if (h[Mapper] == 0x20 && (h[RomType] == 0x13 || h[RomType] == 0x14 || h[RomType] == 0x15 || h[RomType] == 0x1a))
 				{
-					hdr[3] |= 1;
+					ramsz = h[-3];
+					if (ramsz == 0xFF) ramsz = 5; //StarFox
+					if (ramsz > 6) ramsz = 6;
+					hdr[1] |= 0x70;
 				}
 
-				hdr[0] = (ramsz << 4) | romsz;
-				printf("Size from header: 0x%X, calculated size: 0x%X\n", buf[addr + RomSize], romsz);
+				//1..2,E..F - reserved for other mappers.
+			}
+
+			hdr[2] = 0;
+
+			//PAL Regions
+			if ((h[CartRegion] >= 0x02 && h[CartRegion] <= 0x0C) || h[CartRegion] == 0x11)
+			{
+				hdr[3] |= 1;
 			}
-			*(uint32_t*)(&hdr[4]) = addr;
+
+			hdr[0] = (ramsz << 4) | romsz;
+			printf("Size from header: 0x%X, calculated size: 0x%X\n", h[RomSize], romsz);
 		}
-		FileSeekLBA(f, 0);
-		free(prebuf);
+		*(uint32_t*)(&hdr[4]) = addr;
 	}
+	FileSeekLBA(f, 0);
 	return hdr;
 }
 
@@ -327,11 +348,169 @@ void snes_patch_bs_header(fileTYPE *f, uint8_t *buf)
 #define MSU_AUDIO_TRACK_MOUNTED  2
 #define MSU_DATA_BASE            3
 
+#define MSU_SECTOR       1024
+#define MSU_SECTORS_SEC  173 // 44.1kHz 16 bit stereo
+#define MSU_CHUNK        16
+
 static char snes_romFileName[1024] = {};
 static char SelectedPath[1024] = {};
-static uint8_t buf[1024];
+static uint8_t buf[MSU_SECTOR];
 static char has_cd = 0;
 static fileTYPE f_audio = {};
+static int msu_sector = 0;
+
+// Read-ahead ring for the audio track, cdda_buffer seconds deep as the CD
+// audio rings. Sectors [pos, ready) are in RAM, [ready, fill) are being read
+// on the bulk offload worker. The first sectors at the loop point are kept
+// aside, so jumping back there doesn't wait for the storage.
+struct msu_audio_t
+{
+	uint8_t *buf;
+	int size;
+	int pos;
+	int fill;
+	int end;
+	std::atomic<int> ready;
+	offload_handle_t job;
+
+	uint8_t loop_buf[MSU_CHUNK * MSU_SECTOR];
+	int loop;
+	std::atomic<int> loop_ready;
+	offload_handle_t loop_job;
+};
+
+static msu_audio_t msu_audio = {};
+
+// cnt sectors from sector, the part beyond the end of the track is silence
+static void msu_read_sectors(int sector, int cnt, uint8_t *dst)
+{
+	int len = f_audio.size ? FileReadAt(&f_audio, (__off64_t)sector * MSU_SECTOR, dst, cnt * MSU_SECTOR) : 0;
+	if (len < 0) len = 0;
+	memset(dst + len, 0, cnt * MSU_SECTOR - len);
+}
+
+// stops the read-ahead, must be called before the track is closed
+static void msu_audio_drop()
+{
+	offload_wait(msu_audio.job);
+	offload_wait(msu_audio.loop_job);
+	msu_audio.job = 0;
+	msu_audio.loop_job = 0;
+	msu_audio.end = 0;
+	msu_audio.loop_ready = 0;
+}
+
+static void msu_audio_start(int sector)
+{
+	offload_wait(msu_audio.job);
+	msu_audio.job = 0;
+	msu_audio.pos = sector;
+	msu_audio.fill = sector;
+	msu_audio.ready = sector;
+}
+
+// queues the next chunk
+static void msu_audio_fill()
+{
+	msu_audio_t *ring = &msu_audio;
+	if (!offload_is_done(ring->job)) return;
+
+	// chunks don't wrap around the end of the ring, so they are read in one go
+	int pos = ring->fill % ring->size;
+	int cnt = ring->size - (ring->fill - ring->pos);
+	if (cnt > MSU_CHUNK) cnt = MSU_CHUNK;
+	if (cnt > ring->size - pos) cnt = ring->size - pos;
+	if (cnt > ring->end - ring->fill) cnt = ring->end - ring->fill;
+	if (cnt <= 0) return;
+
+	int first = ring->fill;
+	ring->job = offload_try_add_work([ring, first, cnt]
+	{
+		msu_read_sectors(first, cnt, ring->buf + (first % ring->size) * MSU_SECTOR);
+		ring->ready.store(first + cnt);
+	}, OFFLOAD_PRIO_BULK);
+
+	if (ring->job) ring->fill += cnt;
+}
+
+// Sets up the read-ahead for the newly opened track. Zip members are read
+// with seek + read, which can't be done off the main thread.
+static void msu_audio_mount()
+{
+	msu_audio_t *ring = &msu_audio;
+	int size = cfg.cdda_buffer * MSU_SECTORS_SEC;
+	if (!f_audio.size || !size || !(f_audio.filp || f_audio.mem || (f_audio.src && f_audio.src->threadsafe()))) return;
+
+	if (ring->size != size)
+	{
+		free(ring->buf);
+		ring->buf = (uint8_t *)malloc(size * MSU_SECTOR);
+		ring->size = ring->buf ? size : 0;
+		if (!ring->size) return;
+	}
+
+	// "MSU1" and the loop point in samples
+	uint8_t pcm_hdr[8] = {};
+	FileReadAt(&f_audio, 0, pcm_hdr, sizeof(pcm_hdr));
+	uint32_t loop = pcm_hdr[4] | (pcm_hdr[5] << 8) | (pcm_hdr[6] << 16) | ((uint32_t)pcm_hdr[7] << 24);
+
+	ring->end = (f_audio.size + MSU_SECTOR - 1) / MSU_SECTOR;
+	ring->loop = (int)((8 + (uint64_t)loop * 4) / MSU_SECTOR);
+	if (ring->loop >= ring->end) ring->loop = 0;
+
+	ring->loop_job = offload_add_work([ring]
+	{
+		msu_read_sectors(ring->loop, MSU_CHUNK, ring->loop_buf);
+		ring->loop_ready.store(MSU_CHUNK);
+	}, OFFLOAD_PRIO_BULK);
+
+	// playback mostly starts right after mounting
+	msu_audio_start(0);
+	msu_audio_fill();
+}
+
+static void msu_audio_read(int sector, uint8_t *out)
+{
+	msu_audio_t *ring = &msu_audio;
+	if (!ring->end)
+	{
+		msu_read_sectors(sector, 1, out);
+		return;
+	}
+
+	if (ring->pos != sector)
+	{
+		int head = sector - ring->loop;
+		if (head >= 0 && head < ring->loop_ready.load())
+		{
+			// the ring continues behind the kept sectors
+			memcpy(out, ring->loop_buf + head * MSU_SECTOR, MSU_SECTOR);
+			if (ring->pos != ring->loop + MSU_CHUNK) msu_audio_start(ring->loop + MSU_CHUNK);
+			msu_audio_fill();
+			return;
+		}
+
+		msu_audio_start(sector);
+		msu_audio_fill();
+	}
+	else if (ring->ready.load() <= sector)
+	{
+		counter_add(CNT_CDDA_UNDERRUN);
+	}
+
+	if (ring->ready.load() <= sector) offload_wait(ring->job);
+	if (ring->ready.load() > sector)
+	{
+		memcpy(out, ring->buf + (sector % ring->size) * MSU_SECTOR, MSU_SECTOR);
+		ring->pos++;
+	}
+	else
+	{
+		// the job didn't get into the queue
+		msu_read_sectors(sector, 1, out);
+	}
+	msu_audio_fill();
+}
 
 static void msu_send_command(uint64_t cmd)
 {
@@ -342,12 +521,10 @@ static void msu_send_command(uint64_t cmd)
 	DisableIO();
 }
 
-static int msu_send_data(fileTYPE *f, int idx)
+static int msu_send_data(int sector, int idx)
 {
 	int chunk = sizeof(buf);
-
-	memset(buf, 0, chunk);
-	if (f->size) FileReadAdv(f, buf, chunk);
+	msu_audio_read(sector, buf);
 
 	user_io_set_index(idx);
 	user_io_set_download(1);
@@ -360,6 +537,7 @@ static int msu_send_data(fileTYPE *f, int idx)
 void snes_msu_init(const char* name)
 {
 	static fileTYPE f = {};
+	msu_audio_drop();
 	FileClose(&f_audio);
 
 	memset(snes_romFileName, 0, 1024);
@@ -408,19 +586,22 @@ void snes_poll(void)
 		case 0x35:
 			snprintf(SelectedPath, sizeof(SelectedPath), "%s-%d.pcm", snes_romFileName, data);
 			printf("MSU: New track selected: %s\n", SelectedPath);
+			msu_audio_drop();
 			FileOpen(&f_audio, SelectedPath);
+			msu_sector = 0;
+			msu_audio_mount();
 			printf(f_audio.size ? "MSU: Track mounted\n" : "MSU: Track not found!\n");
 			msu_send_command((f_audio.size << 16) | MSU_AUDIO_TRACK_MOUNTED);
 			break;
 
 		case 0x36:
 			printf("MSU: Jump to offset: 0x%X\n", data * 1024);
-			FileSeek(&f_audio, data * 1024, SEEK_SET);
+			msu_sector = data;
 			// fallthrough
 
 		case 0x34:
 			// Next sector requested
-			msu_send_data(&f_audio, 2);
+			msu_send_data(msu_sector++, 2);
 			break;
 		}
 	}
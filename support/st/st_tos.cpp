@@ -8,6 +8,7 @@
 #include "../../debug.h"
 #include "../../user_io.h"
 #include "../../fpga_io.h"
+#include "../../cfg.h"
 #include "st_tos.h"
 
 #define ST_WRITE_MEMORY 0x08
@@ -39,7 +40,7 @@ static tos_config_t config;
 
 fileTYPE hdd_image[2] = {};
 
-static unsigned char dma_buffer[512];
+static unsigned char dma_buffer[512] __attribute__((aligned(4)));
 
 static const char *acsi_cmd_name(int cmd) {
 	static const char *cmdname[] = {
@@ -111,26 +112,20 @@ void tos_set_ar(int ar)
 	else config.system_ctrl &= ~TOS_CONTROL_VIDEO_AR2;
 }
 
+// transmitted bytes must be multiple of 2 (-> words), data 16-bit aligned
 static void memory_read(uint8_t *data, uint32_t words)
 {
 	EnableIO();
 	spi8(ST_READ_MEMORY);
-
-	// transmitted bytes must be multiple of 2 (-> words)
-	uint16_t *buf = (uint16_t*)data;
-	while (words--) *buf++ = spi_w(0);
-
+	spi_block_read_t<1, 1>(data, words * 2);
 	DisableIO();
 }
 
-static void memory_write(uint8_t *data, uint32_t words)
+static void memory_write(const uint8_t *data, uint32_t words)
 {
 	EnableIO();
 	spi8(ST_WRITE_MEMORY);
-
-	uint16_t *buf = (uint16_t*)data;
-	while (words--) spi_w(*buf++);
-
+	spi_block_write_t<1, 1>(data, words * 2);
 	DisableIO();
 }
 
@@ -151,7 +146,7 @@ static void dma_nak()
 
 static void handle_acsi(unsigned char *buffer)
 {
-	static uint8_t buf[65536];
+	static uint8_t buf[65536] __attribute__((aligned(4)));
 
 	static uint8_t asc[2] = { 0,0 };
 	uint8_t target = buffer[10] >> 5;
@@ -241,16 +236,26 @@ static void handle_acsi(unsigned char *buffer)
 				if (lba + length <= blocks)
 				{
 					DISKLED_ON;
-					FileSeekLBA(&hdd_image[target], lba);
-					while (length)
+					// the next chunks are read on the worker while the current one goes out
+					FileSeek(&hdd_image[target], (__off64_t)lba << 9, SEEK_SET);
 					{
-						uint32_t len = length;
-						if (len > 128) len = 128;
-						length -= len;
-
-						len *= 512;
-						FileReadAdv(&hdd_image[target], buf, len);
-						memory_write(buf, len / 2);
+						fileReadAhead ra(&hdd_image[target], length * 512, 64 * 1024);
+						uint32_t len, left = length * 512;
+						uint8_t *data;
+						while ((data = ra.next(&len)))
+						{
+							memory_write(data, len / 2);
+							left -= len;
+						}
+
+						// a failed read still sends the full length, the DMA expects it
+						bzero(buf, sizeof(buf));
+						while (left)
+						{
+							len = (left > sizeof(buf)) ? sizeof(buf) : left;
+							memory_write(buf, len / 2);
+							left -= len;
+						}
 					}
 					DISKLED_OFF;
 
@@ -291,7 +296,7 @@ static void handle_acsi(unsigned char *buffer)
 				if (lba + length <= blocks)
 				{
 					DISKLED_ON;
-					FileSeekLBA(&hdd_image[target], lba);
+					__off64_t ofs = (__off64_t)lba << 9;
 					while (length)
 					{
 						uint32_t len = length;
@@ -300,7 +305,8 @@ static void handle_acsi(unsigned char *buffer)
 
 						len *= 512;
 						memory_read(buf, len / 2);
-						FileWriteAdv(&hdd_image[target], buf, len);
+						FileWriteAt(&hdd_image[target], ofs, buf, len);
+						ofs += len;
 					}
 					DISKLED_OFF;
 					dma_ack(0x00);
@@ -384,7 +390,7 @@ static void get_dmastate()
 
 	EnableIO();
 	spi8(ST_GET_DMASTATE);
-	spi_read(buffer, 16, 0);
+	spi_read_t<0, 1>(buffer, 16);
 	DisableIO();
 
 	if (buffer[10] & 0x01) handle_acsi(buffer);
@@ -516,6 +522,7 @@ static void tos_select_hdd_image(int i, const char *name)
 	{
 		if (FileOpenEx(&hdd_image[i], name, (O_RDWR | O_SYNC)))
 		{
+			FileSetCache(&hdd_image[i], cfg.hdd_cache);
 			config.system_ctrl |= (TOS_ACSI0_ENABLE << i);
 		}
 	}
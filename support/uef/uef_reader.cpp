@@ -47,245 +47,157 @@
 #define UEF_stopBit     1
 #define UEF_Baud        (1000000.0/(16.0*52.0))
 
+// One chunk that produces bits on the tape, indexed once from the
+// uncompressed image in memory.
 typedef struct {
-    // UEF header
     uint16_t    id;
+    uint32_t    offset;         // chunk data in the image
     uint32_t    length;
-    // chunk data
-    uint32_t    file_offset;
-    uint32_t    bit_offset_start;
-    uint32_t    bit_offset_end;
+    uint32_t    bits;
     uint32_t    pre_carrier;
-} __attribute__((packed)) ChunkInfo;
+} ChunkInfo;
 
-// TODO - allocate this as part of the desc structure
-static ChunkInfo s_ChunkData = { 0,0,0,0,0,0 };
+static uint16_t rd16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t rd32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
 
-
-
-static uint16_t ReadChunkHeader(FILE* f, ChunkInfo* chunk)
+static float rdfloat(const uint8_t *p)
 {
-    chunk->id = -1;
-    chunk->length = 0;
-
-    if (fread(chunk, 1, UEF_ChunkHeaderSize, f) != UEF_ChunkHeaderSize) {
-        return (-1);
-    }
-
-    //fprintf(stderr, "ReadChunkHeader: chunk->id %d chunk->length %d\n", chunk->id,chunk->length);
-    return chunk->id;
+    float f;
+    memcpy(&f, p, sizeof(f));
+    return f;
 }
 
-static ChunkInfo* GetChunkAtPosFile(FILE *f, uint32_t* p_bit_pos)
+// returns the number of chunks in list (malloc'd), the total bits in numbits
+static int UEF_IndexChunks(const uint8_t *data, uint32_t size, ChunkInfo **list, uint32_t *numbits)
 {
-    uint32_t bit_pos = *p_bit_pos;
-    uint8_t length_check = (bit_pos == 0xffffffff);
-    ChunkInfo* chunk = &s_ChunkData;
-
-    //fprintf(stderr, "Find pos : %d\n", bit_pos);
-
-    if (chunk->bit_offset_start <= bit_pos && bit_pos < chunk->bit_offset_end) {
-        bit_pos -= chunk->bit_offset_start;
-        *p_bit_pos = bit_pos;
-        return chunk;
-    }
-
-    uint32_t chunk_start = 0;
-    uint32_t chunk_bitlen = 0;
-
-    if (chunk->bit_offset_end != 0 && bit_pos >= chunk->bit_offset_end) {
-        fseek(f, chunk->file_offset + chunk->length, SEEK_SET);
-        chunk_start = chunk->bit_offset_end;
-        bit_pos -= chunk_start;
-
-    } else {
-        fseek(f, 12, SEEK_SET);     // sizeof(UEF_header)
-    }
-
-    chunk->bit_offset_end = 0;
-
-    while (!feof(f)) {
-        uint16_t id = ReadChunkHeader(f, chunk);
-
-        if (id == (uint16_t) - 1) {
-            break;
-        }
-
-        //fprintf(stderr, "Parse ChunkID : %04x - Length : %4d bytes (%04x) - Offset = %d\n", chunk->id, chunk->length, chunk->length, (uint32_t)ftell(f));
-        chunk->file_offset = ftell(f);
-
-        if (UEF_tapeID == id || UEF_gapID == id || UEF_highToneID == id || UEF_highDummyID == id) {
-
-            if (id == UEF_tapeID) {
-                chunk_bitlen = chunk->length * 10;
-
-            } else if (id == UEF_gapID || id == UEF_highToneID) {
-                uint16_t ms;
+    int num = 0, max = 0;
+    uint32_t total = 0;
+    uint32_t pos = 12;      // sizeof(UEF_header)
 
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
-                    break;
-                }
+    *list = 0;
 
-                chunk_bitlen = ms * (UEF_Baud / 1000.0);
-                fseek(f, -sizeof(ms), SEEK_CUR);
+    while (pos + UEF_ChunkHeaderSize <= size) {
+        ChunkInfo chunk = {};
+        chunk.id = rd16(data + pos);
+        chunk.length = rd32(data + pos + 2);
+        chunk.offset = pos + UEF_ChunkHeaderSize;
 
-            } else if (id == UEF_highDummyID) {
-                uint16_t ms;
+        uint32_t left = size - chunk.offset;
+        const uint8_t *p = data + chunk.offset;
+        uint16_t id = chunk.id;
 
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
-                    break;
-                }
+        //fprintf(stderr, "Parse ChunkID : %04x - Length : %4d bytes (%04x) - Offset = %d\n", chunk.id, chunk.length, chunk.length, chunk.offset);
 
-                chunk->pre_carrier = ms * (UEF_Baud / 1000.0);
+        if (id == UEF_tapeID) {
+            chunk.bits = chunk.length * 10;
 
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
-                    break;
-                }
+        } else if (id == UEF_gapID || id == UEF_highToneID) {
+            if (left < 2) break;
+            chunk.bits = rd16(p) * (UEF_Baud / 1000.0);
 
-                uint32_t post_carrier = ms * (UEF_Baud / 1000.0);
-                chunk_bitlen = chunk->pre_carrier + 20 + post_carrier;
-                fseek(f, -sizeof(ms) * 2, SEEK_CUR);
-            }
-
-            if (bit_pos < chunk_bitlen) {
-                chunk->bit_offset_start = chunk_start;
-                chunk->bit_offset_end = chunk_start + chunk_bitlen;
-                break;
-            }
-
-            bit_pos -= chunk_bitlen;
-            chunk_start += chunk_bitlen;
-
-        } else if (length_check) {
-
-            if (UEF_infoID == id) {
-                char buffer[64];
-                uint32_t length = chunk->length;
-
-                while (length > 0) {
-                    uint32_t read_len = length;
-
-                    if (read_len > sizeof(buffer) - 1) {
-                        read_len = sizeof(buffer) - 1;
-                    }
-
-                    if (fread(buffer, 1, read_len, f) != read_len) {
-                        break;
-                    }
-
-                    buffer[read_len] = '\0';
-                    fprintf(stderr, "Drv02:UEF Info : '%s'", buffer);
-
-                    length -= read_len;
-                }
+        } else if (id == UEF_highDummyID) {
+            if (left < 4) break;
+            chunk.pre_carrier = rd16(p) * (UEF_Baud / 1000.0);
+            uint32_t post_carrier = rd16(p + 2) * (UEF_Baud / 1000.0);
+            chunk.bits = chunk.pre_carrier + 20 + post_carrier;
 
-            } else if (UEF_freqChgID == id) {
-                float freq;
+        } else if (UEF_infoID == id) {
+            fprintf(stderr, "Drv02:UEF Info : '%.*s'", (int)(chunk.length < left ? chunk.length : left), (const char*)p);
 
-                if (fread(&freq, 1, sizeof(freq), f) != sizeof(freq)) {
-                    break;
-                }
+        } else if (UEF_freqChgID == id) {
+            if (left < 4) break;
+            fprintf(stderr, "Drv02:Ignoring base frequency change : %d", (int)rdfloat(p));
 
-                fprintf(stderr, "Drv02:Ignoring base frequency change : %d", (int)freq);
+        } else if (UEF_floatGapID == id) {
+            if (left < 4) break;
+            fprintf(stderr, "Drv02:Ignoring floating point gap : %d ms", (int)(rdfloat(p) * 1000.f));
 
-            } else if (UEF_floatGapID == id) {
-                float gap;
+        } else if (UEF_securityID == id) {
+            fprintf(stderr, "Drv02:UEF security block ignored");
 
-                if (fread(&gap, 1, sizeof(gap), f) != sizeof(gap)) {
-                    break;
-                }
-
-                fprintf(stderr, "Drv02:Ignoring floating point gap : %d ms", (int)(gap * 1000.f));
-
-            } else if (UEF_securityID == id) {
-
-                fprintf(stderr, "Drv02:UEF security block ignored");
+        } else {
+            fprintf(stderr, "Drv02:Unknown UEF block ID %04x", id);
+        }
 
-            } else {
-                fprintf(stderr, "Drv02:Unknown UEF block ID %04x", id);
+        if (chunk.bits) {
+            if (num == max) {
+                max = max ? max * 2 : 64;
+                ChunkInfo *l = (ChunkInfo*)realloc(*list, max * sizeof(ChunkInfo));
+                if (!l) break;
+                *list = l;
             }
-
-            fseek(f, chunk->file_offset, SEEK_SET);
+            (*list)[num++] = chunk;
+            total += chunk.bits;
         }
 
-        fseek(f, chunk->length, SEEK_CUR);
+        if (chunk.length >= left) break;
+        pos = chunk.offset + chunk.length;
     }
 
-    /*DEBUG(1, "OK!");*/
-
-    *p_bit_pos = bit_pos;
-    return chunk->bit_offset_end ? chunk : 0;
+    *numbits = total;
+    return num;
 }
 
-static uint8_t GetBitAtPos(FILE *f, uint32_t bit_pos)
+// Bits go msb first into a zeroed buffer, so gaps are just skipped.
+typedef struct {
+    uint8_t     *buf;
+    uint32_t    pos;
+} BitWriter;
+
+static inline void PutBit(BitWriter *w, int bit)
 {
-    ChunkInfo* info = GetChunkAtPosFile(f, &bit_pos);
+    if (bit) w->buf[w->pos >> 3] |= 0x80 >> (w->pos & 7);
+    w->pos++;
+}
 
-    if (!info) {
-        return 0;
-    }
+static void PutOnes(BitWriter *w, uint32_t n)
+{
+    while (n && (w->pos & 7)) PutBit(w, 1), n--;
+    memset(w->buf + (w->pos >> 3), 0xFF, n >> 3);
+    w->pos += n & ~7;
+    n &= 7;
+    while (n--) PutBit(w, 1);
+}
 
-    uint16_t id = info->id;
+// start bit, 8 data bits lsb first, stop bit
+static void PutByte(BitWriter *w, uint8_t byte)
+{
+    uint32_t code = (UEF_stopBit << 9) | (byte << 1) | UEF_startBit;
+    for (int i = 0; i < 10; i++) PutBit(w, (code >> i) & 1);
+}
 
-    if (id == UEF_gapID) {
-        return 0;
+static void UEF_Encode(const uint8_t *data, uint32_t size, const ChunkInfo *list, int num, uint8_t *out)
+{
+    BitWriter w = { out, 0 };
 
-    } else if (id == UEF_highToneID) {
-        return 1;
-    }
+    for (int i = 0; i < num; i++) {
+        const ChunkInfo *chunk = &list[i];
 
-    if (id == UEF_tapeID) {
+        if (chunk->id == UEF_gapID) {
+            w.pos += chunk->bits;
 
-        uint32_t byte_offset = bit_pos / 10;
-        uint32_t bit_offset = bit_pos - byte_offset * 10;
+        } else if (chunk->id == UEF_highToneID) {
+            PutOnes(&w, chunk->bits);
 
-        if (bit_offset == 0) {
-            return UEF_startBit;
-        }
+        } else if (chunk->id == UEF_tapeID) {
+            // data past the end of a truncated image is sent as zeros
+            uint32_t avail = chunk->offset < size ? size - chunk->offset : 0;
+            for (uint32_t n = 0; n < chunk->length; n++) PutByte(&w, n < avail ? data[chunk->offset + n] : 0);
 
-        if (bit_offset == 9) {
-            return UEF_stopBit;
+        } else {
+            // high tone with a dummy byte 'A' inside
+            PutOnes(&w, chunk->pre_carrier);
+            PutByte(&w, 'A');
+            PutByte(&w, 'A');
+            PutOnes(&w, chunk->bits - chunk->pre_carrier - 20);
         }
-
-        uint8_t byte;
-        fseek(f, info->file_offset + byte_offset, SEEK_SET);
-        int ret=fread(&byte, 1, sizeof(byte), f);
-        if (ret<0) fprintf(stderr,"uef: error reading byte\n");
-
-        bit_offset -= 1;        // E (0,7)
-        assert(bit_offset < 8);
-
-        return (byte & (1 << bit_offset)) ? 1 : 0;
-    }
-
-    assert(id == UEF_highDummyID);
-
-    if ((bit_pos < info->pre_carrier) || (bit_pos >= info->pre_carrier + 20)) {
-        return 1;
-    }
-
-    bit_pos -= info->pre_carrier;
-    bit_pos %= 10;
-
-    if (bit_pos == 0) {
-        return UEF_startBit;
-    }
-
-    if (bit_pos == 9) {
-        return UEF_stopBit;
     }
-
-    bit_pos -= 1;       // E (0,7)
-    assert(bit_pos < 8);
-    uint8_t byte = 'A';
-
-    return (byte & (1 << bit_pos)) ? 1 : 0;
 }
 
 #define BUFLEN      16384
 #define CHUNK 16384
 
-#define kBufferSize 4096
+#define kBufferSize (64 * 1024)
 
 static int uef_copy_file(fileTYPE *source, FILE *dest)
 {
@@ -392,9 +304,7 @@ static int uef_inflate_file(fileTYPE *source, FILE *dest)
 
 int UEF_FileSend(fileTYPE *inputfile,int use_progress)
 {
-        uint32_t buf_size=kBufferSize;
-        unsigned char fbuf[kBufferSize];
-        int addr=0;
+        unsigned char fbuf[2];
 
         typedef struct {
             char    ueftag[10];
@@ -403,9 +313,6 @@ int UEF_FileSend(fileTYPE *inputfile,int use_progress)
         } UEF_header;
         UEF_header header;
 
-
-
-
         // the UAE file might be gzipped, if so we need to ungzip it
         // gzip : 1f 8b
         if ( FileReadAdv(inputfile, &fbuf,2) !=2)
@@ -417,6 +324,7 @@ int UEF_FileSend(fileTYPE *inputfile,int use_progress)
         FileSeek(inputfile, 0, SEEK_SET);
 
         FILE *uncompressed_file= tmpfile();
+        if (!uncompressed_file) return 0;
 
         // 1f 8b is the gzip magic number
         if (fbuf[0]==0x1f && fbuf[1]==0x8b) {
@@ -428,84 +336,63 @@ int UEF_FileSend(fileTYPE *inputfile,int use_progress)
             fprintf(stderr,"UEF is not compressed\n");
         }
 
+        // the whole image is decoded from memory
+        fseek(uncompressed_file, 0L, SEEK_END);
+        uint32_t size =ftell(uncompressed_file);
         rewind(uncompressed_file);
 
-        if (fread(&header, 1, sizeof(UEF_header), uncompressed_file) != sizeof(UEF_header)) {
+        uint8_t *data = (uint8_t*)malloc(size ? size : 1);
+        if (!data || fread(data, 1, size, uncompressed_file) != size) size = 0;
+        fclose(uncompressed_file);
+
+        if (size < sizeof(UEF_header)) {
             fprintf(stderr,"Couldn't read file header\n");
+            free(data);
+            return 0;
+        }
 
-        } else if (memcmp(header.ueftag, "UEF File!\0", sizeof(header.ueftag)) != 0) {
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.ueftag, "UEF File!\0", sizeof(header.ueftag)) != 0) {
             fprintf(stderr,"UEF file header mismatch\n");
             fprintf(stderr,"File compressed?\n");
+            free(data);
+            return 0;
+        }
 
-        } else {
-            fprintf(stderr,"UEF: %s %d %d\n",header.ueftag,header.minor_version,header.major_version);
-
-            // figure out how big the file is
-            fseek(uncompressed_file, 0L, SEEK_END);
-            uint32_t size =ftell(uncompressed_file);
-            fprintf(stderr,"size: %d\n",size);
-            rewind(uncompressed_file);
-//FILE *outfile = fopen("tape.raw","wb");
-
-
-            //
-            //  Read the header to find out how big the audio file should be
-            //
-            memset(&s_ChunkData, 0x00, sizeof(ChunkInfo));
-            uint32_t numbits = 0xffffffff;
-            GetChunkAtPosFile(uncompressed_file,&numbits);
-
-            numbits = ~numbits;
-
-            uint32_t bits_per_second = 1225;
-            fprintf(stderr, "Bit length  : %d\n", numbits);
-            fprintf(stderr, "Wave length : %ds\n", numbits / bits_per_second);
-            fprintf(stderr, "Byte length : %d\n", (numbits + 7) / 8);
-
-            // size is the output size of the file we are creating (or dynamically sending)
-            size= (numbits + 7) / 8;
-            uint32_t  orig_size=size;
-
-            fprintf(stderr,"output size: %d\n",size);
-
-            // clear the header
-            memset(&s_ChunkData, 0x00, sizeof(ChunkInfo));
-            uint32_t tot_size=0;
-            uint32_t cur_size=0;
-            uint32_t act_size=0;
-
-            while (size) {
-                cur_size= size;
-                if (cur_size>  buf_size) cur_size=buf_size;
-                act_size=cur_size;
-                // artifically clamp size to the end of the bit stream
-                if (addr + act_size >  orig_size)
-                   act_size = orig_size  - addr;
-
-               tot_size+=act_size;
-               // this is a very naive conversion, but it'll have to do for now..
-               for (uint32_t pos = 0; pos < act_size; ++pos) {
-                   uint8_t val = 0;
-                   for (uint32_t bit = 0; bit < 8; ++bit) {
-                      val = val << 1;
-                      val = val | GetBitAtPos(uncompressed_file, ((addr + pos) << 3) + bit);
-                   }
-
-                   fbuf[pos] = val;
-               }
-               if (use_progress) ProgressMessage("Loading", inputfile->name, orig_size-size  , orig_size);
-               user_io_file_tx_data(fbuf, act_size);
-               if (act_size!=cur_size)
-                  fprintf(stderr,"truncated?\n");
-//fwrite(fbuf,1,act_size,outfile);
-               size -= cur_size;
-               addr += cur_size;
-            }
-         fclose(uncompressed_file);
+        fprintf(stderr,"UEF: %s %d %d\n",header.ueftag,header.minor_version,header.major_version);
+        fprintf(stderr,"size: %d\n",size);
 
-//fclose(outfile);
-      }
-  return 0;
-}
+        //
+        //  Index the chunks to find out how big the audio file should be
+        //
+        ChunkInfo *list;
+        uint32_t numbits;
+        int num = UEF_IndexChunks(data, size, &list, &numbits);
+
+        uint32_t bits_per_second = 1225;
+        fprintf(stderr, "Bit length  : %d\n", numbits);
+        fprintf(stderr, "Wave length : %ds\n", numbits / bits_per_second);
+        fprintf(stderr, "Byte length : %d\n", (numbits + 7) / 8);
+
+        // size is the output size of the file we are creating
+        uint32_t orig_size = (numbits + 7) / 8;
+        fprintf(stderr,"output size: %d\n",orig_size);
+
+        uint8_t *out = (uint8_t*)calloc(orig_size ? orig_size : 1, 1);
+        if (out) {
+            UEF_Encode(data, size, list, num, out);
 
+            for (uint32_t addr = 0; addr < orig_size; addr += kBufferSize) {
+                uint32_t act_size = orig_size - addr;
+                if (act_size > kBufferSize) act_size = kBufferSize;
 
+                if (use_progress) ProgressMessage("Loading", inputfile->name, addr, orig_size);
+                user_io_file_tx_data(out + addr, act_size);
+            }
+            free(out);
+        }
+
+        free(list);
+        free(data);
+        return 0;
+}
@@ -31,6 +31,7 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include "../../spi.h"
 #include "../../user_io.h"
@@ -38,6 +39,7 @@
 #include "../../fpga_io.h"
 #include "../../shmem.h"
 #include "../../ide.h"
+#include "../../shcache.h"
 #include "x86_share.h"
 
 #define FDD0_BASE   0xF200
@@ -216,28 +218,27 @@ static x86_config config = {};
 
 struct hddInfo* FindHDDInfoBySize(uint64_t size)
 {
-	struct hddInfo* fi;
-	uint64_t size_chs;
-	bool is_chs = false;
-
+	// image sizes of the table, worked out on the first lookup
+	static uint64_t hdd_sizes[127] = {};
+	if (!hdd_sizes[0])
+	{
+		for (int i = 0; i < 127; i++) hdd_sizes[i] = (uint64_t)hdd_table[i][0] * hdd_table[i][1] * hdd_table[i][2] * 512;
+	}
 
 	for (int i = 0; i < 127; i++)
 	{
-		size_chs = hdd_table[i][0] * hdd_table[i][1] * hdd_table[i][2] * 512;
-		if (size == size_chs)
+		if (size == hdd_sizes[i])
 		{
-			fi = hddInfos;
+			struct hddInfo* fi = hddInfos;
 			fi->size = size;
 			fi->cylinders = hdd_table[i][0];
 			fi->heads = hdd_table[i][1];
 			fi->sectors = hdd_table[i][2];
-			is_chs = true;
-			break;
+			return fi;
 		}
 	}
 
-	if (!is_chs) fi = NULL;
-	return(fi);
+	return NULL;
 }
 
 /*
@@ -261,6 +262,9 @@ static void x86_dma_set(uint32_t address, uint32_t data)
 	DisableIO();
 }
 
+// Memory is written in 16-bit halves of every dword. The FDD and other high
+// regions of older cores take one byte (FDD0_BASE read: one dword) per ACKed
+// transfer instead, cores announcing DMA16 use the block format everywhere.
 static void x86_dma_sendbuf(uint32_t address, uint32_t length, uint32_t *data)
 {
 	EnableIO();
@@ -268,7 +272,7 @@ static void x86_dma_sendbuf(uint32_t address, uint32_t length, uint32_t *data)
 	fpga_spi_fast(address);
 	fpga_spi_fast(0);
 
-	if(address < FDD0_BASE) fpga_spi_fast_block_write((uint16_t*)data, length * 2);
+	if(address < FDD0_BASE || user_io_dma_wide()) fpga_spi_fast_block_write((uint16_t*)data, length * 2);
 	else
 	{
 		uint8_t *buf = (uint8_t*)data;
@@ -285,7 +289,7 @@ static void x86_dma_recvbuf(uint32_t address, uint32_t length, uint32_t *data)
 	fpga_spi_fast(address);
 	fpga_spi_fast(0);
 
-	if (address < FDD0_BASE) fpga_spi_fast_block_read((uint16_t*)data, length * 2);
+	if (address < FDD0_BASE || user_io_dma_wide()) fpga_spi_fast_block_read((uint16_t*)data, length * 2);
 	else if (address == FDD0_BASE)
 	{
 		while (length--) *data++ = spi_w(0);
@@ -299,15 +303,37 @@ static void x86_dma_recvbuf(uint32_t address, uint32_t length, uint32_t *data)
 	DisableIO();
 }
 
+// BIOS images are kept in the persistent cache by path, size and mtime, so
+// a core reload doesn't read them from the SD card again.
 static int load_bios(const char* name, uint8_t index)
 {
+	static uint8_t bios[BIOS_SIZE];
+
 	printf("BIOS: %s\n", name);
 
+	char key[1100] = {};
+	struct stat64 st;
+	const char *path = getFullPath(name);
+	if (!stat64(path, &st) && S_ISREG(st.st_mode)) snprintf(key, sizeof(key), "%s@%lld.%lld", path, (long long)st.st_size, (long long)st.st_mtime);
+
+	size_t len = 0;
+	uint8_t *rec = *key ? (uint8_t*)shcache_load(key, &len) : 0;
+	if (rec && len <= BIOS_SIZE) memcpy(bios, rec, len);
+	else
+	{
+		int sz = FileLoad(name, bios, BIOS_SIZE);
+		len = (sz > 0) ? sz : 0;
+		if (len && *key) shcache_store(key, bios, len);
+	}
+	free(rec);
+
+	// one pass over the uncached window instead of clearing it first
+	memset(bios + len, 0, BIOS_SIZE - len);
+
 	void *buf = shmem_map(SHMEM_ADDR + (index ? 0xC0000 : 0xF0000), BIOS_SIZE);
 	if (!buf) return 0;
 
-	memset(buf, 0, BIOS_SIZE);
-	FileLoad(name, buf, BIOS_SIZE);
+	memcpy(buf, bios, BIOS_SIZE);
 	shmem_unmap(buf, BIOS_SIZE);
 
 	return 1;
@@ -354,14 +380,12 @@ static bool boot_from_floppy = 1;
 
 static int img_read(fileTYPE *f, uint32_t lba, void *buf, uint32_t cnt)
 {
-	if (!FileSeekLBA(f, lba)) return 0;
-	return FileReadAdv(f, buf, cnt * 512);
+	return FileReadAt(f, (__off64_t)lba << 9, buf, cnt * 512);
 }
 
 static uint32_t img_write(fileTYPE *f, uint32_t lba, void *buf, uint32_t cnt)
 {
-	if (!FileSeekLBA(f, lba)) return 0;
-	return FileWriteAdv(f, buf, cnt * 512);
+	return FileWriteAt(f, (__off64_t)lba << 9, buf, cnt * 512);
 }
 
 static void fdd_set(int num, char* filename)
@@ -470,16 +494,15 @@ static void hdd_set(int num, char* filename)
 	if(!present && vhd) present = ide_img_mount(&ide_image[num], filename, 1);
 	if (!cd && is_pcxt())
 	{
-		FILE* fd;
 		uint64_t size;
 		struct hddInfo* hdd_fi;
+		struct stat64 st;
 
+		// the mounted image knows its size, stat() covers the rest
 		const char* path = getFullPath(filename);
-		fd = fopen(path, "r");
-		if (fd)
+		if (present || !stat64(path, &st))
 		{
-			fseek(fd, 0L, SEEK_END);
-			size = ftello64(fd);
+			size = present ? ide_image[num].size : st.st_size;
 			if ((hdd_fi = FindHDDInfoBySize(size)))
 			{
 				ide_img_set(num, present ? &ide_image[num] : 0, cd, hdd_fi->sectors, hdd_fi->heads);
@@ -672,11 +695,16 @@ static void fdd_io(uint8_t read)
 	{
 		//printf("Read: 0x%08x, %d, %d\n", basereg, sd_params.lba, sd_params.cnt);
 
+		// the whole multi-sector request in one burst if the core can take it
+		uint32_t cnt = (user_io_dma_wide() && sd_params.cnt > 1 && sd_params.cnt <= 16) ? sd_params.cnt : 1;
+
 		if (img->size)
 		{
-			if (img_read(img, sd_params.lba, &secbuf, 1))
+			int len = img_read(img, sd_params.lba, &secbuf, cnt);
+			if (len > 0)
 			{
-				x86_dma_sendbuf(FDD0_BASE + 255, 128, secbuf);
+				if (len < (int)(cnt * 512)) memset((uint8_t*)secbuf + len, 0, cnt * 512 - len);
+				x86_dma_sendbuf(FDD0_BASE + 255, cnt * 128, secbuf);
 				res = 1;
 			}
 		}
@@ -687,8 +715,8 @@ static void fdd_io(uint8_t read)
 
 		if (!res)
 		{
-			memset(secbuf, 0, 512);
-			x86_dma_sendbuf(FDD0_BASE + 255, 128, secbuf);
+			memset(secbuf, 0, cnt * 512);
+			x86_dma_sendbuf(FDD0_BASE + 255, cnt * 128, secbuf);
 		}
 	}
 	else
@@ -740,6 +768,10 @@ void x86_poll(int only_ide)
 		sd_req >>= 3;
 		if (!only_ide && (sd_req & 3)) fdd_io(sd_req & 1);
 	}
+	else
+	{
+		ide_flush_poll();
+	}
 }
 
 void x86_set_image(int num, char *filename)
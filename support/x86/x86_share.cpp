@@ -31,9 +31,11 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <sys/statvfs.h>
+#include <sys/inotify.h>
 #include <time.h>
 
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <vector>
 
@@ -108,7 +110,8 @@ struct lock
 	std::vector<dir_item_t> dir_items;
 };
 
-static std::map<short, lock> locks;
+static std::unordered_map<short, lock> locks;
+static std::unordered_map<uint16_t, short> lock_keys; // token -> key
 static short next_key = 0;
 
 static short get_key()
@@ -128,15 +131,20 @@ static short get_key()
 
 static short get_lock(const uint16_t token)
 {
-	for (const auto &pair : locks)
-	{
-		if (pair.second.token == token)
-		{
-			dbg_print("! token %u has lock: %d\n", token, pair.first);
-			return pair.first;
-		}
-	}
-	return 0;
+	auto it = lock_keys.find(token);
+	if (it == lock_keys.end()) return 0;
+
+	dbg_print("! token %u has lock: %d\n", token, it->second);
+	return it->second;
+}
+
+static void del_lock(short key)
+{
+	auto it = locks.find(key);
+	if (it == locks.end()) return;
+
+	lock_keys.erase(it->second.token);
+	locks.erase(it);
 }
 
 static short add_lock(const uint16_t token)
@@ -150,12 +158,14 @@ static short add_lock(const uint16_t token)
 	{
 		key = get_key();
 		locks[key] = { token, {} };
+		lock_keys[token] = key;
 		dbg_print("+ add lock: %d, %u\n", key, token);
 	}
 	return key;
 }
 
 static std::map<short, fileTYPE> open_file_handles;
+static std::unordered_map<short, std::string> open_file_paths; // handles open for writing
 static short next_fp = 1;
 
 static short get_fp()
@@ -285,13 +295,16 @@ static void __attribute__((noinline)) memcpyb(void *dst, const void *src, int le
 //   |   |   \------- 1 = archive
 //   \---+-------unused
 
+static stat64 *dir_cache_stat(const char *path);
+
 static uint32_t get_attr(char *path, uint16_t *time, uint16_t *date, uint32_t *size)
 {
 	if (time) *time = 0;
 	if (date) *date = 0;
 	if (size) *size = 0;
 
-	stat64 *st = getPathStat(path);
+	stat64 *st = dir_cache_stat(path);
+	if (!st) st = getPathStat(path);
 	if (!st) return 0;
 
 	tm *t = localtime(&st->st_mtime);
@@ -332,7 +345,7 @@ static void name83(const char *src, char *dst)
 	for (int i = 0; i < 3; i++) dst[8 + i] = toupper(ext[i]);
 }
 
-static int cmp_name(const char *name, const char *flt)
+static int fits83(const char *name)
 {
 	int namelen = 0;
 	int extlen = 0;
@@ -351,18 +364,15 @@ static int cmp_name(const char *name, const char *flt)
 	}
 
 	if (namelen > 8 || extlen > 3) return 0;
+	return 1;
+}
 
-	char testname[16];
-	char fltname[16];
-	name83(name, testname);
-	name83(flt, fltname);
-
-	testname[11] = 0;
-	fltname[11] = 0;
-
-	char *cmpname = fltname;
-	char *cmpend = fltname + 8;
-	char *cur = testname;
+// wildcard match of converted 8.3 names
+static int match83(const char *testname, const char *fltname)
+{
+	const char *cmpname = fltname;
+	const char *cmpend = fltname + 8;
+	const char *cur = testname;
 
 	while (cmpname < cmpend)
 	{
@@ -405,6 +415,160 @@ static int cmp_name(const char *name, const char *flt)
 	return 1;
 }
 
+// Listings of recently searched directories with the names already in 8.3
+// form. An entry is dropped on an inotify event, when the directory mtime
+// changes (remote changes on network shares), or when a request changes it.
+#define DIR_CACHE_MAX 32
+#define DIR_CACHE_TRUST 1000 // ms a validated listing answers GETATTR without a stat
+
+struct dir_cache_t
+{
+	std::vector<dir_item_t> items; // 8.3 compatible entries only
+	std::unordered_map<std::string, uint32_t> names;
+	struct timespec mtime;
+	unsigned long checked;
+	int wd;
+	uint32_t used;
+};
+
+static std::unordered_map<std::string, dir_cache_t> dir_cache;
+static std::unordered_map<int, std::string> dir_watch;
+static int dir_notify = -1;
+static uint32_t dir_used = 0;
+
+static void dir_cache_erase(std::unordered_map<std::string, dir_cache_t>::iterator it)
+{
+	if (it->second.wd >= 0)
+	{
+		inotify_rm_watch(dir_notify, it->second.wd);
+		dir_watch.erase(it->second.wd);
+	}
+	dir_cache.erase(it);
+}
+
+static void dir_cache_clear()
+{
+	while (!dir_cache.empty()) dir_cache_erase(dir_cache.begin());
+}
+
+// drop the listing holding path
+static void dir_cache_drop(const char *path)
+{
+	const char *p = strrchr(path, '/');
+	auto it = dir_cache.find(std::string(path, p ? p - path : 0));
+	if (it != dir_cache.end()) dir_cache_erase(it);
+}
+
+static void dir_cache_events()
+{
+	if (dir_notify < 0) return;
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int len;
+	while ((len = read(dir_notify, buf, sizeof(buf))) > 0)
+	{
+		for (int i = 0; i < len; i += sizeof(struct inotify_event) + ((struct inotify_event*)(buf + i))->len)
+		{
+			struct inotify_event *ev = (struct inotify_event*)(buf + i);
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				dir_cache_clear();
+				continue;
+			}
+
+			auto w = dir_watch.find(ev->wd);
+			if (w == dir_watch.end()) continue;
+
+			auto it = dir_cache.find(w->second);
+			if (it != dir_cache.end()) dir_cache_erase(it);
+		}
+	}
+}
+
+static dir_cache_t *dir_cache_get(const char *path)
+{
+	static char str[1024];
+
+	dir_cache_events();
+
+	stat64 *st = getPathStat(path);
+	if (!st || !(st->st_mode & S_IFDIR)) return 0;
+	struct timespec mtime = st->st_mtim;
+
+	auto it = dir_cache.find(path);
+	if (it != dir_cache.end())
+	{
+		if (it->second.mtime.tv_sec == mtime.tv_sec && it->second.mtime.tv_nsec == mtime.tv_nsec)
+		{
+			it->second.used = ++dir_used;
+			it->second.checked = GetTimer(0);
+			return &it->second;
+		}
+		dir_cache_erase(it);
+	}
+
+	const char* full_path = getFullPath(path);
+	DIR *d = opendir(full_path);
+	if (!d) return 0;
+
+	if (dir_cache.size() >= DIR_CACHE_MAX)
+	{
+		auto old = dir_cache.begin();
+		for (auto i = dir_cache.begin(); i != dir_cache.end(); ++i) if (i->second.used < old->second.used) old = i;
+		dir_cache_erase(old);
+	}
+
+	if (dir_notify < 0) dir_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	dir_cache_t &dc = dir_cache[path];
+	dc.mtime = mtime;
+	dc.checked = GetTimer(0);
+	dc.used = ++dir_used;
+	dc.wd = (dir_notify < 0) ? -1 : inotify_add_watch(dir_notify, full_path,
+		IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+	if (dc.wd >= 0) dir_watch[dc.wd] = path;
+
+	struct dirent64 *de;
+	while ((de = readdir64(d)))
+	{
+		if (!fits83(de->d_name)) continue;
+
+		snprintf(str, sizeof(str), "%s/%s", path, de->d_name);
+		stat64 *est = getPathStat(str);
+		if (!est) continue;
+
+		dir_item_t item;
+		memcpy(&item.de, de, sizeof(item.de));
+		name83(de->d_name, item.de.d_name);
+		item.de.d_name[11] = 0;
+		item.st = *est;
+
+		dc.names[item.de.d_name] = dc.items.size();
+		dc.items.push_back(item);
+	}
+	closedir(d);
+
+	return &dc;
+}
+
+// cached stat of a file, 0 if its directory isn't cached
+static stat64 *dir_cache_stat(const char *path)
+{
+	const char *p = strrchr(path, '/');
+	if (!p) return 0;
+
+	dir_cache_events();
+	auto it = dir_cache.find(std::string(path, p - path));
+	if (it == dir_cache.end() || CheckTimer(it->second.checked + DIR_CACHE_TRUST)) return 0;
+
+	char name[16];
+	name83(p + 1, name);
+	name[11] = 0;
+
+	auto n = it->second.names.find(name);
+	return (n == it->second.names.end()) ? 0 : &it->second.items[n->second].st;
+}
+
 static int process_request(void *reqres_buffer)
 {
 	static char str[1024];
@@ -471,6 +635,10 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
+		auto it = dir_cache.find(path);
+		if (it != dir_cache.end()) dir_cache_erase(it);
+		dir_cache_drop(path);
+
 		res = 0;
 	}
 	break;
@@ -492,6 +660,8 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
+		dir_cache_drop(path);
+
 		res = 0;
 	}
 	break;
@@ -542,6 +712,7 @@ static int process_request(void *reqres_buffer)
 		}
 
 		dbg_print("opened handle: %d\n", key);
+		if (mode) open_file_paths[key] = path;
 
 		*buf++ = 0;
 		name83(path, buf);
@@ -602,6 +773,8 @@ static int process_request(void *reqres_buffer)
 		}
 
 		dbg_print("opened handle: %d\n", key);
+		open_file_paths[key] = path;
+		dir_cache_drop(path);
 
 		*buf++ = 0;
 		name83(path, buf);
@@ -689,6 +862,8 @@ static int process_request(void *reqres_buffer)
 		}
 
 		dbg_print("opened handle: %d\n", key);
+		if (mode & O_ACCMODE) open_file_paths[key] = path;
+		if (spopres != 1) dir_cache_drop(path);
 
 		*buf++ = 0;
 		name83(path, buf);
@@ -716,6 +891,13 @@ static int process_request(void *reqres_buffer)
 			FileClose(&open_file_handles[key]);
 			open_file_handles.erase(key);
 
+			auto it = open_file_paths.find(key);
+			if (it != open_file_paths.end())
+			{
+				dir_cache_drop(it->second.c_str());
+				open_file_paths.erase(it);
+			}
+
 			dbg_print("closed handle: %d\n", key);
 		}
 
@@ -787,6 +969,9 @@ static int process_request(void *reqres_buffer)
 
 		dbg_print("  written %d\n", written);
 
+		auto it = open_file_paths.find(key);
+		if (it != open_file_paths.end()) dir_cache_drop(it->second.c_str());
+
 		*buf++ = written;
 		*buf++ = written >> 8;
 
@@ -903,6 +1088,7 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 		strcpy(str, getFullPath(path));
+		std::string dst = path;
 
 		buf[srclen] = 0;
 		path = find_path(buf);
@@ -918,6 +1104,9 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
+		dir_cache_drop(path);
+		dir_cache_drop(dst.c_str());
+
 		res = 0;
 	}
 	break;
@@ -945,6 +1134,8 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
+		dir_cache_drop(path);
+
 		res = 0;
 	}
 	break;
@@ -974,12 +1165,11 @@ static int process_request(void *reqres_buffer)
 		*flt++ = 0;
 		key = add_lock(token);
 
-		const char* full_path = getFullPath(path);
-		DIR *d = opendir(full_path);
-		if (!d)
+		dir_cache_t *dc = dir_cache_get(path);
+		if (!dc)
 		{
-			locks.erase(key);
-			printf("Couldn't open dir: %s\n", full_path);
+			del_lock(key);
+			printf("Couldn't open dir: %s\n", getFullPath(path));
 			res = 0x12;
 			break;
 		}
@@ -1007,24 +1197,15 @@ static int process_request(void *reqres_buffer)
 		}
 		else
 		{
-			struct dirent64 de, *de2;
-			while ((de2 = readdir64(d)))
+			char fltname[16];
+			name83(flt, fltname);
+			fltname[11] = 0;
+
+			std::vector<dir_item_t> &items = locks[key].dir_items;
+			for (const dir_item_t &item : dc->items)
 			{
-				if (de2->d_type == DT_REG || (attr & FAT_DIR))
-				{
-					memcpy(&de, de2, sizeof(dirent64));
-					sprintf(str, "%s/%s", path, de.d_name);
-					stat64 *st = getPathStat(str);
-
-					if (st && cmp_name(de.d_name, flt))
-					{
-						name83(de2->d_name, de.d_name);
-						de.d_name[11] = 0;
-						locks[key].dir_items.push_back({ de, *st });
-					}
-				}
+				if ((item.de.d_type == DT_REG || (attr & FAT_DIR)) && match83(item.de.d_name, fltname)) items.push_back(item);
 			}
-			closedir(d);
 		}
 	}
 	// fall through
@@ -1049,7 +1230,7 @@ static int process_request(void *reqres_buffer)
 
 		if (idx >= locks[key].dir_items.size())
 		{
-			if (locks.find(key) != locks.end()) locks.erase(key);
+			del_lock(key);
 
 			dbg_print("No more items\n");
 			res = 0x12;
@@ -1157,7 +1338,10 @@ void x86_share_poll()
 void x86_share_reset()
 {
 	open_file_handles.clear();
+	open_file_paths.clear();
 	locks.clear();
+	lock_keys.clear();
+	dir_cache_clear();
 	next_fp = 1;
 	next_key = 1;
 }
@@ -1014,7 +1014,64 @@ int XMLDoc_print_attr_sep(const XMLDoc* doc, FILE* f, const SXML_CHAR* tag_sep,
 
 /* --- */
 
-int XML_parse_attribute_to(const SXML_CHAR* str, int to, XMLAttribute* xmlattr)
+/*
+ Strings of the node SAX parsing is at. They come from one buffer reused for
+ every node of the document, as do the attributes, so a document is parsed
+ without an allocation per node. Callbacks only ever see the node until they
+ return. The buffer is sized for the whole tag string before parsing it, so
+ the strings don't move while the node is filled.
+ */
+typedef struct _SAX_Arena {
+	SXML_CHAR* buf;
+	int size;
+	int used;
+	XMLAttribute* attr;
+	int n_attr;
+} SAX_Arena;
+
+static SXML_CHAR* _arena_str(SAX_Arena* arena, int n)
+{
+	SXML_CHAR* p;
+
+	if (arena == NULL)
+		return (SXML_CHAR*)__malloc(n * sizeof(SXML_CHAR));
+	if (arena->used + n > arena->size)
+		return NULL;
+	p = arena->buf + arena->used;
+	arena->used += n;
+	return p;
+}
+
+/* Prepares 'arena' for a tag string of 'len' characters: its strings are no longer than the tag itself, plus their '\0' */
+static int _arena_reset(SAX_Arena* arena, int len)
+{
+	SXML_CHAR* p;
+	int need = 2 * len + 2;
+
+	arena->used = 0;
+	if (need <= arena->size)
+		return true;
+	p = (SXML_CHAR*)__realloc(arena->buf, need * sizeof(SXML_CHAR));
+	if (p == NULL)
+		return false;
+	arena->buf = p;
+	arena->size = need;
+	return true;
+}
+
+static void _node_release(XMLNode* node, SAX_Arena* arena)
+{
+	if (arena == NULL) {
+		(void)XMLNode_free(node);
+		return;
+	}
+	node->tag = NULL;
+	node->attributes = NULL;
+	node->n_attributes = 0;
+	node->tag_type = TAG_NONE;
+}
+
+static int _parse_attribute_to(const SXML_CHAR* str, int to, XMLAttribute* xmlattr, SAX_Arena* arena)
 {
 	const SXML_CHAR *p;
 	int i, n0, n1, remQ = 0;
@@ -1039,8 +1096,8 @@ int XML_parse_attribute_to(const SXML_CHAR* str, int to, XMLAttribute* xmlattr)
 		remQ = 1;
 	}
 
-	xmlattr->name = (SXML_CHAR*)__malloc((n0+1)*sizeof(SXML_CHAR));
-	xmlattr->value = (SXML_CHAR*)__malloc((to+1 - n1 - remQ + 1) * sizeof(SXML_CHAR));
+	xmlattr->name = _arena_str(arena, n0+1);
+	xmlattr->value = _arena_str(arena, to+1 - n1 - remQ + 1);
 	xmlattr->active = true;
 	if (xmlattr->name != NULL && xmlattr->value != NULL) {
 		/* Copy name */
@@ -1060,11 +1117,11 @@ int XML_parse_attribute_to(const SXML_CHAR* str, int to, XMLAttribute* xmlattr)
 
 	if (ret == 0) {
 		if (xmlattr->name != NULL) {
-			__free(xmlattr->name);
+			if (arena == NULL) __free(xmlattr->name);
 			xmlattr->name = NULL;
 		}
 		if (xmlattr->value != NULL) {
-			__free(xmlattr->value);
+			if (arena == NULL) __free(xmlattr->value);
 			xmlattr->value = NULL;
 		}
 	}
@@ -1072,7 +1129,12 @@ int XML_parse_attribute_to(const SXML_CHAR* str, int to, XMLAttribute* xmlattr)
 	return ret;
 }
 
-static TagType _parse_special_tag(const SXML_CHAR* str, int len, _TAG* tag, XMLNode* node)
+int XML_parse_attribute_to(const SXML_CHAR* str, int to, XMLAttribute* xmlattr)
+{
+	return _parse_attribute_to(str, to, xmlattr, NULL);
+}
+
+static TagType _parse_special_tag(const SXML_CHAR* str, int len, _TAG* tag, XMLNode* node, SAX_Arena* arena)
 {
 	if (sx_strncmp(str, tag->start, tag->len_start))
 		return TAG_NONE;
@@ -1080,7 +1142,7 @@ static TagType _parse_special_tag(const SXML_CHAR* str, int len, _TAG* tag, XMLN
 	if (sx_strncmp(str + len - tag->len_end, tag->end, tag->len_end)) /* There probably is a '>' inside the tag */
 		return TAG_PARTIAL;
 
-	node->tag = (SXML_CHAR*)__malloc((len - tag->len_start - tag->len_end + 1)*sizeof(SXML_CHAR));
+	node->tag = _arena_str(arena, len - tag->len_start - tag->len_end + 1);
 	if (node->tag == NULL)
 		return TAG_NONE;
 	sx_strncpy(node->tag, str + tag->len_start, len - tag->len_start - tag->len_end);
@@ -1095,7 +1157,7 @@ static TagType _parse_special_tag(const SXML_CHAR* str, int len, _TAG* tag, XMLN
  Fills the 'xmlnode' structure with the tag name and its attributes.
  Returns 'TAG_ERROR' if an error occurred (malformed 'str' or memory). 'TAG_*' when string is recognized.
  */
-TagType XML_parse_1string(const SXML_CHAR* str, XMLNode* xmlnode)
+static TagType _parse_1string(const SXML_CHAR* str, XMLNode* xmlnode, SAX_Arena* arena)
 {
 	SXML_CHAR *p;
 	XMLAttribute* pt;
@@ -1104,13 +1166,15 @@ TagType XML_parse_1string(const SXML_CHAR* str, XMLNode* xmlnode)
 	if (str == NULL || xmlnode == NULL)
 		return TAG_ERROR;
 	len = sx_strlen(str);
+	if (arena != NULL && !_arena_reset(arena, len))
+		return TAG_ERROR;
 
 	/* Check for malformed string */
 	if (str[0] != C2SX('<') || str[len-1] != C2SX('>'))
 		return TAG_ERROR;
 
 	for (nn = 0; nn < NB_SPECIAL_TAGS; nn++) {
-		n = (int)_parse_special_tag(str, len, &_spec[nn], xmlnode);
+		n = (int)_parse_special_tag(str, len, &_spec[nn], xmlnode, arena);
 		switch (n) {
 			case TAG_NONE:	break;				/* Nothing found => do nothing */
 			default:		return (TagType)n;	/* Tag found => return it */
@@ -1128,7 +1192,7 @@ TagType XML_parse_1string(const SXML_CHAR* str, XMLNode* xmlnode)
 					return TAG_PARTIAL;
 				nn = 1;
 			}
-			xmlnode->tag = (SXML_CHAR*)__malloc((len - 9 - nn)*sizeof(SXML_CHAR)); /* 'len' - "<!DOCTYPE" and ">" + '\0' */
+			xmlnode->tag = _arena_str(arena, len - 9 - nn); /* 'len' - "<!DOCTYPE" and ">" + '\0' */
 			if (xmlnode->tag == NULL)
 				return TAG_ERROR;
 			sx_strncpy(xmlnode->tag, &str[9], len - 10 - nn);
@@ -1141,7 +1205,7 @@ TagType XML_parse_1string(const SXML_CHAR* str, XMLNode* xmlnode)
 
 	/* Test user tags */
 	for (nn = 0; nn < _user_tags.n_tags; nn++) {
-		n = _parse_special_tag(str, len, &_user_tags.tags[nn], xmlnode);
+		n = _parse_special_tag(str, len, &_user_tags.tags[nn], xmlnode, arena);
 		switch (n) {
 			case TAG_ERROR:	return TAG_NONE;	/* Error => exit */
 			case TAG_NONE:	break;				/* Nothing found => do nothing */
@@ -1154,7 +1218,7 @@ TagType XML_parse_1string(const SXML_CHAR* str, XMLNode* xmlnode)
 
 	/* tag starts at index 1 (or 2 if tag end) and ends at the first space or '/>' */
 	for (n = 1 + tag_end; str[n] != NULC && str[n] != C2SX('>') && str[n] != C2SX('/') && !sx_isspace(str[n]); n++) ;
-	xmlnode->tag = (SXML_CHAR*)__malloc((n - tag_end)*sizeof(SXML_CHAR));
+	xmlnode->tag = _arena_str(arena, n - tag_end);
 	if (xmlnode->tag == NULL)
 		return TAG_ERROR;
 	sx_strncpy(xmlnode->tag, &str[1 + tag_end], n - 1 - tag_end);
@@ -1183,8 +1247,18 @@ TagType XML_parse_1string(const SXML_CHAR* str, XMLNode* xmlnode)
 		/* New attribute found */
 		p = sx_strchr(str+n, C2SX('='));
 		if (p == NULL) goto parse_err;
-		pt = (XMLAttribute*)__realloc(xmlnode->attributes, (xmlnode->n_attributes + 1) * sizeof(XMLAttribute));
-		if (pt == NULL) goto parse_err;
+		if (arena == NULL) {
+			pt = (XMLAttribute*)__realloc(xmlnode->attributes, (xmlnode->n_attributes + 1) * sizeof(XMLAttribute));
+			if (pt == NULL) goto parse_err;
+		} else {
+			if (xmlnode->n_attributes >= arena->n_attr) {
+				pt = (XMLAttribute*)__realloc(arena->attr, (arena->n_attr + 8) * sizeof(XMLAttribute));
+				if (pt == NULL) goto parse_err;
+				arena->attr = pt;
+				arena->n_attr += 8;
+			}
+			pt = arena->attr;
+		}
 
 		pt[xmlnode->n_attributes].name = NULL;
 		pt[xmlnode->n_attributes].value = NULL;
@@ -1202,10 +1276,13 @@ TagType XML_parse_1string(const SXML_CHAR* str, XMLNode* xmlnode)
 
 		/* Here 'str[nn]' is the character after value */
 		/* the attribute definition ('attrName="attrVal"') is between 'str[n]' and 'str[nn]' */
-		rc = XML_parse_attribute_to(&str[n], nn - n, &xmlnode->attributes[xmlnode->n_attributes - 1]);
+		rc = _parse_attribute_to(&str[n], nn - n, &xmlnode->attributes[xmlnode->n_attributes - 1], arena);
 		if (!rc) goto parse_err;
 		if (rc == 2) { /* Probable presence of '>' inside attribute value, which is legal XML. Remove attribute to re-parse it later */
-			XMLNode_remove_attribute(xmlnode, xmlnode->n_attributes - 1);
+			if (arena == NULL)
+				XMLNode_remove_attribute(xmlnode, xmlnode->n_attributes - 1);
+			else
+				xmlnode->n_attributes--;
 			return TAG_PARTIAL;
 		}
 
@@ -1215,15 +1292,21 @@ TagType XML_parse_1string(const SXML_CHAR* str, XMLNode* xmlnode)
 	sx_fprintf(stderr, C2SX("\nWE SHOULD NOT BE HERE!\n[%s]\n\n"), str);
 
 parse_err:
-	(void)XMLNode_free(xmlnode);
+	_node_release(xmlnode, arena);
 
 	return TAG_ERROR;
 }
 
+TagType XML_parse_1string(const SXML_CHAR* str, XMLNode* xmlnode)
+{
+	return _parse_1string(str, xmlnode, NULL);
+}
+
 static int _parse_data_SAX(void* in, const DataSourceType in_type, const SAX_Callbacks* sax, SAX_Data* sd)
 {
 	SXML_CHAR *line = NULL, *txt_end, *p;
 	XMLNode node;
+	SAX_Arena arena = { NULL, 0, 0, NULL, 0 };
 	int ret, exit, sz, n0, ncr;
 	TagType tag_type;
 	int (*meos)(void* ds) = (in_type == DATA_SOURCE_BUFFER ? (int(*)(void*))_beob : (int(*)(void*))sx_feof);
@@ -1240,7 +1323,7 @@ static int _parse_data_SAX(void* in, const DataSourceType in_type, const SAX_Cal
 	node.init_value = 0;
 	(void)XMLNode_init(&node);
 	while ((n0 = read_line_alloc(in, in_type, &line, &sz, 0, NULC, C2SX('>'), true, C2SX('\n'), &ncr)) != 0) {
-		(void)XMLNode_free(&node);
+		_node_release(&node, &arena);
 		for (p = line; *p != NULC && sx_isspace(*p); p++) ; /* Checks if text is only spaces */
 		if (*p == NULC)
 			break;
@@ -1286,7 +1369,7 @@ static int _parse_data_SAX(void* in, const DataSourceType in_type, const SAX_Cal
 		}
 		*txt_end = '<'; /* Restores tag start */
 
-		switch (tag_type = XML_parse_1string(txt_end, &node)) {
+		switch (tag_type = _parse_1string(txt_end, &node, &arena)) {
 			case TAG_ERROR: /* Memory error */
 				ret = false;
 				if (sax->on_error == NULL && sax->all_event == NULL)
@@ -1344,7 +1427,8 @@ static int _parse_data_SAX(void* in, const DataSourceType in_type, const SAX_Cal
 					}
 					n0 = n1;
 					txt_end = sx_strchr(line, C2SX('<')); /* In case 'line' has been moved by the '__realloc' in 'read_line_alloc' */
-					tag_type = XML_parse_1string(txt_end, &node);
+					_node_release(&node, &arena);
+					tag_type = _parse_1string(txt_end, &node, &arena);
 					if (tag_type == TAG_ERROR) {
 						ret = false;
 						if (sax->on_error == NULL && sax->all_event == NULL)
@@ -1376,7 +1460,9 @@ static int _parse_data_SAX(void* in, const DataSourceType in_type, const SAX_Cal
 			break;
 	}
 	__free(line);
-	(void)XMLNode_free(&node);
+	_node_release(&node, &arena);
+	__free(arena.buf);
+	__free(arena.attr);
 
 	if (sax->end_doc != NULL && !sax->end_doc(sd))
 		return ret;
@@ -1595,6 +1681,25 @@ int XMLDoc_parse_file_SAX(const SXML_CHAR* filename, const SAX_Callbacks* sax, v
 	f = sx_fopen(filename, fmode);
 	if (f == NULL)
 		return false;
+
+#ifndef SXMLC_UNICODE
+	/* The whole file is parsed from memory, one read instead of a stdio call per character */
+	if (!fseek(f, 0, SEEK_END)) {
+		long size = ftell(f);
+		SXML_CHAR* buf = (size >= 0 && !fseek(f, 0, SEEK_SET)) ? (SXML_CHAR*)__malloc(size + 1) : NULL;
+		if (buf != NULL) {
+			if (fread(buf, 1, size, f) == (size_t)size) {
+				buf[size] = NULC;
+				(void)sx_fclose(f);
+				ret = XMLDoc_parse_buffer_SAX(buf, filename, sax, user);
+				__free(buf);
+				return ret;
+			}
+			__free(buf);
+		}
+		(void)fseek(f, 0, SEEK_SET);
+	}
+#endif
 	/* Microsoft' 'ftell' returns invalid position for Unicode text files
 	   (see http://connect.microsoft.com/VisualStudio/feedback/details/369265/ftell-ftell-nolock-incorrectly-handling-unicode-text-translation)
 	   However, we're opening the file as binary in Unicode so we don't fall into that case...
@@ -1635,6 +1740,7 @@ int XMLDoc_parse_buffer_SAX(const SXML_CHAR* buffer, const SXML_CHAR* name, cons
 		return false;
 
 	sd.name = name;
+	sd.file = NULL;
 	sd.user = user;
 	return _parse_data_SAX((void*)&dsb, DATA_SOURCE_BUFFER, sax, &sd);
 }
@@ -1802,6 +1908,42 @@ int read_line_alloc(void* in, DataSourceType in_type, SXML_CHAR** line, int* sz_
 
 	if (to == NULC)
 		to = C2SX('\n');
+
+	/* Buffers are scanned for 'to' and copied in one go. The first character is taken as it is, like below. */
+	if (in_type == DATA_SOURCE_BUFFER && from == NULC && keep_fromto) {
+		DataSourceBuffer* ds = (DataSourceBuffer*)in;
+		const SXML_CHAR* s = ds->buf + ds->cur_pos;
+		const SXML_CHAR* e;
+
+		if (sz_line == NULL)
+			sz_line = &init_sz;
+		if (i0 < 0)
+			i0 = 0;
+		if (interest_count != NULL)
+			*interest_count = 0;
+
+		e = (*s == NULC) ? NULL : sx_strchr(s + 1, to);
+		e = (e == NULL) ? s + sx_strlen(s) : e + 1;
+		n = (int)(e - s);
+
+		if (*line == NULL || *sz_line < i0 + n + 1) {
+			int sz = (*sz_line > 0) ? *sz_line : (int)MEM_INCR_RLA;
+			while (sz < i0 + n + 1) sz += (int)MEM_INCR_RLA;
+			pt = (SXML_CHAR*)__realloc(*line, sz * sizeof(SXML_CHAR));
+			if (pt == NULL)
+				return 0;
+			*line = pt;
+			*sz_line = sz;
+		}
+
+		memcpy(*line + i0, s, n * sizeof(SXML_CHAR));
+		(*line)[i0 + n] = NULC;
+		ds->cur_pos += n;
+		if (interest_count != NULL) {
+			for (; s < e; s++) if (*s == interest) (*interest_count)++;
+		}
+		return i0 + n;
+	}
 	/* Search for character 'from' */
 	if (interest_count != NULL)
 		*interest_count = 0;
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <atomic>
+
+#include "file_io.h"
+#include "video.h"
+#include "offload.h"
+#include "thumbs.h"
+
+// tiles kept, at most VIDEO_ART_MAX square each
+#define THUMB_SLOTS 16
+
+// entries before and after the selection read ahead
+#define THUMB_AHEAD 2
+
+enum
+{
+	THUMB_FREE,
+	THUMB_QUEUED,   // waiting for the worker, may be cancelled
+	THUMB_DECODING, // owned by the worker
+	THUMB_READY,
+	THUMB_NONE      // no art for this entry
+};
+
+struct thumb_t
+{
+	char path[1024];
+	std::atomic<int> state;
+	uint32_t *pixels;
+	int w, h;
+	uint32_t used;
+};
+
+static thumb_t thumbs[THUMB_SLOTS];
+static uint32_t thumbs_used = 0;
+static char selected[1024] = {};
+
+static int art_path(char *path, int size, const char *dir, const direntext_t *item)
+{
+	if (!item || item->de.d_type == DT_DIR) return 0;
+
+	snprintf(path, size, "%s", getFullPath(dir));
+	int len = strlen(path);
+	snprintf(path + len, size - len, "%s%s", len ? "/" : "", item->de.d_name);
+
+	char *ext = strrchr(path, '.');
+	char *name = strrchr(path, '/');
+	if (!ext || ext < name) return 0;
+	if ((int)(ext - path) + 5 > size) return 0;
+
+	strcpy(ext, ".png");
+	return 1;
+}
+
+static thumb_t *thumb_find(const char *path)
+{
+	for (auto &t : thumbs) if (t.state != THUMB_FREE && !strcmp(t.path, path)) return &t;
+	return nullptr;
+}
+
+// a free slot or the least recently used finished one
+static thumb_t *thumb_alloc()
+{
+	thumb_t *lru = nullptr;
+	for (auto &t : thumbs)
+	{
+		int state = t.state;
+		if (state == THUMB_FREE) return &t;
+		if ((state == THUMB_READY || state == THUMB_NONE) && strcmp(t.path, selected) && (!lru || t.used < lru->used)) lru = &t;
+	}
+
+	if (lru)
+	{
+		free(lru->pixels);
+		lru->pixels = nullptr;
+		lru->state = THUMB_FREE;
+	}
+	return lru;
+}
+
+static void thumb_decode(thumb_t *t)
+{
+	int state = THUMB_QUEUED;
+	if (!t->state.compare_exchange_strong(state, THUMB_DECODING)) return;
+
+	int w = 0, h = 0;
+	t->pixels = video_decode_art(t->path, &w, &h);
+	t->w = w;
+	t->h = h;
+	t->state = t->pixels ? THUMB_READY : THUMB_NONE;
+}
+
+static void thumb_request(const char *path)
+{
+	thumb_t *t = thumb_find(path);
+	if (!t)
+	{
+		if (!(t = thumb_alloc())) return;
+
+		snprintf(t->path, sizeof(t->path), "%s", path);
+		t->pixels = nullptr;
+		t->state = THUMB_QUEUED;
+		if (!offload_try_add_work([t] { thumb_decode(t); }, OFFLOAD_PRIO_BULK)) t->state = THUMB_FREE;
+	}
+
+	t->used = ++thumbs_used;
+}
+
+void thumbs_select(const char *dir)
+{
+	if (!flist_nDirEntries()) return;
+
+	static char paths[THUMB_AHEAD * 2 + 1][1024];
+	int sel = flist_iSelectedEntry();
+	int num = 0;
+
+	// the selection goes first, the worker takes requests in order
+	if (!art_path(selected, sizeof(selected), dir, flist_SelectedItem())) selected[0] = 0;
+	for (int i = 1; i <= THUMB_AHEAD; i++)
+	{
+		if (sel + i < flist_nDirEntries() && art_path(paths[num], sizeof(paths[num]), dir, flist_DirItem(sel + i))) num++;
+		if (sel - i >= 0 && art_path(paths[num], sizeof(paths[num]), dir, flist_DirItem(sel - i))) num++;
+	}
+
+	// cancel what is no longer around the selection
+	for (auto &t : thumbs)
+	{
+		if (t.state != THUMB_QUEUED || !strcmp(t.path, selected)) continue;
+
+		int keep = 0;
+		for (int i = 0; i < num && !keep; i++) keep = !strcmp(t.path, paths[i]);
+
+		int state = THUMB_QUEUED;
+		if (!keep) t.state.compare_exchange_strong(state, THUMB_FREE);
+	}
+
+	if (selected[0]) thumb_request(selected);
+	for (int i = 0; i < num; i++) thumb_request(paths[i]);
+}
+
+void thumbs_poll(int active)
+{
+	const thumb_t *t = (active && selected[0]) ? thumb_find(selected) : nullptr;
+	if (t && t->state == THUMB_READY) video_menu_art(t->pixels, t->w, t->h);
+	else video_menu_art(nullptr, 0, 0);
+}
@@ -0,0 +1,16 @@
+#ifndef THUMBS_H
+#define THUMBS_H
+
+// Box art of the file browser of the menu core: "Name.png" next to
+// "Name.ext". Art is decoded on the bulk worker and kept as ready to draw
+// tiles, the browser never waits for it.
+
+// the selection of the browser in dir changed: request its art and the
+// art of the neighbours, drop requests for entries scrolled past
+void thumbs_select(const char *dir);
+
+// draws the art of the selection once it's ready, removes it when the
+// browser isn't active
+void thumbs_poll(int active);
+
+#endif
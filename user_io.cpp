@@ -9,10 +9,10 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
-
-#include "lib/imlib2/Imlib2.h"
+#include <atomic>
 
 #include "hardware.h"
+#include "counters.h"
 #include "osd.h"
 #include "user_io.h"
 #include "debug.h"
@@ -37,6 +37,13 @@
 #include "ide.h"
 #include "ide_cdrom.h"
 #include "profiling.h"
+#include "scheduler.h"
+#include "offload.h"
+#include "rewind.h"
+#include "perfhud.h"
+#include "midi_bridge.h"
+#include "log.h"
+#include "loadlog.h"
 
 #include "support.h"
 
@@ -46,6 +53,11 @@ static char rbf_path[1024] = {};
 static fileTYPE sd_image[16] = {};
 static int      sd_type[16] = {};
 static int      sd_image_cangrow[16] = {};
+static unsigned long save_write_at = 0; // last write to a save file
+#define SAVE_CACHE_MB 1 // per save image with save_write_delay
+#define PSX_SAVE_DELAY 1000 // memory cards are held even without save_write_delay
+static offload_handle_t save_flush_job[16] = {};
+static int save_flush_ok[16] = {};
 static uint64_t buffer_lba[16] = { ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,
 								   ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,
 								   ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,ULLONG_MAX,
@@ -58,6 +70,17 @@ static int emu_mode = EMU_NONE;
 
 // keep state over core type and its capabilities
 static unsigned char core_type = CORE_TYPE_UNKNOWN;
+
+// Keyboard protocol of the core. The translation tables (ev2amiga, ev2archie,
+// ev2ps2 and ev2ps2_set1 in input.cpp) are constant, the protocol is picked
+// once so a key costs a table lookup and the send.
+enum
+{
+	KBD_PROTO_UNKNOWN = 0, KBD_PROTO_NONE, KBD_PROTO_AMIGA, KBD_PROTO_ARCHIE, KBD_PROTO_PS2, KBD_PROTO_SHARPMZ
+};
+
+static int kbd_proto = KBD_PROTO_UNKNOWN;
+
 static unsigned char dual_sdr = 0;
 
 static int fio_size = 0;
@@ -345,6 +368,18 @@ char is_uneon()
 	return (is_uneon_type == 1);
 }
 
+// Core specific parts of the polling, resolved once the core name is known
+// so the poll loops don't go through the is_*() chains every iteration.
+struct coreHooks
+{
+	void (*poll)(void);    // part of user_io_poll()
+	void (*storage)(void); // disk requests in user_io_poll_storage()
+	void (*cd)(void);      // CD drive emulation, also run between OSD line writes
+};
+
+static coreHooks core_hooks = {};
+static void core_hooks_resolve();
+
 static int is_no_type = 0;
 static int disable_osd = 0;
 char has_menu()
@@ -385,6 +420,7 @@ void user_io_read_core_name()
 	else if (orig_name[0]) strcpy(core_name, p);
 
 	printf("Core name is \"%s\"\n", core_name);
+	core_hooks_resolve();
 }
 
 int substrcpy(char *d, const char *s, char idx)
@@ -482,6 +518,22 @@ uint32_t user_io_hd_mask(const char *opt)
 	return start;
 }
 
+// Savestates are started through the status bits, by the OSD or by a hotkey
+// of the core which reports the new slot number back. Any status traffic has
+// the slots checked right away and then often for a while, since the core
+// writes the state over a few frames. Cores which don't report anything are
+// still found by the slow poll.
+#define SS_POLL_MS  1000
+#define SS_BURST_MS 3000
+static unsigned long ss_burst = 0;
+static int ss_kick = 0;
+
+static void ss_notify()
+{
+	ss_burst = GetTimer(SS_BURST_MS);
+	ss_kick = 1;
+}
+
 void user_io_status_set(const char *opt, uint32_t value, int ex)
 {
 	int start, end;
@@ -504,6 +556,7 @@ void user_io_status_set(const char *opt, uint32_t value, int ex)
 		spi_uio_cmd_cont(UIO_SET_STATUS2);
 		for (uint32_t i = 0; i < sizeof(cur_status); i += 2) spi_w((cur_status[i + 1] << 8) | cur_status[i]);
 		DisableIO();
+		ss_notify();
 	}
 }
 
@@ -604,6 +657,13 @@ static const char mlink_speed_labels[13][32] = { "110", "300", "600", "1200", "2
 static char defmra[1024] = {};
 static int boot0_loaded = 0;
 static int boot0_mounted = 0;
+static int dma_wide = 0;
+
+// core takes the 16-bit block format on every UIO_DMA_* address (DMA16 in CONF_STR)
+int user_io_dma_wide()
+{
+	return dma_wide;
+}
 
 static void parse_config()
 {
@@ -619,6 +679,7 @@ static void parse_config()
 
 	joy_force = 0;
 	joy_bcount = 0;
+	dma_wide = 0;
 
 	do {
 		p = user_io_get_confstr(i);
@@ -691,6 +752,12 @@ static void parse_config()
 					printf("\n");
 				}
 
+				if (!strncasecmp(p, "DMA16", 5))
+				{
+					dma_wide = 1;
+					printf("Core supports wide DMA on all regions.\n");
+				}
+
 				if (!strncasecmp(p, "MIDI", 4))
 				{
 					p += 4;
@@ -987,16 +1054,47 @@ static void parse_config()
 	}
 }
 
+// localtime() and mktime() go through the time zone data, so the offsets
+// to UTC are sampled on the bulk worker and send_rtc() only adds them.
+#define RTC_TZ_PERIOD 60000
+
+static std::atomic<long> rtc_tz_local(0); // local time, with DST
+static std::atomic<long> rtc_tz_stamp(0); // for UIO_TIMESTAMP
+static unsigned long rtc_tz_timer = 0;
+
+static void rtc_tz_sample()
+{
+	time_t t = time(NULL);
+	struct tm tm;
+	localtime_r(&t, &tm);
+	rtc_tz_local = tm.tm_gmtoff;
+
+	gmtime_r(&t, &tm);
+	rtc_tz_stamp = t - mktime(&tm);
+}
+
+static void rtc_tz_update()
+{
+	if (!rtc_tz_timer) rtc_tz_sample();
+	else if (CheckTimer(rtc_tz_timer)) offload_try_add_work([] { rtc_tz_sample(); }, OFFLOAD_PRIO_BULK);
+	else return;
+
+	rtc_tz_timer = GetTimer(RTC_TZ_PERIOD);
+}
+
 //MSM6242B layout
 static void send_rtc(int type)
 {
 	//printf("Update RTC\n");
 
+	rtc_tz_update();
 	time_t t = time(NULL);
 
 	if (type & 1)
 	{
-		struct tm tm = *localtime(&t);
+		time_t lt = t + rtc_tz_local;
+		struct tm tm;
+		gmtime_r(&lt, &tm);
 
 		uint8_t rtc[8];
 		rtc[0] = (tm.tm_sec % 10) | ((tm.tm_sec / 10) << 4);
@@ -1019,7 +1117,7 @@ static void send_rtc(int type)
 
 	if (type & 2)
 	{
-		t += t - mktime(gmtime(&t));
+		t += rtc_tz_stamp;
 
 		spi_uio_cmd_cont(UIO_TIMESTAMP);
 		spi_w(t);
@@ -1093,7 +1191,20 @@ void SetUARTMode(int mode)
 	sprintf(data, "%d", baud);
 	MakeFile("/tmp/UART_SPEED", data);
 
+	midi_bridge_stop();
+
 	char cmd[32];
+	if (mode == 3 && cfg.midi_bridge && GetMidiLinkMode() == 2)
+	{
+		// the helpers must let go of the UART, the mode is still reported as MIDI
+		system("uartmode 0");
+		if (midi_bridge_start(baud, cfg.midi_bridge))
+		{
+			MakeFile("/tmp/uartmode3", "");
+			return;
+		}
+	}
+
 	sprintf(cmd, "uartmode %d", mode);
 	system(cmd);
 }
@@ -1301,10 +1412,15 @@ int user_io_get_width()
 	return fio_size;
 }
 
+static int core_inits = 0;
+static int core_in_init = 0;
+
 void user_io_init(const char *path, const char *xml)
 {
 	char *name;
 	static char mainpath[512];
+	core_inits++;
+	core_in_init = 1;
 	core_name[0] = 0;
 	disable_osd = 0;
 
@@ -1333,6 +1449,7 @@ void user_io_init(const char *path, const char *xml)
 		fio_size = 0;
 		io_ver = 0;
 	}
+	kbd_proto = KBD_PROTO_UNKNOWN;
 
 	OsdSetSize(8);
 
@@ -1364,6 +1481,7 @@ void user_io_init(const char *path, const char *xml)
 		SelectINI();
 	}
 
+	boot_phase("cfg_parse");
 	cfg_parse();
 	cfg_print();
 	while (cfg.waitmount[0] && !is_menu())
@@ -1399,12 +1517,14 @@ void user_io_init(const char *path, const char *xml)
 		bootcore_init(xml ? xml : path);
 	}
 
+	boot_phase("video_init");
 	video_init();
 	if (strlen(cfg.font)) LoadFont(cfg.font);
 	load_volume();
 
+	boot_phase("core_init");
 	user_io_send_buttons(1);
-	if (xml && isXmlName(xml) == 2) mgl_parse(xml);
+	if (xml && isXmlName(xml) == 2) mgl_parse(xml, path);
 
 	switch (core_type)
 	{
@@ -1637,6 +1757,75 @@ void user_io_init(const char *path, const char *xml)
 	{
 		mgl_get()->timer = GetTimer(mgl_get()->item[0].delay * 1000);
 	}
+
+	core_in_init = 0;
+}
+
+// Back to the state of a fresh process for the parts the menu core has used.
+static void user_io_core_reset()
+{
+	memset(sd_type, 0, sizeof(sd_type));
+	memset(sd_image_cangrow, 0, sizeof(sd_image_cangrow));
+	for (auto &lba : buffer_lba) lba = ULLONG_MAX;
+	memset(cur_status, 0, sizeof(cur_status));
+	use_save = 0;
+	emu_mode = EMU_NONE;
+	dual_sdr = 0;
+	osd_is_visible = 0;
+	is_arcade_type = 0;
+	is_gba_type = 0;
+	is_psx_type = 0;
+	is_electron_type = 0;
+	is_saturn_type = 0;
+	is_n64_type = 0;
+	ovr_name[0] = 0;
+	orig_name[0] = 0;
+	config_ver[0] = 0;
+	last_filename[0] = 0;
+	defmra[0] = 0;
+	boot0_loaded = 0;
+	boot0_mounted = 0;
+	use_cheats = 0;
+	joy_force = 0;
+	joy_transl = 0;
+	ss_base = 0;
+	ss_size = 0;
+	dma_wide = 0;
+}
+
+// Starts the core just loaded into the FPGA within this process instead of app_restart().
+// Only done when leaving the menu core as the first core of the process: no other core has
+// run before, so the state of all core specific modules is still the initial one.
+int user_io_core_switch(const char *path, const char *xml)
+{
+	if (!cfg.core_switch_inplace || !is_menu() || core_inits != 1 || core_in_init) return 0;
+	if (!strcasecmp(path, "menu.rbf")) return 0;
+
+	printf("switching to %s in place\n", path);
+
+	// the menu core never runs the input thread
+	input_core_switch();
+	user_io_core_reset();
+	menu_core_switch();
+	user_io_init(path, xml);
+	return 1;
+}
+
+int user_io_mgl_load(const char *rbf, const char *xml)
+{
+	if (strcmp(rbf, rbf_path) || !mgl_get()->done || is_menu() || is_st() || is_archie() || is_arcade() || user_io_core_type() == CORE_TYPE_SHARPMZ) return 0;
+
+	mgl_struct *mgl = mgl_parse(xml, rbf);
+	if (!mgl->count || mgl->setname)
+	{
+		mgl->done = 1;
+		return 0;
+	}
+
+	printf("MGL: %s is running already, no reload.\n", rbf);
+	snprintf(core_path, sizeof(core_path), "%s", xml);
+	mgl->timer = GetTimer(mgl->item[0].delay * 1000);
+	return 1;
 }
 
 static int joyswap = 0;
@@ -1797,13 +1986,122 @@ static void kbd_fifo_poll()
 	kbd_fifo_r = (kbd_fifo_r + 1)&(KBD_FIFO_SIZE - 1);
 }
 
+// A slot is copied out of the uncached mapping in one go and written to the
+// SD card on the bulk worker, so the main loop doesn't wait for the card.
+// With savestate_compress the file is a ssHeader and the deflated slot.
+#define SS_MAGIC 0x5A53534D // "MSSZ"
+
+struct ssHeader
+{
+	uint32_t magic;
+	uint32_t size;
+};
+
+struct ssJob
+{
+	uint8_t *buf;
+	uint32_t size;
+	int slot;
+	int compress;
+	int ok;
+	char path[1024];
+};
+
+// falls back to the raw slot if it doesn't get any smaller
+static void ss_compress(ssJob *job)
+{
+	mz_ulong len = mz_compressBound(job->size);
+	uint8_t *out = (uint8_t*)malloc(sizeof(ssHeader) + len);
+	if (!out) return;
+
+	if (mz_compress2(out + sizeof(ssHeader), &len, job->buf, job->size, MZ_BEST_SPEED) != MZ_OK || len + sizeof(ssHeader) >= job->size)
+	{
+		free(out);
+		return;
+	}
+
+	ssHeader h = { SS_MAGIC, job->size };
+	memcpy(out, &h, sizeof(h));
+	free(job->buf);
+	job->buf = out;
+	job->size = sizeof(h) + len;
+}
+
+static ssJob *ss_job = nullptr;
+static offload_handle_t ss_handle = 0;
+
+static void ss_write(ssJob *job)
+{
+	if (job->compress) ss_compress(job);
+
+	int fd = open(job->path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fd < 0)
+	{
+		log_err("Unable to create file: %s\n", job->path);
+		return;
+	}
+
+	uint32_t done = 0;
+	while (done < job->size)
+	{
+		ssize_t ret = write(fd, job->buf + done, job->size - done);
+		if (ret <= 0) break;
+		done += ret;
+	}
+	job->ok = (done == job->size) && !fsync(fd);
+	if (close(fd)) job->ok = 0;
+	log_info("Wrote %u bytes to file: %s\n", done, job->path);
+}
+
+// either kind of file into the slot, bytes of state or -1
+static int ss_read(fileTYPE *f, void *dst, uint32_t len)
+{
+	ssHeader h;
+	if (f->size <= (__off64_t)sizeof(h) || FileReadAdv(f, &h, sizeof(h)) != sizeof(h) || h.magic != SS_MAGIC || h.size > len)
+	{
+		FileSeek(f, 0, SEEK_SET);
+		return FileReadAdv(f, dst, len);
+	}
+
+	// inflated in normal memory, the slot is uncached
+	mz_ulong in_len = f->size - sizeof(h);
+	mz_ulong out_len = h.size;
+	uint8_t *in = (uint8_t*)malloc(in_len);
+	uint8_t *out = (uint8_t*)malloc(out_len);
+	int ret = -1;
+	if (in && out && FileReadAdv(f, in, in_len) == (int)in_len && mz_uncompress(out, &out_len, in, in_len) == MZ_OK)
+	{
+		memcpy(dst, out, out_len);
+		ret = out_len;
+	}
+	free(in);
+	free(out);
+	return ret;
+}
+
+static void ss_poll()
+{
+	if (!ss_job || !offload_is_done(ss_handle)) return;
+
+	char msg[64];
+	if (ss_job->ok) snprintf(msg, sizeof(msg), "State %d saved", ss_job->slot + 1);
+	else snprintf(msg, sizeof(msg), "Cannot save state %d", ss_job->slot + 1);
+	Info(msg, 1000);
+
+	free(ss_job->buf);
+	delete ss_job;
+	ss_job = nullptr;
+}
+
 int process_ss(const char *rom_name, int enable)
 {
 	static char ss_name[1024] = {};
 	static char *ss_sufx = 0;
 	static uint32_t ss_cnt[4] = {};
+	static uint32_t ss_pending[4] = {}; // size of a state waiting for its write
 	static void *base[4] = {};
 	static int enabled = 0;
+	static int rw_slot = 0; // slot of the last state, rewinding goes there
 
 	if (!ss_base) return 0;
 
@@ -1821,7 +2119,7 @@ int process_ss(const char *rom_name, int enable)
 			if (!base[i]) base[i] = shmem_map(map_addr, len);
 			if (!base[i])
 			{
-				printf("Unable to mmap (0x%X, %d)!\n", map_addr, len);
+				log_err("Unable to mmap (0x%X, %d)!\n", map_addr, len);
 			}
 			else
 			{
@@ -1831,7 +2129,7 @@ int process_ss(const char *rom_name, int enable)
 				if (!i)
 				{
 					FileGenerateSavestatePath(rom_name, ss_name, 1);
-					printf("Base SavestatePath=%s\n", ss_name);
+					log_info("Base SavestatePath=%s\n", ss_name);
 					if (!FileExists(ss_name)) FileGenerateSavestatePath(rom_name, ss_name, 0);
 				}
 				else
@@ -1843,13 +2141,13 @@ int process_ss(const char *rom_name, int enable)
 				{
 					if (!FileOpen(&f, ss_name))
 					{
-						printf("Unable to open file: %s\n", ss_name);
+						log_err("Unable to open file: %s\n", ss_name);
 					}
 					else
 					{
-						int ret = FileReadAdv(&f, base[i], len);
+						int ret = ss_read(&f, base[i], len);
 						FileClose(&f);
-						printf("process_ss: read %d bytes from file: %s\n", ret, ss_name);
+						log_info("process_ss: read %d bytes from file: %s\n", ret, ss_name);
 					}
 				}
 				*(uint32_t*)(base[i]) = 0xFFFFFFFF;
@@ -1860,46 +2158,104 @@ int process_ss(const char *rom_name, int enable)
 
 		FileGenerateSavestatePath(rom_name, ss_name, 1);
 		ss_sufx = ss_name + strlen(ss_name) - 4;
+		memset(ss_pending, 0, sizeof(ss_pending));
+		rewind_init(cfg.rewind * 1024 * 1024);
 		return 1;
 	}
 
+	ss_poll();
 	if (!enabled) return 0;
 
+	// an older state goes into the slot like one loaded from the file,
+	// the core picks it up on its next state load
+	uint8_t *rw_state;
+	uint32_t rw_size;
+	int rw_steps;
+	if (rewind_take(&rw_state, &rw_size, &rw_steps))
+	{
+		char msg[64];
+		if (rw_state && base[rw_slot] && rw_size <= ss_size)
+		{
+			shmem_write(base[rw_slot], rw_state, rw_size);
+			*(uint32_t*)(base[rw_slot]) = 0xFFFFFFFF;
+			ss_cnt[rw_slot] = 0xFFFFFFFF;
+			snprintf(msg, sizeof(msg), "Rewind: %d states back\nin slot %d", rw_steps, rw_slot + 1);
+		}
+		else
+		{
+			snprintf(msg, sizeof(msg), "Rewind: no older state");
+		}
+		Info(msg, 1000);
+		free(rw_state);
+	}
+
+	// rewind needs every state the core saves, not one per second
 	static unsigned long ss_timer = 0;
-	if (ss_timer && !CheckTimer(ss_timer)) return 0;
-	ss_timer = GetTimer(1000);
+	if (!ss_kick && ss_timer && !CheckTimer(ss_timer)) return 0;
+	ss_kick = 0;
+	if (ss_burst && CheckTimer(ss_burst)) ss_burst = 0;
+	ss_timer = GetTimer(ss_burst ? 50 : rewind_enabled() ? 100 : SS_POLL_MS);
 
-	fileTYPE f = {};
 	for (int i = 0; i < 4; i++)
 	{
-		if (base[i])
-		{
-			uint32_t curcnt = ((uint32_t*)(base[i]))[0];
-			uint32_t size = ((uint32_t*)(base[i]))[1];
+		if (!base[i]) continue;
 
-			if (curcnt != ss_cnt[i])
+		uint32_t curcnt = ((uint32_t*)(base[i]))[0];
+		uint32_t size = ((uint32_t*)(base[i]))[1];
+
+		// the DDR is uncached, a new state is read out of it once for the
+		// rewind ring and the file
+		uint8_t *snap = 0;
+		if (curcnt != ss_cnt[i])
+		{
+			ss_cnt[i] = curcnt;
+			if (size) size = (size + 2) * 4;
+			if (size > 0 && size <= ss_size)
 			{
-				ss_cnt[i] = curcnt;
-				if (size) size = (size + 2) * 4;
-				if (size > 0 && size <= ss_size)
+				ss_pending[i] = size;
+				rw_slot = i;
+				if (rewind_enabled())
 				{
-					MenuHide();
-					Info("Saving the state", 500);
-
-					*ss_sufx = i + '1';
-					if (FileOpenEx(&f, ss_name, O_CREAT | O_TRUNC | O_RDWR | O_SYNC))
+					snap = (uint8_t*)malloc(size);
+					if (snap)
 					{
-						int ret = FileWriteAdv(&f, base[i], size);
-						FileClose(&f);
-						printf("Wrote %d bytes to file: %s\n", ret, ss_name);
-					}
-					else
-					{
-						printf("Unable to create file: %s\n", ss_name);
+						shmem_read(snap, base[i], size);
+						rewind_push(snap, size);
 					}
 				}
 			}
 		}
+
+		// one write at a time, a slot changed meanwhile is written once it is done
+		if (ss_pending[i] && !ss_job)
+		{
+			size = ss_pending[i];
+			ss_pending[i] = 0;
+			MenuHide();
+
+			// a snapshot taken above is this state
+			int have = snap != 0;
+			ssJob *job = new ssJob();
+			job->buf = have ? snap : (uint8_t*)malloc(size);
+			snap = 0;
+			if (!job->buf)
+			{
+				delete job;
+				Info("Cannot save the state", 1000);
+				continue;
+			}
+
+			if (!have) shmem_read(job->buf, base[i], size);
+			*ss_sufx = i + '1';
+			snprintf(job->path, sizeof(job->path), "%s", getFullPath(ss_name));
+			job->size = size;
+			job->slot = i;
+			job->compress = cfg.savestate_compress;
+
+			ss_job = job;
+			ss_handle = offload_add_work([job] { ss_write(job); }, OFFLOAD_PRIO_BULK);
+		}
+		free(snap);
 	}
 
 	return 1;
@@ -1976,8 +2332,41 @@ void user_io_file_info(const char *ext)
 	DisableFpga();
 }
 
+// PSX games write the memory card a 128 byte frame at a time in bursts of
+// many, each one a synchronous write to the SD card otherwise.
+static uint16_t save_delay()
+{
+	if (!cfg.save_write_delay && is_psx()) return PSX_SAVE_DELAY;
+	return cfg.save_write_delay;
+}
+
+// the whole save goes into the cache up front, writes then never wait for
+// the rest of a block to be read
+static void save_cache_set(int index)
+{
+	if (!FileSetCache(&sd_image[index], SAVE_CACHE_MB, save_delay())) return;
+	if (sd_image[index].size > SAVE_CACHE_MB * 1024 * 1024) return;
+
+	int size = sd_image[index].size;
+	uint8_t *tmp = (uint8_t*)malloc(size);
+	if (tmp && !FileReadAt(&sd_image[index], 0, tmp, size)) printf("Failed to preload the save of slot %d\n", index);
+	free(tmp);
+}
+
+// write-backs run on the bulk worker, the image must not go away under one
+static void save_flush_wait(int index)
+{
+	if (!save_flush_job[index]) return;
+
+	offload_wait(save_flush_job[index]);
+	save_flush_job[index] = 0;
+	if (!save_flush_ok[index]) printf("Failed to write the save of slot %d\n", index);
+}
+
 int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_size)
 {
+	save_flush_wait(index);
+
 	int writable = 0;
 	int ret = 0;
 	int len = strlen(name);
@@ -2077,6 +2466,7 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 	else
 	{
 		printf("Mount %s as %s on %d slot\n", name, writable ? "read-write" : "read-only", index);
+		if (pre && writable && save_delay()) save_cache_set(index);
 	}
 
 	user_io_sd_set_config();
@@ -2400,6 +2790,12 @@ int user_io_use_cheats()
 	return use_cheats;
 }
 
+// The core flags its own status changes with a counter in the reply to
+// UIO_GET_STATUS, the status itself is only read when it moved. The loop
+// asks at most every STATUS_POLL_MS instead of on each pass, file transfers
+// ask right away once they are done.
+#define STATUS_POLL_MS 10
+
 static void check_status_change()
 {
 	static u_int8_t last_status_change = 0;
@@ -2493,6 +2889,7 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 
 	if (!FileOpen(&f, name, mute)) return 0;
 
+	uint32_t tx_start = counters_time_us();
 	uint32_t bytes2send = f.size;
 
 	if (composite)
@@ -2507,8 +2904,8 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 	}
 
 	/* transmit the entire file using one transfer */
-	printf("Selected file %s with %u bytes to send for index %d.%d\n", name, bytes2send, index & 0x3F, index >> 6);
-	if(load_addr) printf("Load to address 0x%X\n", load_addr);
+	log_info("Selected file %s with %u bytes to send for index %d.%d\n", name, bytes2send, index & 0x3F, index >> 6);
+	if(load_addr) log_info("Load to address 0x%X\n", load_addr);
 
 	// set index byte (0=bios rom, 1-n=OSD entry index)
 	user_io_set_index(index);
@@ -2545,7 +2942,7 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 			if (FileOpen(&fb, user_io_make_filepath(rom_path, "bsx_bios.rom")) ||
 				FileOpen(&fb, user_io_make_filepath(HomeDir(), "bsx_bios.rom")))
 			{
-				printf("Load BSX bios ROM.\n");
+				log_info("Load BSX bios ROM.\n");
 				uint8_t* buf = snes_get_header(&fb);
 				hexdump(buf, 16, 0);
 				user_io_file_tx_data(buf, 512);
@@ -2575,7 +2972,7 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 			}
 		}
 		else if ((index & 0x3F) == 1) {
-			printf("Load SPC ROM.\n");
+			log_info("Load SPC ROM.\n");
 			FileReadSec(&f, buf);
 			user_io_file_tx_data(buf, 256);
 
@@ -2587,7 +2984,7 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 			bytes2send = 64 * 1024;
 		}
 		else {
-			printf("Load SNES ROM.\n");
+			log_info("Load SNES ROM.\n");
 			uint8_t* buf = snes_get_header(&f);
 			hexdump(buf, 16, 0);
 			user_io_file_tx_data(buf, 512);
@@ -2608,7 +3005,13 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 	int size = bytes2send;
 	if (use_progress) ProgressMessage(0, 0, 0, 0);
 
-	if(ss_base && opensave) process_ss(name);
+	uint32_t ss_us = 0, crc_us = 0, t;
+	if (ss_base && opensave)
+	{
+		t = counters_time_us();
+		process_ss(name);
+		ss_us = counters_time_us() - t;
+	}
 
 	if (is_gba())
 	{
@@ -2651,26 +3054,75 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 		uint8_t *mem = (uint8_t *)shmem_map(fpga_mem(load_addr), map_size);
 		if (mem)
 		{
+			fileMapping map;
+			const uint8_t *src = FileMap(&f, bytes2send, &map);
+
 			while (bytes2send)
 			{
 				uint32_t gap = (is_snes() && (load_addr < 0x22000000) && (load_addr + size - bytes2send) >= 0x22000000) ? 0x800000 : 0;
 
 				uint32_t chunk = (bytes2send > (256 * 1024)) ? (256 * 1024) : bytes2send;
-				FileReadAdv(&f, mem + size - bytes2send + gap, chunk);
+				if (src) shmem_write(mem + size - bytes2send + gap, src + size - bytes2send, chunk);
+				else FileReadAdv(&f, mem + size - bytes2send + gap, chunk);
 
-				if(!is_snes()) file_crc = crc32(file_crc, mem + skip + size - bytes2send, chunk - skip);
+				// reading back the uncached DDR window is slow, use the mapping if there is one
+				t = counters_time_us();
+				if(!is_snes()) file_crc = crc32(file_crc, (src ? src : mem) + skip + size - bytes2send, chunk - skip);
+				crc_us += counters_time_us() - t;
 				skip = 0;
 
 				if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
 				bytes2send -= chunk;
 			}
 
+			FileUnmap(&map);
 			shmem_unmap(mem, map_size);
 		}
 	}
 	else
 	{
-		while (dosend && bytes2send)
+		// uncompressed local files are sent straight from the page cache
+		fileMapping map;
+		const uint8_t *src = (dosend && !is_snes_bs) ? FileMap(&f, bytes2send, &map) : 0;
+		while (src && bytes2send)
+		{
+			uint32_t chunk = (bytes2send > (256 * 1024)) ? (256 * 1024) : bytes2send;
+
+			user_io_file_tx_data(src, chunk);
+
+			if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
+			bytes2send -= chunk;
+
+			if (skip >= chunk) skip -= chunk;
+			else
+			{
+				t = counters_time_us();
+				file_crc = crc32(file_crc, src + skip, chunk - skip);
+				crc_us += counters_time_us() - t;
+				skip = 0;
+			}
+			src += chunk;
+		}
+		FileUnmap(&map);
+
+		// everything else is read ahead on the bulk worker while the previous chunk goes out
+		if (dosend && !is_snes_bs && bytes2send)
+		{
+			fileReadAhead ra(&f, bytes2send, 64 * 1024, skip);
+			uint8_t *data;
+			uint32_t chunk;
+			while ((data = ra.next(&chunk)))
+			{
+				user_io_file_tx_data(data, chunk);
+
+				if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
+				bytes2send -= chunk;
+			}
+			file_crc = ra.crc;
+		}
+
+		// BS header patching needs the file offset of every chunk
+		while (dosend && is_snes_bs && bytes2send)
 		{
 			uint32_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
 
@@ -2684,7 +3136,9 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 			if (skip >= chunk) skip -= chunk;
 			else
 			{
+				t = counters_time_us();
 				file_crc = crc32(file_crc, buf + skip, chunk - skip);
+				crc_us += counters_time_us() - t;
 				skip = 0;
 			}
 		}
@@ -2693,20 +3147,29 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 	// check if core requests some change while downloading
 	check_status_change();
 
-	printf("Done.\n");
-	printf("CRC32: %08X\n", file_crc);
+	uint32_t tx_us = counters_time_us() - tx_start;
+	histogram_add(HIST_FILE_TX, tx_us);
+	log_info("Done.\nCRC32: %08X\n", file_crc);
 
 	FileClose(&f);
 
+	uint32_t save_us = 0;
 	if (opensave)
 	{
+		t = counters_time_us();
 		FileGenerateSavePath(name, (char*)buf);
 		user_io_file_mount((char*)buf, 0, 1);
+		save_us = counters_time_us() - t;
 	}
 
+	loadlog_add(LOAD_ROM, tx_us - ss_us, name);
+	loadlog_add(LOAD_CRC, crc_us);
+	if (ss_us) loadlog_add(LOAD_SS, ss_us);
+	if (save_us) loadlog_add(LOAD_SAVE, save_us);
+
 	// signal end of transmission
 	user_io_set_download(0);
-	printf("\n");
+	log_info("\n");
 
 	if (is_zx81() && index)
 	{
@@ -2726,6 +3189,22 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 }
 
 static char cfgstr[1024 * 10] = {};
+
+// start of every item, indexed once after reading. The menu walks all the
+// items on every redraw, each lookup doesn't have to scan from the start.
+static uint16_t cfgstr_pos[sizeof(cfgstr) / 2 + 2];
+static int cfgstr_num = 0;
+
+static void cfgstr_index()
+{
+	cfgstr_num = 0;
+	cfgstr_pos[cfgstr_num++] = 0;
+	for (int i = 0; cfgstr[i]; i++) if (cfgstr[i] == ';') cfgstr_pos[cfgstr_num++] = i + 1;
+
+	// end of the last item + 1
+	cfgstr_pos[cfgstr_num] = strlen(cfgstr) + 1;
+}
+
 void user_io_read_confstr()
 {
 	spi_uio_cmd_cont(UIO_GET_STRING);
@@ -2740,25 +3219,18 @@ void user_io_read_confstr()
 
 	cfgstr[j++] = 0;
 	DisableIO();
+	cfgstr_index();
 }
 
 char *user_io_get_confstr(int index)
 {
-	int lidx = 0;
 	static char buffer[(1024*2) + 1];  // max bytes per config item
 
-	char *start = cfgstr;
-	while (lidx < index)
-	{
-		start = strchr(start, ';');
-		if (!start) return NULL;
-		start++;
-		lidx++;
-	}
+	if (index < 0 || index >= cfgstr_num) return NULL;
 
-	char *end = strchr(start, ';');
-	int len = end ? end - start : strlen(start);
-	if (!len) return NULL;
+	char *start = cfgstr + cfgstr_pos[index];
+	int len = cfgstr_pos[index + 1] - cfgstr_pos[index] - 1;
+	if (len <= 0) return NULL;
 
 	if ((uint32_t)len > sizeof(buffer) - 1) len = sizeof(buffer) - 1;
 	memcpy(buffer, start, len);
@@ -2910,331 +3382,492 @@ static int coldreset_req = 0;
 
 static uint32_t res_timer = 0;
 
-void user_io_poll()
+// Storage requests of the running core (HDD/FDD/SD/CD emulation).
+// Runs in its own coroutine, so it is serviced between every other slice
+// and can be called in from long UI loops through scheduler_service_storage().
+// disk requests of the minimig
+static void storage_minimig()
 {
-	PROFILE_FUNCTION();
+	//HDD & FDD query
+	unsigned char  c1, c2;
+	EnableFpga();
+	uint16_t tmp = spi_w(0);
+	c1 = (uint8_t)(tmp >> 8); // cmd request and drive number
+	c2 = (uint8_t)tmp;      // track number
+	spi_w(0);
+	spi_w(0);
+	DisableFpga();
+	sysled_enable(0);
+	HandleFDD(c1, c2);
+	sysled_enable(1);
 
-	if ((core_type != CORE_TYPE_SHARPMZ) &&
-		(core_type != CORE_TYPE_8BIT))
+	uint16_t sd_req = ide_check();
+	ide_io(0, sd_req & 7);
+	ide_io(1, (sd_req >> 3) & 7);
+	if (sd_req & 0x0100) ide_cdda_send_sector();
+	UpdateDriveStatus();
+
+	minimig_share_poll();
+}
+
+// sd card emulation of the 8 bit cores
+static int sd_read(int disk, uint64_t lba, uint32_t blksz, void *buf, int len)
+{
+	fileTYPE *f = &sd_image[disk];
+	if (f->cache) return FileReadAt(f, lba * blksz, buf, len, 0);
+	return FileSeek(f, lba * blksz, SEEK_SET) ? FileReadAdv(f, buf, len) : 0;
+}
+
+static void sd_write(int disk, uint64_t lba, uint32_t blksz, void *buf, int len)
+{
+	fileTYPE *f = &sd_image[disk];
+	if (!sd_image_cangrow[disk])
 	{
-		return;  // no user io for the installed core
+		__off64_t rem = f->size - (__off64_t)(lba * blksz);
+		len = (rem >= len) ? len : (int)rem;
 	}
+	if (len <= 0) return;
 
-	user_io_send_buttons(0);
+	if (f->cache)
+	{
+		FileWriteAt(f, lba * blksz, buf, len);
+	}
+	else if (FileSeek(f, lba * blksz, SEEK_SET))
+	{
+		FileWriteAdv(f, buf, len);
+	}
+}
 
-	if (is_minimig())
+// Saves written while the core runs are held for a quiet moment, then all
+// dirty sectors go out in one batch. They are never older than
+// save_write_delay, and are written when the OSD opens, on core change and
+// reboot. Cores keep rewriting the same sectors of their SRAM or memory card.
+#define SAVE_IDLE_FLUSH 500
+
+static void sd_save_poll()
+{
+	uint16_t delay = save_delay();
+	if (!delay) return;
+
+	for (int i = 0; i < 16; i++)
 	{
-		//HDD & FDD query
-		unsigned char  c1, c2;
-		EnableFpga();
-		uint16_t tmp = spi_w(0);
-		c1 = (uint8_t)(tmp >> 8); // cmd request and drive number
-		c2 = (uint8_t)tmp;      // track number
-		spi_w(0);
-		spi_w(0);
-		DisableFpga();
-		sysled_enable(0);
-		HandleFDD(c1, c2);
-		sysled_enable(1);
-
-		uint16_t sd_req = ide_check();
-		ide_io(0, sd_req & 7);
-		ide_io(1, (sd_req >> 3) & 7);
-		if (sd_req & 0x0100) ide_cdda_send_sector();
-		UpdateDriveStatus();
-
-		kbd_fifo_poll();
-
-		if (!rtc_timer || CheckTimer(rtc_timer))
+		if (!sd_image[i].cache) continue;
+		if (save_flush_job[i])
 		{
-			// Update once per minute should be enough
-			rtc_timer = GetTimer(60000);
-			send_rtc(1);
+			if (!offload_is_done(save_flush_job[i])) continue;
+			save_flush_wait(i);
 		}
 
-		minimig_share_poll();
-	}
+		uint32_t age = CheckTimer(save_write_at + SAVE_IDLE_FLUSH) ? 0 : delay;
+		if (!FileCacheDirty(&sd_image[i], age)) continue;
 
-	if (core_type == CORE_TYPE_8BIT && !is_menu())
-	{
-		check_status_change();
+		// writes arriving meanwhile only wait for the cache lock
+		save_flush_job[i] = offload_add_work([i, age] { save_flush_ok[i] = FileFlushCache(&sd_image[i], age); }, OFFLOAD_PRIO_BULK);
 	}
+}
 
-	// sd card emulation
-	if (is_x86() || is_pcxt())
+void user_io_save_flush()
+{
+	for (int i = 0; i < 16; i++)
 	{
-		x86_poll(0);
+		save_flush_wait(i);
+		if (sd_image[i].cache && !FileFlushCache(&sd_image[i])) printf("Failed to write the save of slot %d\n", i);
 	}
-	else if ((core_type == CORE_TYPE_8BIT) && !is_menu() && !is_minimig())
+
+	if (is_minimig()) FlushFDD();
+}
+
+static void storage_sd()
+{
+	sd_save_poll();
+
+	if (is_st()) tos_poll();
+	if (is_snes() || is_sgb()) snes_poll();
+
+	for (int i = 0; i < 4; i++)
 	{
-		if (is_st()) tos_poll();
-		if (is_snes() || is_sgb()) snes_poll();
+		int disk = -1;
+		int ack = 0;
+		int op = 0;
+		static uint8_t buffer[16][16384];
+		uint64_t lba;
+		uint32_t blksz, blks, sz;
+
+		if (is_uneon() && i == 3)
+		{
+			x86_poll(1);
+			break;
+		}
 
-		for (int i = 0; i < 4; i++)
+		uint16_t c = spi_uio_cmd_cont(UIO_GET_SDSTAT);
+		if (c & 0x8000)
 		{
-			int disk = -1;
-			int ack = 0;
-			int op = 0;
-			static uint8_t buffer[16][16384];
-			uint64_t lba;
-			uint32_t blksz, blks, sz;
-
-			if (is_uneon() && i == 3)
+			disk = (c >> 2) & 0xF;
+			op = c & 3;
+			ack = disk << 8;
+			spi_w(0);
+			lba = spi_w(0);
+			lba = (lba & 0xFFFF) | (((uint32_t)spi_w(0)) << 16);
+			blks = ((c >> 9) & 0x3F) + 1;
+			blksz = (disk == 1 && is_psx()) ? 2352 : (128 << ((c >> 6) & 7));
+
+			sz = blksz * blks;
+			if (sz > sizeof(buffer[0]))
 			{
-				x86_poll(1);
-				break;
+				blks = sizeof(buffer[0]) / blksz;
+				sz = blksz * blks;
 			}
 
-			uint16_t c = spi_uio_cmd_cont(UIO_GET_SDSTAT);
-			if (c & 0x8000)
+			//if (op) printf("c=%X, op=%d, blkpow=%d, sz=%d, lba=%llu, disk=%d\n", c, op, blkpow, sz, lba, disk);
+		}
+		else
+		{
+			c = spi_w(0);
+			if ((c & 0xf0) == 0x50 && (c & 0x3F03))
 			{
-				disk = (c >> 2) & 0xF;
-				op = c & 3;
-				ack = disk << 8;
-				spi_w(0);
 				lba = spi_w(0);
 				lba = (lba & 0xFFFF) | (((uint32_t)spi_w(0)) << 16);
-				blks = ((c >> 9) & 0x3F) + 1;
-				blksz = (disk == 1 && is_psx()) ? 2352 : (128 << ((c >> 6) & 7));
 
-				sz = blksz * blks;
-				if (sz > sizeof(buffer[0]))
+				// check if core requests configuration
+				if ((c & 0xC) == 0xC)
 				{
-					blks = sizeof(buffer[0]) / blksz;
-					sz = blksz * blks;
+					printf("core requests SD config\n");
+					user_io_sd_set_config();
 				}
 
-				//if (op) printf("c=%X, op=%d, blkpow=%d, sz=%d, lba=%llu, disk=%d\n", c, op, blkpow, sz, lba, disk);
-			}
-			else
-			{
-				c = spi_w(0);
-				if ((c & 0xf0) == 0x50 && (c & 0x3F03))
+				if (c & 0x0003)
 				{
-					lba = spi_w(0);
-					lba = (lba & 0xFFFF) | (((uint32_t)spi_w(0)) << 16);
-
-					// check if core requests configuration
-					if ((c & 0xC) == 0xC)
-					{
-						printf("core requests SD config\n");
-						user_io_sd_set_config();
-					}
-
-					if (c & 0x0003)
-					{
-						disk = 0;
-						op = (c & 1) ? 1 : 2;
-					}
-					else if (c & 0x0900)
-					{
-						disk = 1;
-						op = (c & 0x100) ? 1 : 2;
-					}
-					else if (c & 0x1200)
-					{
-						disk = 2;
-						op = (c & 0x200) ? 1 : 2;
-					}
-					else if (c & 0x2400)
-					{
-						disk = 3;
-						op = (c & 0x400) ? 1 : 2;
-					}
-
-					ack = ((c & 4) ? 0 : ((disk + 1) << 8));
+					disk = 0;
+					op = (c & 1) ? 1 : 2;
+				}
+				else if (c & 0x0900)
+				{
+					disk = 1;
+					op = (c & 0x100) ? 1 : 2;
+				}
+				else if (c & 0x1200)
+				{
+					disk = 2;
+					op = (c & 0x200) ? 1 : 2;
+				}
+				else if (c & 0x2400)
+				{
+					disk = 3;
+					op = (c & 0x400) ? 1 : 2;
 				}
 
-				sz = 512;
-				blksz = 512;
-				blks = 1;
+				ack = ((c & 4) ? 0 : ((disk + 1) << 8));
 			}
-			DisableIO();
 
-			if ((blks == G64_BLOCK_COUNT_1541+1 || blks == G64_BLOCK_COUNT_1571+1) && sd_type[disk])
-			{
-				if (op == 2) c64_writeGCR(disk, lba, blks-1);
-				else if (op & 1) c64_readGCR(disk, lba, blks-1);
-				else break;
-			}
-			else if (op == 2 && is_n64() && use_save)
-			{
-				n64_save_savedata(lba, ack, buffer_lba[disk], buffer[disk], blksz, sz);
-			}
-			else if (op == 2)
-			{
-				//printf("SD WR %llu on %d\n", lba, disk);
+			sz = 512;
+			blksz = 512;
+			blks = 1;
+		}
+		DisableIO();
 
-				if (use_save) menu_process_save();
+		if (op) scheduler_activity();
 
-				buffer_lba[disk] = -1;
+		if ((blks == G64_BLOCK_COUNT_1541+1 || blks == G64_BLOCK_COUNT_1571+1) && sd_type[disk])
+		{
+			if (op == 2) c64_writeGCR(disk, lba, blks-1);
+			else if (op & 1) c64_readGCR(disk, lba, blks-1);
+			else break;
+		}
+		else if (op == 2 && is_n64() && use_save)
+		{
+			save_write_at = GetTimer(0);
+			n64_save_savedata(lba, ack, buffer_lba[disk], buffer[disk], blksz, sz);
+		}
+		else if (op == 2)
+		{
+			//printf("SD WR %llu on %d\n", lba, disk);
 
-				// Fetch sector data from FPGA ...
-				EnableIO();
-				spi_w(UIO_SECTOR_WR | ack);
-				spi_block_read(buffer[disk], fio_size, sz);
-				DisableIO();
+			if (use_save) menu_process_save();
+			if (sd_image_cangrow[disk]) save_write_at = GetTimer(0);
+
+			buffer_lba[disk] = -1;
 
-				if (sd_image[disk].type == 2 && !lba)
+			// Fetch sector data from FPGA ...
+			EnableIO();
+			spi_w(UIO_SECTOR_WR | ack);
+			spi_block_read(buffer[disk], fio_size, sz);
+			DisableIO();
+
+			if (sd_image[disk].type == 2 && is_psx())
+			{
+				// the card is created whole, the first write can be at any frame
+				if (FileOpenEx(&sd_image[disk], sd_image[disk].path, O_CREAT | O_RDWR | O_SYNC))
 				{
-					//Create the file
-					if (FileOpenEx(&sd_image[disk], sd_image[disk].path, O_CREAT | O_RDWR | O_SYNC))
-					{
-						diskled_on();
-						if (FileWriteAdv(&sd_image[disk], buffer[disk], sz))
-						{
-							sd_image[disk].size = sz;
-						}
-					}
-					else
+					// in the cache the blank card goes out with the next write-back
+					diskled_on();
+					sd_image[disk].size = PSX_MCD_SIZE;
+					FileSetCache(&sd_image[disk], SAVE_CACHE_MB, save_delay());
+
+					uint8_t *card = (uint8_t*)malloc(PSX_MCD_SIZE);
+					if (card)
 					{
-						printf("Error in creating file: %s\n", sd_image[disk].path);
+						psx_fill_blanksave(card, 0, PSX_MCD_SIZE / 1024);
+						if (lba * blksz + sz <= PSX_MCD_SIZE) memcpy(card + lba * blksz, buffer[disk], sz);
+						if (!FileWriteAt(&sd_image[disk], 0, card, PSX_MCD_SIZE)) sd_image[disk].size = 0;
+						free(card);
 					}
 				}
 				else
 				{
-					// ... and write it to disk
-					uint64_t size = sd_image[disk].size / blksz;
-					if (sz && lba <= size)
+					printf("Error in creating file: %s\n", sd_image[disk].path);
+				}
+			}
+			else if (sd_image[disk].type == 2 && !lba)
+			{
+				//Create the file
+				if (FileOpenEx(&sd_image[disk], sd_image[disk].path, O_CREAT | O_RDWR | O_SYNC))
+				{
+					diskled_on();
+					if (FileWriteAdv(&sd_image[disk], buffer[disk], sz))
 					{
-						diskled_on();
-						if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
-						{
-							if (!sd_image_cangrow[disk])
-							{
-								__off64_t rem = sd_image[disk].size - sd_image[disk].offset;
-								sz = (rem >= sz) ? sz : (int)rem;
-							}
-
-							if (sz) FileWriteAdv(&sd_image[disk], buffer[disk], sz);
-						}
+						sd_image[disk].size = sz;
 					}
+					if (save_delay()) save_cache_set(disk);
+				}
+				else
+				{
+					printf("Error in creating file: %s\n", sd_image[disk].path);
 				}
 			}
-			else if ((op & 1) && is_n64() && use_save)
+			else
 			{
-				n64_load_savedata(lba, ack, buffer_lba[disk], buffer[disk], sizeof(*buffer), blksz, sz);
+				// ... and write it to disk
+				uint64_t size = sd_image[disk].size / blksz;
+				if (sz && lba <= size)
+				{
+					diskled_on();
+					sd_write(disk, lba, blksz, buffer[disk], sz);
+				}
 			}
-			else if (op & 1)
-			{
-				uint32_t buf_n = sizeof(buffer[0]) / blksz;
-				//printf("SD RD (%llu,%d) on %d, WIDE=%d\n", lba, blksz, disk, fio_size);
+		}
+		else if ((op & 1) && is_n64() && use_save)
+		{
+			n64_load_savedata(lba, ack, buffer_lba[disk], buffer[disk], sizeof(*buffer), blksz, sz);
+		}
+		else if (op & 1)
+		{
+			uint32_t buf_n = sizeof(buffer[0]) / blksz;
+			//printf("SD RD (%llu,%d) on %d, WIDE=%d\n", lba, blksz, disk, fio_size);
 
-				int done = 0;
-				uint32_t offset;
+			int done = 0;
+			uint32_t offset;
 
-				if ((buffer_lba[disk] == -1LLU) || lba < buffer_lba[disk] || (lba + blks - buffer_lba[disk]) > buf_n)
+			if ((buffer_lba[disk] == -1LLU) || lba < buffer_lba[disk] || (lba + blks - buffer_lba[disk]) > buf_n)
+			{
+				buffer_lba[disk] = -1;
+				if (blksz == 2352 && is_psx())
 				{
-					buffer_lba[disk] = -1;
-					if (blksz == 2352 && is_psx())
+					diskled_on();
+					psx_read_cd(buffer[disk], lba, buf_n);
+					done = 1;
+					buffer_lba[disk] = lba;
+				}
+				else if (sd_image[disk].size)
+				{
+					diskled_on();
+					if (sd_read(disk, lba, blksz, buffer[disk], sizeof(buffer[disk])))
 					{
-						diskled_on();
-						psx_read_cd(buffer[disk], lba, buf_n);
 						done = 1;
 						buffer_lba[disk] = lba;
 					}
-					else if (sd_image[disk].size)
+				}
+
+				//Even after error we have to provide the block to the core
+				//Give an empty block.
+				if (!done)
+				{
+					if (sd_image[disk].type == 2)
 					{
-						diskled_on();
-						if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
+						if (is_megacd())
 						{
-							if (FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk])))
-							{
-								done = 1;
-								buffer_lba[disk] = lba;
-							}
+							mcd_fill_blanksave(buffer[disk], lba);
 						}
-					}
-
-					//Even after error we have to provide the block to the core
-					//Give an empty block.
-					if (!done)
-					{
-						if (sd_image[disk].type == 2)
+						else if (is_pce())
 						{
-							if (is_megacd())
-							{
-								mcd_fill_blanksave(buffer[disk], lba);
-							}
-							else if (is_pce())
-							{
-								memset(buffer[disk], 0, sizeof(buffer[disk]));
-								if (!lba)
-								{
-									memcpy(buffer[disk], "HUBM\x00\x88\x10\x80", 8);
-								}
-							}
-							else if (is_psx())
-							{
-								psx_fill_blanksave(buffer[disk], lba, blks);
-							}
-							else if (is_saturn())
-							{
-								saturn_fill_blanksave(buffer[disk], lba);
-							}
-							else
+							memset(buffer[disk], 0, sizeof(buffer[disk]));
+							if (!lba)
 							{
-								memset(buffer[disk], -1, sizeof(buffer[disk]));
+								memcpy(buffer[disk], "HUBM\x00\x88\x10\x80", 8);
 							}
 						}
+						else if (is_psx())
+						{
+							psx_fill_blanksave(buffer[disk], lba, blks);
+						}
+						else if (is_saturn())
+						{
+							saturn_fill_blanksave(buffer[disk], lba);
+						}
 						else
 						{
-							memset(buffer[disk], 0, sizeof(buffer[disk]));
+							memset(buffer[disk], -1, sizeof(buffer[disk]));
 						}
 					}
-
-					offset = 0;
-				}
-				else
-				{
-					offset = (lba - buffer_lba[disk]) * blksz;
-					done = 1;
+					else
+					{
+						memset(buffer[disk], 0, sizeof(buffer[disk]));
+					}
 				}
 
-				// data is now stored in buffer. send it to fpga
-				EnableIO();
-				spi_w(UIO_SECTOR_RD | ack);
-				spi_block_write(buffer[disk] + offset, fio_size, sz);
-				DisableIO();
+				offset = 0;
+			}
+			else
+			{
+				offset = (lba - buffer_lba[disk]) * blksz;
+				done = 1;
+			}
+
+			// data is now stored in buffer. send it to fpga
+			EnableIO();
+			spi_w(UIO_SECTOR_RD | ack);
+			spi_block_write(buffer[disk] + offset, fio_size, sz);
+			DisableIO();
 
-				if (sd_image[disk].type == 2)
+			if (sd_image[disk].type == 2)
+			{
+				buffer_lba[disk] = -1;
+			}
+			else if (done && (lba + blks - buffer_lba[disk]) == buf_n)
+			{
+				diskled_on();
+				lba += blks;
+				if (blksz == 2352 && is_psx())
 				{
-					buffer_lba[disk] = -1;
+					psx_read_cd(buffer[disk], lba, buf_n);
+					buffer_lba[disk] = lba;
 				}
-				else if (done && (lba + blks - buffer_lba[disk]) == buf_n)
+				else if (sd_read(disk, lba, blksz, buffer[disk], sizeof(buffer[disk])))
 				{
-					diskled_on();
-					lba += blks;
-					if (blksz == 2352 && is_psx())
-					{
-						psx_read_cd(buffer[disk], lba, buf_n);
-						buffer_lba[disk] = lba;
-					}
-					else if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET) &&
-						FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk])))
-					{
-						buffer_lba[disk] = lba;
-					}
-					else
-					{
-						memset(buffer[disk], 0, sizeof(buffer[disk]));
-						buffer_lba[disk] = -1;
-					}
+					buffer_lba[disk] = lba;
+				}
+				else
+				{
+					memset(buffer[disk], 0, sizeof(buffer[disk]));
+					buffer_lba[disk] = -1;
 				}
 			}
-			else break;
 		}
+		else break;
+	}
+}
+
+static void storage_x86()
+{
+	x86_poll(0);
+}
+
+static void storage_psx()
+{
+	storage_sd();
+	psx_poll();
+}
+
+static void cd_neogeo()
+{
+	if (neocd_is_en()) neocd_poll();
+}
+
+static void poll_minimig()
+{
+	kbd_fifo_poll();
+
+	if (!rtc_timer || CheckTimer(rtc_timer))
+	{
+		// Update once per minute should be enough
+		rtc_timer = GetTimer(60000);
+		send_rtc(1);
 	}
+}
 
-	if (is_neogeo() && (!rtc_timer || CheckTimer(rtc_timer)))
+static void poll_neogeo()
+{
+	if (!rtc_timer || CheckTimer(rtc_timer))
 	{
 		// Update once per minute should be enough
 		rtc_timer = GetTimer(60000);
 		send_rtc(1);
 	}
+}
+
+static void core_hooks_resolve()
+{
+	core_hooks = {};
+
+	if (is_minimig())
+	{
+		core_hooks.poll = poll_minimig;
+		core_hooks.storage = storage_minimig;
+	}
+	else if (is_x86() || is_pcxt())
+	{
+		core_hooks.storage = storage_x86;
+	}
+	else if (core_type == CORE_TYPE_8BIT && !is_menu())
+	{
+		core_hooks.storage = is_psx() ? storage_psx : storage_sd;
+	}
+
+	if (is_neogeo()) core_hooks.poll = poll_neogeo;
+	if (is_archie()) core_hooks.poll = archie_poll;
+	if (core_type == CORE_TYPE_SHARPMZ) core_hooks.poll = sharpmz_poll;
+
+	if (is_megacd()) core_hooks.cd = mcd_poll;
+	else if (is_pce()) core_hooks.cd = pcecd_poll;
+	else if (is_saturn()) core_hooks.cd = saturn_poll;
+	else if (is_neogeo()) core_hooks.cd = cd_neogeo;
+}
+
+void user_io_cd_poll()
+{
+	if (core_hooks.cd) core_hooks.cd();
+}
+
+void user_io_poll_storage()
+{
+	PROFILE_FUNCTION();
 
-	if (is_archie()) archie_poll();
-	if (core_type == CORE_TYPE_SHARPMZ) sharpmz_poll();
+	// an in-place core switch is setting up the core from the UI coroutine
+	if (core_in_init) return;
+
+	if ((core_type != CORE_TYPE_SHARPMZ) &&
+		(core_type != CORE_TYPE_8BIT))
+	{
+		return;  // no user io for the installed core
+	}
+
+	if (core_hooks.storage) core_hooks.storage();
+	if (core_hooks.cd) core_hooks.cd();
+}
+
+void user_io_poll()
+{
+	PROFILE_FUNCTION();
+
+	if (core_in_init) return;
+
+	user_io_screenshot_poll();
+
+	if ((core_type != CORE_TYPE_SHARPMZ) &&
+		(core_type != CORE_TYPE_8BIT))
+	{
+		return;  // no user io for the installed core
+	}
+
+	user_io_send_buttons(0);
+
+	static unsigned long status_timer = 0;
+	if (core_type == CORE_TYPE_8BIT && !is_menu() && CheckTimer(status_timer))
+	{
+		status_timer = GetTimer(STATUS_POLL_MS);
+		check_status_change();
+	}
+
+	if (core_hooks.poll) core_hooks.poll();
 
 	static uint8_t leds = 0;
 
@@ -3506,16 +4139,27 @@ void user_io_poll()
 		diskled_is_on = 0;
 	}
 
-	if (is_megacd()) mcd_poll();
-	if (is_pce()) pcecd_poll();
-	if (is_saturn()) saturn_poll();
-	if (is_psx()) psx_poll();
-	if (is_neogeo_cd()) neocd_poll();
 	process_ss(0);
 }
 
+// once per core, see kbd_proto
+static int kbd_protocol()
+{
+	if (!kbd_proto)
+	{
+		if (is_minimig()) kbd_proto = KBD_PROTO_AMIGA;
+		else if (is_archie()) kbd_proto = KBD_PROTO_ARCHIE;
+		else if (core_type == CORE_TYPE_8BIT) kbd_proto = KBD_PROTO_PS2;
+		else if (core_type == CORE_TYPE_SHARPMZ) kbd_proto = KBD_PROTO_SHARPMZ;
+		else kbd_proto = KBD_PROTO_NONE;
+	}
+	return kbd_proto;
+}
+
 static void send_keycode(unsigned short key, int press)
 {
+	int proto = kbd_protocol();
+
 	if (is_pcxt())
 	{
 		//WIN+... we override this hotkey in the core.
@@ -3529,7 +4173,7 @@ static void send_keycode(unsigned short key, int press)
 			return;
 		}
 	}
-	if (is_minimig())
+	if (proto == KBD_PROTO_AMIGA)
 	{
 		if (press > 1) return;
 
@@ -3588,7 +4232,7 @@ static void send_keycode(unsigned short key, int press)
 		return;
 	}
 
-	if (is_archie())
+	if (proto == KBD_PROTO_ARCHIE)
 	{
 		if (press > 1) return;
 
@@ -3623,7 +4267,7 @@ static void send_keycode(unsigned short key, int press)
 		return;
 	}
 
-	if (core_type == CORE_TYPE_8BIT)
+	if (proto == KBD_PROTO_PS2)
 	{
 		uint32_t code = get_ps2_code(key);
 		if (code == NONE) return;
@@ -3705,7 +4349,7 @@ static void send_keycode(unsigned short key, int press)
 		}
 	}
 
-	if (core_type == CORE_TYPE_SHARPMZ)
+	if (proto == KBD_PROTO_SHARPMZ)
 	{
 		uint32_t code = get_ps2_code(key);
 		if (code == NONE) return;
@@ -3865,6 +4509,7 @@ void user_io_osd_key_enable(char on)
 {
 	//printf("OSD is now %s\n", on ? "visible" : "invisible");
 	osd_is_visible = on;
+	if (on) user_io_save_flush();
 	input_switch(-1);
 }
 
@@ -3888,6 +4533,18 @@ void user_io_kbd(uint16_t key, int press)
 		}
 	}
 	else
+	if (key == KEY_BACKSPACE && (get_key_mod() & (RGUI | LGUI)) && rewind_enabled())
+	{
+		// Win+Backspace - rewind, repeats while held
+		if (press) rewind_back();
+	}
+	else
+	if (key == KEY_PAUSE && (get_key_mod() & (RGUI | LGUI)))
+	{
+		// Win+Pause - performance HUD
+		if (press == 1) perfhud_toggle();
+	}
+	else
 	if (key == KEY_MUTE)
 	{
 		if (press == 1 && hasAPI1_5()) set_volume(0);
@@ -3905,12 +4562,13 @@ void user_io_kbd(uint16_t key, int press)
 	else
 	if (key == 0xBE)
 	{
-		if (press) setBrightness(BRIGHTNESS_DOWN, 0);
+		// the pi-top hub is a slow SPI device, keep it off the main loop
+		if (press) offload_add_work([] { setBrightness(BRIGHTNESS_DOWN, 0); }, OFFLOAD_PRIO_BULK);
 	}
 	else
 	if (key == 0xBF)
 	{
-		if (press) setBrightness(BRIGHTNESS_UP, 0);
+		if (press) offload_add_work([] { setBrightness(BRIGHTNESS_UP, 0); }, OFFLOAD_PRIO_BULK);
 	}
 	else
 	if (key == KEY_F2 && osd_is_visible)
@@ -4059,38 +4717,112 @@ uint16_t user_io_get_sdram_cfg()
 	return sdram_cfg;
 }
 
-static struct { const char *fmtstr; Imlib_Load_Error errno; } err_strings[] = {
-  {"file '%s' does not exist", IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST},
-  {"file '%s' is a directory", IMLIB_LOAD_ERROR_FILE_IS_DIRECTORY},
-  {"permission denied to read file '%s'", IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_READ},
-  {"no loader for the file format used in file '%s'", IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT},
-  {"path for file '%s' is too long", IMLIB_LOAD_ERROR_PATH_TOO_LONG},
-  {"a component of path '%s' does not exist", IMLIB_LOAD_ERROR_PATH_COMPONENT_NON_EXISTANT},
-  {"a component of path '%s' is not a directory", IMLIB_LOAD_ERROR_PATH_COMPONENT_NOT_DIRECTORY},
-  {"path '%s' has too many symbolic links", IMLIB_LOAD_ERROR_TOO_MANY_SYMBOLIC_LINKS},
-  {"ran out of file descriptors trying to access file '%s'", IMLIB_LOAD_ERROR_OUT_OF_FILE_DESCRIPTORS},
-  {"denied write permission for file '%s'", IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_WRITE},
-  {"out of disk space writing to file '%s'", IMLIB_LOAD_ERROR_OUT_OF_DISK_SPACE},
-  {(const char *)NULL, (Imlib_Load_Error) 0}
+// Screenshots: the frame is copied out of the scaler on the main thread,
+// scaling and PNG encoding run on the bulk worker. The result is shown
+// by user_io_screenshot_poll() once the job is done.
+struct screenshot_job
+{
+	uint8_t *rgb;
+	int width, height;
+	int out_width, out_height;
+	int ok;
+	char path[1024];
+	char name[256];
 };
 
-static void print_imlib_load_error (Imlib_Load_Error err, const char *filepath) {
-  int i;
-  for (i = 0; err_strings[i].fmtstr != NULL; i++) {
-    if (err == err_strings[i].errno) {
-	printf("Screenshot Error (%d): ",err);
-	printf(err_strings[i].fmtstr,filepath);
-	printf("\n");
-      return ;
-    }
-  }
-  /* Unrecognised error */
-    printf("Screenshot Error (%d): unrecognized error accessing file '%s'\n",err,filepath);
-  return ;
+static screenshot_job *shot_job = nullptr;
+static offload_handle_t shot_handle = 0;
+
+// bilinear, 16.16 fixed point
+static uint8_t *screenshot_scale(const uint8_t *src, int w, int h, int ow, int oh)
+{
+	uint8_t *dst = (uint8_t *)malloc(ow * oh * 3);
+	if (!dst) return nullptr;
+
+	uint32_t sx = ((uint32_t)(w - 1) << 16) / (ow > 1 ? ow - 1 : 1);
+	uint32_t sy = ((uint32_t)(h - 1) << 16) / (oh > 1 ? oh - 1 : 1);
+	uint8_t *out = dst;
+	for (int y = 0; y < oh; y++)
+	{
+		uint32_t fy = y * sy;
+		int y0 = fy >> 16, y1 = (y0 + 1 < h) ? y0 + 1 : y0;
+		uint32_t wy = (fy >> 8) & 0xFF;
+		const uint8_t *r0 = src + y0 * w * 3, *r1 = src + y1 * w * 3;
+
+		for (int x = 0; x < ow; x++)
+		{
+			uint32_t fx = x * sx;
+			int x0 = fx >> 16, x1 = (x0 + 1 < w) ? x0 + 1 : x0;
+			uint32_t wx = (fx >> 8) & 0xFF;
+			for (int c = 0; c < 3; c++)
+			{
+				uint32_t t = r0[x0 * 3 + c] * (256 - wx) + r0[x1 * 3 + c] * wx;
+				uint32_t b = r1[x0 * 3 + c] * (256 - wx) + r1[x1 * 3 + c] * wx;
+				*out++ = (t * (256 - wy) + b * wy + 32768) >> 16;
+			}
+		}
+	}
+	return dst;
+}
+
+static void screenshot_encode(screenshot_job *job)
+{
+	int w = job->width, h = job->height;
+	uint8_t *img = job->rgb;
+	if (job->out_width > 0 && job->out_height > 0 && (job->out_width != w || job->out_height != h))
+	{
+		uint8_t *scaled = screenshot_scale(img, w, h, job->out_width, job->out_height);
+		if (scaled)
+		{
+			free(img);
+			img = job->rgb = scaled;
+			w = job->out_width;
+			h = job->out_height;
+		}
+	}
+
+	size_t len = 0;
+	void *png = tdefl_write_image_to_png_file_in_memory_ex(img, w, h, 3, &len, 6, MZ_FALSE);
+	free(job->rgb);
+	job->rgb = nullptr;
+	if (!png)
+	{
+		printf("Screenshot Error: cannot encode\n");
+		return;
+	}
+
+	FILE *fp = fopen(job->path, "wb");
+	if (fp)
+	{
+		job->ok = (fwrite(png, 1, len, fp) == len);
+		if (fclose(fp)) job->ok = 0;
+		if (!job->ok) unlink(job->path);
+	}
+	if (!job->ok) printf("Screenshot Error: cannot write '%s'\n", job->path);
+	mz_free(png);
+}
+
+void user_io_screenshot_poll()
+{
+	if (!shot_job || !offload_is_done(shot_handle)) return;
+
+	char msg[1024];
+	if (shot_job->ok) snprintf(msg, sizeof(msg), "Screen saved to\n%s", shot_job->name);
+	else snprintf(msg, sizeof(msg), "error in saving png");
+	Info(msg);
+
+	delete shot_job;
+	shot_job = nullptr;
 }
 
 bool user_io_screenshot(const char *pngname, int rescale)
 {
+	if (shot_job)
+	{
+		Info("Screenshot in progress");
+		return false;
+	}
+
 	mister_scaler *ms = mister_scaler_init();
 	if (ms == NULL)
 	{
@@ -4098,43 +4830,40 @@ bool user_io_screenshot(const char *pngname, int rescale)
 		Info("Scaler not compatible");
 		return false;
 	}
-	else
+
+	const char *basename = last_filename;
+	if( pngname && *pngname )
+		basename = pngname;
+
+	screenshot_job *job = new screenshot_job();
+	job->width = ms->width;
+	job->height = ms->height;
+
+	/* do we want to save a rescaled image? */
+	if (rescale)
 	{
-		const char *basename = last_filename;
-		if( pngname && *pngname )
-			basename = pngname;
-		unsigned char *outputbuf = (unsigned char *)calloc(ms->width*ms->height * 4, 1);
-		// read the image into the outpubuf - RGBA format
-		mister_scaler_read_32(ms,outputbuf);
-		// using_data will keep a pointer and dispose of the outbuf
-		Imlib_Image im = imlib_create_image_using_data(ms->width,ms->height,(unsigned int *)outputbuf);
-		imlib_context_set_image(im);
-
-		static char filename[1024];
-		FileGenerateScreenshotName(basename, filename, 1024);
-
-		/* do we want to save a rescaled image? */
-		if (rescale)
-		{
-			Imlib_Image im_scaled=imlib_create_cropped_scaled_image(0,0,ms->width,ms->height,ms->output_width,ms->output_height);
-			imlib_free_image_and_decache();
-			imlib_context_set_image(im_scaled);
-		}
-		Imlib_Load_Error error;
-		imlib_save_image_with_error_return(getFullPath(filename),&error);
-		if (error != IMLIB_LOAD_ERROR_NONE)
-		{
-			print_imlib_load_error (error, filename);
-			Info("error in saving png");
-			return false;
-		}
-		imlib_free_image_and_decache();
-		mister_scaler_free(ms);
-		free(outputbuf);
-		char msg[1024];
-		snprintf(msg, 1024, "Screen saved to\n%s", filename + strlen(SCREENSHOT_DIR"/"));
-		Info(msg);
+		job->out_width = ms->output_width;
+		job->out_height = ms->output_height;
 	}
+
+	// the raw frame, RGB
+	job->rgb = (uint8_t *)malloc(ms->width * ms->height * 3);
+	if (job->rgb) mister_scaler_read(ms, job->rgb);
+	mister_scaler_free(ms);
+	if (!job->rgb)
+	{
+		delete job;
+		Info("error in saving png");
+		return false;
+	}
+
+	static char filename[1024];
+	FileGenerateScreenshotName(basename, filename, 1024);
+	snprintf(job->path, sizeof(job->path), "%s", getFullPath(filename));
+	snprintf(job->name, sizeof(job->name), "%s", filename + strlen(SCREENSHOT_DIR"/"));
+
+	shot_job = job;
+	shot_handle = offload_add_work([job] { screenshot_encode(job); }, OFFLOAD_PRIO_BULK);
 	return true;
 }
 
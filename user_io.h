@@ -161,9 +161,12 @@
 #define EMU_JOY1  3
 
 void user_io_init(const char *path, const char *xml);
+int user_io_core_switch(const char *path, const char *xml);
 unsigned char user_io_core_type();
 void user_io_read_core_name();
 void user_io_poll();
+void user_io_poll_storage();
+void user_io_cd_poll();
 char user_io_menu_button();
 char user_io_user_button();
 void user_io_osd_key_enable(char);
@@ -231,13 +234,19 @@ void user_io_rtc_reset();
 
 void user_io_screenshot_cmd(const char *cmd);
 bool user_io_screenshot(const char *pngname, int rescale);
+void user_io_screenshot_poll();
 
 const char* get_rbf_dir();
 const char* get_rbf_name();
 const char* get_rbf_path();
 
+// Runs the file actions of an MGL on the running core if it was loaded from
+// rbf. Returns 0 when a reload is needed (other core, setname, no actions).
+int user_io_mgl_load(const char *rbf, const char *xml);
+
 uint16_t sdram_sz(int sz = -1);
 int user_io_is_dualsdr();
+int user_io_dma_wide();
 uint16_t altcfg(int alt = -1);
 
 void MakeFile(const char * filename, const char * data);
@@ -258,6 +267,9 @@ int user_io_use_cheats();
 
 int process_ss(const char *rom_name, int enable = 1);
 
+// writes the delayed saves (save_write_delay) and Minimig floppy sectors now
+void user_io_save_flush();
+
 void diskled_on();
 #define DISKLED_ON  diskled_on()
 #define DISKLED_OFF void()
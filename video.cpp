@@ -11,6 +11,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <math.h>
+#include <dirent.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #include "hardware.h"
 #include "user_io.h"
@@ -26,6 +30,8 @@
 #include "str_util.h"
 #include "profiling.h"
 #include "offload.h"
+#include "cd.h"
+#include "fbdraw.h"
 
 #include "support.h"
 #include "lib/imlib2/Imlib2.h"
@@ -72,6 +78,8 @@ static int brd_y = 0;
 
 static int menu_bg = 0;
 static int menu_bgn = 0;
+static int draw_bgn = 1; // page the menu background is drawn into, see video_menu_bg
+static offload_handle_t bg_job = 0;
 
 static VideoInfo current_video_info;
 
@@ -206,7 +214,7 @@ static uint32_t getPLLdiv(uint32_t div)
 	return ((div / 2) << 8) | (div / 2);
 }
 
-static int findPLLpar(double Fout, uint32_t *pc, uint32_t *pm, double *pko)
+static int findPLLpar(double Fout, uint32_t *pc, uint32_t *pm, double *pko, int verbose)
 {
 	uint32_t c = 1;
 	while ((Fout*c) < 400) c++;
@@ -222,13 +230,13 @@ static int findPLLpar(double Fout, uint32_t *pc, uint32_t *pm, double *pko)
 
 		if (ko && (ko <= 0.05f || ko >= 0.95f))
 		{
-			printf("Fvco=%f, C=%d, M=%d, K=%f ", fvco, c, m, ko);
+			if (verbose) printf("Fvco=%f, C=%d, M=%d, K=%f ", fvco, c, m, ko);
 			if (fvco > 1500.f)
 			{
-				printf("-> No exact parameters found\n");
+				if (verbose) printf("-> No exact parameters found\n");
 				return 0;
 			}
-			printf("-> K is outside allowed range\n");
+			if (verbose) printf("-> K is outside allowed range\n");
 			c++;
 		}
 		else
@@ -244,17 +252,19 @@ static int findPLLpar(double Fout, uint32_t *pc, uint32_t *pm, double *pko)
 	return 0;
 }
 
-static void setPLL(double Fout, vmode_custom_t *v)
+struct pllParams
 {
-	PROFILE_FUNCTION();
-
+	double Fout;
 	double Fpix;
+	uint32_t c, m, k;
+};
+
+static void calcPLL(double Fout, pllParams *p, int verbose)
+{
 	double fvco, ko;
 	uint32_t m, c;
 
-	printf("Calculate PLL for %.4f MHz:\n", Fout);
-
-	if (!findPLLpar(Fout, &c, &m, &ko))
+	if (!findPLLpar(Fout, &c, &m, &ko, verbose))
 	{
 		c = 1;
 		while ((Fout*c) < 400) c++;
@@ -279,24 +289,69 @@ static void setPLL(double Fout, vmode_custom_t *v)
 
 	fvco = ko + m;
 	fvco *= 50.f;
-	Fpix = fvco / c;
 
-	printf("Fvco=%f, C=%d, M=%d, K=%f(%u) -> Fpix=%f\n", fvco, c, m, ko, k, Fpix);
+	p->Fout = Fout;
+	p->Fpix = fvco / c;
+	p->c = c;
+	p->m = m;
+	p->k = k;
+
+	if (verbose) printf("Fvco=%f, C=%d, M=%d, K=%f(%u) -> Fpix=%f\n", fvco, c, m, ko, k, p->Fpix);
+}
+
+// Pixel clocks seen so far. The standard modes are filled in at startup,
+// vsync_adjust and VRR keep hitting the same few clocks of the core.
+#define PLL_MEMO_SIZE 64
+
+static pllParams pll_memo[PLL_MEMO_SIZE];
+static int pll_memo_count = 0, pll_memo_next = 0;
+
+static const pllParams *getPLL(double Fout, int verbose)
+{
+	for (int i = 0; i < pll_memo_count; i++)
+	{
+		if (pll_memo[i].Fout == Fout)
+		{
+			if (verbose) printf("C=%d, M=%d, K=%u -> Fpix=%f (cached)\n", pll_memo[i].c, pll_memo[i].m, pll_memo[i].k, pll_memo[i].Fpix);
+			return &pll_memo[i];
+		}
+	}
+
+	pllParams *p = &pll_memo[pll_memo_next];
+	pll_memo_next = (pll_memo_next + 1) % PLL_MEMO_SIZE;
+	if (pll_memo_count < PLL_MEMO_SIZE) pll_memo_count++;
+
+	calcPLL(Fout, p, verbose);
+	return p;
+}
+
+static void video_pll_prefill()
+{
+	for (auto &m : vmodes) getPLL(m.Fpix, 0);
+	for (auto &m : tvmodes) getPLL(m.Fpix, 0);
+}
+
+static void setPLL(double Fout, vmode_custom_t *v)
+{
+	PROFILE_FUNCTION();
+
+	printf("Calculate PLL for %.4f MHz:\n", Fout);
+	const pllParams *p = getPLL(Fout, 1);
 
 	v->item[9]  = 4;
-	v->item[10] = getPLLdiv(m);
+	v->item[10] = getPLLdiv(p->m);
 	v->item[11] = 3;
 	v->item[12] = 0x10000;
 	v->item[13] = 5;
-	v->item[14] = getPLLdiv(c);
+	v->item[14] = getPLLdiv(p->c);
 	v->item[15] = 9;
 	v->item[16] = 2;
 	v->item[17] = 8;
 	v->item[18] = 7;
 	v->item[19] = 7;
-	v->item[20] = k;
+	v->item[20] = p->k;
 
-	v->Fpix = Fpix;
+	v->Fpix = p->Fpix;
 }
 
 struct ScalerFilter
@@ -373,6 +428,13 @@ static bool read_video_filter(int type, VideoFilter *out)
 	static char filename[1024];
 	snprintf(filename, sizeof(filename), COEFF_DIR"/%s", scaler_flt[type].filename);
 
+	// parsed and scaled tables of known files (keyed by path, size and mtime)
+	if (scaler_flt[type].filename[0] && cd_info_load(filename, "vflt", out, sizeof(VideoFilter)))
+	{
+		printf("Filter \'%s\', cached\n", scaler_flt[type].filename);
+		return true;
+	}
+
 	if (FileOpenTextReader(&reader, filename))
 	{
 		const char *line;
@@ -446,6 +508,7 @@ static bool read_video_filter(int type, VideoFilter *out)
 	MD5Update(&ctx, (unsigned char *)out->adaptive_phases, sizeof(VideoFilter::adaptive_phases));
 	MD5Final(out->digest.md5, &ctx);
 
+	if (valid) cd_info_store(filename, "vflt", out, sizeof(VideoFilter));
 	return valid;
 }
 
@@ -575,9 +638,14 @@ static void setScaler()
 		}
 	}
 
-	spi_uio_cmd_cont(UIO_SET_AR_CUST);
-	for (int i = 0; i < 4; i++) spi_w(arc[i]);
-	DisableIO();
+	static uint32_t last_arc[4] = { ~0u };
+	if (memcmp(arc, last_arc, sizeof(arc)))
+	{
+		spi_uio_cmd_cont(UIO_SET_AR_CUST);
+		for (int i = 0; i < 4; i++) spi_w(arc[i]);
+		DisableIO();
+		memcpy(last_arc, arc, sizeof(arc));
+	}
 	set_vfilter(1);
 }
 
@@ -685,12 +753,14 @@ static void setGamma()
 
 	snprintf(filename, sizeof(filename), GAMMA_DIR"/%s", gamma_cfg + 1);
 
-	if (FileOpenTextReader(&reader, filename))
+	// curve as sent to the core, word count first
+	static uint16_t curve[1 + 256 * 3];
+	int loaded = cd_info_load(filename, "gamma", curve, sizeof(curve));
+	if (!loaded && FileOpenTextReader(&reader, filename))
 	{
-		spi_uio_cmd_cont(UIO_SET_GAMCURV);
-
 		const char *line;
 		int index = 0;
+		curve[0] = 0;
 		while ((line = FileReadLine(&reader)))
 		{
 			int c0, c1, c2;
@@ -704,14 +774,22 @@ static void setGamma()
 
 			if (n == 3)
 			{
-				spi_w((index << 8) | (c0 & 0xFF));
-				spi_w((index << 8) | (c1 & 0xFF));
-				spi_w((index << 8) | (c2 & 0xFF));
+				curve[++curve[0]] = (index << 8) | (c0 & 0xFF);
+				curve[++curve[0]] = (index << 8) | (c1 & 0xFF);
+				curve[++curve[0]] = (index << 8) | (c2 & 0xFF);
 
 				index++;
 				if (index >= 256) break;
 			}
 		}
+		cd_info_store(filename, "gamma", curve, sizeof(curve));
+		loaded = 1;
+	}
+
+	if (loaded)
+	{
+		spi_uio_cmd_cont(UIO_SET_GAMCURV);
+		for (int i = 1; i <= curve[0]; i++) spi_w(curve[i]);
 		DisableIO();
 		spi_uio_cmd8(UIO_SET_GAMMA, gamma_cfg[0]);
 	}
@@ -800,35 +878,54 @@ enum
 	SM_MODE_COUNT
 };
 
+// words of the last shadow mask upload: flags, up to 16x16 LUT, sizes
+static uint16_t sm_words[1 + 256 + 2 + 1];
+static int sm_len = 0;
+
+static void sm_put(uint16_t word)
+{
+	if (sm_len < (int)(sizeof(sm_words) / sizeof(sm_words[0]))) sm_words[sm_len++] = word;
+}
+
 static void setShadowMask()
 {
 	PROFILE_FUNCTION();
 
 	static char filename[1024];
-	has_shadow_mask = 0;
+	sm_len = 0;
 
-	if (!spi_uio_cmd_cont(UIO_SHADOWMASK))
+	switch (shadow_mask_cfg[0])
 	{
-		DisableIO();
-		return;
-	}
-
-	has_shadow_mask = 1;
-	switch (video_get_shadow_mask_mode())
-	{
-		default: spi_w(SM_FLAG(0)); break;
-		case SM_MODE_1X: spi_w(SM_FLAG(SM_FLAG_ENABLED)); break;
-		case SM_MODE_2X: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_2X)); break;
-		case SM_MODE_1X_ROTATED: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED)); break;
-		case SM_MODE_2X_ROTATED: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED | SM_FLAG_2X)); break;
+		default: sm_put(SM_FLAG(0)); break;
+		case SM_MODE_1X: sm_put(SM_FLAG(SM_FLAG_ENABLED)); break;
+		case SM_MODE_2X: sm_put(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_2X)); break;
+		case SM_MODE_1X_ROTATED: sm_put(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED)); break;
+		case SM_MODE_2X_ROTATED: sm_put(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED | SM_FLAG_2X)); break;
 	}
 
 	int loaded = 0;
 	snprintf(filename, sizeof(filename), SMASK_DIR"/%s", shadow_mask_cfg + 1);
 
+	// LUT part parsed for this file and output resolution
+	struct
+	{
+		int32_t loaded, len;
+		uint16_t words[sizeof(sm_words) / sizeof(sm_words[0]) - 1];
+	} rec;
+
+	char tag[16];
+	sprintf(tag, "sm%u", v_cur.item[5]);
+
 	fileTextReader reader;
-	if (FileOpenTextReader(&reader, filename))
+	if (shadow_mask_cfg[1] && cd_info_load(filename, tag, &rec, sizeof(rec)) && rec.len >= 0 && rec.len <= (int)(sizeof(rec.words) / sizeof(rec.words[0])))
+	{
+		memcpy(sm_words + sm_len, rec.words, rec.len * sizeof(rec.words[0]));
+		sm_len += rec.len;
+		loaded = rec.loaded;
+	}
+	else if (FileOpenTextReader(&reader, filename))
 	{
+		int first = sm_len;
 		char *start_pos = reader.pos;
 		const char *line;
 		uint32_t res = 0;
@@ -881,7 +978,7 @@ static void setShadowMask()
 					break;
 				}
 
-				for (int x = 0; x < 16; x++) spi_w(SM_LUT(v2 ? (p[x] & 0x7FF) : (((p[x] & 7) << 8) | 0x2A)));
+				for (int x = 0; x < 16; x++) sm_put(SM_LUT(v2 ? (p[x] & 0x7FF) : (((p[x] & 7) << 8) | 0x2A)));
 				y += 1;
 
 				if (y == h)
@@ -894,13 +991,34 @@ static void setShadowMask()
 
 		if (y == h)
 		{
-			spi_w(SM_HMAX(w - 1));
-			spi_w(SM_VMAX(h - 1));
+			sm_put(SM_HMAX(w - 1));
+			sm_put(SM_VMAX(h - 1));
 		}
+
+		memset(&rec, 0, sizeof(rec));
+		rec.loaded = loaded;
+		rec.len = sm_len - first;
+		memcpy(rec.words, sm_words + first, rec.len * sizeof(rec.words[0]));
+		cd_info_store(filename, tag, &rec, sizeof(rec));
 	}
 
-	if (!loaded) spi_w(SM_FLAG(0));
+	if (!loaded) sm_put(SM_FLAG(0));
+
+	// the mask is re-read on every mode change, only send it when it differs
+	static uint16_t last_words[sizeof(sm_words) / sizeof(sm_words[0])];
+	static int last_len = -1;
+	if (last_len == sm_len && !memcmp(last_words, sm_words, sm_len * sizeof(sm_words[0]))) return;
+
+	has_shadow_mask = 0;
+	if (spi_uio_cmd_cont(UIO_SHADOWMASK))
+	{
+		has_shadow_mask = 1;
+		for (int i = 0; i < sm_len; i++) spi_w(sm_words[i]);
+	}
 	DisableIO();
+
+	memcpy(last_words, sm_words, sm_len * sizeof(sm_words[0]));
+	last_len = sm_len;
 }
 
 int video_get_shadow_mask_mode()
@@ -1095,37 +1213,135 @@ void video_loadPreset(char *name, bool save)
 	}
 }
 
-static void hdmi_config_set_spd(bool val)
+// Shadow copies of the ADV7513 main (0x39) and packet (0x38) register maps.
+// Only registers that differ from the last written value go over I2C, and
+// runs of consecutive registers are sent as one block write.
+struct hdmiRegMap
 {
-	int fd = i2c_open(0x39, 0);
-	if (fd >= 0)
+	uint8_t val[256];
+	uint8_t valid[256];
+};
+
+static hdmiRegMap hdmi_shadow[2];
+
+static hdmiRegMap *hdmi_map(int addr)
+{
+	return &hdmi_shadow[addr & 1];
+}
+
+static void hdmi_invalidate()
+{
+	memset(hdmi_shadow, 0, sizeof(hdmi_shadow));
+}
+
+static int hdmi_changed(int addr, const uint8_t *data, uint size)
+{
+	hdmiRegMap *map = hdmi_map(addr);
+	int n = 0;
+	for (uint i = 0; i < size; i += 2) if (!map->valid[data[i]] || map->val[data[i]] != data[i + 1]) n++;
+	return n;
+}
+
+static int hdmi_read(int addr, uint8_t reg)
+{
+	hdmiRegMap *map = hdmi_map(addr);
+	if (map->valid[reg]) return map->val[reg];
+
+	int fd = i2c_open(addr, 0);
+	if (fd < 0) return -1;
+	int res = i2c_smbus_read_byte_data(fd, reg);
+	i2c_close(fd);
+
+	if (res >= 0)
 	{
-		uint8_t packet_val = i2c_smbus_read_byte_data(fd, 0x40);
-		if (val)
-			packet_val |= 0x40;
-		else
-			packet_val &= ~0x40;
-		int res = i2c_smbus_write_byte_data(fd, 0x40, packet_val);
-		if (res < 0) printf("i2c: write error (%02X %02X): %d\n", 0x40, packet_val, res);
-		i2c_close(fd);
+		map->val[reg] = (uint8_t)res;
+		map->valid[reg] = 1;
 	}
+	return res;
 }
 
-static void hdmi_config_set_spare(int packet, bool enabled)
+// data is address/value pairs, written in table order.
+// Returns the number of registers sent or -1 if the chip isn't there.
+static int hdmi_write(int addr, const uint8_t *data, uint size)
 {
-	int fd = i2c_open(0x39, 0);
-	uint8_t mask = packet == 0 ? 0x01 : 0x02;
-	if (fd >= 0)
+	if (!hdmi_changed(addr, data, size)) return 0;
+
+	int fd = i2c_open(addr, 0);
+	if (fd < 0) return -1;
+
+	hdmiRegMap *map = hdmi_map(addr);
+	int sent = 0;
+	for (uint i = 0; i < size; i += 2)
 	{
-		uint8_t packet_val = i2c_smbus_read_byte_data(fd, 0x40);
-		if (enabled)
-			packet_val |= mask;
-		else
-			packet_val &= ~mask;
-		int res = i2c_smbus_write_byte_data(fd, 0x40, packet_val);
-		if (res < 0) printf("i2c: write error (%02X %02X): %d\n", 0x40, packet_val, res);
-		i2c_close(fd);
+		uint8_t reg = data[i];
+		if (map->valid[reg] && map->val[reg] == data[i + 1]) continue;
+
+		// extend over the following consecutive registers, then drop the unchanged tail
+		uint8_t block[32];
+		uint n = 0, len = 0;
+		while (i + n * 2 < size && n < sizeof(block) && data[i + n * 2] == (uint8_t)(reg + n))
+		{
+			uint8_t r = data[i + n * 2], v = data[i + n * 2 + 1];
+			block[n++] = v;
+			if (!map->valid[r] || map->val[r] != v) len = n;
+		}
+
+		int res = -1;
+		if (len > 1) res = i2c_smbus_write_i2c_block_data(fd, reg, len, block);
+		if (res < 0)
+		{
+			for (uint k = 0; k < len; k++)
+			{
+				res = i2c_smbus_write_byte_data(fd, reg + k, block[k]);
+				if (res < 0) break;
+			}
+		}
+
+		for (uint k = 0; k < len; k++)
+		{
+			map->val[(uint8_t)(reg + k)] = block[k];
+			map->valid[(uint8_t)(reg + k)] = (res >= 0);
+		}
+
+		if (res < 0) printf("i2c: write error (%02X:%02X %d regs): %d\n", addr, reg, len, res);
+		sent += len;
+		i += (len - 1) * 2;
 	}
+
+	i2c_close(fd);
+	return sent;
+}
+
+// InfoFrame/packet contents on the packet map, latched by the update bit of
+// their change register. Nothing is sent if the packet didn't change.
+static void hdmi_write_packet(uint8_t update_reg, const uint8_t *data, uint size)
+{
+	if (!hdmi_changed(0x38, data, size)) return;
+
+	const uint8_t hold[] = { update_reg, 0x80 };
+	const uint8_t release[] = { update_reg, 0x00 };
+	hdmi_write(0x38, hold, sizeof(hold));
+	hdmi_write(0x38, data, size);
+	hdmi_write(0x38, release, sizeof(release));
+}
+
+static void hdmi_config_set_packet_bit(uint8_t mask, bool val)
+{
+	int packet_val = hdmi_read(0x39, 0x40);
+	if (packet_val < 0) return;
+
+	const uint8_t data[] = { 0x40, (uint8_t)(val ? (packet_val | mask) : (packet_val & ~mask)) };
+	hdmi_write(0x39, data, sizeof(data));
+}
+
+static void hdmi_config_set_spd(bool val)
+{
+	hdmi_config_set_packet_bit(0x40, val);
+}
+
+static void hdmi_config_set_spare(int packet, bool enabled)
+{
+	hdmi_config_set_packet_bit(packet == 0 ? 0x01 : 0x02, enabled);
 }
 
 static void hdmi_config_set_csc()
@@ -1345,18 +1561,7 @@ static void hdmi_config_set_csc()
 		0xC3, (uint8_t)(clipMax & 0xff)
 	};
 
-	int fd = i2c_open(0x39, 0);
-	if (fd >= 0)
-	{
-		for (uint i = 0; i < sizeof(csc_data); i += 2)
-		{
-			int res = i2c_smbus_write_byte_data(fd, csc_data[i], csc_data[i + 1]);
-			if (res < 0) printf("i2c: write error (%02X %02X): %d\n", csc_data[i], csc_data[i + 1], res);
-		}
-
-		i2c_close(fd);
-	}
-	else
+	if (hdmi_write(0x39, csc_data, sizeof(csc_data)) < 0)
 	{
 		printf("*** ADV7513 not found on i2c bus! HDMI won't be available!\n");
 	}
@@ -1502,18 +1707,9 @@ static void hdmi_config_init()
 		0x09, 0x0A,				//
 	};
 
-	int fd = i2c_open(0x39, 0);
-	if (fd >= 0)
-	{
-		for (uint i = 0; i < sizeof(init_data); i += 2)
-		{
-			int res = i2c_smbus_write_byte_data(fd, init_data[i], init_data[i + 1]);
-			if (res < 0) printf("i2c: write error (%02X %02X): %d\n", init_data[i], init_data[i + 1], res);
-		}
-
-		i2c_close(fd);
-	}
-	else
+	// full write, the chip may have been reset behind our back
+	hdmi_invalidate();
+	if (hdmi_write(0x39, init_data, sizeof(init_data)) < 0)
 	{
 		printf("*** ADV7513 not found on i2c bus! HDMI won't be available!\n");
 	}
@@ -1587,29 +1783,16 @@ static void hdmi_config_set_hdr()
 	else
 	{
 		hdmi_config_set_spare(1, true);
-		int fd = i2c_open(0x38, 0);
-		int res = i2c_smbus_write_byte_data(fd, 0xFF, 0b10000000);
-		if (res < 0)
-		{
-			printf("i2c: hdr: Couldn't update Spare Packet change register (0xDF, 0x80) %d\n", res);
-		}
-
-		uint8_t addr = 0xe0;
+		uint8_t packet[sizeof(hdr_data) * 2];
 		for (uint i = 0; i < sizeof(hdr_data); i++)
 		{
-			res = i2c_smbus_write_byte_data(fd, addr, hdr_data[i]);
-			if (res < 0) printf("i2c: hdr register write error (%02X %02x): %d\n", addr, hdr_data[i], res);
-			addr += 1;
+			packet[i * 2] = 0xE0 + i;
+			packet[i * 2 + 1] = hdr_data[i];
 		}
-		res = i2c_smbus_write_byte_data(fd, 0xfF, 0x00);
-		if (res < 0) printf("i2c: hdr: Couldn't update Spare Packet change register (0xDF, 0x00), %d\n", res);
+		hdmi_write_packet(0xFF, packet, sizeof(packet));
 	}
 }
 
-static uint8_t last_sync_invert = 0xff;
-static uint8_t last_pr_flags = 0xff;
-static uint8_t last_vic_mode = 0xff;
-
 static void hdmi_config_set_mode(vmode_custom_t *vm)
 {
 	PROFILE_FUNCTION();
@@ -1625,8 +1808,6 @@ static void hdmi_config_set_mode(vmode_custom_t *vm)
 	if (vm->param.hpol == 0) sync_invert |= 1 << 5;
 	if (vm->param.vpol == 0) sync_invert |= 1 << 6;
 
-	if (last_sync_invert == sync_invert && last_pr_flags == pr_flags && last_vic_mode == vic_mode) return;
-
 	// address, value
 	uint8_t init_data[] = {
 		0x17, (uint8_t)(0b00000010 | sync_invert),		// Aspect ratio 16:9 [1]=1, 4:3 [1]=0
@@ -1634,25 +1815,10 @@ static void hdmi_config_set_mode(vmode_custom_t *vm)
 		0x3C, vic_mode,			// VIC
 	};
 
-	int fd = i2c_open(0x39, 0);
-	if (fd >= 0)
-	{
-		for (uint i = 0; i < sizeof(init_data); i += 2)
-		{
-			int res = i2c_smbus_write_byte_data(fd, init_data[i], init_data[i + 1]);
-			if (res < 0) printf("i2c: write error (%02X %02X): %d\n", init_data[i], init_data[i + 1], res);
-		}
-
-		i2c_close(fd);
-	}
-	else
+	if (hdmi_write(0x39, init_data, sizeof(init_data)) < 0)
 	{
 		printf("*** ADV7513 not found on i2c bus! HDMI won't be available!\n");
 	}
-
-	last_pr_flags = pr_flags;
-	last_sync_invert = sync_invert;
-	last_vic_mode = vic_mode;
 }
 
 static void edid_parse_cea_ext(uint8_t *cea)
@@ -1747,6 +1913,34 @@ static int is_edid_valid()
 	return !memcmp(edid, magic, sizeof(magic));
 }
 
+// Last EDID read from the display. Reading it again means forcing the ADV7513
+// to re-fetch it (up to 2s) and 256 single byte I2C reads, while the buffer it
+// already holds tells whether the display is still the same one.
+#define EDID_CACHE "edid.bin"
+
+static int edid_load_cached()
+{
+	static uint8_t cached[sizeof(edid)];
+	if (FileLoadConfig(EDID_CACHE, 0, 0) != sizeof(cached) || !FileLoadConfig(EDID_CACHE, cached, sizeof(cached))) return 0;
+
+	int fd = i2c_open(0x3f, 0);
+	if (fd < 0) return 0;
+
+	// header, vendor/product/serial and the checksums of both blocks
+	static const uint8_t probe[] = { 0x00, 0x01, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x7E, 0x7F, 0xFF };
+	int match = 1;
+	for (uint i = 0; match && i < sizeof(probe); i++) match = i2c_smbus_read_byte_data(fd, probe[i]) == cached[probe[i]];
+	i2c_close(fd);
+
+	if (!match) return 0;
+
+	memcpy(edid, cached, sizeof(edid));
+	if (!is_edid_valid()) return 0;
+
+	printf("EDID: display unchanged, using cached copy.\n");
+	return 1;
+}
+
 static int get_active_edid()
 {
 	int fd = i2c_open(0x39, 0);
@@ -1764,6 +1958,11 @@ static int get_active_edid()
 		return 0;
 	}
 
+	if (edid_load_cached())
+	{
+		i2c_close(fd);
+		return 1;
+	}
 
 	for (int i = 0; i < 10; i++)
 	{
@@ -1795,6 +1994,8 @@ static int get_active_edid()
 		bzero(edid, sizeof(edid));
 		return 0;
 	}
+
+	FileSaveConfig(EDID_CACHE, edid, sizeof(edid));
 	return 1;
 }
 
@@ -2044,54 +2245,26 @@ static void set_vrr_mode()
 		0xCD, (uint8_t)(vrateh_i & 0xFF),
 	};
 
-	int res = 0;
-	int fd = i2c_open(0x38, 0);
-	if (fd >= 0)
+	if (use_vrr == VRR_FREESYNC)
 	{
-		if (use_vrr == VRR_FREESYNC)
-		{
-			hdmi_config_set_spd(1);
-			res = i2c_smbus_write_byte_data(fd, 0x1F, 0b10000000);
-			if (res < 0)
-			{
-				printf("i2c: Vrr: Couldn't update SPD change register (0x1F, 0x80) %d\n", res);
-			}
-			for (uint i = 0; i < sizeof(freesync_data); i += 2)
-			{
-				res = i2c_smbus_write_byte_data(fd, freesync_data[i], freesync_data[i + 1]);
-				if (res < 0) printf("i2c: Vrr register write error (%02X %02x): %d\n", freesync_data[i], freesync_data[i + 1], res);
-			}
-			res = i2c_smbus_write_byte_data(fd, 0x1F, 0x00);
-			if (res < 0) printf("i2c: Vrr: Couldn't update SPD change register (0x1F, 0x00), %d\n", res);
-		}
-		else
-		{
-			hdmi_config_set_spd(0);
-		}
-
-		if (use_vrr == VRR_VESA)
-		{
-			hdmi_config_set_spare(0, true);
-			res = i2c_smbus_write_byte_data(fd, 0xDF, 0b10000000);
-			if (res < 0)
-			{
-				printf("i2c: Vrr: Couldn't update Spare Packet change register (0xDF, 0x80) %d\n", res);
-			}
+		hdmi_config_set_spd(1);
+		hdmi_write_packet(0x1F, freesync_data, sizeof(freesync_data));
+	}
+	else
+	{
+		hdmi_config_set_spd(0);
+	}
 
-			for (uint i = 0; i < sizeof(vesa_data); i += 2)
-			{
-				res = i2c_smbus_write_byte_data(fd, vesa_data[i], vesa_data[i + 1]);
-				if (res < 0) printf("i2c: Vrr register write error (%02X %02x): %d\n", vesa_data[i], vesa_data[i + 1], res);
-			}
-			res = i2c_smbus_write_byte_data(fd, 0xDF, 0x00);
-			if (res < 0) printf("i2c: Vrr: Couldn't update Spare Packet change register (0xDF, 0x00), %d\n", res);
-		}
-		else
-		{
-			hdmi_config_set_spare(0, false);
-		}
-		i2c_close(fd);
+	if (use_vrr == VRR_VESA)
+	{
+		hdmi_config_set_spare(0, true);
+		hdmi_write_packet(0xDF, vesa_data, sizeof(vesa_data));
+	}
+	else
+	{
+		hdmi_config_set_spare(0, false);
 	}
+
 	last_vrr_mode = cfg.vrr_mode;
 	last_vrr_rate = vrateh;
 	last_vrr_vfp = v_cur.param.vfp;
@@ -2407,6 +2580,7 @@ void video_init()
 	yc_parse(yc_modes, sizeof(yc_modes) / sizeof(yc_modes[0]));
 
 	fb_init();
+	video_pll_prefill();
 	hdmi_config_init();
 	hdmi_config_set_hdr();
 	video_mode_load();
@@ -2867,19 +3041,26 @@ void video_mode_adjust()
 	}
 }
 
-static void fb_write_module_params()
+struct fbModeParams
+{
+	int width, height;
+};
+
+static void fb_apply_module_params(const fbModeParams &p)
 {
-	int width = fb_width;
-	int height = fb_height;
-	offload_add_work([=]
+	FILE *fp = fopen("/sys/module/MiSTer_fb/parameters/mode", "wt");
+	if (fp)
 	{
-		FILE *fp = fopen("/sys/module/MiSTer_fb/parameters/mode", "wt");
-		if (fp)
-		{
-			fprintf(fp, "%d %d %d %d %d\n", 8888, 1, width, height, width * 4);
-			fclose(fp);
-		}
-	});
+		fprintf(fp, "%d %d %d %d %d\n", 8888, 1, p.width, p.height, p.width * 4);
+		fclose(fp);
+	}
+}
+
+static offload_latest<fbModeParams> fb_mode_params(fb_apply_module_params);
+
+static void fb_write_module_params()
+{
+	fb_mode_params.set({ fb_width, fb_height });
 }
 
 void video_fb_enable(int enable, int n)
@@ -2953,6 +3134,12 @@ void video_fb_enable(int enable, int n)
 	}
 }
 
+uint32_t video_frame_us()
+{
+	// 100MHz counter
+	return current_video_info.vtime / 100;
+}
+
 int video_fb_state()
 {
 	if (is_menu())
@@ -2968,6 +3155,9 @@ static void video_fb_config()
 {
 	PROFILE_FUNCTION();
 
+	// a background being drawn uses the sizes
+	if (bg_job) offload_wait(bg_job);
+
 	int fb_scale = cfg.fb_size;
 
 	if (fb_scale <= 1)
@@ -2994,40 +3184,58 @@ static void video_fb_config()
 	fb_write_module_params();
 }
 
+// channel mask of the bar colors: 1 = red, 2 = green, 4 = blue
+static uint32_t bar_mask(int base_color)
+{
+	uint32_t mask = 0;
+	if (base_color & 4) mask |= 0x0000FF;
+	if (base_color & 2) mask |= 0x00FF00;
+	if (base_color & 1) mask |= 0xFF0000;
+	return mask;
+}
+
+static uint32_t draw_row[FBDRAW_MAX_W], draw_tbl[2][FBDRAW_MAX_W];
+
+static volatile uint32_t *draw_start()
+{
+	return fb_base + (FB_SIZE*draw_bgn) + brd_y * fb_width + brd_x;
+}
+
 static void draw_checkers()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = draw_start();
+	int width = fb_width - 2 * brd_x;
+	int height = fb_height - 2 * brd_y;
 
 	uint32_t col1 = 0x888888;
 	uint32_t col2 = 0x666666;
 	int sz = fb_width / 128;
 
-	for (int y = brd_y; y < fb_height - brd_y; y++)
+	// the two possible rows
+	for (int x = 0; x < width; x++)
 	{
-		int c1 = (y / sz) & 1;
-		int pos = y * fb_width;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
-		{
-			int c2 = c1 ^ ((x / sz) & 1);
-			buf[pos + x] = c2 ? col2 : col1;
-		}
+		int c2 = ((x + brd_x) / sz) & 1;
+		draw_tbl[0][x] = c2 ? col2 : col1;
+		draw_tbl[1][x] = c2 ? col1 : col2;
 	}
+
+	for (int y = 0; y < height; y++) fbdraw_row(buf + y * fb_width, draw_tbl[((y + brd_y) / sz) & 1], width);
 }
 
 static void draw_hbars1()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = draw_start();
 	int height = fb_height - 2 * brd_y;
+	int width = fb_width - 2 * brd_x;
 
 	int old_base = 0;
 	int gray = 255;
 	int sz = height / 7;
 	int stp = 0;
 
-	for (int y = brd_y; y < fb_height - brd_y; y++)
+	for (int y = 0; y < height; y++)
 	{
-		int pos = y * fb_width;
-		int base_color = ((7 * (y-brd_y)) / height) + 1;
+		int base_color = ((7 * y) / height) + 1;
 		if (old_base != base_color)
 		{
 			stp = sz;
@@ -3035,15 +3243,7 @@ static void draw_hbars1()
 		}
 
 		gray = 255 * stp / sz;
-
-		for (int x = brd_x; x < fb_width - brd_x; x++)
-		{
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
-		}
+		fbdraw_fill(buf + y * fb_width, fb_width, width, 1, (gray * 0x010101) & bar_mask(base_color));
 
 		stp--;
 		if (stp < 0) stp = 0;
@@ -3052,124 +3252,109 @@ static void draw_hbars1()
 
 static void draw_hbars2()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = draw_start();
 	int height = fb_height - 2 * brd_y;
 	int width = fb_width - 2 * brd_x;
 
-	for (int y = brd_y; y < fb_height - brd_y; y++)
+	fbdraw_gray_ramp(draw_tbl[0], width);
+
+	for (int y = 0; y < height; y++)
 	{
-		int pos = y * fb_width;
-		int base_color = ((14 * (y - brd_y)) / height);
+		int base_color = ((14 * y) / height);
 		int inv = base_color & 1;
 		base_color >>= 1;
 		base_color = (inv ? base_color : 6 - base_color) + 1;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
-		{
-			int gray = (256 * (x - brd_x)) / width;
-			if (inv) gray = 255 - gray;
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
-		}
+
+		fbdraw_ramp(draw_row, draw_tbl[0], inv ? 0xFFFFFF : 0, bar_mask(base_color), width);
+		fbdraw_row(buf + y * fb_width, draw_row, width);
 	}
 }
 
 static void draw_vbars1()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = draw_start();
+	int height = fb_height - 2 * brd_y;
 	int width = fb_width - 2 * brd_x;
 
 	int sz = width / 7;
 	int stp = 0;
+	int old_base = 0;
+	int gray = 255;
 
-	for (int y = brd_y; y < fb_height - brd_y; y++)
+	// all rows are the same
+	for (int x = 0; x < width; x++)
 	{
-		int pos = y * fb_width;
-		int old_base = 0;
-		int gray = 255;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
+		int base_color = ((7 * x) / width) + 1;
+		if (old_base != base_color)
 		{
-			int base_color = ((7 * (x - brd_x)) / width) + 1;
-			if (old_base != base_color)
-			{
-				stp = sz;
-				old_base = base_color;
-			}
-
-			gray = 255 * stp / sz;
+			stp = sz;
+			old_base = base_color;
+		}
 
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
+		gray = 255 * stp / sz;
+		draw_row[x] = (gray * 0x010101) & bar_mask(base_color);
 
-			stp--;
-			if (stp < 0) stp = 0;
-		}
+		stp--;
+		if (stp < 0) stp = 0;
 	}
+
+	for (int y = 0; y < height; y++) fbdraw_row(buf + y * fb_width, draw_row, width);
 }
 
 static void draw_vbars2()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = draw_start();
 	int height = fb_height - 2 * brd_y;
 	int width = fb_width - 2 * brd_x;
 
-	for (int y = brd_y; y < fb_height - brd_y; y++)
+	// per column inversion and channels
+	for (int x = 0; x < width; x++)
 	{
-		int pos = y * fb_width;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
-		{
-			int gray = ((256 * (y - brd_y)) / height);
-			int base_color = ((14 * (x - brd_x)) / width);
-			int inv = base_color & 1;
-			base_color >>= 1;
-			base_color = (inv ? base_color : 6 - base_color) + 1;
+		int base_color = ((14 * x) / width);
+		int inv = base_color & 1;
+		base_color >>= 1;
+		base_color = (inv ? base_color : 6 - base_color) + 1;
 
-			if (inv) gray = 255 - gray;
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
-		}
+		draw_tbl[0][x] = inv ? 0xFFFFFF : 0;
+		draw_tbl[1][x] = bar_mask(base_color);
+	}
+
+	for (int y = 0; y < height; y++)
+	{
+		int gray = ((256 * y) / height);
+		fbdraw_columns(draw_row, gray * 0x010101, draw_tbl[0], draw_tbl[1], width);
+		fbdraw_row(buf + y * fb_width, draw_row, width);
 	}
 }
 
 static void draw_spectrum()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = draw_start();
 	int height = fb_height - 2 * brd_y;
 	int width = fb_width - 2 * brd_x;
 
-	for (int y = brd_y; y < fb_height - brd_y; y++)
+	uint32_t *ramp = draw_tbl[0];
+	for (int x = 0; x < width; x++) ramp[x] = (256 * x) / width;
+
+	for (int y = 0; y < height; y++)
 	{
-		int pos = y * fb_width;
-		int blue = ((256 * (y - brd_y)) / height);
-		for (int x = brd_x; x < fb_width - brd_x; x++)
+		int blue = ((256 * y) / height);
+		for (int x = 0; x < width; x++)
 		{
-			int green = ((256 * (x - brd_x)) / width) - blue / 2;
+			int green = (int)ramp[x] - blue / 2;
 			int red = 255 - green - blue / 2;
 			if (red < 0) red = 0;
 			if (green < 0) green = 0;
 
-			buf[pos + x] = (red << 16) | (green << 8) | blue;
+			draw_row[x] = (red << 16) | (green << 8) | blue;
 		}
+		fbdraw_row(buf + y * fb_width, draw_row, width);
 	}
 }
 
 static void draw_black()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
-
-	for (int y = 0; y < fb_height; y++)
-	{
-		int pos = y * fb_width;
-		for (int x = 0; x < fb_width; x++) buf[pos++] = 0;
-	}
+	fbdraw_fill(fb_base + (FB_SIZE*draw_bgn), fb_width, fb_width, fb_height, 0);
 }
 
 static uint64_t getus()
@@ -3199,40 +3384,46 @@ static void vs_wait()
 	printf("vs_wait(us): %llu\n", t2 - t1);
 }
 
-static char *get_file_fromdir(const char* dir, int num, int *count)
+// Wallpapers of a directory, listed in one pass and kept while its mtime doesn't change.
+static const char *get_file_fromdir(const char* dir, uint32_t rnd)
 {
-	static char name[256+32];
-	name[0] = 0;
-	if(count) *count = 0;
-	DIR *d = opendir(getFullPath(dir));
-	if (d)
+	static char list_dir[128] = {};
+	static time_t list_mtime = 0;
+	static std::vector<std::string> list;
+
+	struct stat st;
+	const char *path = getFullPath(dir);
+	if (stat(path, &st)) return nullptr;
+
+	if (strcmp(list_dir, dir) || list_mtime != st.st_mtime)
 	{
-		int cnt = 0;
-		struct dirent *de = readdir(d);
-		while (de)
+		list.clear();
+		DIR *d = opendir(path);
+		if (d)
 		{
-			int len = strlen(de->d_name);
-			if (len > 4 && (!strcasecmp(de->d_name + len - 4, ".png") || !strcasecmp(de->d_name + len - 4, ".jpg")))
+			struct dirent *de;
+			while ((de = readdir(d)))
 			{
-				if (num == cnt) break;
-				cnt++;
+				int len = strlen(de->d_name);
+				if (len > 4 && (!strcasecmp(de->d_name + len - 4, ".png") || !strcasecmp(de->d_name + len - 4, ".jpg")))
+				{
+					list.push_back(de->d_name);
+				}
 			}
-
-			de = readdir(d);
+			closedir(d);
 		}
-
-		if (de)
-		{
-			snprintf(name, sizeof(name), "%s/%s", dir, de->d_name);
-		}
-		closedir(d);
-		if(count) *count = cnt;
+		snprintf(list_dir, sizeof(list_dir), "%s", dir);
+		list_mtime = st.st_mtime;
 	}
 
+	if (list.empty()) return nullptr;
+
+	static char name[256+32];
+	snprintf(name, sizeof(name), "%s/%s", dir, list[rnd % list.size()].c_str());
 	return name;
 }
 
-static Imlib_Image load_bg()
+static const char *pick_bg()
 {
 	const char* fname = "menu.png";
 	if (!FileExists(fname))
@@ -3264,239 +3455,512 @@ static Imlib_Image load_bg()
 				read(rndfd, &rnd, sizeof(rnd));
 				close(rndfd);
 
-				int count = 0;
-				get_file_fromdir(bgdir, -1, &count);
-				if (count > 0) fname = get_file_fromdir(bgdir, rnd % count, &count);
+				fname = get_file_fromdir(bgdir, rnd);
 			}
 		}
 	}
 
-	if (fname)
+	return fname;
+}
+
+// The wallpaper ready to be copied into the framebuffer: decoded, scaled to
+// the picture area and blended over black. Decoding a big JPG takes a good
+// part of a second, so the result is also kept in BG_CACHE_DIR (tmpfs), which
+// survives the restart at every core load. Entries are keyed by source path,
+// size, mtime and the target size.
+#define BG_CACHE_DIR   "/tmp/MiSTer_bg"
+#define BG_CACHE_MAX   4
+#define BG_CACHE_MAGIC 0x31474B42 // BKG1
+
+struct bgCacheHdr
+{
+	uint32_t magic;
+	uint32_t width, height;
+	uint32_t src_size;
+	int64_t  src_mtime;
+	char     src[256];
+};
+
+static uint32_t *bg_pixels = nullptr;
+static bgCacheHdr bg_hdr = {};
+
+// keeps the newest BG_CACHE_MAX entries
+static void bg_cache_trim()
+{
+	DIR *d = opendir(BG_CACHE_DIR);
+	if (!d) return;
+
+	std::vector<std::pair<time_t, std::string>> files;
+	struct dirent *de;
+	while ((de = readdir(d)))
 	{
-		Imlib_Load_Error error = IMLIB_LOAD_ERROR_NONE;
-		Imlib_Image img = imlib_load_image_with_error_return(getFullPath(fname), &error);
-		if (img) return img;
-		printf("Image %s loading error %d\n", fname, error);
+		if (de->d_name[0] == '.') continue;
+		std::string name = std::string(BG_CACHE_DIR "/") + de->d_name;
+		struct stat st;
+		if (!stat(name.c_str(), &st)) files.push_back({ st.st_mtime, name });
 	}
+	closedir(d);
 
-	return NULL;
+	if (files.size() <= BG_CACHE_MAX) return;
+	std::sort(files.begin(), files.end());
+	for (size_t i = 0; i < files.size() - BG_CACHE_MAX; i++) unlink(files[i].second.c_str());
 }
 
-static int bg_has_picture = 0;
-extern uint8_t  _binary_logo_png_start[], _binary_logo_png_end[];
-void video_menu_bg(int n, int idle)
+static void bg_cache_store(const bgCacheHdr *hdr, const uint32_t *pixels, const char *name)
 {
-	bg_has_picture = 0;
-	menu_bg = n;
-	if (n)
+	size_t size = hdr->width * hdr->height * 4;
+	uint8_t *buf = (uint8_t *)malloc(sizeof(*hdr) + size);
+	char *path = strdup(name);
+	if (!buf || !path)
 	{
-		//printf("**** BG DEBUG START ****\n");
-		//printf("n = %d\n", n);
+		free(buf);
+		free(path);
+		return;
+	}
 
-		Imlib_Load_Error error;
-		static Imlib_Image logo = 0;
-		if (!logo)
+	memcpy(buf, hdr, sizeof(*hdr));
+	memcpy(buf + sizeof(*hdr), pixels, size);
+
+	offload_add_work([buf, path, size]
+	{
+		mkdir(BG_CACHE_DIR, 0755);
+
+		char tmp[300];
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd >= 0)
 		{
-			unlink("/tmp/logo.png");
-			if (FileSave("/tmp/logo.png", _binary_logo_png_start, _binary_logo_png_end - _binary_logo_png_start))
-			{
-				while(1)
-				{
-					error = IMLIB_LOAD_ERROR_NONE;
-					if ((logo = imlib_load_image_with_error_return("/tmp/logo.png", &error))) break;
-					else
-					{
-						if (error != IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT)
-						{
-							printf("logo.png error = %d\n", error);
-							break;
-						}
-					}
-					vs_wait();
-				};
+			int ok = (write(fd, buf, sizeof(bgCacheHdr) + size) == (ssize_t)(sizeof(bgCacheHdr) + size));
+			close(fd);
+			if (ok) rename(tmp, path);
+			else unlink(tmp);
+		}
 
-				if (cfg.osd_rotate)
-				{
-					imlib_context_set_image(logo);
-					imlib_image_orientate(cfg.osd_rotate == 1 ? 3 : 1);
-				}
-			}
-			else
+		bg_cache_trim();
+		free(buf);
+		free(path);
+	}, OFFLOAD_PRIO_BULK);
+}
+
+// Imlib2 isn't thread safe. Everything calling it holds this, the box art
+// of the file browser is decoded on a worker.
+static pthread_mutex_t imlib_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t *video_decode_art(const char *path, int *w, int *h)
+{
+	uint32_t *pixels = nullptr;
+	pthread_mutex_lock(&imlib_mutex);
+
+	Imlib_Image img = imlib_load_image(path);
+	if (img)
+	{
+		imlib_context_set_image(img);
+		int src_w = imlib_image_get_width();
+		int src_h = imlib_image_get_height();
+
+		// fit into the art box, keeping the aspect
+		int dst_w = VIDEO_ART_MAX;
+		int dst_h = src_h * VIDEO_ART_MAX / src_w;
+		if (dst_h > VIDEO_ART_MAX)
+		{
+			dst_h = VIDEO_ART_MAX;
+			dst_w = src_w * VIDEO_ART_MAX / src_h;
+		}
+
+		Imlib_Image dst = (dst_w > 0 && dst_h > 0) ? imlib_create_image(dst_w, dst_h) : nullptr;
+		if (dst)
+		{
+			imlib_context_set_image(dst);
+			memset(imlib_image_get_data(), 0, dst_w * dst_h * 4);
+			imlib_blend_image_onto_image(img, 0, 0, 0, src_w, src_h, 0, 0, dst_w, dst_h);
+
+			pixels = (uint32_t *)malloc(dst_w * dst_h * 4);
+			if (pixels)
 			{
-				printf("Fail to save to /tmp/logo.png\n");
+				memcpy(pixels, imlib_image_get_data_for_reading_only(), dst_w * dst_h * 4);
+				*w = dst_w;
+				*h = dst_h;
 			}
-			unlink("/tmp/logo.png");
-			printf("Logo = %p\n", logo);
+			imlib_free_image();
 		}
 
-		menu_bgn = (menu_bgn == 1) ? 2 : 1;
+		imlib_context_set_image(img);
+		imlib_free_image();
+	}
+
+	pthread_mutex_unlock(&imlib_mutex);
+	return pixels;
+}
+
+static const uint32_t *load_bg(int width, int height)
+{
+	static const char *fname = pick_bg();
+	if (!fname || width <= 0 || height <= 0) return nullptr;
+
+	struct stat st;
+	if (stat(getFullPath(fname), &st)) return nullptr;
+
+	bgCacheHdr hdr = {};
+	hdr.magic = BG_CACHE_MAGIC;
+	hdr.width = width;
+	hdr.height = height;
+	hdr.src_size = st.st_size;
+	hdr.src_mtime = st.st_mtime;
+	snprintf(hdr.src, sizeof(hdr.src), "%s", fname);
+
+	if (bg_pixels && !memcmp(&hdr, &bg_hdr, sizeof(hdr))) return bg_pixels;
 
-		static Imlib_Image menubg = 0;
-		static Imlib_Image bg1 = 0, bg2 = 0;
-		if (!bg1) bg1 = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 1)));
-		if (!bg1) printf("Warning: bg1 is 0\n");
-		if (!bg2) bg2 = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 2)));
-		if (!bg2) printf("Warning: bg2 is 0\n");
+	free(bg_pixels);
+	bg_pixels = nullptr;
+	size_t size = width * height * 4;
 
-		Imlib_Image *bg = (menu_bgn == 1) ? &bg1 : &bg2;
-		//printf("*bg = %p\n", *bg);
+	char name[64];
+	uint32_t hash = str_hash(hdr.src) ^ (hdr.src_size * 0x9E3779B1) ^ (uint32_t)hdr.src_mtime;
+	snprintf(name, sizeof(name), BG_CACHE_DIR "/%08X_%dx%d.bg", hash, width, height);
 
-		static Imlib_Image curtain = 0;
-		if (!curtain)
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		bgCacheHdr fhdr;
+		uint32_t *pixels = (uint32_t *)malloc(size);
+		if (pixels && read(fd, &fhdr, sizeof(fhdr)) == sizeof(fhdr) && !memcmp(&fhdr, &hdr, sizeof(hdr)) && read(fd, pixels, size) == (ssize_t)size)
 		{
-			curtain = imlib_create_image(fb_width, fb_height);
-			imlib_context_set_image(curtain);
-			imlib_image_set_has_alpha(1);
+			bg_pixels = pixels;
+		}
+		else free(pixels);
+		close(fd);
+	}
+
+	if (!bg_pixels)
+	{
+		Imlib_Load_Error error = IMLIB_LOAD_ERROR_NONE;
+		Imlib_Image img = imlib_load_image_with_error_return(getFullPath(fname), &error);
+		if (!img)
+		{
+			printf("Image %s loading error %d\n", fname, error);
+			return nullptr;
+		}
+
+		imlib_context_set_image(img);
+		int src_w = imlib_image_get_width();
+		int src_h = imlib_image_get_height();
 
+		Imlib_Image dst = imlib_create_image(width, height);
+		if (dst)
+		{
+			imlib_context_set_image(dst);
 			uint32_t *data = imlib_image_get_data();
-			int sz = fb_width * fb_height;
-			for (int i = 0; i < sz; i++)
-			{
-				*data++ = 0x9F000000;
-			}
+			memset(data, 0, size);
+			imlib_blend_image_onto_image(img, 0, 0, 0, src_w, src_h, 0, 0, width, height);
+
+			bg_pixels = (uint32_t *)malloc(size);
+			if (bg_pixels) memcpy(bg_pixels, imlib_image_get_data_for_reading_only(), size);
+			imlib_free_image();
 		}
 
-		draw_black();
+		imlib_context_set_image(img);
+		imlib_free_image();
+
+		if (bg_pixels) bg_cache_store(&hdr, bg_pixels, name);
+	}
+
+	if (bg_pixels) bg_hdr = hdr;
+	return bg_pixels;
+}
 
-		if (idle < 3)
+// box art, drawn over the background right of the OSD
+static const uint32_t *art_px = nullptr;
+static uint32_t art_under[VIDEO_ART_MAX * VIDEO_ART_MAX];
+static int art_x, art_y, art_w = 0, art_h;
+
+static int bg_has_picture = 0;
+extern uint8_t  _binary_logo_png_start[], _binary_logo_png_end[];
+// Backgrounds are drawn on the bulk worker into the fb page not shown (1 or
+// 2), the OSD keeps running meanwhile, and shown by one flip of the base
+// address once done (video_menu_bg_poll). A request arriving during a draw
+// waits for it, only the latest one is kept.
+static int draw_picture = 0; // bg_has_picture of draw_bgn
+static int bg_next = 0, bg_next_idle = 0;
+
+static void menu_bg_draw(int n, int idle)
+{
+	pthread_mutex_lock(&imlib_mutex);
+	draw_picture = 0;
+	//printf("**** BG DEBUG START ****\n");
+	//printf("n = %d\n", n);
+
+	Imlib_Load_Error error;
+	static Imlib_Image logo = 0;
+	if (!logo)
+	{
+		unlink("/tmp/logo.png");
+		if (FileSave("/tmp/logo.png", _binary_logo_png_start, _binary_logo_png_end - _binary_logo_png_start))
 		{
-			switch (n)
+			while(1)
 			{
-			case 1:
-				if (!menubg) menubg = load_bg();
-				if (menubg)
+				error = IMLIB_LOAD_ERROR_NONE;
+				if ((logo = imlib_load_image_with_error_return("/tmp/logo.png", &error))) break;
+				else
 				{
-					imlib_context_set_image(menubg);
-					int src_w = imlib_image_get_width();
-					int src_h = imlib_image_get_height();
-					//printf("menubg: src_w=%d, src_h=%d\n", src_w, src_h);
-
-					if (*bg)
+					if (error != IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT)
 					{
-						imlib_context_set_image(*bg);
-						imlib_blend_image_onto_image(menubg, 0,
-							0, 0,                           //int source_x, int source_y,
-							src_w, src_h,                   //int source_width, int source_height,
-							brd_x, brd_y,                   //int destination_x, int destination_y,
-							fb_width - (brd_x * 2), fb_height - (brd_y * 2) //int destination_width, int destination_height
-						);
-						bg_has_picture = 1;
+						printf("logo.png error = %d\n", error);
 						break;
 					}
-					else
-					{
-						printf("*bg = 0!\n");
-					}
 				}
-				draw_checkers();
-				break;
-			case 2:
-				draw_hbars1();
-				break;
-			case 3:
-				draw_hbars2();
-				break;
-			case 4:
-				draw_vbars1();
-				break;
-			case 5:
-				draw_vbars2();
-				break;
-			case 6:
-				draw_spectrum();
-				break;
-			case 7:
-				draw_black();
-				break;
+				vs_wait();
+			};
+
+			if (cfg.osd_rotate)
+			{
+				imlib_context_set_image(logo);
+				imlib_image_orientate(cfg.osd_rotate == 1 ? 3 : 1);
 			}
 		}
-
-		if (cfg.logo && logo && !idle)
+		else
 		{
-			imlib_context_set_image(logo);
+			printf("Fail to save to /tmp/logo.png\n");
+		}
+		unlink("/tmp/logo.png");
+		printf("Logo = %p\n", logo);
+	}
 
-			int src_w = imlib_image_get_width();
-			int src_h = imlib_image_get_height();
+	static Imlib_Image bg1 = 0, bg2 = 0;
+	if (!bg1) bg1 = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 1)));
+	if (!bg1) printf("Warning: bg1 is 0\n");
+	if (!bg2) bg2 = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 2)));
+	if (!bg2) printf("Warning: bg2 is 0\n");
 
-			printf("logo: src_w=%d, src_h=%d\n", src_w, src_h);
+	Imlib_Image *bg = (draw_bgn == 1) ? &bg1 : &bg2;
+	//printf("*bg = %p\n", *bg);
 
-			int width = fb_width - (brd_x * 2);
-			int height = fb_height - (brd_y * 2);
+	static Imlib_Image curtain = 0;
+	if (!curtain)
+	{
+		curtain = imlib_create_image(fb_width, fb_height);
+		imlib_context_set_image(curtain);
+		imlib_image_set_has_alpha(1);
 
-			int dst_w, dst_h;
-			int dst_x, dst_y;
-			if (cfg.osd_rotate)
+		uint32_t *data = imlib_image_get_data();
+		int sz = fb_width * fb_height;
+		for (int i = 0; i < sz; i++)
+		{
+			*data++ = 0x9F000000;
+		}
+	}
+
+	draw_black();
+
+	if (idle < 3)
+	{
+		switch (n)
+		{
+		case 1:
+			if (*bg)
 			{
-				dst_h = height / 2;
-				dst_w = src_w * dst_h / src_h;
-				if (cfg.osd_rotate == 1)
-				{
-					dst_x = brd_x;
-					dst_y = height - dst_h;
-				}
-				else
+				int width = fb_width - (brd_x * 2);
+				int height = fb_height - (brd_y * 2);
+				const uint32_t *pixels = load_bg(width, height);
+				if (pixels)
 				{
-					dst_x = width - dst_w;
-					dst_y = brd_y;
+					volatile uint32_t *buf = fb_base + (FB_SIZE * draw_bgn) + brd_y * fb_width + brd_x;
+					for (int y = 0; y < height; y++) memcpy((void *)(buf + y * fb_width), pixels + y * width, width * 4);
+					draw_picture = 1;
+					break;
 				}
 			}
 			else
 			{
-				dst_x = brd_x;
-				dst_y = brd_y;
-				dst_w = width * 2 / 7;
-				dst_h = src_h * dst_w / src_w;
+				printf("*bg = 0!\n");
 			}
+			draw_checkers();
+			break;
+		case 2:
+			draw_hbars1();
+			break;
+		case 3:
+			draw_hbars2();
+			break;
+		case 4:
+			draw_vbars1();
+			break;
+		case 5:
+			draw_vbars2();
+			break;
+		case 6:
+			draw_spectrum();
+			break;
+		case 7:
+			draw_black();
+			break;
+		}
+	}
 
-			if (*bg)
+	if (cfg.logo && logo && !idle)
+	{
+		imlib_context_set_image(logo);
+
+		int src_w = imlib_image_get_width();
+		int src_h = imlib_image_get_height();
+
+		printf("logo: src_w=%d, src_h=%d\n", src_w, src_h);
+
+		int width = fb_width - (brd_x * 2);
+		int height = fb_height - (brd_y * 2);
+
+		int dst_w, dst_h;
+		int dst_x, dst_y;
+		if (cfg.osd_rotate)
+		{
+			dst_h = height / 2;
+			dst_w = src_w * dst_h / src_h;
+			if (cfg.osd_rotate == 1)
 			{
-				if (cfg.direct_video && (v_cur.item[5] < 300)) dst_h /= 2;
-
-				imlib_context_set_image(*bg);
-				imlib_blend_image_onto_image(logo, 1,
-					0, 0,         //int source_x, int source_y,
-					src_w, src_h, //int source_width, int source_height,
-					dst_x, dst_y, //int destination_x, int destination_y,
-					dst_w, dst_h  //int destination_width, int destination_height
-				);
+				dst_x = brd_x;
+				dst_y = height - dst_h;
 			}
 			else
 			{
-				printf("*bg = 0!\n");
+				dst_x = width - dst_w;
+				dst_y = brd_y;
 			}
 		}
+		else
+		{
+			dst_x = brd_x;
+			dst_y = brd_y;
+			dst_w = width * 2 / 7;
+			dst_h = src_h * dst_w / src_w;
+		}
 
-		if (curtain)
+		if (*bg)
 		{
-			if (idle > 1 && *bg)
-			{
-				imlib_context_set_image(*bg);
-				imlib_blend_image_onto_image(curtain, 1,
-					0, 0,                //int source_x, int source_y,
-					fb_width, fb_height, //int source_width, int source_height,
-					0, 0,                //int destination_x, int destination_y,
-					fb_width, fb_height  //int destination_width, int destination_height
-				);
-			}
+			if (cfg.direct_video && (v_cur.item[5] < 300)) dst_h /= 2;
+
+			imlib_context_set_image(*bg);
+			imlib_blend_image_onto_image(logo, 1,
+				0, 0,         //int source_x, int source_y,
+				src_w, src_h, //int source_width, int source_height,
+				dst_x, dst_y, //int destination_x, int destination_y,
+				dst_w, dst_h  //int destination_width, int destination_height
+			);
 		}
 		else
 		{
-			printf("curtain = 0!\n");
+			printf("*bg = 0!\n");
+		}
+	}
+
+	if (curtain)
+	{
+		if (idle > 1 && *bg)
+		{
+			imlib_context_set_image(*bg);
+			imlib_blend_image_onto_image(curtain, 1,
+				0, 0,                //int source_x, int source_y,
+				fb_width, fb_height, //int source_width, int source_height,
+				0, 0,                //int destination_x, int destination_y,
+				fb_width, fb_height  //int destination_width, int destination_height
+			);
 		}
+	}
+	else
+	{
+		printf("curtain = 0!\n");
+	}
+
+	//test the fb driver
+	//vs_wait();
+	//printf("**** BG DEBUG END ****\n");
+
+	pthread_mutex_unlock(&imlib_mutex);
+}
+
+static void menu_bg_start(int n, int idle)
+{
+	draw_bgn = (menu_bgn == 1) ? 2 : 1;
+	bg_job = offload_add_work([n, idle] { menu_bg_draw(n, idle); }, OFFLOAD_PRIO_BULK);
+}
 
-		//test the fb driver
-		//vs_wait();
-		//printf("**** BG DEBUG END ****\n");
+void video_menu_bg(int n, int idle)
+{
+	menu_bg = n;
+	bg_next = 0;
+	if (n)
+	{
+		if (bg_job)
+		{
+			bg_next = n;
+			bg_next_idle = idle;
+		}
+		else menu_bg_start(n, idle);
+		return;
 	}
 
+	art_px = nullptr;
+	art_w = 0;
+	bg_has_picture = 0;
 	video_fb_enable(0);
 }
 
+void video_menu_bg_poll()
+{
+	if (!bg_job || !offload_is_done(bg_job)) return;
+	bg_job = 0;
+
+	if (menu_bg)
+	{
+		// the box art was on the other page
+		menu_bgn = draw_bgn;
+		bg_has_picture = draw_picture;
+		art_px = nullptr;
+		art_w = 0;
+		video_fb_enable(0);
+	}
+
+	if (bg_next)
+	{
+		int n = bg_next;
+		bg_next = 0;
+		menu_bg_start(n, bg_next_idle);
+	}
+}
+
+
 int video_bg_has_picture()
 {
 	return bg_has_picture;
 }
 
+void video_menu_art(const uint32_t *pixels, int w, int h)
+{
+	if (!fb_base || !menu_bg || cfg.osd_rotate) pixels = nullptr;
+	if (pixels == art_px) return;
+
+	// put back what the previous one covered
+	volatile uint32_t *buf = fb_base + (FB_SIZE * menu_bgn);
+	for (int y = 0; y < art_h && art_w; y++) fbdraw_row(buf + (art_y + y) * fb_width + art_x, art_under + y * art_w, art_w);
+
+	art_px = pixels;
+	art_w = 0;
+	if (!pixels || w > VIDEO_ART_MAX || h > VIDEO_ART_MAX) return;
+
+	int width = fb_width - (brd_x * 2);
+	int height = fb_height - (brd_y * 2);
+	if (w + 16 > width / 3 || h > height) return;
+
+	art_x = fb_width - brd_x - w - 16;
+	art_y = brd_y + (height - h) / 2;
+	art_w = w;
+	art_h = h;
+
+	for (int y = 0; y < h; y++)
+	{
+		memcpy(art_under + y * w, (void *)(buf + (art_y + y) * fb_width + art_x), w * 4);
+		fbdraw_row(buf + (art_y + y) * fb_width + art_x, pixels + y * w, w);
+	}
+}
+
 int video_chvt(int num)
 {
 	static int cur_vt = 0;
@@ -3674,10 +4138,41 @@ static int determine_vsync(int w, int h)
     return 10;
 }
 
+// CVT results of recent requests, vsync_adjust recalculates the same
+// resolution whenever the core refresh rate moves.
+#define CVT_MEMO_SIZE 16
+
+struct cvtMemo
+{
+	int h_pixels, v_lines;
+	float refresh_rate;
+	bool reduced_blanking;
+	uint32_t item[9];
+	uint32_t pr;
+	double Fpix;
+};
+
+static cvtMemo cvt_memo[CVT_MEMO_SIZE];
+static int cvt_memo_count = 0, cvt_memo_next = 0;
+
 static void video_calculate_cvt_int(int h_pixels, int v_lines, float refresh_rate, bool reduced_blanking, vmode_custom_t *vmode)
 {
 	// Based on xfree86 cvt.c and https://tomverbeure.github.io/video_timings_calculator
 
+	for (int i = 0; i < cvt_memo_count; i++)
+	{
+		cvtMemo *m = &cvt_memo[i];
+		if (m->h_pixels == h_pixels && m->v_lines == v_lines && m->refresh_rate == refresh_rate && m->reduced_blanking == reduced_blanking)
+		{
+			memcpy(vmode->item, m->item, sizeof(m->item));
+			vmode->param.rb = reduced_blanking ? 1 : 0;
+			vmode->param.pr = m->pr;
+			vmode->Fpix = m->Fpix;
+			printf("Calculated %dx%d@%0.1fhz %s timings (cached)\n", h_pixels, v_lines, refresh_rate, reduced_blanking ? "CVT-RB" : "CVT");
+			return;
+		}
+	}
+
 	const float CLOCK_STEP = 0.25f;
 	const int MIN_V_BPORCH = 6;
 	const int V_FRONT_PORCH = 3;
@@ -3786,6 +4281,18 @@ static void video_calculate_cvt_int(int h_pixels, int v_lines, float refresh_rat
 		(int)(pixel_freq * 1000.0f),
 		reduced_blanking ? "cvtrb" : "cvt",
 		vmode->param.pr ? ",pr" : "");
+
+	cvtMemo *m = &cvt_memo[cvt_memo_next];
+	cvt_memo_next = (cvt_memo_next + 1) % CVT_MEMO_SIZE;
+	if (cvt_memo_count < CVT_MEMO_SIZE) cvt_memo_count++;
+
+	m->h_pixels = h_pixels;
+	m->v_lines = v_lines;
+	m->refresh_rate = refresh_rate;
+	m->reduced_blanking = reduced_blanking;
+	memcpy(m->item, vmode->item, sizeof(m->item));
+	m->pr = vmode->param.pr;
+	m->Fpix = vmode->Fpix;
 }
 
 static void video_calculate_cvt(int h_pixels, int v_lines, float refresh_rate, int reduced_blanking, vmode_custom_t *vmode)
@@ -53,7 +53,15 @@ int   hasAPI1_5();
 void video_fb_enable(int enable, int n = 0);
 int video_fb_state();
 void video_menu_bg(int n, int idle = 0);
+void video_menu_bg_poll(); // shows the background drawn meanwhile, main loop
 int video_bg_has_picture();
+
+// Box art of the file browser. video_decode_art() loads and scales an image
+// to fit VIDEO_ART_MAX square and may be called from any thread,
+// video_menu_art() shows it on the menu background, null removes it.
+#define VIDEO_ART_MAX 256
+uint32_t *video_decode_art(const char *path, int *w, int *h);
+void video_menu_art(const uint32_t *pixels, int w, int h);
 int video_chvt(int num);
 void video_cmd(char *cmd);
 
@@ -61,4 +69,7 @@ void video_core_description(char *str, size_t len);
 void video_scaler_description(char *str, size_t len);
 char* video_get_core_mode_name(int with_vrefresh = 1);
 
+// frame period of the core in microseconds, 0 if it's not known
+uint32_t video_frame_us();
+
 #endif // VIDEO_H